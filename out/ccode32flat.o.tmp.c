@@ -0,0 +1,90 @@
+#include "src/misc.c"
+ #include "src/stacks.c"
+ #include "src/output.c"
+ #include "src/string.c"
+ #include "src/block.c"
+ #include "src/cdrom.c"
+ #include "src/disk.c"
+ #include "src/mouse.c"
+ #include "src/kbd.c"
+ #include "src/system.c"
+ #include "src/serial.c"
+ #include "src/sercon.c"
+ #include "src/clock.c"
+ #include "src/resume.c"
+ #include "src/pnpbios.c"
+ #include "src/vgahooks.c"
+ #include "src/pcibios.c"
+ #include "src/apm.c"
+ #include "src/cp437.c"
+ #include "src/hw/pci.c"
+ #include "src/hw/timer.c"
+ #include "src/hw/rtc.c"
+ #include "src/hw/dma.c"
+ #include "src/hw/pic.c"
+ #include "src/hw/ps2port.c"
+ #include "src/hw/serialio.c"
+ #include "src/hw/usb.c"
+ #include "src/hw/usb-uhci.c"
+ #include "src/hw/usb-ohci.c"
+ #include "src/hw/usb-ehci.c"
+ #include "src/hw/usb-xhci.c"
+ #include "src/hw/usb-hid.c"
+ #include "src/hw/usb-msc.c"
+ #include "src/hw/usb-uas.c"
+ #include "src/hw/blockcmd.c"
+ #include "src/hw/floppy.c"
+ #include "src/hw/ata.c"
+ #include "src/hw/ramdisk.c"
+ #include "src/hw/lsi-scsi.c"
+ #include "src/hw/esp-scsi.c"
+ #include "src/hw/megasas.c"
+ #include "src/hw/mpt-scsi.c"
+ #include "src/post.c"
+ #include "src/e820map.c"
+ #include "src/malloc.c"
+ #include "src/romfile.c"
+ #include "src/x86.c"
+ #include "src/optionroms.c"
+ #include "src/pmm.c"
+ #include "src/font.c"
+ #include "src/boot.c"
+ #include "src/bootsplash.c"
+ #include "src/jpeg.c"
+ #include "src/bmp.c"
+ #include "src/tcgbios.c"
+ #include "src/sha1.c"
+ #include "src/hw/pcidevice.c"
+ #include "src/hw/ahci.c"
+ #include "src/hw/pvscsi.c"
+ #include "src/hw/usb-hub.c"
+ #include "src/hw/sdcard.c"
+ #include "src/fw/coreboot.c"
+ #include "src/fw/lzmadecode.c"
+ #include "src/fw/multiboot.c"
+ #include "src/fw/csm.c"
+ #include "src/fw/biostables.c"
+ #include "src/fw/paravirt.c"
+ #include "src/fw/shadow.c"
+ #include "src/fw/pciinit.c"
+ #include "src/fw/smm.c"
+ #include "src/fw/smp.c"
+ #include "src/fw/mtrr.c"
+ #include "src/fw/xen.c"
+ #include "src/fw/acpi.c"
+ #include "src/fw/mptable.c"
+ #include "src/fw/pirtable.c"
+ #include "src/fw/smbios.c"
+ #include "src/fw/romfile_loader.c"
+ #include "src/fw/dsdt_parser.c"
+ #include "src/hw/virtio-ring.c"
+ #include "src/hw/virtio-pci.c"
+ #include "src/hw/virtio-mmio.c"
+ #include "src/hw/virtio-blk.c"
+ #include "src/hw/virtio-scsi.c"
+ #include "src/hw/tpm_drivers.c"
+ #include "src/hw/nvme.c"
+ #include "src/sha256.c"
+ #include "src/sha512.c"
+ #include "src/timeline.c"
+ #include "src/sha_ni.c"
@@ -0,0 +1,9 @@
+deps_config := \
+	vgasrc/Kconfig \
+	/root/repo/src/Kconfig
+
+include/config/auto.conf: \
+	$(deps_config)
+
+
+$(deps_config): ;
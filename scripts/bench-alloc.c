@@ -0,0 +1,323 @@
+// Host microbenchmark of the malloc.c zone allocator and romfile lookups.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// This is built and run on the host by scripts/bench-host.py - it
+// includes the firmware sources directly (so their static functions
+// can be driven) and links against the host C library.  Each workload
+// prints one line: "<name> <operations> <total ns> <worst ns>".
+
+#define free bench_free // Don't replace the host free()
+
+#include "../src/malloc.c"
+#include "../src/romfile.c"
+
+// Host C library functions (the firmware headers can't be mixed with
+// the host ones).
+struct bench_timespec {
+    long tv_sec, tv_nsec;
+};
+int clock_gettime(int clk, struct bench_timespec *ts);
+void exit(int status);
+int atoi(const char *s);
+#define BENCH_CLOCK_MONOTONIC 1
+
+
+/****************************************************************
+ * Firmware stubs
+ ****************************************************************/
+
+char zonelow_base[1], final_varlow_start[1], varlow_start[1], varlow_end[1];
+char zonefseg_start[1], zonefseg_end[1];
+struct e820entry *e820_map;
+int e820_map_count;
+
+void __dprintf(const char *fmt, ...) { }
+void e820_add(u64 start, u64 size, u32 type) { }
+void e820_remove(u64 start, u64 size) { }
+int qemu_cfg_write_file(void *src, struct romfile_s *file, u32 offset
+                        , u32 len) { return -1; }
+
+static void
+bench_fail(const char *msg, const char *fname, int lineno)
+{
+    printf("error: %s in %s:%d\n", msg, fname, lineno);
+    exit(1);
+}
+void __warn_internalerror(int lineno, const char *fname)
+{
+    bench_fail("internal error", fname, lineno);
+}
+void __warn_noalloc(int lineno, const char *fname)
+{
+    bench_fail("out of memory", fname, lineno);
+}
+
+char *
+strtcpy(char *dest, const char *src, size_t len)
+{
+    char *d = dest;
+    while (--len && *src != '\0')
+        *d++ = *src++;
+    *d = '\0';
+    return dest;
+}
+
+
+/****************************************************************
+ * Measurement helpers
+ ****************************************************************/
+
+// The zones are carved out of this (below 4GiB in a non-pie binary,
+// so the firmware's u32 addresses work).
+#define ARENA_SIZE (64*1024*1024)
+static char Arena[ARENA_SIZE] __aligned(4096);
+
+struct bench_s {
+    const char *name;
+    u64 ops, total, worst;
+};
+
+static u64
+now_ns(void)
+{
+    struct bench_timespec ts;
+    clock_gettime(BENCH_CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_note(struct bench_s *b, u64 start)
+{
+    u64 t = now_ns() - start;
+    b->ops++;
+    b->total += t;
+    if (t > b->worst)
+        b->worst = t;
+}
+
+static void
+bench_report(struct bench_s *b)
+{
+    printf("%s %llu %llu %llu\n", b->name, b->ops, b->total, b->worst);
+}
+
+static u32 RandState = 1;
+
+static u32
+bench_rand(u32 max)
+{
+    RandState = RandState * 1103515245 + 12345;
+    return (RandState >> 8) % max;
+}
+
+// Allocation sizes seen during a boot - mostly small driver and
+// romfile structures, some pages for rings and buffers, and a few
+// large option rom and table buffers.
+static u32
+boot_size(u32 *palign)
+{
+    u32 r = bench_rand(100);
+    *palign = MALLOC_MIN_ALIGN;
+    if (r < 70)
+        return 16 + bench_rand(240);
+    if (r < 85)
+        return 256 + bench_rand(1792);
+    *palign = PAGE_SIZE;
+    if (r < 97)
+        return PAGE_SIZE * (1 + bench_rand(4));
+    return 64*1024 + bench_rand(192*1024);
+}
+
+
+/****************************************************************
+ * Workloads
+ ****************************************************************/
+
+#define MAXLIVE 4096
+
+// Allocate and free a boot like mix of blocks through _malloc()/free().
+static void
+bench_malloc(int count)
+{
+    static void *live[MAXLIVE];
+    struct bench_s balloc = { "malloc" }, bfree = { "free" };
+    int nlive = 0, i;
+    for (i = 0; i < count; i++) {
+        if (nlive == MAXLIVE || (nlive && bench_rand(100) < 40)) {
+            int pos = bench_rand(nlive);
+            u64 start = now_ns();
+            free(live[pos]);
+            bench_note(&bfree, start);
+            live[pos] = live[--nlive];
+            continue;
+        }
+        u32 align, size = boot_size(&align);
+        struct zone_s *zone = bench_rand(4) ? &ZoneTmpHigh : &ZoneHigh;
+        u64 start = now_ns();
+        void *data = _malloc(zone, size, align);
+        bench_note(&balloc, start);
+        if (!data)
+            bench_fail("allocation failed", __FILE__, __LINE__);
+        live[nlive++] = data;
+    }
+    while (nlive) {
+        u64 start = now_ns();
+        free(live[--nlive]);
+        bench_note(&bfree, start);
+    }
+    bench_report(&balloc);
+    bench_report(&bfree);
+}
+
+// Reserve and release raw ranges with alloc_new()/alloc_free().
+static void
+bench_alloc_new(int count)
+{
+    static struct allocinfo_s infos[MAXLIVE];
+    static struct allocinfo_s *live[MAXLIVE];
+    struct bench_s bnew = { "alloc_new" }, bfree = { "alloc_free" };
+    int nlive = 0, nfree = MAXLIVE, i;
+    static struct allocinfo_s *freeinfos[MAXLIVE];
+    for (i = 0; i < MAXLIVE; i++)
+        freeinfos[i] = &infos[i];
+    for (i = 0; i < count; i++) {
+        if (!nfree || (nlive && bench_rand(100) < 40)) {
+            int pos = bench_rand(nlive);
+            u64 start = now_ns();
+            alloc_free(live[pos]);
+            bench_note(&bfree, start);
+            freeinfos[nfree++] = live[pos];
+            live[pos] = live[--nlive];
+            continue;
+        }
+        u32 align, size = boot_size(&align);
+        struct allocinfo_s *info = freeinfos[--nfree];
+        u64 start = now_ns();
+        u32 data = alloc_new(&ZoneHigh, size, align, info);
+        bench_note(&bnew, start);
+        if (!data)
+            bench_fail("reservation failed", __FILE__, __LINE__);
+        live[nlive++] = info;
+    }
+    while (nlive)
+        alloc_free(live[--nlive]);
+    bench_report(&bnew);
+    bench_report(&bfree);
+}
+
+// Look up pmm handles among many tracked allocations.
+static void
+bench_findhandle(int count)
+{
+    static u32 blocks[1024];
+    struct bench_s b = { "malloc_findhandle" };
+    int i;
+    for (i = 0; i < ARRAY_SIZE(blocks); i++) {
+        blocks[i] = malloc_palloc(&ZoneTmpHigh, 1024, MALLOC_MIN_ALIGN);
+        malloc_sethandle(blocks[i], 0x50000000 + i);
+    }
+    for (i = 0; i < count; i++) {
+        u32 handle = 0x50000000 + bench_rand(ARRAY_SIZE(blocks) * 2);
+        u64 start = now_ns();
+        u32 data = malloc_findhandle(handle);
+        bench_note(&b, start);
+        if (handle < 0x50000000 + ARRAY_SIZE(blocks)
+            && data != blocks[handle - 0x50000000])
+            bench_fail("wrong handle", __FILE__, __LINE__);
+    }
+    for (i = 0; i < ARRAY_SIZE(blocks); i++)
+        malloc_pfree(blocks[i]);
+    bench_report(&b);
+}
+
+// Name patterns of the files a QEMU or coreboot boot registers.
+static const char *RomfileDirs[] = {
+    "etc/", "opt/org.seabios/", "genroms/", "vgaroms/", "fallback/",
+    "pci", "img/", "bootorder",
+};
+
+#define ROMFILES 400
+
+static int
+romfile_name(char *buf, int i)
+{
+    const char *dir = RomfileDirs[i % ARRAY_SIZE(RomfileDirs)];
+    return snprintf(buf, 128, "%s%s%04x", dir
+                    , *dir == 'p' ? "8086," : "file-", i * 7919 % 65536);
+}
+
+static int
+bench_copy(struct romfile_s *file, void *dst, u32 maxlen)
+{
+    return file->size;
+}
+
+// Find romfiles by name and by prefix.
+static void
+bench_romfile(int count)
+{
+    static struct romfile_s files[ROMFILES];
+    struct bench_s bfind = { "romfile_find" };
+    struct bench_s bmiss = { "romfile_find_miss" };
+    struct bench_s bprefix = { "romfile_findprefix" };
+    int i;
+    for (i = 0; i < ROMFILES; i++) {
+        romfile_name(files[i].name, i);
+        files[i].size = 1 + i;
+        files[i].copy = bench_copy;
+        romfile_add(&files[i]);
+    }
+    romfile_index_build();
+
+    char name[128];
+    for (i = 0; i < count; i++) {
+        int n = bench_rand(ROMFILES);
+        romfile_name(name, n);
+        u64 start = now_ns();
+        struct romfile_s *file = romfile_find(name);
+        bench_note(&bfind, start);
+        if (file != &files[n])
+            bench_fail("romfile not found", __FILE__, __LINE__);
+
+        snprintf(name, sizeof(name), "etc/missing-%d", n);
+        start = now_ns();
+        file = romfile_find(name);
+        bench_note(&bmiss, start);
+        if (file)
+            bench_fail("missing romfile found", __FILE__, __LINE__);
+
+        if (i % 16)
+            continue;
+        // Walk all the files of one directory (as optionrom and
+        // ramdisk setup do)
+        const char *dir = RomfileDirs[n % ARRAY_SIZE(RomfileDirs)];
+        start = now_ns();
+        file = NULL;
+        while ((file = romfile_findprefix(dir, file)))
+            ;
+        bench_note(&bprefix, start);
+    }
+    bench_report(&bfind);
+    bench_report(&bmiss);
+    bench_report(&bprefix);
+}
+
+int
+main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    if (argc > 2)
+        RandState = atoi(argv[2]);
+    u32 base = (u32)Arena;
+    alloc_add(&ZoneTmpHigh, base, base + ARENA_SIZE/2);
+    alloc_add(&ZoneHigh, base + ARENA_SIZE/2, base + ARENA_SIZE);
+
+    bench_malloc(count);
+    bench_alloc_new(count);
+    bench_findhandle(count);
+    bench_romfile(count);
+    return 0;
+}
@@ -0,0 +1,422 @@
+#!/usr/bin/env python
+# Boot a SeaBIOS image under QEMU and measure how long booting takes.
+#
+# Copyright (C) 2026  SeaBIOS developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+# Usage:
+#   scripts/bench-boot.py out/bios.bin
+#   scripts/bench-boot.py -b baseline.json out/bios.bin
+#   scripts/bench-boot.py -S baseline.json -c virtio-blk,nvme out/bios.bin
+#
+# Each configuration boots a generated disk (or cdrom) image whose
+# boot sector writes a marker to the debug console, reads the disk
+# with INT 13h, writes a second marker and exits QEMU.  The debug
+# console is timestamped as it arrives to give:
+#   int19:   time until the INT 19h boot message
+#   bootsec: time until the boot sector starts running
+#   int13:   INT 13h read throughput of the boot sector in MB/s
+#   int1587: INT 15h AH=87h extended memory copy throughput in MB/s
+#            (only the "int1587" config, whose boot sector copies
+#            64KiB blocks above 1MiB instead of reading the disk)
+# If the build has CONFIG_BOOT_TIMELINE the guest measured length of
+# POST is also reported ("post").  Times are medians of several runs.
+
+import sys, os, time, subprocess, tempfile, shutil, json, re, optparse
+import select, struct
+
+# Bytes read by the boot sector
+READSIZE = 32 * 1024 * 1024
+# Bytes copied by the INT 15h AH=87h boot sector
+COPYSIZE = 256 * 1024 * 1024
+# Extra (empty) LUNs attached in the virtio-scsi configuration
+SCSI_LUNS = 32
+# Seconds allowed for a single run
+RUNTIMEOUT = 60
+
+
+######################################################################
+# Boot sector
+######################################################################
+
+# A tiny assembler for the boot sector - items are bytes, label
+# definitions ("label", name) and references ("rel8"/"rel16"/"abs16",
+# name).
+def assemble(items, org):
+    labels = {}
+    pos = 0
+    for item in items:
+        if isinstance(item, bytes):
+            pos += len(item)
+        elif item[0] == "label":
+            labels[item[1]] = pos
+        else:
+            pos += 1 if item[0] == "rel8" else 2
+    out = bytearray()
+    for item in items:
+        if isinstance(item, bytes):
+            out += item
+        elif item[0] == "rel8":
+            rel = labels[item[1]] - (len(out) + 1)
+            if not -128 <= rel < 128:
+                raise ValueError("jump to %s out of range" % (item[1],))
+            out += struct.pack("<b", rel)
+        elif item[0] == "rel16":
+            out += struct.pack("<h", labels[item[1]] - (len(out) + 2))
+        elif item[0] == "abs16":
+            out += struct.pack("<H", org + labels[item[1]])
+    return out
+
+BOOTSEG_BUF = 0x1000 # Read buffer at 1000:0000
+COPY_SRC = 0x200000 # INT 15h AH=87h copies from 2MiB to 3MiB
+COPY_DST = 0x300000
+
+# An INT 15h AH=87h descriptor for a 64KiB data segment at 'base'
+def copydesc(base):
+    return struct.pack("<HHBBBB", 0xffff, base & 0xffff, (base >> 16) & 0xff
+                       , 0x93, 0, base >> 24)
+
+def bootsector(chunk, loops, op="int13"):
+    if op == "int13":
+        body = [
+            b"\xbe", ("abs16", "dap"),              # mov si,dap
+            b"\xb4\x42",                            # mov ah,0x42
+            b"\x8a\x16", ("abs16", "drive"),        # mov dl,[drive]
+            b"\xcd\x13",                            # int 0x13
+            b"\x72", ("rel8", "fail"),              # jc fail
+            b"\xa1", ("abs16", "chunk"),            # mov ax,[chunk]
+            b"\x01\x06", ("abs16", "dap_lba"),      # add [dap_lba],ax
+            b"\x83\x16", ("abs16", "dap_lba_hi"), b"\x00", # adc [dap_lba_hi],0
+        ]
+        data = [
+            ("label", "chunk"), struct.pack("<H", chunk),
+            ("label", "dap"),
+            struct.pack("<BBHHH", 0x10, 0, chunk, 0, BOOTSEG_BUF),
+            ("label", "dap_lba"), b"\x00\x00",
+            ("label", "dap_lba_hi"), b"\x00\x00" + b"\x00" * 4,
+        ]
+    else:
+        body = [
+            b"\xbe", ("abs16", "gdt"),              # mov si,gdt
+            b"\xb9", struct.pack("<H", chunk // 2), # mov cx,words
+            b"\xb4\x87",                            # mov ah,0x87
+            b"\xcd\x15",                            # int 0x15
+            b"\x72", ("rel8", "fail"),              # jc fail
+        ]
+        data = [
+            ("label", "gdt"), b"\x00" * 16,
+            copydesc(COPY_SRC), copydesc(COPY_DST), b"\x00" * 16,
+        ]
+    code = [
+        b"\xfa\x31\xc0\x8e\xd8\x8e\xc0\x8e\xd0",  # cli; set ds/es/ss
+        b"\xbc\x00\x7c\xfb",                        # set sp; sti
+        b"\x88\x16", ("abs16", "drive"),            # mov [drive],dl
+        b"\xbe", ("abs16", "msg_start"),            # mov si,msg_start
+        b"\xe8", ("rel16", "puts"),                 # call puts
+        b"\x8b\x0e", ("abs16", "loops"),            # mov cx,[loops]
+        ("label", "loop"),
+        b"\x51",                                    # push cx
+    ] + body + [
+        b"\x59",                                    # pop cx
+        b"\xe2", ("rel8", "loop"),                  # loop loop
+        b"\xbe", ("abs16", "msg_done"),             # mov si,msg_done
+        b"\xe8", ("rel16", "puts"),                 # call puts
+        ("label", "exit"),
+        b"\xba\xf4\x00\x30\xc0\xee",                # isa-debug-exit
+        b"\xfa\xf4",                                # cli; hlt
+        b"\xeb", ("rel8", "exit"),                  # jmp exit
+        ("label", "fail"),
+        b"\x83\xc4\x02",                            # add sp,2
+        b"\xbe", ("abs16", "msg_fail"),             # mov si,msg_fail
+        b"\xe8", ("rel16", "puts"),                 # call puts
+        b"\xeb", ("rel8", "exit"),                  # jmp exit
+        ("label", "puts"),
+        b"\xba\x02\x04",                            # mov dx,0x402
+        ("label", "puts_loop"),
+        b"\xac\x84\xc0",                            # lodsb; test al,al
+        b"\x74", ("rel8", "puts_done"),             # jz puts_done
+        b"\xee",                                    # out dx,al
+        b"\xeb", ("rel8", "puts_loop"),             # jmp puts_loop
+        ("label", "puts_done"),
+        b"\xc3",                                    # ret
+        ("label", "drive"), b"\x00",
+        ("label", "loops"), struct.pack("<H", loops),
+    ] + data + [
+        ("label", "msg_start"), b"BENCH start\n\x00",
+        ("label", "msg_done"), b"BENCH done\n\x00",
+        ("label", "msg_fail"), b"BENCH fail\n\x00",
+    ]
+    out = assemble(code, 0x7c00)
+    if len(out) > 510:
+        raise ValueError("boot sector too large")
+    out += b"\x00" * (510 - len(out)) + b"\x55\xaa"
+    return bytes(out)
+
+# Disk image - the boot sector reads it from lba 0
+def makedisk(path):
+    chunk = 64
+    loops = READSIZE // (chunk * 512)
+    with open(path, "wb") as f:
+        f.write(bootsector(chunk, loops))
+        f.truncate(READSIZE + 1024 * 1024)
+    return READSIZE
+
+# Disk image whose boot sector does INT 15h AH=87h copies
+def makecopydisk(path):
+    chunk = 64 * 1024
+    with open(path, "wb") as f:
+        f.write(bootsector(chunk, COPYSIZE // chunk, "int1587"))
+        f.truncate(1024 * 1024)
+    return COPYSIZE
+
+# El Torito (no emulation) cdrom image - needs xorriso or genisoimage
+def makeiso(path, tmpdir):
+    tool = shutil.which("xorriso") or shutil.which("genisoimage")
+    if not tool:
+        return None
+    chunk = 16
+    loops = READSIZE // (chunk * 2048)
+    isodir = os.path.join(tmpdir, "iso")
+    os.mkdir(isodir)
+    with open(os.path.join(isodir, "boot.img"), "wb") as f:
+        f.write(bootsector(chunk, loops))
+    with open(os.path.join(isodir, "data.bin"), "wb") as f:
+        f.truncate(READSIZE)
+    args = ["-quiet", "-o", path, "-b", "boot.img", "-no-emul-boot"
+            , "-boot-load-size", "4", isodir]
+    if os.path.basename(tool) == "xorriso":
+        args = ["-as", "mkisofs"] + args
+    subprocess.check_call([tool] + args)
+    return READSIZE
+
+
+######################################################################
+# Configurations
+######################################################################
+
+def scsi_luns():
+    args = []
+    for i in range(1, SCSI_LUNS + 1):
+        args += ["-blockdev", "driver=null-co,node-name=lun%d,size=64M"
+                 ",read-zeroes=on" % (i,),
+                 "-device", "scsi-hd,drive=lun%d,bus=scsi.0,scsi-id=0,lun=%d"
+                 % (i, i)]
+    return args
+
+DISK = "-drive", "file=%(disk)s,format=raw,if=none,id=d0"
+CONFIGS = [
+    ("virtio-blk", [DISK, ("-device", "virtio-blk-pci,drive=d0,bootindex=0")]),
+    ("nvme", [DISK, ("-device", "nvme,drive=d0,serial=bench,bootindex=0")]),
+    ("ahci", [DISK, ("-device", "ahci,id=ahci"),
+                 ("-device", "ide-hd,drive=d0,bus=ahci.0,bootindex=0")]),
+    ("xhci-storage", [DISK, ("-device", "qemu-xhci,id=xhci"),
+                         ("-device", "usb-storage,drive=d0,bus=xhci.0"
+                          ",bootindex=0")]),
+    ("virtio-scsi-luns", [DISK, ("-device", "virtio-scsi-pci,id=scsi"),
+                             ("-device", "scsi-hd,drive=d0,bus=scsi.0"
+                              ",scsi-id=0,lun=0,bootindex=0"),
+                             scsi_luns()]),
+    ("cdrom", [("-drive", "file=%(iso)s,format=raw,media=cdrom,if=none"
+                ",id=cd0"),
+               ("-device", "ide-cd,drive=cd0,bus=ide.1,bootindex=0")]),
+    ("kernel", [("-kernel", "%(kernel)s")]),
+    ("int1587", [("-drive", "file=%(copydisk)s,format=raw,if=none,id=d0"),
+                 ("-device", "virtio-blk-pci,drive=d0,bootindex=0")]),
+]
+METRICS = ["int19", "bootsec", "int13", "int1587", "post"]
+UNITS = {"int19": "ms", "bootsec": "ms", "int13": "MB/s", "int1587": "MB/s"
+         , "post": "ms"}
+
+
+######################################################################
+# Running QEMU
+######################################################################
+
+TIMELINE_RE = re.compile(r"^  *(\S+): start=(\d+)us len=(\d+)us$")
+
+# Boot once and return a dict of metrics
+def runone(options, bios, cfgargs, readsize, metric):
+    cmd = [options.qemu, "-nodefaults", "-display", "none", "-m", "256"
+           , "-bios", bios, "-no-reboot"
+           , "-chardev", "stdio,id=seabios,signal=off"
+           , "-device", "isa-debugcon,iobase=0x402,chardev=seabios"
+           , "-device", "isa-debug-exit,iobase=0xf4,iosize=0x04"]
+    if options.accel:
+        cmd += ["-accel", options.accel]
+    cmd += cfgargs
+    start = time.time()
+    proc = subprocess.Popen(cmd, stdin=subprocess.DEVNULL
+                            , stdout=subprocess.PIPE)
+    res = {}
+    postend = 0
+    buf = b""
+    try:
+        while 1:
+            timeout = start + RUNTIMEOUT - time.time()
+            if timeout <= 0:
+                sys.stderr.write("Timeout running %s\n" % (" ".join(cmd),))
+                break
+            r = select.select([proc.stdout], [], [], timeout)
+            if not r[0]:
+                continue
+            d = os.read(proc.stdout.fileno(), 4096)
+            if not d:
+                break
+            now = (time.time() - start) * 1000.0
+            buf += d
+            lines = buf.split(b"\n")
+            buf = lines.pop()
+            for line in lines:
+                line = line.decode("latin-1").rstrip("\r")
+                if options.verbose:
+                    sys.stdout.write("%9.3f: %s\n" % (now, line))
+                m = TIMELINE_RE.match(line)
+                if m:
+                    postend = max(postend, int(m.group(2)) + int(m.group(3)))
+                if line.startswith("Booting from ") and "int19" not in res:
+                    res["int19"] = now
+                    if postend:
+                        res["post"] = postend / 1000.0
+                    if not readsize:
+                        # Nothing else to wait for on a direct kernel boot
+                        return res
+                elif line == "BENCH start":
+                    res["bootsec"] = now
+                elif line == "BENCH done" and "bootsec" in res:
+                    secs = (now - res["bootsec"]) / 1000.0
+                    res[metric] = readsize / (1024.0 * 1024.0) / max(secs
+                                                                     , 1e-6)
+                    return res
+                elif line == "BENCH fail":
+                    sys.stderr.write("%s failed\n" % (metric,))
+                    return res
+    finally:
+        proc.kill()
+        proc.wait()
+    return res
+
+def median(values):
+    values = sorted(values)
+    if not values:
+        return None
+    return values[len(values) // 2]
+
+def runconfig(options, bios, name, cfg, params, readsize):
+    cfgargs = []
+    for arg in cfg:
+        cfgargs += [a % params for a in arg]
+    metric = "int1587" if name == "int1587" else "int13"
+    runs = [runone(options, bios, cfgargs, readsize, metric)
+            for i in range(options.runs)]
+    res = {}
+    for metric in METRICS:
+        val = median([r[metric] for r in runs if metric in r])
+        if val is not None:
+            res[metric] = round(val, 3)
+    return res
+
+
+######################################################################
+# Reporting
+######################################################################
+
+def report(results, baseline):
+    sys.stdout.write("%-18s" % ("config",))
+    for metric in METRICS:
+        sys.stdout.write(" %20s" % ("%s (%s)" % (metric, UNITS[metric]),))
+    sys.stdout.write("\n")
+    for name, res in results:
+        base = baseline.get(name, {})
+        sys.stdout.write("%-18s" % (name,))
+        for metric in METRICS:
+            if metric not in res:
+                sys.stdout.write(" %20s" % ("-",))
+                continue
+            val = "%.1f" % (res[metric],)
+            if base.get(metric):
+                delta = (res[metric] - base[metric]) * 100.0 / base[metric]
+                val += " (%+.1f%%)" % (delta,)
+            sys.stdout.write(" %20s" % (val,))
+        sys.stdout.write("\n")
+
+def main():
+    opts = optparse.OptionParser("%prog [options] <bios.bin>")
+    opts.add_option("-q", "--qemu", dest="qemu"
+                    , default="qemu-system-x86_64", help="qemu binary to run")
+    opts.add_option("-a", "--accel", dest="accel", default=None
+                    , help="qemu accelerator (kvm, tcg)")
+    opts.add_option("-c", "--configs", dest="configs", default=None
+                    , help="comma separated list of configs to run (%s)"
+                    % (",".join([c[0] for c in CONFIGS]),))
+    opts.add_option("-k", "--kernel", dest="kernel", default=None
+                    , help="kernel image for the direct kernel boot config")
+    opts.add_option("-n", "--runs", dest="runs", type="int", default=3
+                    , help="number of boots per config")
+    opts.add_option("-b", "--baseline", dest="baseline", default=None
+                    , help="compare against results saved in this file")
+    opts.add_option("-S", "--save", dest="save", default=None
+                    , help="save the results to this file")
+    opts.add_option("-v", "--verbose", action="store_true", dest="verbose"
+                    , help="show the timestamped debug output")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    bios = os.path.abspath(args[0])
+    if not shutil.which(options.qemu):
+        opts.error("Unable to find %s" % (options.qemu,))
+    if options.accel is None and os.access("/dev/kvm", os.R_OK | os.W_OK):
+        options.accel = "kvm"
+    names = [c[0] for c in CONFIGS]
+    if options.configs:
+        names = options.configs.split(",")
+        for name in names:
+            if name not in [c[0] for c in CONFIGS]:
+                opts.error("Unknown config %s" % (name,))
+
+    baseline = {}
+    if options.baseline:
+        with open(options.baseline) as f:
+            baseline = json.load(f)
+
+    tmpdir = tempfile.mkdtemp(prefix="seabios-bench-")
+    try:
+        params = {"disk": os.path.join(tmpdir, "disk.img"),
+                  "iso": os.path.join(tmpdir, "cdrom.iso"),
+                  "copydisk": os.path.join(tmpdir, "copydisk.img"),
+                  "kernel": options.kernel}
+        disksize = makedisk(params["disk"])
+        isosize = None
+        if "cdrom" in names:
+            isosize = makeiso(params["iso"], tmpdir)
+        results = []
+        for name, cfg in CONFIGS:
+            if name not in names:
+                continue
+            readsize = disksize
+            if name == "cdrom":
+                if isosize is None:
+                    sys.stderr.write("Skipping cdrom: no xorriso or"
+                                     " genisoimage\n")
+                    continue
+                readsize = isosize
+            elif name == "kernel":
+                if not options.kernel:
+                    sys.stderr.write("Skipping kernel: no --kernel given\n")
+                    continue
+                readsize = 0
+            elif name == "int1587":
+                readsize = makecopydisk(params["copydisk"])
+            results.append((name, runconfig(options, bios, name, cfg
+                                            , params, readsize)))
+    finally:
+        shutil.rmtree(tmpdir)
+
+    report(results, baseline)
+    if options.save:
+        with open(options.save, "w") as f:
+            json.dump(dict(results), f, indent=2, sort_keys=True)
+            f.write("\n")
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,283 @@
+// Host microbenchmark of the lzma, jpeg and bmp decoders.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// This is built and run on the host by "scripts/bench-host.py -t
+// decode", which passes the compressed payload and the splash images
+// on stdin - along with the uncompressed payload, which the decoded
+// data is checked against.  Like bench-sha.c it is a freestanding 32bit program built
+// with the firmware's code generation flags - see bench-host.h.
+
+#include "x86.h" // sse_enable
+
+// The SSE state doesn't need enabling in a user space process (and
+// control registers can't be written there).
+#define sse_enable(cr0, cr4) do { } while (0)
+#define sse_restore(cr0, cr4) do { } while (0)
+
+#include "../src/string.c"
+#include "../src/fw/lzmadecode.c"
+#include "../src/jpeg.c"
+#include "../src/bmp.c"
+#include "bench-host.h"
+
+
+/****************************************************************
+ * Firmware stubs
+ ****************************************************************/
+
+int HaveRunPost = 1;
+
+void __dprintf(const char *fmt, ...) { }
+
+void yield(void) { }
+
+void
+cpuid(u32 index, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    __cpuid(index, eax, ebx, ecx, edx);
+}
+
+// Simple bump allocator for the decoder state (reset between runs)
+struct zone_s { int dummy; } ZoneTmpHigh;
+static u8 Heap[64*1024] __aligned(MALLOC_MIN_ALIGN);
+static u32 HeapUsed;
+
+void *
+_malloc(struct zone_s *zone, u32 size, u32 align)
+{
+    u32 pos = ALIGN(HeapUsed, align);
+    if (pos + size > sizeof(Heap))
+        return NULL;
+    HeapUsed = pos + size;
+    return &Heap[pos];
+}
+
+
+/****************************************************************
+ * Workloads
+ ****************************************************************/
+
+#define MAX_INPUT  (2*1024*1024)
+#define MAX_OUTPUT (2*1024*1024)
+#define WIDTH  640
+#define HEIGHT 480
+
+static u8 Input[MAX_INPUT] __aligned(16);
+static u8 Output[MAX_OUTPUT] __aligned(16);
+static u8 Rowbuf[16 * WIDTH * 4] __aligned(16);
+static u8 *Lzma, *Raw, *Jpeg, *Bmp;
+static u32 LzmaSize, RawSize, JpegSize, BmpSize;
+
+// Uncompress the payload like ulzma_with() does - reading the
+// compressed data in chunks through the input callback.
+#define LZMA_CHUNK_SIZE 1024
+
+struct lzma_stream_s {
+    ILzmaInCallback cb;
+    const u8 *src;
+    u32 srclen;
+    u8 buf[LZMA_CHUNK_SIZE];
+};
+
+static int
+lzma_read(void *object, const unsigned char **buffer, SizeT *size)
+{
+    struct lzma_stream_s *s = container_of(object, struct lzma_stream_s, cb);
+    u32 len = s->srclen;
+    if (len > LZMA_CHUNK_SIZE)
+        len = LZMA_CHUNK_SIZE;
+    iomemcpy(s->buf, s->src, len);
+    s->src += len;
+    s->srclen -= len;
+    *buffer = s->buf;
+    *size = len;
+    return 0;
+}
+
+static u32
+lzma_run(int chunked)
+{
+    // Same limit (lc + lp <= 3) as the decoder state of ulzma_with()
+    static CProb probs[LZMA_BASE_SIZE + (LZMA_LIT_SIZE << 3)];
+    static struct lzma_stream_s stream;
+    CLzmaDecoderState state;
+    if (LzmaDecodeProperties(&state.Properties, Lzma, LZMA_PROPERTIES_SIZE))
+        bench_fail("lzma properties");
+    if (LzmaGetNumProbs(&state.Properties) > ARRAY_SIZE(probs))
+        bench_fail("lzma probs");
+    state.Probs = probs;
+    u32 dstlen = *(u32*)(Lzma + LZMA_PROPERTIES_SIZE);
+    if (dstlen > sizeof(Output))
+        bench_fail("lzma output too large");
+    const u8 *src = Lzma + LZMA_PROPERTIES_SIZE + 8;
+    u32 srclen = LzmaSize - LZMA_PROPERTIES_SIZE - 8;
+    u32 inProcessed, outProcessed;
+    int ret;
+    if (chunked) {
+        stream.cb.Read = lzma_read;
+        stream.src = src;
+        stream.srclen = srclen;
+        state.InCallback = &stream.cb;
+        ret = LzmaDecode(&state, NULL, 0, &inProcessed
+                         , Output, dstlen, &outProcessed);
+    } else {
+        state.InCallback = NULL;
+        ret = LzmaDecode(&state, src, srclen, &inProcessed
+                         , Output, dstlen, &outProcessed);
+    }
+    if (ret || outProcessed != dstlen)
+        bench_fail("lzma decode");
+    return dstlen;
+}
+
+static void
+bench_lzma(const char *name, int chunked, int count)
+{
+    struct bench_s b = { name };
+    int i;
+    for (i = 0; i < count; i++) {
+        bench_start(&b);
+        b.bytes = lzma_run(chunked);
+        bench_note(&b);
+    }
+    if (b.bytes != RawSize || memcmp(Output, Raw, RawSize))
+        bench_fail("lzma output differs from the uncompressed data");
+    bench_report(&b);
+}
+
+// Decode the jpeg splash image into a 32bpp frame buffer as
+// enable_bootsplash() does - using the scalar code if 'scalar' is set.
+static void
+bench_jpeg_show(int scalar)
+{
+    // jpeg_sse2_available() only uses sse2 during POST
+    HaveRunPost = scalar ? 2 : 1;
+    HeapUsed = 0;
+    struct jpeg_decdata *jpeg = jpeg_alloc();
+    int width, height;
+    if (!jpeg || jpeg_decode(jpeg, Jpeg))
+        bench_fail("jpeg decode");
+    jpeg_get_size(jpeg, &width, &height);
+    if (width != WIDTH || height != HEIGHT
+        || jpeg_show(jpeg, Output, width, height, 32, width * 4, Rowbuf))
+        bench_fail("jpeg show");
+    HaveRunPost = 1;
+}
+
+static void
+bench_jpeg(const char *name, int scalar, int count)
+{
+    struct bench_s b = { name, .bytes = WIDTH * HEIGHT * 4 };
+    int i;
+    for (i = 0; i < count; i++) {
+        bench_start(&b);
+        bench_jpeg_show(scalar);
+        bench_note(&b);
+    }
+    bench_report(&b);
+}
+
+// The sse2 idct and color conversion of jpeg.c must give exactly the
+// same output as the scalar code.  Check them on random blocks
+// (including colors that need clamping) and on the whole image.
+static void
+jpeg_sse2_check(void)
+{
+    static int in[64], ref[64 * 6], res[64 * 6];
+    static u8 pic[2][16 * 4 * 16], image[WIDTH * HEIGHT * 4];
+    u32 seed = 0x12345678;
+    int i, n;
+
+    HeapUsed = 0;
+    struct jpeg_decdata *jpeg = jpeg_alloc();
+    if (!jpeg || jpeg_decode(jpeg, Jpeg))
+        bench_fail("jpeg decode");
+    for (n = 0; n < 1000; n++) {
+        for (i = 0; i < 64; i++) {
+            seed = seed * 1103515245 + 12345;
+            in[i] = (int)(seed >> 16) % 64 - 32;
+        }
+        idct(in, ref, jpeg->dquant[0], IFIX(128.5), 64);
+        idct_sse2(in, res, jpeg->dquant[0], IFIX(128.5), 64);
+        if (memcmp(ref, res, 64 * sizeof(int)))
+            bench_fail("sse2 idct differs from the scalar idct");
+
+        for (i = 0; i < 64 * 6; i++) {
+            seed = seed * 1103515245 + 12345;
+            ref[i] = (int)(seed >> 16) % 640 - 192;
+        }
+        col221111_32(ref, pic[0], 16 * 4);
+        col221111_32_sse2(ref, pic[1], 16 * 4);
+        if (memcmp(pic[0], pic[1], sizeof(pic[0])))
+            bench_fail("sse2 color conversion differs from the scalar one");
+    }
+
+    bench_jpeg_show(0);
+    memcpy(image, Output, sizeof(image));
+    bench_jpeg_show(1);
+    if (memcmp(image, Output, sizeof(image)))
+        bench_fail("sse2 jpeg output differs from the scalar output");
+}
+
+static void
+bench_bmp(const char *name, int depth, int count)
+{
+    struct bench_s b = { name, .bytes = WIDTH * HEIGHT * depth / 8 };
+    int i;
+    for (i = 0; i < count; i++) {
+        HeapUsed = 0;
+        bench_start(&b);
+        struct bmp_decdata *bmp = bmp_alloc();
+        int width, height, bpp;
+        if (!bmp || bmp_decode(bmp, Bmp, BmpSize))
+            bench_fail("bmp decode");
+        bmp_get_info(bmp, &width, &height, &bpp);
+        if (width != WIDTH || height != HEIGHT
+            || bmp_show(bmp, Output, width, height, depth
+                        , width * depth / 8))
+            bench_fail("bmp show");
+        bench_note(&b);
+    }
+    bench_report(&b);
+}
+
+void __noreturn VISIBLE32FLAT
+bench_main(u32 *sp)
+{
+    u32 argc = sp[0];
+    char **argv = (char**)&sp[1];
+    int count = argc > 1 ? bench_atoi(argv[1]) : 20;
+
+    // Input: four lengths followed by the lzma data, the uncompressed
+    // data, the jpeg and the bmp
+    u32 sizes[4];
+    bench_read(sizes, sizeof(sizes));
+    if (sizes[0] + sizes[1] + sizes[2] + sizes[3] > sizeof(Input))
+        bench_fail("input too large");
+    bench_read(Input, sizes[0] + sizes[1] + sizes[2] + sizes[3]);
+    Lzma = Input;
+    LzmaSize = sizes[0];
+    Raw = Lzma + LzmaSize;
+    RawSize = sizes[1];
+    Jpeg = Raw + RawSize;
+    JpegSize = sizes[2];
+    Bmp = Jpeg + JpegSize;
+    BmpSize = sizes[3];
+    if (LzmaSize < LZMA_PROPERTIES_SIZE + 8)
+        bench_fail("lzma input truncated");
+
+    string_preinit();
+    bench_lzma("lzma", 1, count);
+    bench_lzma("lzma_mem", 0, count);
+    bench_jpeg("jpeg_32", 0, count);
+    if (jpeg_sse2_available()) {
+        jpeg_sse2_check();
+        bench_jpeg("jpeg_32_scalar", 1, count);
+    }
+    bench_bmp("bmp_32", 32, count);
+    bench_bmp("bmp_24", 24, count);
+    bench_exit(0);
+}
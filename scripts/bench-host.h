@@ -0,0 +1,205 @@
+// Host interface of the freestanding microbenchmarks.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// The benchmarks run by "scripts/bench-host.py -t <target>" that are
+// built with the firmware's code generation flags can't use a C
+// library, so they talk to the kernel directly through the 32bit
+// system call interface.  Each benchmark defines bench_main(), which
+// is entered with the initial stack (argc, argv).  Results are printed
+// one per line: "<name> <operations> <total ns> <worst ns>" optionally
+// followed by "<key>=<value>" items (see runone() in bench-host.py).
+// Workloads that set a byte count also report the time stamp counter
+// cycles they took, from which the script derives cycles per byte.
+
+#ifndef __BENCH_HOST_H
+#define __BENCH_HOST_H
+
+#define SYS_exit_group    252
+#define SYS_read          3
+#define SYS_write         4
+#define SYS_clock_gettime 265
+#define BENCH_CLOCK_MONOTONIC 1
+
+static int
+bench_syscall(int nr, u32 a, u32 b, u32 c)
+{
+    int ret;
+    asm volatile("int $0x80" : "=a"(ret) : "a"(nr), "b"(a), "c"(b), "d"(c)
+                 : "memory");
+    return ret;
+}
+
+static void __noreturn
+bench_exit(int status)
+{
+    bench_syscall(SYS_exit_group, status, 0, 0);
+    for (;;)
+        ;
+}
+
+static void
+bench_puts(const char *s)
+{
+    const char *p = s;
+    while (*p)
+        p++;
+    bench_syscall(SYS_write, 1, (u32)s, p - s);
+}
+
+// Print a decimal number (without 64bit division, which would need
+// libgcc).
+static void
+bench_putu64(u64 val)
+{
+    char buf[24], *p = buf;
+    u64 pow = 1;
+    int digits = 1, i;
+    while (digits < 20 && pow * 10 <= val) {
+        pow = pow * 10;
+        digits++;
+    }
+    for (i = 0; i < digits; i++) {
+        int digit = 0;
+        while (val >= pow) {
+            val -= pow;
+            digit++;
+        }
+        *p++ = '0' + digit;
+        // Step down to the next power of ten
+        u64 next = 1;
+        while (next * 10 < pow)
+            next = next * 10;
+        pow = next;
+    }
+    *p = '\0';
+    bench_puts(buf);
+}
+
+static void __noreturn
+bench_fail(const char *msg)
+{
+    bench_puts("error: ");
+    bench_puts(msg);
+    bench_puts("\n");
+    bench_exit(1);
+}
+
+static inline u64
+bench_rdtsc(void)
+{
+    u64 val;
+    asm volatile("rdtsc" : "=A"(val));
+    return val;
+}
+
+static u64
+now_ns(void)
+{
+    struct { u32 tv_sec, tv_nsec; } ts;
+    bench_syscall(SYS_clock_gettime, BENCH_CLOCK_MONOTONIC, (u32)&ts, 0);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Read exactly 'len' bytes of the benchmark input from stdin.
+static void
+bench_read(void *buf, u32 len)
+{
+    while (len) {
+        int ret = bench_syscall(SYS_read, 0, (u32)buf, len);
+        if (ret <= 0)
+            bench_fail("short input");
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static int
+bench_atoi(const char *s)
+{
+    int val = 0;
+    while (*s >= '0' && *s <= '9')
+        val = val * 10 + *s++ - '0';
+    return val;
+}
+
+
+/****************************************************************
+ * Measurement helpers
+ ****************************************************************/
+
+struct bench_s {
+    const char *name;
+    u64 ops, total, worst;
+    u64 cycles;         // Time stamp counter cycles of all operations
+    u32 bytes;          // Bytes processed per operation (0 if unused)
+    u64 start, startcycles;
+};
+
+// Start timing one operation
+static void
+bench_start(struct bench_s *b)
+{
+    b->start = now_ns();
+    b->startcycles = bench_rdtsc();
+}
+
+// Account the operation started with bench_start()
+static void
+bench_note(struct bench_s *b)
+{
+    u64 cycles = bench_rdtsc() - b->startcycles;
+    u64 t = now_ns() - b->start;
+    b->ops++;
+    b->total += t;
+    b->cycles += cycles;
+    if (t > b->worst)
+        b->worst = t;
+}
+
+// Print an optional "<key>=<value>" item of a result line
+static void
+bench_putitem(const char *key, u64 val)
+{
+    bench_puts(" ");
+    bench_puts(key);
+    bench_puts("=");
+    bench_putu64(val);
+}
+
+// Print a result line without the trailing newline (so that more
+// items can be added)
+static void
+bench_report_start(struct bench_s *b)
+{
+    bench_puts(b->name);
+    bench_puts(" ");
+    bench_putu64(b->ops);
+    bench_puts(" ");
+    bench_putu64(b->total);
+    bench_puts(" ");
+    bench_putu64(b->worst);
+    if (b->bytes) {
+        bench_putitem("bytes", b->bytes);
+        bench_putitem("cycles", b->cycles);
+    }
+}
+
+static void
+bench_report(struct bench_s *b)
+{
+    bench_report_start(b);
+    bench_puts("\n");
+}
+
+asm(
+    "  .globl _start\n"
+    "_start:\n"
+    "  movl %esp, %eax\n"
+    "  andl $-16, %esp\n"
+    "  calll bench_main\n"
+    );
+
+#endif // bench-host.h
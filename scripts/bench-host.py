@@ -0,0 +1,389 @@
+#!/usr/bin/env python
+# Build and run the host microbenchmarks of firmware hot paths - the
+# allocator, romfiles, hash functions, decoders, string functions and
+# pci resource layout.
+#
+# Copyright (C) 2026  SeaBIOS developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+# Usage:
+#   scripts/bench-host.py
+#   scripts/bench-host.py -t alloc
+#   scripts/bench-host.py -S baseline.json
+#   scripts/bench-host.py -b baseline.json -n 10
+#   scripts/bench-host.py -t sha
+#   scripts/bench-host.py -t decode
+#   scripts/bench-host.py -t string
+#   scripts/bench-host.py -t pci
+#
+# With "-t alloc" (the default) scripts/bench-alloc.c is compiled for
+# the host against the sources in src/ and the configuration of an
+# existing build (out/ by default).  It drives malloc.c (_malloc(), free(), alloc_new(),
+# alloc_free(), malloc_findhandle()) and romfile.c (romfile_find(),
+# romfile_findprefix()) with synthetic boot like workloads.  For each
+# operation the throughput and the worst case latency are reported;
+# both are medians of several runs.
+#
+# With "-t sha" scripts/bench-sha.c is run instead.  It hashes event
+# log, table and option rom sized buffers with sha1.c, sha256.c and
+# sha512.c, with and without the accelerated block functions of
+# sha_ni.c.  It is built as a freestanding 32bit program with the
+# firmware's code generation flags.
+#
+# With "-t decode" scripts/bench-decode.c is run the same way.  It
+# uncompresses an lzma copy of the built rom (bios.bin) with
+# lzmadecode.c and shows 640x480 jpeg and bmp splash images generated
+# by this script into a 32bpp buffer with jpeg.c and bmp.c.  The
+# uncompressed rom is checked against bios.bin.  When the host has
+# sse2 it first checks that the sse2 jpeg code gives exactly the same
+# output as the scalar code.
+#
+# With "-t string" scripts/bench-string.c times memset() and memcpy()
+# (aligned and misaligned) of string.c on 4KiB to 16MiB buffers - with
+# the cpu features string_preinit() detected, without any ("_plain")
+# and against a byte loop ("_bytes").
+#
+# With "-t pci" scripts/bench-pci.c replays the bar and bridge window
+# layout of pciinit.c for a few topologies, against the old
+# ALIGN(sum, align) window sizing ("_old").  It reports the time and
+# the part of the address space needed at the root bus that device
+# bars use ("util").
+#
+# The freestanding benchmarks report the bytes they process where that
+# is meaningful (the sha, decode and string workloads).  For those the
+# throughput in MB/s ("mbs") and the time stamp counter cycles per byte
+# ("cpb") are shown as well.
+
+import sys, os, subprocess, tempfile, shutil, json, optparse, struct
+
+# Operations per workload in each run
+COUNT = {"alloc": 20000, "sha": 2000, "decode": 20, "string": 256
+         , "pci": 2000}
+
+# Compiler flags of each benchmark
+CFLAGS = {
+    "alloc": ["-O2", "-fno-pie", "-no-pie"],
+    "sha": ["-m32", "-march=i386", "-Os", "-mregparm=3"
+            , "-mpreferred-stack-boundary=2", "-ffreestanding", "-nostdlib"
+            , "-static", "-fno-pie", "-no-pie", "-fno-stack-protector"
+            , "-fcf-protection=none"],
+}
+# These pull in parts of the firmware that aren't used
+for target in ["decode", "string", "pci"]:
+    CFLAGS[target] = CFLAGS["sha"] + ["-ffunction-sections", "-fdata-sections"
+                                      , "-Wl,--gc-sections"]
+
+def build(options, tmpdir):
+    srcdir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+    if not os.path.exists(os.path.join(options.out, "autoconf.h")):
+        sys.stderr.write("No autoconf.h in %s - run make first\n"
+                         % (options.out,))
+        sys.exit(1)
+    name = "bench-" + options.target
+    binary = os.path.join(tmpdir, name)
+    cmd = ([options.cc] + CFLAGS[options.target]
+           + ["-fno-strict-aliasing", "-w", "-I" + options.out
+              , "-I" + os.path.join(srcdir, "src")
+              , "-DMODE16=0", "-DMODESEGMENT=0"
+              , os.path.join(srcdir, "scripts", name + ".c"), "-o", binary])
+    subprocess.check_call(cmd)
+    return binary
+
+def runone(binary, count, data):
+    proc = subprocess.Popen([binary, str(count)], stdin=subprocess.PIPE
+                            , stdout=subprocess.PIPE)
+    out = proc.communicate(data)[0].decode()
+    res = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if parts[0] == "error:":
+            sys.stderr.write("%s\n" % (line,))
+            sys.exit(1)
+        name, ops, total, worst = parts[0], int(parts[1]), int(parts[2]), int(parts[3])
+        r = res[name] = {"kops": ops * 1000000.0 / max(total, 1)
+                         , "worst": worst / 1000.0}
+        # Optional "<key>=<value>" items
+        nbytes = 0
+        for item in parts[4:]:
+            key, val = item.split("=")
+            if key == "bytes":
+                nbytes = ops * int(val)
+                r["mbs"] = nbytes * 1000.0 / max(total, 1)
+            else:
+                r[key] = float(val)
+        if "cycles" in r and nbytes:
+            r["cpb"] = r.pop("cycles") / nbytes
+        if "used" in r and "size" in r:
+            r["util"] = r["used"] * 100.0 / max(r["size"], 1)
+    if proc.returncode:
+        sys.stderr.write("%s failed\n" % (binary,))
+        sys.exit(1)
+    return res
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+######################################################################
+# Benchmark inputs
+######################################################################
+
+# Zigzag order of the coefficients of an 8x8 block
+ZIGZAG = [
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63]
+
+# Example quantization and huffman tables of the jpeg standard (annex K)
+JPEG_QUANT = [
+    [16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+     14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+     18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+     49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99],
+    [17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+     24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99]
+    + [99] * 32]
+JPEG_DC_BITS = [
+    [0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0],
+    [0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0]]
+JPEG_DC_VALS = list(range(12))
+JPEG_AC_BITS = [
+    [0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d],
+    [0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77]]
+JPEG_AC_VALS = [bytes.fromhex(
+    "01020300041105122131410613516107227114328191a1082342b1c11552d1f0"
+    "2433627282090a161718191a25262728292a3435363738393a43444546474849"
+    "4a535455565758595a636465666768696a737475767778797a83848586878889"
+    "8a92939495969798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5"
+    "c6c7c8c9cad2d3d4d5d6d7d8d9dae1e2e3e4e5e6e7e8e9eaf1f2f3f4f5f6f7f8"
+    "f9fa"), bytes.fromhex(
+    "000102031104052131061241510761711322328108144291a1b1c109233352f0"
+    "156272d10a162434e125f11718191a262728292a35363738393a434445464748"
+    "494a535455565758595a636465666768696a737475767778797a828384858687"
+    "88898a92939495969798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3"
+    "c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae2e3e4e5e6e7e8e9eaf2f3f4f5f6f7f8"
+    "f9fa")]
+
+# Test picture - smooth gradients with some sharp edges
+def picture(x, y, width, height):
+    r = x * 255 // width
+    g = y * 255 // height
+    b = 255 if ((x // 40) + (y // 30)) % 2 else (x * y) & 0xff
+    return r, g, b
+
+def jpeg_huffcodes(bits, vals):
+    codes = {}
+    code = pos = 0
+    for length in range(1, 17):
+        for i in range(bits[length - 1]):
+            codes[vals[pos]] = (code, length)
+            code += 1
+            pos += 1
+        code <<= 1
+    return codes
+
+# Encode a baseline jpeg with 2x2 subsampled chroma - the only format
+# jpeg.c supports.
+def jpeg_image(width, height):
+    import math
+    cos = [[(math.sqrt(0.5) if u == 0 else 1.0) / 2
+            * math.cos((2 * x + 1) * u * math.pi / 16) for x in range(8)]
+           for u in range(8)]
+    ycc = [[], [], []]
+    for y in range(height):
+        for i in range(3):
+            ycc[i].append([])
+        for x in range(width):
+            r, g, b = picture(x, y, width, height)
+            ycc[0][y].append(0.299 * r + 0.587 * g + 0.114 * b - 128)
+            ycc[1][y].append(-0.1687 * r - 0.3313 * g + 0.5 * b)
+            ycc[2][y].append(0.5 * r - 0.4187 * g - 0.0813 * b)
+    for i in (1, 2):
+        plane = ycc[i]
+        ycc[i] = [[(plane[2*y][2*x] + plane[2*y][2*x+1] + plane[2*y+1][2*x]
+                    + plane[2*y+1][2*x+1]) / 4 for x in range(width // 2)]
+                  for y in range(height // 2)]
+    dccodes = [jpeg_huffcodes(JPEG_DC_BITS[i], JPEG_DC_VALS) for i in (0, 1)]
+    accodes = [jpeg_huffcodes(JPEG_AC_BITS[i], JPEG_AC_VALS[i])
+               for i in (0, 1)]
+    out = bytearray()
+    state = [0, 0]      # bit buffer, bit count
+    def putbits(code, length):
+        state[0] = (state[0] << length) | code
+        state[1] += length
+        while state[1] >= 8:
+            state[1] -= 8
+            c = (state[0] >> state[1]) & 0xff
+            out.append(c)
+            if c == 0xff:
+                out.append(0)
+    def putval(codes, sym, val, size):
+        putbits(*codes[sym])
+        if size:
+            putbits(val if val >= 0 else val + (1 << size) - 1, size)
+    pred = [0, 0, 0]
+    def block(comp, plane, bx, by):
+        rows = [plane[by + y][bx:bx + 8] for y in range(8)]
+        tmp = [[sum(cos[u][x] * rows[y][x] for x in range(8))
+                for u in range(8)] for y in range(8)]
+        q = JPEG_QUANT[comp > 0]
+        coef = [0] * 64
+        for v in range(8):
+            for u in range(8):
+                f = sum(cos[v][y] * tmp[y][u] for y in range(8))
+                coef[v * 8 + u] = int(round(f / q[v * 8 + u]))
+        t = comp > 0
+        diff = coef[0] - pred[comp]
+        pred[comp] = coef[0]
+        size = abs(diff).bit_length()
+        putval(dccodes[t], size, diff, size)
+        run = 0
+        for k in range(1, 64):
+            val = coef[ZIGZAG[k]]
+            if not val:
+                run += 1
+                continue
+            while run > 15:
+                putbits(*accodes[t][0xf0])
+                run -= 16
+            size = abs(val).bit_length()
+            putval(accodes[t], (run << 4) | size, val, size)
+            run = 0
+        if run:
+            putbits(*accodes[t][0x00])
+    for my in range(0, height, 16):
+        for mx in range(0, width, 16):
+            for i in range(4):
+                block(0, ycc[0], mx + (i & 1) * 8, my + (i >> 1) * 8)
+            block(1, ycc[1], mx // 2, my // 2)
+            block(2, ycc[2], mx // 2, my // 2)
+    if state[1]:
+        putbits((1 << (8 - state[1])) - 1, 8 - state[1])
+    def segment(marker, data):
+        return struct.pack(">BBH", 0xff, marker, len(data) + 2) + data
+    hdr = b"\xff\xd8"
+    for i in (0, 1):
+        hdr += segment(0xdb, bytes([i]) + bytes(
+            JPEG_QUANT[i][ZIGZAG[k]] for k in range(64)))
+    hdr += segment(0xc0, struct.pack(">BHHB", 8, height, width, 3)
+                   + bytes([1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1]))
+    for i in (0, 1):
+        hdr += segment(0xc4, bytes([i]) + bytes(JPEG_DC_BITS[i])
+                       + bytes(JPEG_DC_VALS))
+        hdr += segment(0xc4, bytes([0x10 | i]) + bytes(JPEG_AC_BITS[i])
+                       + JPEG_AC_VALS[i])
+    hdr += segment(0xda, bytes([3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0]))
+    return hdr + bytes(out) + b"\xff\xd9"
+
+# Encode a bottom-up 24bpp bmp
+def bmp_image(width, height):
+    stride = (width * 3 + 3) & ~3
+    data = bytearray()
+    for y in reversed(range(height)):
+        for x in range(width):
+            r, g, b = picture(x, y, width, height)
+            data += bytes([b, g, r])
+        data += bytes(stride - width * 3)
+    hdr = struct.pack("<2sIHHIIiiHHIIiiII", b"BM", 54 + len(data), 0, 0, 54
+                      , 40, width, height, 1, 24, 0, len(data), 2835, 2835
+                      , 0, 0)
+    return hdr + bytes(data)
+
+# The decode benchmark uncompresses the built rom (a typical lzma
+# compressed payload), checks the result against the rom and shows a
+# 640x480 jpeg and bmp splash image.
+def decode_input(options):
+    import lzma
+    with open(os.path.join(options.out, "bios.bin"), "rb") as f:
+        raw = f.read()
+    comp = bytearray(lzma.compress(raw, format=lzma.FORMAT_ALONE))
+    comp[5:13] = struct.pack("<Q", len(raw))
+    blobs = [bytes(comp), raw, jpeg_image(640, 480), bmp_image(640, 480)]
+    return (b"".join(struct.pack("<I", len(b)) for b in blobs)
+            + b"".join(blobs))
+
+# Input passed on stdin to each benchmark
+INPUT = {"decode": decode_input}
+
+
+######################################################################
+# Reporting
+######################################################################
+
+METRICS = ["kops", "worst", "mbs", "cpb", "util"]
+UNITS = {"kops": "kops/s", "worst": "us", "mbs": "MB/s", "cpb": "cycles/B"
+         , "util": "%"}
+
+def report(results, baseline):
+    metrics = [m for m in METRICS
+               if [r for r in results.values() if m in r]]
+    sys.stdout.write("%-28s" % ("operation",))
+    for metric in metrics:
+        sys.stdout.write(" %20s" % ("%s (%s)" % (metric, UNITS[metric]),))
+    sys.stdout.write("\n")
+    for name in sorted(results):
+        res = results[name]
+        base = baseline.get(name, {})
+        sys.stdout.write("%-28s" % (name,))
+        for metric in metrics:
+            if metric not in res:
+                sys.stdout.write(" %20s" % ("-",))
+                continue
+            val = ("%.2f" if metric == "cpb" else "%.1f") % (res[metric],)
+            if base.get(metric):
+                delta = (res[metric] - base[metric]) * 100.0 / base[metric]
+                val += " (%+.1f%%)" % (delta,)
+            sys.stdout.write(" %20s" % (val,))
+        sys.stdout.write("\n")
+
+def main():
+    opts = optparse.OptionParser("%prog [options]")
+    opts.add_option("-o", "--out", dest="out", default="out"
+                    , help="build directory with the configuration to use")
+    opts.add_option("-t", "--target", dest="target", default="alloc"
+                    , choices=sorted(COUNT)
+                    , help="benchmark to run (alloc, sha, decode, string"
+                    " or pci)")
+    opts.add_option("--cc", dest="cc", default="gcc"
+                    , help="host compiler")
+    opts.add_option("-n", "--runs", dest="runs", type="int", default=5
+                    , help="number of runs")
+    opts.add_option("-b", "--baseline", dest="baseline", default=None
+                    , help="compare against results saved in this file")
+    opts.add_option("-S", "--save", dest="save", default=None
+                    , help="save the results to this file")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+
+    baseline = {}
+    if options.baseline:
+        with open(options.baseline) as f:
+            baseline = json.load(f)
+
+    tmpdir = tempfile.mkdtemp(prefix="seabios-bench-")
+    try:
+        binary = build(options, tmpdir)
+        data = INPUT.get(options.target, lambda options: b"")(options)
+        runs = [runone(binary, COUNT[options.target], data)
+                for i in range(options.runs)]
+    finally:
+        shutil.rmtree(tmpdir)
+
+    results = {}
+    for name in runs[0]:
+        results[name] = dict(
+            (metric, round(median([r[name][metric] for r in runs]), 3))
+            for metric in METRICS if metric in runs[0][name])
+
+    report(results, baseline)
+    if options.save:
+        with open(options.save, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,272 @@
+// Host replay of the pci bar and bridge window layout.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// This is built and run on the host by "scripts/bench-host.py -t pci".
+// Like bench-sha.c it is a freestanding 32bit program built with the
+// firmware's code generation flags - see bench-host.h.
+//
+// Each topology is replayed through pci_region_create_entry() and
+// pci_region_layout() the way pci_bios_check_devices() sizes the
+// bridge windows (without hotplug or qemu reservations).  The "_old"
+// runs size windows as ALIGN(sum, align) and place entries one after
+// the other, as before pci_region_layout().  Besides the time, the
+// space needed at the root bus and the part of it used by device bars
+// are reported.
+
+#include "../src/fw/pciinit.c"
+#include "bench-host.h"
+
+
+/****************************************************************
+ * Firmware stubs
+ ****************************************************************/
+
+void __dprintf(const char *fmt, ...) { }
+
+void
+__warn_noalloc(int lineno, const char *fname)
+{
+    bench_fail("out of memory");
+}
+
+// Simple bump allocator for the region entries (reset between runs)
+struct zone_s { int dummy; } ZoneTmpHigh, ZoneTmpLow;
+static u8 Heap[256*1024] __aligned(MALLOC_MIN_ALIGN);
+static u32 HeapUsed;
+
+void *
+_malloc(struct zone_s *zone, u32 size, u32 align)
+{
+    u32 pos = ALIGN(HeapUsed, align);
+    if (pos + size > sizeof(Heap))
+        return NULL;
+    HeapUsed = pos + size;
+    return &Heap[pos];
+}
+
+void *
+memset(void *s, int c, size_t n)
+{
+    u8 *p = s;
+    while (n--)
+        *p++ = c;
+    return s;
+}
+
+
+/****************************************************************
+ * Topologies
+ ****************************************************************/
+
+#define MAX_BUS 32
+
+// A device bar (or, with 'bus' > 0 and 'size' 0, the bridge to 'bus')
+struct bench_bar_s {
+    u8 bus, parent;
+    u8 type;
+    u64 size;
+};
+
+#define IO PCI_REGION_TYPE_IO
+#define MEM PCI_REGION_TYPE_MEM
+#define PREF PCI_REGION_TYPE_PREFMEM
+#define KB(n) ((u64)(n) << 10)
+#define MB(n) ((u64)(n) << 20)
+#define GB(n) ((u64)(n) << 30)
+#define BRIDGE(bus, parent) { bus, parent, 0, 0 }
+#define BAR(bus, type, size) { bus, 0, type, size }
+
+// Two gpus behind their own root ports
+static struct bench_bar_s TopoGpu[] = {
+    BRIDGE(1, 0), BRIDGE(2, 0),
+    BAR(1, PREF, GB(16)), BAR(1, PREF, MB(32)), BAR(1, MEM, MB(16)),
+    BAR(1, MEM, KB(512)), BAR(1, IO, 0x80),
+    BAR(2, PREF, GB(16)), BAR(2, PREF, MB(32)), BAR(2, MEM, MB(16)),
+    BAR(2, MEM, KB(512)), BAR(2, IO, 0x80),
+    BAR(0, MEM, KB(16)), BAR(0, IO, 0x40),
+};
+
+// A q35 guest with a virtio device on each of eight root ports
+static struct bench_bar_s TopoQ35[] = {
+    BRIDGE(1, 0), BRIDGE(2, 0), BRIDGE(3, 0), BRIDGE(4, 0),
+    BRIDGE(5, 0), BRIDGE(6, 0), BRIDGE(7, 0), BRIDGE(8, 0),
+    BAR(1, MEM, KB(4)), BAR(1, PREF, KB(16)), BAR(1, IO, 0x40),
+    BAR(2, MEM, KB(4)), BAR(2, PREF, KB(16)), BAR(2, IO, 0x40),
+    BAR(3, MEM, KB(4)), BAR(3, PREF, KB(16)),
+    BAR(4, MEM, KB(4)), BAR(4, PREF, KB(16)),
+    BAR(5, MEM, KB(16)), BAR(5, PREF, MB(1)),
+    BAR(6, MEM, KB(16)),
+    BAR(7, PREF, MB(8)), BAR(7, MEM, KB(4)),
+    BAR(8, MEM, KB(4)),
+    BAR(0, PREF, MB(16)), BAR(0, MEM, KB(4)), BAR(0, IO, 0x20),
+    BAR(0, MEM, KB(4)), BAR(0, IO, 0x40),
+};
+
+// A switch with gpus and nvme drives on its downstream ports
+static struct bench_bar_s TopoSwitch[] = {
+    BRIDGE(1, 0), BRIDGE(2, 1), BRIDGE(3, 1), BRIDGE(4, 1), BRIDGE(5, 1),
+    BRIDGE(6, 0),
+    BAR(2, PREF, MB(256)), BAR(2, MEM, MB(16)), BAR(2, PREF, MB(32)),
+    BAR(3, PREF, MB(256)), BAR(3, MEM, MB(16)), BAR(3, PREF, MB(32)),
+    BAR(4, MEM, KB(16)), BAR(4, MEM, KB(16)),
+    BAR(5, MEM, KB(16)),
+    BAR(6, MEM, MB(4)), BAR(6, MEM, KB(256)), BAR(6, IO, 0x20),
+    BAR(0, MEM, KB(4)), BAR(0, IO, 0x40),
+};
+
+struct bench_topo_s {
+    const char *name;
+    struct bench_bar_s *bars;
+    int count;
+};
+
+static struct bench_topo_s Topos[] = {
+    { "gpu", TopoGpu, ARRAY_SIZE(TopoGpu) },
+    { "q35", TopoQ35, ARRAY_SIZE(TopoQ35) },
+    { "switch", TopoSwitch, ARRAY_SIZE(TopoSwitch) },
+};
+
+
+/****************************************************************
+ * Replay
+ ****************************************************************/
+
+static struct pci_bus Busses[MAX_BUS];
+static u8 Parents[MAX_BUS];
+
+// Size a region the way the code before pci_region_layout() did
+static u64
+old_region_sum(struct pci_region *r)
+{
+    u64 sum = 0;
+    struct pci_region_entry *entry;
+    hlist_for_each_entry(entry, &r->list, node) {
+        entry->offset = sum;
+        sum += entry->size;
+    }
+    return sum;
+}
+
+// Check that the entries of a region are aligned and don't overlap
+static void
+check_region(struct pci_region *r, u64 size)
+{
+    struct pci_region_entry *entry, *other;
+    hlist_for_each_entry(entry, &r->list, node) {
+        if (entry->offset & (entry->align - 1)
+            || entry->offset + entry->size > size)
+            bench_fail("misplaced entry");
+        hlist_for_each_entry(other, &r->list, node) {
+            if (other != entry && other->offset < entry->offset + entry->size
+                && entry->offset < other->offset + other->size)
+                bench_fail("overlapping entries");
+        }
+    }
+}
+
+// Replay one topology - returns the total size of the root regions
+static u64
+replay(struct bench_topo_s *topo, int old, int check)
+{
+    int i, bus, type, maxbus = 0;
+    HeapUsed = 0;
+    memset(Busses, 0, sizeof(Busses));
+    for (i = 0; i < topo->count; i++) {
+        struct bench_bar_s *bar = &topo->bars[i];
+        if (bar->size) {
+            if (!pci_region_create_entry(&Busses[bar->bus], NULL, i
+                                         , bar->size, bar->size, bar->type
+                                         , bar->size > GB(4)))
+                bench_fail("create entry");
+            continue;
+        }
+        Parents[bar->bus] = bar->parent;
+        if (bar->bus > maxbus)
+            maxbus = bar->bus;
+    }
+
+    // Propagate the bridge windows (see pci_bios_check_devices())
+    for (bus = maxbus; bus > 0; bus--) {
+        struct pci_bus *s = &Busses[bus];
+        for (type = 0; type < PCI_REGION_TYPE_COUNT; type++) {
+            u64 gran = (type == PCI_REGION_TYPE_IO) ?
+                PCI_BRIDGE_IO_MIN : PCI_BRIDGE_MEM_MIN;
+            u64 align = gran;
+            if (pci_region_align(&s->r[type]) > align)
+                align = pci_region_align(&s->r[type]);
+            u64 sum, size;
+            if (old) {
+                sum = old_region_sum(&s->r[type]);
+                size = ALIGN(sum, align);
+            } else {
+                sum = pci_region_layout(&s->r[type]);
+                size = ALIGN(sum, gran);
+            }
+            if (check)
+                check_region(&s->r[type], size);
+            if (!sum)
+                continue;
+            if (!pci_region_create_entry(&Busses[Parents[bus]], NULL, -1
+                                         , size, align, type, 0))
+                bench_fail("create entry");
+        }
+    }
+
+    u64 total = 0;
+    for (type = 0; type < PCI_REGION_TYPE_COUNT; type++) {
+        struct pci_region *r = &Busses[0].r[type];
+        u64 size = old ? old_region_sum(r) : pci_region_layout(r);
+        if (check)
+            check_region(r, size);
+        total += size;
+    }
+    return total;
+}
+
+static void
+bench_topo(struct bench_topo_s *topo, int old, int count)
+{
+    char name[32], *p = name;
+    const char *q = topo->name;
+    while (*q)
+        *p++ = *q++;
+    if (old) {
+        q = "_old";
+        while (*q)
+            *p++ = *q++;
+    }
+    *p = '\0';
+
+    struct bench_s b = { name };
+    u64 size = replay(topo, old, 1), used = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        bench_start(&b);
+        replay(topo, old, 0);
+        bench_note(&b);
+    }
+    for (i = 0; i < topo->count; i++)
+        used += topo->bars[i].size;
+    // Add the space used by bars and the space needed at the root bus
+    bench_report_start(&b);
+    bench_putitem("used", used);
+    bench_putitem("size", size);
+    bench_puts("\n");
+}
+
+void __noreturn VISIBLE32FLAT
+bench_main(u32 *sp)
+{
+    u32 argc = sp[0];
+    char **argv = (char**)&sp[1];
+    int count = argc > 1 ? bench_atoi(argv[1]) : 2000;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(Topos); i++) {
+        bench_topo(&Topos[i], 0, count);
+        bench_topo(&Topos[i], 1, count);
+    }
+    bench_exit(0);
+}
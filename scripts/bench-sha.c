@@ -0,0 +1,174 @@
+// Host microbenchmark of the sha1/sha256/sha384/sha512 implementations.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// This is built and run on the host by "scripts/bench-host.py -t sha".
+// Unlike bench-alloc.c it is a freestanding 32bit program built with
+// the firmware's code generation flags (the cost of the 64bit math in
+// sha512 depends on it) - see bench-host.h.
+
+#include "x86.h" // sse_enable
+
+// The SSE state doesn't need enabling in a user space process (and
+// control registers can't be written there).
+#define sse_enable(cr0, cr4) do { } while (0)
+#define sse_restore(cr0, cr4) do { } while (0)
+
+#include "../src/sha1.c"
+#include "../src/sha256.c"
+#include "../src/sha512.c"
+#include "../src/sha_ni.c"
+#include "bench-host.h"
+
+
+/****************************************************************
+ * Firmware stubs
+ ****************************************************************/
+
+int HaveRunPost = 1;
+
+void __dprintf(const char *fmt, ...) { }
+
+void
+cpuid(u32 index, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    __cpuid(index, eax, ebx, ecx, edx);
+}
+
+size_t
+strlen(const char *s)
+{
+    const char *p = s;
+    while (*p)
+        p++;
+    return p - s;
+}
+
+int
+memcmp(const void *s1, const void *s2, size_t n)
+{
+    const u8 *a = s1, *b = s2;
+    for (; n; n--, a++, b++)
+        if (*a != *b)
+            return *a < *b ? -1 : 1;
+    return 0;
+}
+
+void *
+memset(void *s, int c, size_t n)
+{
+    u8 *p = s;
+    while (n--)
+        *p++ = c;
+    return s;
+}
+
+#undef memcpy
+void *
+memcpy(void *d1, const void *s1, size_t len)
+{
+    u8 *d = d1;
+    const u8 *s = s1;
+    while (len--)
+        *d++ = *s++;
+    return d1;
+}
+
+void
+iomemcpy(void *d, const void *s, u32 len)
+{
+    memcpy(d, s, len);
+}
+
+
+/****************************************************************
+ * Workloads
+ ****************************************************************/
+
+// Input sizes - a tpm event log entry, a table and an option rom
+static const u32 Sizes[] = { 64, 4096, 65536 };
+static const char *SizeNames[] = { "64", "4k", "64k" };
+
+static u8 Data[65536] __aligned(16);
+
+struct bench_hash_s {
+    const char *name;
+    void (*hash)(const u8 *data, u32 length, u8 *hash);
+    int *accel;         // Enable flag of the accelerated version
+    const char *accelname;
+};
+
+static void
+bench_hash(struct bench_hash_s *bh, int accel, int count)
+{
+    int i, s;
+    for (s = 0; s < ARRAY_SIZE(Sizes); s++) {
+        int ops = Sizes[s] >= 65536 ? count / 16 : count;
+        struct bench_s b = { .bytes = Sizes[s] };
+        for (i = 0; i < ops; i++) {
+            u8 hash[64];
+            bench_start(&b);
+            bh->hash(Data, Sizes[s], hash);
+            bench_note(&b);
+        }
+
+        char name[32], *p = name;
+        const char *parts[] = { bh->name, SizeNames[s]
+                                , accel ? bh->accelname : NULL };
+        int j;
+        for (j = 0; j < ARRAY_SIZE(parts) && parts[j]; j++) {
+            const char *q = parts[j];
+            if (j)
+                *p++ = '_';
+            while (*q)
+                *p++ = *q++;
+        }
+        *p = '\0';
+        b.name = name;
+        bench_report(&b);
+    }
+}
+
+static struct bench_hash_s Hashes[] = {
+    { "sha1", sha1, &ShaNiEnabled, "ni" },
+    { "sha256", sha256, &ShaNiEnabled, "ni" },
+    { "sha384", sha384, &Sha512Sse2Enabled, "sse2" },
+    { "sha512", sha512, &Sha512Sse2Enabled, "sse2" },
+};
+
+void __noreturn VISIBLE32FLAT
+bench_main(u32 *sp)
+{
+    u32 argc = sp[0];
+    char **argv = (char**)&sp[1];
+    int count = argc > 1 ? bench_atoi(argv[1]) : 2000;
+    int i;
+    for (i = 0; i < sizeof(Data); i++)
+        Data[i] = i * 7 + (i >> 8);
+
+    // Detect (and self test) the accelerated versions
+    sha_ni_setup();
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if ((edx & CPUID_SSE2) && !Sha512Sse2Enabled)
+        bench_fail("sse2 sha512 failed self test");
+    int avail[ARRAY_SIZE(Hashes)];
+    for (i = 0; i < ARRAY_SIZE(Hashes); i++)
+        avail[i] = *Hashes[i].accel;
+    ShaNiEnabled = Sha512Sse2Enabled = 0;
+    if (sha_selftest())
+        bench_fail("sha self test failed");
+
+    for (i = 0; i < ARRAY_SIZE(Hashes); i++) {
+        *Hashes[i].accel = 0;
+        bench_hash(&Hashes[i], 0, count);
+        if (!avail[i])
+            continue;
+        *Hashes[i].accel = 1;
+        bench_hash(&Hashes[i], 1, count);
+        *Hashes[i].accel = 0;
+    }
+    bench_exit(0);
+}
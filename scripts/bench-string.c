@@ -0,0 +1,139 @@
+// Host microbenchmark of the memcpy and memset implementations.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+// This is built and run on the host by "scripts/bench-host.py -t
+// string".  Like bench-sha.c it is a freestanding 32bit program built
+// with the firmware's code generation flags - see bench-host.h.
+
+#include "../src/string.c"
+#include "bench-host.h"
+
+
+/****************************************************************
+ * Firmware stubs
+ ****************************************************************/
+
+void __dprintf(const char *fmt, ...) { }
+
+void yield(void) { }
+
+void
+cpuid(u32 index, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    __cpuid(index, eax, ebx, ecx, edx);
+}
+
+
+/****************************************************************
+ * Workloads
+ ****************************************************************/
+
+// Buffer sizes - a sector buffer, an option rom, a ramdisk chunk and
+// a large memory region being cleared
+static const u32 Sizes[] = { 4096, 65536, 1024*1024, 16*1024*1024 };
+static const char *SizeNames[] = { "4k", "64k", "1m", "16m" };
+#define MAX_SIZE (16*1024*1024)
+
+// Room for a misaligned destination
+static u8 Src[MAX_SIZE + 16] __aligned(64);
+static u8 Dest[MAX_SIZE + 16] __aligned(64);
+
+// Reference byte loops (kept out of line so the compiler doesn't turn
+// them back into calls to memset/memcpy)
+static void noinline
+memset_bytes(void *s, int c, size_t n)
+{
+    u8 *p = s;
+    while (n--) {
+        *p++ = c;
+        barrier();
+    }
+}
+
+static void noinline
+memcpy_bytes(void *d, const void *s, size_t n)
+{
+    u8 *dp = d;
+    const u8 *sp = s;
+    while (n--) {
+        *dp++ = *sp++;
+        barrier();
+    }
+}
+
+enum { OP_MEMSET, OP_MEMCPY, OP_MEMCPY_UNALIGNED };
+static const char *OpNames[] = { "memset", "memcpy", "memcpy_unaligned" };
+
+// Implementation: the firmware's with the detected features, the
+// firmware's without any (the "rep stosl/movsl" paths), or a byte loop.
+enum { IMPL_FW, IMPL_PLAIN, IMPL_BYTES };
+static const char *ImplNames[] = { NULL, "plain", "bytes" };
+
+static void
+bench_string(int op, int impl, u8 features, int count)
+{
+    int i, s;
+    for (s = 0; s < ARRAY_SIZE(Sizes); s++) {
+        u32 size = Sizes[s];
+        // Touch the same amount of memory for every size
+        int ops = (u32)count * 65536 / size;
+        if (ops < 4)
+            ops = 4;
+        u8 *d = op == OP_MEMCPY_UNALIGNED ? Dest + 1 : Dest;
+        struct bench_s b = { .bytes = size };
+        StringFeatures = impl == IMPL_FW ? features : 0;
+        for (i = 0; i < ops; i++) {
+            bench_start(&b);
+            if (op == OP_MEMSET) {
+                if (impl == IMPL_BYTES)
+                    memset_bytes(d, i, size);
+                else
+                    memset(d, i, size);
+            } else {
+                if (impl == IMPL_BYTES)
+                    memcpy_bytes(d, Src, size);
+                else
+                    memcpy(d, Src, size);
+            }
+            bench_note(&b);
+        }
+        if (d[size - 1] != (op == OP_MEMSET ? (u8)(ops - 1) : Src[size - 1]))
+            bench_fail("bad result");
+
+        char name[64], *p = name;
+        const char *parts[] = { OpNames[op], SizeNames[s], ImplNames[impl] };
+        int j;
+        for (j = 0; j < ARRAY_SIZE(parts) && parts[j]; j++) {
+            const char *q = parts[j];
+            if (j)
+                *p++ = '_';
+            while (*q)
+                *p++ = *q++;
+        }
+        *p = '\0';
+        b.name = name;
+        bench_report(&b);
+    }
+}
+
+void __noreturn VISIBLE32FLAT
+bench_main(u32 *sp)
+{
+    u32 argc = sp[0];
+    char **argv = (char**)&sp[1];
+    int count = argc > 1 ? bench_atoi(argv[1]) : 256;
+    int i, op, impl;
+    for (i = 0; i < sizeof(Src); i++)
+        Src[i] = i * 7 + (i >> 8);
+
+    string_preinit();
+    u8 features = StringFeatures;
+
+    for (op = 0; op < ARRAY_SIZE(OpNames); op++)
+        for (impl = 0; impl < ARRAY_SIZE(ImplNames); impl++)
+            bench_string(op, impl, features, count);
+    bench_exit(0);
+}
@@ -15,6 +15,36 @@ def checksum(data, start, size, csum):
     sumbyte = buildrom.checksum(data[start:start+size])
     return subst(data, start+csum, sumbyte)
 
+# Compress data in the lzma format understood by src/fw/lzmadecode.c
+def lzmacompress(data):
+    import lzma
+    filters = [{"id": lzma.FILTER_LZMA1, "preset": 9 | lzma.PRESET_EXTREME,
+                "lc": 3, "lp": 0, "pb": 2}]
+    comp = lzma.compress(data, format=lzma.FORMAT_ALONE, filters=filters)
+    # The decoder needs the uncompressed size in the header
+    return comp[:5] + struct.pack('<Q', len(data)) + comp[13:]
+
+# Replace the init code that runs after relocation with its compressed
+# form (CONFIG_COMPRESS_INIT).  The compressed stream and its length
+# end where the uncompressed code ended (see post.c:copy_init()) and
+# the image is cut down to start with it.
+def compressinit(rawdata, symbols):
+    start = symbols['code32flat_start'].offset
+    initofs = symbols['code32init_start'].offset - start
+    mainofs = symbols['code32init_main_end'].offset - start
+    if initofs != 0:
+        print("Error!  Init code not at start of image (0x%x)" % (initofs,))
+        sys.exit(1)
+    comp = lzmacompress(rawdata[initofs:mainofs])
+    comp += struct.pack('<I', len(comp))
+    compofs = mainofs - len(comp)
+    if compofs < 0:
+        print("Error!  Compressed init code is larger than the original")
+        sys.exit(1)
+    print("Init code compressed from %d to %d bytes" % (mainofs, len(comp)))
+    cut = compofs & ~15
+    return b"\0" * (compofs - cut) + comp + rawdata[mainofs:]
+
 def main():
     # Get args
     objinfo, finalsize, rawfile, outfile = sys.argv[1:]
@@ -28,20 +58,6 @@ def main():
     rawdata = f.read()
     f.close()
     datasize = len(rawdata)
-    finalsize = int(finalsize) * 1024
-    if finalsize == 0:
-        finalsize = 64*1024
-        if datasize > 64*1024:
-            finalsize = 128*1024
-            if datasize > 128*1024:
-                finalsize = 256*1024
-    if datasize > finalsize:
-        print("Error!  ROM doesn't fit (%d > %d)" % (datasize, finalsize))
-        print("   You have to either increase the size (CONFIG_ROM_SIZE)")
-        print("   or turn off some features (such as hardware support not")
-        print("   needed) to make it fit.  Trying a more recent gcc version")
-        print("   might work too.")
-        sys.exit(1)
 
     # Sanity checks
     start = symbols['code32flat_start'].offset
@@ -51,10 +67,6 @@ def main():
         print("Error!  Code does not end at 0x%x (got 0x%x)" % (
             expend, end))
         sys.exit(1)
-    if datasize > finalsize:
-        print("Error!  Code is too big (0x%x vs 0x%x)" % (
-            datasize, finalsize))
-        sys.exit(1)
     expdatasize = end - start
     if datasize != expdatasize:
         print("Error!  Unknown extra data (0x%x vs 0x%x)" % (
@@ -77,8 +89,30 @@ def main():
         tablesize = ord(rawdata[tsfield:tsfield+1])
         rawdata = checksum(rawdata, tableofs, tablesize, CSUM_FIELD_OFS)
 
+    if 'code32init_main_end' in symbols:
+        rawdata = compressinit(rawdata, symbols)
+        datasize = len(rawdata)
+
+    finalsize = int(finalsize) * 1024
+    if finalsize == 0:
+        finalsize = 64*1024
+        if datasize > 64*1024:
+            finalsize = 128*1024
+            if datasize > 128*1024:
+                finalsize = 256*1024
+    if datasize > finalsize:
+        print("Error!  ROM doesn't fit (%d > %d)" % (datasize, finalsize))
+        print("   You have to either increase the size (CONFIG_ROM_SIZE)")
+        print("   or turn off some features (such as hardware support not")
+        print("   needed) to make it fit.  Trying a more recent gcc version")
+        print("   might work too.")
+        sys.exit(1)
+
     # Print statistics
     runtimesize = end - symbols['code32init_end'].offset
+    if 'code32init_main_end' in symbols:
+        # The low memory data and relocations follow the init code
+        runtimesize = end - symbols['varlow_end'].offset
     print("Total size: %d  Fixed: %d  Free: %d (used %.1f%% of %dKiB rom)" % (
         datasize, runtimesize, finalsize - datasize
         , (datasize / float(finalsize)) * 100.0
@@ -8,9 +8,13 @@
 
 # Usage:
 #   objdump -m i386 -M i8086 -M suffix -d out/rom16.o | scripts/checkstack.py
+#
+# With "-r <debuglog>" the runtime stack profile in a debug log from a
+# CONFIG_STACK_PROFILE build is shown next to the static estimates.
 
 import sys
 import re
+import optparse
 
 # Functions that change stacks
 STACKHOP = ['stack_hop', 'stack_hop_back']
@@ -113,7 +117,49 @@ re_asm = re.compile(
 re_usestack = re.compile(
     r'^(push[f]?[lw])|(sub.* [$](?P<num>0x' + hex_s + r'),%esp)$')
 
+re_profile = re.compile(
+    r'  (?P<type>entry|thread) (?P<addr>' + hex_s + r'): max=(?P<max>\d+)'
+    + r' of (?P<size>\d+) count=(?P<count>\d+)')
+re_reloc = re.compile(
+    r'Relocating init from 0x(?P<src>' + hex_s + r') to 0x(?P<dest>'
+    + hex_s + r') \(size (?P<size>\d+)\)')
+
+# Show the measured stack usage from a CONFIG_STACK_PROFILE debug log
+def showprofile(logname, funcs):
+    src = dest = size = 0
+    print("#type funcname[measured_usage,static_max_usage] of stack_size"
+          " (count)")
+    for line in open(logname, 'r'):
+        m = re_reloc.search(line)
+        if m is not None:
+            src = int(m.group('src'), 16)
+            dest = int(m.group('dest'), 16)
+            size = int(m.group('size'))
+            continue
+        m = re_profile.search(line)
+        if m is None:
+            continue
+        addr = int(m.group('addr'), 16)
+        if dest <= addr < dest + size:
+            # Thread function in the relocated init code
+            addr = addr - dest + src
+        info = funcs.get(addr)
+        if info is None:
+            name, static = "0x%x" % (addr,), "?"
+        else:
+            name, static = info.funcname, "%d" % (info.max_stack_usage,)
+        print("%-6s %s[%s,%s] of %s (%s)" % (
+            m.group('type'), name, m.group('max'), static, m.group('size')
+            , m.group('count')))
+
 def main():
+    opts = optparse.OptionParser("%prog [options] < objdump.txt")
+    opts.add_option("-r", "--runtime", dest="runtime",
+                    help="compare with the stack profile in the debug log")
+    options, args = opts.parse_args()
+    if args:
+        opts.error("Incorrect number of arguments")
+
     unknownfunc = function(None, "<unknown>")
     indirectfunc = function(-1, '<indirect>')
     unknownfunc.max_stack_usage = indirectfunc.max_stack_usage = 0
@@ -199,6 +245,10 @@ def main():
     for info in funcs.values():
         calcmaxstack(info, funcs)
 
+    if options.runtime:
+        showprofile(options.runtime, funcs)
+        return
+
     # Sort functions for output
     funcinfos = orderfuncs(funcs.keys(), funcs.copy())
 
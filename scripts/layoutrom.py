@@ -7,6 +7,7 @@
 
 import operator
 import sys
+import optparse
 
 # LD script headers/trailers
 COMMONHEADER = """
@@ -149,6 +150,12 @@ def fitSections(sections, fillsections):
 
     return firstfixed + BUILD_BIOS_ADDR
 
+# Move profiled "hot" sections after the others so that they end up
+# contiguous in the final layout.
+def orderHot(sections):
+    return ([section for section in sections if not section.hot]
+            + [section for section in sections if section.hot])
+
 # Return the subset of sections with a given category
 def getSectionsCategory(sections, category):
     return [section for section in sections if section.category == category]
@@ -168,6 +175,7 @@ class LayoutInfo:
     config = None
     genreloc = None
     sec32init_start = sec32init_end = sec32init_align = None
+    compressinit = sec32init_main_end = None
     sec32low_start = sec32low_end = None
     zonelow_base = final_sec32low_start = None
     zonefseg_start = zonefseg_end = None
@@ -187,8 +195,12 @@ def doLayout(sections, config, genreloc):
     datasections = getSectionsPrefix(sections16, '.data16.')
     fixedsections = getSectionsCategory(sections, 'fixed')
 
-    firstfixed = fitSections(fixedsections, textsections)
-    remsections = [s for s in textsections+rodatasections+datasections
+    # Hot sections are not used to fill the gaps between fixed
+    # sections so that they stay together.
+    firstfixed = fitSections(fixedsections,
+                             [s for s in textsections if not s.hot])
+    remsections = [s for s in orderHot(rodatasections + datasections
+                                       + textsections)
                    if s.finalloc is None]
     sec16_start, sec16_align = setSectionsStart(
         remsections, firstfixed, segoffset=BUILD_BIOS_ADDR)
@@ -215,7 +227,7 @@ def doLayout(sections, config, genreloc):
 
     # Determine 32flat runtime positions
     sections32flat = getSectionsCategory(sections, '32flat')
-    textsections = getSectionsPrefix(sections32flat, '.text.')
+    textsections = orderHot(getSectionsPrefix(sections32flat, '.text.'))
     rodatasections = getSectionsPrefix(sections32flat, '.rodata')
     datasections = getSectionsPrefix(sections32flat, '.data.')
     bsssections = getSectionsPrefix(sections32flat, '.bss.')
@@ -230,11 +242,18 @@ def doLayout(sections, config, genreloc):
     init32_rodatasections = getSectionsPrefix(sections32init, '.rodata')
     init32_datasections = getSectionsPrefix(sections32init, '.data.')
     init32_bsssections = getSectionsPrefix(sections32init, '.bss.')
+    init32_sections = (init32_textsections + init32_rodatasections
+                       + init32_datasections + init32_bsssections)
+    compressinit = genreloc and config.get('CONFIG_COMPRESS_INIT')
+    li.compressinit = compressinit
+    if compressinit:
+        # Keep the init code that runs before relocation at the end
+        init32_sections = (
+            [s for s in init32_sections if not s.preinit]
+            + [s for s in init32_sections if s.preinit])
 
     sec32init_start, sec32init_align = setSectionsStart(
-        init32_textsections + init32_rodatasections
-        + init32_datasections + init32_bsssections
-        , sec32flat_start, 16)
+        init32_sections, sec32flat_start, 16)
 
     # Determine location of ZoneFSeg memory.
     zonefseg_end = sec32flat_start
@@ -249,9 +268,7 @@ def doLayout(sections, config, genreloc):
             textsections + rodatasections + datasections + bsssections
             , zonefseg_start, 16)
         sec32init_start, sec32init_align = setSectionsStart(
-            init32_textsections + init32_rodatasections
-            + init32_datasections + init32_bsssections
-            , sec32flat_start, 16)
+            init32_sections, sec32flat_start, 16)
     li.sec32init_start = sec32init_start
     li.sec32init_end = sec32flat_start
     li.sec32init_align = sec32init_align
@@ -265,6 +282,11 @@ def doLayout(sections, config, genreloc):
     # Determine "low memory" data positions
     sections32low = getSectionsCategory(sections, '32low')
     sec32low_end = sec32init_start
+    if compressinit:
+        # The compressed init code must be the lowest part of the
+        # image - place the low memory data and the relocation tables
+        # above it.
+        sec32low_end = sec32flat_start
     if config.get('CONFIG_MALLOC_UPPERMEMORY'):
         final_sec32low_end = final_readonly_start
         zonelow_base = final_sec32low_end - 64*1024
@@ -280,13 +302,26 @@ def doLayout(sections, config, genreloc):
     li.zonelow_base = zonelow_base
     li.final_sec32low_start = li.sec32low_start + relocdelta
 
+    if compressinit:
+        numrelocs = sum([len(r) for r in getInitRelocs(li)])
+        li.sec32init_end = aligndown(li.sec32low_start - numrelocs * 4
+                                     , sec32init_align)
+        sec32init_start, sec32init_align = setSectionsStart(
+            init32_sections, li.sec32init_end, 16)
+        li.sec32init_start = sec32init_start
+        li.sec32init_main_end = li.sec32init_end
+        for section in init32_sections:
+            if section.preinit:
+                li.sec32init_main_end = section.finalloc
+                break
+
     # Print statistics
     size16 = BUILD_BIOS_ADDR + BUILD_BIOS_SIZE - sec16_start
     size32seg = sec16_start - sec32seg_start
     size32textfseg = sec32seg_start - sec32textfseg_start
     size32fseg = sec32textfseg_start - sec32fseg_start
     size32flat = sec32fseg_start - sec32flat_start
-    size32init = sec32flat_start - sec32init_start
+    size32init = li.sec32init_end - li.sec32init_start
     sizelow = li.sec32low_end - li.sec32low_start
     print("16bit size:           %d" % size16)
     print("32bit segmented size: %d" % size32seg)
@@ -329,13 +364,19 @@ def outSections(sections, useseg=0):
         out += "%s 0x%x : { *(%s) }\n" % (section.name, loc, section.name)
     return out
 
-# Write LD script includes for the given sections using relative offsets
-def outRelSections(sections, startsym, useseg=0):
+# Write LD script includes for the given sections using relative offsets.
+# Any 'extra' (addr, text) items are emitted at their address.
+def outRelSections(sections, startsym, useseg=0, extra=[]):
     sections = [(section.finalloc, section) for section in sections
                 if section.finalloc is not None]
     sections.sort(key=operator.itemgetter(0))
+    extra = sorted(extra, key=operator.itemgetter(0))
     out = ""
     for addr, section in sections:
+        while extra and extra[0][0] <= addr:
+            out += ". = ( 0x%x - %s ) ;\n%s" % (extra[0][0], startsym
+                                                , extra[0][1])
+            extra.pop(0)
         loc = section.finalloc
         if useseg:
             loc = section.finalsegloc
@@ -361,6 +402,19 @@ def getRelocs(sections, tosection, type=None):
                     if (reloc.symbol.section in tosection
                         and (type is None or reloc.type == type))]
 
+# Find the relocations needed to move the init code (absolute and
+# relative relocations within and from the init code, and runtime
+# references to it).
+def getInitRelocs(li):
+    initsections = dict([
+        (s, 1) for s in getSectionsCategory(li.sections, '32init')])
+    noninitsections = dict([(s, 1) for s in li.sections
+                            if s not in initsections])
+    absrelocs = getRelocs(initsections, initsections, type='R_386_32')
+    relrelocs = getRelocs(initsections, noninitsections, type='R_386_PC32')
+    initrelocs = getRelocs(noninitsections, initsections)
+    return absrelocs, relrelocs, initrelocs
+
 # Output the linker scripts for all required sections.
 def writeLinkerScripts(li, out16, out32seg, out32flat):
     # Write 16bit linker script
@@ -388,20 +442,20 @@ def writeLinkerScripts(li, out16, out32seg, out32flat):
     # Write 32flat linker script
     sec32all_start = li.sec32low_start
     relocstr = ""
+    extra = []
     if li.genreloc:
         # Generate relocations
-        initsections = dict([
-            (s, 1) for s in getSectionsCategory(li.sections, '32init')])
-        noninitsections = dict([(s, 1) for s in li.sections
-                                if s not in initsections])
-        absrelocs = getRelocs(initsections, initsections, type='R_386_32')
-        relrelocs = getRelocs(initsections, noninitsections, type='R_386_PC32')
-        initrelocs = getRelocs(noninitsections, initsections)
+        absrelocs, relrelocs, initrelocs = getInitRelocs(li)
         relocstr = (strRelocs("_reloc_abs", "code32init_start", absrelocs)
                     + strRelocs("_reloc_rel", "code32init_start", relrelocs)
                     + strRelocs("_reloc_init", "code32flat_start", initrelocs))
         numrelocs = len(absrelocs + relrelocs + initrelocs)
         sec32all_start -= numrelocs * 4
+        if li.compressinit:
+            # The relocations follow the init code - see doLayout()
+            extra.append((li.sec32init_end, relocstr))
+            relocstr = ""
+            sec32all_start = li.sec32init_start
     filesections32flat = getSectionsFileid(li.sections, '32flat')
     out = outXRefs([], exportsyms=li.varlowsyms
                    , forcedelta=li.final_sec32low_start-li.sec32low_start)
@@ -411,6 +465,8 @@ def writeLinkerScripts(li, out16, out32seg, out32flat):
         sec32all_start -= 3 * 4
     sec32all_align = max([section.align for section in li.sections])
     sec32all_start = aligndown(sec32all_start, sec32all_align)
+    if li.compressinit:
+        out += "    code32init_main_end = 0x%x ;\n" % (li.sec32init_main_end,)
     out += outXRefs(filesections32flat, exportsyms=[li.entrysym]) + """
     _reloc_min_align = 0x%x ;
     zonefseg_start = 0x%x ;
@@ -443,7 +499,7 @@ def writeLinkerScripts(li, out16, out32seg, out32flat):
        sec32all_start,
        multiboot_header,
        relocstr,
-       outRelSections(li.sections, 'code32flat_start'))
+       outRelSections(li.sections, 'code32flat_start', extra=extra))
     out = COMMONHEADER + out + COMMONTRAILER + """
 ENTRY(%s)
 PHDRS
@@ -456,6 +512,63 @@ PHDRS
     outfile.close()
 
 
+######################################################################
+# Layout report
+######################################################################
+
+# Report the size and relocation count of each kept section, grouped
+# by the area it was placed in.
+def writeReport(li, outname, profiled):
+    out = []
+    categories = {}
+    for section in li.sections:
+        categories.setdefault(section.category, []).append(section)
+    out.append("%-12s %8s %8s %8s" % ("area", "sections", "size", "relocs"))
+    for category in sorted(categories):
+        sections = categories[category]
+        out.append("%-12s %8d %8d %8d" % (
+            category, len(sections), sum([s.size for s in sections])
+            , sum([len(s.relocs) for s in sections])))
+    if li.genreloc:
+        absrelocs, relrelocs, initrelocs = getInitRelocs(li)
+        out.append("\nInit relocation: %d bytes, %d absolute, %d relative"
+                   ", %d runtime to init relocations" % (
+                       li.sec32init_end - li.sec32init_start, len(absrelocs)
+                       , len(relrelocs), len(initrelocs)))
+    if profiled:
+        hot = [s for s in li.sections if s.hot]
+        out.append("\nProfile: %d hot sections (%d bytes)" % (
+            len(hot), sum([s.size for s in hot])))
+        hot16 = [s.finalloc for s in hot if s.category == '16']
+        if hot16:
+            out.append("Hot 16bit code: 0x%x-0x%x" % (
+                min(hot16), max([s.finalloc + s.size for s in hot
+                                 if s.category == '16'])))
+        cold = [(s.size, s.name) for s in li.sections
+                if s.category == '32flat' and not s.hot
+                and s.name.startswith('.text.')]
+        cold.sort(reverse=True)
+        out.append("Runtime 32bit code not in profile: %d sections"
+                   " (%d bytes)" % (len(cold), sum([c[0] for c in cold])))
+        for size, name in cold:
+            out.append("    %6d %s" % (size, name))
+    out.append("\n%-12s %8s %8s %10s %s" % (
+        "area", "size", "relocs", "address", "section"))
+    for category in sorted(categories):
+        sections = [(s.size, s.name, s) for s in categories[category]]
+        sections.sort(key=operator.itemgetter(0, 1), reverse=True)
+        for size, name, section in sections:
+            loc = section.finalloc
+            out.append("%-12s %8d %8d %10s %s%s%s" % (
+                category, size, len(section.relocs)
+                , "-" if loc is None else "0x%x" % (loc,), name
+                , " (hot)" if section.hot else ""
+                , " (preinit)" if section.preinit else ""))
+    outfile = open(outname, 'w')
+    outfile.write("\n".join(out) + "\n")
+    outfile.close()
+
+
 ######################################################################
 # Detection of unused sections and init sections
 ######################################################################
@@ -487,6 +600,18 @@ def checkRuntime(reloc, rsection, data, chain):
         sys.exit(1)
     return 1
 
+# Find init sections that may run before the init code is relocated.
+# Taking the address of a function (such as the one passed to
+# reloc_preinit()) does not run it.
+def checkPreinit(reloc, rsection, data, chain):
+    section = reloc.symbol.section
+    if section is None or section.category != '32init':
+        return 0
+    if (reloc.type == 'R_386_32' and rsection.name.startswith('.text.')
+        and section.name.startswith('.text.')):
+        return 0
+    return 1
+
 # Find and keep the section associated with a symbol (if available).
 def checkKeepSym(reloc, syms, fileid, isxref):
     symbolname = reloc.symbolname
@@ -530,6 +655,7 @@ def checkKeep(reloc, section, symbols, chain):
 class Section:
     name = size = alignment = fileid = relocs = None
     finalloc = finalsegloc = category = None
+    hot = preinit = 0
 class Reloc:
     offset = type = symbolname = symbol = None
 class Symbol:
@@ -634,9 +760,30 @@ def scanconfig(file):
         opts[parts[1]] = value
     return opts
 
+# Read a profile of symbols used at runtime - one symbol per line
+# (the last word of the line), '#' starts a comment.
+def scanprofile(file):
+    f = open(file, 'r')
+    names = []
+    for l in f.readlines():
+        parts = l.split('#')[0].split()
+        if parts:
+            names.append(parts[-1])
+    return names
+
 def main():
-    # Get output name
-    in16, in32seg, in32flat, cfgfile, out16, out32seg, out32flat = sys.argv[1:]
+    usage = ("%prog [options] <code16.objdump> <code32seg.objdump>"
+             " <code32flat.objdump> <autoconf.h>"
+             " <out16.lds> <out32seg.lds> <out32flat.lds>")
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-p", "--profile", dest="profile",
+                    help="file listing symbols used at runtime")
+    opts.add_option("-r", "--report", dest="report",
+                    help="write a section size and relocation report")
+    options, args = opts.parse_args()
+    if len(args) != 7:
+        opts.error("Incorrect number of arguments")
+    in16, in32seg, in32flat, cfgfile, out16, out32seg, out32flat = args
 
     # Read in the objdump information
     infile16 = open(in16, 'r')
@@ -690,6 +837,27 @@ def main():
         else:
             section.category = section.fileid
 
+    # Find the init code that is used before relocation - it is not
+    # compressed with CONFIG_COMPRESS_INIT.
+    if config.get('CONFIG_COMPRESS_INIT'):
+        anchorsections = [
+            reloc.symbol.section for section in sections
+            if section.category != '32init'
+            for reloc in section.relocs
+            if (reloc.symbol.section is not None
+                and reloc.symbol.section.category == '32init')]
+        for section in findReachable(anchorsections, checkPreinit, None):
+            section.preinit = 1
+
+    # Mark the sections of profiled symbols
+    if options.profile:
+        for name in scanprofile(options.profile):
+            for fileid in ('16', '32seg', '32flat'):
+                symbol = symbols[fileid].get(name)
+                if (symbol is not None and symbol.section is not None
+                    and symbol.section in keepsections):
+                    symbol.section.hot = 1
+
     # Determine the final memory locations of each kept section.
     genreloc = '_reloc_abs_start' in symbols['32flat']
     li = doLayout(sections, config, genreloc)
@@ -704,6 +872,8 @@ def main():
 
     # Write out linker script files.
     writeLinkerScripts(li, out16, out32seg, out32flat)
+    if options.report:
+        writeReport(li, options.report, options.profile)
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,141 @@
+#!/usr/bin/env python
+# Decode the binary debug log (CONFIG_DEBUG_BINLOG).
+#
+# Copyright (C) 2026  SeaBIOS developers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+# Usage:
+#   scripts/readbinlog.py out/bios.bin binlog.dump
+#
+# The dump is a copy of guest memory starting at the address SeaBIOS
+# reports in its "Debug messages now go to the binary log" message
+# (and in the optional "etc/debug-binlog" fw_cfg file).  With QEMU it
+# can be saved from the monitor with "pmemsave <addr> <size> <file>".
+# The bios.bin must be the exact image that produced the log as the
+# records only contain the addresses of their format strings.
+
+import sys, struct, re, optparse
+
+BINLOG_SIGNATURE = 0x474c4253
+HEADERFMT = "<IHHIIIIII"
+RECFMT = "<IHH"
+FLAG_THREAD = 0x01
+
+class BiosImage:
+    def __init__(self, data, init_src, init_dest, init_size):
+        self.data = data
+        self.init_src = init_src
+        self.init_dest = init_dest
+        self.init_size = init_size
+    def offset(self, addr):
+        # Undo the relocation of the init code
+        if self.init_size and (
+                self.init_dest <= addr < self.init_dest + self.init_size):
+            addr = addr - self.init_dest + self.init_src
+        size = len(self.data)
+        if addr >= 0x100000000 - size:
+            return addr - (0x100000000 - size)
+        if 0x100000 - size <= addr < 0x100000:
+            return addr - (0x100000 - size)
+        return None
+    def string(self, addr):
+        offset = self.offset(addr)
+        if offset is None:
+            return None
+        end = self.data.find(b"\0", offset)
+        if end < 0:
+            return None
+        return self.data[offset:end].decode("latin-1")
+
+FMTRE = re.compile(r"%([0-9]*)(l?l?)(\.s|pP|[dsuxXcp%])")
+
+def formatrec(image, fmtaddr, args):
+    fmt = image.string(fmtaddr)
+    if fmt is None:
+        return "<unknown format at 0x%08x>\n" % (fmtaddr,)
+    out = []
+    pos = [0]
+    def getu32():
+        if pos[0] + 4 > len(args):
+            return 0
+        val = struct.unpack_from("<I", args, pos[0])[0]
+        pos[0] += 4
+        return val
+    def getstr():
+        if pos[0] >= len(args):
+            return ""
+        slen = args[pos[0]]
+        s = args[pos[0]+1:pos[0]+1+slen].decode("latin-1")
+        pos[0] = (pos[0] + 1 + slen + 3) & ~3
+        return s
+    last = 0
+    for m in FMTRE.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+        width, lng, conv = m.groups()
+        pad = "0" if width.startswith("0") else ""
+        width = pad + str(int(width)) if width else ""
+        if conv == "%":
+            out.append("%")
+        elif conv in ("s", ".s"):
+            out.append(getstr())
+        elif conv == "pP":
+            bdf = getu32()
+            out.append("%02x:%02x.%x" % (bdf >> 8, (bdf >> 3) & 0x1f, bdf & 7))
+        elif conv == "p":
+            out.append("0x%08x" % (getu32(),))
+        elif conv == "c":
+            out.append(chr(getu32() & 0xff))
+        else:
+            val = getu32()
+            bits = 32
+            if lng == "ll":
+                val |= getu32() << 32
+                bits = 64
+            if conv == "d" and val & (1 << (bits - 1)):
+                val -= 1 << bits
+            out.append(("%" + width + conv) % (val,))
+    out.append(fmt[last:])
+    return "".join(out)
+
+def main():
+    opts = optparse.OptionParser("%prog [options] <bios.bin> <dump>")
+    opts.add_option("-t", "--threads", action="store_true", dest="threads",
+                    help="mark messages from threads other than the main one")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    biosdata = open(args[0], "rb").read()
+    dump = open(args[1], "rb").read()
+
+    (sig, version, header_size, size, head, tail, init_src, init_dest,
+     init_size) = struct.unpack_from(HEADERFMT, dump)
+    if sig != BINLOG_SIGNATURE:
+        sys.stderr.write("Not a SeaBIOS binary log\n")
+        sys.exit(1)
+    data = dump[header_size:header_size+size]
+    if len(data) < size:
+        sys.stderr.write("Dump is truncated (%d of %d bytes)\n" % (
+            len(data), size))
+        sys.exit(1)
+    image = BiosImage(biosdata, init_src, init_dest, init_size)
+
+    mask = size - 1
+    rsize = struct.calcsize(RECFMT)
+    pos = tail
+    while pos < head:
+        fmtaddr, rlen, flags = struct.unpack_from(RECFMT, data, pos & mask)
+        if rlen < rsize or rlen & 3:
+            sys.stderr.write("Corrupt record at %d\n" % (pos,))
+            sys.exit(1)
+        if fmtaddr:
+            start = (pos & mask) + rsize
+            msg = formatrec(image, fmtaddr, data[start:(pos & mask) + rlen])
+            if options.threads and flags & FLAG_THREAD:
+                msg = "|thread| " + msg
+            sys.stdout.write(msg)
+        pos += rlen
+
+if __name__ == '__main__':
+    main()
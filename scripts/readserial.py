@@ -7,8 +7,9 @@
 
 # Usage:
 #   scripts/readserial.py /dev/ttyUSB0 115200
+#   scripts/readserial.py -s seriallog-20260101_120000.log
 
-import sys, os, time, select, optparse
+import sys, os, time, select, optparse, re
 
 # Reset time counter after this much idle time.
 RESTARTINTERVAL = 60
@@ -114,6 +115,54 @@ def readserial(infile, logfile, byteadjust):
         logfile.write(out)
         logfile.flush()
 
+# Patterns for the CONFIG_DISK_STATS report (see disk_stats_prepboot())
+DSTATS_PREFIX = r"^(?:[0-9.]+: )?"
+DSTATS_HEADER = re.compile(DSTATS_PREFIX + r"Disk statistics \(timer (\d+) khz,"
+                           r" bounce buffer hits=(\d+) misses=(\d+)\):")
+DSTATS_DRIVE = re.compile(DSTATS_PREFIX + r"  drive ([0-9a-f]+) type ([0-9a-f]+):"
+                          r" (.*)")
+DSTATS_COMMANDS = re.compile(DSTATS_PREFIX + r"    commands: (.*)")
+DSTATS_LATENCY = re.compile(DSTATS_PREFIX + r"    latency:(.*)")
+
+def dstats_fields(text):
+    return [tuple(f.split("=", 1)) for f in text.split()]
+
+def printdiskstats(lines):
+    found = 0
+    for line in lines:
+        m = DSTATS_HEADER.match(line)
+        if m:
+            found = 1
+            sys.stdout.write("Disk statistics (timer %s khz)\n"
+                             "  bounce buffers: %s hits, %s misses\n" % (
+                                 m.group(1), m.group(2), m.group(3)))
+            continue
+        m = DSTATS_DRIVE.match(line)
+        if m:
+            sys.stdout.write("\nDrive %s (type 0x%s)\n" % (
+                m.group(1), m.group(2)))
+            for name, val in dstats_fields(m.group(3)):
+                sys.stdout.write("  %-10s %12s\n" % (name, val))
+            continue
+        m = DSTATS_COMMANDS.match(line)
+        if m:
+            mix = ["%s %s" % (name, val)
+                   for name, val in dstats_fields(m.group(1)) if val != "0"]
+            sys.stdout.write("  %-10s %s\n" % ("commands", ", ".join(mix)))
+            continue
+        m = DSTATS_LATENCY.match(line)
+        if m:
+            buckets = [tuple(f.rsplit(":", 1)) for f in m.group(1).split()]
+            total = sum(int(count) for bound, count in buckets) or 1
+            sys.stdout.write("  latency\n")
+            for bound, count in buckets:
+                bar = "#" * ((int(count) * 40 + total - 1) // total)
+                sys.stdout.write("    %12s %8s %s\n" % (bound, count, bar))
+    if not found:
+        sys.stderr.write("No disk statistics found\n")
+        return 1
+    return 0
+
 def main():
     usage = "%prog [options] [<serialdevice> [<baud>]]"
     opts = optparse.OptionParser(usage)
@@ -132,7 +181,16 @@ def main():
     opts.add_option("-t", "--time",
                     type="float", dest="time", default=None,
                     help="time to write one byte on serial port (in us)")
+    opts.add_option("-s", "--disk-stats",
+                    action="store_true", dest="diskstats", default=False,
+                    help="pretty-print the disk statistics in a saved log")
     options, args = opts.parse_args()
+    if options.diskstats:
+        if len(args) != 1:
+            opts.error("Expected a single log file")
+        with open(args[0], 'rb') as f:
+            lines = f.read().decode('latin-1').splitlines()
+        sys.exit(printdiskstats(lines))
     serialport = 0
     baud = 115200
     if len(args) > 2:
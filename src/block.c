@@ -7,6 +7,7 @@
 
 #include "biosvar.h" // GET_GLOBAL
 #include "block.h" // process_op
+#include "fw/paravirt.h" // qemu_cfg_write_file
 #include "hw/ata.h" // process_ata_op
 #include "hw/ahci.h" // process_ahci_op
 #include "hw/esp-scsi.h" // esp_scsi_process_op
@@ -21,8 +22,9 @@
 #include "hw/virtio-blk.h" // process_virtio_blk_op
 #include "hw/virtio-scsi.h" // virtio_scsi_process_op
 #include "hw/nvme.h" // nvme_process_op
-#include "malloc.h" // malloc_low
+#include "malloc.h" // memalign_low
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_find
 #include "stacks.h" // call32
 #include "std/disk.h" // struct dpte_s
 #include "string.h" // checksum
@@ -31,7 +33,6 @@
 u8 FloppyCount VARFSEG;
 u8 CDCount;
 struct drive_s *IDMap[3][BUILD_MAX_EXTDRIVE] VARFSEG;
-u8 *bounce_buf_fl VARFSEG;
 
 struct drive_s *
 getDrive(u8 exttype, u8 extdriveoffset)
@@ -51,20 +52,72 @@ int getDriveId(u8 exttype, struct drive_s *drive)
     return -1;
 }
 
+// Pool of bounce buffers for drivers that need an aligned transfer
+// buffer.  The first is a single sector in low memory (so it is real
+// mode reachable); the others hold BOUNCE_BUF_SIZE bytes and are taken
+// from ZoneHigh so they don't use up scarce low memory.
+u8 *BounceBufs[BOUNCE_BUF_COUNT] VARFSEG;
+u8 BounceBusy VARLOW;
+
+static void dstats_bounce(int hit);
+
 int create_bounce_buf(void)
 {
-    if (bounce_buf_fl)
+    if (BounceBufs[0])
         return 0;
 
-    u8 *buf = malloc_low(CDROM_SECTOR_SIZE);
+    u8 *buf = memalign_low(DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
     if (!buf) {
         warn_noalloc();
         return -1;
     }
-    bounce_buf_fl = buf;
+    BounceBufs[0] = buf;
+    int i;
+    for (i = 1; i < BOUNCE_BUF_COUNT; i++) {
+        buf = memalign_high(DISK_SECTOR_SIZE, BOUNCE_BUF_SIZE);
+        if (!buf)
+            break;
+        BounceBufs[i] = buf;
+    }
+    dprintf(3, "Allocated a low bounce buffer and %d of %d bytes\n", i - 1
+            , BOUNCE_BUF_SIZE);
     return 0;
 }
 
+// Reserve a bounce buffer for one request.  The larger buffers are
+// handed out first; the size of the buffer is stored in 'size'.
+u8 *
+bounce_buf_get(u32 *size)
+{
+    u8 busy = GET_LOW(BounceBusy);
+    int i;
+    for (i = BOUNCE_BUF_COUNT - 1; i >= 0; i--) {
+        u8 *buf = GET_GLOBAL(BounceBufs[i]);
+        if (!buf || busy & (1 << i))
+            continue;
+        SET_LOW(BounceBusy, busy | (1 << i));
+        dstats_bounce(1);
+        *size = i ? BOUNCE_BUF_SIZE : DISK_SECTOR_SIZE;
+        return buf;
+    }
+    dprintf(1, "No free bounce buffer\n");
+    dstats_bounce(0);
+    return NULL;
+}
+
+// Release a bounce buffer obtained from bounce_buf_get().
+void
+bounce_buf_put(u8 *buf)
+{
+    int i;
+    for (i = 0; i < BOUNCE_BUF_COUNT; i++)
+        if (GET_GLOBAL(BounceBufs[i]) == buf) {
+            SET_LOW(BounceBusy, GET_LOW(BounceBusy) & ~(1 << i));
+            return;
+        }
+}
+
+
 /****************************************************************
  * Disk geometry translation
  ****************************************************************/
@@ -94,7 +147,7 @@ get_translation(struct drive_s *drive)
     u16 heads = drive->pchs.head;
     u16 cylinders = drive->pchs.cylinder;
     u16 spt = drive->pchs.sector;
-    u64 sectors = drive->sectors;
+    u64 sectors = drive_sectors(drive);
     u64 psectors = (u64)heads * cylinders * spt;
     if (!heads || !cylinders || !spt || psectors > sectors)
         // pchs doesn't look valid - use LBA.
@@ -116,7 +169,7 @@ setup_translation(struct drive_s *drive)
     u16 heads = drive->pchs.head ;
     u16 cylinders = drive->pchs.cylinder;
     u16 spt = drive->pchs.sector;
-    u64 sectors = drive->sectors;
+    u64 sectors = drive_sectors(drive);
     const char *desc = NULL;
 
     switch (translation) {
@@ -240,6 +293,9 @@ fill_fdpt(struct drive_s *drive, int hdid)
                                  struct extended_bios_data_area_s, fdpt[1])));
 }
 
+static inline process_op_fn drive_op32_lookup(u8 type);
+static void blk512e_setup(struct drive_s *drive);
+
 // Find spot to add a drive
 static void
 add_drive(struct drive_s **idmap, u8 *count, struct drive_s *drive)
@@ -248,6 +304,7 @@ add_drive(struct drive_s **idmap, u8 *count, struct drive_s *drive)
         warn_noalloc();
         return;
     }
+    drive->op32 = drive_op32_lookup(drive->type);
     idmap[*count] = drive;
     *count = *count + 1;
 }
@@ -262,6 +319,9 @@ map_hd_drive(struct drive_s *drive)
     dprintf(3, "Mapping hd drive %p to %d\n", drive, hdid);
     add_drive(IDMap[EXTTYPE_HD], &bda->hdcount, drive);
 
+    // Present drives with larger blocks as 512 byte sector drives.
+    blk512e_setup(drive);
+
     // Setup disk geometry translation.
     setup_translation(drive);
 
@@ -331,8 +391,10 @@ fill_generic_edd(struct segoff_s edd, struct drive_s *drive_fl
     u16 npc     = GET_FLATPTR(drive_fl->pchs.cylinder);
     u16 nph     = GET_FLATPTR(drive_fl->pchs.head);
     u16 nps     = GET_FLATPTR(drive_fl->pchs.sector);
-    u64 lba     = GET_FLATPTR(drive_fl->sectors);
+    u64 lba     = drive_sectors(drive_fl);
     u16 blksize = GET_FLATPTR(drive_fl->blksize);
+    if (CONFIG_DISK_512E && GET_FLATPTR(drive_fl->sector_shift))
+        blksize = DISK_SECTOR_SIZE;
 
     dprintf(DEBUG_HDL_13, "disk_1348 size=%d t=%d chs=%d,%d,%d lba=%d bs=%d\n"
             , size, type, npc, nph, nps, (u32)lba, blksize);
@@ -504,22 +566,25 @@ fill_edd(struct segoff_s edd, struct drive_s *drive_fl)
  * Disk driver dispatch
  ****************************************************************/
 
+static void bcache_setup(void);
+
 void
 block_setup(void)
 {
-    floppy_setup();
-    ata_setup();
-    ahci_setup();
-    sdcard_setup();
-    ramdisk_setup();
-    virtio_blk_setup();
-    virtio_scsi_setup();
-    lsi_scsi_setup();
-    esp_scsi_setup();
-    megasas_setup();
-    pvscsi_setup();
-    mpt_scsi_setup();
-    nvme_setup();
+    bcache_setup();
+    TIMELINE_CALL(floppy_setup);
+    TIMELINE_CALL(ata_setup);
+    TIMELINE_CALL(ahci_setup);
+    TIMELINE_CALL(sdcard_setup);
+    TIMELINE_CALL(ramdisk_setup);
+    TIMELINE_CALL(virtio_blk_setup);
+    TIMELINE_CALL(virtio_scsi_setup);
+    TIMELINE_CALL(lsi_scsi_setup);
+    TIMELINE_CALL(esp_scsi_setup);
+    TIMELINE_CALL(megasas_setup);
+    TIMELINE_CALL(pvscsi_setup);
+    TIMELINE_CALL(mpt_scsi_setup);
+    TIMELINE_CALL(nvme_setup);
 }
 
 // Fallback handler for command requests not implemented by drivers
@@ -532,6 +597,7 @@ default_process_op(struct disk_op_s *op)
     case CMD_ISREADY:
     case CMD_VERIFY:
     case CMD_SEEK:
+    case CMD_FLUSH:
         // Return success if the driver doesn't implement these commands
         return DISK_RET_SUCCESS;
     default:
@@ -539,61 +605,715 @@ default_process_op(struct disk_op_s *op)
     }
 }
 
+
+/****************************************************************
+ * Write-back tracking
+ ****************************************************************/
+
+// The drive with writes that haven't reached stable storage yet.  Only
+// one drive at a time may buffer writes - they are flushed before
+// requests to any other drive.
+struct drive_s *WriteBackDrive VARLOW;
+
+// Called by drivers when a drive starts buffering writes (and with
+// NULL once they have been flushed).
+void
+disk_writeback_note(struct drive_s *drive_fl)
+{
+    SET_LOW(WriteBackDrive, drive_fl);
+}
+
+// Set while read-ahead of the disk cache may be in flight
+u8 ReadAheadActive VARLOW;
+
+void bcache_drain(void);
+
+// Write out any writes buffered by a drive.  Called on requests to
+// other drives and when the operating system is likely about to take
+// over from the bios - which also completes any read-ahead.
+void
+disk_writeback_flush(void)
+{
+    if (CONFIG_BLOCK_CACHE && GET_LOW(ReadAheadActive)) {
+        if (MODESEGMENT)
+            call32(bcache_drain, 0, 0);
+        else
+            bcache_drain();
+    }
+    struct drive_s *drive_fl = GET_LOW(WriteBackDrive);
+    if (!drive_fl)
+        return;
+    SET_LOW(WriteBackDrive, NULL);
+    struct disk_op_s dop;
+    memset(&dop, 0, sizeof(dop));
+    dop.drive_fl = drive_fl;
+    dop.command = CMD_FLUSH;
+    int ret = process_op(&dop);
+    if (ret)
+        dprintf(1, "drive %p: write-back flush failed (%d)\n", drive_fl, ret);
+}
+
 // Command dispatch for disk drivers that run in both 16bit and 32bit mode
+// The drive types of drivers that aren't in the build are never
+// assigned, so their tests below are compiled out.  When just one
+// driver is enabled the dispatch is a single compare.
+#define DTYPE_TEST(type, cfg, dtype) ((cfg) && (type) == (dtype))
+
 static int
 process_op_both(struct disk_op_s *op)
 {
-    switch (GET_FLATPTR(op->drive_fl->type)) {
-    case DTYPE_ATA_ATAPI:
+    u8 type = GET_FLATPTR(op->drive_fl->type);
+    if (DTYPE_TEST(type, CONFIG_ATA, DTYPE_ATA_ATAPI))
         return ata_atapi_process_op(op);
-    case DTYPE_USB:
+    if (DTYPE_TEST(type, CONFIG_USB_MSC, DTYPE_USB))
         return usb_process_op(op);
-    case DTYPE_UAS:
+    if (DTYPE_TEST(type, CONFIG_USB_UAS, DTYPE_UAS))
         return uas_process_op(op);
-    case DTYPE_LSI_SCSI:
+    if (DTYPE_TEST(type, CONFIG_LSI_SCSI, DTYPE_LSI_SCSI))
         return lsi_scsi_process_op(op);
-    case DTYPE_ESP_SCSI:
+    if (DTYPE_TEST(type, CONFIG_ESP_SCSI, DTYPE_ESP_SCSI))
         return esp_scsi_process_op(op);
-    case DTYPE_MEGASAS:
+    if (DTYPE_TEST(type, CONFIG_MEGASAS, DTYPE_MEGASAS))
         return megasas_process_op(op);
-    case DTYPE_MPT_SCSI:
+    if (DTYPE_TEST(type, CONFIG_MPT_SCSI, DTYPE_MPT_SCSI))
         return mpt_scsi_process_op(op);
+    if (!MODESEGMENT)
+        return DISK_RET_EPARAM;
+    // In 16bit mode and driver not found - try in 32bit mode
+    return call32(process_op_32, MAKE_FLATPTR(GET_SEG(SS), op)
+                  , DISK_RET_EPARAM);
+}
+
+// Find the 32bit mode request handler for a drive type
+static inline process_op_fn
+drive_op32_lookup(u8 type)
+{
+    ASSERT32FLAT();
+    if (DTYPE_TEST(type, CONFIG_VIRTIO_BLK, DTYPE_VIRTIO_BLK))
+        return virtio_blk_process_op;
+    if (DTYPE_TEST(type, CONFIG_AHCI, DTYPE_AHCI))
+        return ahci_process_op;
+    if (DTYPE_TEST(type, CONFIG_AHCI, DTYPE_AHCI_ATAPI))
+        return ahci_atapi_process_op;
+    if (DTYPE_TEST(type, CONFIG_SDCARD, DTYPE_SDCARD))
+        return sdcard_process_op;
+    if (DTYPE_TEST(type, CONFIG_USB_MSC, DTYPE_USB_32))
+        return usb_process_op;
+    if (DTYPE_TEST(type, CONFIG_USB_UAS, DTYPE_UAS_32))
+        return uas_process_op;
+    if (DTYPE_TEST(type, CONFIG_VIRTIO_SCSI, DTYPE_VIRTIO_SCSI))
+        return virtio_scsi_process_op;
+    if (DTYPE_TEST(type, CONFIG_PVSCSI, DTYPE_PVSCSI))
+        return pvscsi_process_op;
+    if (DTYPE_TEST(type, CONFIG_NVME, DTYPE_NVME))
+        return nvme_process_op;
+    if (DTYPE_TEST(type, CONFIG_FLASH_FLOPPY || CONFIG_FLASH_HARDDISK
+                   , DTYPE_RAMDISK))
+        return ramdisk_process_op;
+    return process_op_both;
+}
+
+// Number of request handlers drive_op32_lookup() can return
+#define DRIVERS_32 (CONFIG_VIRTIO_BLK + 2*CONFIG_AHCI + CONFIG_SDCARD   \
+                    + CONFIG_USB_MSC + CONFIG_USB_UAS + CONFIG_VIRTIO_SCSI \
+                    + CONFIG_PVSCSI + CONFIG_NVME                       \
+                    + (CONFIG_FLASH_FLOPPY || CONFIG_FLASH_HARDDISK)    \
+                    + CONFIG_ATA + CONFIG_LSI_SCSI + CONFIG_ESP_SCSI    \
+                    + CONFIG_MEGASAS + CONFIG_MPT_SCSI)
+
+// Command dispatch for disk drivers in 32bit mode
+static int
+__process_op_32(struct disk_op_s *op)
+{
+    process_op_fn fn = op->drive_fl->op32;
+    if (DRIVERS_32 <= 1 || !fn)
+        // Single driver builds (and drives that were never mapped)
+        // resolve the handler directly.
+        fn = drive_op32_lookup(op->drive_fl->type);
+    return fn(op);
+}
+
+
+
+/****************************************************************
+ * Disk read cache
+ ****************************************************************/
+
+#define BCACHE_LINE_SIZE (16*1024)
+// Lines filled by the first read-ahead of a sequential stream - the
+// window doubles on each further sequential miss up to the maximum
+#define BCACHE_READAHEAD_LINES 4
+#define BCACHE_READAHEAD_MAX 16
+#define BCACHE_STREAMS 4
+// Requests of this size (and larger) are not cached
+#define BCACHE_BYPASS_SIZE (2*BCACHE_LINE_SIZE)
+#define BCACHE_NONE 0xffff
+
+static int disk_queue(struct disk_req_s *req);
+
+struct bcache_line_s {
+    struct drive_s *drive_fl;
+    u64 lba;            // First sector of the line
+    u16 count;          // Number of valid sectors (0 if unused)
+    u16 hnext;          // Next line in hash chain
+};
+
+// Sequential read detection (one stream per drive)
+struct bcache_stream_s {
+    struct drive_s *drive_fl;
+    u64 next_lba;       // Sector following the last request
+    u16 window;         // Lines to read ahead on the next sequential miss
+    // Read-ahead in the background on drives with disk_submit() support
+    struct disk_req_s ra;
+    u16 ra_first, ra_lines; // Lines being read by 'ra'
+    u64 ra_mark;        // Reading this line starts the next read-ahead
+    u64 ra_next;        // Sector following the last read-ahead
+};
+
+struct bcache_s {
+    u8 *data;
+    u16 count;          // Number of lines
+    u16 next;           // Next line to replace
+    struct bcache_stream_s streams[BCACHE_STREAMS];
+    u8 nextstream;      // Next stream to replace
+    u16 *hash;
+    struct bcache_line_s lines[];
+};
+
+static struct bcache_s *BlockCache;
+
+static void
+bcache_setup(void)
+{
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    u32 count = CONFIG_BLOCK_CACHE_SIZE * 1024 / BCACHE_LINE_SIZE;
+    struct bcache_s *bc = malloc_high(
+        sizeof(*bc) + count * (sizeof(bc->lines[0]) + sizeof(bc->hash[0])));
+    u8 *data = memalign_high(PAGE_SIZE, count * BCACHE_LINE_SIZE);
+    if (!bc || !data) {
+        warn_noalloc();
+        free(bc);
+        free(data);
+        return;
+    }
+    memset(bc, 0, sizeof(*bc) + count * sizeof(bc->lines[0]));
+    bc->data = data;
+    bc->count = count;
+    bc->hash = (void*)&bc->lines[count];
+    memset(bc->hash, 0xff, count * sizeof(bc->hash[0]));
+    BlockCache = bc;
+    dprintf(3, "disk read cache %d lines at %p\n", count, data);
+}
+
+static int
+bcache_cacheable(struct drive_s *drive_fl)
+{
+    u16 blksize = drive_fl->blksize;
+    return (drive_fl->type != DTYPE_RAMDISK && blksize && blksize != CDROM_SECTOR_SIZE
+            && blksize <= BCACHE_LINE_SIZE && !(blksize & (blksize - 1)));
+}
+
+static u32
+bcache_hash(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba)
+{
+    u32 h = ((u32)drive_fl >> 4) ^ (((u32)(lba >> 32) ^ (u32)lba) * 0x9e3779b1);
+    return (h ^ (h >> 16)) % bc->count;
+}
+
+static int
+bcache_find(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba)
+{
+    u16 idx = bc->hash[bcache_hash(bc, drive_fl, lba)];
+    while (idx != BCACHE_NONE) {
+        struct bcache_line_s *line = &bc->lines[idx];
+        if (line->drive_fl == drive_fl && line->lba == lba)
+            return idx;
+        idx = line->hnext;
+    }
+    return -1;
+}
+
+// Remove a line from the cache
+static void
+bcache_drop(struct bcache_s *bc, int idx)
+{
+    struct bcache_line_s *line = &bc->lines[idx];
+    if (!line->count)
+        return;
+    u16 *pprev = &bc->hash[bcache_hash(bc, line->drive_fl, line->lba)];
+    while (*pprev != idx)
+        pprev = &bc->lines[*pprev].hnext;
+    *pprev = line->hnext;
+    line->count = 0;
+}
+
+// Drop the lines of a stream's read-ahead
+static void
+bcache_ra_drop(struct bcache_s *bc, struct bcache_stream_s *s)
+{
+    int i;
+    for (i = s->ra_first; i < s->ra_first + s->ra_lines; i++)
+        if (bc->lines[i].drive_fl == s->drive_fl)
+            bcache_drop(bc, i);
+}
+
+// Wait for the read-ahead of a stream (if any) to complete
+static void
+bcache_ra_wait(struct bcache_s *bc, struct bcache_stream_s *s)
+{
+    if (s->ra.pending)
+        disk_wait(&s->ra);
+    if (s->ra.pending) {
+        // The drive didn't complete the request - don't wait for it again
+        bcache_ra_drop(bc, s);
+        s->ra.pending = 0;
+    }
+}
+
+// Wait for the read-ahead that is filling a line (if any)
+static void
+bcache_wait(struct bcache_s *bc, int idx)
+{
+    int i;
+    for (i = 0; i < BCACHE_STREAMS; i++) {
+        struct bcache_stream_s *s = &bc->streams[i];
+        if (s->ra.pending && idx >= s->ra_first
+            && idx < s->ra_first + s->ra_lines)
+            bcache_ra_wait(bc, s);
+    }
+}
+
+// Complete any read-ahead still in flight
+void VISIBLE32FLAT
+bcache_drain(void)
+{
+    struct bcache_s *bc = BlockCache;
+    int i;
+    for (i = 0; bc && i < BCACHE_STREAMS; i++)
+        bcache_ra_wait(bc, &bc->streams[i]);
+    SET_LOW(ReadAheadActive, 0);
+}
+
+// Take up to '*pcount' lines for the sectors starting at 'lba' from
+// the ring.  Returns the index of the first line (and the number of
+// lines in '*pcount') or -1 if 'lba' is past the end of the drive.
+static int
+bcache_alloc(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba
+             , int *pcount)
+{
+    u32 spl = BCACHE_LINE_SIZE / drive_fl->blksize;
+    if (lba >= drive_fl->sectors)
+        return -1;
+
+    // Lines are filled in order of the ring - don't wrap or refetch
+    int first = bc->next, count = *pcount, n, i;
+    if (count > bc->count - first)
+        count = bc->count - first;
+    for (n = 1; n < count; n++)
+        if (lba + n * spl >= drive_fl->sectors
+            || bcache_find(bc, drive_fl, lba + n * spl) >= 0)
+            break;
+    for (i = 0; i < n; i++) {
+        bcache_wait(bc, first + i);
+        bcache_drop(bc, first + i);
+    }
+    bc->next = (first + n) % bc->count;
+    *pcount = n;
+    return first;
+}
+
+// Add 'sectors' sectors read from 'lba' into the lines at 'first'
+static void
+bcache_insert(struct bcache_s *bc, struct drive_s *drive_fl, int first
+              , u64 lba, u32 sectors)
+{
+    u32 spl = BCACHE_LINE_SIZE / drive_fl->blksize;
+    int idx;
+    for (idx = first; sectors; idx++, lba += spl) {
+        struct bcache_line_s *line = &bc->lines[idx];
+        line->drive_fl = drive_fl;
+        line->lba = lba;
+        line->count = sectors < spl ? sectors : spl;
+        sectors -= line->count;
+        u16 *head = &bc->hash[bcache_hash(bc, drive_fl, lba)];
+        line->hnext = *head;
+        *head = idx;
+    }
+}
+
+// Read up to '*pcount' lines starting at 'lba' into the cache.
+// Returns the index of the first line (and the number of lines in
+// '*pcount') or -1 on error.
+static int
+bcache_fill(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba
+            , int *pcount)
+{
+    int first = bcache_alloc(bc, drive_fl, lba, pcount);
+    if (first < 0)
+        return -1;
+
+    u32 spl = BCACHE_LINE_SIZE / drive_fl->blksize;
+    u64 sectors = drive_fl->sectors - lba;
+    struct disk_op_s dop;
+    memset(&dop, 0, sizeof(dop));
+    dop.drive_fl = drive_fl;
+    dop.command = CMD_READ;
+    dop.lba = lba;
+    dop.buf_fl = bc->data + first * BCACHE_LINE_SIZE;
+    dop.count = sectors < *pcount * spl ? sectors : *pcount * spl;
+    int ret = __process_op_32(&dop);
+    if (ret)
+        return -1;
+    bcache_insert(bc, drive_fl, first, lba, dop.count);
+    return first;
+}
+
+// Completion handler of read-ahead requests
+static void
+bcache_ra_done(struct disk_req_s *req)
+{
+    if (req->status)
+        bcache_ra_drop(BlockCache, req->data);
+}
+
+// Start reading the next window of a sequential stream into the
+// cache without waiting for it.  The lines are added right away -
+// bcache_wait() must be called before using them.
+static void
+bcache_readahead(struct bcache_s *bc, struct bcache_stream_s *s, int max)
+{
+    struct drive_s *drive_fl = s->drive_fl;
+    bcache_ra_wait(bc, s);
+    if (bcache_find(bc, drive_fl, s->ra_next) >= 0)
+        return;
+    int count = s->window < max ? s->window : max;
+    int first = bcache_alloc(bc, drive_fl, s->ra_next, &count);
+    if (first < 0)
+        return;
+    if (s->window < BCACHE_READAHEAD_MAX)
+        s->window *= 2;
+
+    u32 spl = BCACHE_LINE_SIZE / drive_fl->blksize;
+    u64 sectors = drive_fl->sectors - s->ra_next;
+    struct disk_req_s *req = &s->ra;
+    memset(req, 0, sizeof(*req));
+    req->op.drive_fl = drive_fl;
+    req->op.command = CMD_READ;
+    req->op.lba = s->ra_next;
+    req->op.buf_fl = bc->data + first * BCACHE_LINE_SIZE;
+    req->op.count = sectors < count * spl ? sectors : count * spl;
+    req->complete = bcache_ra_done;
+    req->data = s;
+    if (disk_queue(req))
+        // Not worth waiting for - the lines are filled on demand
+        return;
+    s->ra_first = first;
+    s->ra_lines = count;
+    s->ra_mark = s->ra_next;
+    s->ra_next += count * spl;
+    bcache_insert(bc, drive_fl, first, req->op.lba, req->op.count);
+    SET_LOW(ReadAheadActive, 1);
+}
+
+// Find (or start) the sequential read stream of a drive.
+static struct bcache_stream_s *
+bcache_stream(struct bcache_s *bc, struct drive_s *drive_fl)
+{
+    int i;
+    for (i = 0; i < BCACHE_STREAMS; i++)
+        if (bc->streams[i].drive_fl == drive_fl)
+            return &bc->streams[i];
+    struct bcache_stream_s *s = &bc->streams[bc->nextstream];
+    bc->nextstream = (bc->nextstream + 1) % BCACHE_STREAMS;
+    bcache_ra_wait(bc, s);
+    s->drive_fl = drive_fl;
+    s->next_lba = s->ra_mark = -1;
+    s->window = BCACHE_READAHEAD_LINES;
+    return s;
+}
+
+// Largest number of lines a single fill may request from a drive.
+static int
+bcache_max_lines(struct bcache_s *bc, struct drive_s *drive_fl)
+{
+    u32 max = drive_fl->max_blocks;
+    if (!max)
+        max = 64*1024 / drive_fl->blksize;
+    int lines = max / (BCACHE_LINE_SIZE / drive_fl->blksize);
+    if (lines > BCACHE_READAHEAD_MAX)
+        lines = BCACHE_READAHEAD_MAX;
+    if (lines > bc->count / 4)
+        lines = bc->count / 4;
+    return lines > 1 ? lines : 1;
+}
+
+// Service a read request from the cache.  Returns 0 on success.
+static int
+bcache_read(struct bcache_s *bc, struct disk_op_s *op
+            , struct bcache_stream_s *s)
+{
+    struct drive_s *drive_fl = op->drive_fl;
+    u32 blksize = drive_fl->blksize, spl = BCACHE_LINE_SIZE / blksize;
+    int readahead = op->lba == s->next_lba;
+    if (!readahead)
+        s->window = BCACHE_READAHEAD_LINES;
+    u64 lba = op->lba;
+    u32 remaining = op->count;
+    u8 *buf = op->buf_fl;
+
+    while (remaining) {
+        u64 linelba = lba & ~(u64)(spl - 1);
+        u32 offset = lba - linelba;
+        int max = bcache_max_lines(bc, drive_fl);
+        int idx = bcache_find(bc, drive_fl, linelba);
+        if (idx >= 0) {
+            bcache_wait(bc, idx);
+            if (readahead && linelba == s->ra_mark)
+                // Reached the read-ahead - start reading the next window
+                bcache_readahead(bc, s, max);
+            idx = bcache_find(bc, drive_fl, linelba);
+        }
+        if (idx < 0) {
+            int lines = DIV_ROUND_UP(offset + remaining, spl);
+            int async = readahead && drive_fl->async;
+            if (readahead && !async) {
+                lines = s->window;
+                if (s->window < BCACHE_READAHEAD_MAX)
+                    s->window *= 2;
+            }
+            if (lines > max)
+                lines = max;
+            idx = bcache_fill(bc, drive_fl, linelba, &lines);
+            if (idx < 0)
+                return -1;
+            if (async) {
+                // Read the lines needed now and have the drive read
+                // ahead while they are used
+                s->ra_next = linelba + lines * spl;
+                bcache_readahead(bc, s, max);
+            }
+        }
+        struct bcache_line_s *line = &bc->lines[idx];
+        if (offset >= line->count)
+            return -1;
+        u32 n = line->count - offset;
+        if (n > remaining)
+            n = remaining;
+        memcpy(buf, bc->data + idx * BCACHE_LINE_SIZE + offset * blksize
+               , n * blksize);
+        buf += n * blksize;
+        lba += n;
+        remaining -= n;
+    }
+    return 0;
+}
+
+// Drop all cached lines of a drive in the given range.
+static void
+bcache_invalidate(struct bcache_s *bc, struct drive_s *drive_fl
+                  , u64 lba, u32 count)
+{
+    int i;
+    for (i = 0; i < bc->count; i++) {
+        struct bcache_line_s *line = &bc->lines[i];
+        if (line->count && line->drive_fl == drive_fl
+            && line->lba < lba + count && lba < line->lba + line->count)
+            bcache_drop(bc, i);
+    }
+}
+
+// Command dispatch for 32bit disk drivers through the disk read cache
+static int
+bcache_process_op(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    struct bcache_s *bc = BlockCache;
+    if (!CONFIG_BLOCK_CACHE || !bc || !bcache_cacheable(op->drive_fl))
+        return __process_op_32(op);
+
+    struct drive_s *drive_fl = op->drive_fl;
+    struct bcache_stream_s *s = bcache_stream(bc, drive_fl);
+    switch (op->command) {
+    case CMD_READ:
+        if (op->count * drive_fl->blksize < BCACHE_BYPASS_SIZE
+            && !bcache_read(bc, op, s)) {
+            s->next_lba = op->lba + op->count;
+            return DISK_RET_SUCCESS;
+        }
+        break;
+    case CMD_WRITE:
+        bcache_invalidate(bc, drive_fl, op->lba, op->count);
+        break;
+    case CMD_FORMAT:
+    case CMD_SCSI:
+        bcache_invalidate(bc, drive_fl, 0, -1);
+        break;
+    }
+    s->next_lba = op->lba + op->count;
+    return __process_op_32(op);
+}
+
+
+/****************************************************************
+ * 512 byte sector emulation
+ ****************************************************************/
+
+#define DISK_512E_MAX_BLKSIZE 4096
+
+// The most recently used block of a drive presented as 512 byte
+// sectors.  The cache is write-through - the operating system may
+// take over from the bios at any time.
+struct blk512e_s {
+    u64 lba;            // In device blocks
+    u8 valid;
+    u8 *data;
+};
+
+// Check if a hard drive with the given block size can be used
+int
+disk_blksize_supported(u32 blksize)
+{
+    if (blksize == DISK_SECTOR_SIZE)
+        return 1;
+    return (CONFIG_DISK_512E && blksize > DISK_SECTOR_SIZE
+            && blksize <= DISK_512E_MAX_BLKSIZE && !(blksize & (blksize - 1)));
+}
+
+// Number of sectors as seen by int13 callers
+u64
+drive_sectors(struct drive_s *drive_fl)
+{
+    u64 sectors = GET_FLATPTR(drive_fl->sectors);
+    if (!CONFIG_DISK_512E || sectors == (u64)-1)
+        return sectors;
+    return sectors << GET_FLATPTR(drive_fl->sector_shift);
+}
+
+static void
+blk512e_setup(struct drive_s *drive)
+{
+    u32 blksize = drive->blksize;
+    if (!CONFIG_DISK_512E || drive->blk512e || blksize <= DISK_SECTOR_SIZE
+        || !disk_blksize_supported(blksize))
+        return;
+    struct blk512e_s *be = malloc_high(sizeof(*be));
+    u8 *data = memalign_high(blksize, blksize);
+    if (!be || !data) {
+        warn_noalloc();
+        free(be);
+        free(data);
+        return;
+    }
+    memset(be, 0, sizeof(*be));
+    be->data = data;
+    drive->blk512e = be;
+    drive->sector_shift = __ffs(blksize) - __ffs(DISK_SECTOR_SIZE);
+    dprintf(1, "drive %p: %d byte blocks presented as 512 byte sectors\n"
+            , drive, blksize);
+}
+
+// Issue a request in device blocks
+static int
+blk512e_xfer(struct drive_s *drive_fl, u8 command, u64 lba, u16 count
+             , void *buf)
+{
+    struct disk_op_s dop;
+    memset(&dop, 0, sizeof(dop));
+    dop.drive_fl = drive_fl;
+    dop.command = command;
+    dop.lba = lba;
+    dop.count = count;
+    dop.buf_fl = buf;
+    return bcache_process_op(&dop);
+}
+
+// Translate a request in 512 byte sectors to device blocks.  Whole
+// blocks are transferred directly, partial blocks through the cache.
+static int
+blk512e_process_op(struct disk_op_s *op)
+{
+    struct drive_s *drive_fl = op->drive_fl;
+    struct blk512e_s *be = drive_fl->blk512e;
+    u32 shift = drive_fl->sector_shift, spb = 1 << shift;
+    switch (op->command) {
+    case CMD_READ:
+    case CMD_WRITE:
+        break;
+    case CMD_VERIFY:
+    case CMD_SEEK: {
+        u64 first = op->lba >> shift;
+        u64 last = (op->lba + (op->count ? op->count - 1 : 0)) >> shift;
+        return blk512e_xfer(drive_fl, op->command, first, last - first + 1
+                            , op->buf_fl);
+    }
+    case CMD_FORMAT:
+    case CMD_SCSI:
+        be->valid = 0;
+        // FALLTHROUGH
     default:
-        if (!MODESEGMENT)
-            return DISK_RET_EPARAM;
-        // In 16bit mode and driver not found - try in 32bit mode
-        return call32(process_op_32, MAKE_FLATPTR(GET_SEG(SS), op)
-                      , DISK_RET_EPARAM);
+        return bcache_process_op(op);
+    }
+
+    int iswrite = op->command == CMD_WRITE, ret = DISK_RET_SUCCESS;
+    u16 count = op->count, done = 0;
+    u8 *buf = op->buf_fl;
+    while (done < count) {
+        u64 lba = op->lba + done, block = lba >> shift;
+        u32 offset = lba & (spb - 1), n = count - done;
+        if (!offset && n >= spb) {
+            u16 blocks = n >> shift;
+            ret = blk512e_xfer(drive_fl, op->command, block, blocks, buf);
+            if (iswrite && be->valid && be->lba >= block
+                && be->lba < block + blocks) {
+                // Keep the cached block in sync with the drive
+                if (ret)
+                    be->valid = 0;
+                else
+                    memcpy(be->data, buf + ((u32)(be->lba - block) << (shift + 9))
+                           , spb * DISK_SECTOR_SIZE);
+            }
+            if (ret)
+                break;
+            n = blocks << shift;
+        } else {
+            if (n > spb - offset)
+                n = spb - offset;
+            if (!be->valid || be->lba != block) {
+                be->valid = 0;
+                ret = blk512e_xfer(drive_fl, CMD_READ, block, 1, be->data);
+                if (ret)
+                    break;
+                be->lba = block;
+                be->valid = 1;
+            }
+            u8 *data = be->data + offset * DISK_SECTOR_SIZE;
+            if (iswrite) {
+                memcpy(data, buf, n * DISK_SECTOR_SIZE);
+                ret = blk512e_xfer(drive_fl, CMD_WRITE, block, 1, be->data);
+                if (ret) {
+                    be->valid = 0;
+                    break;
+                }
+            } else {
+                memcpy(buf, data, n * DISK_SECTOR_SIZE);
+            }
+        }
+        done += n;
+        buf += n * DISK_SECTOR_SIZE;
     }
+    op->count = done;
+    return ret;
 }
 
-// Command dispatch for disk drivers that only run in 32bit mode
+// Command dispatch for 32bit disk drivers
 int VISIBLE32FLAT
 process_op_32(struct disk_op_s *op)
 {
     ASSERT32FLAT();
-    switch (op->drive_fl->type) {
-    case DTYPE_VIRTIO_BLK:
-        return virtio_blk_process_op(op);
-    case DTYPE_AHCI:
-        return ahci_process_op(op);
-    case DTYPE_AHCI_ATAPI:
-        return ahci_atapi_process_op(op);
-    case DTYPE_SDCARD:
-        return sdcard_process_op(op);
-    case DTYPE_USB_32:
-        return usb_process_op(op);
-    case DTYPE_UAS_32:
-        return uas_process_op(op);
-    case DTYPE_VIRTIO_SCSI:
-        return virtio_scsi_process_op(op);
-    case DTYPE_PVSCSI:
-        return pvscsi_process_op(op);
-    case DTYPE_NVME:
-        return nvme_process_op(op);
-    default:
-        return process_op_both(op);
-    }
+    if (CONFIG_DISK_512E && op->drive_fl->sector_shift)
+        return blk512e_process_op(op);
+    return bcache_process_op(op);
 }
 
 // Command dispatch for disk drivers that only run in 16bit mode
@@ -601,20 +1321,202 @@ static int
 process_op_16(struct disk_op_s *op)
 {
     ASSERT16();
-    switch (GET_FLATPTR(op->drive_fl->type)) {
-    case DTYPE_FLOPPY:
+    u8 type = GET_FLATPTR(op->drive_fl->type);
+    if (DTYPE_TEST(type, CONFIG_FLOPPY, DTYPE_FLOPPY))
         return floppy_process_op(op);
-    case DTYPE_ATA:
+    if (DTYPE_TEST(type, CONFIG_ATA, DTYPE_ATA))
         return ata_process_op(op);
-    case DTYPE_RAMDISK:
-        return ramdisk_process_op(op);
-    case DTYPE_CDEMU:
+    if (DTYPE_TEST(type, CONFIG_CDROM_EMU, DTYPE_CDEMU))
         return cdemu_process_op(op);
-    default:
-        return process_op_both(op);
+    return process_op_both(op);
+}
+
+// Issue a read or write larger than the driver accepts as several
+// requests of at most 'max' blocks.
+static int
+process_op_split(struct disk_op_s *op, u32 max)
+{
+    struct disk_op_s dop = *op;
+    u32 blksize = GET_FLATPTR(op->drive_fl->blksize);
+    if (CONFIG_DISK_512E && GET_FLATPTR(op->drive_fl->sector_shift))
+        blksize = DISK_SECTOR_SIZE;
+    u16 count = op->count, done = 0;
+    int ret = DISK_RET_SUCCESS;
+    while (done < count) {
+        dop.count = count - done > max ? max : count - done;
+        dop.lba = op->lba + done;
+        dop.buf_fl = op->buf_fl + done * blksize;
+        ret = process_op(&dop);
+        done += dop.count;
+        if (ret)
+            break;
+    }
+    op->count = done;
+    return ret;
+}
+
+
+
+/****************************************************************
+ * Disk request statistics
+ ****************************************************************/
+
+#define DSTATS_MAGIC 0x54534b44 // "DKST"
+#define DSTATS_VERSION 1
+#define DSTATS_DRIVES 8
+#define DSTATS_CMDS 6           // reset, read, write, verify, seek, other
+#define DSTATS_BUCKETS 24       // log2 of the request time in timer ticks
+
+// Binary layout of the statistics - the host reads a copy taken before
+// boot from the "etc/disk-stats" fw_cfg file.  'live' is the address
+// of the counters, which keep running after boot.
+struct dstats_drive_s {
+    u32 drive;                  // Zero for drives that didn't fit
+    u8 type;
+    u8 reserved[3];
+    u32 requests, errors, sectors;
+    u32 commands[DSTATS_CMDS];
+    u32 ticks, max_ticks;
+    u32 latency[DSTATS_BUCKETS];
+} PACKED;
+
+struct dstats_s {
+    u32 magic;
+    u16 version;
+    u8 drive_count, bucket_count;
+    u32 timer_khz;
+    u32 live;
+    u32 bounce_hits, bounce_misses;
+    struct dstats_drive_s drives[DSTATS_DRIVES];
+} PACKED;
+
+struct dstats_s DiskStats VARLOW;
+
+#define DSTATS_ADD(var, val) SET_LOW((var), GET_LOW(var) + (val))
+
+// Note a bounce_buf_get() request
+static void
+dstats_bounce(int hit)
+{
+    if (!CONFIG_DISK_STATS)
+        return;
+    if (hit)
+        DSTATS_ADD(DiskStats.bounce_hits, 1);
+    else
+        DSTATS_ADD(DiskStats.bounce_misses, 1);
+}
+
+static int
+dstats_cmd(u8 command)
+{
+    switch (command) {
+    case CMD_RESET:  return 0;
+    case CMD_READ:   return 1;
+    case CMD_WRITE:  return 2;
+    case CMD_VERIFY: return 3;
+    case CMD_SEEK:   return 4;
+    default:         return 5;
     }
 }
 
+// Note a completed request that was started at timer value 'start'
+static void
+dstats_record(struct disk_op_s *op, int ret, u32 start)
+{
+    if (!CONFIG_DISK_STATS)
+        return;
+    u32 ticks = timer_read() - start;
+    struct drive_s *drive_fl = op->drive_fl;
+    struct dstats_drive_s *ds;
+    int i;
+    for (i=0; i<DSTATS_DRIVES-1; i++) {
+        ds = &DiskStats.drives[i];
+        u32 drive = GET_LOW(ds->drive);
+        if (!drive) {
+            SET_LOW(ds->drive, (u32)drive_fl);
+            SET_LOW(ds->type, GET_FLATPTR(drive_fl->type));
+            break;
+        }
+        if (drive == (u32)drive_fl)
+            break;
+    }
+    // Drives beyond the table are accounted in the last slot
+    ds = &DiskStats.drives[i];
+
+    int cmd = dstats_cmd(op->command);
+    DSTATS_ADD(ds->requests, 1);
+    DSTATS_ADD(ds->commands[cmd], 1);
+    if (ret)
+        DSTATS_ADD(ds->errors, 1);
+    if (cmd >= 1 && cmd <= 3)
+        DSTATS_ADD(ds->sectors, op->count);
+    DSTATS_ADD(ds->ticks, ticks);
+    if (ticks > GET_LOW(ds->max_ticks))
+        SET_LOW(ds->max_ticks, ticks);
+    int bucket = ticks ? __fls(ticks) : 0;
+    if (bucket >= DSTATS_BUCKETS)
+        bucket = DSTATS_BUCKETS - 1;
+    DSTATS_ADD(ds->latency[bucket], 1);
+}
+
+static u32
+dstats_usecs(u32 ticks, u32 khz)
+{
+    if (ticks < 0xffffffff / 1000)
+        return ticks * 1000 / khz;
+    return ticks / khz * 1000;
+}
+
+// Report disk statistics on the debug console and hand them to the host.
+void
+disk_stats_prepboot(void)
+{
+    if (!CONFIG_DISK_STATS)
+        return;
+    u32 khz = timer_khz();
+    DiskStats.magic = DSTATS_MAGIC;
+    DiskStats.version = DSTATS_VERSION;
+    DiskStats.drive_count = DSTATS_DRIVES;
+    DiskStats.bucket_count = DSTATS_BUCKETS;
+    DiskStats.timer_khz = khz;
+    DiskStats.live = (u32)&DiskStats;
+
+    dprintf(1, "Disk statistics (timer %d khz, bounce buffer hits=%d"
+            " misses=%d):\n", khz, DiskStats.bounce_hits
+            , DiskStats.bounce_misses);
+    int i, j;
+    for (i=0; i<DSTATS_DRIVES; i++) {
+        struct dstats_drive_s *ds = &DiskStats.drives[i];
+        if (!ds->requests)
+            continue;
+        dprintf(1, "  drive %08x type %02x: requests=%d errors=%d sectors=%d"
+                " time=%dus max=%dus\n", ds->drive, ds->type, ds->requests
+                , ds->errors, ds->sectors, dstats_usecs(ds->ticks, khz)
+                , dstats_usecs(ds->max_ticks, khz));
+        dprintf(1, "    commands: reset=%d read=%d write=%d verify=%d seek=%d"
+                " other=%d\n", ds->commands[0], ds->commands[1]
+                , ds->commands[2], ds->commands[3], ds->commands[4]
+                , ds->commands[5]);
+        dprintf(1, "    latency:");
+        for (j=0; j<DSTATS_BUCKETS-1; j++)
+            if (ds->latency[j])
+                dprintf(1, " <%dus:%d", dstats_usecs(2 << j, khz)
+                        , ds->latency[j]);
+        if (ds->latency[j])
+            dprintf(1, " >=%dus:%d", dstats_usecs(1 << j, khz)
+                    , ds->latency[j]);
+        dprintf(1, "\n");
+    }
+
+    struct romfile_s *file = romfile_find("etc/disk-stats");
+    if (!file)
+        return;
+    u32 size = sizeof(DiskStats);
+    if (size > file->size)
+        size = file->size;
+    qemu_cfg_write_file(&DiskStats, file, 0, size);
+}
+
 // Execute a disk_op_s request.
 int
 process_op(struct disk_op_s *op)
@@ -623,17 +1525,239 @@ process_op(struct disk_op_s *op)
             , op->drive_fl, (u32)op->lba, op->buf_fl
             , op->count, op->command);
 
+    struct drive_s *wb_fl = GET_LOW(WriteBackDrive);
+    if (wb_fl && wb_fl != op->drive_fl)
+        // Complete the writes buffered on another drive first
+        disk_writeback_flush();
+
     int ret, origcount = op->count;
-    if (origcount * GET_FLATPTR(op->drive_fl->blksize) > 64*1024) {
+    u32 max = GET_FLATPTR(op->drive_fl->max_blocks);
+    if (!max)
+        max = 64*1024 / GET_FLATPTR(op->drive_fl->blksize);
+    u8 shift = CONFIG_DISK_512E ? GET_FLATPTR(op->drive_fl->sector_shift) : 0;
+    max <<= shift;
+    if (origcount > max) {
+        if (op->command == CMD_READ || op->command == CMD_WRITE)
+            return process_op_split(op, max);
         op->count = 0;
         return DISK_RET_EBOUNDARY;
     }
-    if (MODESEGMENT)
+    u32 start = CONFIG_DISK_STATS ? timer_read() : 0;
+    if (MODESEGMENT && shift)
+        // Sector emulation is only done in 32bit mode
+        ret = call32(process_op_32, MAKE_FLATPTR(GET_SEG(SS), op)
+                     , DISK_RET_EPARAM);
+    else if (MODESEGMENT)
         ret = process_op_16(op);
     else
         ret = process_op_32(op);
     if (ret && op->count == origcount)
         // If the count hasn't changed on error, assume no data transferred.
         op->count = 0;
+    dstats_record(op, ret, start);
+    return ret;
+}
+
+// Check if a drive has a 32bit mode request handler (needed to reach
+// EDD 3.0 flat buffer addresses).
+int
+drive_can_flat(struct drive_s *drive_fl)
+{
+    u8 type = GET_FLATPTR(drive_fl->type);
+    return !(DTYPE_TEST(type, CONFIG_FLOPPY, DTYPE_FLOPPY)
+             || DTYPE_TEST(type, CONFIG_ATA, DTYPE_ATA)
+             || DTYPE_TEST(type, CONFIG_CDROM_EMU, DTYPE_CDEMU));
+}
+
+int VISIBLE32FLAT
+process_op_flat_32(struct disk_op_s *op)
+{
+    return process_op(op);
+}
+
+// Execute a read or write whose buffer is an EDD 3.0 flat address -
+// the buffer may be above 1MiB, so the request is run in 32bit mode.
+// The drive must pass drive_can_flat().
+int
+process_op_flat(struct disk_op_s *op)
+{
+    if (!MODESEGMENT)
+        return process_op(op);
+    int origcount = op->count;
+    int ret = call32(process_op_flat_32, MAKE_FLATPTR(GET_SEG(SS), op)
+                     , DISK_RET_EPARAM);
+    if (ret && op->count == origcount)
+        op->count = 0;
     return ret;
 }
+
+
+/****************************************************************
+ * Asynchronous requests
+ ****************************************************************/
+
+// Number of requests a drive can have in flight at once
+int
+disk_queue_depth(struct drive_s *drive_fl)
+{
+    ASSERT32FLAT();
+    return drive_fl->async ? drive_fl->queue_depth : 1;
+}
+
+// Back to the 512 byte sectors the request was submitted with
+static void
+disk_req_untranslate(struct disk_req_s *req)
+{
+    struct disk_op_s *op = &req->op;
+    op->lba <<= req->shift;
+    op->count <<= req->shift;
+    req->shift = 0;
+}
+
+// Called by drivers (and disk_submit()) when a request completes
+void
+disk_req_done(struct disk_req_s *req, int status)
+{
+    ASSERT32FLAT();
+    disk_req_untranslate(req);
+    req->status = status;
+    req->pending = 0;
+    if (req->complete)
+        req->complete(req);
+}
+
+// Hand a request in device blocks to the driver.  Returns zero if it
+// was started, or -1 if it must be processed synchronously.
+static int
+disk_queue(struct disk_req_s *req)
+{
+    struct drive_s *drive_fl = req->op.drive_fl;
+    const struct disk_async_s *async = drive_fl->async;
+    if (!async)
+        return -1;
+    req->status = DISK_RET_SUCCESS;
+    u32 end = timer_calc(DISK_REQUEST_TIMEOUT);
+    for (;;) {
+        int ret = async->submit(req);
+        if (ret == DISK_QUEUE_STARTED) {
+            req->pending = 1;
+            return 0;
+        }
+        if (ret != DISK_QUEUE_FULL)
+            return -1;
+        async->poll(drive_fl);
+        if (timer_check(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
+}
+
+// Convert a read or write in 512 byte sectors to device blocks (see
+// blk512e_process_op()).  Returns -1 if the request must go through
+// process_op() - it isn't block aligned or is too large for the driver.
+static int
+disk_req_translate(struct disk_req_s *req)
+{
+    struct disk_op_s *op = &req->op;
+    struct drive_s *drive_fl = op->drive_fl;
+    if (!op->count || (op->command != CMD_READ && op->command != CMD_WRITE))
+        return -1;
+    u8 shift = CONFIG_DISK_512E ? drive_fl->sector_shift : 0;
+    u32 max = drive_fl->max_blocks;
+    if (!max)
+        max = 64*1024 / drive_fl->blksize;
+    if ((((u32)op->lba | op->count) & ((1 << shift) - 1))
+        || (op->count >> shift) > max)
+        return -1;
+    op->lba >>= shift;
+    op->count >>= shift;
+    req->shift = shift;
+    return 0;
+}
+
+// Start a read or write without waiting for it to complete.  Drives
+// without asynchronous support (and requests their driver can't queue)
+// are processed synchronously.  Returns zero if the request was
+// started or has successfully completed.
+int
+disk_submit(struct disk_req_s *req)
+{
+    ASSERT32FLAT();
+    struct disk_op_s *op = &req->op;
+    struct drive_s *drive_fl = op->drive_fl;
+    req->shift = 0;
+    if (drive_fl->async && !disk_req_translate(req)) {
+        struct drive_s *wb_fl = GET_LOW(WriteBackDrive);
+        if (wb_fl && wb_fl != drive_fl)
+            // Complete the writes buffered on another drive first
+            disk_writeback_flush();
+        if (op->command == CMD_WRITE) {
+            // Keep the caches of the drive in sync
+            if (CONFIG_BLOCK_CACHE && BlockCache)
+                bcache_invalidate(BlockCache, drive_fl, op->lba, op->count);
+            struct blk512e_s *be = drive_fl->blk512e;
+            if (CONFIG_DISK_512E && be && be->lba >= op->lba
+                && be->lba < op->lba + op->count)
+                be->valid = 0;
+        }
+        if (!disk_queue(req))
+            return 0;
+        disk_req_untranslate(req);
+    }
+    // Use the synchronous path (with its sector emulation and bounce
+    // buffers)
+    req->pending = 1;
+    int status = process_op(op);
+    disk_req_done(req, status);
+    return status;
+}
+
+// Complete any finished requests of a drive.  Returns the number of
+// requests still in flight.
+int
+disk_poll(struct drive_s *drive_fl)
+{
+    ASSERT32FLAT();
+    const struct disk_async_s *async = drive_fl->async;
+    return async ? async->poll(drive_fl) : 0;
+}
+
+// Wait for a request to complete and return its status
+int
+disk_wait(struct disk_req_s *req)
+{
+    ASSERT32FLAT();
+    u32 end = timer_calc(DISK_REQUEST_TIMEOUT);
+    while (req->pending) {
+        disk_poll(req->op.drive_fl);
+        if (!req->pending)
+            break;
+        if (timer_check(end)) {
+            warn_timeout();
+            return DISK_RET_ETIMEOUT;
+        }
+        yield();
+    }
+    return req->status;
+}
+
+// Wait for all requests in flight on a drive to complete.  Drivers
+// call this before using their synchronous path.
+void
+disk_drain(struct drive_s *drive_fl)
+{
+    ASSERT32FLAT();
+    const struct disk_async_s *async = drive_fl->async;
+    if (!async)
+        return;
+    u32 end = timer_calc(DISK_REQUEST_TIMEOUT);
+    while (async->poll(drive_fl)) {
+        if (timer_check(end)) {
+            warn_timeout();
+            return;
+        }
+        yield();
+    }
+}
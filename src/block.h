@@ -31,8 +31,34 @@ struct disk_op_s {
 #define CMD_FORMAT  0x05
 #define CMD_SEEK    0x07
 #define CMD_ISREADY 0x10
+#define CMD_FLUSH   0x11
 #define CMD_SCSI    0x20
 
+// An asynchronous read or write (see disk_submit()).  The request
+// must stay in place until it is no longer pending.
+struct disk_req_s {
+    struct disk_op_s op;
+    // Optional - called from disk_poll() (or disk_submit()) once the
+    // request completes.  It may submit further requests.
+    void (*complete)(struct disk_req_s *req);
+    void *data;         // For use by the submitter
+    int status;         // DISK_RET_* once the request completes
+    u8 pending;
+    u8 shift;           // Sector shift applied by disk_submit()
+};
+
+// Handlers of drivers that can keep several requests in flight
+struct disk_async_s {
+    // Start a request - returns one of DISK_QUEUE_*
+    int (*submit)(struct disk_req_s *req);
+    // Complete finished requests - returns the number still in flight
+    int (*poll)(struct drive_s *drive_fl);
+};
+
+#define DISK_QUEUE_STARTED 0 // Request is in flight
+#define DISK_QUEUE_FULL    1 // No room for the request right now
+#define DISK_QUEUE_SYNC    2 // Request must use the synchronous path
+
 
 /****************************************************************
  * Global storage
@@ -45,6 +71,9 @@ struct chs_s {
     u16 pad;
 };
 
+struct disk_op_s;
+typedef int (*process_op_fn)(struct disk_op_s *op);
+
 struct drive_s {
     u8 type;            // Driver type (DTYPE_*)
     u8 floppy_type;     // Type of floppy (only for floppy drives).
@@ -59,8 +88,19 @@ struct drive_s {
     struct chs_s pchs;  // Physical CHS
     u32 max_segment_size; //max_segment_size
     u32 max_segments;   //max_segments
+    u16 max_blocks;     // Max blocks per driver request (0 for 64KiB)
+    process_op_fn op32; // 32bit mode request handler (set when mapped)
+    // Optional - support for disk_submit() and its queue depth
+    const struct disk_async_s *async;
+    u8 queue_depth;
+    // Set on hard drives with larger blocks presented as 512 byte sectors
+    u8 sector_shift;    // log2(blksize / DISK_SECTOR_SIZE)
+    struct blk512e_s *blk512e;
 };
 
+// Time allowed for a single disk request to complete (in ms)
+#define DISK_REQUEST_TIMEOUT 32000
+
 #define DISK_SECTOR_SIZE  512
 #define CDROM_SECTOR_SIZE 2048
 
@@ -101,6 +141,10 @@ struct drive_s {
 #define EXTSTART_HD 0x80
 #define EXTSTART_CD 0xE0
 
+// Bounce buffer pool (one sector sized low buffer and the rest high)
+#define BOUNCE_BUF_COUNT 4
+#define BOUNCE_BUF_SIZE  4096
+
 
 /****************************************************************
  * Function defs
@@ -108,17 +152,31 @@ struct drive_s {
 
 // block.c
 extern u8 FloppyCount, CDCount;
-extern u8 *bounce_buf_fl;
 struct drive_s *getDrive(u8 exttype, u8 extdriveoffset);
 int getDriveId(u8 exttype, struct drive_s *drive);
 void map_floppy_drive(struct drive_s *drive);
+int disk_blksize_supported(u32 blksize);
+u64 drive_sectors(struct drive_s *drive_fl);
 void map_hd_drive(struct drive_s *drive);
 void map_cd_drive(struct drive_s *drive);
 struct int13dpt_s;
 int fill_edd(struct segoff_s edd, struct drive_s *drive_fl);
 void block_setup(void);
+void disk_stats_prepboot(void);
 int default_process_op(struct disk_op_s *op);
 int process_op(struct disk_op_s *op);
+int drive_can_flat(struct drive_s *drive_fl);
+int process_op_flat(struct disk_op_s *op);
+void disk_writeback_note(struct drive_s *drive_fl);
+void disk_writeback_flush(void);
+int disk_queue_depth(struct drive_s *drive_fl);
+int disk_submit(struct disk_req_s *req);
+int disk_poll(struct drive_s *drive_fl);
+int disk_wait(struct disk_req_s *req);
+void disk_drain(struct drive_s *drive_fl);
+void disk_req_done(struct disk_req_s *req, int status);
 int create_bounce_buf(void);
+u8 *bounce_buf_get(u32 *size);
+void bounce_buf_put(u8 *buf);
 
 #endif // block.h
@@ -7,7 +7,7 @@
 * This work is licensed under the terms of the GNU LGPLv3.
 */
 #include "malloc.h" // malloc_tmphigh
-#include "string.h" // memcpy
+#include "string.h" // iomemcpy
 #include "util.h" // struct bmp_decdata
 
 struct bmp_decdata {
@@ -16,6 +16,7 @@ struct bmp_decdata {
     int width;
     int height;
     int bpp;
+    int topdown;
 };
 
 #define bmp_load4byte(addr) (*(u32 *)(addr))
@@ -50,20 +51,44 @@ typedef struct tagRGBQUAD {
     u8 rgbReserved;
 } RGBQUAD, tagRGBQUAD;
 
-/* flat picture data adjusting function
+/* bytes in one (dword padded) line of the bmp pixel data */
+static int bmp_stride(struct bmp_decdata *bmp)
+{
+    return ALIGN(bmp->width * (bmp->bpp / 8), 4);
+}
+
+/* row conversion functions
 * description:
-*   switch the vertical line sequence
-*   arrange horizontal pixel data, add extra space in the dest buffer
-*       for every line
+*   convert one line of 'width' bgr pixels straight into the frame
+*   buffer, using only dword sized writes where possible
 */
-static void raw_data_format_adjust(u8 *src, u8 *dest, int width,
-		int height, int bytes_per_line_src, int bytes_per_line_dest)
+static void bmp_row_24to32(u8 *dest, u8 *src, int width)
 {
-    int i;
-    for (i = 0 ; i < height ; i++) {
-        memcpy(dest + i * bytes_per_line_dest,
-           src + (height - 1 - i) * bytes_per_line_src, bytes_per_line_src);
+    u32 *d = (void *)dest;
+    /* four pixels from three dwords */
+    for (; width >= 4; width -= 4, src += 12, d += 4) {
+        u32 a = bmp_load4byte(src), b = bmp_load4byte(src + 4);
+        u32 c = bmp_load4byte(src + 8);
+        d[0] = a & 0xffffff;
+        d[1] = ((a >> 24) | (b << 8)) & 0xffffff;
+        d[2] = ((b >> 16) | (c << 16)) & 0xffffff;
+        d[3] = c >> 8;
     }
+    for (; width > 0; width--, src += 3)
+        *d++ = src[0] | (src[1] << 8) | (src[2] << 16);
+}
+
+#define BMP_RGB565(p) ((((p)[2] & 0xf8) << 8) | (((p)[1] & 0xfc) << 3) \
+                      | ((p)[0] >> 3))
+
+static void bmp_row_24to16(u8 *dest, u8 *src, int width)
+{
+    u32 *d = (void *)dest;
+    /* two pixels per dword */
+    for (; width >= 2; width -= 2, src += 6)
+        *d++ = BMP_RGB565(src) | (BMP_RGB565(src + 3) << 16);
+    if (width)
+        *(u16 *)d = BMP_RGB565(src);
 }
 
 /* allocate decdata struct */
@@ -90,6 +115,15 @@ int bmp_decode(struct bmp_decdata *bmp, unsigned char *data, int data_size)
     bmp->width = bmp_load4byte(data + 18);
     bmp->height = bmp_load4byte(data + 22);
     bmp->bpp = bmp_load2byte(data + 28);
+    bmp->topdown = 0;
+    if (bmp->height < 0) {
+        bmp->height = -bmp->height;
+        bmp->topdown = 1;
+    }
+    if (bmp->width <= 0 || bmp->bpp < 8 || bmp->bpp % 8
+        || bmp_dataoffset > data_size
+        || (data_size - bmp_dataoffset) / bmp_stride(bmp) < bmp->height)
+        return 4;
     return 0;
 }
 
@@ -101,16 +135,37 @@ void bmp_get_info(struct bmp_decdata *bmp, int *width, int *height, int *bpp)
     *bpp = bmp->bpp;
 }
 
-/* flush flat picture data to *pc */
+/* flush flat picture data to *pc
+* description:
+*   flip the bottom-up lines and convert a line at a time straight
+*   into *pc, which may be the frame buffer.  Same depth images are
+*   copied as is; 24bpp images can also be shown in 32 or 16 (565) bpp
+*/
 int bmp_show(struct bmp_decdata *bmp, unsigned char *pic, int width,
              int height, int depth, int bytes_per_line_dest)
 {
+    void (*convert)(u8 *dest, u8 *src, int width) = NULL;
+    int i, stride = bmp_stride(bmp);
+
     if (bmp->datap == pic)
         return 0;
-    if ((depth == bmp->bpp) && (bmp->bpp%8 == 0)) {
-        raw_data_format_adjust(bmp->datap, pic, width, height,
-			(bmp->bpp/8)*width, bytes_per_line_dest);
-        return 0;
+    if (width != bmp->width || height != bmp->height)
+        return 1;
+    if (depth != bmp->bpp) {
+        if (bmp->bpp == 24 && depth == 32)
+            convert = bmp_row_24to32;
+        else if (bmp->bpp == 24 && depth == 16)
+            convert = bmp_row_24to16;
+        else
+            return 1;
+    }
+    for (i = 0 ; i < height ; i++) {
+        u8 *src = bmp->datap + (bmp->topdown ? i : height - 1 - i) * stride;
+        u8 *dest = pic + i * bytes_per_line_dest;
+        if (convert)
+            convert(dest, src, width);
+        else
+            iomemcpy(dest, src, width * (bmp->bpp / 8));
     }
-    return 1;
+    return 0;
 }
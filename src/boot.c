@@ -17,6 +17,7 @@
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "romfile.h" // romfile_loadint
+#include "stacks.h" // run_thread
 #include "std/disk.h" // struct mbr_s
 #include "string.h" // memset
 #include "util.h" // irqtimer_calc
@@ -245,6 +246,101 @@ int boot_lchs_find_ata_device(struct pci_device *pci, int chanid, int slave,
 static char **Bootorder VARVERIFY32INIT;
 static int BootorderCount;
 
+// The bootorder list compiled into a tree of path components, so that
+// a lookup only visits entries sharing a prefix with the search glob.
+struct bootorder_node_s {
+    const char *name;   // Path component - ends at '/' or end of string
+    int prio;           // Best priority of the entries in this subtree
+    struct bootorder_node_s *child, *next;
+};
+static struct bootorder_node_s *BootorderTree VARVERIFY32INIT;
+
+// Return the length of the path component at 's'
+static int
+component_len(const char *s)
+{
+    int len = 0;
+    while (s[len] && s[len] != '/')
+        len++;
+    return len;
+}
+
+// Add bootorder entry 'path' with priority 'prio' to the tree.
+static void
+bootorder_add(const char *path, int prio)
+{
+    struct bootorder_node_s **pnode = &BootorderTree;
+    for (;;) {
+        int len = component_len(path);
+        struct bootorder_node_s *node;
+        for (node = *pnode; node; node = node->next)
+            if (component_len(node->name) == len
+                && !memcmp(node->name, path, len))
+                break;
+        if (!node) {
+            node = malloc_tmphigh(sizeof(*node));
+            if (!node) {
+                warn_noalloc();
+                return;
+            }
+            // Entries are added in priority order - the first is the best.
+            node->name = path;
+            node->prio = prio;
+            node->child = NULL;
+            node->next = *pnode;
+            *pnode = node;
+        }
+        path += len;
+        if (!*path)
+            return;
+        path++;
+        pnode = &node->child;
+    }
+}
+
+// Check if the glob component at 'glob' matches the whole path
+// component at 'str' ('*' matches any number of characters up to the
+// next glob character, as in glob_prefix()).
+static int
+glob_component(const char *glob, const char *str)
+{
+    for (;;) {
+        if (!*glob || *glob == '/')
+            return !*str || *str == '/';
+        if (*glob == '*') {
+            if (!*str || *str == '/' || *str == glob[1])
+                glob++;
+            else
+                str++;
+            continue;
+        }
+        if (*glob != *str)
+            return 0;
+        glob++;
+        str++;
+    }
+}
+
+// Find the best priority below 'node' of an entry that 'glob' matches
+// a prefix of - or 'best' if there is no better one.
+static int
+bootorder_lookup(struct bootorder_node_s *node, const char *glob, int best)
+{
+    const char *rest = glob + component_len(glob);
+    for (; node; node = node->next) {
+        if (best >= 0 && node->prio >= best)
+            // Nothing in this subtree can improve on 'best'
+            continue;
+        if (!glob_component(glob, node->name))
+            continue;
+        if (!*rest)
+            best = node->prio;
+        else
+            best = bootorder_lookup(node->child, rest + 1, best);
+    }
+    return best;
+}
+
 static void
 loadBootOrder(void)
 {
@@ -279,6 +375,7 @@ loadBootOrder(void)
             *(f++) = '\0';
         Bootorder[i] = nullTrailingSpace(Bootorder[i]);
         dprintf(1, "%d: %s\n", i+1, Bootorder[i]);
+        bootorder_add(Bootorder[i], i+1);
         i++;
     } while (f);
 }
@@ -288,11 +385,7 @@ static int
 find_prio(const char *glob)
 {
     dprintf(1, "Searching bootorder for: %s\n", glob);
-    int i;
-    for (i = 0; i < BootorderCount; i++)
-        if (glob_prefix(glob, Bootorder[i]))
-            return i+1;
-    return -1;
+    return bootorder_lookup(BootorderTree, glob, -1);
 }
 
 u8 is_bootprio_strict(void)
@@ -304,6 +397,14 @@ u8 is_bootprio_strict(void)
     return prio_halt >= 0;
 }
 
+static int FastBoot;
+
+// Is the fast boot profile (no keyboard, mouse, or boot menu) active
+u8 is_fast_boot(void)
+{
+    return FastBoot;
+}
+
 int bootprio_find_pci_device(struct pci_device *pci)
 {
     if (CONFIG_CSM)
@@ -347,6 +448,30 @@ int bootprio_find_scsi_mmio_device(void *mmio, int target, int lun)
     return find_prio(desc);
 }
 
+// Find the best priority of any lun on the given scsi target.
+int bootprio_find_scsi_target(struct pci_device *pci, int target)
+{
+    if (!CONFIG_BOOTORDER)
+        return -1;
+    if (!pci)
+        // support only pci machine for now
+        return -1;
+    char desc[256], *p;
+    p = build_pci_path(desc, sizeof(desc), "*", pci);
+    snprintf(p, desc+sizeof(desc)-p, "/*@0/*@%x,*", target);
+    return find_prio(desc);
+}
+
+int bootprio_find_scsi_mmio_target(void *mmio, int target)
+{
+    if (!CONFIG_BOOTORDER)
+        return -1;
+    char desc[256];
+    snprintf(desc, sizeof(desc), "/virtio-mmio@%016x/*@0/*@%x,*",
+             (u32)mmio, target);
+    return find_prio(desc);
+}
+
 int bootprio_find_ata_device(struct pci_device *pci, int chanid, int slave)
 {
     if (CONFIG_CSM)
@@ -361,6 +486,27 @@ int bootprio_find_ata_device(struct pci_device *pci, int chanid, int slave)
     return find_prio(desc);
 }
 
+// Find an nvme namespace - for example: /pci@i0cf8/*@4/namespace@1,0
+int bootprio_find_nvme_ns(struct pci_device *pci, u32 nsid)
+{
+    if (CONFIG_CSM)
+        return csm_bootprio_pci(pci);
+    if (!CONFIG_BOOTORDER)
+        return -1;
+    char desc[256], *p;
+    p = build_pci_path(desc, sizeof(desc), "*", pci);
+    snprintf(p, desc+sizeof(desc)-p, "/namespace@%x,*", nsid);
+    int prio = find_prio(desc);
+    if (prio >= 0)
+        return prio;
+    // Only an entry naming the controller itself covers all namespaces
+    snprintf(p, desc+sizeof(desc)-p, "/*");
+    if (find_prio(desc) >= 0)
+        return -1;
+    *p = '\0';
+    return find_prio(desc);
+}
+
 int bootprio_find_fdc_device(struct pci_device *pci, int port, int fdid)
 {
     if (CONFIG_CSM)
@@ -457,6 +603,9 @@ static int CheckFloppySig = 1;
 
 #define DEFAULT_PRIO           9999
 
+static int LazyInit;
+static int EarlyExit, TopDeviceFound;
+
 static int DefaultFloppyPrio = 101;
 static int DefaultCDPrio     = 102;
 static int DefaultHDPrio     = 103;
@@ -492,9 +641,33 @@ boot_init(void)
     BootRetryTime = romfile_loadint("etc/boot-fail-wait", 60*1000);
 
     loadBootOrder();
+    LazyInit = BootorderCount && romfile_loadint("etc/boot-lazy-init", 0);
+    FastBoot = romfile_loadint("etc/fast-boot", 0);
+    EarlyExit = (BootorderCount && romfile_loadint("etc/boot-early-exit", 0)
+                 && (!CONFIG_BOOTMENU || FastBoot
+                     || !romfile_loadint("etc/show-boot-menu", 1)));
     loadBiosGeometry();
 }
 
+// Note the registration of a drive - with "etc/boot-early-exit" the
+// device probing stops once the first bootorder entry is present.
+static void
+boot_check_top(const char *desc, int prio)
+{
+    if (!EarlyExit || prio != 1 || TopDeviceFound)
+        return;
+    dprintf(1, "Found first bootorder device %s - stopping device probe\n"
+            , desc ?: "?");
+    TopDeviceFound = 1;
+}
+
+// Check if device probe threads should stop looking for further devices.
+int
+boot_stop_probing(void)
+{
+    return TopDeviceFound;
+}
+
 
 /****************************************************************
  * BootList handling
@@ -559,9 +732,15 @@ bootentry_add(int type, int prio, u32 data, const char *desc)
     hlist_add(&be->node, pprev);
 }
 
+// Number of boot entries registered with an explicit priority.
+static int BootorderMatches;
+
 // Return the given priority if it's set - defaultprio otherwise.
 static inline int defPrio(int priority, int defaultprio) {
-    return (priority < 0) ? defaultprio : priority;
+    if (priority < 0)
+        return defaultprio;
+    BootorderMatches++;
+    return priority;
 }
 
 // Add a BEV vector for a given pnp compatible option rom.
@@ -593,6 +772,7 @@ boot_add_floppy(struct drive_s *drive, const char *desc, int prio)
 void
 boot_add_hd(struct drive_s *drive, const char *desc, int prio)
 {
+    boot_check_top(desc, prio);
     bootentry_add(IPL_TYPE_HARDDISK, defPrio(prio, DefaultHDPrio)
                   , (u32)drive, desc);
 }
@@ -600,6 +780,7 @@ boot_add_hd(struct drive_s *drive, const char *desc, int prio)
 void
 boot_add_cd(struct drive_s *drive, const char *desc, int prio)
 {
+    boot_check_top(desc, prio);
     if (GET_GLOBAL(PlatformRunningOn) & PF_QEMU) {
         // We want short boot times.  But on physical hardware even
         // the test unit ready can take several seconds.  So do media
@@ -622,6 +803,73 @@ boot_add_cbfs(void *data, const char *desc, int prio)
 }
 
 
+/****************************************************************
+ * Deferred controller initialization
+ ****************************************************************/
+
+// With "etc/boot-lazy-init" set, storage controllers that no bootorder
+// entry refers to are not initialized during POST.  They are started
+// only if the boot menu is opened or if no bootorder entry matched any
+// device that was initialized.
+struct deferinit_s {
+    void (*func)(void *data);
+    struct pci_device *pci;
+    struct hlist_node node;
+};
+static struct hlist_head DeferList VARVERIFY32INIT;
+
+// Defer initialization of the controller at 'pci' (by 'func(pci)') if
+// lazy init is enabled and the bootorder doesn't refer to it.
+int
+boot_defer_pci(void (*func)(void *), struct pci_device *pci)
+{
+    if (!LazyInit || bootprio_find_pci_device(pci) >= 0)
+        return 0;
+    struct deferinit_s *d = malloc_tmp(sizeof(*d));
+    if (!d) {
+        warn_noalloc();
+        return 0;
+    }
+    d->func = func;
+    d->pci = pci;
+    // Keep PCI order so drives are found in the usual order later
+    struct hlist_node **pprev;
+    struct deferinit_s *pos;
+    hlist_for_each_entry_pprev(pos, pprev, &DeferList, node)
+        ;
+    hlist_add(&d->node, pprev);
+    dprintf(1, "Deferring init of %pP\n", pci);
+    return 1;
+}
+
+// Scheduling priority for the init thread of the controller at 'pci' -
+// controllers that the bootorder refers to are probed first.
+int
+boot_thread_prio(struct pci_device *pci)
+{
+    if (bootprio_find_pci_device(pci) >= 0)
+        return THREAD_PRIO_HIGH;
+    return THREAD_PRIO_NORMAL;
+}
+
+// Start all deferred controller initializations and wait for them.
+static void
+boot_run_deferred(void)
+{
+    if (hlist_empty(&DeferList))
+        return;
+    dprintf(1, "Running deferred controller init\n");
+    struct deferinit_s *d;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(d, n, &DeferList, node) {
+        hlist_del(&d->node);
+        run_thread(d->func, d->pci);
+        free(d);
+    }
+    wait_threads();
+}
+
+
 /****************************************************************
  * Keyboard calls
  ****************************************************************/
@@ -690,11 +938,25 @@ static const char menuchars[] = {
     'u', 'v', 'w', 'x', 'y', 'z'
 };
 
+static int BootMenuSelected;
+
+// Return the bootorder priority of the entry that will be booted first,
+// or -1 if the bootorder file did not select it.
+int
+boot_selected_prio(void)
+{
+    if (BootMenuSelected || hlist_empty(&BootList))
+        return -1;
+    struct bootentry_s *pos = container_of(
+        BootList.first, struct bootentry_s, node);
+    return pos->priority < BootorderCount ? pos->priority : -1;
+}
+
 // Show IPL option menu.
 void
 interactive_bootmenu(void)
 {
-    if (! CONFIG_BOOTMENU)
+    if (! CONFIG_BOOTMENU || FastBoot)
         return;
     int show_boot_menu = romfile_loadint("etc/show-boot-menu", 1);
     if (!show_boot_menu)
@@ -729,7 +991,9 @@ interactive_bootmenu(void)
     while (get_keystroke(0) >= 0)
         ;
 
+    optionrom_run_lazy();
     printf("Select boot device:\n\n");
+    boot_run_deferred();
     wait_threads();
 
     // Show menu items
@@ -791,6 +1055,7 @@ interactive_bootmenu(void)
     hlist_del(&boot->node);
     boot->priority = 0;
     hlist_add_head(&boot->node, &BootList);
+    BootMenuSelected = 1;
 }
 
 // BEV (Boot Execution Vector) list
@@ -823,6 +1088,13 @@ bcv_prepboot(void)
     if (! CONFIG_BOOT)
         return;
 
+    // Nothing in the bootorder was found - fall back to all devices.
+    if (!BootorderMatches)
+        boot_run_deferred();
+
+    // Run option roms skipped due to the rom cache if needed.
+    optionrom_cache_prepboot();
+
     int haltprio = find_prio("HALT");
     if (haltprio >= 0)
         bootentry_add(IPL_TYPE_HALT, haltprio, 0, "HALT");
@@ -1041,6 +1313,7 @@ void VISIBLE32FLAT
 handle_19(void)
 {
     debug_enter(NULL, DEBUG_HDL_19);
+    disk_writeback_flush();
     BootSequence = 0;
     do_boot(0);
 }
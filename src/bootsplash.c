@@ -10,7 +10,7 @@
 #include "farptr.h" // FLATPTR_TO_SEG
 #include "malloc.h" // free
 #include "output.h" // dprintf
-#include "romfile.h" // romfile_loadfile
+#include "romfile.h" // romfile_mapfile
 #include "stacks.h" // call16_int
 #include "std/vbe.h" // struct vbe_info
 #include "string.h" // memset
@@ -92,6 +92,37 @@ find_videomode(struct vbe_info *vesa_info, struct vbe_mode_info *mode_info
     }
 }
 
+// Header of a pre-decoded "bootsplash.raw" image.  The pixel rows
+// follow top to bottom, each 'width * bpp / 8' bytes in the pixel
+// format of the matching vesa mode, so they can be copied to the
+// framebuffer without any decoding.
+struct bootsplash_raw_s {
+    u32 magic;
+    u16 width;
+    u16 height;
+    u8 bpp;
+    u8 reserved[3];
+} PACKED;
+
+#define BOOTSPLASH_RAW_MAGIC 0x57525342 // "BSRW"
+
+// Copy a pre-decoded image to the framebuffer.
+static int
+raw_show(struct bootsplash_raw_s *raw, void *framebuffer
+         , int bytes_per_line_dest)
+{
+    u8 *pixels = (void*)&raw[1];
+    int width = raw->width * (raw->bpp / 8), y;
+    if (width == bytes_per_line_dest) {
+        iomemcpy(framebuffer, pixels, width * raw->height);
+        return 0;
+    }
+    for (y = 0; y < raw->height; y++)
+        iomemcpy(framebuffer + y * bytes_per_line_dest, pixels + y * width
+                 , width);
+    return 0;
+}
+
 static int BootsplashActive;
 
 void
@@ -99,20 +130,26 @@ enable_bootsplash(void)
 {
     if (!CONFIG_BOOTSPLASH)
         return;
-    /* splash picture can be bmp or jpeg file */
+    /* splash picture can be a pre-decoded raw image, jpeg or bmp file */
     dprintf(3, "Checking for bootsplash\n");
-    u8 type = 0; /* 0 means jpg, 1 means bmp, default is 0=jpg */
+    u8 type = 2; /* 0 means jpg, 1 means bmp, 2 means raw */
     int filesize;
-    u8 *filedata = romfile_loadfile("bootsplash.jpg", &filesize);
+    void *filecopy;
+    u8 *filedata = romfile_mapfile("bootsplash.raw", &filesize, &filecopy);
     if (!filedata) {
-        filedata = romfile_loadfile("bootsplash.bmp", &filesize);
+        type = 0;
+        filedata = romfile_mapfile("bootsplash.jpg", &filesize, &filecopy);
+    }
+    if (!filedata) {
+        filedata = romfile_mapfile("bootsplash.bmp", &filesize, &filecopy);
         if (!filedata)
             return;
         type = 1;
     }
     dprintf(3, "start showing bootsplash\n");
 
-    u8 *picture = NULL; /* data buff used to be flushed to the video buf */
+    u8 *rowbuf = NULL; /* jpeg decode buffer for one row of MCUs */
+    struct bootsplash_raw_s *raw = NULL;
     struct jpeg_decdata *jpeg = NULL;
     struct bmp_decdata *bmp = NULL;
     struct vbe_info *vesa_info = malloc_tmplow(sizeof(*vesa_info));
@@ -145,7 +182,19 @@ enable_bootsplash(void)
 
     int ret, width, height;
     int bpp_require = 0;
-    if (type == 0) {
+    if (type == 2) {
+        raw = (void*)filedata;
+        if (filesize < sizeof(*raw) || raw->magic != BOOTSPLASH_RAW_MAGIC
+            || (raw->bpp != 16 && raw->bpp != 24 && raw->bpp != 32)
+            || (filesize - sizeof(*raw)
+                < (u32)raw->width * raw->height * (raw->bpp / 8))) {
+            dprintf(1, "Invalid bootsplash.raw image\n");
+            goto done;
+        }
+        width = raw->width;
+        height = raw->height;
+        bpp_require = raw->bpp;
+    } else if (type == 0) {
         jpeg = jpeg_alloc();
         if (!jpeg) {
             warn_noalloc();
@@ -180,6 +229,13 @@ enable_bootsplash(void)
     // Try to find a graphics mode with the corresponding dimensions.
     int videomode = find_videomode(vesa_info, mode_info, width, height,
                                        bpp_require);
+    if (videomode < 0 && type == 1 && bpp_require == 24) {
+        // bmp_show() can convert 24bpp images to 32 and 16bpp modes
+        videomode = find_videomode(vesa_info, mode_info, width, height, 32);
+        if (videomode < 0)
+            videomode = find_videomode(vesa_info, mode_info, width, height
+                                       , 16);
+    }
     if (videomode < 0) {
         dprintf(1, "failed to find a videomode with %dx%d %dbpp (0=any).\n",
                     width, height, bpp_require);
@@ -192,28 +248,12 @@ enable_bootsplash(void)
     dprintf(3, "bytes per scanline: %d\n", mode_info->bytes_per_scanline);
     dprintf(3, "bits per pixel: %d\n", depth);
 
-    // Allocate space for image and decompress it.
-    int imagesize = height * mode_info->bytes_per_scanline;
-    picture = malloc_tmphigh(imagesize);
-    if (!picture) {
-        warn_noalloc();
-        goto done;
-    }
-
+    // The image is drawn straight into the framebuffer; jpeg decodes
+    // each row of MCUs into a small buffer first.
     if (type == 0) {
-        dprintf(5, "Decompressing bootsplash.jpg\n");
-        ret = jpeg_show(jpeg, picture, width, height, depth,
-                            mode_info->bytes_per_scanline);
-        if (ret) {
-            dprintf(1, "jpeg_show failed with return code %d...\n", ret);
-            goto done;
-        }
-    } else {
-        dprintf(5, "Decompressing bootsplash.bmp\n");
-        ret = bmp_show(bmp, picture, width, height, depth,
-                           mode_info->bytes_per_scanline);
-        if (ret) {
-            dprintf(1, "bmp_show failed with return code %d...\n", ret);
+        rowbuf = malloc_tmphigh(16 * mode_info->bytes_per_scanline);
+        if (!rowbuf) {
+            warn_noalloc();
             goto done;
         }
     }
@@ -231,13 +271,27 @@ enable_bootsplash(void)
 
     /* Show the picture */
     dprintf(5, "Showing bootsplash picture\n");
-    iomemcpy(framebuffer, picture, imagesize);
+    int bpl = mode_info->bytes_per_scanline;
+    if (type == 2)
+        ret = raw_show(raw, framebuffer, bpl);
+    else if (type == 0)
+        ret = jpeg_show(jpeg, framebuffer, width, height, depth, bpl, rowbuf);
+    else
+        ret = bmp_show(bmp, framebuffer, width, height, depth, bpl);
+    if (ret) {
+        dprintf(1, "bootsplash show failed with return code %d...\n", ret);
+        // Go back to the text console
+        memset(&br, 0, sizeof(br));
+        br.ax = 0x0003;
+        call16_int10(&br);
+        goto done;
+    }
     dprintf(5, "Bootsplash copy complete\n");
     BootsplashActive = 1;
 
 done:
-    free(filedata);
-    free(picture);
+    free(filecopy);
+    free(rowbuf);
     free(vesa_info);
     free(mode_info);
     free(jpeg);
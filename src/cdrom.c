@@ -26,6 +26,49 @@ struct eltorito_s CDEmu VARLOW = { .size=sizeof(CDEmu) };
 struct drive_s *emulated_drive_gf VARLOW;
 struct drive_s *cdemu_drive_gf VARFSEG;
 
+// Recently read cdrom sectors, used for the partial sector reads of
+// the emulated drive.  The cache holds one run of consecutive sectors
+// filled by a single read-ahead request, so that neighboring 512 byte
+// requests are served from memory.
+#define CDEMU_CACHE_SECTORS 4
+
+u8 *CDEmuCache VARFSEG;
+u32 CDEmuCacheLba VARLOW;
+u8 CDEmuCacheCount VARLOW;
+
+// Find cdrom sector 'lba' in the cache - reading it (and the sectors
+// following it) on a miss.
+static int
+cdemu_cache_read(struct drive_s *drive_gf, u32 lba, u8 **data_fl)
+{
+    u8 *cache_fl = GET_GLOBAL(CDEmuCache);
+    u32 first = GET_LOW(CDEmuCacheLba);
+    if (lba >= first && lba - first < GET_LOW(CDEmuCacheCount)) {
+        *data_fl = cache_fl + (lba - first) * CDROM_SECTOR_SIZE;
+        return DISK_RET_SUCCESS;
+    }
+
+    SET_LOW(CDEmuCacheCount, 0);
+    struct disk_op_s dop;
+    dop.drive_fl = drive_gf;
+    dop.command = CMD_READ;
+    dop.lba = lba;
+    dop.count = CDEMU_CACHE_SECTORS;
+    dop.buf_fl = cache_fl;
+    int ret = process_op(&dop);
+    if (ret) {
+        // The read-ahead may extend past the end of the disc
+        dop.count = 1;
+        ret = process_op(&dop);
+        if (ret)
+            return ret;
+    }
+    SET_LOW(CDEmuCacheLba, lba);
+    SET_LOW(CDEmuCacheCount, dop.count);
+    *data_fl = cache_fl;
+    return DISK_RET_SUCCESS;
+}
+
 static int
 cdemu_read(struct disk_op_s *op)
 {
@@ -37,20 +80,18 @@ cdemu_read(struct disk_op_s *op)
 
     int count = op->count;
     op->count = 0;
-    u8 *cdbuf_fl = GET_GLOBAL(bounce_buf_fl);
 
     if (op->lba & 3) {
         // Partial read of first block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+        u8 *data_fl;
+        int ret = cdemu_cache_read(drive_gf, dop.lba, &data_fl);
         if (ret)
             return ret;
         u8 thiscount = 4 - (op->lba & 3);
         if (thiscount > count)
             thiscount = count;
         count -= thiscount;
-        memcpy_fl(op->buf_fl, cdbuf_fl + (op->lba & 3) * 512, thiscount * 512);
+        memcpy_fl(op->buf_fl, data_fl + (op->lba & 3) * 512, thiscount * 512);
         op->buf_fl += thiscount * 512;
         op->count += thiscount;
         dop.lba++;
@@ -72,13 +113,12 @@ cdemu_read(struct disk_op_s *op)
 
     if (count) {
         // Partial read on last block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+        u8 *data_fl;
+        int ret = cdemu_cache_read(drive_gf, dop.lba, &data_fl);
         if (ret)
             return ret;
         u8 thiscount = count;
-        memcpy_fl(op->buf_fl, cdbuf_fl, thiscount * 512);
+        memcpy_fl(op->buf_fl, data_fl, thiscount * 512);
         op->count += thiscount;
     }
 
@@ -109,8 +149,12 @@ cdrom_prepboot(void)
         return;
     if (!CDCount)
         return;
-    if (create_bounce_buf() < 0)
+    u8 *cache = malloc_low(CDEMU_CACHE_SECTORS * CDROM_SECTOR_SIZE);
+    if (!cache) {
+        warn_noalloc();
         return;
+    }
+    CDEmuCache = cache;
 
     struct drive_s *drive = malloc_fseg(sizeof(*drive));
     if (!drive) {
@@ -129,6 +173,32 @@ cdrom_prepboot(void)
  * CD booting
  ****************************************************************/
 
+// The boot record volume descriptor and the sectors after it are read
+// with one request - the boot catalog is usually among those.  They are
+// read to the default load address of the boot image, which is free
+// until the image is loaded.
+#define CDROM_VD_LBA 0x11
+#define CDROM_VD_SECTORS 16
+#define CDROM_VD_BUF ((u8*)MAKE_FLATPTR(0x07C0, 0))
+
+// Read a sector from the start of the disc, using the copy in 'vds'
+// (holding 'vdcount' sectors from CDROM_VD_LBA) if it has it.
+static int
+cdrom_read_vd(struct disk_op_s *dop, u32 lba, u8 *buffer
+              , u8 *vds, u32 vdcount)
+{
+    if (lba >= CDROM_VD_LBA && lba - CDROM_VD_LBA < vdcount) {
+        memcpy(buffer, vds + (lba - CDROM_VD_LBA) * CDROM_SECTOR_SIZE
+               , CDROM_SECTOR_SIZE);
+        return 0;
+    }
+    dop->command = CMD_READ;
+    dop->lba = lba;
+    dop->count = 1;
+    dop->buf_fl = buffer;
+    return process_op(dop);
+}
+
 int
 cdrom_boot(struct drive_s *drive)
 {
@@ -144,13 +214,18 @@ cdrom_boot(struct drive_s *drive)
     if (ret)
         dprintf(5, "scsi_is_ready returned %d\n", ret);
 
+    u8 *vds = CDROM_VD_BUF;
+    u32 vdcount = 0;
+    dop.command = CMD_READ;
+    dop.lba = CDROM_VD_LBA;
+    dop.count = CDROM_VD_SECTORS;
+    dop.buf_fl = vds;
+    if (!process_op(&dop))
+        vdcount = dop.count;
+
     // Read the Boot Record Volume Descriptor
     u8 buffer[CDROM_SECTOR_SIZE];
-    dop.command = CMD_READ;
-    dop.lba = 0x11;
-    dop.count = 1;
-    dop.buf_fl = buffer;
-    ret = process_op(&dop);
+    ret = cdrom_read_vd(&dop, CDROM_VD_LBA, buffer, vds, vdcount);
     if (ret)
         return 3;
 
@@ -164,9 +239,9 @@ cdrom_boot(struct drive_s *drive)
     u32 lba = *(u32*)&buffer[0x47];
 
     // And we read the Boot Catalog
-    dop.lba = lba;
-    dop.count = 1;
-    ret = process_op(&dop);
+    ret = cdrom_read_vd(&dop, lba, buffer, vds, vdcount);
+    dprintf(3, "cdrom: boot catalog at lba %d%s\n", lba
+            , lba - CDROM_VD_LBA < vdcount ? " (read with descriptors)" : "");
     if (ret)
         return 7;
 
@@ -202,26 +277,20 @@ cdrom_boot(struct drive_s *drive)
 
     lba = *(u32*)&buffer[0x28];
     CDEmu.ilba = lba;
+    CDEmuCacheCount = 0;
 
     CDEmu.controller_index = drive->cntl_id / 2;
     CDEmu.device_spec = drive->cntl_id % 2;
 
     // And we read the image in memory
     nbsectors = DIV_ROUND_UP(nbsectors, 4);
+    // A single request - process_op() splits it if the drive needs that
     dop.lba = lba;
     dop.buf_fl = MAKE_FLATPTR(boot_segment, 0);
-    while (nbsectors) {
-        int count = nbsectors;
-        if (count > 64*1024/CDROM_SECTOR_SIZE)
-            count = 64*1024/CDROM_SECTOR_SIZE;
-        dop.count = count;
-        ret = process_op(&dop);
-        if (ret)
-            return 12;
-        nbsectors -= count;
-        dop.lba += count;
-        dop.buf_fl += count*CDROM_SECTOR_SIZE;
-    }
+    dop.count = nbsectors;
+    ret = process_op(&dop);
+    if (ret)
+        return 12;
 
     if (media == 0) {
         // No emulation requested - return success.
@@ -27,8 +27,89 @@ bcd2bin(u8 val)
     return (val & 0xf) + ((val >> 4) * 10);
 }
 
+static u8
+bin2bcd(u32 val)
+{
+    return ((val / 10) << 4) | (val % 10);
+}
+
 u8 Century VARLOW;
 
+// Each rtc register read is two io port accesses (and two vm exits
+// when virtualized).  When the timer is tsc based and the rtc uses the
+// bcd 24 hour format, the time and date are read once and the time is
+// advanced from the tsc afterwards.  The rtc is read again every
+// RTC_CACHE_MS and when the derived time would pass midnight.  The
+// derived time rounds down, so it may lag the rtc by up to a second
+// but never runs ahead of it.  Otherwise the registers are passed
+// through as read.
+#define RTC_CACHE_MS 10000
+
+struct rtc_cache_s {
+    u64 tsc;            // timer_tsc_read() at the last read (0 if invalid)
+    u32 seconds;        // Seconds since midnight at the last read
+    u8 dse, year, month, day;
+};
+struct rtc_cache_s RtcCache VARLOW;
+
+// Read the time and date from the rtc into the cache.  Returns
+// non-zero (leaving the cache invalid) if the rtc isn't in the bcd 24
+// hour format.
+static int
+rtc_cache_fill(void)
+{
+    u64 tsc = timer_tsc_read();
+    u8 statusb = rtc_read(CMOS_STATUS_B);
+    if ((statusb & (RTC_B_BIN|RTC_B_24HR)) != RTC_B_24HR) {
+        SET_LOW(RtcCache.tsc, 0);
+        return -1;
+    }
+    u32 seconds = bcd2bin(rtc_read(CMOS_RTC_SECONDS));
+    u32 minutes = bcd2bin(rtc_read(CMOS_RTC_MINUTES));
+    u32 hours = bcd2bin(rtc_read(CMOS_RTC_HOURS));
+    SET_LOW(RtcCache.seconds, (hours * 60 + minutes) * 60 + seconds);
+    SET_LOW(RtcCache.dse, statusb & RTC_B_DSE);
+    SET_LOW(RtcCache.year, rtc_read(CMOS_RTC_YEAR));
+    SET_LOW(RtcCache.month, rtc_read(CMOS_RTC_MONTH));
+    SET_LOW(RtcCache.day, rtc_read(CMOS_RTC_DAY_MONTH));
+    SET_LOW(RtcCache.tsc, tsc);
+    return 0;
+}
+
+// Force the next time or date request to read the rtc
+static void
+rtc_cache_invalidate(void)
+{
+    SET_LOW(RtcCache.tsc, 0);
+}
+
+// Get the current time (in seconds since midnight) and make sure the
+// date in the cache is current.  Returns 1 if the cache can't be used
+// (the caller then reads the rtc registers itself) and -1 if the rtc
+// couldn't be read.
+static int
+rtc_cache_get(u32 *pseconds)
+{
+    u64 now = timer_tsc_read();
+    if (!now)
+        return 1;
+    u64 start = GET_LOW(RtcCache.tsc);
+    if (start) {
+        u32 ms = timer_tsc_msecs(now - start);
+        u32 seconds = GET_LOW(RtcCache.seconds) + ms / 1000;
+        if (ms < RTC_CACHE_MS && seconds < 24*60*60) {
+            *pseconds = seconds;
+            return 0;
+        }
+    }
+    if (rtc_updating())
+        return -1;
+    if (rtc_cache_fill())
+        return 1;
+    *pseconds = GET_LOW(RtcCache.seconds);
+    return 0;
+}
+
 void
 clock_setup(void)
 {
@@ -94,15 +175,24 @@ handle_1a01(struct bregs *regs)
 static void
 handle_1a02(struct bregs *regs)
 {
-    if (rtc_updating()) {
+    u32 seconds;
+    int ret = rtc_cache_get(&seconds);
+    if (ret < 0 || (ret && rtc_updating())) {
         set_invalid(regs);
         return;
     }
 
-    regs->dh = rtc_read(CMOS_RTC_SECONDS);
-    regs->cl = rtc_read(CMOS_RTC_MINUTES);
-    regs->ch = rtc_read(CMOS_RTC_HOURS);
-    regs->dl = rtc_read(CMOS_STATUS_B) & RTC_B_DSE;
+    if (ret) {
+        regs->dh = rtc_read(CMOS_RTC_SECONDS);
+        regs->cl = rtc_read(CMOS_RTC_MINUTES);
+        regs->ch = rtc_read(CMOS_RTC_HOURS);
+        regs->dl = rtc_read(CMOS_STATUS_B) & RTC_B_DSE;
+    } else {
+        regs->dh = bin2bcd(seconds % 60);
+        regs->cl = bin2bcd(seconds / 60 % 60);
+        regs->ch = bin2bcd(seconds / (60 * 60));
+        regs->dl = GET_LOW(RtcCache.dse);
+    }
     regs->ah = 0;
     regs->al = regs->ch;
     set_success(regs);
@@ -133,6 +223,7 @@ handle_1a03(struct bregs *regs)
     u8 val8 = ((rtc_read(CMOS_STATUS_B) & (RTC_B_PIE|RTC_B_AIE))
                | RTC_B_24HR | (regs->dl & RTC_B_DSE));
     rtc_write(CMOS_STATUS_B, val8);
+    rtc_cache_invalidate();
     regs->ah = 0;
     regs->al = val8; // val last written to Reg B
     set_success(regs);
@@ -143,13 +234,21 @@ static void
 handle_1a04(struct bregs *regs)
 {
     regs->ah = 0;
-    if (rtc_updating()) {
+    u32 seconds;
+    int ret = rtc_cache_get(&seconds);
+    if (ret < 0 || (ret && rtc_updating())) {
         set_invalid(regs);
         return;
     }
-    regs->cl = rtc_read(CMOS_RTC_YEAR);
-    regs->dh = rtc_read(CMOS_RTC_MONTH);
-    regs->dl = rtc_read(CMOS_RTC_DAY_MONTH);
+    if (ret) {
+        regs->cl = rtc_read(CMOS_RTC_YEAR);
+        regs->dh = rtc_read(CMOS_RTC_MONTH);
+        regs->dl = rtc_read(CMOS_RTC_DAY_MONTH);
+    } else {
+        regs->cl = GET_LOW(RtcCache.year);
+        regs->dh = GET_LOW(RtcCache.month);
+        regs->dl = GET_LOW(RtcCache.day);
+    }
     regs->ch = GET_LOW(Century);
     regs->al = regs->ch;
     set_success(regs);
@@ -181,6 +280,7 @@ handle_1a05(struct bregs *regs)
     // clear halt-clock bit
     u8 val8 = rtc_read(CMOS_STATUS_B) & ~RTC_B_SET;
     rtc_write(CMOS_STATUS_B, val8);
+    rtc_cache_invalidate();
     regs->ah = 0;
     regs->al = val8; // AL = val last written to Reg B
     set_success(regs);
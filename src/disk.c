@@ -115,6 +115,33 @@ send_disk_op(struct disk_op_s *op)
     return process_op(op);
 }
 
+// Execute a request with an EDD 3.0 flat buffer after jumping to the
+// extra stack.
+static int
+__send_disk_op_flat(struct disk_op_s *op_far, u16 op_seg)
+{
+    struct disk_op_s dop;
+    memcpy_far(GET_SEG(SS), &dop, op_seg, op_far, sizeof(dop));
+
+    int status = process_op_flat(&dop);
+
+    SET_FARVAR(op_seg, op_far->count, dop.count);
+
+    return status;
+}
+
+// Execute a request whose buffer is an EDD 3.0 flat address.
+static int
+send_disk_op_flat(struct disk_op_s *op)
+{
+    ASSERT16();
+    if (! CONFIG_DRIVES)
+        return -1;
+    if (!CONFIG_ENTRY_EXTRASTACK)
+        return stack_hop(__send_disk_op_flat, op, GET_SEG(SS));
+    return process_op_flat(op);
+}
+
 // Perform read/write/verify using old-style chs accesses
 static void noinline
 basic_access(struct bregs *regs, struct drive_s *drive_fl, u16 command)
@@ -168,21 +195,39 @@ extended_access(struct bregs *regs, struct drive_s *drive_fl, u16 command)
     dop.lba = GET_FARVAR(regs->ds, param_far->lba);
     dop.command = command;
     dop.drive_fl = drive_fl;
-    if (dop.lba >= GET_FLATPTR(drive_fl->sectors)) {
+    if (dop.lba >= drive_sectors(drive_fl)) {
         warn_invalid(regs);
         disk_ret(regs, DISK_RET_EPARAM);
         return;
     }
 
-    dop.buf_fl = SEGOFF_TO_FLATPTR(GET_FARVAR(regs->ds, param_far->data));
+    struct segoff_s data = GET_FARVAR(regs->ds, param_far->data);
     dop.count = GET_FARVAR(regs->ds, param_far->count);
+    int flat = (data.segoff == 0xffffffff
+                && GET_FARVAR(regs->ds, param_far->size) >= 0x18);
+    if (flat) {
+        // EDD 3.0 64bit flat buffer address
+        u64 data64 = GET_FARVAR(regs->ds, param_far->data64);
+        u32 blksize = GET_FLATPTR(drive_fl->blksize);
+        if (CONFIG_DISK_512E && GET_FLATPTR(drive_fl->sector_shift))
+            blksize = DISK_SECTOR_SIZE;
+        if (!drive_can_flat(drive_fl)
+            || data64 + (u32)dop.count * blksize > 0x100000000ULL) {
+            warn_invalid(regs);
+            disk_ret(regs, DISK_RET_EPARAM);
+            return;
+        }
+        dop.buf_fl = (void*)(u32)data64;
+    } else {
+        dop.buf_fl = SEGOFF_TO_FLATPTR(data);
+    }
     if (! dop.count) {
         // Nothing to do.
         disk_ret(regs, DISK_RET_SUCCESS);
         return;
     }
 
-    int status = send_disk_op(&dop);
+    int status = flat ? send_disk_op_flat(&dop) : send_disk_op(&dop);
 
     SET_FARVAR(regs->ds, param_far->count, dop.count);
 
@@ -410,6 +455,8 @@ disk_1341(struct bregs *regs, struct drive_s *drive_fl)
 {
     regs->bx = 0xaa55;  // install check
     regs->cx = 0x0007;  // ext disk access and edd, removable supported
+    if (drive_can_flat(drive_fl))
+        regs->cx |= 0x0008; // 64bit flat buffer addresses
     disk_ret(regs, DISK_RET_SUCCESS);
     regs->ah = 0x30;    // EDD 3.0
 }
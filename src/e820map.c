@@ -6,6 +6,7 @@
 
 #include "config.h" // BUILD_MAX_E820
 #include "e820map.h" // struct e820entry
+#include "malloc.h" // malloc_tmphigh
 #include "output.h" // dprintf
 #include "string.h" // memmove
 
@@ -18,31 +19,49 @@
 struct e820entry e820_list[BUILD_MAX_E820] VARFSEG;
 int e820_count VARFSEG;
 
-// Remove an entry from the e820_list.
-static void
-remove_e820(int i)
+// During POST the map is kept as a sorted array of non-overlapping
+// ranges, with adjacent ranges of the same type always merged.  It is
+// copied to e820_list (as used by int 15 e820) when an option rom runs
+// and at boot.  The map starts out in e820_list itself and moves to
+// ZoneTmpHigh if it outgrows it.
+struct e820entry *e820_map = e820_list;
+int e820_map_count;
+static int E820MapMax = BUILD_MAX_E820, E820Dirty;
+
+// Make room for 'count' entries in the working map.
+static int
+e820_reserve(int count)
 {
-    e820_count--;
-    memmove(&e820_list[i], &e820_list[i+1]
-            , sizeof(e820_list[0]) * (e820_count - i));
+    if (count <= E820MapMax)
+        return 0;
+    int max = E820MapMax * 2;
+    struct e820entry *map = malloc_tmphigh(max * sizeof(map[0]));
+    if (!map) {
+        warn_noalloc();
+        return -1;
+    }
+    memcpy(map, e820_map, e820_map_count * sizeof(map[0]));
+    if (e820_map != e820_list)
+        free(e820_map);
+    e820_map = map;
+    E820MapMax = max;
+    return 0;
 }
 
-// Insert an entry in the e820_list at the given position.
-static void
-insert_e820(int i, u64 start, u64 size, u32 type)
+// Find the first entry that ends at or after 'addr'.
+static int
+e820_find(u64 addr)
 {
-    if (e820_count >= BUILD_MAX_E820) {
-        warn_noalloc();
-        return;
+    int lo = 0, hi = e820_map_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        struct e820entry *e = &e820_map[mid];
+        if (e->start + e->size < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-
-    memmove(&e820_list[i+1], &e820_list[i]
-            , sizeof(e820_list[0]) * (e820_count - i));
-    e820_count++;
-    struct e820entry *e = &e820_list[i];
-    e->start = start;
-    e->size = size;
-    e->type = type;
+    return lo;
 }
 
 static const char *
@@ -74,8 +93,8 @@ dump_map(void)
 
 #define E820_HOLE         ((u32)-1) // Used internally to remove entries
 
-// Add a new entry to the list.  This scans for overlaps and keeps the
-// list sorted.
+// Add a new entry to the map.  Existing entries overlapping the new
+// range are trimmed, split, or merged as needed.
 void
 e820_add(u64 start, u64 size, u32 type)
 {
@@ -85,56 +104,86 @@ e820_add(u64 start, u64 size, u32 type)
         // Huh?  Nothing to do.
         return;
 
-    // Find position of new item (splitting existing item if needed).
+    // Entries [i, j) overlap or touch the new range.
     u64 end = start + size;
-    int i;
-    for (i=0; i<e820_count; i++) {
-        struct e820entry *e = &e820_list[i];
-        u64 e_end = e->start + e->size;
-        if (start > e_end)
-            continue;
-        // Found position - check if an existing item needs to be split.
-        if (start > e->start) {
-            if (type == e->type) {
-                // Same type - merge them.
-                size += start - e->start;
-                start = e->start;
+    int i = e820_find(start), j = i;
+    while (j < e820_map_count && e820_map[j].start <= end)
+        j++;
+
+    // Build the replacement for [i, j): the part of the first entry
+    // below the new range, the new range, and the part of the last
+    // entry above it.  Parts of the same type are merged in.
+    struct e820entry repl[3];
+    int n = 0;
+    if (i < j) {
+        struct e820entry *first = &e820_map[i];
+        if (first->start < start) {
+            if (first->type == type) {
+                start = first->start;
             } else {
-                // Split existing item.
-                e->size = start - e->start;
-                i++;
-                if (e_end > end)
-                    insert_e820(i, end, e_end - end, e->type);
+                repl[n].start = first->start;
+                repl[n].size = start - first->start;
+                repl[n++].type = first->type;
             }
         }
-        break;
     }
-    // Remove/adjust existing items that are overlapping.
-    while (i<e820_count) {
-        struct e820entry *e = &e820_list[i];
-        if (end < e->start)
-            // No overlap - done.
-            break;
-        u64 e_end = e->start + e->size;
-        if (end >= e_end) {
-            // Existing item completely overlapped - remove it.
-            remove_e820(i);
-            continue;
+    struct e820entry *new = &repl[n];
+    new->start = start;
+    new->size = end - start;
+    new->type = type;
+    if (type != E820_HOLE)
+        n++;
+    if (i < j) {
+        struct e820entry *last = &e820_map[j-1];
+        u64 last_end = last->start + last->size;
+        if (last_end > end) {
+            if (last->type == type) {
+                new->size = last_end - start;
+            } else {
+                repl[n].start = end;
+                repl[n].size = last_end - end;
+                repl[n++].type = last->type;
+            }
         }
-        // Not completely overlapped - adjust its start.
-        e->start = end;
-        e->size = e_end - end;
-        if (type == e->type) {
-            // Same type - merge them.
-            size += e->size;
-            remove_e820(i);
+    }
+
+    if (e820_reserve(e820_map_count - (j - i) + n))
+        return;
+    memmove(&e820_map[i + n], &e820_map[j]
+            , sizeof(e820_map[0]) * (e820_map_count - j));
+    memcpy(&e820_map[i], repl, sizeof(repl[0]) * n);
+    e820_map_count += n - (j - i);
+    E820Dirty = 1;
+}
+
+// Replace an empty map with 'count' entries from 'list'.  This only
+// succeeds if the entries are already in the form e820_add() keeps
+// them in - sorted, non-empty, non-overlapping, and with no adjacent
+// entries of the same type.
+int
+e820_load(struct e820entry *list, int count)
+{
+    if (e820_map_count)
+        return -1;
+    int i;
+    for (i=0; i<count; i++) {
+        struct e820entry *e = &list[i];
+        if (!e->size || e->type == E820_HOLE || e->start + e->size < e->start)
+            return -1;
+        if (i) {
+            struct e820entry *prev = &list[i-1];
+            u64 prev_end = prev->start + prev->size;
+            if (e->start < prev_end
+                || (e->start == prev_end && e->type == prev->type))
+                return -1;
         }
-        break;
     }
-    // Insert new item.
-    if (type != E820_HOLE)
-        insert_e820(i, start, size, type);
-    //dump_map();
+    if (e820_reserve(count))
+        return -1;
+    memcpy(e820_map, list, sizeof(e820_map[0]) * count);
+    e820_map_count = count;
+    E820Dirty = 1;
+    return 0;
 }
 
 // Remove any definitions in a memory range (make a memory hole).
@@ -144,24 +193,37 @@ e820_remove(u64 start, u64 size)
     e820_add(start, size, E820_HOLE);
 }
 
+// Copy the working map to the int 15 e820 table if it changed.
+void
+e820_update(void)
+{
+    if (!E820Dirty)
+        return;
+    E820Dirty = 0;
+    int count = e820_map_count;
+    if (count > BUILD_MAX_E820) {
+        dprintf(1, "e820 map has %d items, only reporting %d\n"
+                , count, BUILD_MAX_E820);
+        count = BUILD_MAX_E820;
+    }
+    if (e820_map != e820_list)
+        memcpy(e820_list, e820_map, sizeof(e820_list[0]) * count);
+    e820_count = count;
+}
+
 // Report on final memory locations.
 void
 e820_prepboot(void)
 {
+    e820_update();
     dump_map();
 }
 
 int
 e820_is_used(u64 start, u64 size)
 {
-    int i;
-    for (i=0; i<e820_count; i++) {
-        struct e820entry *e = &e820_list[i];
-        if (start + size <= e->start)
-            continue;
-        if (start >= e->start + e->size)
-            continue;
-        return 1;
-    }
-    return 0;
+    int i = e820_find(start);
+    if (i < e820_map_count && e820_map[i].start + e820_map[i].size == start)
+        i++;
+    return i < e820_map_count && e820_map[i].start < start + size;
 }
@@ -16,12 +16,17 @@ struct e820entry {
 };
 
 void e820_add(u64 start, u64 size, u32 type);
+int e820_load(struct e820entry *list, int count);
 void e820_remove(u64 start, u64 size);
+void e820_update(void);
 void e820_prepboot(void);
 int e820_is_used(u64 start, u64 size);
 
 // e820 map storage
 extern struct e820entry e820_list[];
 extern int e820_count;
+// Working map during POST
+extern struct e820entry *e820_map;
+extern int e820_map_count;
 
 #endif // e820map.h
@@ -49,8 +49,10 @@ copy_pir(void *pos)
     PirAddr = copy_fseg_table("PIR", pos, p->size);
 }
 
-void
-copy_mptable(void *pos)
+// Copy the mptable floating pointer to the f-segment.  If 'inplace'
+// is set the config structure is left where it is.
+static void
+__copy_mptable(void *pos, int inplace)
 {
     struct mptable_floating_s *p = pos;
     if (p->signature != MPTABLE_SIGNATURE)
@@ -61,6 +63,11 @@ copy_mptable(void *pos)
         return;
     u32 length = p->length * 16;
     u16 mpclength = ((struct mptable_config_s *)p->physaddr)->length;
+    if (inplace) {
+        if (copy_fseg_table("MPTABLE floating pointer", pos, length))
+            dprintf(1, "Linking MPTABLE config at %x\n", p->physaddr);
+        return;
+    }
     if (length + mpclength > BUILD_MAX_MPTABLE_FSEG) {
         dprintf(1, "Skipping MPTABLE copy due to large size (%d bytes)\n"
                 , length + mpclength);
@@ -81,6 +88,12 @@ copy_mptable(void *pos)
     memcpy((void*)newpos + length, (void*)p->physaddr, mpclength);
 }
 
+void
+copy_mptable(void *pos)
+{
+    __copy_mptable(pos, 0);
+}
+
 
 /****************************************************************
  * ACPI
@@ -133,12 +146,50 @@ void *find_acpi_rsdp(void)
     return NULL;
 }
 
-void *
-find_acpi_table(u32 signature)
+// Index of the tables reachable from RsdpAddr.  It is (re)built on
+// the first lookup after RsdpAddr changes.
+#define ACPI_INDEX_MAX 32
+
+struct acpi_index_s {
+    u32 signature;
+    struct acpi_table_header *table;
+};
+static struct acpi_index_s AcpiIndex[ACPI_INDEX_MAX];
+static int AcpiIndexCount, AcpiIndexFull;
+static struct rsdp_descriptor *AcpiIndexRsdp;
+static struct facs_descriptor_rev1 *AcpiFacs;
+
+static struct acpi_table_header *
+acpi_index_find(u32 signature)
+{
+    int i;
+    for (i=0; i<AcpiIndexCount; i++)
+        if (AcpiIndex[i].signature == signature)
+            return AcpiIndex[i].table;
+    return NULL;
+}
+
+static void
+acpi_index_add(struct acpi_table_header *tbl, const char *via)
+{
+    if (!tbl || acpi_index_find(tbl->signature))
+        // Only the first table with a given signature is reported
+        return;
+    if (AcpiIndexCount >= ARRAY_SIZE(AcpiIndex)) {
+        AcpiIndexFull = 1;
+        return;
+    }
+    dprintf(1, "table(%x)=%p (via %s)\n", tbl->signature, tbl, via);
+    AcpiIndex[AcpiIndexCount].signature = tbl->signature;
+    AcpiIndex[AcpiIndexCount].table = tbl;
+    AcpiIndexCount++;
+}
+
+// Scan the xsdt and rsdt for tables.  If 'signature' is non-zero only
+// that table is looked for.
+static struct acpi_table_header *
+acpi_scan_tables(u32 signature)
 {
-    dprintf(4, "rsdp=%p\n", RsdpAddr);
-    if (!RsdpAddr || RsdpAddr->signature != RSDP_SIGNATURE)
-        return NULL;
     struct rsdt_descriptor_rev1 *rsdt = (void*)RsdpAddr->rsdt_physical_address;
     struct xsdt_descriptor_rev2 *xsdt =
         RsdpAddr->xsdt_physical_address >= 0x100000000
@@ -153,10 +204,10 @@ find_acpi_table(u32 signature)
             if (xsdt->table_offset_entry[i] >= 0x100000000)
                 continue; /* above 4G */
             struct acpi_table_header *tbl = (void*)(u32)xsdt->table_offset_entry[i];
-            if (!tbl || tbl->signature != signature)
-                continue;
-            dprintf(1, "table(%x)=%p (via xsdt)\n", signature, tbl);
-            return tbl;
+            if (!signature)
+                acpi_index_add(tbl, "xsdt");
+            else if (tbl && tbl->signature == signature)
+                return tbl;
         }
     }
 
@@ -165,30 +216,58 @@ find_acpi_table(u32 signature)
         int i;
         for (i=0; (void*)&rsdt->table_offset_entry[i] < end; i++) {
             struct acpi_table_header *tbl = (void*)rsdt->table_offset_entry[i];
-            if (!tbl || tbl->signature != signature)
-                continue;
-            dprintf(1, "table(%x)=%p (via rsdt)\n", signature, tbl);
-            return tbl;
+            if (!signature)
+                acpi_index_add(tbl, "rsdt");
+            else if (tbl && tbl->signature == signature)
+                return tbl;
         }
     }
-
-    dprintf(4, "no table %x found\n", signature);
     return NULL;
 }
 
-u32
-find_resume_vector(void)
+static void
+acpi_index_build(void)
 {
-    struct fadt_descriptor_rev1 *fadt = find_acpi_table(FACP_SIGNATURE);
+    dprintf(4, "rsdp=%p\n", RsdpAddr);
+    AcpiIndexRsdp = RsdpAddr;
+    AcpiIndexCount = AcpiIndexFull = 0;
+    AcpiFacs = NULL;
+    if (!RsdpAddr || RsdpAddr->signature != RSDP_SIGNATURE)
+        return;
+    acpi_scan_tables(0);
+
+    struct fadt_descriptor_rev1 *fadt = (void*)acpi_index_find(FACP_SIGNATURE);
     if (!fadt)
-        return 0;
+        return;
     struct facs_descriptor_rev1 *facs = (void*)fadt->firmware_ctrl;
     dprintf(4, "facs=%p\n", facs);
-    if (! facs || facs->signature != FACS_SIGNATURE)
+    if (facs && facs->signature == FACS_SIGNATURE)
+        AcpiFacs = facs;
+}
+
+void *
+find_acpi_table(u32 signature)
+{
+    if (AcpiIndexRsdp != RsdpAddr)
+        acpi_index_build();
+    struct acpi_table_header *tbl = acpi_index_find(signature);
+    if (!tbl && AcpiIndexFull && RsdpAddr)
+        tbl = acpi_scan_tables(signature);
+    if (!tbl)
+        dprintf(4, "no table %x found\n", signature);
+    return tbl;
+}
+
+u32
+find_resume_vector(void)
+{
+    if (AcpiIndexRsdp != RsdpAddr)
+        acpi_index_build();
+    if (!AcpiFacs)
         return 0;
     // Found it.
-    dprintf(4, "resume addr=%d\n", facs->firmware_waking_vector);
-    return facs->firmware_waking_vector;
+    dprintf(4, "resume addr=%d\n", AcpiFacs->firmware_waking_vector);
+    return AcpiFacs->firmware_waking_vector;
 }
 
 static struct acpi_20_generic_address acpi_reset_reg;
@@ -247,6 +326,9 @@ find_acpi_features(void)
         pmtimer_setup(pm_tmr);
     if (pm1a_cnt)
         acpi_pm1a_cnt = pm1a_cnt;
+    struct acpi_20_hpet *hpet = find_acpi_table(HPET_SIGNATURE);
+    if (hpet && !hpet->addr.address_space_id) // system memory space
+        hpet_setup(hpet->addr.address);
 
     // Theoretically we should check the 'reset_reg_sup' flag, but Windows
     // doesn't and thus nobody seems to *set* it. If the table is large enough
@@ -487,13 +569,14 @@ smbios_new_type_0(void *start,
 
 /*
  * Build tables using qtables as input, adding additional type 0
- * table if necessary.
+ * table if necessary.  The tables are loaded straight into their final
+ * location - the f-segment only if @fseg is set and they are small.
  *
  * @address and @length can't be NULL.  @max_structure_size and
  * @number_of_structures are optional and can be NULL.
  */
 static int
-smbios_build_tables(struct romfile_s *f_tables,
+smbios_build_tables(struct romfile_s *f_tables, int fseg,
                     u64 *address, u32 *length,
                     u16 *max_structure_size,
                     u16 *number_of_structures)
@@ -505,13 +588,28 @@ smbios_build_tables(struct romfile_s *f_tables,
     if (f_tables->size != *length)
         return 0;
 
-    qtables = malloc_tmphigh(f_tables->size);
-    if (!qtables) {
+    /* common case: add our own type 0, with 3 strings and 4 '\0's */
+    u16 t0_len = sizeof(struct smbios_type_0) + strlen(BIOS_NAME) +
+                 strlen(VERSION) + strlen(BIOS_DATE) + 4;
+    if (t0_len > (0xffff - *length)) {
+        dprintf(1, "Insufficient space (%d bytes) to add SMBIOS type 0 table (%d bytes)\n",
+                0xffff - *length, t0_len);
+        t0_len = 0;
+    }
+
+    /* allocate final blob, leaving room for a type 0 in front */
+    u32 size = *length + t0_len;
+    if (fseg && size <= BUILD_MAX_SMBIOS_FSEG)
+        tables = malloc_fseg(size);
+    else
+        tables = malloc_high(size);
+    if (!tables) {
         warn_noalloc();
         return 0;
     }
-    f_tables->copy(f_tables, qtables, f_tables->size);
+    qtables = tables + t0_len;
     qtables_len = f_tables->size;
+    f_tables->copy(f_tables, qtables, qtables_len);
 
     /* did we get a type 0 structure ? */
     for (t0 = smbios_next(qtables, qtables_len, NULL); t0;
@@ -522,40 +620,18 @@ smbios_build_tables(struct romfile_s *f_tables,
         }
     }
 
-    if (need_t0) {
-        /* common case: add our own type 0, with 3 strings and 4 '\0's */
-        u16 t0_len = sizeof(struct smbios_type_0) + strlen(BIOS_NAME) +
-                     strlen(VERSION) + strlen(BIOS_DATE) + 4;
-        if (t0_len > (0xffff - *length)) {
-            dprintf(1, "Insufficient space (%d bytes) to add SMBIOS type 0 table (%d bytes)\n",
-                    0xffff - *length, t0_len);
-            need_t0 = 0;
-        } else {
-            *length += t0_len;
-            if (max_structure_size && t0_len > *max_structure_size)
-                *max_structure_size = t0_len;
-            if (number_of_structures)
-                (*number_of_structures)++;
-        }
-    }
-
-    /* allocate final blob and record its address in the entry point */
-    if (*length > BUILD_MAX_SMBIOS_FSEG)
-        tables = malloc_high(*length);
-    else
-        tables = malloc_fseg(*length);
-    if (!tables) {
-        warn_noalloc();
-        free(qtables);
-        return 0;
+    /* populate final blob and record its address in the entry point */
+    if (need_t0 && t0_len) {
+        *length += t0_len;
+        if (max_structure_size && t0_len > *max_structure_size)
+            *max_structure_size = t0_len;
+        if (number_of_structures)
+            (*number_of_structures)++;
+        smbios_new_type_0(tables, BIOS_NAME, VERSION, BIOS_DATE);
+    } else if (t0_len) {
+        memmove(tables, qtables, qtables_len);
     }
     *address = (u32)tables;
-
-    /* populate final blob */
-    if (need_t0)
-        tables = smbios_new_type_0(tables, BIOS_NAME, VERSION, BIOS_DATE);
-    memcpy(tables, qtables, qtables_len);
-    free(qtables);
     return 1;
 }
 
@@ -566,7 +642,9 @@ smbios_21_setup_entry_point(struct romfile_s *f_tables,
     u64 address = ep->structure_table_address;
     u32 length = ep->structure_table_length;
 
-    if (!smbios_build_tables(f_tables,
+    // The 2.1 entry point only needs tables below 1MiB for legacy
+    // software, so only use the f-segment if asked to.
+    if (!smbios_build_tables(f_tables, romfile_loadint("etc/smbios-fseg", 0),
                              &address,
                              &length,
                              &ep->max_structure_size,
@@ -592,7 +670,7 @@ static int
 smbios_30_setup_entry_point(struct romfile_s *f_tables,
                             struct smbios_30_entry_point *ep)
 {
-    if (!smbios_build_tables(f_tables,
+    if (!smbios_build_tables(f_tables, 0,
                              &ep->structure_table_address,
                              &ep->structure_table_max_size,
                              NULL, NULL))
@@ -647,3 +725,16 @@ copy_table(void *pos)
     copy_smbios_21(pos);
     copy_smbios_30(pos);
 }
+
+// Like copy_table(), but only the entry points that an OS locates by
+// scanning the f-segment are copied - the tables they reference
+// (including the mptable config structure) are used where they are.
+void
+link_table(void *pos)
+{
+    copy_pir(pos);
+    __copy_mptable(pos, 1);
+    copy_acpi_rsdp(pos);
+    copy_smbios_21(pos);
+    copy_smbios_30(pos);
+}
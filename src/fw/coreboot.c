@@ -216,20 +216,50 @@ fail:
     return;
 }
 
+// Output is collected into whole lines, which are copied to the cbmem
+// console with the shared cursor updated once per line.
+#define CBCON_BUFSIZE 128
+static char CbconBuf[CBCON_BUFSIZE];
+static u32 CbconLen;
+
 void coreboot_debug_putc(char c)
 {
     if (!CONFIG_DEBUG_COREBOOT)
         return;
     if (!cbcon)
         return;
+    CbconBuf[CbconLen++] = c;
+    if (c == '\n' || CbconLen >= sizeof(CbconBuf))
+        coreboot_debug_flush();
+}
+
+// Append any buffered characters to the cbmem console.
+void coreboot_debug_flush(void)
+{
+    if (!CONFIG_DEBUG_COREBOOT || !cbcon)
+        return;
+    u32 len = CbconLen;
+    if (!len)
+        return;
+    CbconLen = 0;
     u32 cursor = cbcon->cursor & CBMC_CURSOR_MASK;
     u32 flags = cbcon->cursor & ~CBMC_CURSOR_MASK;
-    if (cursor >= cbcon->size)
+    u32 size = cbcon->size;
+    if (cursor >= size)
         return; // Old coreboot version with legacy overflow mechanism.
-    cbcon->body[cursor++] = c;
-    if (cursor >= cbcon->size) {
-        cursor = 0;
-        flags |= CBMC_OVERFLOW;
+    char *buf = CbconBuf;
+    while (len) {
+        u32 n = size - cursor;
+        if (n > len)
+            n = len;
+        memcpy(&cbcon->body[cursor], buf, n);
+        buf += n;
+        len -= n;
+        cursor += n;
+        if (cursor >= size) {
+            cursor = 0;
+            flags |= CBMC_OVERFLOW;
+        }
     }
     cbcon->cursor = flags | cursor;
 }
@@ -245,8 +275,15 @@ scan_tables(u32 start, u32 size)
 {
     void *p = (void*)ALIGN(start, 16);
     void *end = (void*)start + size;
-    for (; p<end; p += 16)
-        copy_table(p);
+    // The first 16KiB are handed out as ram (see coreboot_preinit()),
+    // so tables there have to be copied.
+    int link = CONFIG_COREBOOT_LINK_TABLES && start >= 16*1024;
+    for (; p<end; p += 16) {
+        if (link)
+            link_table(p);
+        else
+            copy_table(p);
+    }
 }
 
 void
@@ -278,33 +315,91 @@ coreboot_platform_setup(void)
  * ulzma
  ****************************************************************/
 
-// Uncompress data in flash to an area of memory.
+#define ULZMA_CHUNK_SIZE 1024
+
+struct ulzma_stream_s {
+    ILzmaInCallback cb;
+    const u8 *src;
+    u32 srclen;
+    u8 buf[ULZMA_CHUNK_SIZE];
+};
+
+// Copy the next chunk of compressed data out of flash
 static int
-ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen)
+ulzma_read(void *object, const unsigned char **buffer, SizeT *size)
+{
+    struct ulzma_stream_s *s = container_of(object, struct ulzma_stream_s, cb);
+    u32 len = s->srclen;
+    if (len > ULZMA_CHUNK_SIZE)
+        len = ULZMA_CHUNK_SIZE;
+    iomemcpy(s->buf, s->src, len);
+    s->src += len;
+    s->srclen -= len;
+    *buffer = s->buf;
+    *size = len;
+    return 0;
+}
+
+#define ULZMA_PROBS_SIZE 15980
+
+// Decoder state - large enough that it can't live on the runtime
+// (extra) stack.
+struct ulzma_work_s {
+    struct ulzma_stream_s stream;
+    u8 probs[ULZMA_PROBS_SIZE];
+};
+
+// Allocate permanent decoder state for use by runtime callers.
+struct ulzma_work_s *
+ulzma_work_alloc(void)
+{
+    struct ulzma_work_s *work = malloc_high(sizeof(*work));
+    if (!work)
+        warn_noalloc();
+    return work;
+}
+
+// Uncompress data in flash to an area of memory using the given
+// decoder state.  The compressed data is read from flash in chunks as
+// the decoder consumes it.
+int
+ulzma_with(u8 *dst, u32 maxlen, const u8 *src, u32 srclen
+           , struct ulzma_work_s *work)
 {
     dprintf(3, "Uncompressing data %d@%p to %d@%p\n", srclen, src, maxlen, dst);
+    u8 header[LZMA_PROPERTIES_SIZE + 8];
+    if (srclen < sizeof(header)) {
+        dprintf(1, "LzmaDecode truncated header\n");
+        return -1;
+    }
+    iomemcpy(header, src, sizeof(header));
     CLzmaDecoderState state;
-    int ret = LzmaDecodeProperties(&state.Properties, src, LZMA_PROPERTIES_SIZE);
+    int ret = LzmaDecodeProperties(&state.Properties, header
+                                   , LZMA_PROPERTIES_SIZE);
     if (ret != LZMA_RESULT_OK) {
         dprintf(1, "LzmaDecodeProperties error - %d\n", ret);
         return -1;
     }
-    u8 scratch[15980];
     int need = (LzmaGetNumProbs(&state.Properties) * sizeof(CProb));
-    if (need > sizeof(scratch)) {
-        dprintf(1, "LzmaDecode need %d have %d\n", need, (unsigned int)sizeof(scratch));
+    if (need > sizeof(work->probs)) {
+        dprintf(1, "LzmaDecode need %d have %d\n"
+                , need, (unsigned int)sizeof(work->probs));
         return -1;
     }
-    state.Probs = (CProb *)scratch;
+    state.Probs = (CProb *)work->probs;
 
-    u32 dstlen = *(u32*)(src + LZMA_PROPERTIES_SIZE);
+    u32 dstlen = *(u32*)(header + LZMA_PROPERTIES_SIZE);
     if (dstlen > maxlen) {
         dprintf(1, "LzmaDecode too large (max %d need %d)\n", maxlen, dstlen);
         return -1;
     }
+    struct ulzma_stream_s *stream = &work->stream;
+    stream->cb.Read = ulzma_read;
+    stream->src = src + sizeof(header);
+    stream->srclen = srclen - sizeof(header);
+    state.InCallback = &stream->cb;
     u32 inProcessed, outProcessed;
-    ret = LzmaDecode(&state, src + LZMA_PROPERTIES_SIZE + 8, srclen
-                     , &inProcessed, dst, dstlen, &outProcessed);
+    ret = LzmaDecode(&state, NULL, 0, &inProcessed, dst, dstlen, &outProcessed);
     if (ret) {
         dprintf(1, "LzmaDecode returned %d\n", ret);
         return -1;
@@ -312,6 +407,16 @@ ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen)
     return dstlen;
 }
 
+// Uncompress data in flash to an area of memory.
+int
+ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen)
+{
+    // Note, this may be called at runtime (cbfs_run_payload()) where
+    // malloc is not available - so the decoder state is on the stack.
+    struct ulzma_work_s work;
+    return ulzma_with(dst, maxlen, src, srclen, &work);
+}
+
 
 /****************************************************************
  * Coreboot flash format
@@ -332,6 +437,17 @@ struct cbfs_header {
 
 #define CBFS_FILE_MAGIC 0x455649484352414cLL // LARCHIVE
 
+// cbfs_file types that are only used by coreboot itself
+#define CBFS_TYPE_DELETED       0x00000000
+#define CBFS_TYPE_STAGE         0x00000010
+#define CBFS_TYPE_FIT           0x00000021
+#define CBFS_TYPE_MICROCODE     0x00000053
+#define CBFS_TYPE_FSP           0x00000060
+#define CBFS_TYPE_MRC           0x00000061
+#define CBFS_TYPE_SPD           0x000000ab
+#define CBFS_TYPE_MRC_CACHE     0x000000ac
+#define CBFS_TYPE_NULL          0xffffffff
+
 struct cbfs_file {
     u64 magic;
     u32 len;
@@ -360,16 +476,9 @@ cbfs_copyfile(struct romfile_s *file, void *dst, u32 maxlen)
     u32 size = cfile->rawsize;
     void *src = cfile->data;
     if (cfile->flags) {
-        // Compressed - copy to temp ram and uncompress it.
-        void *temp = malloc_tmphigh(size);
-        if (!temp) {
-            warn_noalloc();
-            return -1;
-        }
-        iomemcpy(temp, src, size);
-        int ret = ulzma(dst, maxlen, temp, size);
+        // Compressed - uncompress it while reading it from flash.
+        int ret = ulzma(dst, maxlen, src, size);
         yield();
-        free(temp);
         return ret;
     }
 
@@ -383,6 +492,21 @@ cbfs_copyfile(struct romfile_s *file, void *dst, u32 maxlen)
     return size;
 }
 
+// Map an uncompressed file directly from flash
+static void *
+cbfs_mapfile(struct romfile_s *file)
+{
+    if (!CONFIG_COREBOOT_FLASH)
+        return NULL;
+
+    struct cbfs_romfile_s *cfile;
+    cfile = container_of(file, struct cbfs_romfile_s, file);
+    if (cfile->flags)
+        // Compressed - must use cbfs_copyfile()
+        return NULL;
+    return cfile->data;
+}
+
 // Process CBFS links file.  The links file is a newline separated
 // file where each line has a "link name" and a "destination name"
 // separated by a space character.
@@ -423,6 +547,47 @@ process_links_file(void)
     free(links);
 }
 
+// Determine if a cbfs file of the given type can be of use to SeaBIOS
+static int
+cbfs_type_wanted(u32 type)
+{
+    if (!CONFIG_CBFS_FILTER)
+        return 1;
+    switch (type) {
+    case CBFS_TYPE_DELETED:
+    case CBFS_TYPE_STAGE:
+    case CBFS_TYPE_FIT:
+    case CBFS_TYPE_MICROCODE:
+    case CBFS_TYPE_FSP:
+    case CBFS_TYPE_MRC:
+    case CBFS_TYPE_SPD:
+    case CBFS_TYPE_MRC_CACHE:
+    case CBFS_TYPE_NULL:
+        return 0;
+    }
+    return 1;
+}
+
+// Make room for another record in the array of cbfs romfiles
+static struct cbfs_romfile_s *
+cbfs_grow(struct cbfs_romfile_s *files, int count, int *pmax)
+{
+    if (count < *pmax)
+        return files;
+    int max = *pmax ? *pmax * 2 : 32;
+    struct cbfs_romfile_s *newfiles = malloc_tmp(max * sizeof(newfiles[0]));
+    if (!newfiles) {
+        warn_noalloc();
+        return NULL;
+    }
+    if (files) {
+        memcpy(newfiles, files, count * sizeof(files[0]));
+        free(files);
+    }
+    *pmax = max;
+    return newfiles;
+}
+
 void
 coreboot_cbfs_init(void)
 {
@@ -446,24 +611,41 @@ coreboot_cbfs_init(void)
 
     u32 romsize = be32_to_cpu(hdr->romsize);
     u32 romstart = CONFIG_CBFS_LOCATION - romsize;
+    u32 align = be32_to_cpu(hdr->align);
     struct cbfs_file *fhdr = (void*)romstart + be32_to_cpu(hdr->offset);
+    // The parsed headers are kept in one array in ram - each flash
+    // header is read with a single copy and names only when needed.
+    struct cbfs_romfile_s *files = NULL;
+    int count = 0, max = 0, skipped = 0;
     for (;;) {
         if ((u32)fhdr - romstart > romsize)
             break;
-        u64 magic = fhdr->magic;
-        if (magic != CBFS_FILE_MAGIC)
-            break;
-        struct cbfs_romfile_s *cfile = malloc_tmp(sizeof(*cfile));
-        if (!cfile) {
-            warn_noalloc();
+        struct cbfs_file fcopy, *cur = fhdr;
+        memcpy(&fcopy, cur, sizeof(fcopy));
+        if (fcopy.magic != CBFS_FILE_MAGIC)
             break;
+        u32 rawsize = be32_to_cpu(fcopy.len);
+        void *data = (void*)cur + be32_to_cpu(fcopy.offset);
+        fhdr = (void*)ALIGN((u32)data + rawsize, align);
+        if (!cbfs_type_wanted(be32_to_cpu(fcopy.type))) {
+            skipped++;
+            continue;
         }
+        struct cbfs_romfile_s *newfiles = cbfs_grow(files, count, &max);
+        if (!newfiles)
+            break;
+        files = newfiles;
+        struct cbfs_romfile_s *cfile = &files[count++];
         memset(cfile, 0, sizeof(*cfile));
-        strtcpy(cfile->file.name, fhdr->filename, sizeof(cfile->file.name));
-        cfile->file.size = cfile->rawsize = be32_to_cpu(fhdr->len);
-        cfile->fhdr = fhdr;
+        u32 namelen = be32_to_cpu(fcopy.offset) - sizeof(fcopy);
+        if (namelen > sizeof(cfile->file.name) - 1)
+            namelen = sizeof(cfile->file.name) - 1;
+        memcpy(cfile->file.name, cur->filename, namelen);
+        cfile->file.size = cfile->rawsize = rawsize;
+        cfile->fhdr = cur;
         cfile->file.copy = cbfs_copyfile;
-        cfile->data = (void*)fhdr + be32_to_cpu(fhdr->offset);
+        cfile->file.map = cbfs_mapfile;
+        cfile->data = data;
         int len = strlen(cfile->file.name);
         if (len > 5 && strcmp(&cfile->file.name[len-5], ".lzma") == 0) {
             // Using compression.
@@ -471,11 +653,14 @@ coreboot_cbfs_init(void)
             cfile->file.name[len-5] = '\0';
             cfile->file.size = *(u32*)(cfile->data + LZMA_PROPERTIES_SIZE);
         }
-        romfile_add(&cfile->file);
-
-        fhdr = (void*)ALIGN((u32)cfile->data + cfile->rawsize
-                            , be32_to_cpu(hdr->align));
     }
+    if (skipped)
+        dprintf(3, "Skipped %d coreboot internal CBFS files\n", skipped);
+
+    // The records no longer move - link them into the romfile list.
+    int i;
+    for (i = 0; i < count; i++)
+        romfile_add(&files[i].file);
 
     process_links_file();
 }
@@ -356,6 +356,31 @@ int csm_bootprio_fdc(struct pci_device *pci, int port, int fdid)
     return csm_prio_to_seabios(bbs[0].BootPriority);
 }
 
+// Report which drives EFI found on the ata channel at 'iobase1' (bit 0
+// for the master, bit 1 for the slave) or -1 if EFI didn't describe it.
+int csm_ata_drives(u16 iobase1)
+{
+    if (!csm_boot_table)
+        return -1;
+    int i;
+    for (i = 0; i < MAX_IDE_CONTROLLER; i++) {
+        HDD_INFO *hdd = &csm_boot_table->HddInfo[i];
+        if (!(hdd->Status & (HDD_PRIMARY | HDD_SECONDARY))
+            || hdd->CommandBaseAddress != iobase1)
+            continue;
+        int drives = 0;
+        if (hdd->Status & (HDD_MASTER_IDE | HDD_MASTER_ATAPI_CDROM
+                           | HDD_MASTER_ATAPI_ZIPDISK))
+            drives |= 1;
+        if (hdd->Status & (HDD_SLAVE_IDE | HDD_SLAVE_ATAPI_CDROM
+                           | HDD_SLAVE_ATAPI_ZIPDISK))
+            drives |= 2;
+        dprintf(3, "CSM ata drives at %x: %x\n", iobase1, drives);
+        return drives;
+    }
+    return -1;
+}
+
 int csm_bootprio_pci(struct pci_device *pci)
 {
     if (!csm_boot_table)
@@ -19,7 +19,8 @@
 struct acpi_device {
     struct hlist_node node;
     char name[16];
-    u8 *hid_aml;
+    char hid[12];
+    char cid[12];
     u8 *sta_aml;
     u8 *crs_data;
     int crs_size;
@@ -27,11 +28,25 @@ struct acpi_device {
 static struct hlist_head acpi_devices VARVERIFY32INIT;
 static const int parse_dumpdevs = 0;
 
+// Devices are indexed by their _HID and _CID in a small hash table.
+#define ACPI_ID_BUCKETS 32
+
+struct acpi_id_s {
+    const char *id;
+    struct acpi_device *dev;
+    struct hlist_node node;
+};
+static struct hlist_head acpi_ids[ACPI_ID_BUCKETS] VARVERIFY32INIT;
+
+// DSDT to parse on the first lookup
+static u8 *acpi_dsdt VARVERIFY32INIT;
+
 struct parse_state {
     char name[32];
     struct acpi_device *dev;
     int error;
     int depth;
+    int skipdev;
 };
 
 static void parse_termlist(struct parse_state *s,
@@ -346,6 +361,48 @@ static int parse_pkg_scope(struct parse_state *s,
     return pkglength;
 }
 
+static int acpi_id_hash(const char *id)
+{
+    u32 hash = 0;
+    while (*id)
+        hash = hash * 31 + *id++;
+    return hash % ACPI_ID_BUCKETS;
+}
+
+static void acpi_index_id(struct acpi_device *dev, const char *id)
+{
+    if (!id[0])
+        return;
+    struct acpi_id_s *e = malloc_tmp(sizeof(*e));
+    if (!e) {
+        warn_noalloc();
+        return;
+    }
+    e->id = id;
+    e->dev = dev;
+    hlist_add_head(&e->node, &acpi_ids[acpi_id_hash(id)]);
+}
+
+// Store the identifier encoded at 'ptr' (an EISA id or a string) as
+// a string - returns the aml length or 0 if it isn't an identifier.
+static int parse_id(u8 *ptr, char *dst, int size)
+{
+    if (ptr[0] == 0x0c) {
+        /* dword prefix - compressed EISA id */
+        snprintf(dst, size, "%c%c%c%02X%02X"
+                 , ((ptr[1] >> 2) & 0x1f) + 0x40
+                 , (((ptr[1] & 0x03) << 3) | (ptr[2] >> 5)) + 0x40
+                 , (ptr[2] & 0x1f) + 0x40, ptr[3], ptr[4]);
+        return 5;
+    }
+    if (ptr[0] == 0x0d) {
+        /* string prefix */
+        strtcpy(dst, (char*)ptr + 1, size);
+        return 1;
+    }
+    return 0;
+}
+
 static int parse_pkg_device(struct parse_state *s,
                             u8 *ptr)
 {
@@ -353,18 +410,30 @@ static int parse_pkg_device(struct parse_state *s,
 
     offset = parse_pkg_common(s, ptr, "device", &pkglength);
 
-    s->dev = malloc_tmp(sizeof(struct acpi_device));
-    if (!s->dev) {
+    struct acpi_device *parent = s->dev;
+    struct acpi_device *dev = malloc_tmp(sizeof(*dev));
+    if (!dev) {
         warn_noalloc();
         s->error = 1;
         return pkglength;
     }
 
-    memset(s->dev, 0, sizeof(struct acpi_device));
-    hlist_add_head(&s->dev->node, &acpi_devices);
-    strtcpy(s->dev->name, s->name, sizeof(s->name));
+    memset(dev, 0, sizeof(*dev));
+    strtcpy(dev->name, s->name, sizeof(dev->name));
+    s->dev = dev;
     parse_termlist(s, ptr, offset, pkglength);
-    s->dev = NULL;
+    s->dev = parent;
+
+    if (s->skipdev || (!dev->hid[0] && !dev->cid[0] && !dev->crs_data)) {
+        // Nothing anyone looks up
+        s->skipdev = 0;
+        free(dev);
+        return pkglength;
+    }
+    hlist_add_head(&dev->node, &acpi_devices);
+    acpi_index_id(dev, dev->hid);
+    if (strcmp(dev->cid, dev->hid) != 0)
+        acpi_index_id(dev, dev->cid);
 
     return pkglength;
 }
@@ -423,11 +492,19 @@ static int parse_termobj(struct parse_state *s,
         break;
     case 0x08: /* name op */
         offset += parse_namestring(s, ptr + offset, "name");
-        offset += parse_termobj(s, ptr + offset);
-        if (s->dev && strcmp(s->name, "_HID") == 0)
-            s->dev->hid_aml = ptr;
+        if (s->dev && strcmp(s->name, "_HID") == 0) {
+            parse_id(ptr + offset, s->dev->hid, sizeof(s->dev->hid));
+            if (strcmp(s->dev->hid, "ACPI0007") == 0) {
+                // Processor device (cpu hotplug) - skip the rest of it
+                s->skipdev = 1;
+                break;
+            }
+        }
+        if (s->dev && strcmp(s->name, "_CID") == 0)
+            parse_id(ptr + offset, s->dev->cid, sizeof(s->dev->cid));
         if (s->dev && strcmp(s->name, "_STA") == 0)
             s->dev->sta_aml = ptr;
+        offset += parse_termobj(s, ptr + offset);
         break;
     case 0x0a: /* byte prefix */
         offset++;
@@ -501,7 +578,7 @@ static void parse_termlist(struct parse_state *s,
 {
     for (;;) {
         offset += parse_termobj(s, ptr + offset);
-        if (offset == pkglength)
+        if (offset == pkglength || s->skipdev)
             return;
         if (offset > pkglength) {
             dprintf(1, "%s: overrun: %d/%d\n", __func__,
@@ -518,28 +595,42 @@ static void parse_termlist(struct parse_state *s,
     }
 }
 
+static void acpi_dsdt_index(void)
+{
+    u8 *dsdt = acpi_dsdt;
+    if (!dsdt)
+        return;
+    acpi_dsdt = NULL;
+
+    u32 length = *(u32*)(dsdt + 4);
+    u32 offset = 0x24;
+    dprintf(1, "ACPI: parse DSDT at %p (len %d)\n", dsdt, length);
+
+    struct parse_state s;
+    memset(&s, 0, sizeof(s));
+    parse_termlist(&s, dsdt, offset, length);
+}
+
+// Find the device after 'prev' with the given _HID or _CID - or any
+// device if 'id' is NULL.
 static struct acpi_device *acpi_dsdt_find(struct acpi_device *prev,
-                                          const u8 *aml1, int size1,
-                                          const u8 *aml2, int size2)
+                                          const char *id)
 {
-    struct acpi_device *dev;
-    struct hlist_node *node;
-
-    if (!prev)
-        node = acpi_devices.first;
-    else
-        node = prev->node.next;
-
-    for (; node != NULL; node = dev->node.next) {
-        dev = container_of(node, struct acpi_device, node);
-        if (!aml1 && !aml2)
-            return dev;
-        if (!dev->hid_aml)
+    acpi_dsdt_index();
+    if (!id) {
+        struct hlist_node *node = prev ? prev->node.next : acpi_devices.first;
+        return node ? container_of(node, struct acpi_device, node) : NULL;
+    }
+    struct acpi_id_s *e;
+    hlist_for_each_entry(e, &acpi_ids[acpi_id_hash(id)], node) {
+        if (prev) {
+            // Continue after the entry of the previous match
+            if (e->dev == prev && strcmp(e->id, id) == 0)
+                prev = NULL;
             continue;
-        if (aml1 && memcmp(dev->hid_aml + 5, aml1, size1) == 0)
-            return dev;
-        if (aml2 && memcmp(dev->hid_aml + 5, aml2, size2) == 0)
-            return dev;
+        }
+        if (strcmp(e->id, id) == 0)
+            return e->dev;
     }
     return NULL;
 }
@@ -573,23 +664,16 @@ struct acpi_device *acpi_dsdt_find_string(struct acpi_device *prev,
     if (!CONFIG_ACPI_PARSE)
         return NULL;
 
-    u8 aml[10];
-    int len = snprintf((char*)aml, sizeof(aml), "\x0d%s", hid);
-    return acpi_dsdt_find(prev, aml, len, NULL, 0);
+    return acpi_dsdt_find(prev, hid);
 }
 
 struct acpi_device *acpi_dsdt_find_eisaid(struct acpi_device *prev, u16 eisaid)
 {
     if (!CONFIG_ACPI_PARSE)
         return NULL;
-    u8 aml1[] = {
-        0x0c, 0x41, 0xd0,
-        eisaid >> 8,
-        eisaid & 0xff
-    };
-    u8 aml2[10];
-    int len2 = snprintf((char*)aml2, sizeof(aml2), "\x0dPNP%04X", eisaid);
-    return acpi_dsdt_find(prev, aml1, 5, aml2, len2);
+    char id[8];
+    snprintf(id, sizeof(id), "PNP%04X", eisaid);
+    return acpi_dsdt_find(prev, id);
 }
 
 char *acpi_dsdt_name(struct acpi_device *dev)
@@ -628,6 +712,7 @@ int acpi_dsdt_present_eisaid(u16 eisaid)
 {
     if (!CONFIG_ACPI_PARSE)
         return -1; /* unknown */
+    acpi_dsdt_index();
     if (hlist_empty(&acpi_devices))
         return -1; /* unknown (no dsdt table) */
 
@@ -647,25 +732,25 @@ void acpi_dsdt_parse(void)
     if (!dsdt)
         return;
 
-    u32 length = *(u32*)(dsdt + 4);
-    u32 offset = 0x24;
-    dprintf(1, "ACPI: parse DSDT at %p (len %d)\n", dsdt, length);
-
-    struct parse_state s;
-    memset(&s, 0, sizeof(s));
-    parse_termlist(&s, dsdt, offset, length);
+    if (dsdt == acpi_dsdt || !hlist_empty(&acpi_devices))
+        // Already known
+        return;
+    // The DSDT is only parsed when a device is first looked up
+    acpi_dsdt = dsdt;
 
     if (!parse_dumpdevs)
         return;
 
     struct acpi_device *dev;
     dprintf(1, "ACPI: dumping dsdt devices\n");
-    for (dev = acpi_dsdt_find(NULL, NULL, 0, NULL, 0);
+    for (dev = acpi_dsdt_find(NULL, NULL);
          dev != NULL;
-         dev = acpi_dsdt_find(dev, NULL, 0, NULL, 0)) {
+         dev = acpi_dsdt_find(dev, NULL)) {
         dprintf(1, "    %s", acpi_dsdt_name(dev));
-        if (dev->hid_aml)
-            dprintf(1, ", hid");
+        if (dev->hid[0])
+            dprintf(1, ", hid %s", dev->hid);
+        if (dev->cid[0])
+            dprintf(1, ", cid %s", dev->cid);
         if (dev->sta_aml)
             dprintf(1, ", sta (0x%x)", dev->sta_aml[0]);
         if (dev->crs_data)
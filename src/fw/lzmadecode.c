@@ -34,9 +34,15 @@
   { int i; for(i = 0; i < 5; i++) { RC_TEST; Code = (Code << 8) | RC_READ_BYTE; }}
 
 
-#define RC_TEST { if (Buffer == BufferLim) return LZMA_RESULT_DATA_ERROR; }
+#define RC_FILL { SizeT size; \
+  if (!InCallback || InCallback->Read(InCallback, &Buffer, &size) || !size) \
+    return LZMA_RESULT_DATA_ERROR; \
+  inPrevious += BufferLim - BufferStart; BufferStart = Buffer; BufferLim = Buffer + size; }
 
-#define RC_INIT(buffer, bufferSize) Buffer = buffer; BufferLim = buffer + bufferSize; RC_INIT2
+#define RC_TEST { if (Buffer == BufferLim) RC_FILL; }
+
+#define RC_INIT(buffer, bufferSize) Buffer = BufferStart = buffer; \
+  BufferLim = InCallback ? buffer : buffer + bufferSize; RC_INIT2
  
 
 #define RC_NORMALIZE if (Range < kTopValue) { RC_TEST; Range <<= 8; Code = (Code << 8) | RC_READ_BYTE; }
@@ -132,16 +138,22 @@ int LzmaDecodeProperties(CLzmaProperties *propsRes, const unsigned char *propsDa
 
 #define kLzmaStreamWasFinishedId (-1)
 
-int LzmaDecode(CLzmaDecoderState *vs,
+/* Decode one bit of a plain (unmatched) literal */
+#define RC_GET_LITBIT { CProb *probLit = prob + symbol; RC_GET_BIT(probLit, symbol) }
+
+/* The decoder body is always inlined so that LzmaDecode() can
+   instantiate a copy with constant lc/lp/pb for the common case. */
+static inline __attribute__((always_inline)) int
+LzmaDecodeBody(CLzmaDecoderState *vs,
     const unsigned char *inStream, SizeT inSize, SizeT *inSizeProcessed,
-    unsigned char *outStream, SizeT outSize, SizeT *outSizeProcessed)
+    unsigned char *outStream, SizeT outSize, SizeT *outSizeProcessed,
+    int lc, int lp, int pb)
 {
   CProb *p = vs->Probs;
   SizeT nowPos = 0;
   Byte previousByte = 0;
-  UInt32 posStateMask = (1 << (vs->Properties.pb)) - 1;
-  UInt32 literalPosMask = (1 << (vs->Properties.lp)) - 1;
-  int lc = vs->Properties.lc;
+  UInt32 posStateMask = (1 << pb) - 1;
+  UInt32 literalPosMask = (1 << lp) - 1;
 
 
   int state = 0;
@@ -149,6 +161,9 @@ int LzmaDecode(CLzmaDecoderState *vs,
   int len = 0;
   const Byte *Buffer;
   const Byte *BufferLim;
+  const Byte *BufferStart;
+  ILzmaInCallback *InCallback = vs->InCallback;
+  SizeT inPrevious = 0;
   UInt32 Range;
   UInt32 Code;
 
@@ -157,7 +172,7 @@ int LzmaDecode(CLzmaDecoderState *vs,
 
   {
     UInt32 i;
-    UInt32 numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (lc + vs->Properties.lp));
+    UInt32 numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (lc + lp));
     for (i = 0; i < numProbs; i++)
       p[i] = kBitModelTotal >> 1;
   }
@@ -199,11 +214,14 @@ int LzmaDecode(CLzmaDecoderState *vs,
           RC_GET_BIT2(probLit, symbol, if (bit != 0) break, if (bit == 0) break)
         }
         while (symbol < 0x100);
+        while (symbol < 0x100)
+          RC_GET_LITBIT
       }
-      while (symbol < 0x100)
+      else
       {
-        CProb *probLit = prob + symbol;
-        RC_GET_BIT(probLit, symbol)
+        /* Plain literal - always exactly 8 bits */
+        RC_GET_LITBIT RC_GET_LITBIT RC_GET_LITBIT RC_GET_LITBIT
+        RC_GET_LITBIT RC_GET_LITBIT RC_GET_LITBIT RC_GET_LITBIT
       }
       previousByte = (Byte)symbol;
 
@@ -380,19 +398,41 @@ int LzmaDecode(CLzmaDecoderState *vs,
         return LZMA_RESULT_DATA_ERROR;
 
 
-      do
       {
-        previousByte = outStream[nowPos - rep0];
-        len--;
-        outStream[nowPos++] = previousByte;
+        SizeT copyLen = outSize - nowPos;
+        Byte *dst = outStream + nowPos;
+        const Byte *src = dst - rep0;
+        if (copyLen > (SizeT)len)
+          copyLen = len;
+        nowPos += copyLen;
+        /* Copy a word at a time when source and destination words
+           can not overlap */
+        if (rep0 >= 4)
+          for (; copyLen >= 4; copyLen -= 4, dst += 4, src += 4)
+            __builtin_memcpy(dst, src, 4);
+        while (copyLen--)
+          *dst++ = *src++;
+        previousByte = outStream[nowPos - 1];
       }
-      while(len != 0 && nowPos < outSize);
     }
   }
   RC_NORMALIZE;
 
 
-  *inSizeProcessed = (SizeT)(Buffer - inStream);
+  *inSizeProcessed = inPrevious + (SizeT)(Buffer - BufferStart);
   *outSizeProcessed = nowPos;
   return LZMA_RESULT_OK;
 }
+
+int LzmaDecode(CLzmaDecoderState *vs,
+    const unsigned char *inStream, SizeT inSize, SizeT *inSizeProcessed,
+    unsigned char *outStream, SizeT outSize, SizeT *outSizeProcessed)
+{
+  CLzmaProperties *props = &vs->Properties;
+  /* Fast path for the default lc=3, lp=0, pb=2 encoder properties */
+  if (props->lc == 3 && props->lp == 0 && props->pb == 2)
+    return LzmaDecodeBody(vs, inStream, inSize, inSizeProcessed,
+        outStream, outSize, outSizeProcessed, 3, 0, 2);
+  return LzmaDecodeBody(vs, inStream, inSize, inSizeProcessed,
+      outStream, outSize, outSizeProcessed, props->lc, props->lp, props->pb);
+}
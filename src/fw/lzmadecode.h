@@ -51,11 +51,20 @@ int LzmaDecodeProperties(CLzmaProperties *propsRes, const unsigned char *propsDa
 
 #define kLzmaNeedInitId (-2)
 
+/* Optional input callback - when set the decoder ignores inStream/inSize
+   and requests more input through Read() each time the current chunk
+   is exhausted. Read() returns 0 on success and a zero size at the end
+   of the input. */
+typedef struct _ILzmaInCallback
+{
+  int (*Read)(void *object, const unsigned char **buffer, SizeT *bufferSize);
+} ILzmaInCallback;
+
 typedef struct _CLzmaDecoderState
 {
   CLzmaProperties Properties;
   CProb *Probs;
-
+  ILzmaInCallback *InCallback;
 
 } CLzmaDecoderState;
 
@@ -33,6 +33,71 @@
 #define MTRR_MEMTYPE_WP 5
 #define MTRR_MEMTYPE_WB 6
 
+// Largest naturally aligned power of two block starting at 'base'
+// that fits within [base, end).
+static u64
+mtrr_block(u64 base, u64 end)
+{
+    u64 size = base & -base;
+    if (!size || size > end - base) {
+        size = 1ull << 63;
+        while (size > end - base)
+            size >>= 1;
+    }
+    return size;
+}
+
+// Number of variable MTRRs needed to cover [base, end)
+static int
+mtrr_count(u64 base, u64 end)
+{
+    int count = 0;
+    while (base < end) {
+        base += mtrr_block(base, end);
+        count++;
+    }
+    return count;
+}
+
+// Program variable MTRRs covering [base, end) with the given type
+static void
+mtrr_set_range(int *reg, int vcnt, u64 phys_mask, u64 base, u64 end, int type)
+{
+    while (base < end && *reg < vcnt) {
+        u64 size = mtrr_block(base, end);
+        wrmsr_smp(MTRRphysBase_MSR(*reg), base | type);
+        wrmsr_smp(MTRRphysMask_MSR(*reg), (-size & phys_mask) | 0x800);
+        (*reg)++;
+        base += size;
+    }
+}
+
+// Extra variable MTRRs needed to carve a write-combining framebuffer
+// out of the uncached window [start, end).
+static int
+mtrr_fb_cost(u64 start, u64 end, u64 fb, u64 fbend)
+{
+    if (fb >= fbend || fb < start || fbend > end)
+        return -1;
+    return (mtrr_count(start, fb) + mtrr_count(fb, fbend)
+            + mtrr_count(fbend, end) - mtrr_count(start, end));
+}
+
+// Mark the mmio window [start, end) uncached, with the framebuffer (if
+// it is within the window) write-combining.
+static void
+mtrr_set_window(int *reg, int vcnt, u64 phys_mask, u64 start, u64 end
+                , u64 fb, u64 fbend)
+{
+    if (mtrr_fb_cost(start, end, fb, fbend) < 0) {
+        mtrr_set_range(reg, vcnt, phys_mask, start, end, MTRR_MEMTYPE_UC);
+        return;
+    }
+    mtrr_set_range(reg, vcnt, phys_mask, start, fb, MTRR_MEMTYPE_UC);
+    mtrr_set_range(reg, vcnt, phys_mask, fbend, end, MTRR_MEMTYPE_UC);
+    mtrr_set_range(reg, vcnt, phys_mask, fb, fbend, MTRR_MEMTYPE_WC);
+}
+
 void mtrr_setup(void)
 {
     if (!CONFIG_MTRR_INIT)
@@ -95,10 +160,35 @@ void mtrr_setup(void)
         wrmsr_smp(MTRRphysBase_MSR(i), 0);
         wrmsr_smp(MTRRphysMask_MSR(i), 0);
     }
-    /* Mark 3.5-4GB as UC, anything not specified defaults to WB */
-    wrmsr_smp(MTRRphysBase_MSR(0), pcimem_start | MTRR_MEMTYPE_UC);
-    wrmsr_smp(MTRRphysMask_MSR(0)
-              , (-((1ull<<32)-pcimem_start) & phys_mask) | 0x800);
+
+    /* Mark the pci windows as UC, anything not specified defaults to
+     * WB.  The 32bit window must be covered; the 64bit window and a
+     * write-combining framebuffer are added if enough MTRRs remain. */
+    u64 start32 = ALIGN_DOWN(pcimem_start, 4096), end32 = 1ull << 32;
+    u64 start64 = 0, end64 = 0;
+    if (pcimem64_start && pcimem64_start < pcimem64_end) {
+        start64 = ALIGN_DOWN(pcimem64_start, 4096);
+        end64 = ALIGN(pcimem64_end, 4096);
+    }
+    int need = mtrr_count(start32, end32);
+    if (need + mtrr_count(start64, end64) <= vcnt)
+        need += mtrr_count(start64, end64);
+    else
+        start64 = end64 = 0;
+    u64 fb = pcifb_start, fbend = pcifb_end;
+    int cost = mtrr_fb_cost(start32, end32, fb, fbend);
+    if (cost < 0)
+        cost = mtrr_fb_cost(start64, end64, fb, fbend);
+    if (cost < 0 || need + cost > vcnt)
+        fb = fbend = 0;
+    if (fbend)
+        dprintf(3, "mtrr: framebuffer %llx-%llx write-combining\n"
+                , fb, fbend);
+
+    int reg = 0;
+    mtrr_set_window(&reg, vcnt, phys_mask, start32, end32, fb, fbend);
+    if (end64)
+        mtrr_set_window(&reg, vcnt, phys_mask, start64, end64, fb, fbend);
 
     // Enable fixed and variable MTRRs; set default type.
     wrmsr_smp(MSR_MTRRdefType, 0xc00 | MTRR_MEMTYPE_WB);
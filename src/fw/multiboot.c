@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "config.h" // CONFIG_*
+#include "e820map.h" // e820_add
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "romfile.h" // romfile_add
@@ -12,11 +13,17 @@
 #include "string.h" // memset
 #include "util.h" // multiboot_init
 
+// Modules are used where the bootloader placed them - their memory is
+// reserved in the e820 map before any allocations are made and is
+// handed back at boot unless it backs a ramdisk.
 struct mbfs_romfile_s {
     struct romfile_s file;
+    struct mbfs_romfile_s *next;
     void *data;
 };
 
+static struct mbfs_romfile_s *MbfsFiles VARVERIFY32INIT;
+
 static int
 extract_filename(char *dest, char *src, size_t lim)
 {
@@ -57,8 +64,41 @@ mbfs_copyfile(struct romfile_s *file, void *dst, u32 maxlen)
     return size;
 }
 
+static void *
+mbfs_mapfile(struct romfile_s *file)
+{
+    return container_of(file, struct mbfs_romfile_s, file)->data;
+}
+
 u32 __VISIBLE entry_elf_eax, entry_elf_ebx;
 
+static struct multiboot_info *
+multiboot_info(void)
+{
+    if (!CONFIG_MULTIBOOT || entry_elf_eax != MULTIBOOT_BOOTLOADER_MAGIC)
+        return NULL;
+    struct multiboot_info *mbi = (void *)entry_elf_ebx;
+    if (!(mbi->flags & MULTIBOOT_INFO_MODS))
+        return NULL;
+    return mbi;
+}
+
+// Keep the malloc zones (and the relocated init code) out of the
+// module images.
+void
+multiboot_preinit(void)
+{
+    struct multiboot_info *mbi = multiboot_info();
+    if (!mbi)
+        return;
+    struct multiboot_mod_list *mod = (void *)mbi->mods_addr;
+    int i;
+    for (i = 0; i < mbi->mods_count; i++)
+        if (mod[i].cmdline && mod[i].mod_end > mod[i].mod_start)
+            e820_add(mod[i].mod_start, mod[i].mod_end - mod[i].mod_start
+                     , E820_RESERVED);
+}
+
 void
 multiboot_init(void)
 {
@@ -78,7 +118,6 @@ multiboot_init(void)
     struct multiboot_mod_list *mod = (void *)mbi->mods_addr;
     for (i = 0; i < mbi->mods_count; i++) {
         struct mbfs_romfile_s *cfile;
-        u8 *copy;
         u32 len;
         if (!mod[i].cmdline)
             continue;
@@ -97,15 +136,27 @@ multiboot_init(void)
         }
         dprintf(1, "assigned file name <%s>\n", cfile->file.name);
         cfile->file.size = len;
-        copy = malloc_tmp(len);
-        if (!copy) {
-            warn_noalloc();
-            free(cfile);
-            return;
-        }
-        memcpy(copy, (void *)mod[i].mod_start, len);
         cfile->file.copy = mbfs_copyfile;
-        cfile->data = copy;
+        cfile->file.map = mbfs_mapfile;
+        cfile->data = (void *)mod[i].mod_start;
+        cfile->next = MbfsFiles;
+        MbfsFiles = cfile;
         romfile_add(&cfile->file);
     }
 }
+
+// Return the memory of modules that are only needed during POST.
+void
+multiboot_prepboot(void)
+{
+    if (!CONFIG_MULTIBOOT)
+        return;
+    struct mbfs_romfile_s *cfile;
+    for (cfile = MbfsFiles; cfile; cfile = cfile->next) {
+        if (CONFIG_FLASH_HARDDISK
+            && memcmp(cfile->file.name, "hdimg/", 6) == 0)
+            // May be mapped as a ramdisk
+            continue;
+        e820_add((u32)cfile->data, cfile->file.size, E820_RAM);
+    }
+}
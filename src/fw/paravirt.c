@@ -196,8 +196,15 @@ static void qemu_detect(void)
 
     // check northbridge @ 00:00.0
     u16 v = pci_config_readw(0, PCI_VENDOR_ID);
-    if (v == 0x0000 || v == 0xffff)
+    if (v == 0x0000 || v == 0xffff) {
+        if (!CONFIG_QEMU)
+            return;
+        // The only QEMU machine without a pci host bridge is microvm
+        PlatformRunningOn |= PF_QEMU | PF_MICROVM;
+        dprintf(1, "Running on QEMU (microvm)\n");
+        physbits(1);
         return;
+    }
     u16 d = pci_config_readw(0, PCI_DEVICE_ID);
     u16 sv = pci_config_readw(0, PCI_SUBSYSTEM_VENDOR_ID);
     u16 sd = pci_config_readw(0, PCI_SUBSYSTEM_ID);
@@ -266,12 +273,44 @@ static void msr_feature_control_setup(void)
         wrmsr_smp(MSR_IA32_FEATURE_CONTROL, feature_control_bits);
 }
 
+// microvm has no pci and only virtio-mmio devices - skip pci init,
+// smm and the pci based bios tables.
+static void
+microvm_platform_setup(void)
+{
+    mtrr_setup();
+    msr_feature_control_setup();
+    TIMELINE_CALL(smp_setup);
+    if (MaxCountCPUs <= 255)
+        mptable_setup();
+    TIMELINE_CALL(smbios_setup);
+
+    if (CONFIG_FW_ROMFILE_LOAD) {
+        timeline_begin("romfile_loader");
+        romfile_loader_execute("etc/table-loader");
+        timeline_end();
+        RsdpAddr = find_acpi_rsdp();
+    }
+    if (RsdpAddr) {
+        acpi_dsdt_parse();
+        virtio_mmio_setup_acpi();
+    } else {
+        virtio_mmio_setup_romfile();
+    }
+}
+
 void
 qemu_platform_setup(void)
 {
     if (!CONFIG_QEMU)
         return;
 
+    if (runningOnMicrovm()) {
+        kvmclock_init();
+        microvm_platform_setup();
+        return;
+    }
+
     if (runningOnXen()) {
         pci_probe_devices();
         xen_hypercall_setup();
@@ -282,28 +321,37 @@ qemu_platform_setup(void)
     kvmclock_init();
 
     // Initialize pci
-    pci_setup();
+    TIMELINE_CALL(pci_setup);
     smm_device_setup();
-    smm_setup();
+    TIMELINE_CALL(smm_setup);
 
     // Initialize mtrr, msr_feature_control and smp
     mtrr_setup();
     msr_feature_control_setup();
-    smp_setup();
-
-    // Create bios tables
-    if (MaxCountCPUs <= 255) {
+    TIMELINE_CALL(smp_setup);
+
+    // Create bios tables.  The legacy MP and $PIR tables can be left out
+    // for guests that only use ACPI (0: never build them, 1: always,
+    // 2: only if the host doesn't provide ACPI tables).
+    int legacy = romfile_loadint("etc/legacy-tables", 1);
+    if (legacy == 2)
+        legacy = !CONFIG_FW_ROMFILE_LOAD || !romfile_find("etc/table-loader");
+    if (legacy && MaxCountCPUs <= 255) {
         pirtable_setup();
         mptable_setup();
+    } else {
+        dprintf(3, "Skipping legacy MP and PIR tables\n");
     }
-    smbios_setup();
+    TIMELINE_CALL(smbios_setup);
 
     if (CONFIG_FW_ROMFILE_LOAD) {
         int loader_err;
 
         dprintf(3, "load ACPI tables\n");
 
+        timeline_begin("romfile_loader");
         loader_err = romfile_loader_execute("etc/table-loader");
+        timeline_end();
 
         RsdpAddr = find_acpi_rsdp();
 
@@ -345,10 +393,76 @@ qemu_platform_setup(void)
 #define QEMU_CFG_IRQ0_OVERRIDE          (QEMU_CFG_ARCH_LOCAL + 2)
 #define QEMU_CFG_E820_TABLE             (QEMU_CFG_ARCH_LOCAL + 3)
 
+// Base of the memory mapped fw_cfg interface (if it is in use)
+static void *cfg_mmio;
+
+// Without DMA the selected key and the position in it are tracked so
+// that a read at a later offset of the same key only skips the gap.
+static int cfg_pos_valid;
+static u16 cfg_pos_key;
+static u32 cfg_pos;
+
+// Largest pio transfer done without yielding
+#define QEMU_CFG_PIO_CHUNK 4096
+
 static void
 qemu_cfg_select(u16 f)
 {
-    outw(f, PORT_QEMU_CFG_CTL);
+    if (cfg_mmio)
+        writew(cfg_mmio + QEMU_CFG_MMIO_CTL, cpu_to_be16(f));
+    else
+        outw(f, PORT_QEMU_CFG_CTL);
+    cfg_pos_valid = 1;
+    cfg_pos_key = f;
+    cfg_pos = 0;
+}
+
+// Start the dma request at 'access'
+static void
+qemu_cfg_dma_kick(QemuCfgDmaAccess *access)
+{
+    // A dma request may change the selected key and its position
+    cfg_pos_valid = 0;
+    if (cfg_mmio)
+        writel(cfg_mmio + QEMU_CFG_MMIO_DMA_ADDR_LOW, cpu_to_be32((u32)access));
+    else
+        outl(cpu_to_be32((u32)access), PORT_QEMU_CFG_DMA_ADDR_LOW);
+}
+
+// Read from the data register of the selected key without dma
+static void
+qemu_cfg_pio_read(void *buf, u32 len)
+{
+    cfg_pos += len;
+    if (cfg_mmio) {
+        // The data register returns the bytes in file order
+        void *data = cfg_mmio + QEMU_CFG_MMIO_DATA;
+        for (; len >= 4; len -= 4, buf += 4)
+            *(u32*)buf = readl(data);
+        for (; len; len--, buf++)
+            *(u8*)buf = readb(data);
+        return;
+    }
+    for (;;) {
+        u32 count = len < QEMU_CFG_PIO_CHUNK ? len : QEMU_CFG_PIO_CHUNK;
+        insb(PORT_QEMU_CFG_DATA, buf, count);
+        len -= count;
+        if (!len)
+            break;
+        buf += count;
+        yield();
+    }
+}
+
+static void
+qemu_cfg_pio_skip(u32 len)
+{
+    u8 discard[64];
+    while (len) {
+        u32 count = len < sizeof(discard) ? len : sizeof(discard);
+        qemu_cfg_pio_read(discard, count);
+        len -= count;
+    }
 }
 
 static void
@@ -362,7 +476,7 @@ qemu_cfg_dma_transfer(void *address, u32 length, u32 control)
 
     barrier();
 
-    outl(cpu_to_be32((u32)&access), PORT_QEMU_CFG_DMA_ADDR_LOW);
+    qemu_cfg_dma_kick(&access);
 
     while(be32_to_cpu(access.control) & ~QEMU_CFG_DMA_CTL_ERROR) {
         yield();
@@ -379,7 +493,7 @@ qemu_cfg_read(void *buf, int len)
     if (qemu_cfg_dma_enabled()) {
         qemu_cfg_dma_transfer(buf, len, QEMU_CFG_DMA_CTL_READ);
     } else {
-        insb(PORT_QEMU_CFG_DATA, buf, len);
+        qemu_cfg_pio_read(buf, len);
     }
 }
 
@@ -407,11 +521,19 @@ qemu_cfg_skip(int len)
     if (qemu_cfg_dma_enabled()) {
         qemu_cfg_dma_transfer(0, len, QEMU_CFG_DMA_CTL_SKIP);
     } else {
-        while (len--)
-            inb(PORT_QEMU_CFG_DATA);
+        qemu_cfg_pio_skip(len);
     }
 }
 
+// Select key 'f' and move to 'offset' in it
+static void
+qemu_cfg_seek(u16 f, u32 offset)
+{
+    if (!cfg_pos_valid || cfg_pos_key != f || cfg_pos > offset)
+        qemu_cfg_select(f);
+    qemu_cfg_skip(offset - cfg_pos);
+}
+
 static void
 qemu_cfg_read_entry(void *buf, int e, int len)
 {
@@ -453,13 +575,99 @@ qemu_cfg_read_file(struct romfile_s *file, void *dst, u32 maxlen)
         /* Do it in one transfer */
         qemu_cfg_read_entry(dst, qfile->select, file->size);
     } else {
-        qemu_cfg_select(qfile->select);
-        qemu_cfg_skip(qfile->skip);
+        qemu_cfg_seek(qfile->select, qfile->skip);
         qemu_cfg_read(dst, file->size);
     }
     return file->size;
 }
 
+// A list of fw_cfg DMA requests that are submitted together
+struct qemu_cfg_batch_s {
+    int count, max;
+    QemuCfgDmaAccess access[];
+};
+
+// Allocate a batch that can hold reads of up to 'files' fw_cfg files.
+// Returns NULL if the DMA interface is not available.
+struct qemu_cfg_batch_s *
+qemu_cfg_batch_alloc(int files)
+{
+    if (!qemu_cfg_dma_enabled())
+        return NULL;
+    // Each file needs at most two requests (select+skip and read)
+    int max = files * 2;
+    struct qemu_cfg_batch_s *batch = malloc_tmp(
+        sizeof(*batch) + max * sizeof(batch->access[0]));
+    if (!batch) {
+        warn_noalloc();
+        return NULL;
+    }
+    batch->count = 0;
+    batch->max = max;
+    return batch;
+}
+
+static void
+qemu_cfg_batch_add(struct qemu_cfg_batch_s *batch, void *address, u32 length
+                   , u32 control)
+{
+    QemuCfgDmaAccess *access = &batch->access[batch->count++];
+    access->address = cpu_to_be64((u64)(u32)address);
+    access->length = cpu_to_be32(length);
+    access->control = cpu_to_be32(control);
+}
+
+// Add the read of a file to a batch.  Files that can not be batched
+// (or a NULL batch) are read immediately.  Returns 0 on success.
+int
+qemu_cfg_batch_read_file(struct qemu_cfg_batch_s *batch
+                         , struct romfile_s *file, void *dst)
+{
+    if (!batch || file->copy != qemu_cfg_read_file
+        || batch->count + 2 > batch->max) {
+        int ret = file->copy(file, dst, file->size);
+        return ret == file->size ? 0 : -1;
+    }
+    struct qemu_romfile_s *qfile;
+    qfile = container_of(file, struct qemu_romfile_s, file);
+    u32 control = (qfile->select << 16) | QEMU_CFG_DMA_CTL_SELECT;
+    if (qfile->skip) {
+        // Fold the select and the skip into a single request
+        qemu_cfg_batch_add(batch, 0, qfile->skip
+                           , control | QEMU_CFG_DMA_CTL_SKIP);
+        control = 0;
+    }
+    if (file->size)
+        qemu_cfg_batch_add(batch, dst, file->size
+                           , control | QEMU_CFG_DMA_CTL_READ);
+    return 0;
+}
+
+// Submit all requests of a batch back-to-back and free the batch.
+// Returns 0 if all requests completed without error.
+int
+qemu_cfg_batch_run(struct qemu_cfg_batch_s *batch)
+{
+    if (!batch)
+        return 0;
+
+    barrier();
+
+    // The device processes one request per doorbell write, so only
+    // yield when a request hasn't completed by the time it's checked.
+    int i, ret = 0;
+    for (i = 0; i < batch->count; i++) {
+        QemuCfgDmaAccess *access = &batch->access[i];
+        qemu_cfg_dma_kick(access);
+        while (be32_to_cpu(access->control) & ~QEMU_CFG_DMA_CTL_ERROR)
+            yield();
+        if (access->control)
+            ret = -1;
+    }
+    free(batch);
+    return ret;
+}
+
 // Bare-bones function for writing a file knowing only its unique
 // identifying key (select)
 int
@@ -661,20 +869,65 @@ struct QemuCfgFile {
     char name[56];
 };
 
+// Read the whole fw_cfg file directory in one transfer and add its
+// files as romfiles backed by a single allocation.
+static void
+qemu_cfg_load_directory(void)
+{
+    u32 count;
+    qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
+    count = be32_to_cpu(count);
+    if (!count)
+        return;
+    struct qemu_romfile_s *files = malloc_tmp(count * sizeof(files[0]));
+    if (!files) {
+        warn_noalloc();
+        return;
+    }
+    // The directory is read into the end of the arena and converted
+    // in place - record 'e' never extends past directory entry 'e'.
+    struct QemuCfgFile *dir = (void*)&files[count] - count * sizeof(dir[0]);
+    qemu_cfg_read(dir, count * sizeof(dir[0]));
+    u32 e;
+    for (e = 0; e < count; e++) {
+        struct QemuCfgFile qfile = dir[e];
+        struct qemu_romfile_s *file = &files[e];
+        memset(file, 0, sizeof(*file));
+        strtcpy(file->file.name, qfile.name, sizeof(qfile.name));
+        file->file.size = be32_to_cpu(qfile.size);
+        file->file.copy = qemu_cfg_read_file;
+        file->select = be16_to_cpu(qfile.select);
+    }
+    // QEMU sorts the directory by name - add it in reverse so the
+    // files form one sorted run for romfile_index_build().
+    while (e--)
+        romfile_add(&files[e].file);
+}
+
+static int
+qemu_cfg_check_signature(void)
+{
+    char sig[4];
+    qemu_cfg_select(QEMU_CFG_SIGNATURE);
+    qemu_cfg_pio_read(sig, sizeof(sig));
+    return memcmp(sig, "QEMU", sizeof(sig)) == 0;
+}
+
 static int qemu_cfg_detect(void)
 {
     if (cfg_enabled)
         return 1;
 
-    // Detect fw_cfg interface.
-    qemu_cfg_select(QEMU_CFG_SIGNATURE);
-    char *sig = "QEMU";
-    int i;
-    for (i = 0; i < 4; i++)
-        if (inb(PORT_QEMU_CFG_DATA) != sig[i])
-            return 0;
+    // Detect fw_cfg interface - prefer the memory mapped one.
+    if (CONFIG_QEMU_CFG_MMIO_ADDR) {
+        cfg_mmio = (void*)CONFIG_QEMU_CFG_MMIO_ADDR;
+        if (!qemu_cfg_check_signature())
+            cfg_mmio = NULL;
+    }
+    if (!cfg_mmio && !qemu_cfg_check_signature())
+        return 0;
 
-    dprintf(1, "Found QEMU fw_cfg\n");
+    dprintf(1, "Found QEMU fw_cfg%s\n", cfg_mmio ? " (mmio)" : "");
     cfg_enabled = 1;
 
     // Detect DMA interface.
@@ -700,16 +953,7 @@ void qemu_cfg_init(void)
     qemu_cfg_legacy();
 
     // Load files found in the fw_cfg file directory
-    u32 count;
-    qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
-    count = be32_to_cpu(count);
-    u32 e;
-    for (e = 0; e < count; e++) {
-        struct QemuCfgFile qfile;
-        qemu_cfg_read(&qfile, sizeof(qfile));
-        qemu_romfile_add(qfile.name, be16_to_cpu(qfile.select)
-                         , 0, be32_to_cpu(qfile.size));
-    }
+    qemu_cfg_load_directory();
 
     qemu_cfg_e820();
 
@@ -21,6 +21,7 @@ struct pvclock_vcpu_time_info {
 #define PF_QEMU     (1<<0)
 #define PF_XEN      (1<<1)
 #define PF_KVM      (1<<2)
+#define PF_MICROVM  (1<<3)
 
 typedef struct QemuCfgDmaAccess {
     u32 control;
@@ -44,6 +45,10 @@ static inline int runningOnXen(void) {
 static inline int runningOnKVM(void) {
     return CONFIG_QEMU && GET_GLOBAL(PlatformRunningOn) & PF_KVM;
 }
+static inline int runningOnMicrovm(void) {
+    return CONFIG_PROFILE_QEMU_MICROVM || (
+        CONFIG_QEMU && GET_GLOBAL(PlatformRunningOn) & PF_MICROVM);
+}
 
 // Common paravirt ports.
 #define PORT_SMI_CMD                0x00b2
@@ -53,6 +58,12 @@ static inline int runningOnKVM(void) {
 #define PORT_QEMU_CFG_DMA_ADDR_HIGH 0x0514
 #define PORT_QEMU_CFG_DMA_ADDR_LOW  0x0518
 
+// Register offsets of the memory mapped fw_cfg interface
+#define QEMU_CFG_MMIO_DATA          0x00
+#define QEMU_CFG_MMIO_CTL           0x08
+#define QEMU_CFG_MMIO_DMA_ADDR_HIGH 0x10
+#define QEMU_CFG_MMIO_DMA_ADDR_LOW  0x14
+
 // QEMU_CFG_DMA_CONTROL bits
 #define QEMU_CFG_DMA_CTL_ERROR   0x01
 #define QEMU_CFG_DMA_CTL_READ    0x02
@@ -76,5 +87,10 @@ u16 qemu_get_present_cpus_count(void);
 int qemu_cfg_write_file(void *src, struct romfile_s *file, u32 offset, u32 len);
 int qemu_cfg_write_file_simple(void *src, u16 key, u32 offset, u32 len);
 u16 qemu_get_romfile_key(struct romfile_s *file);
+struct qemu_cfg_batch_s;
+struct qemu_cfg_batch_s *qemu_cfg_batch_alloc(int files);
+int qemu_cfg_batch_read_file(struct qemu_cfg_batch_s *batch
+                             , struct romfile_s *file, void *dst);
+int qemu_cfg_batch_run(struct qemu_cfg_batch_s *batch);
 
 #endif
@@ -52,6 +52,9 @@ u64 pcimem_end     = BUILD_PCIMEM_END;
 u64 pcimem64_start = BUILD_PCIMEM64_START;
 u64 pcimem64_end   = BUILD_PCIMEM64_END;
 
+// Largest prefetchable bar of a vga device (used for mtrr setup)
+u64 pcifb_start, pcifb_end;
+
 // Resource allocation limits
 static u64 pci_io_low_end = 0xa000;
 static u64 pci_mem64_top  = 0;
@@ -62,6 +65,7 @@ struct pci_region_entry {
     int bar;
     u64 size;
     u64 align;
+    u64 offset;     // Position in the region (see pci_region_layout)
     int is64;
     enum pci_region_type type;
     struct hlist_node node;
@@ -407,9 +411,9 @@ static void pci_bios_init_device(struct pci_device *pci)
 
     /* map the interrupt */
     u16 bdf = pci->bdf;
-    int pin = pci_config_readb(bdf, PCI_INTERRUPT_PIN);
+    int pin = pci_device_readb(pci, PCI_INTERRUPT_PIN);
     if (pin != 0)
-        pci_config_writeb(bdf, PCI_INTERRUPT_LINE, pci_slot_get_irq(pci, pin));
+        pci_device_writeb(pci, PCI_INTERRUPT_LINE, pci_slot_get_irq(pci, pin));
 
     pci_init_device(pci_device_tbl, pci, NULL);
 
@@ -482,20 +486,34 @@ static void mch_mmconfig_setup(u16 bdf)
     u64 addr = Q35_HOST_BRIDGE_PCIEXBAR_ADDR;
     u32 upper = addr >> 32;
     u32 lower = (addr & 0xffffffff) | Q35_HOST_BRIDGE_PCIEXBAREN;
-    pci_config_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR, 0);
-    pci_config_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR + 4, upper);
-    pci_config_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR, lower);
+    // Port io, as the window is briefly disabled (and may be in use)
+    pci_ioconfig_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR, 0);
+    pci_ioconfig_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR + 4, upper);
+    pci_ioconfig_writel(bdf, Q35_HOST_BRIDGE_PCIEXBAR, lower);
     pci_enable_mmconfig(Q35_HOST_BRIDGE_PCIEXBAR_ADDR, "q35");
 }
 
+// Enable the q35 mmconfig window before the bus scans, so that they
+// don't need (trapping) port io accesses.
+static void mch_mmconfig_early_setup(void)
+{
+    u32 id = pci_ioconfig_readl(0, PCI_VENDOR_ID);
+    if (id != (PCI_VENDOR_ID_INTEL | (PCI_DEVICE_ID_INTEL_Q35_MCH << 16)))
+        return;
+    MCHMmcfgBDF = 0;
+    mch_mmconfig_setup(0);
+}
+
 static void mch_mem_addr_setup(struct pci_device *dev, void *arg)
 {
     u64 addr = Q35_HOST_BRIDGE_PCIEXBAR_ADDR;
     u32 size = Q35_HOST_BRIDGE_PCIEXBAR_SIZE;
 
-    /* setup mmconfig */
-    MCHMmcfgBDF = dev->bdf;
-    mch_mmconfig_setup(dev->bdf);
+    /* setup mmconfig (unless done before the bus scan) */
+    if (MCHMmcfgBDF != dev->bdf) {
+        MCHMmcfgBDF = dev->bdf;
+        mch_mmconfig_setup(dev->bdf);
+    }
     e820_add(addr, size, E820_RESERVED);
 
     /* setup pci i/o window (above mmconfig) */
@@ -566,87 +584,89 @@ static u8 pci_find_resource_reserve_capability(u16 bdf)
  * Bus initialization
  ****************************************************************/
 
+// A bridge found while numbering the buses
+struct pci_bus_bridge {
+    u16 bdf;
+    u32 busregs;        // primary, secondary and subordinate bus registers
+};
+
 static void
-pci_bios_init_bus_rec(int bus, u8 *pci_bus)
+pci_bios_init_bus_rec(int bus, int devs, u8 *pci_bus)
 {
-    int bdf;
-    u16 class;
+    int bdf, count = 0;
 
     dprintf(1, "PCI: %s bus = 0x%x\n", __func__, bus);
 
-    /* prevent accidental access to unintended devices */
-    foreachbdf(bdf, bus) {
-        class = pci_config_readw(bdf, PCI_CLASS_DEVICE);
-        if (class == PCI_CLASS_BRIDGE_PCI) {
-            pci_config_writeb(bdf, PCI_SECONDARY_BUS, 255);
-            pci_config_writeb(bdf, PCI_SUBORDINATE_BUS, 0);
-        }
+    struct pci_bus_bridge *bridges = malloc_tmp(sizeof(*bridges) * devs * 8);
+    if (!bridges) {
+        warn_noalloc();
+        return;
     }
 
-    foreachbdf(bdf, bus) {
-        class = pci_config_readw(bdf, PCI_CLASS_DEVICE);
-        if (class != PCI_CLASS_BRIDGE_PCI) {
+    /* Find the bridges with a single scan of the bus and prevent
+       accidental access to unintended devices.  A bridge with its
+       subordinate bus below its secondary bus forwards nothing - bridges
+       that still have their reset values (both zero) are left alone. */
+    foreachbdf_devs(bdf, bus, devs) {
+        if (pci_config_readw(bdf, PCI_CLASS_DEVICE) != PCI_CLASS_BRIDGE_PCI)
             continue;
+        u32 busregs = pci_config_readl(bdf, PCI_PRIMARY_BUS);
+        if (busregs & 0x00ffff00) {
+            busregs = (busregs & 0xff0000ff) | (255 << 8);
+            pci_config_writel(bdf, PCI_PRIMARY_BUS, busregs);
         }
-        dprintf(1, "PCI: %s bdf = 0x%x\n", __func__, bdf);
+        bridges[count].bdf = bdf;
+        bridges[count].busregs = busregs;
+        count++;
+    }
 
-        u8 pribus = pci_config_readb(bdf, PCI_PRIMARY_BUS);
-        if (pribus != bus) {
-            dprintf(1, "PCI: primary bus = 0x%x -> 0x%x\n", pribus, bus);
-            pci_config_writeb(bdf, PCI_PRIMARY_BUS, bus);
-        } else {
-            dprintf(1, "PCI: primary bus = 0x%x\n", pribus);
-        }
+    int i;
+    for (i = 0; i < count; i++) {
+        bdf = bridges[i].bdf;
+        u32 busregs = bridges[i].busregs;
+        u8 secbus = ++(*pci_bus);
+        dprintf(1, "PCI: %s bdf = 0x%x primary bus = 0x%x -> 0x%x"
+                " secondary bus = 0x%x\n", __func__, bdf
+                , busregs & 0xff, bus, secbus);
+
+        /* Set the primary and secondary bus and the maximum subordinate
+           bus in one write for access to all buses behind the bridge.
+           The subordinate bus is set to its accurate value later. */
+        pci_config_writel(bdf, PCI_PRIMARY_BUS, (busregs & 0xff000000)
+                          | (255 << 16) | (secbus << 8) | bus);
 
-        u8 secbus = pci_config_readb(bdf, PCI_SECONDARY_BUS);
-        (*pci_bus)++;
-        if (*pci_bus != secbus) {
-            dprintf(1, "PCI: secondary bus = 0x%x -> 0x%x\n",
-                    secbus, *pci_bus);
-            secbus = *pci_bus;
-            pci_config_writeb(bdf, PCI_SECONDARY_BUS, secbus);
-        } else {
-            dprintf(1, "PCI: secondary bus = 0x%x\n", secbus);
-        }
-
-        /* set to max for access to all subordinate buses.
-           later set it to accurate value */
-        u8 subbus = pci_config_readb(bdf, PCI_SUBORDINATE_BUS);
-        pci_config_writeb(bdf, PCI_SUBORDINATE_BUS, 255);
-
-        pci_bios_init_bus_rec(secbus, pci_bus);
-
-        if (subbus != *pci_bus) {
-            u8 res_bus = *pci_bus;
-            u8 cap = pci_find_resource_reserve_capability(bdf);
-
-            if (cap) {
-                u32 tmp_res_bus = pci_config_readl(bdf,
-                        cap + RES_RESERVE_BUS_RES);
-                if (tmp_res_bus != (u32)-1) {
-                    res_bus = tmp_res_bus & 0xFF;
-                    if ((u8)(res_bus + secbus) < secbus ||
-                            (u8)(res_bus + secbus) < res_bus) {
-                        dprintf(1, "PCI: bus_reserve value %d is invalid\n",
-                                res_bus);
-                        res_bus = 0;
-                    }
-                    if (secbus + res_bus > *pci_bus) {
-                        dprintf(1, "PCI: QEMU resource reserve cap: bus = %u\n",
-                                res_bus);
-                        res_bus = secbus + res_bus;
-                    }
+        u8 pcie_cap = pci_find_capability(bdf, PCI_CAP_ID_EXP, 0);
+        pci_bios_init_bus_rec(secbus, pci_bridge_devices(bdf, pcie_cap)
+                              , pci_bus);
+
+        u8 res_bus = *pci_bus;
+        u8 cap = pci_find_resource_reserve_capability(bdf);
+
+        if (cap) {
+            u32 tmp_res_bus = pci_config_readl(bdf,
+                    cap + RES_RESERVE_BUS_RES);
+            if (tmp_res_bus != (u32)-1) {
+                res_bus = tmp_res_bus & 0xFF;
+                if ((u8)(res_bus + secbus) < secbus ||
+                        (u8)(res_bus + secbus) < res_bus) {
+                    dprintf(1, "PCI: bus_reserve value %d is invalid\n",
+                            res_bus);
+                    res_bus = 0;
+                }
+                if (secbus + res_bus > *pci_bus) {
+                    dprintf(1, "PCI: QEMU resource reserve cap: bus = %u\n",
+                            res_bus);
+                    res_bus = secbus + res_bus;
                 }
             }
-            dprintf(1, "PCI: subordinate bus = 0x%x -> 0x%x\n",
-                    subbus, res_bus);
-            subbus = res_bus;
-            *pci_bus = res_bus;
-        } else {
-            dprintf(1, "PCI: subordinate bus = 0x%x\n", subbus);
         }
-        pci_config_writeb(bdf, PCI_SUBORDINATE_BUS, subbus);
+        dprintf(1, "PCI: subordinate bus = 0x%x\n", res_bus);
+        *pci_bus = res_bus;
+        if (res_bus != 255)
+            pci_config_writeb(bdf, PCI_SUBORDINATE_BUS, res_bus);
     }
+
+    free(bridges);
 }
 
 static void
@@ -655,12 +675,12 @@ pci_bios_init_bus(void)
     u8 extraroots = romfile_loadint("etc/extra-pci-roots", 0);
     u8 pci_bus = 0;
 
-    pci_bios_init_bus_rec(0 /* host bus */, &pci_bus);
+    pci_bios_init_bus_rec(0 /* host bus */, 32, &pci_bus);
 
     if (extraroots) {
         while (pci_bus < 0xff) {
             pci_bus++;
-            pci_bios_init_bus_rec(pci_bus, &pci_bus);
+            pci_bios_init_bus_rec(pci_bus, 32, &pci_bus);
         }
     }
 }
@@ -744,14 +764,51 @@ static u64 pci_region_align(struct pci_region *r)
     return 1;
 }
 
-static u64 pci_region_sum(struct pci_region *r)
+#define PCI_REGION_GAPS 16
+
+// Assign each entry of a region an offset within the region and
+// return the size of the region.  Entries are placed in order of
+// decreasing alignment, each one going into the first alignment gap
+// left by earlier entries that it fits, so that bridge windows that
+// are not a multiple of their alignment don't waste space.  The
+// region base must be aligned to pci_region_align().
+static u64 pci_region_layout(struct pci_region *r)
 {
-    u64 sum = 0;
+    struct { u64 start, end; } gaps[PCI_REGION_GAPS];
+    int gapcount = 0, i;
+    u64 end = 0;
     struct pci_region_entry *entry;
     hlist_for_each_entry(entry, &r->list, node) {
-        sum += entry->size;
+        for (i = 0; i < gapcount; i++) {
+            u64 addr = ALIGN(gaps[i].start, entry->align);
+            if (addr + entry->size <= gaps[i].end)
+                break;
+        }
+        if (i < gapcount) {
+            // Place in the gap and split the gap around the entry
+            u64 start = gaps[i].start;
+            u64 addr = ALIGN(start, entry->align);
+            entry->offset = addr;
+            gaps[i].start = addr + entry->size;
+            if (gaps[i].start == gaps[i].end)
+                gaps[i] = gaps[--gapcount];
+            if (addr > start && gapcount < ARRAY_SIZE(gaps)) {
+                gaps[gapcount].start = start;
+                gaps[gapcount].end = addr;
+                gapcount++;
+            }
+            continue;
+        }
+        u64 addr = ALIGN(end, entry->align);
+        if (addr > end && gapcount < ARRAY_SIZE(gaps)) {
+            gaps[gapcount].start = end;
+            gaps[gapcount].end = addr;
+            gapcount++;
+        }
+        entry->offset = addr;
+        end = addr + entry->size;
     }
-    return sum;
+    return end;
 }
 
 static void pci_region_migrate_64bit_entries(struct pci_region *from,
@@ -835,7 +892,7 @@ static hotplug_type_t pci_bus_hotplug_support(struct pci_bus *bus, u8 pcie_cap)
     }
 
 check_shpc:
-    shpc_cap = pci_find_capability(bus->bus_dev->bdf, PCI_CAP_ID_SHPC, 0);
+    shpc_cap = pci_device_find_capability(bus->bus_dev, PCI_CAP_ID_SHPC, 0);
     return !!shpc_cap ? HOTPLUG_SHPC : HOTPLUG_NO_SUPPORTED;
 }
 
@@ -918,7 +975,7 @@ static int pci_bios_check_devices(struct pci_bus *busses)
             parent = &busses[0];
         int type;
         u16 bdf = s->bus_dev->bdf;
-        u8 pcie_cap = pci_find_capability(bdf, PCI_CAP_ID_EXP, 0);
+        u8 pcie_cap = pci_device_find_capability(s->bus_dev, PCI_CAP_ID_EXP, 0);
         u8 qemu_cap = pci_find_resource_reserve_capability(bdf);
 
         hotplug_type_t hotplug_support = pci_bus_hotplug_support(s, pcie_cap);
@@ -964,7 +1021,7 @@ static int pci_bios_check_devices(struct pci_bus *busses)
             }
             if (pci_region_align(&s->r[type]) > align)
                  align = pci_region_align(&s->r[type]);
-            u64 sum = pci_region_sum(&s->r[type]);
+            u64 sum = pci_region_layout(&s->r[type]);
             int is64 = pci_bios_bridge_region_is64(&s->r[type],
                                                    s->bus_dev, type);
             int resource_optional = 0;
@@ -985,7 +1042,11 @@ static int pci_bios_check_devices(struct pci_bus *busses)
                     size = ALIGN(size, align);
                 }
             } else {
-                size = ALIGN(sum, align);
+                // The window base is aligned, but its size only needs
+                // the bridge granularity - see pci_region_layout()
+                u64 gran = (type == PCI_REGION_TYPE_IO) ?
+                    PCI_BRIDGE_IO_MIN : PCI_BRIDGE_MEM_MIN;
+                size = ALIGN(sum, gran);
             }
             // entry->bar is -1 if the entry represents a bridge region
             struct pci_region_entry *entry = pci_region_create_entry(
@@ -1020,7 +1081,7 @@ static int pci_bios_init_root_regions_io(struct pci_bus *bus)
      *   c000 - ffff    free, traditionally used for pci io
      */
     struct pci_region *r_io = &bus->r[PCI_REGION_TYPE_IO];
-    u64 sum = pci_region_sum(r_io);
+    u64 sum = pci_region_layout(r_io);
     if (sum < 0x4000) {
         /* traditional region is big enougth, use it */
         r_io->base = 0xc000;
@@ -1045,10 +1106,10 @@ static int pci_bios_init_root_regions_mem(struct pci_bus *bus)
         r_end = r_start;
         r_start = &bus->r[PCI_REGION_TYPE_PREFMEM];
     }
-    u64 sum = pci_region_sum(r_end);
+    u64 sum = pci_region_layout(r_end);
     u64 align = pci_region_align(r_end);
     r_end->base = ALIGN_DOWN((pcimem_end - sum), align);
-    sum = pci_region_sum(r_start);
+    sum = pci_region_layout(r_start);
     align = pci_region_align(r_start);
     r_start->base = ALIGN_DOWN((r_end->base - sum), align);
 
@@ -1073,6 +1134,12 @@ pci_region_map_one_entry(struct pci_region_entry *entry, u64 addr)
                 entry->bar, addr, entry->size, region_type_name[entry->type]);
 
         pci_set_io_region_addr(entry->dev, entry->bar, addr, entry->is64);
+        if (entry->type == PCI_REGION_TYPE_PREFMEM
+            && entry->dev->class == PCI_CLASS_DISPLAY_VGA
+            && entry->size > pcifb_end - pcifb_start) {
+            pcifb_start = addr;
+            pcifb_end = addr + entry->size;
+        }
         return;
     }
 
@@ -1101,8 +1168,7 @@ static void pci_region_map_entries(struct pci_bus *busses, struct pci_region *r)
     struct hlist_node *n;
     struct pci_region_entry *entry;
     hlist_for_each_entry_safe(entry, n, &r->list, node) {
-        u64 addr = r->base;
-        r->base += entry->size;
+        u64 addr = r->base + entry->offset;
         if (entry->bar == -1)
             // Update bus base address if entry is a bridge region
             busses[entry->dev->secondary_bus].r[entry->type].base = addr;
@@ -1130,8 +1196,8 @@ static void pci_bios_map_devices(struct pci_bus *busses)
         if (pci_bios_init_root_regions_mem(busses))
             panic("PCI: out of 32bit address space\n");
 
-        u64 sum_mem = pci_region_sum(&r64_mem);
-        u64 sum_pref = pci_region_sum(&r64_pref);
+        u64 sum_mem = pci_region_layout(&r64_mem);
+        u64 sum_pref = pci_region_layout(&r64_pref);
         u64 align_mem = pci_region_align(&r64_mem);
         u64 align_pref = pci_region_align(&r64_pref);
 
@@ -1216,6 +1282,7 @@ pci_setup(void)
     if (pci_probe_host() != 0) {
         return;
     }
+    mch_mmconfig_early_setup();
     pci_bios_init_bus();
 
     dprintf(1, "=== PCI device probing ===\n");
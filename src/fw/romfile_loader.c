@@ -11,6 +11,15 @@
 struct romfile_loader_file {
     struct romfile_s *file;
     void *data;
+    struct hlist_head cksums;
+};
+
+// A range of a file covered by an ADD_CHECKSUM command.  Its byte sum
+// is computed once and then kept up to date as the file is patched.
+struct romfile_loader_cksum {
+    u32 start, len;
+    u8 sum;
+    struct hlist_node node;
 };
 struct romfile_loader_files {
     int nfiles;
@@ -59,7 +68,6 @@ static void romfile_loader_allocate(struct romfile_loader_entry_s *entry,
     struct zone_s *zone;
     struct romfile_loader_file *file = &files->files[files->nfiles];
     void *data;
-    int ret;
     unsigned alloc_align = le32_to_cpu(entry->alloc.align);
 
     if (alloc_align & (alloc_align - 1))
@@ -87,19 +95,82 @@ static void romfile_loader_allocate(struct romfile_loader_entry_s *entry,
         warn_noalloc();
         return;
     }
-    ret = file->file->copy(file->file, data, file->file->size);
-    if (ret != file->file->size)
-        goto file_err;
+    // The file contents are read later by romfile_loader_load()
     file->data = data;
+    file->cksums.first = NULL;
     files->nfiles++;
     return;
 
-file_err:
-    free(data);
 err:
     warn_internalerror();
 }
 
+// Read the contents of all allocated files using a single fw_cfg batch
+static void romfile_loader_load(struct romfile_loader_files *files)
+{
+    struct qemu_cfg_batch_s *batch = qemu_cfg_batch_alloc(files->nfiles);
+    int i, ret = 0;
+    for (i = 0; i < files->nfiles; i++)
+        ret |= qemu_cfg_batch_read_file(batch, files->files[i].file
+                                        , files->files[i].data);
+    ret |= qemu_cfg_batch_run(batch);
+    if (!ret)
+        return;
+
+    // Something failed - reload each file individually to find out what
+    for (i = 0; i < files->nfiles; i++) {
+        struct romfile_loader_file *file = &files->files[i];
+        int len = file->file->copy(file->file, file->data, file->file->size);
+        if (len != file->file->size) {
+            warn_internalerror();
+            free(file->data);
+            file->data = NULL;
+        }
+    }
+}
+
+// Write 'len' bytes at 'offset' of a file, updating the sums of the
+// checksummed ranges that cover them.
+static void romfile_loader_patch(struct romfile_loader_file *file,
+                                 unsigned offset, const void *src, unsigned len)
+{
+    u8 *dest = file->data + offset;
+    struct romfile_loader_cksum *ck;
+    hlist_for_each_entry(ck, &file->cksums, node) {
+        if (offset + len <= ck->start || offset >= ck->start + ck->len)
+            continue;
+        unsigned s = offset > ck->start ? offset : ck->start;
+        unsigned e = offset + len;
+        if (e > ck->start + ck->len)
+            e = ck->start + ck->len;
+        ck->sum += checksum((u8*)src + s - offset, e - s)
+                   - checksum(dest + s - offset, e - s);
+    }
+    memcpy(dest, src, len);
+}
+
+// Find the checksum state of a range - summing it if it is new.
+static struct romfile_loader_cksum *
+romfile_loader_get_cksum(struct romfile_loader_file *file
+                         , unsigned start, unsigned len)
+{
+    struct romfile_loader_cksum *ck;
+    hlist_for_each_entry(ck, &file->cksums, node) {
+        if (ck->start == start && ck->len == len)
+            return ck;
+    }
+    ck = malloc_tmp(sizeof(*ck));
+    if (!ck) {
+        warn_noalloc();
+        return NULL;
+    }
+    ck->start = start;
+    ck->len = len;
+    ck->sum = checksum(file->data + start, len);
+    hlist_add_head(&ck->node, &file->cksums);
+    return ck;
+}
+
 static void romfile_loader_add_pointer(struct romfile_loader_entry_s *entry,
                                        struct romfile_loader_files *files)
 {
@@ -122,7 +193,7 @@ static void romfile_loader_add_pointer(struct romfile_loader_entry_s *entry,
     pointer = le64_to_cpu(pointer);
     pointer += (unsigned long)src_file->data;
     pointer = cpu_to_le64(pointer);
-    memcpy(dest_file->data + offset, &pointer, entry->pointer.size);
+    romfile_loader_patch(dest_file, offset, &pointer, entry->pointer.size);
 
     return;
 err:
@@ -136,7 +207,6 @@ static void romfile_loader_add_checksum(struct romfile_loader_entry_s *entry,
     unsigned offset = le32_to_cpu(entry->cksum.offset);
     unsigned start = le32_to_cpu(entry->cksum.start);
     unsigned len = le32_to_cpu(entry->cksum.length);
-    u8 *data;
 
     file = romfile_loader_find(entry->cksum.file, files);
 
@@ -144,8 +214,13 @@ static void romfile_loader_add_checksum(struct romfile_loader_entry_s *entry,
         start + len < start || start + len > file->file->size)
         goto err;
 
-    data = file->data + offset;
-    *data -= checksum(file->data + start, len);
+    struct romfile_loader_cksum *ck = romfile_loader_get_cksum(file, start, len);
+    if (!ck) {
+        *(u8*)(file->data + offset) -= checksum(file->data + start, len);
+        return;
+    }
+    u8 val = *(u8*)(file->data + offset) - ck->sum;
+    romfile_loader_patch(file, offset, &val, 1);
 
     return;
 err:
@@ -228,12 +303,17 @@ int romfile_loader_execute(const char *name)
     }
     files->nfiles = 0;
 
+    /* Allocate all files first, so their contents can be read together. */
+    for (offset = 0; offset < size; offset += sizeof(*entry)) {
+        entry = data + offset;
+        if (le32_to_cpu(entry->command) == ROMFILE_LOADER_COMMAND_ALLOCATE)
+            romfile_loader_allocate(entry, files);
+    }
+    romfile_loader_load(files);
+
     for (offset = 0; offset < size; offset += sizeof(*entry)) {
         entry = data + offset;
         switch (le32_to_cpu(entry->command)) {
-                case ROMFILE_LOADER_COMMAND_ALLOCATE:
-                        romfile_loader_allocate(entry, files);
-                        break;
                 case ROMFILE_LOADER_COMMAND_ADD_POINTER:
                         romfile_loader_add_pointer(entry, files);
                         break;
@@ -249,6 +329,13 @@ int romfile_loader_execute(const char *name)
         }
     }
 
+    int i;
+    for (i = 0; i < files->nfiles; i++) {
+        struct romfile_loader_cksum *ck;
+        struct hlist_node *n;
+        hlist_for_each_entry_safe(ck, n, &files->files[i].cksums, node)
+            free(ck);
+    }
     free(files);
     free(data);
     return 0;
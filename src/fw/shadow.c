@@ -166,6 +166,28 @@ make_bios_readonly(void)
         make_bios_readonly_intel(ShadowBDF, Q35_HOST_BRIDGE_PAM0);
 }
 
+// Size of the blocks compared against the flash copy on a reboot
+#define REBOOT_BLOCK_SIZE 1024
+
+// Restore the parts of the BIOS image at 'dest' that differ from the
+// pristine copy at 'src'.  Returns the number of blocks rewritten.
+static int
+reboot_restore(void *dest, void *src, u32 len)
+{
+    int copied = 0;
+    while (len) {
+        u32 count = len < REBOOT_BLOCK_SIZE ? len : REBOOT_BLOCK_SIZE;
+        if (memcmp(dest, src, count)) {
+            memcpy(dest, src, count);
+            copied++;
+        }
+        dest += count;
+        src += count;
+        len -= count;
+    }
+    return copied;
+}
+
 void
 qemu_reboot(void)
 {
@@ -185,11 +207,17 @@ qemu_reboot(void)
         make_bios_writable();
         HaveRunPost = 3;
     } else {
-        // Copy the BIOS making sure to only reset HaveRunPost at end
+        // Restore the BIOS making sure to only reset HaveRunPost at end.
+        // Most of the image is unchanged code, so only rewrite the
+        // blocks that no longer match the flash copy.
         make_bios_writable();
         u32 cstart = SYMBOL(code32flat_start), cend = SYMBOL(code32flat_end);
-        memcpy((void*)cstart, flash + cstart, hrp - cstart);
-        memcpy((void*)hrp + 4, flash + hrp + 4, cend - (hrp + 4));
+        int copied = reboot_restore((void*)cstart, flash + cstart
+                                    , hrp - cstart);
+        copied += reboot_restore((void*)hrp + 4, flash + hrp + 4
+                                 , cend - (hrp + 4));
+        dprintf(3, "Restored %d of %d bios blocks\n", copied
+                , DIV_ROUND_UP(cend - cstart, REBOOT_BLOCK_SIZE));
         barrier();
         HaveRunPost = 0;
         barrier();
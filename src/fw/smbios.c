@@ -7,6 +7,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "config.h" // CONFIG_*
+#include "list.h" // hlist_add
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "paravirt.h" // RamSize
@@ -56,16 +57,122 @@ smbios_21_entry_point_setup(u16 max_structure_size,
     copy_smbios_21(&ep);
 }
 
+/****************************************************************
+ * fw_cfg entry index
+ ****************************************************************/
+
+// The legacy "smbios/" fw_cfg entries - these are read from the host
+// once so that building many cpu and memory structures does not
+// repeat the romfile lookups and fw_cfg transfers.
+struct smbios_entry_s {
+    struct hlist_node node;
+    u16 offset;             // Offset within the structure (fields only)
+    u16 size;
+    u8 data[];
+};
+
+struct smbios_index_s {
+    struct hlist_head fields[256];
+    struct hlist_head tables[256];
+    u32 fieldsize[256];     // Total size of the fields of each type
+    u32 tablesize;          // Space needed for all the provided tables
+};
+
+static struct smbios_index_s *SmbiosIndex;
+
+static const char *
+parse_num(const char *cur, int *n)
+{
+    int m = 0;
+    while ('0' <= *cur && *cur <= '9') {
+        m = 10 * m + (*cur - '0');
+        cur++;
+    }
+    *n = m;
+    return cur;
+}
+
+static int
+smbios_load_index(void)
+{
+    struct smbios_index_s *idx = malloc_tmp(sizeof(*idx));
+    if (!idx) {
+        warn_noalloc();
+        return -1;
+    }
+    memset(idx, 0, sizeof(*idx));
+    SmbiosIndex = idx;
+
+    struct romfile_s *file = NULL;
+    for (;;) {
+        file = romfile_findprefix("smbios/", file);
+        if (!file)
+            break;
+        const char *name = file->name + strlen("smbios/");
+        int isfield = memcmp(name, "field", 5) == 0;
+        if (!isfield && memcmp(name, "table", 5) != 0)
+            continue;
+        int type, offset = 0;
+        name = parse_num(name + 5, &type);
+        if (*name != '-' || type > 255 || file->size > 0xffff)
+            continue;
+        if (isfield)
+            parse_num(name + 1, &offset);
+
+        struct smbios_entry_s *e = malloc_tmp(sizeof(*e) + file->size);
+        if (!e) {
+            warn_noalloc();
+            return -1;
+        }
+        e->offset = offset;
+        e->size = file->size;
+        file->copy(file, e->data, file->size);
+        if (isfield) {
+            hlist_add_head(&e->node, &idx->fields[type]);
+            idx->fieldsize[type] += e->size;
+            continue;
+        }
+        // Keep provided tables in their fw_cfg order
+        struct smbios_entry_s *pos;
+        struct hlist_node **pprev;
+        hlist_for_each_entry_pprev(pos, pprev, &idx->tables[type], node)
+            ;
+        hlist_add(&e->node, pprev);
+        idx->tablesize += e->size + 2;
+    }
+    return 0;
+}
+
+static void
+smbios_free_index(void)
+{
+    struct smbios_index_s *idx = SmbiosIndex;
+    if (!idx)
+        return;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(idx->fields); i++) {
+        struct smbios_entry_s *e;
+        struct hlist_node *n;
+        hlist_for_each_entry_safe(e, n, &idx->fields[i], node)
+            free(e);
+        hlist_for_each_entry_safe(e, n, &idx->tables[i], node)
+            free(e);
+    }
+    free(idx);
+    SmbiosIndex = NULL;
+}
+
 static int
 get_field(int type, int offset, void *dest)
 {
-    char name[128];
-    snprintf(name, sizeof(name), "smbios/field%d-%d", type, offset);
-    struct romfile_s *file = romfile_find(name);
-    if (!file)
-        return 0;
-    file->copy(file, dest, file->size);
-    return file->size;
+    struct smbios_entry_s *e;
+    hlist_for_each_entry(e, &SmbiosIndex->fields[type], node) {
+        if (e->offset == offset) {
+            memcpy(dest, e->data, e->size);
+            return e->size;
+        }
+    }
+    return 0;
 }
 
 static int
@@ -83,29 +190,23 @@ get_external(int type, char **p, unsigned *nr_structs,
     if (type == 127)
         return 0;
 
-    char prefix[128];
-    snprintf(prefix, sizeof(prefix), "smbios/table%d-", type);
-    struct romfile_s *file = NULL;
-    for (;;) {
-        file = romfile_findprefix(prefix, file);
-        if (!file)
-            break;
-
-        if (end - *p < file->size) {
+    struct smbios_entry_s *e;
+    hlist_for_each_entry(e, &SmbiosIndex->tables[type], node) {
+        if (end - *p < e->size + 2) {
             warn_noalloc();
             break;
         }
 
         struct smbios_structure_header *header = (void*)*p;
-        file->copy(file, header, file->size);
-        *p += file->size;
+        memcpy(header, e->data, e->size);
+        *p += e->size;
 
         /* Entries end with a double NULL char, if there's a string at
          * the end (length is greater than formatted length), the string
          * terminator provides the first NULL. */
         *((u8*)*p) = 0;
         (*p)++;
-        if (header->length >= file->size) {
+        if (header->length >= e->size) {
             *((u8*)*p) = 0;
             (*p)++;
         }
@@ -505,7 +606,17 @@ smbios_init_type_127(void *start)
     return start + 2;
 }
 
-#define TEMPSMBIOSSIZE (32 * 1024)
+// Room for the strings a generated structure adds beyond its fields
+// (defaults and the cpu / dimm numbers).
+#define SMBIOS_STRING_SLACK 64
+
+// Upper bound on the space needed for 'count' generated structures
+static u32
+smbios_generated_size(int type, u32 size, u32 count)
+{
+    return count * (size + SmbiosIndex->fieldsize[type]
+                    + SMBIOS_STRING_SLACK + 2);
+}
 
 void
 smbios_legacy_setup(void)
@@ -515,16 +626,44 @@ smbios_legacy_setup(void)
 
     dprintf(3, "init SMBIOS tables\n");
 
-    char *start = malloc_tmphigh(TEMPSMBIOSSIZE);
+    if (smbios_load_index() < 0) {
+        smbios_free_index();
+        return;
+    }
+
+    // Size the table up front from the host entries and the number of
+    // cpu and memory structures.
+    int ram_mb = (RamSize + RamSizeOver4G) >> 20;
+    int nr_mem_devs = (ram_mb + 0x3fff) >> 14;
+    u32 tempsize = (SmbiosIndex->tablesize
+                    + smbios_generated_size(0, sizeof(struct smbios_type_0), 1)
+                    + smbios_generated_size(1, sizeof(struct smbios_type_1), 1)
+                    + smbios_generated_size(3, sizeof(struct smbios_type_3), 1)
+                    + smbios_generated_size(4, sizeof(struct smbios_type_4)
+                                            , MaxCountCPUs)
+                    + smbios_generated_size(16, sizeof(struct smbios_type_16)
+                                            , 1)
+                    + smbios_generated_size(17, sizeof(struct smbios_type_17)
+                                            , nr_mem_devs)
+                    + smbios_generated_size(19, sizeof(struct smbios_type_19)
+                                            , 2)
+                    + smbios_generated_size(20, sizeof(struct smbios_type_20)
+                                            , nr_mem_devs + 1)
+                    + smbios_generated_size(32, sizeof(struct smbios_type_32)
+                                            , 1)
+                    + sizeof(struct smbios_type_127) + 2);
+
+    char *start = malloc_tmphigh(tempsize);
     if (! start) {
         warn_noalloc();
+        smbios_free_index();
         return;
     }
-    memset(start, 0, TEMPSMBIOSSIZE);
+    memset(start, 0, tempsize);
 
     u32 nr_structs = 0, max_struct_size = 0;
     char *q, *p = start;
-    char *end = start + TEMPSMBIOSSIZE - sizeof(struct smbios_type_127);
+    char *end = start + tempsize - sizeof(struct smbios_type_127);
 
 #define add_struct(type, args...)                                       \
     do {                                                                \
@@ -545,8 +684,6 @@ smbios_legacy_setup(void)
     for (cpu_num = 1; cpu_num <= MaxCountCPUs; cpu_num++)
         add_struct(4, p, cpu_num);
 
-    int ram_mb = (RamSize + RamSizeOver4G) >> 20;
-    int nr_mem_devs = (ram_mb + 0x3fff) >> 14;
     add_struct(16, p, ram_mb, nr_mem_devs);
 
     int i, j;
@@ -586,4 +723,5 @@ smbios_legacy_setup(void)
 
     smbios_21_entry_point_setup(max_struct_size, p - start, start, nr_structs);
     free(start);
+    smbios_free_index();
 }
@@ -23,21 +23,32 @@
 #define MSR_IA32_APIC_BASE 0x01B
 #define MSR_LOCAL_APIC_ID 0x802
 #define MSR_IA32_APICBASE_EXTD (1ULL << 10) /* Enable x2APIC mode */
+#define MSR_X2APIC_SVR   0x80F
+#define MSR_X2APIC_ICR   0x830
+#define MSR_X2APIC_LINT0 0x835
+#define MSR_X2APIC_LINT1 0x836
 
-static struct { u32 index; u64 val; } smp_msr[32];
-static u32 smp_msr_count;
+// MSRs to replay on the APs.  The APs program these from entry_smp
+// (romlayout.S) before taking the shared stack lock, so that all APs
+// write their MSRs in parallel.  The assembler depends on this layout.
+struct smp_msr_s {
+    u32 index;
+    u64 val;
+} PACKED;
+struct smp_msr_s SMPMsr[32] __VISIBLE;
+u32 SMPMsrCount __VISIBLE;
 
 void
 wrmsr_smp(u32 index, u64 val)
 {
     wrmsr(index, val);
-    if (smp_msr_count >= ARRAY_SIZE(smp_msr)) {
+    if (SMPMsrCount >= ARRAY_SIZE(SMPMsr)) {
         warn_noalloc();
         return;
     }
-    smp_msr[smp_msr_count].index = index;
-    smp_msr[smp_msr_count].val = val;
-    smp_msr_count++;
+    SMPMsr[SMPMsrCount].index = index;
+    SMPMsr[SMPMsrCount].val = val;
+    SMPMsrCount++;
 }
 
 static void
@@ -45,41 +56,114 @@ smp_write_msrs(void)
 {
     // MTRR and MSR_IA32_FEATURE_CONTROL setup
     int i;
-    for (i=0; i<smp_msr_count; i++)
-        wrmsr(smp_msr[i].index, smp_msr[i].val);
+    for (i=0; i<SMPMsrCount; i++)
+        wrmsr(SMPMsr[i].index, SMPMsr[i].val);
 }
 
 u32 MaxCountCPUs;
 static u32 CountCPUs;
 // 256 bits for the found APIC IDs
 static u32 FoundAPICIDs[256/32];
+// Set when the apic ids don't fit the 8 bits of xAPIC mode
+static int X2APICMode;
 
 int apic_id_is_present(u8 apic_id)
 {
     return !!(FoundAPICIDs[apic_id/32] & (1ul << (apic_id % 32)));
 }
 
+// Read the x2APIC id of this cpu and the apic id bits below the
+// package level from the cpuid topology leaf (0x1f or 0xb).
+static int
+cpuid_topology(u32 *x2apic_id, u32 *pkg_shift, u32 *pkg_cpus)
+{
+    u32 eax, ebx, ecx, edx, max_leaf;
+    cpuid(0, &max_leaf, &ebx, &ecx, &edx);
+    if (max_leaf < 0xb)
+        return -1;
+    u32 leaf = 0xb;
+    if (max_leaf >= 0x1f) {
+        __cpuid_count(0x1f, 0, &eax, &ebx, &ecx, &edx);
+        if (ecx & 0xff00)
+            leaf = 0x1f;
+    }
+    int level;
+    for (level = 0; level < 8; level++) {
+        __cpuid_count(leaf, level, &eax, &ebx, &ecx, &edx);
+        if (!(ecx & 0xff00))
+            // Invalid level type - the previous one was the last
+            break;
+        *pkg_shift = eax & 0x1f;
+        *pkg_cpus = ebx & 0xffff;
+        *x2apic_id = edx;
+    }
+    return level ? 0 : -1;
+}
+
+// Check if the apic ids of the cpus may not fit in 8 bits (the
+// xAPIC broadcast id 0xff excluded).
+static int
+smp_need_x2apic(void)
+{
+    if (MaxCountCPUs >= 256)
+        return 1;
+    u32 x2apic_id, pkg_shift, pkg_cpus;
+    if (cpuid_topology(&x2apic_id, &pkg_shift, &pkg_cpus) || !pkg_cpus)
+        return 0;
+    u32 packages = DIV_ROUND_UP(MaxCountCPUs, pkg_cpus);
+    u64 max_apic_id = ((u64)packages << pkg_shift) - 1;
+    return max_apic_id >= 0xff;
+}
+
+static void
+x2apic_enable(void)
+{
+    u64 apic_base = rdmsr(MSR_IA32_APIC_BASE);
+    if (!(apic_base & MSR_IA32_APICBASE_EXTD))
+        wrmsr(MSR_IA32_APIC_BASE, apic_base | MSR_IA32_APICBASE_EXTD);
+}
+
 static int
 apic_id_init(void)
 {
     u32 eax, ebx, ecx, cpuid_features;
     cpuid(1, &eax, &ebx, &ecx, &cpuid_features);
     u32 apic_id = ebx>>24;
-    if (MaxCountCPUs < 256) { // xAPIC mode
-        // Track found apic id for use in legacy internal bios tables
-        FoundAPICIDs[apic_id/32] |= 1 << (apic_id % 32);
-    } else if (ecx & CPUID_X2APIC) {
+    if (X2APICMode) {
         // switch to x2APIC mode
-        u64 apic_base = rdmsr(MSR_IA32_APIC_BASE);
-        wrmsr(MSR_IA32_APIC_BASE, apic_base | MSR_IA32_APICBASE_EXTD);
-        apic_id = rdmsr(MSR_LOCAL_APIC_ID);
-    } else {
+        x2apic_enable();
+        u32 pkg_shift, pkg_cpus;
+        if (cpuid_topology(&apic_id, &pkg_shift, &pkg_cpus))
+            apic_id = rdmsr(MSR_LOCAL_APIC_ID);
+    } else if (MaxCountCPUs >= 256) {
         // x2APIC is masked by CPUID
-        apic_id = -1;
+        return -1;
     }
+    if (apic_id < 256)
+        // Track found apic id for use in legacy internal bios tables
+        FoundAPICIDs[apic_id/32] |= 1 << (apic_id % 32);
     return apic_id;
 }
 
+// Atomic lock for shared stack across processors.
+u32 SMPLock __VISIBLE;
+u32 SMPStack __VISIBLE;
+
+// Stacks for processors that serve threads (see ap_thread_worker).
+#define SMP_MAX_THREADS 16
+static void *SMPThreadStack[SMP_MAX_THREADS];
+static u32 SMPThreadCount, SMPThreadStarted, SMPThreadParked;
+static void (*SMPThreadEntry)(void);
+
+// Entry point of a thread serving processor (on its private stack).
+static void
+smp_thread_main(void)
+{
+    // Done with the shared stack - let the next processor have it.
+    writel(&SMPLock, 0);
+    ap_thread_worker();
+}
+
 void VISIBLE32FLAT
 handle_smp(void)
 {
@@ -90,14 +174,24 @@ handle_smp(void)
     int apic_id = apic_id_init();
     dprintf(DEBUG_HDL_smp, "handle_smp: apic_id=0x%x\n", apic_id);
 
-    smp_write_msrs();
-
     CountCPUs++;
-}
 
-// Atomic lock for shared stack across processors.
-u32 SMPLock __VISIBLE;
-u32 SMPStack __VISIBLE;
+    if (!SMPThreadEntry || !SMPThreadCount)
+        return;
+    // Switch to a private stack and serve threads.  The stack is
+    // freed at boot, so park the cpu in the f-segment afterwards.
+    void *stack = SMPThreadStack[--SMPThreadCount];
+    SMPThreadStarted++;
+    asm volatile(
+        "  movl %1, %%esp\n"
+        "  calll *%2\n"
+        "  lock incl %0\n"
+        "1:cli ; hlt\n"
+        "  jmp 1b\n"
+        : "+m"(SMPThreadParked)
+        : "r"(stack), "r"(SMPThreadEntry)
+        : "memory");
+}
 
 // find and initialize the CPUs by launching a SIPI to them
 static void
@@ -124,32 +218,49 @@ smp_scan(void)
                | (((u32)entry_smp - BUILD_BIOS_ADDR) << 8));
     *(u64*)BUILD_AP_BOOT_ADDR = new;
 
-    // enable local APIC
-    u32 val = readl(APIC_SVR);
-    writel(APIC_SVR, val | APIC_ENABLED);
+    // Use x2APIC mode (and its msr interface) if the apic ids need it
+    X2APICMode = (ecx & CPUID_X2APIC) && smp_need_x2apic();
+    if (X2APICMode) {
+        x2apic_enable();
+        wrmsr(MSR_X2APIC_SVR, rdmsr(MSR_X2APIC_SVR) | APIC_ENABLED);
+        wrmsr(MSR_X2APIC_LINT0, 0x8700);
+        wrmsr(MSR_X2APIC_LINT1, 0x8400);
+    } else {
+        // enable local APIC
+        u32 val = readl(APIC_SVR);
+        writel(APIC_SVR, val | APIC_ENABLED);
 
-    /* Set LINT0 as Ext_INT, level triggered */
-    writel(APIC_LINT0, 0x8700);
+        /* Set LINT0 as Ext_INT, level triggered */
+        writel(APIC_LINT0, 0x8700);
 
-    /* Set LINT1 as NMI, level triggered */
-    writel(APIC_LINT1, 0x8400);
+        /* Set LINT1 as NMI, level triggered */
+        writel(APIC_LINT1, 0x8400);
+    }
 
     // Init the lock.
     writel(&SMPLock, 1);
 
-    // broadcast SIPI
+    // broadcast SIPI (unless there are no APs to start)
+    u16 expected_cpus_count = qemu_get_present_cpus_count();
     barrier();
-    writel(APIC_ICR_LOW, 0x000C4500);
-    u32 sipi_vector = BUILD_AP_BOOT_ADDR >> 12;
-    writel(APIC_ICR_LOW, 0x000C4600 | sipi_vector);
+    if (expected_cpus_count > 1) {
+        u32 sipi_vector = BUILD_AP_BOOT_ADDR >> 12;
+        if (X2APICMode) {
+            // A single msr write per IPI (no delivery status to poll)
+            wrmsr(MSR_X2APIC_ICR, 0x000C4500);
+            wrmsr(MSR_X2APIC_ICR, 0x000C4600 | sipi_vector);
+        } else {
+            writel(APIC_ICR_LOW, 0x000C4500);
+            writel(APIC_ICR_LOW, 0x000C4600 | sipi_vector);
+        }
+    }
 
-    // switch to x2APIC mode after sending SIPI so that
-    // x2APIC and xAPIC mode could share AP wake up code
+    // The APs start in xAPIC mode and switch to x2APIC mode (if in
+    // use) in apic_id_init(), so both modes share the wake up code.
     apic_id_init();
 
     // Wait for other CPUs to process the SIPI.
-    u16 expected_cpus_count = qemu_get_present_cpus_count();
-    while (expected_cpus_count != CountCPUs)
+    while (expected_cpus_count > CountCPUs)
         asm volatile(
             // Release lock and allow other processors to use the stack.
             "  movl %%esp, %1\n"
@@ -180,7 +291,38 @@ smp_setup(void)
     if (MaxCountCPUs < smp_count)
         MaxCountCPUs = smp_count;
 
+    // Optionally keep the application processors running hardware
+    // init threads instead of halting them.
+    if (smp_count > 1 && romfile_loadint("etc/smp-threads", 0)
+        && ap_threads_start()) {
+        while (SMPThreadCount < smp_count - 1
+               && SMPThreadCount < ARRAY_SIZE(SMPThreadStack)) {
+            void *stack = ap_thread_stack();
+            if (!stack)
+                break;
+            SMPThreadStack[SMPThreadCount++] = stack;
+        }
+        SMPThreadEntry = smp_thread_main;
+    }
+
     smp_scan();
+
+    if (SMPThreadEntry)
+        dprintf(1, "Running threads on %d application processor(s)\n"
+                , SMPThreadStarted);
+}
+
+// Halt the thread serving processors before their stacks are freed.
+void
+smp_prepboot(void)
+{
+    if (!CONFIG_QEMU || !SMPThreadEntry)
+        return;
+    ap_threads_stop();
+    while (*(volatile u32*)&SMPThreadParked != SMPThreadStarted)
+        cpu_relax();
+    SMPThreadEntry = NULL;
+    SMPThreadCount = 0;
 }
 
 void
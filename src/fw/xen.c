@@ -142,9 +142,15 @@ void xen_biostable_setup(void)
         panic("Xen info corrupted\n");
 
     tables = (void*)info->tables;
-    dprintf(1, "xen: copy BIOS tables...\n");
-    for (i=0; i<info->tables_nr; i++)
-        copy_table(tables[i]);
+    if (CONFIG_XEN_LINK_TABLES) {
+        dprintf(1, "xen: link BIOS tables...\n");
+        for (i=0; i<info->tables_nr; i++)
+            link_table(tables[i]);
+    } else {
+        dprintf(1, "xen: copy BIOS tables...\n");
+        for (i=0; i<info->tables_nr; i++)
+            copy_table(tables[i]);
+    }
 
     find_acpi_features();
 }
@@ -161,6 +167,8 @@ void xen_ramsize_preinit(void)
     dprintf(1, "xen: copy e820...\n");
 
     e820 = (struct e820entry *)info->e820;
+    if (!e820_load(e820, info->e820_nr))
+        return;
     for (i = 0; i < info->e820_nr; i++) {
         struct e820entry *e = &e820[i];
         e820_add(e->start, e->size, e->type);
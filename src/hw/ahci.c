@@ -14,7 +14,7 @@
 #include "pcidevice.h" // foreachpci
 #include "pci_ids.h" // PCI_CLASS_STORAGE_OTHER
 #include "pci_regs.h" // PCI_INTERRUPT_LINE
-#include "stacks.h" // yield
+#include "stacks.h" // wait_completion
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
 #include "util.h" // timer_calc
@@ -24,6 +24,13 @@
 #define AHCI_RESET_TIMEOUT     500 // 500 miliseconds
 #define AHCI_LINK_TIMEOUT       10 // 10 miliseconds
 
+#define AHCI_CMD_SIZE          256 // size of one command table
+#define AHCI_PRD_MAX     (4*1024*1024) // max bytes per prd entry
+#define AHCI_PRD_COUNT ((AHCI_CMD_SIZE - sizeof(struct ahci_cmd_s))     \
+                        / sizeof(((struct ahci_cmd_s*)0)->prdt[0]))
+#define AHCI_NCQ_SLOTS           8 // max NCQ commands in flight per port
+#define AHCI_NCQ_CHUNK          32 // sectors per NCQ command
+
 // prepare sata command fis
 static void sata_prep_simple(struct sata_cmd_fis *fis, u8 command)
 {
@@ -60,6 +67,26 @@ static void sata_prep_readwrite(struct sata_cmd_fis *fis,
     fis->device       = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 }
 
+static void sata_prep_ncq(struct sata_cmd_fis *fis, u64 lba, u16 count,
+                          u8 tag, int iswrite)
+{
+    memset_fl(fis, 0, sizeof(*fis));
+    fis->reg           = 0x27;
+    fis->pmp_type      = 1 << 7; /* cmd fis */
+    fis->command       = (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED
+                          : ATA_CMD_READ_FPDMA_QUEUED);
+    fis->feature       = count;
+    fis->feature2      = count >> 8;
+    fis->sector_count  = tag << 3;
+    fis->lba_low       = lba;
+    fis->lba_mid       = lba >> 8;
+    fis->lba_high      = lba >> 16;
+    fis->lba_low2      = lba >> 24;
+    fis->lba_mid2      = lba >> 32;
+    fis->lba_high2     = lba >> 40;
+    fis->device        = ATA_CB_DH_LBA;
+}
+
 static void sata_prep_atapi(struct sata_cmd_fis *fis, u16 blocksize)
 {
     memset_fl(fis, 0, sizeof(*fis));
@@ -100,11 +127,109 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
+// State for polling a port for command completion
+struct ahci_wait_s {
+    struct ahci_ctrl_s *ctrl;
+    struct ahci_fis_s *fis;
+    u32 pnr;
+    u32 intbits, status, error;
+};
+
+// Check a port's interrupt status for the end of a command
+static int ahci_command_done(void *data)
+{
+    struct ahci_wait_s *w = data;
+    u32 intbits = ahci_port_readl(w->ctrl, w->pnr, PORT_IRQ_STAT);
+    if (!intbits)
+        return 0;
+    ahci_port_writel(w->ctrl, w->pnr, PORT_IRQ_STAT, intbits);
+    w->intbits = intbits;
+    if (intbits & 0x40000000) {
+        u32 tf = ahci_port_readl(w->ctrl, w->pnr, PORT_TFDATA);
+        w->status = tf & 0xff;
+        w->error = (tf & 0xff00) >> 8;
+        return 1;
+    }
+    if (intbits & 0x02) {
+        w->status = GET_LOWFLAT(w->fis->psfis[2]);
+        w->error  = GET_LOWFLAT(w->fis->psfis[3]);
+        return 1;
+    }
+    if (intbits & 0x01) {
+        w->status = GET_LOWFLAT(w->fis->rfis[2]);
+        w->error  = GET_LOWFLAT(w->fis->rfis[3]);
+        return 1;
+    }
+    return 0;
+}
+
+// error recovery (AHCI 1.3 section 6.2.2.1)
+static void ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr)
+{
+    u32 val;
+
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
+        dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+        mdelay (1);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+}
+
+// Describe a buffer in a command's prd table - returns number of entries
+static u32 ahci_fill_prdt(struct ahci_cmd_s *cmd, void *buffer, u32 bsize)
+{
+    u32 base = (u32)buffer, i;
+    if (!bsize)
+        return 0;
+    for (i = 0; i < AHCI_PRD_COUNT; i++) {
+        u32 len = bsize < AHCI_PRD_MAX ? bsize : AHCI_PRD_MAX;
+        cmd->prdt[i].base  = base;
+        cmd->prdt[i].baseu = 0;
+        cmd->prdt[i].flags = len - 1;
+        base += len;
+        bsize -= len;
+        if (!bsize)
+            return i + 1;
+    }
+    warn_internalerror();
+    return i;
+}
+
 // submit ahci command + wait for result
 static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
                         void *buffer, u32 bsize)
 {
-    u32 val, status, success, flags, intbits, error;
+    u32 status, success, flags, intbits, error;
     struct ahci_ctrl_s *ctrl = port_gf->ctrl;
     struct ahci_cmd_s  *cmd  = port_gf->cmd;
     struct ahci_fis_s  *fis  = port_gf->fis;
@@ -113,11 +238,9 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
 
     cmd->fis.reg       = 0x27;
     cmd->fis.pmp_type  = 1 << 7; /* cmd fis */
-    cmd->prdt[0].base  = (u32)buffer;
-    cmd->prdt[0].baseu = 0;
-    cmd->prdt[0].flags = bsize-1;
+    u32 prds = ahci_fill_prdt(cmd, buffer, bsize);
 
-    flags = ((1 << 16) | /* one prd entry */
+    flags = ((prds << 16) | /* prd table length */
              (iswrite ? (1 << 6) : 0) |
              (isatapi ? (1 << 5) : 0) |
              (5 << 0)); /* fis length (dwords) */
@@ -132,35 +255,13 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
         ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
     ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, 1);
 
-    u32 end = timer_calc(AHCI_REQUEST_TIMEOUT);
+    struct ahci_wait_s w = { .ctrl = ctrl, .fis = fis, .pnr = pnr };
     do {
-        for (;;) {
-            intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-            if (intbits) {
-                ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
-                if (intbits & 0x40000000) {
-                    u32 tf = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-                    status = tf & 0xff;
-                    error = (tf & 0xff00) >> 8;
-                    break;
-                }
-                if (intbits & 0x02) {
-                    status = GET_LOWFLAT(fis->psfis[2]);
-                    error  = GET_LOWFLAT(fis->psfis[3]);
-                    break;
-                }
-                if (intbits & 0x01) {
-                    status = GET_LOWFLAT(fis->rfis[2]);
-                    error  = GET_LOWFLAT(fis->rfis[3]);
-                    break;
-                }
-            }
-            if (timer_check(end)) {
-                warn_timeout();
-                return -1;
-            }
-            yield();
-        }
+        if (wait_completion(ahci_command_done, &w, AHCI_REQUEST_TIMEOUT))
+            return -1;
+        intbits = w.intbits;
+        status = w.status;
+        error = w.error;
         dprintf(8, "AHCI/%d: ... intbits 0x%x, status 0x%x ...\n",
                 pnr, intbits, status);
     } while (status & ATA_CB_STAT_BSY);
@@ -175,42 +276,7 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
 
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
-
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
-
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
-
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
-
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
-        }
-
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        ahci_port_recover(ctrl, pnr);
     }
     return success ? 0 : -1;
 }
@@ -257,45 +323,268 @@ ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
     return DISK_RET_SUCCESS;
 }
 
+// State for polling a port for the end of a batch of NCQ commands
+struct ahci_ncq_wait_s {
+    struct ahci_ctrl_s *ctrl;
+    u32 pnr;
+    u32 mask;
+};
+
+// Check if all queued commands in a batch have completed
+static int ahci_ncq_done(void *data)
+{
+    struct ahci_ncq_wait_s *w = data;
+    u32 intbits = ahci_port_readl(w->ctrl, w->pnr, PORT_IRQ_STAT);
+    if (intbits & PORT_IRQ_ERROR)
+        return -1;
+    if (ahci_port_readl(w->ctrl, w->pnr, PORT_SCR_ACT) & w->mask)
+        return 0;
+    if (ahci_port_readl(w->ctrl, w->pnr, PORT_CMD_ISSUE) & w->mask)
+        return 0;
+    return 1;
+}
+
+// Recover from a failed NCQ command.  The device aborts all
+// outstanding commands and refuses new ones until the NCQ command
+// error log is read.
+static void ahci_ncq_recover(struct ahci_port_s *port_gf)
+{
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr;
+    u32 tf = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    dprintf(2, "AHCI/%d: NCQ error, status 0x%x, ERROR 0x%x\n", pnr,
+            tf & 0xff, (tf & 0xff00) >> 8);
+
+    ahci_port_recover(ctrl, pnr);
+
+    struct ahci_cmd_s *cmd = port_gf->cmd;
+    sata_prep_simple(&cmd->fis, ATA_CMD_READ_LOG_EXT);
+    cmd->fis.lba_low = 0x10; // NCQ command error log
+    cmd->fis.sector_count = 1;
+    cmd->fis.device = ATA_CB_DH_LBA;
+    u32 size;
+    u8 *buf = bounce_buf_get(&size);
+    if (!buf)
+        return;
+    ahci_command(port_gf, 0, 0, buf, DISK_SECTOR_SIZE);
+    bounce_buf_put(buf);
+}
+
+// read/write count blocks using native command queuing, spreading
+// the request over the port's command slots.  op->buf_fl must be
+// word aligned.
+static int
+ahci_disk_readwrite_ncq(struct disk_op_s *op, int iswrite)
+{
+    struct ahci_port_s *port_gf = container_of(
+        op->drive_fl, struct ahci_port_s, drive);
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    struct ahci_list_s *list = port_gf->list;
+    u32 pnr = port_gf->pnr, slots = port_gf->slots;
+    u64 lba = op->lba;
+    u8 *buf = op->buf_fl;
+    u32 remaining = op->count;
+
+    while (remaining) {
+        u32 intbits, mask = 0, slot;
+        for (slot = 0; slot < slots && remaining; slot++) {
+            u32 count = remaining;
+            if (count > AHCI_NCQ_CHUNK)
+                count = AHCI_NCQ_CHUNK;
+            struct ahci_cmd_s *cmd = (void*)port_gf->cmd + slot * AHCI_CMD_SIZE;
+            sata_prep_ncq(&cmd->fis, lba, count, slot, iswrite);
+            u32 prds = ahci_fill_prdt(cmd, buf, count * DISK_SECTOR_SIZE);
+
+            list[slot].flags = ((prds << 16) | /* prd table length */
+                                (iswrite ? AHCI_CMD_WRITE : 0) |
+                                (5 << 0)); /* fis length (dwords) */
+            list[slot].bytes = 0;
+            list[slot].base  = (u32)cmd;
+            list[slot].baseu = 0;
+
+            mask |= 1 << slot;
+            lba += count;
+            buf += count * DISK_SECTOR_SIZE;
+            remaining -= count;
+        }
+
+        dprintf(8, "AHCI/%d: send ncq cmds 0x%x ...\n", pnr, mask);
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, mask);
+        ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, mask);
+
+        struct ahci_ncq_wait_s w = { .ctrl = ctrl, .pnr = pnr, .mask = mask };
+        int rc = wait_completion(ahci_ncq_done, &w, AHCI_REQUEST_TIMEOUT);
+        if (rc) {
+            ahci_ncq_recover(port_gf);
+            return DISK_RET_EBADTRACK;
+        }
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    }
+    dprintf(8, "ahci disk ncq %s, lba %6x, count %3x, buf %p\n",
+            iswrite ? "write" : "read", (u32)op->lba, op->count, op->buf_fl);
+    return DISK_RET_SUCCESS;
+}
+
 // read/write count blocks from a harddrive.
 static int
 ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
 {
     // if caller's buffer is word aligned, use it directly
-    if (((u32) op->buf_fl & 1) == 0)
+    if (((u32) op->buf_fl & 1) == 0) {
+        struct ahci_port_s *port_gf = container_of(
+            op->drive_fl, struct ahci_port_s, drive);
+        if (port_gf->slots && op->count > AHCI_NCQ_CHUNK)
+            return ahci_disk_readwrite_ncq(op, iswrite);
         return ahci_disk_readwrite_aligned(op, iswrite);
+    }
 
-    // Use a word aligned buffer for AHCI I/O
-    int rc;
+    // Use a word aligned buffer for AHCI I/O, as many sectors at a
+    // time as a bounce buffer holds
+    int rc = DISK_RET_SUCCESS;
     struct disk_op_s localop = *op;
-    u8 *alignedbuf_fl = bounce_buf_fl;
+    u32 size;
+    u8 *alignedbuf_fl = bounce_buf_get(&size);
     u8 *position = op->buf_fl;
+    u16 remaining = op->count;
+    if (!alignedbuf_fl)
+        return DISK_RET_EBADTRACK;
 
     localop.buf_fl = alignedbuf_fl;
-    localop.count = 1;
-
-    if (iswrite) {
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            memcpy_fl (alignedbuf_fl, position, DISK_SECTOR_SIZE);
-            rc = ahci_disk_readwrite_aligned (&localop, 1);
-            if (rc)
-                return rc;
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    } else { // read
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            rc = ahci_disk_readwrite_aligned (&localop, 0);
-            if (rc)
-                return rc;
-            memcpy_fl (position, alignedbuf_fl, DISK_SECTOR_SIZE);
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
+    while (remaining) {
+        u16 count = size / DISK_SECTOR_SIZE;
+        if (count > remaining)
+            count = remaining;
+        u32 bytes = count * DISK_SECTOR_SIZE;
+        localop.count = count;
+        if (iswrite)
+            memcpy_fl(alignedbuf_fl, position, bytes);
+        rc = ahci_disk_readwrite_aligned(&localop, iswrite);
+        if (rc)
+            break;
+        if (!iswrite)
+            memcpy_fl(position, alignedbuf_fl, bytes);
+        position += bytes;
+        localop.lba += count;
+        remaining -= count;
     }
-    return DISK_RET_SUCCESS;
+    bounce_buf_put(alignedbuf_fl);
+    return rc;
+}
+
+// Requests started with disk_submit() (indexed by command slot)
+struct ahci_ncq_s {
+    struct disk_req_s *reqs[AHCI_NCQ_SLOTS];
+    u32 busy;
+    int count;
+};
+
+// Start a request submitted with disk_submit() in a free NCQ slot
+static int
+ahci_async_submit(struct disk_req_s *req)
+{
+    struct disk_op_s *op = &req->op;
+    struct ahci_port_s *port_gf = container_of(
+        op->drive_fl, struct ahci_port_s, drive);
+    struct ahci_ncq_s *ncq = port_gf->ncq;
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr;
+    u32 bytes = op->count * DISK_SECTOR_SIZE;
+    int iswrite = op->command == CMD_WRITE;
+
+    if (((u32)op->buf_fl & 1) || bytes > AHCI_PRD_COUNT * AHCI_PRD_MAX)
+        return DISK_QUEUE_SYNC;
+    u32 idle = ~ncq->busy & ((1 << port_gf->slots) - 1);
+    if (!idle)
+        return DISK_QUEUE_FULL;
+
+    int slot = __ffs(idle);
+    struct ahci_cmd_s *cmd = (void*)port_gf->cmd + slot * AHCI_CMD_SIZE;
+    sata_prep_ncq(&cmd->fis, op->lba, op->count, slot, iswrite);
+    u32 prds = ahci_fill_prdt(cmd, op->buf_fl, bytes);
+    struct ahci_list_s *list = &port_gf->list[slot];
+    list->flags = ((prds << 16) | /* prd table length */
+                   (iswrite ? AHCI_CMD_WRITE : 0) |
+                   (5 << 0)); /* fis length (dwords) */
+    list->bytes = 0;
+    list->base  = (u32)cmd;
+    list->baseu = 0;
+
+    if (!ncq->busy) {
+        // Nothing in flight - drop stale status from earlier commands
+        u32 intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    }
+    ncq->reqs[slot] = req;
+    ncq->busy |= 1 << slot;
+    ncq->count++;
+    dprintf(8, "AHCI/%d: submit ncq slot %d, lba %6x, count %3x\n", pnr
+            , slot, (u32)op->lba, op->count);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, 1 << slot);
+    ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, 1 << slot);
+    return DISK_QUEUE_STARTED;
+}
+
+// Complete finished requests that were started by ahci_async_submit()
+static int
+ahci_async_poll(struct drive_s *drive_fl)
+{
+    struct ahci_port_s *port_gf = container_of(
+        drive_fl, struct ahci_port_s, drive);
+    struct ahci_ncq_s *ncq = port_gf->ncq;
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr;
+    if (!ncq->busy)
+        return 0;
+
+    u32 done, status = DISK_RET_SUCCESS;
+    u32 intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    if (intbits & PORT_IRQ_ERROR) {
+        // The device aborted every outstanding command
+        ahci_ncq_recover(port_gf);
+        done = ncq->busy;
+        status = DISK_RET_EBADTRACK;
+    } else {
+        u32 active = (ahci_port_readl(ctrl, pnr, PORT_SCR_ACT)
+                      | ahci_port_readl(ctrl, pnr, PORT_CMD_ISSUE));
+        done = ncq->busy & ~active;
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    }
+    while (done) {
+        int slot = __ffs(done);
+        done &= ~(1 << slot);
+        ncq->busy &= ~(1 << slot);
+        ncq->count--;
+        disk_req_done(ncq->reqs[slot], status);
+    }
+    return ncq->count;
+}
+
+static const struct disk_async_s ahci_async = {
+    .submit = ahci_async_submit,
+    .poll = ahci_async_poll,
+};
+
+// Enable disk_submit() support on a port that uses NCQ
+static void
+ahci_async_setup(struct ahci_port_s *port)
+{
+    if (!port->slots)
+        return;
+    port->ncq = malloc_high(sizeof(*port->ncq));
+    if (!port->ncq) {
+        warn_noalloc();
+        return;
+    }
+    memset(port->ncq, 0, sizeof(*port->ncq));
+    port->drive.async = &ahci_async;
+    port->drive.queue_depth = port->slots;
 }
 
 // command demuxer
@@ -304,6 +593,8 @@ ahci_process_op(struct disk_op_s *op)
 {
     if (!CONFIG_AHCI)
         return 0;
+    // The synchronous path reuses the command slots of disk_submit()
+    disk_drain(op->drive_fl);
     switch (op->command) {
     case CMD_READ:
         return ahci_disk_readwrite(op, 0);
@@ -342,6 +633,12 @@ ahci_port_reset(struct ahci_ctrl_s *ctrl, u32 pnr)
         ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
 }
 
+// Size of the command table area - one table per command slot
+static u32 ahci_port_cmd_size(struct ahci_port_s *port)
+{
+    return (port->slots ? port->slots : 1) * AHCI_CMD_SIZE;
+}
+
 static struct ahci_port_s*
 ahci_port_alloc(struct ahci_ctrl_s *ctrl, u32 pnr)
 {
@@ -356,14 +653,14 @@ ahci_port_alloc(struct ahci_ctrl_s *ctrl, u32 pnr)
     port->ctrl = ctrl;
     port->list = memalign_tmp(1024, 1024);
     port->fis = memalign_tmp(256, 256);
-    port->cmd = memalign_tmp(256, 256);
+    port->cmd = memalign_tmp(256, ahci_port_cmd_size(port));
     if (port->list == NULL || port->fis == NULL || port->cmd == NULL) {
         warn_noalloc();
         return NULL;
     }
     memset(port->list, 0, 1024);
     memset(port->fis, 0, 256);
-    memset(port->cmd, 0, 256);
+    memset(port->cmd, 0, ahci_port_cmd_size(port));
 
     ahci_port_writel(ctrl, pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(ctrl, pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -406,7 +703,7 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
     free(port->cmd);
     port->list = memalign_high(1024, 1024);
     port->fis = memalign_high(256, 256);
-    port->cmd = memalign_high(256, 256);
+    port->cmd = memalign_high(256, ahci_port_cmd_size(port));
     if (!port->list || !port->fis || !port->cmd) {
         warn_noalloc();
         free(port->list);
@@ -415,6 +712,8 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
         free(port);
         return NULL;
     }
+    memset(port->list, 0, 1024);
+    memset(port->cmd, 0, ahci_port_cmd_size(port));
 
     ahci_port_writel(port->ctrl, port->pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(port->ctrl, port->pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -435,39 +734,16 @@ static int ahci_port_setup(struct ahci_port_s *port)
     u32 pnr = port->pnr;
     char model[MAXMODEL+1];
     u16 buffer[256];
-    u32 cmd, stat, err, tf;
+    u32 cmd, err, tf;
     int rc;
 
-    /* enable FIS recv */
-    cmd = ahci_port_readl(ctrl, pnr, PORT_CMD);
-    cmd |= PORT_CMD_FIS_RX;
-    ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
-
-    /* spin up */
-    cmd &= ~PORT_CMD_ICC_MASK;
-    cmd |= PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON | PORT_CMD_ICC_ACTIVE;
-    ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
-    u32 end = timer_calc(AHCI_LINK_TIMEOUT);
-    for (;;) {
-        stat = ahci_port_readl(ctrl, pnr, PORT_SCR_STAT);
-        if ((stat & 0x07) == 0x03) {
-            dprintf(2, "AHCI/%d: link up\n", port->pnr);
-            break;
-        }
-        if (timer_check(end)) {
-            dprintf(2, "AHCI/%d: link down\n", port->pnr);
-            return -1;
-        }
-        yield();
-    }
-
     /* clear error status */
     err = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
     if (err)
         ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, err);
 
     /* wait for device becoming ready */
-    end = timer_calc(AHCI_REQUEST_TIMEOUT);
+    u32 end = timer_calc(AHCI_REQUEST_TIMEOUT);
     for (;;) {
         tf = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
         if (!(tf & (ATA_CB_STAT_BSY |
@@ -482,6 +758,7 @@ static int ahci_port_setup(struct ahci_port_s *port)
     }
 
     /* start device */
+    cmd = ahci_port_readl(ctrl, pnr, PORT_CMD);
     cmd |= PORT_CMD_START;
     ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
 
@@ -556,6 +833,20 @@ static int ahci_port_setup(struct ahci_port_s *port)
         dprintf(2, "AHCI/%d: supported modes: udma %d, multi-dma %d, pio %d\n",
                 port->pnr, udma_mode, multi_dma, pio_mode);
 
+        // word 76 bit 8 - native command queuing support
+        if (ctrl->caps & HOST_CAP_NCQ && buffer[76] & (1 << 8)) {
+            u32 slots = ((ctrl->caps >> 8) & 0x1f) + 1;
+            u32 depth = (buffer[75] & 0x1f) + 1; // word 75 - queue depth
+            if (slots > depth)
+                slots = depth;
+            if (slots > AHCI_NCQ_SLOTS)
+                slots = AHCI_NCQ_SLOTS;
+            if (slots > 1)
+                port->slots = slots;
+            dprintf(2, "AHCI/%d: ncq depth %d, using %d slots\n",
+                    port->pnr, depth, port->slots);
+        }
+
         sata_prep_simple(&port->cmd->fis, ATA_CMD_SET_FEATURES);
         port->cmd->fis.feature = ATA_SET_FEATRUE_TRANSFER_MODE;
         // Select used mode. UDMA first, then Multi-DMA followed by
@@ -589,6 +880,8 @@ static int ahci_port_setup(struct ahci_port_s *port)
         port->drive.type = DTYPE_AHCI_ATAPI;
         port->drive.blksize = CDROM_SECTOR_SIZE;
         port->drive.sectors = (u64)-1;
+        // A packet command is limited by what the prd table can describe
+        port->drive.max_blocks = AHCI_PRD_COUNT * AHCI_PRD_MAX / CDROM_SECTOR_SIZE;
         u8 iscd = ((buffer[0] >> 8) & 0x1f) == 0x05;
         if (!iscd) {
             dprintf(1, "AHCI/%d: atapi device isn't a cdrom\n", port->pnr);
@@ -613,7 +906,6 @@ ahci_port_detect(void *data)
     int rc;
 
     dprintf(2, "AHCI/%d: probing\n", port->pnr);
-    ahci_port_reset(port->ctrl, port->pnr);
     rc = ahci_port_setup(port);
     if (rc < 0)
         ahci_port_release(port);
@@ -624,6 +916,7 @@ ahci_port_detect(void *data)
         dprintf(1, "AHCI/%d: registering: \"%s\"\n", port->pnr, port->desc);
         if (!port->atapi) {
             // Register with bcv system.
+            ahci_async_setup(port);
             boot_add_hd(&port->drive, port->desc, port->prio);
         } else {
             // fill cdidmap
@@ -632,12 +925,91 @@ ahci_port_detect(void *data)
     }
 }
 
+#define SCR_STAT_DET_MASK    0x07
+#define SCR_STAT_DET_PRESENT 0x01 // device detected, no phy communication
+#define SCR_STAT_DET_LINK    0x03 // device detected, phy communication
+#define SCR_CTL_DET_MASK     0x0f
+#define SCR_CTL_DET_COMRESET 0x01
+
+/* Reset and spin up the links of all implemented ports at once and
+ * wait for them in a single loop - returns the mask of the ports that
+ * have a link.  Only those need a thread for the slower device probe. */
+static u32
+ahci_link_setup(struct ahci_ctrl_s *ctrl, struct ahci_port_s **ports)
+{
+    u32 pnr, pending = 0;
+    for (pnr = 0; pnr < 32; pnr++) {
+        if (!(ctrl->ports & (1 << pnr)))
+            continue;
+        /* the port must be idle before its list and fis are set up */
+        ahci_port_reset(ctrl, pnr);
+        ports[pnr] = ahci_port_alloc(ctrl, pnr);
+        if (!ports[pnr])
+            continue;
+        u32 sctl = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        sctl = (sctl & ~SCR_CTL_DET_MASK) | SCR_CTL_DET_COMRESET;
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, sctl);
+        pending |= 1 << pnr;
+    }
+    if (!pending)
+        return 0;
+
+    /* COMRESET must be asserted for at least 1ms */
+    msleep(1);
+    for (pnr = 0; pnr < 32; pnr++) {
+        if (!(pending & (1 << pnr)))
+            continue;
+        u32 sctl = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, sctl & ~SCR_CTL_DET_MASK);
+
+        /* enable FIS recv */
+        u32 cmd = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        cmd |= PORT_CMD_FIS_RX;
+        ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
+
+        /* spin up */
+        cmd &= ~PORT_CMD_ICC_MASK;
+        cmd |= PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON | PORT_CMD_ICC_ACTIVE;
+        ahci_port_writel(ctrl, pnr, PORT_CMD, cmd);
+    }
+
+    /* Empty ports give up after AHCI_LINK_TIMEOUT; ports that see a
+     * device but no phy communication yet get up to AHCI_RESET_TIMEOUT. */
+    u32 linkup = 0, present;
+    u32 end = timer_calc(AHCI_LINK_TIMEOUT);
+    u32 end_present = timer_calc(AHCI_RESET_TIMEOUT);
+    for (;;) {
+        present = 0;
+        for (pnr = 0; pnr < 32; pnr++) {
+            if (!(pending & ~linkup & (1 << pnr)))
+                continue;
+            u32 det = ahci_port_readl(ctrl, pnr, PORT_SCR_STAT);
+            det &= SCR_STAT_DET_MASK;
+            if (det == SCR_STAT_DET_LINK)
+                linkup |= 1 << pnr;
+            else if (det == SCR_STAT_DET_PRESENT)
+                present |= 1 << pnr;
+        }
+        if (linkup == pending)
+            break;
+        if (timer_check(end) && (!present || timer_check(end_present)))
+            break;
+        yield();
+    }
+    for (pnr = 0; pnr < 32; pnr++)
+        if (pending & (1 << pnr))
+            dprintf(2, "AHCI/%d: link %s\n", pnr
+                    , linkup & (1 << pnr) ? "up" : "down");
+    return linkup;
+}
+
 // Initialize an ata controller and detect its drives.
 static void
-ahci_controller_setup(struct pci_device *pci)
+ahci_controller_setup(void *data)
 {
-    struct ahci_port_s *port;
-    u32 pnr, max;
+    struct pci_device *pci = data;
+    struct ahci_port_s *ports[32];
+    u32 pnr;
 
     if (create_bounce_buf() < 0)
         return;
@@ -661,6 +1033,14 @@ ahci_controller_setup(struct pci_device *pci)
     pci_enable_busmaster(pci);
 
     ahci_ctrl_writel(ctrl, HOST_CTL, HOST_CTL_RESET);
+    u32 end = timer_calc(AHCI_RESET_TIMEOUT);
+    while (ahci_ctrl_readl(ctrl, HOST_CTL) & HOST_CTL_RESET) {
+        if (timer_check(end)) {
+            warn_timeout();
+            break;
+        }
+        yield();
+    }
     ahci_ctrl_writel(ctrl, HOST_CTL, HOST_CTL_AHCI_EN);
 
     ctrl->caps = ahci_ctrl_readl(ctrl, HOST_CAP);
@@ -668,14 +1048,16 @@ ahci_controller_setup(struct pci_device *pci)
     dprintf(2, "AHCI: cap 0x%x, ports_impl 0x%x\n",
             ctrl->caps, ctrl->ports);
 
-    max = 0x1f;
-    for (pnr = 0; pnr <= max; pnr++) {
-        if (!(ctrl->ports & (1 << pnr)))
+    memset(ports, 0, sizeof(ports));
+    u32 linkup = ahci_link_setup(ctrl, ports);
+    for (pnr = 0; pnr < 32; pnr++) {
+        if (!ports[pnr])
             continue;
-        port = ahci_port_alloc(ctrl, pnr);
-        if (port == NULL)
+        if (!(linkup & (1 << pnr))) {
+            ahci_port_release(ports[pnr]);
             continue;
-        run_thread(ahci_port_detect, port);
+        }
+        run_thread_prio(ahci_port_detect, ports[pnr], boot_thread_prio(pci));
     }
 }
 
@@ -690,6 +1072,8 @@ ahci_scan(void)
             continue;
         if (pci->prog_if != 1 /* AHCI rev 1 */)
             continue;
+        if (boot_defer_pci(ahci_controller_setup, pci))
+            continue;
         ahci_controller_setup(pci);
     }
 }
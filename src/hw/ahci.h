@@ -77,6 +77,8 @@ struct ahci_port_s {
     struct ahci_cmd_s  *cmd;
     u32                pnr;
     u32                atapi;
+    u32                slots; // NCQ command slots in use, 0 if none
+    struct ahci_ncq_s  *ncq;  // disk_submit() state, NULL if no NCQ
     char               *desc;
     int                prio;
 };
@@ -10,6 +10,7 @@
 #include "block.h" // struct drive_s
 #include "blockcmd.h" // CDB_CMD_READ_10
 #include "byteorder.h" // be16_to_cpu
+#include "fw/paravirt.h" // runningOnMicrovm
 #include "malloc.h" // malloc_fseg
 #include "output.h" // dprintf
 #include "pci.h" // pci_config_readb
@@ -17,6 +18,7 @@
 #include "pci_ids.h" // PCI_CLASS_STORAGE_OTHER
 #include "pci_regs.h" // PCI_INTERRUPT_LINE
 #include "pic.h" // enable_hwirq
+#include "romfile.h" // romfile_loadint
 #include "stacks.h" // yield
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
@@ -24,6 +26,7 @@
 #include "x86.h" // inb
 
 #define IDE_TIMEOUT 32000 //32 seconds max for IDE ops
+#define ATA_MAX_MULTI 16  // max sectors per DRQ block
 
 
 /****************************************************************
@@ -189,8 +192,9 @@ send_cmd(struct atadrive_s *adrive_gf, struct ata_pio_command *cmd)
             return status;
     }
 
-    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA)_EXT commands.
-    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT) {
+    // Check for ATA_CMD_(READ|WRITE)_(SECTORS|DMA|MULTIPLE)_EXT commands.
+    if ((cmd->command & ~0x11) == ATA_CMD_READ_SECTORS_EXT
+        || (cmd->command & ~0x10) == ATA_CMD_READ_MULTIPLE_EXT) {
         outb(cmd->feature2, iobase1 + ATA_CB_FR);
         outb(cmd->sector_count2, iobase1 + ATA_CB_SC);
         outb(cmd->lba_low2, iobase1 + ATA_CB_SN);
@@ -271,9 +275,9 @@ fail:
  ****************************************************************/
 
 // Transfer 'op->count' blocks (of 'blocksize' bytes) to/from drive
-// 'op->drive_fl'.
+// 'op->drive_fl', 'multi' blocks per DRQ data block.
 static int
-ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
+ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize, int multi)
 {
     dprintf(16, "ata_pio_transfer id=%p write=%d count=%d bs=%d buf=%p\n"
             , op->drive_fl, iswrite, op->count, blocksize, op->buf_fl);
@@ -283,26 +287,29 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
     struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
     u16 iobase1 = GET_GLOBALFLAT(chan_gf->iobase1);
     u16 iobase2 = GET_GLOBALFLAT(chan_gf->iobase2);
+    u8 pio32 = GET_GLOBALFLAT(chan_gf->pio32);
     int count = op->count;
     void *buf_fl = op->buf_fl;
     int status;
     for (;;) {
+        int blocks = count < multi ? count : multi;
+        u32 bytes = blocks * blocksize;
         if (iswrite) {
             // Write data to controller
             dprintf(16, "Write sector id=%p dest=%p\n", op->drive_fl, buf_fl);
-            if (CONFIG_ATA_PIO32)
-                outsl_fl(iobase1, buf_fl, blocksize / 4);
+            if (pio32 && !(bytes & 3))
+                outsl_fl(iobase1, buf_fl, bytes / 4);
             else
-                outsw_fl(iobase1, buf_fl, blocksize / 2);
+                outsw_fl(iobase1, buf_fl, bytes / 2);
         } else {
             // Read data from controller
             dprintf(16, "Read sector id=%p dest=%p\n", op->drive_fl, buf_fl);
-            if (CONFIG_ATA_PIO32)
-                insl_fl(iobase1, buf_fl, blocksize / 4);
+            if (pio32 && !(bytes & 3))
+                insl_fl(iobase1, buf_fl, bytes / 4);
             else
-                insw_fl(iobase1, buf_fl, blocksize / 2);
+                insw_fl(iobase1, buf_fl, bytes / 2);
         }
-        buf_fl += blocksize;
+        buf_fl += bytes;
 
         status = pause_await_not_bsy(iobase1, iobase2);
         if (status < 0) {
@@ -311,7 +318,7 @@ ata_pio_transfer(struct disk_op_s *op, int iswrite, int blocksize)
             return status;
         }
 
-        count--;
+        count -= blocks;
         if (!count)
             break;
         status &= (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ | ATA_CB_STAT_ERR);
@@ -354,6 +361,12 @@ struct sff_dma_prd {
     u32 count;
 };
 
+#define ATA_DMA_PRD_COUNT 128
+
+// Bus master descriptor table, shared by all channels.  Aligned to its
+// size so that it never crosses a 64KiB boundary.
+struct sff_dma_prd *AtaDmaPrd VARFSEG;
+
 // Check if DMA available and setup transfer if so.
 static int
 ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
@@ -375,11 +388,14 @@ ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
     if (! bytes)
         return -1;
 
+    struct sff_dma_prd *origdma = GET_GLOBAL(AtaDmaPrd);
+    if (!origdma)
+        return -1;
+
     // Build PRD dma structure.
-    struct sff_dma_prd *dma = MAKE_FLATPTR(SEG_LOW, ExtraStack);
-    struct sff_dma_prd *origdma = dma;
+    struct sff_dma_prd *dma = origdma;
     while (bytes) {
-        if (dma >= &origdma[16])
+        if (dma >= &origdma[ATA_DMA_PRD_COUNT])
             // Too many descriptors..
             return -1;
         u32 count = bytes;
@@ -463,7 +479,8 @@ ata_dma_transfer(struct disk_op_s *op)
 
 // Transfer data to harddrive using PIO protocol.
 static int
-ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
+ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd
+                 , int multi)
 {
     struct atadrive_s *adrive_gf = container_of(
         op->drive_fl, struct atadrive_s, drive);
@@ -480,7 +497,7 @@ ata_pio_cmd_data(struct disk_op_s *op, int iswrite, struct ata_pio_command *cmd)
     ret = ata_wait_data(iobase1);
     if (ret)
         goto fail;
-    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE);
+    ret = ata_pio_transfer(op, iswrite, DISK_SECTOR_SIZE, multi);
 
 fail:
     // Enable interrupts
@@ -509,6 +526,12 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
     u64 lba = op->lba;
 
     int usepio = ata_try_dma(op, iswrite, DISK_SECTOR_SIZE);
+    int multi = 1;
+    if (usepio) {
+        struct atadrive_s *adrive_gf = container_of(
+            op->drive_fl, struct atadrive_s, drive);
+        multi = GET_GLOBALFLAT(adrive_gf->multi) ?: 1;
+    }
 
     struct ata_pio_command cmd;
     memset(&cmd, 0, sizeof(cmd));
@@ -520,14 +543,20 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
         cmd.lba_high2 = lba >> 40;
         lba &= 0xffffff;
 
-        if (usepio)
+        if (usepio && multi > 1)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE_EXT
+                           : ATA_CMD_READ_MULTIPLE_EXT);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS_EXT
                            : ATA_CMD_READ_SECTORS_EXT);
         else
             cmd.command = (iswrite ? ATA_CMD_WRITE_DMA_EXT
                            : ATA_CMD_READ_DMA_EXT);
     } else {
-        if (usepio)
+        if (usepio && multi > 1)
+            cmd.command = (iswrite ? ATA_CMD_WRITE_MULTIPLE
+                           : ATA_CMD_READ_MULTIPLE);
+        else if (usepio)
             cmd.command = (iswrite ? ATA_CMD_WRITE_SECTORS
                            : ATA_CMD_READ_SECTORS);
         else
@@ -543,7 +572,7 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
 
     int ret;
     if (usepio)
-        ret = ata_pio_cmd_data(op, iswrite, &cmd);
+        ret = ata_pio_cmd_data(op, iswrite, &cmd, multi);
     else
         ret = ata_dma_cmd_data(op, &cmd);
     if (ret)
@@ -643,7 +672,7 @@ ata_atapi_process_op(struct disk_op_s *op)
             goto fail;
         }
 
-        ret = ata_pio_transfer(op, 0, blocksize);
+        ret = ata_pio_transfer(op, 0, blocksize, 1);
     }
 
 fail:
@@ -676,7 +705,7 @@ send_ata_identity(struct atadrive_s *adrive, u16 *buffer, int command)
     memset(&cmd, 0, sizeof(cmd));
     cmd.command = command;
 
-    return ata_pio_cmd_data(&dop, 0, &cmd);
+    return ata_pio_cmd_data(&dop, 0, &cmd, 1);
 }
 
 // Extract the ATA/ATAPI version info.
@@ -740,6 +769,8 @@ init_drive_atapi(struct atadrive_s *dummy, u16 *buffer)
     adrive->drive.type = DTYPE_ATA_ATAPI;
     adrive->drive.blksize = CDROM_SECTOR_SIZE;
     adrive->drive.sectors = (u64)-1;
+    // Only the READ(10) transfer length limits a packet command
+    adrive->drive.max_blocks = 0xffff;
     u8 iscd = ((buffer[0] >> 8) & 0x1f) == 0x05;
     char model[MAXMODEL+1];
     char *desc = znprintf(MAXDESCSIZE
@@ -806,6 +837,24 @@ init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
                           , (u32)adjsize, adjprefix);
     dprintf(1, "%s\n", desc);
 
+    // word 47 - max sectors per DRQ block for READ/WRITE MULTIPLE
+    u8 multi = buffer[47] & 0xff;
+    if (multi > ATA_MAX_MULTI)
+        multi = ATA_MAX_MULTI;
+    while (multi & (multi - 1))
+        multi &= multi - 1;
+    if (multi > 1) {
+        struct ata_pio_command cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.command = ATA_CMD_SET_MULTIPLE_MODE;
+        cmd.sector_count = multi;
+        if (ata_cmd_nondata(adrive, &cmd) == 0) {
+            adrive->multi = multi;
+            dprintf(3, "ata%d-%d: %d sectors per multiple block\n"
+                    , adrive->chan_gf->ataid, adrive->slave, multi);
+        }
+    }
+
     int prio = bootprio_find_ata_device(adrive->chan_gf->pci_tmp,
                                         adrive->chan_gf->chanid,
                                         adrive->slave);
@@ -819,22 +868,28 @@ init_drive_ata(struct atadrive_s *dummy, u16 *buffer)
     return adrive;
 }
 
-static u32 SpinupEnd;
+// All waits during detection share one deadline - the drives on all
+// channels spin up in parallel from power on, so a slow drive doesn't
+// cost a full timeout for every device probed after it.
+static u32 SpinupTime, SpinupEnd;
+
+#define POWERUP_FLOATING -2
 
-// Wait for non-busy status and check for "floating bus" condition.
+// Wait for the given ide state during detection and check for
+// "floating bus" condition.
 static int
-powerup_await_non_bsy(u16 base)
+powerup_await_ide(u8 mask, u8 flags, u16 base)
 {
     u8 orstatus = 0;
     u8 status;
     for (;;) {
         status = inb(base+ATA_CB_STAT);
-        if (!(status & ATA_CB_STAT_BSY))
+        if ((status & mask) == flags)
             break;
         orstatus |= status;
         if (orstatus == 0xff) {
             dprintf(4, "powerup IDE floating\n");
-            return orstatus;
+            return POWERUP_FLOATING;
         }
         if (timer_check(SpinupEnd)) {
             warn_timeout();
@@ -846,6 +901,13 @@ powerup_await_non_bsy(u16 base)
     return status;
 }
 
+// Wait for non-busy status during detection.
+static int
+powerup_await_non_bsy(u16 base)
+{
+    return powerup_await_ide(ATA_CB_STAT_BSY, 0, base);
+}
+
 // Detect any drives attached to a given controller.
 static void
 ata_detect(void *data)
@@ -854,19 +916,35 @@ ata_detect(void *data)
     struct atadrive_s dummy;
     memset(&dummy, 0, sizeof(dummy));
     dummy.chan_gf = chan_gf;
+    // Under a CSM, EFI has already probed the channel - only look for
+    // the drives it found rather than waiting on empty slots.
+    int expect = CONFIG_CSM ? csm_ata_drives(chan_gf->iobase1) : -1;
+    // Reject a floating bus (no drives and no pull-down on the data
+    // lines) without waiting for a drive to leave the busy state.
+    u16 iobase1 = chan_gf->iobase1;
+    if (inb(iobase1+ATA_CB_STAT) == 0xff
+        && inb(chan_gf->iobase2+ATA_CB_ASTAT) == 0xff) {
+        dprintf(3, "ata%d: floating bus - no drives\n", chan_gf->ataid);
+        return;
+    }
     // Device detection
     int didreset = 0;
     u8 slave;
     for (slave=0; slave<=1; slave++) {
+        if (expect >= 0 && !(expect & (1 << slave)))
+            continue;
         // Wait for not-bsy.
-        u16 iobase1 = chan_gf->iobase1;
         int status = powerup_await_non_bsy(iobase1);
+        if (status == POWERUP_FLOATING)
+            break;
         if (status < 0)
             continue;
         u8 newdh = slave ? ATA_CB_DH_DEV1 : ATA_CB_DH_DEV0;
         outb(newdh, iobase1+ATA_CB_DH);
         ndelay(400);
         status = powerup_await_non_bsy(iobase1);
+        if (status == POWERUP_FLOATING)
+            break;
         if (status < 0)
             continue;
 
@@ -902,7 +980,8 @@ ata_detect(void *data)
                 continue;
 
             // Wait for RDY.
-            int ret = await_rdy(iobase1);
+            int ret = powerup_await_ide(ATA_CB_STAT_RDY, ATA_CB_STAT_RDY
+                                        , iobase1);
             if (ret < 0)
                 continue;
 
@@ -942,9 +1021,13 @@ init_controller(struct pci_device *pci, int chanid, int irq
     chan_gf->iobase1 = port1;
     chan_gf->iobase2 = port2;
     chan_gf->iomaster = master;
+    // PCI IDE controllers split 32bit data port accesses into two
+    // 16bit transfers; only legacy ISA channels need 16bit PIO.
+    chan_gf->pio32 = CONFIG_ATA_PIO32 || pci;
     dprintf(1, "ATA controller %d at %x/%x/%x (irq %d dev %x)\n"
             , ataid, port1, port2, master, irq, chan_gf->pci_bdf);
-    run_thread(ata_detect, chan_gf);
+    run_thread_prio(ata_detect, chan_gf
+                    , pci ? boot_thread_prio(pci) : THREAD_PRIO_NORMAL);
 }
 
 #define IRQ_ATA1 14
@@ -959,7 +1042,10 @@ init_pciata(struct pci_device *pci, u8 prog_if)
     if (CONFIG_ATA_DMA && prog_if & 0x80) {
         // Check for bus-mastering.
         u32 bar = pci_config_readl(pci->bdf, PCI_BASE_ADDRESS_4);
-        if (bar & PCI_BASE_ADDRESS_SPACE_IO) {
+        u32 prdsize = ATA_DMA_PRD_COUNT * sizeof(struct sff_dma_prd);
+        if (!AtaDmaPrd)
+            AtaDmaPrd = memalign_low(prdsize, prdsize);
+        if (bar & PCI_BASE_ADDRESS_SPACE_IO && AtaDmaPrd) {
             master = pci_enable_iobar(pci, PCI_BASE_ADDRESS_4);
             pci_enable_busmaster(pci);
         }
@@ -993,9 +1079,23 @@ init_pciata(struct pci_device *pci, u8 prog_if)
     init_controller(pci, 1, irq, port1, port2, master ? master + 8 : 0);
 }
 
+// Initialize an ATA PCI device whose initialization was deferred.
+static void
+ata_pci_setup(void *data)
+{
+    struct pci_device *pci = data;
+    // The drives had all of POST to spin up - if the common deadline
+    // already passed, give them the full budget again.
+    if (timer_check(SpinupEnd))
+        SpinupEnd = timer_calc(SpinupTime);
+    init_pciata(pci, pci->prog_if);
+}
+
 static void
 found_genericata(struct pci_device *pci, void *arg)
 {
+    if (boot_defer_pci(ata_pci_setup, pci))
+        return;
     init_pciata(pci, pci->prog_if);
 }
 
@@ -1019,7 +1119,7 @@ static const struct pci_device_id pci_ata_tbl[] = {
 static void
 ata_scan(void)
 {
-    if (CONFIG_QEMU && hlist_empty(&PCIDevices)) {
+    if (CONFIG_QEMU && hlist_empty(&PCIDevices) && !runningOnMicrovm()) {
         // No PCI devices found - probably a QEMU "-M isapc" machine.
         // Try using ISA ports for ATA controllers.
         init_controller(NULL, 0, IRQ_ATA1
@@ -1045,7 +1145,8 @@ ata_setup(void)
 
     dprintf(3, "init hard drives\n");
 
-    SpinupEnd = timer_calc(IDE_TIMEOUT);
+    SpinupTime = romfile_loadint("etc/ata-spinup-timeout", IDE_TIMEOUT);
+    SpinupEnd = timer_calc(SpinupTime);
     ata_scan();
 
     SET_BDA(disk_control_byte, 0xc0);
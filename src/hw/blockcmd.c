@@ -12,8 +12,9 @@
 #include "output.h" // dprintf
 #include "std/disk.h" // DISK_RET_EPARAM
 #include "string.h" // memset
-#include "util.h" // timer_calc
+#include "util.h" // timer_calc, boot_stop_probing
 #include "malloc.h"
+#include "stacks.h" // run_thread
 
 
 /****************************************************************
@@ -66,6 +67,23 @@ cdb_test_unit_ready(struct disk_op_s *op)
     return process_op(op);
 }
 
+// Start stop unit - ask the device to spin up, without waiting for it
+static int
+cdb_start_unit(struct disk_op_s *op)
+{
+    struct cdb_start_stop_unit cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = CDB_CMD_START_STOP_UNIT;
+    cmd.immed = 1;
+    cmd.flags = 1; /* START */
+    op->command = CMD_SCSI;
+    op->count = 0;
+    op->buf_fl = NULL;
+    op->cdbcmd = &cmd;
+    op->blocksize = 0;
+    return process_op(op);
+}
+
 static int
 cdb_read_capacity16(struct disk_op_s *op, struct cdbres_read_capacity_16 *data)
 {
@@ -171,9 +189,13 @@ scsi_is_ready(struct disk_op_s *op)
 
     /* Retry TEST UNIT READY for 5 seconds unless MEDIUM NOT PRESENT is
      * reported by the device 3 times.  If the device reports "IN PROGRESS",
-     * 30 seconds is added. */
+     * 30 seconds is added.  A device that waits for an "INITIALIZING
+     * COMMAND" is sent START STOP UNIT once and gets the same 30 seconds.
+     * Retries back off up to SCSI_READY_POLL_MAX ms, letting other threads
+     * probe their units meanwhile. */
     int tries = 3;
     int in_progress = 0;
+    u32 delay = 1;
     u32 end = timer_calc(5000);
     for (;;) {
         if (timer_check(end)) {
@@ -201,17 +223,42 @@ scsi_is_ready(struct disk_op_s *op)
                 return -1;
         }
 
-        if (sense.asc == 0x04 && sense.ascq == 0x01 && !in_progress) {
-            /* IN PROGRESS OF BECOMING READY */
-            dprintf(1, "Waiting for device to detect medium... ");
+        if (sense.asc == 0x04 && !in_progress
+            && (sense.ascq == 0x01 || sense.ascq == 0x02)) {
+            if (sense.ascq == 0x02) {
+                /* INITIALIZING COMMAND REQUIRED */
+                dprintf(1, "Starting device... ");
+                cdb_start_unit(op);
+            } else {
+                /* IN PROGRESS OF BECOMING READY */
+                dprintf(1, "Waiting for device to detect medium... ");
+            }
             /* Allow 30 seconds more */
             end = timer_calc(30000);
             in_progress = 1;
         }
+
+        msleep(delay);
+        if (delay < SCSI_READY_POLL_MAX)
+            delay *= 2;
     }
     return 0;
 }
 
+// Check if a removable device reports that it has no medium.  Unlike
+// scsi_is_ready(), this trusts the first sense data, so empty slots of card
+// readers are skipped without waiting for them.
+static int
+scsi_medium_absent(struct disk_op_s *op)
+{
+    if (!cdb_test_unit_ready(op))
+        return 0;
+    struct cdbres_request_sense sense;
+    if (cdb_get_sense(op, &sense))
+        return 0;
+    return sense.asc == 0x3a; /* MEDIUM NOT PRESENT */
+}
+
 #define CDB_CMD_REPORT_LUNS  0xA0
 
 struct cdb_report_luns {
@@ -240,15 +287,38 @@ static u64 scsilun2u64(struct scsi_lun *scsi_lun)
     return ret;
 }
 
-// Issue REPORT LUNS on a temporary drive and iterate reported luns calling
-// @add_lun for each
-int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun)
+struct scsi_lun_scan_s {
+    struct drive_s *tmp_drive;
+    scsi_add_lun add_lun;
+    struct cdbres_report_luns *resp;
+    u32 nluns, next_lun;
+    int workers, tot;
+};
+
+static void
+scsi_lun_scan_worker(void *data)
+{
+    struct scsi_lun_scan_s *scan = data;
+    while (scan->next_lun < scan->nluns && !boot_stop_probing()) {
+        u64 lun = scsilun2u64(&scan->resp->luns[scan->next_lun++]);
+        if (lun >> 32)
+            continue;
+        scan->tot += !scan->add_lun((u32)lun, scan->tmp_drive);
+    }
+    scan->workers--;
+}
+
+// Issue REPORT LUNS on a temporary drive and call @add_lun for each reported
+// lun from up to @threads threads at once
+static int
+scsi_rep_luns_scan_threads(struct drive_s *tmp_drive, scsi_add_lun add_lun,
+                           int threads)
 {
     int ret = -1;
     /* start with the smallest possible buffer, otherwise some devices in QEMU
      * may (incorrectly) error out on returning less data than fits in it */
     u32 maxluns = 1;
-    u32 nluns, i;
+    u32 nluns;
     struct cdb_report_luns cdb = {
         .command = CDB_CMD_REPORT_LUNS,
     };
@@ -284,17 +354,41 @@ int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun)
         maxluns = nluns;
     }
 
-    for (i = 0, ret = 0; i < nluns; i++) {
-        u64 lun = scsilun2u64(&resp->luns[i]);
-        if (lun >> 32)
-            continue;
-        ret += !add_lun((u32)lun, tmp_drive);
+    struct scsi_lun_scan_s scan = {
+        .tmp_drive = tmp_drive, .add_lun = add_lun,
+        .resp = resp, .nluns = nluns,
+    };
+    int i;
+    for (i = 0; i < threads && i < nluns; i++) {
+        scan.workers++;
+        if (threads > 1)
+            run_thread(scsi_lun_scan_worker, &scan);
+        else
+            scsi_lun_scan_worker(&scan);
     }
+    while (scan.workers)
+        yield();
+    ret = scan.tot;
 out:
     free(op.buf_fl);
     return ret;
 }
 
+// Issue REPORT LUNS on a temporary drive and iterate reported luns calling
+// @add_lun for each
+int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun)
+{
+    return scsi_rep_luns_scan_threads(tmp_drive, add_lun, 1);
+}
+
+// As scsi_rep_luns_scan(), but probe several luns at once, so that units
+// spinning up wait for the slowest of them rather than for all in turn.
+// Only for drivers that can have several commands in flight on a target.
+int scsi_rep_luns_scan_parallel(struct drive_s *tmp_drive, scsi_add_lun add_lun)
+{
+    return scsi_rep_luns_scan_threads(tmp_drive, add_lun, SCSI_SCAN_LUN_THREADS);
+}
+
 // Iterate LUNs on the target and call @add_lun for each
 int scsi_sequential_scan(struct drive_s *tmp_drive, u32 maxluns,
                          scsi_add_lun add_lun)
@@ -346,6 +440,10 @@ scsi_drive_setup(struct drive_s *drive, const char *s, int prio)
     if (pdt != SCSI_TYPE_DISK)
         return -1;
 
+    if (removable && scsi_medium_absent(&dop)) {
+        dprintf(1, "%s: no medium\n", s);
+        return -1;
+    }
     ret = scsi_is_ready(&dop);
     if (ret) {
         dprintf(1, "scsi_is_ready returned %d\n", ret);
@@ -368,7 +466,7 @@ scsi_drive_setup(struct drive_s *drive, const char *s, int prio)
         drive->sectors = (u64)be32_to_cpu(capdata.sectors) + 1;
     }
 
-    if (drive->blksize != DISK_SECTOR_SIZE) {
+    if (!disk_blksize_supported(drive->blksize)) {
         dprintf(1, "%s: unsupported block size %d\n", s, drive->blksize);
         return -1;
     }
@@ -62,6 +62,7 @@ struct cdbres_read_capacity_16 {
 #define CDB_CMD_TEST_UNIT_READY  0x00
 #define CDB_CMD_INQUIRY          0x12
 #define CDB_CMD_REQUEST_SENSE    0x03
+#define CDB_CMD_START_STOP_UNIT  0x1b
 
 struct cdb_request_sense {
     u8 command;
@@ -72,6 +73,14 @@ struct cdb_request_sense {
     u8 pad[10];
 } PACKED;
 
+struct cdb_start_stop_unit {
+    u8 command;
+    u8 immed;
+    u16 reserved_02;
+    u8 flags;
+    u8 pad[11];
+} PACKED;
+
 struct cdbres_request_sense {
     u8 errcode;
     u8 segment;
@@ -127,6 +136,8 @@ struct cdbres_mode_sense_geom {
 } PACKED;
 
 // blockcmd.c
+#define SCSI_READY_POLL_MAX 64  // Longest wait between TEST UNIT READYs (ms)
+#define SCSI_SCAN_LUN_THREADS 4 // Luns probed at once by a parallel scan
 struct disk_op_s;
 int scsi_fill_cmd(struct disk_op_s *op, void *cdbcmd, int maxcdb);
 int scsi_is_read(struct disk_op_s *op);
@@ -135,6 +146,7 @@ struct drive_s;
 int scsi_drive_setup(struct drive_s *drive, const char *s, int prio);
 typedef int (*scsi_add_lun)(u32 lun, struct drive_s *tmpl_drv);
 int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun);
+int scsi_rep_luns_scan_parallel(struct drive_s *tmp_drive, scsi_add_lun add_lun);
 int scsi_sequential_scan(struct drive_s *tmp_drive, u32 maxluns,
                          scsi_add_lun add_lun);
 
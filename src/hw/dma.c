@@ -23,10 +23,10 @@
 int
 dma_floppy(u32 addr, int count, int isWrite)
 {
-    // check for 64K boundary overrun
+    // check for 64K boundary overrun and the 16M isa dma limit
     u16 end = count - 1;
     u32 last_addr = addr + end;
-    if ((addr >> 16) != (last_addr >> 16))
+    if ((addr >> 16) != (last_addr >> 16) || last_addr >= 0x1000000)
         return -1;
 
     u8 mode_register = 0x46; // single mode, increment, autoinit disable,
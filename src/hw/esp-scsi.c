@@ -62,6 +62,9 @@
 #define ESP_INTR_BS      0x10
 #define ESP_INTR_DC      0x20
 
+// The transfer counter is 24 bits - longer transfers are chained
+#define ESP_MAX_XFER     (8*1024*1024)
+
 struct esp_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
@@ -95,7 +98,10 @@ esp_scsi_process_op(struct disk_op_s *op)
     if (blocksize < 0)
         return default_process_op(op);
     u32 iobase = GET_GLOBALFLAT(llun_gf->iobase);
-    int i, state;
+    u32 end = timer_calc(DISK_REQUEST_TIMEOUT);
+    u32 total = op->count && blocksize ? (u32)op->count * blocksize : 0;
+    u32 done = 0, buf = (u32)op->buf_fl;
+    int i, state, read = scsi_is_read(op);
     u8 status;
 
     outb(target, iobase + ESP_WBUSID);
@@ -132,19 +138,26 @@ esp_scsi_process_op(struct disk_op_s *op)
             /* HBA reads command, executes it, sets BS/FC -> do DMA if needed.  */
             if (intr & (ESP_INTR_BS | ESP_INTR_FC)) {
                 state++;
-                if (op->count && blocksize) {
-                    /* Data phase.  */
-                    u32 count = (u32)op->count * blocksize;
-                    esp_scsi_dma(iobase, (u32)op->buf_fl, count, scsi_is_read(op));
-                    outb(ESP_CMD_TI | ESP_CMD_DMA, iobase + ESP_CMD);
-                    continue;
-                } else {
+                if (!total) {
                     /* No data phase.  */
                     state++;
                 }
             }
         }
 
+        /* Data phase - one transfer per chunk of the buffer.  */
+        if (state == 1 && done < total && (!done || (stat & ESP_STAT_TC))) {
+            u32 count = total - done;
+            if (count > ESP_MAX_XFER)
+                count = ESP_MAX_XFER;
+            if (done)
+                outb(0, iobase + ESP_DMA_CMD);
+            esp_scsi_dma(iobase, buf + done, count, read);
+            outb(ESP_CMD_TI | ESP_CMD_DMA, iobase + ESP_CMD);
+            done += count;
+            continue;
+        }
+
         /* At end of DMA TC is set again -> complete command.  */
         if (state == 1 && (stat & ESP_STAT_TC)) {
             state++;
@@ -168,7 +181,11 @@ esp_scsi_process_op(struct disk_op_s *op)
             outb(ESP_CMD_MSGACC, iobase + ESP_CMD);
             break;
         }
-        usleep(5);
+        if (timer_check(end)) {
+            warn_timeout();
+            return DISK_RET_ETIMEOUT;
+        }
+        yield();
     }
 
     if (status == 0) {
@@ -213,6 +230,7 @@ esp_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
     free(name);
     if (ret)
         goto fail;
+    llun->drive.max_blocks = 0xffff;
     return 0;
 
 fail:
@@ -263,6 +281,8 @@ esp_scsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_AMD
             || pci->device != PCI_DEVICE_ID_AMD_SCSI)
             continue;
+        if (boot_defer_pci(init_esp_scsi, pci))
+            continue;
         run_thread(init_esp_scsi, pci);
     }
 }
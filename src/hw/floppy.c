@@ -9,6 +9,7 @@
 #include "block.h" // struct drive_s
 #include "bregs.h" // struct bregs
 #include "config.h" // CONFIG_FLOPPY
+#include "fw/paravirt.h" // runningOnMicrovm
 #include "malloc.h" // malloc_fseg
 #include "output.h" // dprintf
 #include "pcidevice.h" // pci_find_class
@@ -131,18 +132,22 @@ init_floppy(int floppyid, int ftype)
     return drive;
 }
 
-static void
+// Returns the size of a cylinder of the added drive
+static u32
 addFloppy(int floppyid, int ftype)
 {
     struct drive_s *drive = init_floppy(floppyid, ftype);
     if (!drive)
-        return;
+        return 0;
     char *desc = znprintf(MAXDESCSIZE, "Floppy [drive %c]", 'A' + floppyid);
     struct pci_device *pci = pci_find_class(PCI_CLASS_BRIDGE_ISA); /* isa-to-pci bridge */
     int prio = bootprio_find_fdc_device(pci, PORT_FD_BASE, floppyid);
     boot_add_floppy(drive, desc, prio);
+    return drive->lchs.head * drive->lchs.sector * DISK_SECTOR_SIZE;
 }
 
+static void floppy_cache_setup(u32 size);
+
 void
 floppy_setup(void)
 {
@@ -155,20 +160,23 @@ floppy_setup(void)
         return;
     dprintf(3, "init floppy drives\n");
 
-    if (CONFIG_QEMU) {
+    u32 size0 = 0, size1 = 0;
+    if (CONFIG_QEMU && !runningOnMicrovm()) {
+        // microvm may not have a cmos - it uses the fw_cfg files below
         u8 type = rtc_read(CMOS_FLOPPY_DRIVE_TYPE);
         if (type & 0xf0)
-            addFloppy(0, type >> 4);
+            size0 = addFloppy(0, type >> 4);
         if (type & 0x0f)
-            addFloppy(1, type & 0x0f);
+            size1 = addFloppy(1, type & 0x0f);
     } else {
         u8 type = romfile_loadint("etc/floppy0", 0);
         if (type)
-            addFloppy(0, type);
+            size0 = addFloppy(0, type);
         type = romfile_loadint("etc/floppy1", 0);
         if (type)
-            addFloppy(1, type);
+            size1 = addFloppy(1, type);
     }
+    floppy_cache_setup(size0 > size1 ? size0 : size1);
 
     enable_hwirq(6, FUNC16(entry_0e));
 }
@@ -442,9 +450,13 @@ floppy_drive_readid(u8 floppyid, u8 data_rate, u8 head)
     return 0;
 }
 
+static void floppy_cache_invalidate(void);
+static void floppy_cache_media(u8 floppyid, u8 stype);
+
 static int
 floppy_media_sense(struct drive_s *drive_gf)
 {
+    floppy_cache_invalidate();
     u8 ftype = GET_GLOBALFLAT(drive_gf->floppy_type), stype = ftype;
     u8 floppyid = GET_GLOBALFLAT(drive_gf->cntl_id);
 
@@ -482,6 +494,7 @@ floppy_media_sense(struct drive_s *drive_gf)
         < GET_GLOBAL(FloppyInfo[ftype].chs.cylinder))
         fms |= FMS_DOUBLE_STEPPING;
     SET_BDA(floppy_media_state[floppyid], fms);
+    floppy_cache_media(floppyid, stype);
 
     return DISK_RET_SUCCESS;
 }
@@ -532,16 +545,15 @@ floppy_prep(struct drive_s *drive_gf, u8 cylinder)
 
 // Perform a floppy transfer command (setup DMA and issue PIO).
 static int
-floppy_dma_cmd(struct disk_op_s *op, int count, int command, u8 *param)
+floppy_dma_xfer(u8 floppyid, void *buf_fl, int count, int command, u8 *param)
 {
     // Setup DMA controller
     int isWrite = command != FC_READ;
-    int ret = dma_floppy((u32)op->buf_fl, count, isWrite);
+    int ret = dma_floppy((u32)buf_fl, count, isWrite);
     if (ret)
         return DISK_RET_EBOUNDARY;
 
     // Invoke floppy controller
-    u8 floppyid = GET_GLOBALFLAT(op->drive_fl->cntl_id);
     ret = floppy_drive_pio(floppyid, command, param);
     if (ret)
         return ret;
@@ -564,6 +576,138 @@ floppy_dma_cmd(struct disk_op_s *op, int count, int command, u8 *param)
 }
 
 
+/****************************************************************
+ * Floppy track cache
+ ****************************************************************/
+
+// A whole cylinder is read with one multi-track command into a buffer
+// the isa dma controller can reach.  The cache is only trusted while
+// the drive motor keeps running - media can't be swapped before then.
+u8 *FloppyCacheBuf VARLOW;
+u16 FloppyCacheSize VARLOW;
+u8 FloppyCacheDrive VARLOW; // floppyid + 1 of the cached cylinder
+u8 FloppyCacheCyl VARLOW;
+u8 FloppyCacheMedia[2] VARLOW; // FloppyInfo index of the sensed media
+u8 FloppyCacheFailed VARLOW; // Drives whose media can't be read by cylinder
+
+static void
+floppy_cache_invalidate(void)
+{
+    if (CONFIG_FLOPPY_TRACK_CACHE)
+        SET_LOW(FloppyCacheDrive, 0);
+}
+
+// Note the media found by floppy_media_sense()
+static void
+floppy_cache_media(u8 floppyid, u8 stype)
+{
+    if (!CONFIG_FLOPPY_TRACK_CACHE)
+        return;
+    SET_LOW(FloppyCacheMedia[floppyid], stype);
+    SET_LOW(FloppyCacheFailed, GET_LOW(FloppyCacheFailed) & ~(1 << floppyid));
+}
+
+static void
+floppy_cache_setup(u32 size)
+{
+    if (!CONFIG_FLOPPY_TRACK_CACHE || !size)
+        return;
+    // The buffer must not cross a 64KiB boundary
+    u8 *buf = malloc_low(size);
+    if (buf && ((u32)buf >> 16) != (((u32)buf + size - 1) >> 16)) {
+        free(buf);
+        u32 align = 1;
+        while (align < size)
+            align <<= 1;
+        buf = memalign_low(align, size);
+    }
+    if (!buf) {
+        warn_noalloc();
+        return;
+    }
+    FloppyCacheBuf = buf;
+    FloppyCacheSize = size;
+}
+
+// Transfer via the cache buffer if the caller's buffer isn't dma-able
+static int
+floppy_dma_cmd(struct disk_op_s *op, int count, int command, u8 *param)
+{
+    u8 floppyid = GET_GLOBALFLAT(op->drive_fl->cntl_id);
+    int ret = floppy_dma_xfer(floppyid, op->buf_fl, count, command, param);
+    u8 *bounce = GET_LOW(FloppyCacheBuf);
+    if (ret != DISK_RET_EBOUNDARY || !CONFIG_FLOPPY_TRACK_CACHE || !bounce
+        || count > GET_LOW(FloppyCacheSize))
+        return ret;
+
+    floppy_cache_invalidate();
+    int isWrite = command != FC_READ;
+    if (isWrite)
+        memcpy_fl(bounce, op->buf_fl, count);
+    ret = floppy_dma_xfer(floppyid, bounce, count, command, param);
+    if (!ret && !isWrite)
+        memcpy_fl(op->buf_fl, bounce, count);
+    return ret;
+}
+
+// Serve a read from the cached cylinder, reading it in first if needed.
+// Returns -1 if the request should be read directly instead.
+static int
+floppy_cache_read(struct disk_op_s *op, struct chs_s chs)
+{
+    u8 *cache = GET_LOW(FloppyCacheBuf);
+    if (!CONFIG_FLOPPY_TRACK_CACHE || !cache)
+        return -1;
+    u8 floppyid = GET_GLOBALFLAT(op->drive_fl->cntl_id);
+    int hit = (GET_LOW(FloppyCacheDrive) == floppyid + 1
+               && GET_LOW(FloppyCacheCyl) == chs.cylinder);
+    if (!hit) {
+        if (GET_LOW(FloppyCacheFailed) & (1 << floppyid))
+            return -1;
+        floppy_cache_invalidate();
+        // Sense the media (if needed) to find the track layout
+        int ret = floppy_prep(op->drive_fl, chs.cylinder);
+        if (ret)
+            return ret;
+    }
+    u8 stype = GET_LOW(FloppyCacheMedia[floppyid]);
+    u16 nlh = GET_GLOBAL(FloppyInfo[stype].chs.head);
+    u16 nls = GET_GLOBAL(FloppyInfo[stype].chs.sector);
+    u32 size = nlh * nls * DISK_SECTOR_SIZE;
+    u32 start = (chs.head * nls + chs.sector - 1) * DISK_SECTOR_SIZE;
+    u32 len = op->count * DISK_SECTOR_SIZE;
+    if (size > GET_LOW(FloppyCacheSize) || start + len > size)
+        return -1;
+
+    if (hit) {
+        // Keep the motor (and thus the cache) alive
+        SET_BDA(floppy_motor_counter, FLOPPY_MOTOR_TICKS);
+    } else {
+        // read both heads of the cylinder with the MT bit of FC_READ
+        u8 param[8];
+        param[0] = floppyid; // HD DR1 DR2 - starting at head 0
+        param[1] = chs.cylinder;
+        param[2] = 0;
+        param[3] = 1;
+        param[4] = FLOPPY_SIZE_CODE;
+        param[5] = nls; // last sector on each track
+        param[6] = FLOPPY_GAPLEN;
+        param[7] = FLOPPY_DATALEN;
+        int ret = floppy_dma_xfer(floppyid, cache, size, FC_READ, param);
+        if (ret) {
+            // Don't try again until the media changes
+            SET_LOW(FloppyCacheFailed
+                    , GET_LOW(FloppyCacheFailed) | (1 << floppyid));
+            return -1;
+        }
+        SET_LOW(FloppyCacheDrive, floppyid + 1);
+        SET_LOW(FloppyCacheCyl, chs.cylinder);
+    }
+    memcpy_fl(op->buf_fl, cache + start, len);
+    return DISK_RET_SUCCESS;
+}
+
+
 /****************************************************************
  * Floppy handlers
  ****************************************************************/
@@ -597,6 +741,7 @@ floppy_reset(struct disk_op_s *op)
     SET_BDA(floppy_track[0], 0);
     SET_BDA(floppy_track[1], 0);
     SET_BDA(floppy_last_data_rate, 0);
+    floppy_cache_invalidate();
     floppy_disable_controller();
     return floppy_enable_controller();
 }
@@ -606,7 +751,10 @@ static int
 floppy_read(struct disk_op_s *op)
 {
     struct chs_s chs = lba2chs(op);
-    int ret = floppy_prep(op->drive_fl, chs.cylinder);
+    int ret = floppy_cache_read(op, chs);
+    if (ret >= 0)
+        return ret;
+    ret = floppy_prep(op->drive_fl, chs.cylinder);
     if (ret)
         return ret;
 
@@ -629,6 +777,7 @@ static int
 floppy_write(struct disk_op_s *op)
 {
     struct chs_s chs = lba2chs(op);
+    floppy_cache_invalidate();
     int ret = floppy_prep(op->drive_fl, chs.cylinder);
     if (ret)
         return ret;
@@ -665,6 +814,7 @@ static int
 floppy_format(struct disk_op_s *op)
 {
     struct chs_s chs = lba2chs(op);
+    floppy_cache_invalidate();
     int ret = floppy_prep(op->drive_fl, chs.cylinder);
     if (ret)
         return ret;
@@ -734,8 +884,10 @@ floppy_tick(void)
     if (fcount) {
         fcount--;
         SET_BDA(floppy_motor_counter, fcount);
-        if (fcount == 0)
+        if (fcount == 0) {
             // turn motor(s) off
             floppy_dor_mask(FLOPPY_DOR_MOTOR_MASK, 0);
+            floppy_cache_invalidate();
+        }
     }
 }
@@ -23,14 +23,11 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep
+#include "util.h" // bootprio_find_scsi_device
 
 #define LSI_REG_DSTAT     0x0c
 #define LSI_REG_ISTAT0    0x14
 #define LSI_REG_DSP0      0x2c
-#define LSI_REG_DSP1      0x2d
-#define LSI_REG_DSP2      0x2e
-#define LSI_REG_DSP3      0x2f
 #define LSI_REG_SIST0     0x42
 #define LSI_REG_SIST1     0x43
 
@@ -43,14 +40,47 @@
 #define LSI_ISTAT0_SRST   0x40
 #define LSI_ISTAT0_ABRT   0x80
 
+#define LSI_MOVE_MAX      (8*1024*1024) // block move counts are 24 bits
+#define LSI_SG_ENTRIES    4
+
+// Resident SCRIPTS program - one per controller, patched per command
+struct lsi_script_s {
+    u32 head[14];                       // select, msgout, cmd, disconnect
+    u32 data[(LSI_SG_ENTRIES + 1) * 2]; // block moves, then jump to tail
+    u32 tail[6];                        // status, msgin, dma irq
+    u8 cdb[16];
+    u8 msgout[2];
+    u8 msgin_tmp[2];
+    u8 status;
+    u8 msgin;
+};
+
 struct lsi_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
+    struct lsi_script_s *script;
     u32 iobase;
     u8 target;
     u8 lun;
 };
 
+// Check for script completion (dma interrupt) or a scsi error
+static int
+lsi_scsi_done(void *data)
+{
+    u32 iobase = (u32)data;
+    u8 istat = inb(iobase + LSI_REG_ISTAT0);
+    if (istat & LSI_ISTAT0_SIP) {
+        u8 sist0 = inb(iobase + LSI_REG_SIST0);
+        u8 sist1 = inb(iobase + LSI_REG_SIST1);
+        if (sist0 || sist1)
+            return -1;
+    }
+    if (!(istat & LSI_ISTAT0_DIP))
+        return 0;
+    return inb(iobase + LSI_REG_DSTAT) & 0x04;
+}
+
 int
 lsi_scsi_process_op(struct disk_op_s *op)
 {
@@ -58,88 +88,103 @@ lsi_scsi_process_op(struct disk_op_s *op)
         return DISK_RET_EBADTRACK;
     struct lsi_lun_s *llun_gf =
         container_of(op->drive_fl, struct lsi_lun_s, drive);
-    u16 target = GET_GLOBALFLAT(llun_gf->target);
-    u16 lun = GET_GLOBALFLAT(llun_gf->lun);
+    struct lsi_script_s *script = GET_GLOBALFLAT(llun_gf->script);
     u8 cdbcmd[16];
     int blocksize = scsi_fill_cmd(op, cdbcmd, sizeof(cdbcmd));
     if (blocksize < 0)
         return default_process_op(op);
     u32 iobase = GET_GLOBALFLAT(llun_gf->iobase);
-    u32 dma = ((scsi_is_read(op) ? 0x01000000 : 0x00000000) |
-               (op->count * blocksize));
-    u8 msgout[] = {
-        0x80 | lun,                 // select lun
-        0x08,
-    };
-    u8 status = 0xff;
-    u8 msgin_tmp[2];
-    u8 msgin = 0xff;
+    u32 len = op->count * blocksize, buf = (u32)op->buf_fl;
+    if (len > LSI_SG_ENTRIES * LSI_MOVE_MAX)
+        goto fail;
+
+    // Patch the resident program for this command
+    u16 target = GET_GLOBALFLAT(llun_gf->target);
+    SET_LOWFLAT(script->head[0], 0x40000000 | target << 16);
+    SET_LOWFLAT(script->msgout[0], 0x80 | GET_GLOBALFLAT(llun_gf->lun));
+    int i;
+    for (i = 0; i < sizeof(cdbcmd); i++)
+        SET_LOWFLAT(script->cdb[i], cdbcmd[i]);
+    u32 move = scsi_is_read(op) ? 0x01000000 : 0x00000000;
+    i = 0;
+    do {
+        u32 n = len < LSI_MOVE_MAX ? len : LSI_MOVE_MAX;
+        SET_LOWFLAT(script->data[i++], move | n); // dma data
+        SET_LOWFLAT(script->data[i++], buf);
+        buf += n;
+        len -= n;
+    } while (len);
+    SET_LOWFLAT(script->data[i++], 0x80080000);   // jump to status phase
+    SET_LOWFLAT(script->data[i], (u32)script->tail);
+    SET_LOWFLAT(script->status, 0xff);
+    SET_LOWFLAT(script->msgin, 0xff);
+
+    outl((u32)script->head, iobase + LSI_REG_DSP0);
+
+    if (wait_completion(lsi_scsi_done, (void*)iobase, DISK_REQUEST_TIMEOUT))
+        goto fail;
+
+    if (GET_LOWFLAT(script->msgin) == 0 && GET_LOWFLAT(script->status) == 0) {
+        return DISK_RET_SUCCESS;
+    }
 
-    u32 script[] = {
+fail:
+    return DISK_RET_EBADTRACK;
+}
+
+// Allocate the SCRIPTS program shared by all luns of a controller
+static struct lsi_script_s *
+lsi_scsi_alloc_script(void)
+{
+    struct lsi_script_s *s = memalign_low(16, sizeof(*s));
+    if (!s) {
+        warn_noalloc();
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    u32 head[] = {
         /* select target, send scsi command */
-        0x40000000 | target << 16,  // select target
+        0x40000000,                 // select target (patched per command)
         0x00000000,
         0x06000001,                 // msgout
-        (u32)MAKE_FLATPTR(GET_SEG(SS), &msgout),
+        (u32)s->msgout,
         0x02000010,                 // scsi command
-        (u32)MAKE_FLATPTR(GET_SEG(SS), cdbcmd),
+        (u32)s->cdb,
 
         /* handle disconnect */
         0x87820000,                 // phase == msgin ?
         0x00000018,
         0x07000002,                 // msgin
-        (u32)MAKE_FLATPTR(GET_SEG(SS), &msgin_tmp),
+        (u32)s->msgin_tmp,
         0x50000000,                 // re-select
         0x00000000,
         0x07000002,                 // msgin
-        (u32)MAKE_FLATPTR(GET_SEG(SS), &msgin_tmp),
-
-        /* dma data, get status, raise irq */
-        dma,                        // dma data
-        (u32)op->buf_fl,
+        (u32)s->msgin_tmp,
+    };
+    u32 tail[] = {
+        /* get status, raise irq */
         0x03000001,                 // status
-        (u32)MAKE_FLATPTR(GET_SEG(SS), &status),
+        (u32)&s->status,
         0x07000001,                 // msgin
-        (u32)MAKE_FLATPTR(GET_SEG(SS), &msgin),
+        (u32)&s->msgin,
         0x98080000,                 // dma irq
         0x00000000,
     };
-    u32 dsp = (u32)MAKE_FLATPTR(GET_SEG(SS), &script);
-
-    outb(dsp         & 0xff, iobase + LSI_REG_DSP0);
-    outb((dsp >>  8) & 0xff, iobase + LSI_REG_DSP1);
-    outb((dsp >> 16) & 0xff, iobase + LSI_REG_DSP2);
-    outb((dsp >> 24) & 0xff, iobase + LSI_REG_DSP3);
-
-    for (;;) {
-        u8 dstat = inb(iobase + LSI_REG_DSTAT);
-        u8 sist0 = inb(iobase + LSI_REG_SIST0);
-        u8 sist1 = inb(iobase + LSI_REG_SIST1);
-        if (sist0 || sist1) {
-            goto fail;
-        }
-        if (dstat & 0x04) {
-            break;
-        }
-        usleep(5);
-    }
-
-    if (msgin == 0 && status == 0) {
-        return DISK_RET_SUCCESS;
-    }
-
-fail:
-    return DISK_RET_EBADTRACK;
+    memcpy(s->head, head, sizeof(head));
+    memcpy(s->tail, tail, sizeof(tail));
+    s->msgout[1] = 0x08;
+    return s;
 }
 
 static void
 lsi_scsi_init_lun(struct lsi_lun_s *llun, struct pci_device *pci, u32 iobase,
-                  u8 target, u8 lun)
+                  struct lsi_script_s *script, u8 target, u8 lun)
 {
     memset(llun, 0, sizeof(*llun));
     llun->drive.type = DTYPE_LSI_SCSI;
     llun->drive.cntl_id = pci->bdf;
     llun->pci = pci;
+    llun->script = script;
     llun->target = target;
     llun->lun = lun;
     llun->iobase = iobase;
@@ -156,7 +201,7 @@ lsi_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
         return -1;
     }
     lsi_scsi_init_lun(llun, tmpl_llun->pci, tmpl_llun->iobase,
-                      tmpl_llun->target, lun);
+                      tmpl_llun->script, tmpl_llun->target, lun);
 
     boot_lchs_find_scsi_device(llun->pci, llun->target, llun->lun,
                                &(llun->drive.lchs));
@@ -167,6 +212,8 @@ lsi_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
     free(name);
     if (ret)
         goto fail;
+    u32 max = LSI_SG_ENTRIES * LSI_MOVE_MAX / llun->drive.blksize;
+    llun->drive.max_blocks = max < 0xffff ? max : 0xffff;
     return 0;
 
 fail:
@@ -175,11 +222,12 @@ fail:
 }
 
 static void
-lsi_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+lsi_scsi_scan_target(struct pci_device *pci, u32 iobase,
+                     struct lsi_script_s *script, u8 target)
 {
     struct lsi_lun_s llun0;
 
-    lsi_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    lsi_scsi_init_lun(&llun0, pci, iobase, script, target, 0);
 
     if (scsi_rep_luns_scan(&llun0.drive, lsi_scsi_add_lun) < 0)
         scsi_sequential_scan(&llun0.drive, 8, lsi_scsi_add_lun);
@@ -196,12 +244,16 @@ init_lsi_scsi(void *data)
 
     dprintf(1, "found lsi53c895a at %pP, io @ %x\n", pci, iobase);
 
+    struct lsi_script_s *script = lsi_scsi_alloc_script();
+    if (!script)
+        return;
+
     // reset
     outb(LSI_ISTAT0_SRST, iobase + LSI_REG_ISTAT0);
 
     int i;
     for (i = 0; i < 7; i++)
-        lsi_scsi_scan_target(pci, iobase, i);
+        lsi_scsi_scan_target(pci, iobase, script, i);
 }
 
 void
@@ -218,6 +270,8 @@ lsi_scsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_LSI_LOGIC
             || pci->device != PCI_DEVICE_ID_LSI_53C895A)
             continue;
+        if (boot_defer_pci(init_lsi_scsi, pci))
+            continue;
         run_thread(init_lsi_scsi, pci);
     }
 }
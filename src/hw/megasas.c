@@ -20,7 +20,7 @@
 #include "pcidevice.h" // foreachpci
 #include "pci_ids.h" // PCI_DEVICE_ID_XXX
 #include "pci_regs.h" // PCI_VENDOR_ID
-#include "stacks.h" // yield
+#include "stacks.h" // wait_completion
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
 #include "util.h" // timer_calc
@@ -87,6 +87,14 @@ struct megasas_cmd_frame {
             u32 sgl_addr;     /*30h */
             u32 sgl_len;      /*34h */
         } pthru;
+        struct {
+            u32 sense_buf_lo; /*18h */
+            u32 sense_buf_hi; /*1Ch */
+            u32 start_lba_lo; /*20h */
+            u32 start_lba_hi; /*24h */
+            u32 sgl_addr;     /*28h */
+            u32 sgl_len;      /*2Ch */
+        } io;
         struct {
             u8 pad[22];       /*18h */
         } gen;
@@ -108,21 +116,34 @@ struct mfi_ld_list_s {
 
 #define MEGASAS_POLL_TIMEOUT 60000 // 60 seconds polling timeout
 
+#define MEGASAS_FRAMES 4            // frames outstanding per lun
+#define MEGASAS_MAX_XFER (64*1024)  // data length of one LD_READ/LD_WRITE
+
+#define MFI_FRAME_DONT_POST_IN_REPLY_QUEUE 0x0001
+#define MFI_FRAME_DIR_WRITE 0x0008
+#define MFI_FRAME_DIR_READ  0x0010
+
 struct megasas_lun_s {
     struct drive_s drive;
-    struct megasas_cmd_frame *frame;
+    struct megasas_cmd_frame *frame; // pool of MEGASAS_FRAMES frames
     u32 iobase;
     u16 pci_id;
     u8 target;
     u8 lun;
 };
 
-static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
-                            struct megasas_cmd_frame *frame)
+static int megasas_cmd_done(void *data)
+{
+    struct megasas_cmd_frame *frame = data;
+    return GET_LOWFLAT(frame->cmd_status) != 0xff;
+}
+
+// Hand a frame to the firmware via the inbound queue port
+static void megasas_post_frame(u16 pci_id, u32 ioaddr,
+                               struct megasas_cmd_frame *frame)
 {
     u32 frame_addr = (u32)frame;
     int frame_count = 1;
-    u8 cmd_state;
 
     dprintf(2, "Frame 0x%x\n", frame_addr);
     if (pci_id == PCI_DEVICE_ID_LSI_SAS2004 ||
@@ -136,38 +157,97 @@ static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
     } else {
         outl(frame_addr | frame_count << 1 | 1, ioaddr + MFI_IQP);
     }
+}
 
-    u32 end = timer_calc(MEGASAS_POLL_TIMEOUT);
-    do {
-        for (;;) {
-            cmd_state = GET_LOWFLAT(frame->cmd_status);
-            if (cmd_state != 0xff)
-                break;
-            if (timer_check(end)) {
-                warn_timeout();
-                return -1;
-            }
-            yield();
-        }
-    } while (cmd_state == 0xff);
+// Wait for the firmware to complete a posted frame
+static int megasas_wait_frame(struct megasas_cmd_frame *frame)
+{
+    if (wait_completion(megasas_cmd_done, frame, MEGASAS_POLL_TIMEOUT))
+        return -1;
+    u8 cmd_state = GET_LOWFLAT(frame->cmd_status);
 
     if (cmd_state == 0 || cmd_state == 0x2d)
         return 0;
-    dprintf(1, "ERROR: Frame 0x%x, status 0x%x\n", frame_addr, cmd_state);
+    dprintf(1, "ERROR: Frame 0x%x, status 0x%x\n", (u32)frame, cmd_state);
     return -1;
 }
 
+static int megasas_fire_cmd(u16 pci_id, u32 ioaddr,
+                            struct megasas_cmd_frame *frame)
+{
+    megasas_post_frame(pci_id, ioaddr, frame);
+    return megasas_wait_frame(frame);
+}
+
+// Fill an LD_READ/LD_WRITE frame for part of a request
+static void
+megasas_fill_io(struct megasas_cmd_frame *frame, struct megasas_lun_s *mlun_gf
+                , struct disk_op_s *op, u64 lba, u32 count, u32 buf)
+{
+    u32 len = count * GET_GLOBALFLAT(mlun_gf->drive.blksize);
+    int iswrite = op->command == CMD_WRITE;
+    memset_fl(frame, 0, sizeof(*frame));
+    SET_LOWFLAT(frame->cmd, iswrite ? MFI_CMD_LD_WRITE : MFI_CMD_LD_READ);
+    SET_LOWFLAT(frame->cmd_status, 0xFF);
+    SET_LOWFLAT(frame->target_id, GET_GLOBALFLAT(mlun_gf->target));
+    SET_LOWFLAT(frame->sge_count, 1);
+    SET_LOWFLAT(frame->flags, MFI_FRAME_DONT_POST_IN_REPLY_QUEUE
+                | (iswrite ? MFI_FRAME_DIR_WRITE : MFI_FRAME_DIR_READ));
+    SET_LOWFLAT(frame->data_xfer_len, count); // lba count for io frames
+    SET_LOWFLAT(frame->io.start_lba_lo, (u32)lba);
+    SET_LOWFLAT(frame->io.start_lba_hi, (u32)(lba >> 32));
+    SET_LOWFLAT(frame->io.sgl_addr, buf);
+    SET_LOWFLAT(frame->io.sgl_len, len);
+    SET_LOWFLAT(frame->context, (u32)frame);
+}
+
+// Split a read or write over the frame pool so several are in flight
+static int
+megasas_process_rw(struct disk_op_s *op, struct megasas_lun_s *mlun_gf)
+{
+    struct megasas_cmd_frame *pool = GET_GLOBALFLAT(mlun_gf->frame);
+    u16 pci_id = GET_GLOBALFLAT(mlun_gf->pci_id);
+    u32 iobase = GET_GLOBALFLAT(mlun_gf->iobase);
+    u32 blksize = GET_GLOBALFLAT(mlun_gf->drive.blksize);
+    u32 chunk = MEGASAS_MAX_XFER / blksize;
+    u32 done = 0, count = op->count;
+    int ret = DISK_RET_SUCCESS;
+    while (done < count) {
+        int num = 0, i;
+        while (num < MEGASAS_FRAMES && done < count) {
+            u32 n = count - done < chunk ? count - done : chunk;
+            megasas_fill_io(&pool[num], mlun_gf, op, op->lba + done, n
+                            , (u32)op->buf_fl + done * blksize);
+            megasas_post_frame(pci_id, iobase, &pool[num]);
+            done += n;
+            num++;
+        }
+        // Frames complete in any order - waiting on each in turn
+        // returns once all of them are done.
+        for (i = 0; i < num; i++)
+            if (megasas_wait_frame(&pool[i]))
+                ret = DISK_RET_EBADTRACK;
+        if (ret)
+            break;
+    }
+    return ret;
+}
+
 int
 megasas_process_op(struct disk_op_s *op)
 {
     if (!CONFIG_MEGASAS)
         return DISK_RET_EBADTRACK;
+    struct megasas_lun_s *mlun_gf =
+        container_of(op->drive_fl, struct megasas_lun_s, drive);
+    u32 blksize = GET_GLOBALFLAT(mlun_gf->drive.blksize);
+    if ((op->command == CMD_READ || op->command == CMD_WRITE)
+        && blksize && blksize <= MEGASAS_MAX_XFER)
+        return megasas_process_rw(op, mlun_gf);
     u8 cdb[16];
     int blocksize = scsi_fill_cmd(op, cdb, sizeof(cdb));
     if (blocksize < 0)
         return default_process_op(op);
-    struct megasas_lun_s *mlun_gf =
-        container_of(op->drive_fl, struct megasas_lun_s, drive);
     struct megasas_cmd_frame *frame = GET_GLOBALFLAT(mlun_gf->frame);
     u16 pci_id = GET_GLOBALFLAT(mlun_gf->pci_id);
     int i;
@@ -219,7 +299,8 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
     mlun->target = target;
     mlun->lun = lun;
     mlun->iobase = iobase;
-    mlun->frame = memalign_low(256, sizeof(struct megasas_cmd_frame));
+    mlun->frame = memalign_low(256, sizeof(struct megasas_cmd_frame)
+                               * MEGASAS_FRAMES);
     if (!mlun->frame) {
         warn_noalloc();
         free(mlun);
@@ -235,11 +316,28 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
         free(mlun->frame);
         free(mlun);
         ret = -1;
+    } else {
+        mlun->drive.max_blocks = 0xffff;
     }
 
     return ret;
 }
 
+struct megasas_ld_probe_s {
+    struct pci_device *pci;
+    u32 iobase;
+    u8 target;
+    u8 lun;
+};
+
+static void
+megasas_probe_ld(void *data)
+{
+    struct megasas_ld_probe_s *probe = data;
+    megasas_add_lun(probe->pci, probe->iobase, probe->target, probe->lun);
+    free(probe);
+}
+
 static void megasas_scan_target(struct pci_device *pci, u32 iobase)
 {
     struct mfi_ld_list_s ld_list;
@@ -269,10 +367,20 @@ static void megasas_scan_target(struct pci_device *pci, u32 iobase)
             dprintf(2, "LD %d:%d state 0x%x\n",
                     ld_list.lds[i].target, ld_list.lds[i].lun,
                     ld_list.lds[i].state);
-            if (ld_list.lds[i].state != 0) {
+            if (ld_list.lds[i].state == 0)
+                continue;
+            // Each logical drive has its own frames - probe them in parallel
+            struct megasas_ld_probe_s *probe = malloc_tmp(sizeof(*probe));
+            if (!probe) {
                 megasas_add_lun(pci, iobase,
                                 ld_list.lds[i].target, ld_list.lds[i].lun);
+                continue;
             }
+            probe->pci = pci;
+            probe->iobase = iobase;
+            probe->target = ld_list.lds[i].target;
+            probe->lun = ld_list.lds[i].lun;
+            run_thread_prio(megasas_probe_ld, probe, boot_thread_prio(pci));
         }
     }
 }
@@ -400,7 +508,10 @@ megasas_setup(void)
             pci->device == PCI_DEVICE_ID_LSI_VERDE_ZCR ||
             pci->device == PCI_DEVICE_ID_DELL_PERC5 ||
             pci->device == PCI_DEVICE_ID_LSI_SAS2208 ||
-            pci->device == PCI_DEVICE_ID_LSI_SAS3108)
+            pci->device == PCI_DEVICE_ID_LSI_SAS3108) {
+            if (boot_defer_pci(init_megasas, pci))
+                continue;
             run_thread(init_megasas, pci);
+        }
     }
 }
@@ -37,19 +37,39 @@
 #define MPT_IMASK_DOORBELL 0x01
 #define MPT_IMASK_REPLY    0x08
 
+#define MPT_REPLY_EMPTY   0xffffffff
+
 struct mpt_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
+    struct mpt_ctrl_s *ctrl;
     u32 iobase;
     u8 target;
     u8 lun;
 };
 
-u8 reply_msg[4] __attribute((aligned(4))) VARLOW;
-
 #define MPT_MESSAGE_HDR_FUNCTION_SCSI_IO_REQUEST        (0x00)
 #define MPT_MESSAGE_HDR_FUNCTION_IOC_INIT               (0x02)
 
+struct mpt_reply_s {
+    u8     TargetID;            /* Target ID */
+    u8     Bus;                 /* Bus number */
+    u8     MessageLength;       /* Message length */
+    u8     Function;            /* Function number. */
+    u8     CDBLength;           /* CDB length. */
+    u8     SenseBufferLength;   /* Sense buffer length. */
+    u8     Reserved;            /* Reserved */
+    u8     MessageFlags;        /* Message flags. */
+    u32    MessageContext;      /* Message context ID. */
+    u8     SCSIStatus;          /* SCSI status. */
+    u8     SCSIState;           /* SCSI state. */
+    u16    IOCStatus;           /* IO controller status. */
+    u32    IOCLogInfo;          /* IO controller log information. */
+    u32    TransferCount;       /* Transfer count. */
+    u32    SenseCount;          /* Sense count. */
+    u32    ResponseInfo;        /* Response information. */
+} __attribute__((packed));
+
 static struct MptIOCInitRequest
 {
     u8     WhoInit;             /* Which system sent this init request. */
@@ -70,7 +90,7 @@ static struct MptIOCInitRequest
     .Function = MPT_MESSAGE_HDR_FUNCTION_IOC_INIT,
     .MaxDevices = 8,
     .MaxBuses = 1,
-    .ReplyFrameSize = sizeof(reply_msg),
+    .ReplyFrameSize = sizeof(struct mpt_reply_s),
     .HostMfaHighAddr = 0,
     .SenseBufferHighAddr = 0
 };
@@ -114,26 +134,39 @@ typedef struct MptSGEntrySimple32 {
     u32 DataBufferAddressLow;
 } __attribute__((packed)) MptSGEntrySimple32_t;
 
-static int
-mpt_scsi_cmd(u32 iobase, struct disk_op_s *op,
-             u8 *cdb, u16 target, u16 lun, u16 blocksize)
-{
-    u32 end = timer_calc(MPT_POLL_TIMEOUT);
+#define MPT_REQS          4 // request frames outstanding at once
+#define MPT_REPLIES       4 // reply frames posted to the free queue
+#define MPT_MAX_XFER      (64*1024)
+#define MPT_CONTEXT_SLOT  0x0f
+
+struct mpt_req_s {
+    MptSCSIIORequest_t      scsi_io;
+    MptSGEntrySimple32_t    sge;
+} __attribute__((packed));
+
+// Request and reply frames of a controller - kept in low memory
+struct mpt_ctrl_s {
+    struct mpt_req_s reqs[MPT_REQS];
+    struct mpt_reply_s replies[MPT_REPLIES];
+    u8 sense[MPT_REQS][20];
+};
 
-    u8 sense_buf[18];
-    struct scsi_req {
-        MptSCSIIORequest_t      scsi_io;
-        MptSGEntrySimple32_t    sge;
-    } __attribute__((packed, aligned(4))) req = {
+// Fill and post one SCSI IO request frame from the pool
+static void
+mpt_scsi_post(struct mpt_ctrl_s *ctrl, u32 iobase, struct disk_op_s *op,
+              u8 *cdb, u16 target, u16 lun, u16 blocksize, u32 context)
+{
+    int slot = context & MPT_CONTEXT_SLOT;
+    struct mpt_req_s req = {
         .scsi_io = {
             .TargetID = target,
             .Bus = 0,
             .Function = MPT_MESSAGE_HDR_FUNCTION_SCSI_IO_REQUEST,
             .CDBLength = 16,
-            .SenseBufferLength = 18,
-            .MessageContext = end & 0x7fffffff,
+            .SenseBufferLength = sizeof(ctrl->sense[0]),
+            .MessageContext = context,
             .DataLength = op->count * blocksize,
-            .SenseBufferLowAddr = (u32)MAKE_FLATPTR(GET_SEG(SS), &sense_buf[0]),
+            .SenseBufferLowAddr = (u32)ctrl->sense[slot],
         },
         .sge = {
             /* end of list, simple entry, end of buffer, last element */
@@ -153,27 +186,45 @@ mpt_scsi_cmd(u32 iobase, struct disk_op_s *op,
         }
     }
 
-    outl((u32)MAKE_FLATPTR(GET_SEG(SS), &req), iobase + MPT_REG_REQ_Q);
+    struct mpt_req_s *frame = &ctrl->reqs[slot];
+    memcpy_fl(frame, MAKE_FLATPTR(GET_SEG(SS), &req), sizeof(req));
+    outl((u32)frame, iobase + MPT_REG_REQ_Q);
+}
 
-    for (;;) {
-        if (timer_check(end)) {
+// Drain the reply queue until the 'num' requests tagged 'tag' complete
+static int
+mpt_scsi_reap(u32 iobase, u32 tag, int num)
+{
+    u32 end = timer_calc(MPT_POLL_TIMEOUT);
+    u32 pending = (1 << num) - 1;
+    int ret = DISK_RET_SUCCESS;
+    while (pending) {
+        if (timer_check(end))
             return DISK_RET_ETIMEOUT;
+        if (!(inl(iobase + MPT_REG_ISTATUS) & MPT_IMASK_REPLY)) {
+            usleep(50);
+            continue;
         }
-
-        u32 istatus = inl(iobase + MPT_REG_ISTATUS);
-        if (istatus & MPT_IMASK_REPLY) {
+        // Reading the queue until it is empty also clears the interrupt
+        for (;;) {
             u32 resp = inl(iobase + MPT_REG_REP_Q);
-            /* another read to turn interrupt off */
-            inl(iobase + MPT_REG_REP_Q);
-            if (resp == req.scsi_io.MessageContext) {
-                return DISK_RET_SUCCESS;
-            } else if (resp & 0x80000000) {
-                outl((u32)&reply_msg[0], iobase + MPT_REG_REP_Q);
-                return DISK_RET_EBADTRACK;
+            if (resp == MPT_REPLY_EMPTY)
+                break;
+            u32 context = resp;
+            if (resp & 0x80000000) {
+                // Address reply - an error report in a reply frame
+                struct mpt_reply_s *reply = (void*)(resp << 1);
+                context = GET_LOWFLAT(reply->MessageContext);
+                outl((u32)reply, iobase + MPT_REG_REP_Q);
             }
+            if ((context & ~MPT_CONTEXT_SLOT) != tag)
+                continue;
+            pending &= ~(1 << (context & MPT_CONTEXT_SLOT));
+            if (resp & 0x80000000)
+                ret = DISK_RET_EBADTRACK;
         }
-        usleep(50);
     }
+    return ret;
 }
 
 int
@@ -182,27 +233,53 @@ mpt_scsi_process_op(struct disk_op_s *op)
     if (!CONFIG_MPT_SCSI)
         return DISK_RET_EBADTRACK;
 
-    u8 cdbcmd[16];
-    int blocksize = scsi_fill_cmd(op, cdbcmd, sizeof(cdbcmd));
-    if (blocksize < 0)
-        return default_process_op(op);
-
     struct mpt_lun_s *llun_gf =
         container_of(op->drive_fl, struct mpt_lun_s, drive);
     u16 target = GET_GLOBALFLAT(llun_gf->target);
     u16 lun = GET_GLOBALFLAT(llun_gf->lun);
     u32 iobase = GET_GLOBALFLAT(llun_gf->iobase);
-    return mpt_scsi_cmd(iobase, op, cdbcmd, target, lun, blocksize);
+    struct mpt_ctrl_s *ctrl = GET_GLOBALFLAT(llun_gf->ctrl);
+
+    // Reads and writes are split over the request pool so several
+    // frames are outstanding at once.
+    u16 count = op->count, chunk = count, done = 0;
+    u32 blksize = GET_GLOBALFLAT(op->drive_fl->blksize);
+    if ((op->command == CMD_READ || op->command == CMD_WRITE)
+        && blksize && blksize <= MPT_MAX_XFER)
+        chunk = MPT_MAX_XFER / blksize;
+    struct disk_op_s dop = *op;
+    do {
+        u32 tag = (timer_calc(0) << 4) & ~(0x80000000 | MPT_CONTEXT_SLOT);
+        int num = 0;
+        do {
+            dop.count = count - done < chunk ? count - done : chunk;
+            dop.lba = op->lba + done;
+            dop.buf_fl = op->buf_fl + done * blksize;
+            u8 cdbcmd[16];
+            int blocksize = scsi_fill_cmd(&dop, cdbcmd, sizeof(cdbcmd));
+            if (blocksize < 0)
+                return default_process_op(op);
+            mpt_scsi_post(ctrl, iobase, &dop, cdbcmd, target, lun, blocksize
+                          , tag | num);
+            done += dop.count;
+            num++;
+        } while (num < MPT_REQS && done < count);
+        int ret = mpt_scsi_reap(iobase, tag, num);
+        if (ret)
+            return ret;
+    } while (done < count);
+    return DISK_RET_SUCCESS;
 }
 
 static void
 mpt_scsi_init_lun(struct mpt_lun_s *llun, struct pci_device *pci,
-                  u32 iobase, u8 target, u8 lun)
+                  u32 iobase, struct mpt_ctrl_s *ctrl, u8 target, u8 lun)
 {
     memset(llun, 0, sizeof(*llun));
     llun->drive.type = DTYPE_MPT_SCSI;
     llun->drive.cntl_id = pci->bdf;
     llun->pci = pci;
+    llun->ctrl = ctrl;
     llun->target = target;
     llun->lun = lun;
     llun->iobase = iobase;
@@ -219,7 +296,7 @@ mpt_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
         return -1;
     }
     mpt_scsi_init_lun(llun, tmpl_llun->pci, tmpl_llun->iobase,
-                      tmpl_llun->target, lun);
+                      tmpl_llun->ctrl, tmpl_llun->target, lun);
 
     boot_lchs_find_scsi_device(llun->pci, llun->target, llun->lun,
                                &(llun->drive.lchs));
@@ -231,6 +308,7 @@ mpt_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
     if (ret) {
         goto fail;
     }
+    llun->drive.max_blocks = 0xffff;
     return 0;
 
 fail:
@@ -239,11 +317,12 @@ fail:
 }
 
 static void
-mpt_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+mpt_scsi_scan_target(struct pci_device *pci, u32 iobase,
+                     struct mpt_ctrl_s *ctrl, u8 target)
 {
     struct mpt_lun_s llun0;
 
-    mpt_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    mpt_scsi_init_lun(&llun0, pci, iobase, ctrl, target, 0);
 
     if (scsi_rep_luns_scan(&llun0.drive, mpt_scsi_add_lun) < 0)
         scsi_sequential_scan(&llun0.drive, 8, mpt_scsi_add_lun);
@@ -264,6 +343,12 @@ init_mpt_scsi(void *data)
     if (!iobase)
         return;
     struct MptIOCInitReply MptIOCInitReply;
+    struct mpt_ctrl_s *ctrl = memalign_low(16, sizeof(*ctrl));
+    if (!ctrl) {
+        warn_noalloc();
+        return;
+    }
+    memset(ctrl, 0, sizeof(*ctrl));
     pci_enable_busmaster(pci);
 
     dprintf(1, "found mpt-scsi(%04x) at %pP, io @ %x\n"
@@ -292,12 +377,13 @@ init_mpt_scsi(void *data)
     // Eat doorbell interrupt
     outl(0, iobase + MPT_REG_ISTATUS);
 
-    // Post reply message used for SCSI errors
-    outl((u32)&reply_msg[0], iobase + MPT_REG_REP_Q);
-
+    // Post the reply frames used for SCSI errors
     int i;
+    for (i = 0; i < MPT_REPLIES; i++)
+        outl((u32)&ctrl->replies[i], iobase + MPT_REG_REP_Q);
+
     for (i = 0; i < 7; i++)
-        mpt_scsi_scan_target(pci, iobase, i);
+        mpt_scsi_scan_target(pci, iobase, ctrl, i);
 }
 
 void
@@ -315,7 +401,8 @@ mpt_scsi_setup(void)
         if (pci->vendor == PCI_VENDOR_ID_LSI_LOGIC
             && (pci->device == PCI_DEVICE_ID_LSI_53C1030
                 || pci->device == PCI_DEVICE_ID_LSI_SAS1068
-                || pci->device == PCI_DEVICE_ID_LSI_SAS1068E))
+                || pci->device == PCI_DEVICE_ID_LSI_SAS1068E)
+            && !boot_defer_pci(init_mpt_scsi, pci))
             run_thread(init_mpt_scsi, pci);
     }
 }
@@ -28,6 +28,14 @@ struct nvme_reg {
     u64 acq;                    /* admin completion queue base address */
 };
 
+/* SGL data block descriptor */
+struct nvme_sgl_desc {
+    u64 addr;
+    u32 length;
+    u8  _res[3];
+    u8  type;
+};
+
 /* Submission queue entry */
 struct nvme_sqe {
     union {
@@ -38,8 +46,13 @@ struct nvme_sqe {
             u64 _res0;
             u64 mptr;           /* metadata ptr */
 
-            u64 dptr_prp1;
-            u64 dptr_prp2;
+            union {
+                struct {
+                    u64 dptr_prp1;
+                    u64 dptr_prp2;
+                };
+                struct nvme_sgl_desc dptr_sgl;
+            };
         };
     };
 };
@@ -92,15 +105,19 @@ struct nvme_sq {
 };
 
 struct nvme_ctrl {
+    struct hlist_node node;
     struct pci_device *pci;
     struct nvme_reg volatile *reg;
 
+    int enabled;                /* CC.EN has been set */
+
     u32 doorbell_stride;        /* in bytes */
 
     struct nvme_sq admin_sq;
     struct nvme_cq admin_cq;
 
     u32 ns_count;
+    u8 sgls;                    /* NVME_SGLS_* data block support */
 
     struct nvme_sq io_sq;
     struct nvme_cq io_cq;
@@ -136,6 +153,10 @@ struct nvme_identify_ctrl {
     char _boring[516 - 78];
 
     u32 nn;                     /* number of namespaces */
+
+    char _boring2[536 - 520];
+
+    u32 sgls;                   /* SGL support */
 };
 
 struct nvme_identify_ns_list {
@@ -180,6 +201,8 @@ union nvme_identify {
 #define NVME_SQE_OPC_ADMIN_CREATE_IO_CQ 5U
 #define NVME_SQE_OPC_ADMIN_IDENTIFY     6U
 
+#define NVME_SQE_PSDT_SGL (1U << 14)
+
 #define NVME_SQE_OPC_IO_WRITE 1U
 #define NVME_SQE_OPC_IO_READ  2U
 
@@ -187,6 +210,12 @@ union nvme_identify {
 #define NVME_ADMIN_IDENTIFY_CNS_ID_CTRL     1U
 #define NVME_ADMIN_IDENTIFY_CNS_GET_NS_LIST 2U
 
+#define NVME_SGLS_MASK      3U
+#define NVME_SGLS_BYTE      1U  /* no alignment requirement */
+#define NVME_SGLS_DWORD     2U  /* data blocks must be dword aligned */
+
+#define NVME_SGL_TYPE_DATA_BLOCK 0x00
+
 #define NVME_CQE_DW3_P (1U << 16)
 
 #define NVME_PAGE_SIZE 4096
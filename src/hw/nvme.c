@@ -20,8 +20,14 @@
 #include "nvme.h"
 #include "nvme-int.h"
 
-// Page aligned "dma bounce buffer" of size NVME_PAGE_SIZE in high memory
-static void *nvme_dma_buffer;
+// Page aligned pool of PRP list slots (one per in-flight command)
+static u64 *nvme_prpl_pool;
+// Page aligned "dma bounce buffer" of CONFIG_NVME_BOUNCE_PAGES pages
+static void *nvme_bounce_pool;
+// Commands started by disk_submit() (see nvme_async_submit())
+static struct nvme_async_s *nvme_async;
+
+static void nvme_async_setup(struct nvme_namespace *ns);
 
 static void *
 zalloc_page_aligned(struct zone_s *zone, u32 size)
@@ -157,7 +163,7 @@ nvme_wait(struct nvme_sq *sq)
 static struct nvme_sqe *
 nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data, void *data2)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full\n");
         return NULL;
     }
@@ -174,20 +180,50 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data, void *
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Call this after you've filled out an sqe that you've got from
+   nvme_get_next_sqe. The controller is not notified until
+   nvme_ring_sq_doorbell() is called. */
 static void
-nvme_commit_sqe(struct nvme_sq *sq)
+nvme_queue_sqe(struct nvme_sq *sq)
 {
-    dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
+    dprintf(4, "sq %p queue_sqe %u\n", sq, sq->tail);
     sq->tail = (sq->tail + 1) & sq->common.mask;
+}
+
+/* Tell the controller about all queued submission queue entries. */
+static void
+nvme_ring_sq_doorbell(struct nvme_sq *sq)
+{
     writel(sq->common.dbl, sq->tail);
 }
 
-/* Perform an identify command on the admin queue and return the resulting
-   buffer. This may be a NULL pointer, if something failed. This function
-   cannot be used after initialization, because it uses buffers in tmp zone. */
+/* Ring the doorbell for all queued commands and wait for count completions.
+   The completion entries are stored in cqes[] in the order the commands were
+   queued, starting with the command at submission queue index first. */
+static void
+nvme_wait_batch(struct nvme_sq *sq, u16 first, int count,
+                struct nvme_cqe *cqes)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        cqes[i] = nvme_error_cqe();
+
+    nvme_ring_sq_doorbell(sq);
+
+    for (i = 0; i < count; i++) {
+        struct nvme_cqe cqe = nvme_wait(sq);
+        u16 idx = (cqe.cid - first) & sq->common.mask;
+        if (idx < count)
+            cqes[idx] = cqe;
+    }
+}
+
+/* Queue an identify command on the admin queue and return the buffer that
+   receives the result. This may be a NULL pointer, if something failed. This
+   function cannot be used after initialization, because it uses buffers in
+   tmp zone. */
 static union nvme_identify *
-nvme_admin_identify(struct nvme_ctrl *ctrl, u8 cns, u32 nsid)
+nvme_admin_queue_identify(struct nvme_ctrl *ctrl, u8 cns, u32 nsid)
 {
     union nvme_identify *identify_buf = zalloc_page_aligned(&ZoneTmpHigh, 4096);
     if (!identify_buf) {
@@ -203,75 +239,53 @@ nvme_admin_identify(struct nvme_ctrl *ctrl, u8 cns, u32 nsid)
 
     if (!cmd_identify) {
         warn_internalerror();
-        goto error;
+        free(identify_buf);
+        return NULL;
     }
 
     cmd_identify->nsid = nsid;
     cmd_identify->dword[10] = cns;
 
-    nvme_commit_sqe(&ctrl->admin_sq);
-
-    struct nvme_cqe cqe = nvme_wait(&ctrl->admin_sq);
-
-    if (!nvme_is_cqe_success(&cqe)) {
-        goto error;
-    }
-
+    nvme_queue_sqe(&ctrl->admin_sq);
     return identify_buf;
- error:
-    free(identify_buf);
-    return NULL;
-}
-
-static struct nvme_identify_ctrl *
-nvme_admin_identify_ctrl(struct nvme_ctrl *ctrl)
-{
-    return &nvme_admin_identify(ctrl, NVME_ADMIN_IDENTIFY_CNS_ID_CTRL, 0)->ctrl;
-}
-
-static struct nvme_identify_ns *
-nvme_admin_identify_ns(struct nvme_ctrl *ctrl, u32 ns_id)
-{
-    return &nvme_admin_identify(ctrl, NVME_ADMIN_IDENTIFY_CNS_ID_NS,
-                                ns_id)->ns;
 }
 
 static void
-nvme_probe_ns(struct nvme_ctrl *ctrl, u32 ns_idx, u8 mdts)
+nvme_probe_ns(struct nvme_ctrl *ctrl, u32 ns_idx, struct nvme_identify_ns *id,
+              u8 mdts)
 {
     u32 ns_id = ns_idx + 1;
 
-    struct nvme_identify_ns *id = nvme_admin_identify_ns(ctrl, ns_id);
-    if (!id) {
-        dprintf(2, "NVMe couldn't identify namespace %u.\n", ns_id);
-        goto free_buffer;
-    }
-
     u8 current_lba_format = id->flbas & 0xF;
     if (current_lba_format > id->nlbaf) {
         dprintf(2, "NVMe NS %u: current LBA format %u is beyond what the "
                 " namespace supports (%u)?\n",
                 ns_id, current_lba_format, id->nlbaf + 1);
-        goto free_buffer;
+        return;
     }
 
     if (!id->nsze) {
         dprintf(2, "NVMe NS %u is inactive.\n", ns_id);
-        goto free_buffer;
+        return;
     }
 
-    if (!nvme_dma_buffer) {
-        nvme_dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
-        if (!nvme_dma_buffer) {
+    if (!nvme_prpl_pool) {
+        nvme_prpl_pool = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+        nvme_bounce_pool = zalloc_page_aligned(
+            &ZoneHigh, CONFIG_NVME_BOUNCE_PAGES * NVME_PAGE_SIZE);
+        if (!nvme_prpl_pool || !nvme_bounce_pool) {
             warn_noalloc();
-            goto free_buffer;
+            free(nvme_prpl_pool);
+            free(nvme_bounce_pool);
+            nvme_prpl_pool = nvme_bounce_pool = NULL;
+            return;
         }
     }
 
     struct nvme_namespace *ns = malloc_fseg(sizeof(*ns));
     if (!ns) {
         warn_noalloc();
-        goto free_buffer;
+        return;
     }
     memset(ns, 0, sizeof(*ns));
     ns->ctrl  = ctrl;
@@ -288,7 +302,7 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, u32 ns_idx, u8 mdts)
            buffer size. */
         warn_internalerror();
         free(ns);
-        goto free_buffer;
+        return;
     }
 
     ns->drive.cntl_id   = ns_idx;
@@ -311,10 +325,129 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, u32 ns_idx, u8 mdts)
                           ns->lba_count, ns->block_size, ns->metadata_size);
 
     dprintf(3, "%s\n", desc);
-    boot_add_hd(&ns->drive, desc, bootprio_find_pci_device(ctrl->pci));
+    nvme_async_setup(ns);
+    boot_add_hd(&ns->drive, desc, bootprio_find_nvme_ns(ctrl->pci, ns_id));
+}
+
+/* Maximum number of admin commands outstanding during namespace probing */
+#define NVME_ADMIN_BATCH 16
+
+/* Identify the given namespaces, keeping several identify commands in
+   flight. */
+static void
+nvme_identify_namespaces(struct nvme_ctrl *ctrl, u32 *ns_ids, u32 ns_count,
+                         u8 mdts)
+{
+    union nvme_identify *id[NVME_ADMIN_BATCH];
+    struct nvme_cqe cqes[NVME_ADMIN_BATCH];
+    u32 pos = 0;
+
+    while (pos < ns_count) {
+        u16 first = ctrl->admin_sq.tail;
+        int count, i;
+        for (count = 0; count < NVME_ADMIN_BATCH; count++) {
+            if (pos + count >= ns_count)
+                break;
+            id[count] = nvme_admin_queue_identify(
+                ctrl, NVME_ADMIN_IDENTIFY_CNS_ID_NS, ns_ids[pos + count]);
+            if (!id[count])
+                break;
+        }
+        if (!count)
+            return;
+
+        nvme_wait_batch(&ctrl->admin_sq, first, count, cqes);
+
+        for (i = 0; i < count; i++) {
+            if (nvme_is_cqe_success(&cqes[i]))
+                nvme_probe_ns(ctrl, ns_ids[pos + i] - 1, &id[i]->ns, mdts);
+            else
+                dprintf(2, "NVMe couldn't identify namespace %u.\n",
+                        ns_ids[pos + i]);
+            free(id[i]);
+        }
+        pos += count;
+    }
+}
+
+#define NVME_NS_LIST_SIZE ARRAY_SIZE(((struct nvme_identify_ns_list *)0)->ns_id)
 
-free_buffer:
-    free (id);
+/* Fetch the list of active namespace ids above prev_id. Returns NULL if the
+   controller doesn't support the list (it is optional before NVMe 1.1). */
+static union nvme_identify *
+nvme_active_ns_list(struct nvme_ctrl *ctrl, u32 prev_id)
+{
+    struct nvme_cqe cqe;
+    u16 first = ctrl->admin_sq.tail;
+    union nvme_identify *list = nvme_admin_queue_identify(
+        ctrl, NVME_ADMIN_IDENTIFY_CNS_GET_NS_LIST, prev_id);
+    if (!list)
+        return NULL;
+    nvme_wait_batch(&ctrl->admin_sq, first, 1, &cqe);
+    if (!nvme_is_cqe_success(&cqe)) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+/* Identify the active namespaces. The active namespace list avoids an
+   identify command for each of the up to ns_count possible ids. With a
+   strict boot order, namespaces that the boot order doesn't name are not
+   identified at all. */
+static void
+nvme_probe_namespaces(struct nvme_ctrl *ctrl, u8 mdts)
+{
+    u8 skip_nonbootable = is_bootprio_strict();
+    int scan = 0;
+    union nvme_identify *list = nvme_active_ns_list(ctrl, 0);
+    if (!list) {
+        dprintf(3, "NVMe has no active namespace list, scanning all ids.\n");
+        list = zalloc_page_aligned(&ZoneTmpHigh, NVME_PAGE_SIZE);
+        if (!list) {
+            warn_noalloc();
+            return;
+        }
+        scan = 1;
+    }
+
+    u32 prev_id = 0;
+    for (;;) {
+        u32 *ns_ids = list->ns_list.ns_id;
+        u32 i, count = 0;
+        if (scan) {
+            memset(ns_ids, 0, sizeof(list->ns_list));
+            for (i = 0; i < NVME_NS_LIST_SIZE; i++) {
+                if (prev_id + i >= ctrl->ns_count)
+                    break;
+                ns_ids[i] = prev_id + i + 1;
+            }
+        }
+
+        /* the list ends at the first zero entry */
+        for (i = 0; i < NVME_NS_LIST_SIZE && ns_ids[i]; i++) {
+            u32 ns_id = ns_ids[i];
+            prev_id = ns_id;
+            if (skip_nonbootable
+                && bootprio_find_nvme_ns(ctrl->pci, ns_id) < 0) {
+                dprintf(3, "skipping non-bootable NVMe NS %u\n", ns_id);
+                continue;
+            }
+            ns_ids[count++] = ns_id;
+        }
+        nvme_identify_namespaces(ctrl, ns_ids, count, mdts);
+        if (i < NVME_NS_LIST_SIZE)
+            break;
+
+        /* a full list - there may be more active namespaces */
+        if (!scan) {
+            free(list);
+            list = nvme_active_ns_list(ctrl, prev_id);
+            if (!list)
+                return;
+        }
+    }
+    free(list);
 }
 
 
@@ -334,9 +467,9 @@ nvme_destroy_sq(struct nvme_sq *sq)
     sq->sqe = NULL;
 }
 
-/* Returns 0 on success. */
+/* Queue the creation of an I/O completion queue. Returns 0 on success. */
 static int
-nvme_create_io_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq, u16 q_idx)
+nvme_queue_create_io_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq, u16 q_idx)
 {
     int rc;
     struct nvme_sqe *cmd_create_cq;
@@ -346,41 +479,28 @@ nvme_create_io_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq, u16 q_idx)
 
     rc = nvme_init_cq(ctrl, cq, q_idx, length);
     if (rc) {
-        goto err;
+        return -1;
     }
 
     cmd_create_cq = nvme_get_next_sqe(&ctrl->admin_sq,
                                       NVME_SQE_OPC_ADMIN_CREATE_IO_CQ, NULL,
                                       cq->cqe, NULL);
     if (!cmd_create_cq) {
-        goto err_destroy_cq;
+        nvme_destroy_cq(cq);
+        return -1;
     }
 
     cmd_create_cq->dword[10] = (cq->common.mask << 16) | (q_idx >> 1);
     cmd_create_cq->dword[11] = 1 /* physically contiguous */;
 
-    nvme_commit_sqe(&ctrl->admin_sq);
-
-    struct nvme_cqe cqe = nvme_wait(&ctrl->admin_sq);
-
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "create io cq failed: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
-
-        goto err_destroy_cq;
-    }
-
+    nvme_queue_sqe(&ctrl->admin_sq);
     return 0;
-
-err_destroy_cq:
-    nvme_destroy_cq(cq);
-err:
-    return -1;
 }
 
-/* Returns 0 on success. */
+/* Queue the creation of an I/O submission queue. Returns 0 on success. */
 static int
-nvme_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx, struct nvme_cq *cq)
+nvme_queue_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx,
+                        struct nvme_cq *cq)
 {
     int rc;
     struct nvme_sqe *cmd_create_sq;
@@ -390,14 +510,15 @@ nvme_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx, struct
 
     rc = nvme_init_sq(ctrl, sq, q_idx, length, cq);
     if (rc) {
-        goto err;
+        return -1;
     }
 
     cmd_create_sq = nvme_get_next_sqe(&ctrl->admin_sq,
                                       NVME_SQE_OPC_ADMIN_CREATE_IO_SQ, NULL,
                                       sq->sqe, NULL);
     if (!cmd_create_sq) {
-        goto err_destroy_sq;
+        nvme_destroy_sq(sq);
+        return -1;
     }
 
     cmd_create_sq->dword[10] = (sq->common.mask << 16) | (q_idx >> 1);
@@ -405,28 +526,34 @@ nvme_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx, struct
     dprintf(3, "sq %p create dword10 %08x dword11 %08x\n", sq,
             cmd_create_sq->dword[10], cmd_create_sq->dword[11]);
 
-    nvme_commit_sqe(&ctrl->admin_sq);
-
-    struct nvme_cqe cqe = nvme_wait(&ctrl->admin_sq);
+    nvme_queue_sqe(&ctrl->admin_sq);
+    return 0;
+}
 
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "create io sq failed: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
-        goto err_destroy_sq;
-    }
+/* Fill out the I/O fields of an sqe from nvme_get_next_sqe() and queue it.
+   The command is not sent to the controller until nvme_io_reap() is
+   called. */
+static int
+nvme_io_queue(struct nvme_namespace *ns, struct nvme_sqe *io_cmd, u64 lba,
+              u16 count, int write)
+{
+    io_cmd->nsid = ns->ns_id;
+    io_cmd->dword[10] = (u32)lba;
+    io_cmd->dword[11] = (u32)(lba >> 32);
+    io_cmd->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
 
-    return 0;
+    nvme_queue_sqe(&ns->ctrl->io_sq);
 
-err_destroy_sq:
-    nvme_destroy_sq(sq);
-err:
-    return -1;
+    dprintf(5, "ns %u %s lba %llu+%u\n", ns->ns_id, write ? "write" : "read",
+            lba, count);
+    return count;
 }
 
-/* Reads count sectors into buf. The buffer cannot cross page boundaries. */
+/* Queue a command to transfer count sectors. The buffer cannot cross page
+   boundaries. */
 static int
-nvme_io_xfer(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
-             u16 count, int write)
+nvme_io_submit(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
+               u16 count, int write)
 {
     if (((u32)prp1 & 0x3) || ((u32)prp2 & 0x3)) {
         /* Buffer is misaligned */
@@ -434,80 +561,143 @@ nvme_io_xfer(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
         return -1;
     }
 
-    struct nvme_sqe *io_read = nvme_get_next_sqe(&ns->ctrl->io_sq,
-                                                 write ? NVME_SQE_OPC_IO_WRITE
-                                                       : NVME_SQE_OPC_IO_READ,
-                                                 NULL, prp1, prp2);
-    io_read->nsid = ns->ns_id;
-    io_read->dword[10] = (u32)lba;
-    io_read->dword[11] = (u32)(lba >> 32);
-    io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
-
-    nvme_commit_sqe(&ns->ctrl->io_sq);
-
-    struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
-
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "read io: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
-
+    struct nvme_sqe *io_cmd = nvme_get_next_sqe(&ns->ctrl->io_sq,
+                                                write ? NVME_SQE_OPC_IO_WRITE
+                                                      : NVME_SQE_OPC_IO_READ,
+                                                NULL, prp1, prp2);
+    if (!io_cmd) {
+        warn_internalerror();
         return -1;
     }
+    return nvme_io_queue(ns, io_cmd, lba, count, write);
+}
 
-    dprintf(5, "ns %u %s lba %llu+%u\n", ns->ns_id, write ? "write" : "read",
-            lba, count);
-    return count;
+/* Can the controller take the buffer at 'base' as one SGL data block? */
+static int
+nvme_sgl_usable(struct nvme_ctrl *ctrl, u32 base)
+{
+    return (ctrl->sgls == NVME_SGLS_BYTE
+            || (ctrl->sgls == NVME_SGLS_DWORD && !(base & 0x3)));
 }
 
-// Transfer up to one page of data using the internal dma bounce buffer
+/* Queue a command to transfer count sectors described by a single SGL data
+   block. The buffer may have any alignment nvme_sgl_usable() accepts. */
 static int
-nvme_bounce_xfer(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
-                 int write)
+nvme_sgl_submit(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
+                int write)
 {
-    u16 const max_blocks = NVME_PAGE_SIZE / ns->block_size;
-    u16 blocks = count < max_blocks ? count : max_blocks;
+    struct nvme_sqe *io_cmd = nvme_get_next_sqe(&ns->ctrl->io_sq,
+                                                write ? NVME_SQE_OPC_IO_WRITE
+                                                      : NVME_SQE_OPC_IO_READ,
+                                                NULL, NULL, NULL);
+    if (!io_cmd) {
+        warn_internalerror();
+        return -1;
+    }
+    io_cmd->cdw0 |= NVME_SQE_PSDT_SGL;
+    io_cmd->dptr_sgl.addr = (u32)buf;
+    io_cmd->dptr_sgl.length = count * ns->block_size;
+    io_cmd->dptr_sgl.type = NVME_SGL_TYPE_DATA_BLOCK;
+    return nvme_io_queue(ns, io_cmd, lba, count, write);
+}
 
-    if (write)
-        memcpy(nvme_dma_buffer, buf, blocks * ns->block_size);
+/* Ring the doorbell for all queued commands and wait for count completions.
+   Returns 0 if all of them were successful. */
+static int
+nvme_io_reap(struct nvme_sq *sq, int count)
+{
+    if (!count)
+        return 0;
 
-    int res = nvme_io_xfer(ns, lba, nvme_dma_buffer, NULL, blocks, write);
+    nvme_ring_sq_doorbell(sq);
 
-    if (!write && res >= 0)
-        memcpy(buf, nvme_dma_buffer, res * ns->block_size);
+    int ret = 0;
+    while (count--) {
+        struct nvme_cqe cqe = nvme_wait(sq);
 
-    return res;
+        if (!nvme_is_cqe_success(&cqe)) {
+            dprintf(2, "read io: %08x %08x %08x %08x\n",
+                    cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+            ret = -1;
+        }
+    }
+    return ret;
 }
 
 #define NVME_MAX_PRPL_ENTRIES 15 /* Allows requests up to 64kb */
 
-// Transfer data using page list (if applicable)
+/* The PRP list page is split into one slot per in-flight command */
+#define NVME_PRPL_SLOT_ENTRIES (NVME_MAX_PRPL_ENTRIES + 1)
+#define NVME_MAX_INFLIGHT \
+    (NVME_PAGE_SIZE / (NVME_PRPL_SLOT_ENTRIES * sizeof(u64)))
+
+// Determine how many blocks of a transfer at 'buf' one command can
+// describe.  Returns 0 if the transfer has to go through the bounce
+// buffer.
 static int
-nvme_prpl_xfer(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
-               int write)
+nvme_prpl_blocks(struct nvme_namespace *ns, void *buf, u16 count)
 {
     u32 base = (long)buf;
-    s32 size;
 
     if (count > ns->max_req_size)
         count = ns->max_req_size;
 
-    size = count * ns->block_size;
+    /* A single SGL data block describes any contiguous buffer */
+    if (nvme_sgl_usable(ns->ctrl, base))
+        return count;
+
+    /* PRP entries have to be dword aligned */
+    if (base & 0x3)
+        return 0;
+
+    s32 size = count * ns->block_size;
     /* Special case for transfers that fit into PRP1, but are unaligned */
     if (((size + (base & ~NVME_PAGE_MASK)) <= NVME_PAGE_SIZE))
-        goto single;
+        return count;
 
     /* Every request has to be page aligned */
     if (base & ~NVME_PAGE_MASK)
-        goto bounce;
+        return 0;
 
     /* Make sure a full block fits into the last chunk */
     if (size & (ns->block_size - 1ULL))
-        goto bounce;
+        return 0;
+
+    /* Limit the request to what a single PRP list slot can describe */
+    u32 max_blocks = ((NVME_MAX_PRPL_ENTRIES + 1) * NVME_PAGE_SIZE
+                      / ns->block_size);
+    if (count > max_blocks)
+        count = max_blocks;
+    return count;
+}
+
+// Queue a transfer using page list (if applicable) in the given PRP list
+// slot, or a single SGL data block if the buffer isn't page aligned and
+// the controller supports SGLs.  Returns the number of blocks queued, 0
+// if the transfer has to go through the bounce buffer, or -1 on error.
+static int
+nvme_prpl_submit(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
+                 int write, int slot)
+{
+    u32 base = (long)buf;
+
+    count = nvme_prpl_blocks(ns, buf, count);
+    if (!count)
+        return 0;
+
+    s32 size = count * ns->block_size;
+    /* Special case for transfers that fit into PRP1, but are unaligned */
+    if (((size + (base & ~NVME_PAGE_MASK)) <= NVME_PAGE_SIZE)
+        && !(base & 0x3))
+        goto single;
+
+    if (nvme_sgl_usable(ns->ctrl, base))
+        return nvme_sgl_submit(ns, lba, buf, count, write);
 
     /* Build PRP list if we need to describe more than 2 pages */
     if ((ns->block_size * count) > (NVME_PAGE_SIZE * 2)) {
         u32 prpl_len = 0;
-        u64 *prpl = nvme_dma_buffer;
+        u64 *prpl = nvme_prpl_pool + slot * NVME_PRPL_SLOT_ENTRIES;
         int first_page = 1;
         for (; size > 0; base += NVME_PAGE_SIZE, size -= NVME_PAGE_SIZE) {
             if (first_page) {
@@ -515,41 +705,57 @@ nvme_prpl_xfer(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
                 first_page = 0;
                 continue;
             }
-            if (prpl_len >= NVME_MAX_PRPL_ENTRIES)
-                goto bounce;
             prpl[prpl_len++] = base;
         }
-        return nvme_io_xfer(ns, lba, buf, prpl, count, write);
+        return nvme_io_submit(ns, lba, buf, prpl, count, write);
     }
 
     /* Directly embed the 2nd page if we only need 2 pages */
     if ((ns->block_size * count) > NVME_PAGE_SIZE)
-        return nvme_io_xfer(ns, lba, buf, buf + NVME_PAGE_SIZE, count, write);
+        return nvme_io_submit(ns, lba, buf, buf + NVME_PAGE_SIZE, count, write);
 
 single:
     /* One page is enough, don't expose anything else */
-    return nvme_io_xfer(ns, lba, buf, NULL, count, write);
-
-bounce:
-    /* Use bounce buffer to make transfer */
-    return nvme_bounce_xfer(ns, lba, buf, count, write);
+    return nvme_io_submit(ns, lba, buf, NULL, count, write);
 }
 
+// Transfer data using the internal dma bounce pool
 static int
-nvme_create_io_queues(struct nvme_ctrl *ctrl)
+nvme_bounce_xfer(struct nvme_namespace *ns, u64 lba, void *buf, u16 count,
+                 int write, int depth)
 {
-    if (nvme_create_io_cq(ctrl, &ctrl->io_cq, 3))
-        goto err;
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
+    u32 const max_blocks = (CONFIG_NVME_BOUNCE_PAGES * NVME_PAGE_SIZE
+                            / ns->block_size);
+    u16 blocks = count < max_blocks ? count : max_blocks;
 
-    if (nvme_create_io_sq(ctrl, &ctrl->io_sq, 2, &ctrl->io_cq))
-        goto err_free_cq;
+    if (write)
+        memcpy(nvme_bounce_pool, buf, blocks * ns->block_size);
+
+    /* The bounce pool is page aligned, so it never needs bouncing itself */
+    int i = 0, inflight = 0;
+    while (i < blocks) {
+        int res = nvme_prpl_submit(ns, lba + i,
+                                   nvme_bounce_pool + i * ns->block_size,
+                                   blocks - i, write, inflight);
+        if (res <= 0) {
+            nvme_io_reap(sq, inflight);
+            return -1;
+        }
+        i += res;
+        if (++inflight >= depth) {
+            if (nvme_io_reap(sq, inflight))
+                return -1;
+            inflight = 0;
+        }
+    }
+    if (nvme_io_reap(sq, inflight))
+        return -1;
 
-    return 0;
+    if (!write)
+        memcpy(buf, nvme_bounce_pool, blocks * ns->block_size);
 
- err_free_cq:
-    nvme_destroy_cq(&ctrl->io_cq);
- err:
-    return -1;
+    return blocks;
 }
 
 /* Waits for CSTS.RDY to match rdy. Returns 0 on success. */
@@ -577,23 +783,13 @@ nvme_wait_csts_rdy(struct nvme_ctrl *ctrl, unsigned rdy)
     return 0;
 }
 
-/* Returns 0 on success. */
+/* Program the admin queues and set CC.EN. The controller must be disabled
+   (CSTS.RDY clear). Returns 0 on success. */
 static int
-nvme_controller_enable(struct nvme_ctrl *ctrl)
+nvme_controller_set_enable(struct nvme_ctrl *ctrl)
 {
     int rc;
 
-    pci_enable_busmaster(ctrl->pci);
-
-    /* Turn the controller off. */
-    ctrl->reg->cc = 0;
-    if (nvme_wait_csts_rdy(ctrl, 0)) {
-        dprintf(2, "NVMe fatal error during controller shutdown\n");
-        return -1;
-    }
-
-    ctrl->doorbell_stride = 4U << ((ctrl->reg->cap >> 32) & 0xF);
-
     rc = nvme_init_cq(ctrl, &ctrl->admin_cq, 1,
                       NVME_PAGE_SIZE / sizeof(struct nvme_cqe));
     if (rc) {
@@ -603,7 +799,8 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
     rc = nvme_init_sq(ctrl, &ctrl->admin_sq, 0,
                       NVME_PAGE_SIZE / sizeof(struct nvme_sqe), &ctrl->admin_cq);
     if (rc) {
-        goto err_destroy_admin_cq;
+        nvme_destroy_cq(&ctrl->admin_cq);
+        return -1;
     }
 
     ctrl->reg->aqa = ctrl->admin_cq.common.mask << 16
@@ -617,6 +814,40 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
 
     ctrl->reg->cc = NVME_CC_EN | (NVME_CQE_SIZE_LOG << 20)
         | (NVME_SQE_SIZE_LOG << 16 /* IOSQES */);
+    ctrl->enabled = 1;
+    return 0;
+}
+
+/* First phase of controller bring-up. This only writes registers and never
+   waits, so that all controllers are reset (and, when already idle, enabled)
+   at about the same time. */
+static void
+nvme_controller_start(struct nvme_ctrl *ctrl)
+{
+    pci_enable_busmaster(ctrl->pci);
+
+    ctrl->doorbell_stride = 4U << ((ctrl->reg->cap >> 32) & 0xF);
+
+    /* Turn the controller off. */
+    ctrl->reg->cc = 0;
+
+    /* A controller that wasn't running can be enabled right away. */
+    if (!(ctrl->reg->csts & NVME_CSTS_RDY))
+        nvme_controller_set_enable(ctrl);
+}
+
+/* Second phase of controller bring-up. Returns 0 on success. */
+static int
+nvme_controller_enable(struct nvme_ctrl *ctrl)
+{
+    if (!ctrl->enabled) {
+        if (nvme_wait_csts_rdy(ctrl, 0)) {
+            dprintf(2, "NVMe fatal error during controller shutdown\n");
+            return -1;
+        }
+        if (nvme_controller_set_enable(ctrl))
+            return -1;
+    }
 
     if (nvme_wait_csts_rdy(ctrl, 1)) {
         dprintf(2, "NVMe fatal error while enabling controller\n");
@@ -624,50 +855,99 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
     }
 
     /* The admin queue is set up and the controller is ready. Let's figure out
-       what namespaces we have. */
-
-    struct nvme_identify_ctrl *identify = nvme_admin_identify_ctrl(ctrl);
+       what namespaces we have, while the I/O completion queue is created. */
 
+    struct nvme_cqe cqes[2];
+    u16 first = ctrl->admin_sq.tail;
+    union nvme_identify *identify = nvme_admin_queue_identify(
+        ctrl, NVME_ADMIN_IDENTIFY_CNS_ID_CTRL, 0);
     if (!identify) {
         dprintf(2, "NVMe couldn't identify controller.\n");
         goto err_destroy_admin_sq;
     }
+    if (nvme_queue_create_io_cq(ctrl, &ctrl->io_cq, 3)) {
+        nvme_wait_batch(&ctrl->admin_sq, first, 1, cqes);
+        free(identify);
+        goto err_destroy_admin_sq;
+    }
 
-    dprintf(3, "NVMe has %u namespace%s.\n",
-            identify->nn, (identify->nn == 1) ? "" : "s");
+    nvme_wait_batch(&ctrl->admin_sq, first, 2, cqes);
+
+    if (!nvme_is_cqe_success(&cqes[1])) {
+        dprintf(2, "create io cq failed: %08x %08x %08x %08x\n",
+                cqes[1].dword[0], cqes[1].dword[1], cqes[1].dword[2],
+                cqes[1].dword[3]);
+        nvme_destroy_cq(&ctrl->io_cq);
+        free(identify);
+        goto err_destroy_admin_sq;
+    }
+
+    if (!nvme_is_cqe_success(&cqes[0])) {
+        dprintf(2, "NVMe couldn't identify controller.\n");
+        free(identify);
+        goto err_destroy_io_cq;
+    }
 
-    ctrl->ns_count = identify->nn;
-    u8 mdts = identify->mdts;
+    dprintf(3, "NVMe has %u namespace%s.\n",
+            identify->ctrl.nn, (identify->ctrl.nn == 1) ? "" : "s");
+
+    ctrl->ns_count = identify->ctrl.nn;
+    ctrl->sgls = identify->ctrl.sgls & NVME_SGLS_MASK;
+    if (ctrl->sgls)
+        dprintf(3, "NVMe supports SGL data blocks (sgls %x).\n",
+                identify->ctrl.sgls);
+    u8 mdts = identify->ctrl.mdts;
     free(identify);
 
-    if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
+    if (ctrl->ns_count == 0) {
         /* No point to continue, if the controller says it doesn't have
-           namespaces or we couldn't create I/O queues. */
-        goto err_destroy_admin_sq;
+           namespaces. */
+        goto err_destroy_io_cq;
     }
 
-    /* Populate namespace IDs */
-    int ns_idx;
-    for (ns_idx = 0; ns_idx < ctrl->ns_count; ns_idx++) {
-        nvme_probe_ns(ctrl, ns_idx, mdts);
+    first = ctrl->admin_sq.tail;
+    if (nvme_queue_create_io_sq(ctrl, &ctrl->io_sq, 2, &ctrl->io_cq))
+        goto err_destroy_io_cq;
+    nvme_wait_batch(&ctrl->admin_sq, first, 1, cqes);
+    if (!nvme_is_cqe_success(&cqes[0])) {
+        dprintf(2, "create io sq failed: %08x %08x %08x %08x\n",
+                cqes[0].dword[0], cqes[0].dword[1], cqes[0].dword[2],
+                cqes[0].dword[3]);
+        nvme_destroy_sq(&ctrl->io_sq);
+        goto err_destroy_io_cq;
     }
 
+    /* Populate namespace IDs */
+    nvme_probe_namespaces(ctrl, mdts);
+
     dprintf(3, "NVMe initialization complete!\n");
     return 0;
 
+ err_destroy_io_cq:
+    nvme_destroy_cq(&ctrl->io_cq);
  err_destroy_admin_sq:
     nvme_destroy_sq(&ctrl->admin_sq);
- err_destroy_admin_cq:
     nvme_destroy_cq(&ctrl->admin_cq);
     return -1;
 }
 
-/* Initialize an NVMe controller and detect its drives. */
+/* Wait for an NVMe controller to become ready and detect its drives. */
 static void
 nvme_controller_setup(void *opaque)
+{
+    struct nvme_ctrl *ctrl = opaque;
+
+    if (nvme_controller_enable(ctrl)) {
+        free(ctrl);
+        dprintf(2, "Failed to enable NVMe controller.\n");
+    }
+}
+
+/* Map an NVMe controller and start its bring-up. */
+static struct nvme_ctrl *
+nvme_controller_probe(struct pci_device *pci)
 {
     u8 skip_nonbootable = is_bootprio_strict();
-    struct pci_device *pci = opaque;
 
     if (skip_nonbootable && bootprio_find_pci_device(pci) < 0) {
         dprintf(1, "skipping init of a non-bootable NVMe at %pP\n",
@@ -677,7 +957,7 @@ nvme_controller_setup(void *opaque)
 
     struct nvme_reg volatile *reg = pci_enable_membar(pci, PCI_BASE_ADDRESS_0);
     if (!reg)
-        return;
+        return NULL;
 
     u32 version = reg->vs;
     dprintf(3, "Found NVMe controller with version %u.%u.%u.\n",
@@ -700,23 +980,30 @@ nvme_controller_setup(void *opaque)
     ctrl->reg = reg;
     ctrl->pci = pci;
 
-    if (nvme_controller_enable(ctrl)) {
-        goto err_free_ctrl;
-    }
-
-    return;
+    nvme_controller_start(ctrl);
+    return ctrl;
 
- err_free_ctrl:
-    free(ctrl);
  err:
     dprintf(2, "Failed to enable NVMe controller.\n");
+    return NULL;
+}
+
+// Bring up a controller whose initialization was deferred
+static void
+nvme_controller_init(void *opaque)
+{
+    struct nvme_ctrl *ctrl = nvme_controller_probe(opaque);
+    if (ctrl)
+        nvme_controller_setup(ctrl);
 }
 
 // Locate and init NVMe controllers
 static void
 nvme_scan(void)
 {
-    // Scan PCI bus for NVMe adapters
+    // Scan PCI bus for NVMe adapters and reset/enable all of them
+    struct hlist_head ctrls = { NULL };
+    struct hlist_node **pprev = &ctrls.first;
     struct pci_device *pci;
 
     foreachpci(pci) {
@@ -726,28 +1013,183 @@ nvme_scan(void)
             dprintf(3, "Found incompatble NVMe: prog-if=%02x\n", pci->prog_if);
             continue;
         }
+        if (boot_defer_pci(nvme_controller_init, pci))
+            continue;
 
-        run_thread(nvme_controller_setup, pci);
+        struct nvme_ctrl *ctrl = nvme_controller_probe(pci);
+        if (!ctrl)
+            continue;
+        hlist_add(&ctrl->node, pprev);
+        pprev = &ctrl->node.next;
+    }
+
+    // Wait for readiness and probe namespaces on all controllers in parallel
+    struct nvme_ctrl *ctrl;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(ctrl, n, &ctrls, node) {
+        run_thread_prio(nvme_controller_setup, ctrl
+                        , boot_thread_prio(ctrl->pci));
     }
 }
 
 static int
 nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
 {
-    int i;
-    for (i = 0; i < op->count;) {
+    /* The PRP list slots are shared with requests from disk_submit() */
+    disk_drain(&ns->drive);
+
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
+    int depth = NVME_MAX_INFLIGHT;
+    if (depth > sq->common.mask)
+        depth = sq->common.mask;
+
+    /* Split the request into several commands that are queued to the
+       controller together and reaped in a batch. */
+    int i = 0, inflight = 0;
+    while (i < op->count) {
         u16 blocks_remaining = op->count - i;
         char *op_buf = op->buf_fl + i * ns->block_size;
-        int blocks = nvme_prpl_xfer(ns, op->lba + i, op_buf,
-                                    blocks_remaining, write);
-        if (blocks < 0)
+        int blocks = nvme_prpl_submit(ns, op->lba + i, op_buf,
+                                      blocks_remaining, write, inflight);
+        if (blocks > 0) {
+            i += blocks;
+            if (++inflight < depth)
+                continue;
+        }
+
+        /* Queue is full, an error occurred, or the bounce buffer is needed */
+        int res = nvme_io_reap(sq, inflight);
+        inflight = 0;
+        if (blocks < 0 || res)
             return DISK_RET_EBADTRACK;
-        i += blocks;
+        if (!blocks) {
+            blocks = nvme_bounce_xfer(ns, op->lba + i, op_buf,
+                                      blocks_remaining, write, depth);
+            if (blocks < 0)
+                return DISK_RET_EBADTRACK;
+            i += blocks;
+        }
     }
 
+    if (nvme_io_reap(sq, inflight))
+        return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
 }
 
+
+/****************************************************************
+ * Asynchronous requests
+ ****************************************************************/
+
+// The PRP list pool is shared by all controllers, so the slots of
+// requests in flight are tracked globally.
+struct nvme_async_s {
+    struct disk_req_s *req[NVME_MAX_INFLIGHT];
+    struct nvme_sq *sq[NVME_MAX_INFLIGHT];
+    u16 cid[NVME_MAX_INFLIGHT];
+    u32 busy;
+    int count;
+};
+
+// Start a request submitted with disk_submit()
+static int
+nvme_async_submit(struct disk_req_s *req)
+{
+    struct disk_op_s *op = &req->op;
+    struct nvme_namespace *ns = container_of(op->drive_fl, struct nvme_namespace,
+                                             drive);
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
+    struct nvme_async_s *async = nvme_async;
+
+    /* Requests that need several commands or the bounce buffer are
+       left to the synchronous path */
+    if (nvme_prpl_blocks(ns, op->buf_fl, op->count) != op->count)
+        return DISK_QUEUE_SYNC;
+    u32 idle = ~async->busy;
+    if (!idle || ((sq->tail + 1) & sq->common.mask) == sq->head)
+        return DISK_QUEUE_FULL;
+
+    int slot = __ffs(idle);
+    u16 cid = sq->tail;
+    if (nvme_prpl_submit(ns, op->lba, op->buf_fl, op->count
+                         , op->command == CMD_WRITE, slot) != op->count)
+        return DISK_QUEUE_SYNC;
+    async->req[slot] = req;
+    async->sq[slot] = sq;
+    async->cid[slot] = cid;
+    async->busy |= 1U << slot;
+    async->count++;
+    nvme_ring_sq_doorbell(sq);
+    return DISK_QUEUE_STARTED;
+}
+
+// Complete the request a completion queue entry belongs to
+static void
+nvme_async_complete(struct nvme_sq *sq, struct nvme_cqe *cqe)
+{
+    struct nvme_async_s *async = nvme_async;
+    int slot;
+    for (slot = 0; slot < NVME_MAX_INFLIGHT; slot++)
+        if (async->busy & (1U << slot) && async->sq[slot] == sq
+            && async->cid[slot] == cqe->cid)
+            break;
+    if (slot >= NVME_MAX_INFLIGHT) {
+        dprintf(1, "nvme: completion for unknown command %u\n", cqe->cid);
+        return;
+    }
+    int status = DISK_RET_SUCCESS;
+    if (!nvme_is_cqe_success(cqe)) {
+        dprintf(2, "async io: %08x %08x %08x %08x\n",
+                cqe->dword[0], cqe->dword[1], cqe->dword[2], cqe->dword[3]);
+        status = DISK_RET_EBADTRACK;
+    }
+    async->busy &= ~(1U << slot);
+    async->count--;
+    disk_req_done(async->req[slot], status);
+}
+
+// Complete finished requests of all controllers
+static int
+nvme_async_poll(struct drive_s *drive_fl)
+{
+    struct nvme_async_s *async = nvme_async;
+    int slot;
+    for (slot = 0; slot < NVME_MAX_INFLIGHT && async->busy; slot++) {
+        if (!(async->busy & (1U << slot)))
+            continue;
+        struct nvme_sq *sq = async->sq[slot];
+        while (nvme_poll_cq(sq->cq)) {
+            struct nvme_cqe cqe = nvme_consume_cqe(sq);
+            nvme_async_complete(sq, &cqe);
+        }
+    }
+    return async->count;
+}
+
+static const struct disk_async_s nvme_async_ops = {
+    .submit = nvme_async_submit,
+    .poll = nvme_async_poll,
+};
+
+// Enable disk_submit() support on a namespace
+static void
+nvme_async_setup(struct nvme_namespace *ns)
+{
+    if (!nvme_async) {
+        nvme_async = malloc_high(sizeof(*nvme_async));
+        if (!nvme_async) {
+            warn_noalloc();
+            return;
+        }
+        memset(nvme_async, 0, sizeof(*nvme_async));
+    }
+    int depth = NVME_MAX_INFLIGHT;
+    if (depth > ns->ctrl->io_sq.common.mask)
+        depth = ns->ctrl->io_sq.common.mask;
+    ns->drive.async = &nvme_async_ops;
+    ns->drive.queue_depth = depth;
+}
+
 int
 nvme_process_op(struct disk_op_s *op)
 {
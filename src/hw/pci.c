@@ -184,9 +184,9 @@ int pci_ioconfig_next(int bdf, int bus)
     }
 }
 
-// Helper function for foreachbdf() macro - return next device
+// Helper function for foreachbdf_devs() macro - return next device
 int
-pci_next(int bdf, int bus)
+pci_next_devs(int bdf, int bus, int devs)
 {
     if (pci_bdf_to_fn(bdf) == 0
         && (pci_config_readb(bdf, PCI_HEADER_TYPE) & 0x80) == 0)
@@ -197,7 +197,7 @@ pci_next(int bdf, int bus)
         bdf += 1;
 
     for (;;) {
-        if (pci_bdf_to_bus(bdf) != bus)
+        if (pci_bdf_to_bus(bdf) != bus || pci_bdf_to_dev(bdf) >= devs)
             return -1;
 
         u16 v = pci_config_readw(bdf, PCI_VENDOR_ID);
@@ -212,6 +212,33 @@ pci_next(int bdf, int bus)
     }
 }
 
+// Return the number of device numbers to probe on the secondary bus of
+// the bridge at 'bdf' ('pcie_cap' is its PCI Express capability, if
+// any).  The link below a PCIe root or downstream port only has device
+// 0, unless ARI forwarding is enabled.
+int
+pci_bridge_devices(u16 bdf, u8 pcie_cap)
+{
+    if (!pcie_cap)
+        return 32;
+    u16 flags = pci_config_readw(bdf, pcie_cap + PCI_EXP_FLAGS);
+    u8 type = (flags & PCI_EXP_FLAGS_TYPE) >> 4;
+    if (type != PCI_EXP_TYPE_ROOT_PORT && type != PCI_EXP_TYPE_DOWNSTREAM)
+        return 32;
+    if ((flags & PCI_EXP_FLAGS_VERS) >= 2
+        && (pci_config_readw(bdf, pcie_cap + PCI_EXP_DEVCTL2)
+            & PCI_EXP_DEVCTL2_ARI))
+        return 32;
+    return 1;
+}
+
+// Helper function for foreachbdf() macro - return next device
+int
+pci_next(int bdf, int bus)
+{
+    return pci_next_devs(bdf, bus, 32);
+}
+
 // Check if PCI is available at all
 int
 pci_probe_host(void)
@@ -37,6 +37,13 @@ static inline u16 pci_bus_devfn_to_bdf(int bus, u16 devfn) {
          ; BDF >= 0                                             \
          ; BDF=pci_next(BDF, (BUS)))
 
+// Iterate over the devices of a bus, only probing the first DEVS
+// device numbers (see pci_bridge_devices).
+#define foreachbdf_devs(BDF, BUS, DEVS)                                 \
+    for (BDF=pci_next_devs(pci_bus_devfn_to_bdf((BUS), 0)-1, (BUS), (DEVS)) \
+         ; BDF >= 0                                                     \
+         ; BDF=pci_next_devs(BDF, (BUS), (DEVS)))
+
 // standard PCI configration access mechanism
 void pci_ioconfig_writel(u16 bdf, u32 addr, u32 val);
 void pci_ioconfig_writew(u16 bdf, u32 addr, u16 val);
@@ -55,7 +62,9 @@ u16 pci_config_readw(u16 bdf, u32 addr);
 u8 pci_config_readb(u16 bdf, u32 addr);
 void pci_config_maskw(u16 bdf, u32 addr, u16 off, u16 on);
 u8 pci_find_capability(u16 bdf, u8 cap_id, u8 cap);
+int pci_next_devs(int bdf, int bus, int devs);
 int pci_next(int bdf, int bus);
+int pci_bridge_devices(u16 bdf, u8 pcie_cap);
 
 void pci_enable_mmconfig(u64 addr, const char *name);
 int pci_probe_host(void);
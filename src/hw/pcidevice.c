@@ -16,6 +16,35 @@
 struct hlist_head PCIDevices VARVERIFY32INIT;
 int MaxPCIBus VARFSEG;
 
+// Read the config space header and capability list of 'dev'.
+static void
+pci_snapshot(struct pci_device *dev)
+{
+    u16 bdf = dev->bdf;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(dev->config); i++)
+        dev->config[i] = pci_config_readl(bdf, i * 4);
+
+    u8 *config = (void*)dev->config;
+    u8 type = config[PCI_HEADER_TYPE] & 0x7f;
+    if (!(config[PCI_STATUS] & PCI_STATUS_CAP_LIST)
+        || type == PCI_HEADER_TYPE_CARDBUS)
+        return;
+    u8 cap = config[PCI_CAPABILITY_LIST];
+    for (i = 0; cap && i <= 0xff; i++) {
+        if (dev->capcount >= ARRAY_SIZE(dev->caps)) {
+            // Too many capabilities - walk the list in config space
+            dev->capcount = ARRAY_SIZE(dev->caps) + 1;
+            return;
+        }
+        u16 v = pci_config_readw(bdf, cap);
+        dev->caps[dev->capcount].id = v;
+        dev->caps[dev->capcount].offset = cap;
+        dev->capcount++;
+        cap = v >> 8;
+    }
+}
+
 // Find all PCI devices and populate PCIDevices linked list.
 void
 pci_probe_devices(void)
@@ -28,8 +57,14 @@ pci_probe_devices(void)
     int bus = -1, lastbus = 0, rootbuses = 0, count=0;
     while (bus < 0xff && (bus < MaxPCIBus || rootbuses < extraroots)) {
         bus++;
-        int bdf;
-        foreachbdf(bdf, bus) {
+        int bdf, devs = 32;
+        if (busdevs[bus]) {
+            struct pci_device *bridge = busdevs[bus];
+            u8 pcie_cap = pci_device_find_capability(
+                bridge, PCI_CAP_ID_EXP, 0);
+            devs = pci_bridge_devices(bridge->bdf, pcie_cap);
+        }
+        foreachbdf_devs(bdf, bus, devs) {
             // Create new pci_device struct and add to list.
             struct pci_device *dev = malloc_tmp(sizeof(*dev));
             if (!dev) {
@@ -59,17 +94,17 @@ pci_probe_devices(void)
             dev->bdf = bdf;
             dev->parent = parent;
             dev->rootbus = rootbus;
-            u32 vendev = pci_config_readl(bdf, PCI_VENDOR_ID);
-            dev->vendor = vendev & 0xffff;
-            dev->device = vendev >> 16;
-            u32 classrev = pci_config_readl(bdf, PCI_CLASS_REVISION);
+            pci_snapshot(dev);
+            dev->vendor = pci_device_readw(dev, PCI_VENDOR_ID);
+            dev->device = pci_device_readw(dev, PCI_DEVICE_ID);
+            u32 classrev = pci_device_readl(dev, PCI_CLASS_REVISION);
             dev->class = classrev >> 16;
             dev->prog_if = classrev >> 8;
             dev->revision = classrev & 0xff;
-            dev->header_type = pci_config_readb(bdf, PCI_HEADER_TYPE);
+            dev->header_type = pci_device_readb(dev, PCI_HEADER_TYPE);
             u8 v = dev->header_type & 0x7f;
             if (v == PCI_HEADER_TYPE_BRIDGE || v == PCI_HEADER_TYPE_CARDBUS) {
-                u8 secbus = pci_config_readb(bdf, PCI_SECONDARY_BUS);
+                u8 secbus = ((u8*)dev->config)[PCI_SECONDARY_BUS];
                 dev->secondary_bus = secbus;
                 if (secbus > bus && !busdevs[secbus])
                     busdevs[secbus] = dev;
@@ -134,6 +169,102 @@ pci_find_init_device(const struct pci_device_id *ids, void *arg)
     return NULL;
 }
 
+// Bitmaps of the read-only bytes of a config space header - reads of
+// these are served from the snapshot.
+#define RO_BYTES(addr, size) (((1ULL << (size)) - 1) << (addr))
+#define RO_HEADER (RO_BYTES(PCI_VENDOR_ID, 4) | RO_BYTES(PCI_REVISION_ID, 4) \
+                   | RO_BYTES(PCI_HEADER_TYPE, 1))
+#define RO_HEADER_CAPS (RO_BYTES(PCI_CAPABILITY_LIST, 1)                \
+                        | RO_BYTES(PCI_INTERRUPT_PIN, 1))
+#define RO_HEADER_NORMAL (RO_HEADER | RO_HEADER_CAPS                    \
+                          | RO_BYTES(PCI_SUBSYSTEM_VENDOR_ID, 4))
+#define RO_HEADER_BRIDGE (RO_HEADER | RO_HEADER_CAPS)
+
+// Check if the 'size' bytes at 'addr' can be read from the snapshot.
+static int
+pci_snapshot_valid(struct pci_device *pci, u32 addr, int size)
+{
+    if (addr + size > PCI_CONFIG_SNAPSHOT)
+        return 0;
+    u64 ro = RO_HEADER;
+    switch (((u8*)pci->config)[PCI_HEADER_TYPE] & 0x7f) {
+    case PCI_HEADER_TYPE_NORMAL: ro = RO_HEADER_NORMAL; break;
+    case PCI_HEADER_TYPE_BRIDGE: ro = RO_HEADER_BRIDGE; break;
+    }
+    u64 mask = RO_BYTES(addr, size);
+    return (ro & mask) == mask;
+}
+
+// Read config space of a device - read-only registers of the header
+// are served from the snapshot taken at probe time.
+u32
+pci_device_readl(struct pci_device *pci, u32 addr)
+{
+    if (pci_snapshot_valid(pci, addr, 4))
+        return pci->config[addr / 4];
+    return pci_config_readl(pci->bdf, addr);
+}
+
+u16
+pci_device_readw(struct pci_device *pci, u32 addr)
+{
+    if (pci_snapshot_valid(pci, addr, 2))
+        return *(u16*)((void*)pci->config + addr);
+    return pci_config_readw(pci->bdf, addr);
+}
+
+u8
+pci_device_readb(struct pci_device *pci, u32 addr)
+{
+    if (pci_snapshot_valid(pci, addr, 1))
+        return *(u8*)((void*)pci->config + addr);
+    return pci_config_readb(pci->bdf, addr);
+}
+
+// Write config space of a device - the snapshot is written through.
+void
+pci_device_writel(struct pci_device *pci, u32 addr, u32 val)
+{
+    pci_config_writel(pci->bdf, addr, val);
+    if (addr + 4 <= PCI_CONFIG_SNAPSHOT)
+        pci->config[addr / 4] = val;
+}
+
+void
+pci_device_writew(struct pci_device *pci, u32 addr, u16 val)
+{
+    pci_config_writew(pci->bdf, addr, val);
+    if (addr + 2 <= PCI_CONFIG_SNAPSHOT)
+        *(u16*)((void*)pci->config + addr) = val;
+}
+
+void
+pci_device_writeb(struct pci_device *pci, u32 addr, u8 val)
+{
+    pci_config_writeb(pci->bdf, addr, val);
+    if (addr + 1 <= PCI_CONFIG_SNAPSHOT)
+        *(u8*)((void*)pci->config + addr) = val;
+}
+
+// Find a capability of a device (starting after 'cap' if non-zero)
+// using the capability list snapshot.
+u8
+pci_device_find_capability(struct pci_device *pci, u8 cap_id, u8 cap)
+{
+    if (pci->capcount > ARRAY_SIZE(pci->caps))
+        return pci_find_capability(pci->bdf, cap_id, cap);
+    int i = 0;
+    if (cap) {
+        while (i < pci->capcount && pci->caps[i].offset != cap)
+            i++;
+        i++;
+    }
+    for (; i < pci->capcount; i++)
+        if (pci->caps[i].id == cap_id)
+            return pci->caps[i].offset;
+    return 0;
+}
+
 // Enable PCI bus-mastering (ie, DMA) support on a pci device
 void
 pci_enable_busmaster(struct pci_device *pci)
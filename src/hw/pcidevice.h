@@ -4,6 +4,9 @@
 #include "types.h" // u32
 #include "list.h" // hlist_node
 
+#define PCI_CONFIG_SNAPSHOT 64
+#define PCI_CAP_SNAPSHOT 16
+
 struct pci_device {
     u16 bdf;
     u8 rootbus;
@@ -17,6 +20,12 @@ struct pci_device {
     u8 header_type;
     u8 secondary_bus;
 
+    // Snapshot of the config space header and the capability list,
+    // taken at probe time (see pci_device_readl).
+    u32 config[PCI_CONFIG_SNAPSHOT / 4];
+    struct { u8 id, offset; } caps[PCI_CAP_SNAPSHOT];
+    u8 capcount;        // PCI_CAP_SNAPSHOT+1 if the list didn't fit
+
     // Local information on device.
     int have_driver;
 };
@@ -69,6 +78,13 @@ int pci_init_device(const struct pci_device_id *ids
                     , struct pci_device *pci, void *arg);
 struct pci_device *pci_find_init_device(const struct pci_device_id *ids
                                         , void *arg);
+u32 pci_device_readl(struct pci_device *pci, u32 addr);
+u16 pci_device_readw(struct pci_device *pci, u32 addr);
+u8 pci_device_readb(struct pci_device *pci, u32 addr);
+void pci_device_writel(struct pci_device *pci, u32 addr, u32 val);
+void pci_device_writew(struct pci_device *pci, u32 addr, u16 val);
+void pci_device_writeb(struct pci_device *pci, u32 addr, u8 val);
+u8 pci_device_find_capability(struct pci_device *pci, u8 cap_id, u8 cap);
 void pci_enable_busmaster(struct pci_device *pci);
 u16 pci_enable_iobar(struct pci_device *pci, u32 addr);
 void *pci_enable_membar(struct pci_device *pci, u32 addr);
@@ -409,6 +409,16 @@ handle_09(void)
 
     process_key(v);
 
+    // Process any further scancodes the controller already has queued
+    // (a multi-byte sequence or fast typing) without an irq for each.
+    int count;
+    for (count=1; count<I8042_BUFFER_SIZE; count++) {
+        u8 status = inb(PORT_PS2_STATUS);
+        if ((status & (I8042_STR_OBF|I8042_STR_AUXDATA)) != I8042_STR_OBF)
+            break;
+        process_key(inb(PORT_PS2_DATA));
+    }
+
     // Some old programs expect ISR to turn keyboard back on.
     i8042_command(I8042_CMD_KBD_ENABLE, NULL);
 
@@ -446,42 +456,28 @@ ps2_check_event(void)
  * Setup
  ****************************************************************/
 
-static void
-ps2_keyboard_setup(void *data)
+// Controller self-tests and keyboard reset (BAT).
+static int
+ps2_keyboard_test(void)
 {
-    // flush incoming keys (also verifies port is likely present)
-    int ret = i8042_flush();
-    if (ret)
-        return;
-
-    // Disable keyboard / mouse and drain any input they may have sent
-    ret = i8042_command(I8042_CMD_KBD_DISABLE, NULL);
-    if (ret)
-        return;
-    ret = i8042_command(I8042_CMD_AUX_DISABLE, NULL);
-    if (ret)
-        return;
-    ret = i8042_flush();
-    if (ret)
-        return;
+    u8 param[2];
 
     // Controller self-test.
-    u8 param[2];
-    ret = i8042_command(I8042_CMD_CTL_TEST, param);
+    int ret = i8042_command(I8042_CMD_CTL_TEST, param);
     if (ret)
-        return;
+        return -1;
     if (param[0] != 0x55) {
         dprintf(1, "i8042 self test failed (got %x not 0x55)\n", param[0]);
-        return;
+        return -1;
     }
 
     // Controller keyboard test.
     ret = i8042_command(I8042_CMD_KBD_TEST, param);
     if (ret)
-        return;
+        return -1;
     if (param[0] != 0x00) {
         dprintf(1, "i8042 keyboard test failed (got %x not 0x00)\n", param[0]);
-        return;
+        return -1;
     }
 
 
@@ -496,25 +492,33 @@ ps2_keyboard_setup(void *data)
         if (timer_check(end)) {
             if (spinupdelay)
                 warn_timeout();
-            return;
+            return -1;
         }
         yield();
     }
     if (param[0] != 0xaa) {
         dprintf(1, "keyboard self test failed (got %x not 0xaa)\n", param[0]);
-        return;
+        return -1;
     }
+    return 0;
+}
 
+// Set up the keyboard for scanning (after ps2_keyboard_test() or with
+// a keyboard that is known to be working).
+static int
+ps2_keyboard_enable(void)
+{
     /* Disable keyboard */
-    ret = ps2_kbd_command(ATKBD_CMD_RESET_DIS, NULL);
+    int ret = ps2_kbd_command(ATKBD_CMD_RESET_DIS, NULL);
     if (ret)
-        return;
+        return -1;
 
     // Set scancode command (mode 2)
+    u8 param[2];
     param[0] = 0x02;
     ret = ps2_kbd_command(ATKBD_CMD_SSCANSET, param);
     if (ret)
-        return;
+        return -1;
 
     // Keyboard Mode: disable mouse, scan code convert, enable kbd IRQ
     Ps2ctr = (I8042_CTR_AUXDIS | I8042_CTR_XLATE
@@ -522,9 +526,56 @@ ps2_keyboard_setup(void *data)
 
     /* Enable keyboard */
     ret = ps2_kbd_command(ATKBD_CMD_ENABLE, NULL);
+    if (ret)
+        return -1;
+
+    return 0;
+}
+
+// The self-tests and BAT take hundreds of milliseconds on real
+// hardware (and many trapping status polls in a vm).  They are skipped
+// after a ctrl+alt+del reboot, or always with etc/ps2-fast-init=2.
+static int
+ps2_fast_init(void)
+{
+    int mode = romfile_loadint("etc/ps2-fast-init", 1);
+    return mode >= 2 || (mode == 1 && WarmBoot);
+}
+
+static void
+ps2_keyboard_setup(void *data)
+{
+    // flush incoming keys (also verifies port is likely present)
+    int ret = i8042_flush();
     if (ret)
         return;
 
+    // Disable keyboard / mouse and drain any input they may have sent
+    ret = i8042_command(I8042_CMD_KBD_DISABLE, NULL);
+    if (ret)
+        return;
+    ret = i8042_command(I8042_CMD_AUX_DISABLE, NULL);
+    if (ret)
+        return;
+    ret = i8042_flush();
+    if (ret)
+        return;
+
+    if (ps2_fast_init()) {
+        if (!ps2_keyboard_enable()) {
+            dprintf(1, "PS2 keyboard initialized (fast)\n");
+            return;
+        }
+        // Keyboard didn't respond - reset it with the full sequence
+        dprintf(1, "PS2 keyboard fast init failed\n");
+        Ps2ctr = I8042_CTR_KBDDIS | I8042_CTR_AUXDIS;
+        ret = i8042_flush();
+        if (ret)
+            return;
+    }
+
+    if (ps2_keyboard_test() || ps2_keyboard_enable())
+        return;
     dprintf(1, "PS2 keyboard initialized\n");
 }
 
@@ -538,10 +589,15 @@ ps2port_setup(void)
         dprintf(1, "ACPI: no PS/2 keyboard present\n");
         return;
     }
+    if (is_fast_boot()) {
+        dprintf(1, "Fast boot - not initializing PS/2 keyboard and mouse\n");
+        return;
+    }
     dprintf(3, "init ps2port\n");
 
     enable_hwirq(1, FUNC16(entry_09));
     enable_hwirq(12, FUNC16(entry_74));
 
-    run_thread(ps2_keyboard_setup, NULL);
+    // The keyboard isn't needed until the boot menu - let disks go first
+    run_thread_prio(ps2_keyboard_setup, NULL, THREAD_PRIO_LOW);
 }
@@ -20,13 +20,18 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep
+#include "util.h" // bootprio_find_scsi_device
 #include "x86.h" // writel
 
 #define MASK(n) ((1 << (n)) - 1)
 
 #define SIMPLE_QUEUE_TAG 0x20
 
+// Maximum number of requests posted to the ring with one kick
+#define PVSCSI_MAX_INFLIGHT 16
+// Maximum data length of a single ring request
+#define PVSCSI_MAX_XFER (64*1024)
+
 #define PVSCSI_INTR_CMPL_0                 (1 << 0)
 #define PVSCSI_INTR_CMPL_1                 (1 << 1)
 #define PVSCSI_INTR_CMPL_MASK              MASK(2)
@@ -154,13 +159,6 @@ pvscsi_kick_rw_io(void *iobase)
     writel(iobase + PVSCSI_REG_OFFSET_KICK_RW_IO, 0);
 }
 
-static void
-pvscsi_wait_intr_cmpl(void *iobase)
-{
-    while (!(readl(iobase + PVSCSI_REG_OFFSET_INTR_STATUS) & PVSCSI_INTR_CMPL_MASK))
-        usleep(5);
-    writel(iobase + PVSCSI_REG_OFFSET_INTR_STATUS, PVSCSI_INTR_CMPL_MASK);
-}
 
 static void
 pvscsi_init_rings(void *iobase, struct pvscsi_ring_dsc_s **ring_dsc)
@@ -198,40 +196,57 @@ pvscsi_init_rings(void *iobase, struct pvscsi_ring_dsc_s **ring_dsc)
     *ring_dsc = dsc;
 }
 
-static u32
-pvscsi_get_rsp(struct PVSCSIRingsState *s,
-               struct PVSCSIRingCmpDesc *rsp)
+// Check if the device has completed all requests up to 'cmpidx'
+struct pvscsi_wait_s {
+    struct PVSCSIRingsState *s;
+    u32 cmpidx;
+};
+
+static int
+pvscsi_cmpl_reached(void *data)
 {
-    u32 status = rsp->hostStatus;
-    s->cmpConsIdx = s->cmpConsIdx + 1;
-    return status;
+    struct pvscsi_wait_s *w = data;
+    return (s32)(*(volatile u32*)&w->s->cmpProdIdx - w->cmpidx) >= 0;
 }
 
-int
-pvscsi_process_op(struct disk_op_s *op)
+// Wait for and drain the completions of 'num' posted requests
+static int
+pvscsi_reap(struct pvscsi_lun_s *plun, int num)
 {
-    if (!CONFIG_PVSCSI)
-        return DISK_RET_EBADTRACK;
-    struct pvscsi_lun_s *plun =
-        container_of(op->drive_fl, struct pvscsi_lun_s, drive);
     struct pvscsi_ring_dsc_s *ring_dsc = plun->ring_dsc;
     struct PVSCSIRingsState *s = ring_dsc->ring_state;
-    u32 req_entries = s->reqNumEntriesLog2;
     u32 cmp_entries = s->cmpNumEntriesLog2;
-    struct PVSCSIRingReqDesc *req;
-    struct PVSCSIRingCmpDesc *rsp;
-    u32 status;
-
-    if (s->reqProdIdx - s->cmpConsIdx >= 1 << req_entries) {
-        dprintf(1, "pvscsi: ring full: reqProdIdx=%d cmpConsIdx=%d\n",
-                s->reqProdIdx, s->cmpConsIdx);
-        return DISK_RET_EBADTRACK;
+    struct pvscsi_wait_s w = { s, s->cmpConsIdx + num };
+    int ret = wait_completion(pvscsi_cmpl_reached, &w, DISK_REQUEST_TIMEOUT);
+    writel(plun->iobase + PVSCSI_REG_OFFSET_INTR_STATUS, PVSCSI_INTR_CMPL_MASK);
+    if (ret)
+        return DISK_RET_ETIMEOUT;
+
+    ret = DISK_RET_SUCCESS;
+    while (num--) {
+        struct PVSCSIRingCmpDesc *rsp =
+            ring_dsc->ring_cmps + (s->cmpConsIdx & MASK(cmp_entries));
+        if (rsp->hostStatus)
+            ret = DISK_RET_EBADTRACK;
+        s->cmpConsIdx = s->cmpConsIdx + 1;
     }
+    return ret;
+}
+
+// Place a request on the ring (without notifying the device)
+static int
+pvscsi_post(struct pvscsi_lun_s *plun, struct disk_op_s *op)
+{
+    struct pvscsi_ring_dsc_s *ring_dsc = plun->ring_dsc;
+    struct PVSCSIRingsState *s = ring_dsc->ring_state;
+    u32 req_entries = s->reqNumEntriesLog2;
+    struct PVSCSIRingReqDesc *req;
 
     req = ring_dsc->ring_reqs + (s->reqProdIdx & MASK(req_entries));
     int blocksize = scsi_fill_cmd(op, req->cdb, 16);
     if (blocksize < 0)
-        return default_process_op(op);
+        return blocksize;
+    req->context = s->reqProdIdx;
     req->bus = 0;
     req->target = plun->target;
     memset(req->lun, 0, sizeof(req->lun));
@@ -246,14 +261,52 @@ pvscsi_process_op(struct disk_op_s *op)
     req->dataLen = op->count * blocksize;
     req->dataAddr = (u32)op->buf_fl;
     s->reqProdIdx = s->reqProdIdx + 1;
+    return blocksize;
+}
 
-    pvscsi_kick_rw_io(plun->iobase);
-    pvscsi_wait_intr_cmpl(plun->iobase);
-
-    rsp = ring_dsc->ring_cmps + (s->cmpConsIdx & MASK(cmp_entries));
-    status = pvscsi_get_rsp(s, rsp);
+int
+pvscsi_process_op(struct disk_op_s *op)
+{
+    if (!CONFIG_PVSCSI)
+        return DISK_RET_EBADTRACK;
+    struct pvscsi_lun_s *plun =
+        container_of(op->drive_fl, struct pvscsi_lun_s, drive);
+    struct PVSCSIRingsState *s = plun->ring_dsc->ring_state;
 
-    return status == 0 ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    int depth = (1 << s->reqNumEntriesLog2) - (s->reqProdIdx - s->cmpConsIdx);
+    if (depth <= 0) {
+        dprintf(1, "pvscsi: ring full: reqProdIdx=%d cmpConsIdx=%d\n",
+                s->reqProdIdx, s->cmpConsIdx);
+        return DISK_RET_EBADTRACK;
+    }
+    if (depth > PVSCSI_MAX_INFLIGHT)
+        depth = PVSCSI_MAX_INFLIGHT;
+
+    // Reads and writes are split into several requests which are
+    // posted together with one kick and then reaped in a batch.
+    u16 count = op->count, chunk = count, done = 0;
+    u32 blksize = op->drive_fl->blksize;
+    if ((op->command == CMD_READ || op->command == CMD_WRITE)
+        && blksize && blksize <= PVSCSI_MAX_XFER)
+        chunk = PVSCSI_MAX_XFER / blksize;
+    struct disk_op_s dop = *op;
+    int num = 0;
+    do {
+        dop.count = count - done < chunk ? count - done : chunk;
+        dop.lba = op->lba + done;
+        dop.buf_fl = op->buf_fl + done * blksize;
+        if (pvscsi_post(plun, &dop) < 0)
+            return default_process_op(op);
+        done += dop.count;
+        if (++num < depth && done < count)
+            continue;
+        pvscsi_kick_rw_io(plun->iobase);
+        int ret = pvscsi_reap(plun, num);
+        if (ret)
+            return ret;
+        num = 0;
+    } while (done < count);
+    return DISK_RET_SUCCESS;
 }
 
 static int
@@ -268,6 +321,7 @@ pvscsi_add_lun(struct pci_device *pci, void *iobase,
     memset(plun, 0, sizeof(*plun));
     plun->drive.type = DTYPE_PVSCSI;
     plun->drive.cntl_id = pci->bdf;
+    plun->drive.max_blocks = 0xffff;
     plun->target = target;
     plun->lun = lun;
     plun->iobase = iobase;
@@ -329,6 +383,8 @@ pvscsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_VMWARE
             || pci->device != PCI_DEVICE_ID_VMWARE_PVSCSI)
             continue;
+        if (boot_defer_pci(init_pvscsi, pci))
+            continue;
         run_thread(init_pvscsi, pci);
     }
 }
@@ -4,21 +4,177 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
-#include "biosvar.h" // GET_GLOBALFLAT
 #include "block.h" // struct drive_s
-#include "bregs.h" // struct bregs
-#include "e820map.h" // e820_add
-#include "malloc.h" // memalign_tmphigh
+#include "malloc.h" // memalign_persistent
 #include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
 #include "romfile.h" // romfile_findprefix
-#include "stacks.h" // call16_int
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
 #include "util.h" // process_ramdisk_op
 
-void
-ramdisk_setup(void)
+// Chunked compressed image file header.  The image is split into
+// fixed size blocks that are each an independent lzma stream (in the
+// same format cbfs uses).  The header is followed by blockcount+1
+// offsets (from the start of the file) of the compressed blocks.
+struct ramdisk_chunk_hdr {
+    u32 magic;
+    u32 imagesize;      // Uncompressed image size
+    u32 blocksize;      // Uncompressed bytes per block
+    u32 blockcount;
+} PACKED;
+
+#define RAMDISK_CHUNK_MAGIC 0x4b435253 // "SRCK"
+#define RAMDISK_CHUNK_MAXBLOCK (64*1024)
+#define RAMDISK_CACHE_BLOCKS 4
+
+struct ramdisk_chunk_s {
+    const u8 *data;     // File contents (mapped from flash)
+    u32 *index;         // Compressed block offsets (blockcount+1)
+    u32 imagesize, blocksize, blockcount;
+    struct ulzma_work_s *work;
+    u8 *cache;          // RAMDISK_CACHE_BLOCKS uncompressed blocks
+    u32 tags[RAMDISK_CACHE_BLOCKS]; // Block number+1 held in each slot
+    u32 next;           // Next slot to replace
+};
+
+struct ramdisk_s {
+    struct drive_s drive;
+    u8 readonly;        // Image is mapped in place from flash
+    struct ramdisk_chunk_s *chunk; // Image is decompressed on demand
+};
+
+// Check for a chunked compressed image mapped at 'data' and set up
+// its (permanent) block cache.  Blocks are only decompressed when
+// first read, so no ram is reserved for the uncompressed image.
+static struct ramdisk_chunk_s *
+ramdisk_chunk_setup(const u8 *data, u32 size)
+{
+    struct ramdisk_chunk_hdr hdr;
+    if (!CONFIG_FLASH_CHUNKED || size < sizeof(hdr))
+        return NULL;
+    iomemcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != RAMDISK_CHUNK_MAGIC)
+        return NULL;
+    u32 bs = hdr.blocksize;
+    if (!bs || bs > RAMDISK_CHUNK_MAXBLOCK || bs % DISK_SECTOR_SIZE
+        || !hdr.imagesize || hdr.imagesize % DISK_SECTOR_SIZE
+        || hdr.blockcount != DIV_ROUND_UP(hdr.imagesize, bs)) {
+        dprintf(1, "Invalid chunked ramdisk header\n");
+        return NULL;
+    }
+    u32 indexsize = (hdr.blockcount + 1) * sizeof(u32);
+    if (indexsize > size - sizeof(hdr)) {
+        dprintf(1, "Truncated chunked ramdisk index\n");
+        return NULL;
+    }
+
+    struct ramdisk_chunk_s *rc = malloc_high(sizeof(*rc));
+    u32 *index = malloc_high(indexsize);
+    u8 *cache = memalign_high(PAGE_SIZE, bs * RAMDISK_CACHE_BLOCKS);
+    struct ulzma_work_s *work = ulzma_work_alloc();
+    if (!rc || !index || !cache || !work) {
+        warn_noalloc();
+        goto fail;
+    }
+    iomemcpy(index, data + sizeof(hdr), indexsize);
+    int i;
+    for (i = 0; i < hdr.blockcount; i++)
+        if (index[i] < sizeof(hdr) + indexsize || index[i] > index[i+1]
+            || index[i+1] > size) {
+            dprintf(1, "Invalid chunked ramdisk index\n");
+            goto fail;
+        }
+
+    memset(rc, 0, sizeof(*rc));
+    rc->data = data;
+    rc->index = index;
+    rc->imagesize = hdr.imagesize;
+    rc->blocksize = bs;
+    rc->blockcount = hdr.blockcount;
+    rc->work = work;
+    rc->cache = cache;
+    dprintf(3, "Chunked ramdisk %d blocks of %d bytes\n", hdr.blockcount, bs);
+    return rc;
+fail:
+    free(rc);
+    free(index);
+    free(cache);
+    free(work);
+    return NULL;
+}
+
+// Return the uncompressed contents of a block, decompressing it into
+// the cache if needed.
+static u8 *
+ramdisk_chunk_get(struct ramdisk_chunk_s *rc, u32 block)
+{
+    u32 bs = rc->blocksize;
+    int i;
+    for (i = 0; i < RAMDISK_CACHE_BLOCKS; i++)
+        if (rc->tags[i] == block + 1)
+            return rc->cache + i * bs;
+    u32 slot = rc->next;
+    rc->next = (slot + 1) % RAMDISK_CACHE_BLOCKS;
+    rc->tags[slot] = 0;
+    u8 *dst = rc->cache + slot * bs;
+    u32 len = rc->imagesize - block * bs;
+    if (len > bs)
+        len = bs;
+    u32 start = rc->index[block];
+    int ret = ulzma_with(dst, bs, rc->data + start
+                         , rc->index[block + 1] - start, rc->work);
+    if (ret != len) {
+        dprintf(1, "Chunked ramdisk block %d failed (%d)\n", block, ret);
+        return NULL;
+    }
+    rc->tags[slot] = block + 1;
+    return dst;
+}
+
+static int
+ramdisk_chunk_read(struct ramdisk_chunk_s *rc, u8 *dst, u32 offset, u32 len)
+{
+    u32 bs = rc->blocksize;
+    if (offset > rc->imagesize || len > rc->imagesize - offset)
+        return DISK_RET_EPARAM;
+    while (len) {
+        u32 block = offset / bs, boff = offset % bs, count = bs - boff;
+        if (count > len)
+            count = len;
+        u8 *src = ramdisk_chunk_get(rc, block);
+        if (!src)
+            return DISK_RET_EBADTRACK;
+        memcpy(dst, src + boff, count);
+        dst += count;
+        offset += count;
+        len -= count;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+// Allocate a ramdisk_s wrapper for a floppy drive created by
+// init_floppy().
+static struct ramdisk_s *
+ramdisk_floppy_alloc(u32 pos, int ftype)
+{
+    struct ramdisk_s *rd = malloc_fseg(sizeof(*rd));
+    struct drive_s *drive = init_floppy(pos, ftype);
+    if (!rd || !drive) {
+        warn_noalloc();
+        free(rd);
+        free(drive);
+        return NULL;
+    }
+    memset(rd, 0, sizeof(*rd));
+    memcpy(&rd->drive, drive, sizeof(*drive));
+    free(drive);
+    rd->drive.type = DTYPE_RAMDISK;
+    return rd;
+}
+
+static void
+ramdisk_floppy_setup(void)
 {
     if (!CONFIG_FLASH_FLOPPY)
         return;
@@ -30,72 +186,149 @@ ramdisk_setup(void)
     const char *filename = file->name;
     u32 size = file->size;
     dprintf(3, "Found floppy file %s of size %d\n", filename, size);
+
+    // Chunked compressed images are decompressed on demand.
+    void *map = file->map ? file->map(file) : NULL;
+    struct ramdisk_chunk_s *rc = map ? ramdisk_chunk_setup(map, size) : NULL;
+    if (rc)
+        size = rc->imagesize;
     int ftype = find_floppy_type(size);
     if (ftype < 0) {
         dprintf(3, "No floppy type found for ramdisk size\n");
         return;
     }
 
-    // Allocate ram for image.
-    void *pos = memalign_tmphigh(PAGE_SIZE, size);
-    if (!pos) {
-        warn_noalloc();
-        return;
-    }
-    e820_add((u32)pos, size, E820_RESERVED);
+    void *pos = map;
+    if (!rc) {
+        // Allocate ram for image.
+        pos = memalign_persistent(PAGE_SIZE, size);
+        if (!pos) {
+            warn_noalloc();
+            return;
+        }
 
-    // Copy image into ram.
-    int ret = file->copy(file, pos, size);
-    if (ret < 0)
-        return;
+        // Copy image into ram.
+        int ret = file->copy(file, pos, size);
+        if (ret < 0) {
+            free(pos);
+            return;
+        }
+        malloc_persist(pos, size);
+    }
 
     // Setup driver.
-    struct drive_s *drive = init_floppy((u32)pos, ftype);
-    if (!drive)
+    struct ramdisk_s *rd = ramdisk_floppy_alloc((u32)pos, ftype);
+    if (!rd)
         return;
-    drive->type = DTYPE_RAMDISK;
-    dprintf(1, "Mapping floppy %s to addr %p\n", filename, pos);
+    rd->chunk = rc;
+    rd->readonly = !!rc;
+    struct drive_s *drive = &rd->drive;
+    dprintf(1, "Mapping floppy %s to addr %p%s\n", filename, pos
+            , rc ? " (compressed)" : "");
     char *desc = znprintf(MAXDESCSIZE, "Ramdisk [%s]", &filename[10]);
     boot_add_floppy(drive, desc, bootprio_find_named_rom(filename, 0));
 }
 
+static void
+ramdisk_hd_setup(void)
+{
+    if (!CONFIG_FLASH_HARDDISK)
+        return;
+
+    // Find image.
+    struct romfile_s *file = romfile_findprefix("hdimg/", NULL);
+    if (!file)
+        return;
+    const char *filename = file->name;
+    u32 size = file->size;
+    dprintf(3, "Found hard disk file %s of size %d\n", filename, size);
+    if (size < DISK_SECTOR_SIZE) {
+        dprintf(1, "Hard disk image %s is too small\n", filename);
+        return;
+    }
+
+    struct ramdisk_s *rd = malloc_fseg(sizeof(*rd));
+    if (!rd) {
+        warn_noalloc();
+        return;
+    }
+    memset(rd, 0, sizeof(*rd));
+
+    // Large images are served directly from flash when possible
+    // instead of being copied into ram.
+    void *pos = file->map ? file->map(file) : NULL;
+    struct ramdisk_chunk_s *rc = pos ? ramdisk_chunk_setup(pos, size) : NULL;
+    if (rc) {
+        rd->readonly = 1;
+        rd->chunk = rc;
+        size = rc->imagesize;
+    } else if (pos) {
+        rd->readonly = 1;
+    } else {
+        pos = memalign_persistent(PAGE_SIZE, size);
+        if (!pos) {
+            warn_noalloc();
+            free(rd);
+            return;
+        }
+        int ret = file->copy(file, pos, size);
+        if (ret < 0) {
+            free(pos);
+            free(rd);
+            return;
+        }
+        malloc_persist(pos, size);
+    }
+
+    // Setup driver.
+    rd->drive.type = DTYPE_RAMDISK;
+    rd->drive.cntl_id = (u32)pos;
+    rd->drive.blksize = DISK_SECTOR_SIZE;
+    rd->drive.sectors = size / DISK_SECTOR_SIZE;
+    dprintf(1, "Mapping hard disk %s to addr %p%s\n", filename, pos
+            , rc ? " (compressed)" : rd->readonly ? " (read-only)" : "");
+    char *desc = znprintf(MAXDESCSIZE, "Ramdisk [%s]", &filename[6]);
+    boot_add_hd(&rd->drive, desc, bootprio_find_named_rom(filename, 0));
+}
+
+void
+ramdisk_setup(void)
+{
+    ramdisk_floppy_setup();
+    ramdisk_hd_setup();
+}
+
 static int
 ramdisk_copy(struct disk_op_s *op, int iswrite)
 {
-    u32 offset = GET_GLOBALFLAT(op->drive_fl->cntl_id);
-    offset += (u32)op->lba * DISK_SECTOR_SIZE;
-    u64 opd = GDT_DATA | GDT_LIMIT(0xfffff) | GDT_BASE((u32)op->buf_fl);
-    u64 ramd = GDT_DATA | GDT_LIMIT(0xfffff) | GDT_BASE(offset);
+    struct drive_s *drive_fl = op->drive_fl;
+    struct ramdisk_s *rd = container_of(drive_fl, struct ramdisk_s, drive);
+    u32 offset = (u32)op->lba * DISK_SECTOR_SIZE;
+    void *pos = (void*)drive_fl->cntl_id + offset;
+    u32 len = op->count * DISK_SECTOR_SIZE;
+    if (!drive_fl->floppy_type && op->lba + op->count > drive_fl->sectors)
+        return DISK_RET_EPARAM;
 
-    u64 gdt[6];
     if (iswrite) {
-        gdt[2] = opd;
-        gdt[3] = ramd;
+        if (rd->readonly)
+            return DISK_RET_EWRITEPROTECT;
+        memcpy(pos, op->buf_fl, len);
+    } else if (CONFIG_FLASH_CHUNKED && rd->chunk) {
+        return ramdisk_chunk_read(rd->chunk, op->buf_fl, offset, len);
+    } else if (rd->readonly) {
+        iomemcpy(op->buf_fl, pos, len);
     } else {
-        gdt[2] = ramd;
-        gdt[3] = opd;
+        memcpy(op->buf_fl, pos, len);
     }
-
-    // Call int 1587 to copy data.
-    struct bregs br;
-    memset(&br, 0, sizeof(br));
-    br.flags = F_CF|F_IF;
-    br.ah = 0x87;
-    br.es = GET_SEG(SS);
-    br.si = (u32)gdt;
-    br.cx = op->count * DISK_SECTOR_SIZE / 2;
-    call16_int(0x15, &br);
-
-    if (br.flags & F_CF)
-        return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
 }
 
 int
 ramdisk_process_op(struct disk_op_s *op)
 {
-    if (!CONFIG_FLASH_FLOPPY)
+    if (!CONFIG_FLASH_FLOPPY && !CONFIG_FLASH_HARDDISK)
         return 0;
+    ASSERT32FLAT();
 
     switch (op->command) {
     case CMD_READ:
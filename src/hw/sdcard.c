@@ -66,6 +66,9 @@ struct sdhci_s {
 #define SC_SEND_OP_COND         ((1<<8) | SCB_R48o)
 #define SC_ALL_SEND_CID         ((2<<8) | SCB_R136)
 #define SC_SEND_RELATIVE_ADDR   ((3<<8) | SCB_R48)
+#define SC_SWITCH_FUNC          ((6<<8) | SCB_R48d)
+#define SC_MMC_SWITCH           ((6<<8) | SCB_R48b)
+#define SC_APP_SET_BUS_WIDTH    ((6<<8) | SCB_R48)
 #define SC_SELECT_DESELECT_CARD ((7<<8) | SCB_R48b)
 #define SC_SEND_IF_COND         ((8<<8) | SCB_R48)
 #define SC_SEND_EXT_CSD         ((8<<8) | SCB_R48d)
@@ -90,12 +93,25 @@ struct sdhci_s {
 #define SP_CARD_INSERTED (1<<16)
 
 // SDHCI transfer_mode flags
+#define ST_DMA        (1<<0)
 #define ST_BLOCKCOUNT (1<<1)
 #define ST_AUTO_CMD12 (1<<2)
 #define ST_READ       (1<<4)
 #define ST_MULTIPLE   (1<<5)
 
+// SDHCI host_control flags
+#define SHC_4BIT        (1<<1)
+#define SHC_HIGHSPEED   (1<<2)
+#define SHC_ADMA2_32    (2<<3)
+#define SHC_8BIT        (1<<5)
+
+// SDHCI error_irq_status flags
+#define SE_ADMA         (1<<9)
+
 // SDHCI capabilities flags
+#define SD_CAPLO_8BIT            (1<<18)
+#define SD_CAPLO_ADMA2           (1<<19)
+#define SD_CAPLO_HIGHSPEED       (1<<21)
 #define SD_CAPLO_V33             (1<<24)
 #define SD_CAPLO_V30             (1<<25)
 #define SD_CAPLO_V18             (1<<26)
@@ -133,16 +149,32 @@ struct sdhci_s {
 #define SDHCI_POWERUP_TIMEOUT  1000
 #define SDHCI_PIO_TIMEOUT      1000  // XXX - this is just made up
 
+// ADMA2 (32bit) descriptor
+struct sdhci_adma2_desc {
+    u16 attr;
+    u16 length;
+    u32 addr;
+} PACKED;
+
+#define SA_VALID (1<<0)
+#define SA_END   (1<<1)
+#define SA_TRAN  (2<<4)
+
+#define SDHCI_ADMA_DESCS   4
+#define SDHCI_ADMA_MAXLEN  (32*1024)
+
 // Internal 'struct drive_s' storage for a detected card
 struct sddrive_s {
     struct drive_s drive;
     struct sdhci_s *regs;
     int card_type;
+    struct sdhci_adma2_desc *adma;
 };
 
 // SD card types
 #define SF_MMC          (1<<0)
 #define SF_HIGHCAPACITY (1<<1)
+#define SF_HIGHSPEED    (1<<2) // MMC supports 52Mhz timing
 
 // Repeatedly read a u16 register until any bit in a given mask is set
 static int
@@ -210,29 +242,48 @@ sdcard_pio(struct sdhci_s *regs, int cmd, u32 *param)
 
 // Send an "app specific" command to the card.
 static int
-sdcard_pio_app(struct sdhci_s *regs, int cmd, u32 *param)
+sdcard_pio_app(struct sdhci_s *regs, u16 rca, int cmd, u32 *param)
 {
-    u32 aparam[4] = {};
+    u32 aparam[4] = { rca << 16 };
     int ret = sdcard_pio(regs, SC_APP_CMD, aparam);
     if (ret)
         return ret;
     return sdcard_pio(regs, cmd, param);
 }
 
+// Wait for the end of a data transfer (or of the busy signal of an
+// R1b command).
+static int
+sdcard_wait_done(struct sdhci_s *regs)
+{
+    int ret = sdcard_waitw(&regs->irq_status, SI_ERROR|SI_TRANS_DONE);
+    if (ret >= 0 && ret & SI_ERROR) {
+        u16 err = readw(&regs->error_irq_status);
+        dprintf(3, "sdcard transfer stop (code=%x adma=%x)\n"
+                , err, err & SE_ADMA ? readb(&regs->adma_error) : 0);
+        writew(&regs->error_irq_status, err);
+        ret = -1;
+    }
+    if (ret < 0) {
+        sdcard_reset(regs, SRF_CMD|SRF_DATA);
+        return ret;
+    }
+    writew(&regs->irq_status, SI_TRANS_DONE);
+    return 0;
+}
+
 // Send a command to the card which transfers data.
 static int
 sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
-                    , void *data, int count)
+                    , void *data, int count, int blksize)
 {
     // Send command
-    writew(&drive->regs->block_size, DISK_SECTOR_SIZE);
+    writew(&drive->regs->block_size, blksize);
     writew(&drive->regs->block_count, count);
     int isread = cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE;
     u16 tmode = ((count > 1 ? ST_MULTIPLE|ST_AUTO_CMD12|ST_BLOCKCOUNT : 0)
                  | (isread ? ST_READ : 0));
     writew(&drive->regs->transfer_mode, tmode);
-    if (!(drive->card_type & SF_HIGHCAPACITY))
-        addr *= DISK_SECTOR_SIZE;
     u32 param[4] = { addr };
     int ret = sdcard_pio(drive->regs, cmd, param);
     if (ret)
@@ -245,7 +296,7 @@ sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
             return ret;
         writew(&drive->regs->irq_status, cbit);
         int i;
-        for (i=0; i<DISK_SECTOR_SIZE/4; i++) {
+        for (i=0; i<blksize/4; i++) {
             if (isread)
                 *(u32*)data = readl(&drive->regs->data);
             else
@@ -261,6 +312,44 @@ sdcard_pio_transfer(struct sddrive_s *drive, int cmd, u32 addr
     return 0;
 }
 
+// Transfer data between the card and memory using the ADMA2 engine.
+static int
+sdcard_dma_transfer(struct sddrive_s *drive, int cmd, u32 addr
+                    , void *data, int count)
+{
+    struct sdhci_s *regs = drive->regs;
+    struct sdhci_adma2_desc *desc = drive->adma;
+    u32 len = count * DISK_SECTOR_SIZE;
+    int i;
+    for (i = 0; len; i++) {
+        if (i >= SDHCI_ADMA_DESCS)
+            return -1;
+        u32 n = len > SDHCI_ADMA_MAXLEN ? SDHCI_ADMA_MAXLEN : len;
+        len -= n;
+        desc[i].attr = SA_VALID | SA_TRAN | (len ? 0 : SA_END);
+        desc[i].length = n;
+        desc[i].addr = (u32)data;
+        data += n;
+    }
+    writel(&regs->adma_addr, (u32)desc);
+    writel((void*)&regs->adma_addr + 4, 0);
+
+    // Send command
+    writew(&regs->block_size, DISK_SECTOR_SIZE);
+    writew(&regs->block_count, count);
+    int isread = cmd != SC_WRITE_SINGLE && cmd != SC_WRITE_MULTIPLE;
+    u16 tmode = ((count > 1 ? ST_MULTIPLE|ST_AUTO_CMD12|ST_BLOCKCOUNT : 0)
+                 | (isread ? ST_READ : 0) | ST_DMA);
+    writew(&regs->transfer_mode, tmode);
+    // Don't mistake the busy end of an earlier R1b command for completion
+    writew(&regs->irq_status, SI_TRANS_DONE);
+    u32 param[4] = { addr };
+    int ret = sdcard_pio(regs, cmd, param);
+    if (ret)
+        return ret;
+    return sdcard_wait_done(regs);
+}
+
 // Read/write a block of data to/from the card.
 static int
 sdcard_readwrite(struct disk_op_s *op, int iswrite)
@@ -270,7 +359,16 @@ sdcard_readwrite(struct disk_op_s *op, int iswrite)
     int cmd = iswrite ? SC_WRITE_SINGLE : SC_READ_SINGLE;
     if (op->count > 1)
         cmd = iswrite ? SC_WRITE_MULTIPLE : SC_READ_MULTIPLE;
-    int ret = sdcard_pio_transfer(drive, cmd, op->lba, op->buf_fl, op->count);
+    u32 addr = op->lba;
+    if (!(drive->card_type & SF_HIGHCAPACITY))
+        addr *= DISK_SECTOR_SIZE;
+    int ret;
+    // The 32bit ADMA2 engine requires dword aligned buffers
+    if (drive->adma && !((u32)op->buf_fl & 3))
+        ret = sdcard_dma_transfer(drive, cmd, addr, op->buf_fl, op->count);
+    else
+        ret = sdcard_pio_transfer(drive, cmd, addr, op->buf_fl, op->count
+                                  , DISK_SECTOR_SIZE);
     if (ret)
         return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
@@ -338,7 +436,7 @@ sdcard_set_frequency(struct sdhci_s *regs, u32 khz)
         divisor = divisor > 1 ? 1 << __fls(divisor-1) : 0;
         creg = (divisor & SCC_SDCLK_MASK) << SCC_SDCLK_SHIFT;
     } else {
-        divisor = DIV_ROUND_UP(divisor, 2);
+        divisor = divisor > 1 ? DIV_ROUND_UP(divisor, 2) : 0;
         creg = (divisor & SCC_SDCLK_MASK) << SCC_SDCLK_SHIFT;
         creg |= (divisor & SCC_SDCLK_HI_MASK) >> SCC_SDCLK_HI_RSHIFT;
     }
@@ -354,6 +452,61 @@ sdcard_set_frequency(struct sdhci_s *regs, u32 khz)
     return 0;
 }
 
+// Write a byte of the EXT_CSD register of an MMC card
+static int
+sdcard_mmc_switch(struct sdhci_s *regs, u8 index, u8 value)
+{
+    u32 param[4] = { (3<<24) | (index<<16) | (value<<8) };
+    int ret = sdcard_pio(regs, SC_MMC_SWITCH, param);
+    if (ret)
+        return ret;
+    return sdcard_wait_done(regs);
+}
+
+// Widen the data bus and enable high speed timing where both the card
+// and the controller support it.
+static int
+sdcard_set_buswidth(struct sddrive_s *drive, u16 rca)
+{
+    struct sdhci_s *regs = drive->regs;
+    u32 cap = readl(&regs->cap_lo), khz = 25000;
+    u8 hctl = readb(&regs->host_control);
+    hctl &= ~(SHC_4BIT | SHC_8BIT | SHC_HIGHSPEED);
+    if (drive->card_type & SF_MMC) {
+        // EXT_CSD BUS_WIDTH (2 is 8bit, 1 is 4bit) and HS_TIMING
+        if (cap & SD_CAPLO_8BIT && !sdcard_mmc_switch(regs, 183, 2))
+            hctl |= SHC_8BIT;
+        else if (!sdcard_mmc_switch(regs, 183, 1))
+            hctl |= SHC_4BIT;
+        if (cap & SD_CAPLO_HIGHSPEED && drive->card_type & SF_HIGHSPEED
+            && !sdcard_mmc_switch(regs, 185, 1)) {
+            hctl |= SHC_HIGHSPEED;
+            khz = 52000;
+        }
+        writeb(&regs->host_control, hctl);
+    } else {
+        // All SD cards support a 4bit bus
+        u32 param[4] = { 2 };
+        if (!sdcard_pio_app(regs, rca, SC_APP_SET_BUS_WIDTH, param))
+            hctl |= SHC_4BIT;
+        writeb(&regs->host_control, hctl);
+        if (cap & SD_CAPLO_HIGHSPEED) {
+            // Select function 1 (high speed) of function group 1
+            u8 status[64];
+            int ret = sdcard_pio_transfer(drive, SC_SWITCH_FUNC, 0x80fffff1
+                                          , status, 1, sizeof(status));
+            if (!ret && (status[16] & 0x0f) == 1) {
+                hctl |= SHC_HIGHSPEED;
+                khz = 50000;
+                writeb(&regs->host_control, hctl);
+            }
+        }
+    }
+    dprintf(3, "sdcard@%p bus %dbit %dKhz\n", regs
+            , hctl & SHC_8BIT ? 8 : hctl & SHC_4BIT ? 4 : 1, khz);
+    return sdcard_set_frequency(regs, khz);
+}
+
 // Obtain the disk size of an SD card
 static int
 sdcard_get_capacity(struct sddrive_s *drive, u8 *csd)
@@ -368,10 +521,13 @@ sdcard_get_capacity(struct sddrive_s *drive, u8 *csd)
     if ((drive->card_type & SF_MMC) && CSD_STRUCTURE >= 2) {
         // Get capacity from EXT_CSD register
         u8 ext_csd[512];
-        int ret = sdcard_pio_transfer(drive, SC_SEND_EXT_CSD, 0, ext_csd, 1);
+        int ret = sdcard_pio_transfer(drive, SC_SEND_EXT_CSD, 0, ext_csd, 1
+                                      , sizeof(ext_csd));
         if (ret)
             return ret;
         count = *(u32*)&ext_csd[212];
+        if (ext_csd[196] & 0x02) // DEVICE_TYPE - 52Mhz high speed
+            drive->card_type |= SF_HIGHSPEED;
     } else if (!(drive->card_type & SF_MMC) && CSD_STRUCTURE >= 1) {
         // High capacity SD card
         u32 C_SIZE2 = csd[5] | (csd[6] << 8) | ((csd[7] & 0x3f) << 16);
@@ -406,7 +562,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         hcs = (1<<30);
     // Verify SD card (instead of MMC or SDIO)
     param[0] = 0x00;
-    ret = sdcard_pio_app(regs, SC_APP_SEND_OP_COND, param);
+    ret = sdcard_pio_app(regs, 0, SC_APP_SEND_OP_COND, param);
     if (ret) {
         // Check for MMC card
         param[0] = 0x00;
@@ -423,7 +579,7 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
         if (drive->card_type & SF_MMC)
             ret = sdcard_pio(regs, SC_SEND_OP_COND, param);
         else
-            ret = sdcard_pio_app(regs, SC_APP_SEND_OP_COND, param);
+            ret = sdcard_pio_app(regs, 0, SC_APP_SEND_OP_COND, param);
         if (ret)
             return ret;
         if (param[0] & SR_OCR_NOTBUSY)
@@ -465,6 +621,19 @@ sdcard_card_setup(struct sddrive_s *drive, int volt, int prio)
     ret = sdcard_get_capacity(drive, csd);
     if (ret)
         return ret;
+    ret = sdcard_set_buswidth(drive, rca);
+    if (ret)
+        return ret;
+    if (readl(&regs->cap_lo) & SD_CAPLO_ADMA2) {
+        drive->adma = memalign_high(
+            4, SDHCI_ADMA_DESCS * sizeof(struct sdhci_adma2_desc));
+        if (drive->adma) {
+            writeb(&regs->host_control
+                   , readb(&regs->host_control) | SHC_ADMA2_32);
+            drive->drive.max_blocks = (SDHCI_ADMA_DESCS * SDHCI_ADMA_MAXLEN
+                                       / DISK_SECTOR_SIZE);
+        }
+    }
     char pnm[7] = {};
     int i;
     for (i=0; i < (drive->card_type & SF_MMC ? 6 : 5); i++)
@@ -567,6 +736,8 @@ sdcard_setup(void)
         if (pci->class != PCI_CLASS_SYSTEM_SDHCI || pci->prog_if >= 2)
             // Not an SDHCI controller following SDHCI spec
             continue;
+        if (boot_defer_pci(sdcard_pci_setup, pci))
+            continue;
         run_thread(sdcard_pci_setup, pci);
     }
 }
@@ -8,6 +8,7 @@
 #include "fw/paravirt.h" // RunningOnQEMU
 #include "output.h" // dprintf
 #include "serialio.h" // serial_debug_preinit
+#include "util.h" // in_post
 #include "x86.h" // outb
 
 
@@ -55,18 +56,49 @@ serial_debug_preinit(void)
     u8 oldier, newier = 0;
     oldier = serial_debug_read(SEROFF_IER);
     serial_debug_write(SEROFF_IER, newier);
+    // Enable (and clear) the fifo if there is one
+    serial_debug_write(SEROFF_FCR, 0x07);
 
     if (oldparam != newparam || oldier != newier)
         dprintf(1, "Changing serial settings was %x/%x now %x/%x\n"
                 , oldparam, oldier, newparam, newier);
 }
 
+// During POST the transmit fifo is filled without checking the LSR
+// for every character - DebugSerialRoom counts the space left since
+// the fifo was last seen empty.
+u8 DebugSerialFifo VARFSEG; // Zero until probed
+u8 DebugSerialRoom VARFSEG;
+
+static void
+serial_debug_fifo(char c)
+{
+    if (!DebugSerialRoom) {
+        int timeout = DEBUG_TIMEOUT;
+        while ((serial_debug_read(SEROFF_LSR) & 0x20) != 0x20)
+            if (!timeout--)
+                // Ran out of time.
+                return;
+        if (!DebugSerialFifo)
+            // A 16550A reports a working fifo in the top bits of the IIR
+            DebugSerialFifo = ((serial_debug_read(SEROFF_IIR) & 0xc0) == 0xc0
+                               ? 16 : 1);
+        DebugSerialRoom = DebugSerialFifo;
+    }
+    serial_debug_write(SEROFF_DATA, c);
+    DebugSerialRoom--;
+}
+
 // Write a character to the serial port.
 static void
 serial_debug(char c)
 {
     if (!CONFIG_DEBUG_SERIAL && (!CONFIG_DEBUG_SERIAL_MMIO || MODESEGMENT))
         return;
+    if (!MODESEGMENT && in_post()) {
+        serial_debug_fifo(c);
+        return;
+    }
     int timeout = DEBUG_TIMEOUT;
     while ((serial_debug_read(SEROFF_LSR) & 0x20) != 0x20)
         if (!timeout--)
@@ -116,6 +148,12 @@ qemu_debug_preinit(void)
         DebugOutputPort = 0;
 }
 
+// During POST whole lines are sent to the debug port with a single
+// "rep outsb" instead of one (trapping) outb per character.
+#define QEMU_DEBUG_BUFSIZE 128
+char QemuDebugBuf[QEMU_DEBUG_BUFSIZE] VARFSEG;
+u8 QemuDebugLen VARFSEG;
+
 // Write a character to the special debugging port.
 void
 qemu_debug_putc(char c)
@@ -123,7 +161,27 @@ qemu_debug_putc(char c)
     if (!CONFIG_DEBUG_IO || !runningOnQEMU())
         return;
     u16 port = GET_GLOBAL(DebugOutputPort);
-    if (port)
-        // Send character to debug port.
-        outb(c, port);
+    if (!port)
+        return;
+    if (!MODESEGMENT && in_post()) {
+        QemuDebugBuf[QemuDebugLen++] = c;
+        if (c == '\n' || QemuDebugLen >= sizeof(QemuDebugBuf))
+            qemu_debug_flush();
+        return;
+    }
+    // Send character to debug port.
+    outb(c, port);
+}
+
+// Send any buffered characters to the debugging port.
+void
+qemu_debug_flush(void)
+{
+    if (!CONFIG_DEBUG_IO || MODESEGMENT)
+        return;
+    u32 len = QemuDebugLen;
+    if (!len)
+        return;
+    QemuDebugLen = 0;
+    outsb(DebugOutputPort, (u8*)QemuDebugBuf, len);
 }
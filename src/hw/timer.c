@@ -60,6 +60,16 @@ u8 ShiftTSC VARFSEG;
 
 #define CALIBRATE_COUNT 0x800   // Approx 1.7ms
 
+// HPET registers
+#define HPET_ID_PERIOD  0x004   // Counter period in femtoseconds
+#define HPET_CFG        0x010
+#define HPET_CFG_ENABLE 0x001
+#define HPET_COUNTER    0x0f0
+#define HPET_MAX_PERIOD 100000000 // 100ns - the maximum the spec allows
+#define HPET_CALIBRATE_US 2000
+
+static u32 HpetAddr;
+
 // Calibrate the CPU time-stamp-counter
 static void
 tsctimer_setup(void)
@@ -97,41 +107,138 @@ tsctimer_setup(void)
     dprintf(1, "CPU Mhz=%u\n", (TimerKHz << ShiftTSC) / 1000);
 }
 
-// Setup internal timers.
+static void
+__tsctimer_setfreq(u32 khz, const char *src)
+{
+    TimerKHz = khz;
+    ShiftTSC = 0;
+    while (TimerKHz >= 6000) {
+        ShiftTSC++;
+        TimerKHz = (TimerKHz + 1) >> 1;
+    }
+    TimerPort = 0;
+
+    dprintf(1, "CPU Mhz=%u (%s)\n", (TimerKHz << ShiftTSC) / 1000, src);
+}
+
 void
-timer_setup(void)
+tsctimer_setfreq(u32 khz, const char *src)
 {
     if (!CONFIG_TSC_TIMER)
         return;
     if (TimerPort != PORT_PIT_COUNTER0)
         return; // have timer already
+    __tsctimer_setfreq(khz, src);
+}
 
-    // Check if CPU has a timestamp counter
-    u32 eax, ebx, ecx, edx, cpuid_features = 0;
-    cpuid(0, &eax, &ebx, &ecx, &edx);
-    if (eax > 0)
-        cpuid(1, &eax, &ebx, &ecx, &cpuid_features);
-    if (cpuid_features & CPUID_TSC)
-        tsctimer_setup();
+// Check if the tsc runs at a constant rate in all cpu states.
+static int
+tsc_invariant(void)
+{
+    u32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007)
+        return 0;
+    cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return !!(edx & CPUID_EXT7_EDX_INVTSC);
+}
+
+// Return the tsc frequency reported by cpuid leaf 0x15 (or the base
+// frequency from leaf 0x16) - zero if not reported.
+static u32
+tsc_cpuid_khz(void)
+{
+    u32 max, eax, ebx, ecx, edx;
+    cpuid(0, &max, &ebx, &ecx, &edx);
+    if (max >= 0x15) {
+        cpuid(0x15, &eax, &ebx, &ecx, &edx);
+        if (eax && ebx && ecx)
+            // ecx is the crystal Hz and ebx/eax the tsc to crystal ratio
+            return DIV_ROUND_UP(ecx, 1000) * ebx / eax;
+    }
+    if (max >= 0x16) {
+        cpuid(0x16, &eax, &ebx, &ecx, &edx);
+        if (eax & 0xffff)
+            return (eax & 0xffff) * 1000;
+    }
+    return 0;
 }
 
+// Note the hpet found in the ACPI tables (for tsc calibration).
 void
-tsctimer_setfreq(u32 khz, const char *src)
+hpet_setup(u64 addr)
+{
+    if (!CONFIG_TSC_TIMER || !addr || addr > 0xffffffff)
+        return;
+    dprintf(1, "Found hpet at %x\n", (u32)addr);
+    HpetAddr = addr;
+}
+
+// Calibrate the tsc against the hpet main counter - returns the tsc
+// frequency in khz (or zero if there is no usable hpet).
+static u32
+tsc_hpet_khz(void)
+{
+    void *hpet = (void*)HpetAddr;
+    if (!hpet)
+        return 0;
+    u32 period = readl(hpet + HPET_ID_PERIOD);
+    if (!period || period > HPET_MAX_PERIOD)
+        return 0;
+    u32 cfg = readl(hpet + HPET_CFG);
+    if (!(cfg & HPET_CFG_ENABLE))
+        writel(hpet + HPET_CFG, cfg | HPET_CFG_ENABLE);
+
+    // Count tsc cycles for HPET_CALIBRATE_US worth of hpet ticks
+    u32 ps = period / 1000;
+    u32 ticks = DIV_ROUND_UP(HPET_CALIBRATE_US * 1000000U, ps);
+    u32 start = readl(hpet + HPET_COUNTER), now;
+    u64 tscstart = rdtscll();
+    do {
+        now = readl(hpet + HPET_COUNTER);
+    } while (now - start < ticks);
+    u32 diff = rdtscll() - tscstart;
+
+    if (!(cfg & HPET_CFG_ENABLE))
+        writel(hpet + HPET_CFG, cfg);
+
+    // Elapsed time (scaled to avoid overflowing 32 bits)
+    u32 us = (now - start) * (ps / 8) / 125 / 1000;
+    dprintf(6, "tsc hpet calibrate diff=%u us=%u\n", diff, us);
+    return diff / us * 1000 + diff % us * 1000 / us;
+}
+
+// Setup internal timers.  An invariant tsc is preferred over the pm
+// timer (whose port reads trap to the hypervisor on virtual machines).
+void
+timer_setup(void)
 {
     if (!CONFIG_TSC_TIMER)
         return;
-    if (TimerPort != PORT_PIT_COUNTER0)
-        return; // have timer already
+    if (!TimerPort)
+        return; // have tsc timer already
 
-    TimerKHz = khz;
-    ShiftTSC = 0;
-    while (TimerKHz >= 6000) {
-        ShiftTSC++;
-        TimerKHz = (TimerKHz + 1) >> 1;
+    // Check if CPU has a timestamp counter
+    u32 eax, ebx, ecx, edx, cpuid_features = 0;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax > 0)
+        cpuid(1, &eax, &ebx, &ecx, &cpuid_features);
+    if (!(cpuid_features & CPUID_TSC))
+        return;
+    int invariant = tsc_invariant();
+    if (TimerPort != PORT_PIT_COUNTER0 && !invariant)
+        return; // keep the pm timer
+    u32 khz = invariant ? tsc_cpuid_khz() : 0;
+    if (khz) {
+        __tsctimer_setfreq(khz, "cpuid");
+        return;
     }
-    TimerPort = 0;
-
-    dprintf(1, "CPU Mhz=%u (%s)\n", (TimerKHz << ShiftTSC) / 1000, src);
+    // The hpet gives a more precise calibration than the pit
+    khz = tsc_hpet_khz();
+    if (khz)
+        __tsctimer_setfreq(khz, "hpet");
+    else
+        tsctimer_setup();
 }
 
 void
@@ -148,6 +255,43 @@ pmtimer_setup(u16 ioport)
 }
 
 
+// Return the tsc frequency (or zero if the tsc is not the timer source)
+u32
+timer_tsc_khz(void)
+{
+    if (GET_GLOBAL(TimerPort))
+        return 0;
+    return GET_GLOBAL(TimerKHz) << GET_GLOBAL(ShiftTSC);
+}
+
+// Return the frequency of the values returned by timer_read()
+u32
+timer_khz(void)
+{
+    return GET_GLOBAL(TimerKHz);
+}
+
+// Sample the tsc (or return zero if the tsc is not the timer source)
+u64
+timer_tsc_read(void)
+{
+    if (!CONFIG_TSC_TIMER || GET_GLOBAL(TimerPort))
+        return 0;
+    return rdtscll();
+}
+
+// Convert a difference of two timer_tsc_read() samples to
+// milliseconds.  Returns 0xffffffff if the difference is too large.
+u32
+timer_tsc_msecs(u64 delta)
+{
+    delta >>= GET_GLOBAL(ShiftTSC);
+    if (delta > 0xffffffff)
+        return 0xffffffff;
+    return (u32)delta / GET_GLOBAL(TimerKHz);
+}
+
+
 /****************************************************************
  * Internal timer reading
  ****************************************************************/
@@ -167,7 +311,7 @@ timer_adjust_bits(u32 value, u32 validbits)
 }
 
 // Sample the current timer value.
-static u32
+u32
 timer_read(void)
 {
     u16 port = GET_GLOBAL(TimerPort);
@@ -223,8 +367,7 @@ timer_delay(u32 end)
 static void
 timer_sleep(u32 end)
 {
-    while (!timer_check(end))
-        yield();
+    yield_until(end);
 }
 
 void ndelay(u32 count) {
@@ -58,6 +58,13 @@ static const u32 tpm_default_durations[3] = {
 static u32 tpm_default_dur[3];
 static u32 tpm_default_to[4];
 
+/* locality known to be active - only trusted during POST when the
+   firmware is the sole user of the tpm */
+#define TIS_LOCTY_NONE 0xff
+static u8 tis_locty_cache = TIS_LOCTY_NONE;
+/* PTP FIFO interface permits 4 byte data fifo accesses */
+static u8 tis_fifo_wide;
+
 static u32 crb_cmd_size;
 static void *crb_cmd;
 static u32 crb_resp_size;
@@ -123,6 +130,7 @@ static u32 tis_probe(void)
     u32 ifaceid = readl(TIS_REG(0, TIS_REG_IFACE_ID));
 
     if ((ifaceid & 0xf) != 0xf) {
+        tis_fifo_wide = 1;
         if ((ifaceid & 0xf) == 1) {
             /* CRB is active; no TIS */
             return 0;
@@ -216,6 +224,10 @@ static u32 tis_activate(u8 locty)
     int l;
     u32 timeout_a = tpm_drivers[TIS_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_A];
 
+    /* the previous command left the locality active and ready */
+    if (in_post() && tis_locty_cache == locty)
+        return 0;
+
     if (!(readb(TIS_REG(locty, TIS_REG_ACCESS)) &
           TIS_ACCESS_ACTIVE_LOCALITY)) {
         /* release locality in use top-downwards */
@@ -232,6 +244,8 @@ static u32 tis_activate(u8 locty)
         writeb(TIS_REG(locty, TIS_REG_STS), TIS_STS_COMMAND_READY);
         rc = tis_wait_sts(locty, timeout_a,
                           TIS_STS_COMMAND_READY, TIS_STS_COMMAND_READY);
+        if (rc == 0 && in_post())
+            tis_locty_cache = locty;
     }
 
     return rc;
@@ -244,6 +258,9 @@ static u32 tis_find_active_locality(void)
 
     u8 locty;
 
+    if (in_post() && tis_locty_cache != TIS_LOCTY_NONE)
+        return tis_locty_cache;
+
     for (locty = 0; locty <= 4; locty++) {
         if ((readb(TIS_REG(locty, TIS_REG_ACCESS)) &
              TIS_ACCESS_ACTIVE_LOCALITY))
@@ -301,12 +318,16 @@ static u32 tis_senddata(const u8 *const data, u32 len)
             break;
         }
 
-        while (1) {
-            writeb(TIS_REG(locty, TIS_REG_DATA_FIFO), data[offset++]);
-            burst--;
-
-            if (burst == 0 || offset == len)
-                break;
+        while (burst && offset < len) {
+            if (tis_fifo_wide && burst >= 4 && len - offset >= 4) {
+                writel(TIS_REG(locty, TIS_REG_DATA_FIFO),
+                       *(u32*)&data[offset]);
+                offset += 4;
+                burst -= 4;
+            } else {
+                writeb(TIS_REG(locty, TIS_REG_DATA_FIFO), data[offset++]);
+                burst--;
+            }
         }
 
         if (offset == len)
@@ -327,12 +348,25 @@ static u32 tis_readresp(u8 *buffer, u32 *len)
     u8 locty = tis_find_active_locality();
 
     while (offset < *len) {
-        buffer[offset] = readb(TIS_REG(locty, TIS_REG_DATA_FIFO));
-        offset++;
-        sts = readb(TIS_REG(locty, TIS_REG_STS));
+        sts = readl(TIS_REG(locty, TIS_REG_STS));
         /* data left ? */
         if ((sts & TIS_STS_DATA_AVAILABLE) == 0)
             break;
+        /* read the whole burst before checking the status again */
+        u16 burst = sts >> 8;
+        if (burst == 0)
+            burst = 1;
+        while (burst && offset < *len) {
+            if (tis_fifo_wide && burst >= 4 && *len - offset >= 4) {
+                *(u32*)&buffer[offset] =
+                    readl(TIS_REG(locty, TIS_REG_DATA_FIFO));
+                offset += 4;
+                burst -= 4;
+            } else {
+                buffer[offset++] = readb(TIS_REG(locty, TIS_REG_DATA_FIFO));
+                burst--;
+            }
+        }
     }
 
     *len = offset;
@@ -475,6 +509,25 @@ static u32 crb_ready(void)
     return rc;
 }
 
+/* copy to/from the crb buffers with 32 bit accesses - a byte copy may
+   trap to the hypervisor for every byte */
+static void crb_write_buf(void *buf, const u8 *data, u32 len)
+{
+    u32 offset = 0;
+    for (; offset + 4 <= len; offset += 4)
+        writel(buf + offset, *(u32*)&data[offset]);
+    for (; offset < len; offset++)
+        writeb(buf + offset, data[offset]);
+}
+
+static void crb_read_buf(u8 *data, void *buf, u32 offset, u32 end)
+{
+    for (; offset + 4 <= end; offset += 4)
+        *(u32*)&data[offset] = readl(buf + offset);
+    for (; offset < end; offset++)
+        data[offset] = readb(buf + offset);
+}
+
 static u32 crb_senddata(const u8 *const data, u32 len)
 {
     if (!CONFIG_TCGBIOS)
@@ -484,7 +537,7 @@ static u32 crb_senddata(const u8 *const data, u32 len)
         return 1;
 
     u8 locty = crb_find_active_locality();
-    memcpy(crb_cmd, data, len);
+    crb_write_buf(crb_cmd, data, len);
     writel(CRB_REG(locty, CRB_REG_CTRL_START), CRB_START_INVOKE);
 
     return 0;
@@ -502,14 +555,17 @@ static u32 crb_readresp(u8 *buffer, u32 *len)
     if (*len < 6)
         return 1;
 
-    memcpy(buffer, crb_resp, 6);
+    /* tag and size, then only as much of the response as was sent */
+    *(u32*)&buffer[0] = readl(crb_resp);
+    *(u16*)&buffer[4] = readw(crb_resp + 4);
     u32 expected = be32_to_cpu(*(u32 *) &buffer[2]);
     if (expected < 6)
         return 1;
 
     *len = (*len < expected) ? *len : expected;
 
-    memcpy(buffer + 6, crb_resp + 6, *len - 6);
+    /* continue from offset 4 to keep the dword reads aligned */
+    crb_read_buf(buffer, crb_resp, 4, *len);
 
     return 0;
 }
@@ -604,29 +660,35 @@ tpmhw_transmit(u8 locty, struct tpm_req_header *req,
     u32 irc = td->activate(locty);
     if (irc != 0) {
         /* tpm could not be activated */
-        return -1;
+        goto fail;
     }
 
     irc = td->senddata((void*)req, be32_to_cpu(req->totlen));
     if (irc != 0)
-        return -1;
+        goto fail;
 
     irc = td->waitdatavalid();
     if (irc != 0)
-        return -1;
+        goto fail;
 
     irc = td->waitrespready(to_t);
     if (irc != 0)
-        return -1;
+        goto fail;
 
     irc = td->readresp(respbuffer, respbufferlen);
     if (irc != 0 ||
         *respbufferlen < sizeof(struct tpm_rsp_header))
-        return -1;
+        goto fail;
 
-    td->ready();
+    if (td->ready() != 0)
+        tis_locty_cache = TIS_LOCTY_NONE;
 
     return 0;
+
+fail:
+    /* the tpm state is unknown - redo the locality handshake next time */
+    tis_locty_cache = TIS_LOCTY_NONE;
+    return -1;
 }
 
 void
@@ -9,6 +9,7 @@
 #include "output.h" // dprintf
 #include "malloc.h" // free
 #include "memmap.h" // PAGE_SIZE
+#include "pci.h" // pci_bdf_to_busdev
 #include "pcidevice.h" // foreachpci
 #include "pci_ids.h" // PCI_CLASS_SERIAL_USB_UHCI
 #include "pci_regs.h" // PCI_BASE_ADDRESS_0
@@ -23,9 +24,26 @@ struct usb_ehci_s {
     struct ehci_caps *caps;
     struct ehci_regs *regs;
     struct ehci_qh *async_qh;
+    struct ehci_route_s *route;
     int checkports;
 };
 
+// How an EHCI controller routed its ports - companion UHCI/OHCI
+// controllers (in the same PCI slot) only need to start if it handed
+// them a port.
+struct ehci_route_s {
+    struct ehci_route_s *next;
+    struct pci_device *pci;
+    struct usbhub_s *hub;   // Root hub while its ports are being scanned
+    u64 portroute;
+    u32 hcsparams;
+    u16 released;           // Ports handed to a companion controller
+    u8 routed;              // Ports are routed to EHCI (configflag set)
+    u8 scanned;
+};
+
+static struct ehci_route_s *EHCIRoutes;
+
 struct ehci_pipe {
     struct ehci_qh qh;
     struct ehci_qtd *next_td, *tds;
@@ -58,6 +76,7 @@ ehci_hub_detect(struct usbhub_s *hub, u32 port)
     if ((portsc & PORT_LINESTATUS_MASK) == PORT_LINESTATUS_KSTATE) {
         // low speed device
         writel(portreg, portsc | PORT_OWNER);
+        cntl->route->released |= 1 << port;
         return -1;
     }
 
@@ -90,6 +109,7 @@ ehci_hub_reset(struct usbhub_s *hub, u32 port)
     if (!(portsc & PORT_PE)) {
         // full speed device
         writel(portreg, portsc | PORT_OWNER);
+        cntl->route->released |= 1 << port;
         return -1;
     }
 
@@ -133,7 +153,10 @@ check_ehci_ports(struct usb_ehci_s *cntl)
     hub.cntl = &cntl->usb;
     hub.portcount = cntl->checkports;
     hub.op = &ehci_HubOp;
+    cntl->route->hub = &hub;
     usb_enumerate(&hub);
+    cntl->route->hub = NULL;
+    cntl->route->scanned = 1;
     return hub.devcount;
 }
 
@@ -208,6 +231,7 @@ ehci_free_pipes(struct usb_ehci_s *cntl)
             break;
         cntl->usb.freelist = usbpipe->freenext;
         struct ehci_pipe *pipe = container_of(usbpipe, struct ehci_pipe, pipe);
+        free(pipe->tds);
         free(pipe);
     }
 }
@@ -223,6 +247,7 @@ configure_ehci(void *data)
     struct ehci_qh *async_qh = memalign_high(EHCI_QH_ALIGN, sizeof(*async_qh));
     if (!fl || !intr_qh || !async_qh) {
         warn_noalloc();
+        cntl->route->scanned = 1;
         PendingEHCI--;
         goto fail;
     }
@@ -239,6 +264,7 @@ configure_ehci(void *data)
             break;
         if (timer_check(end)) {
             warn_timeout();
+            cntl->route->scanned = 1;
             PendingEHCI--;
             goto fail;
         }
@@ -273,6 +299,7 @@ configure_ehci(void *data)
 
     // Set default of high speed for root hub.
     writel(&cntl->regs->configflag, 1);
+    cntl->route->routed = 1;
     PendingEHCI--;
 
     // Find devices
@@ -301,11 +328,22 @@ ehci_controller_setup(struct pci_device *pci)
     u32 hcc_params = readl(&caps->hccparams);
 
     struct usb_ehci_s *cntl = malloc_tmphigh(sizeof(*cntl));
-    if (!cntl) {
+    struct ehci_route_s *route = malloc_tmphigh(sizeof(*route));
+    if (!cntl || !route) {
         warn_noalloc();
+        free(cntl);
+        free(route);
         return;
     }
     memset(cntl, 0, sizeof(*cntl));
+    memset(route, 0, sizeof(*route));
+    route->pci = pci;
+    route->hcsparams = readl(&caps->hcsparams);
+    route->portroute = ((u64)readl((void*)&caps->portroute + 4) << 32
+                        | readl(&caps->portroute));
+    route->next = EHCIRoutes;
+    EHCIRoutes = route;
+    cntl->route = route;
     cntl->usb.pci = pci;
     cntl->usb.type = USB_TYPE_EHCI;
     cntl->caps = caps;
@@ -338,13 +376,71 @@ ehci_setup(void)
 
 // Wait for all EHCI controllers to initialize.  This forces OHCI/UHCI
 // setup to always be after any EHCI ports are routed to EHCI.
-void
+static void
 ehci_wait_controllers(void)
 {
     while (CONFIG_USB_EHCI && CONFIG_THREADS && PendingEHCI)
         yield();
 }
 
+// Check if a companion controller of 'route' at 'pci' owns 'port'
+static int
+ehci_is_companion_port(struct ehci_route_s *route, struct pci_device *pci
+                       , int port)
+{
+    // Companions are numbered by function in the EHCI's PCI slot
+    int cc = 0;
+    struct pci_device *other;
+    foreachpci(other) {
+        if (pci_bdf_to_busdev(other->bdf) == pci_bdf_to_busdev(pci->bdf)
+            && other->bdf < pci->bdf
+            && (pci_classprog(other) == PCI_CLASS_SERIAL_USB_UHCI
+                || pci_classprog(other) == PCI_CLASS_SERIAL_USB_OHCI))
+            cc++;
+    }
+    if (route->hcsparams & HCS_PORTROUTED)
+        return ((route->portroute >> (port * 4)) & 0xf) == cc;
+    int npcc = HCS_N_PCC(route->hcsparams);
+    if (!npcc)
+        // Unknown routing - assume any companion may own the port
+        return 1;
+    return port / npcc == cc;
+}
+
+// Check if the UHCI/OHCI controller at 'pci' needs to be started.  A
+// companion of an EHCI controller only gets ports with low or full speed
+// devices, so wait until the EHCI has detected and reset its ports and
+// skip the companion if it didn't release any port to it.
+int
+ehci_companion_needed(struct pci_device *pci)
+{
+    ehci_wait_controllers();
+    if (!CONFIG_USB_EHCI)
+        return 1;
+    struct ehci_route_s *route;
+    for (route = EHCIRoutes; route; route = route->next) {
+        if (pci_bdf_to_busdev(route->pci->bdf) == pci_bdf_to_busdev(pci->bdf))
+            break;
+    }
+    if (!route)
+        // Not a companion controller
+        return 1;
+    for (;;) {
+        struct usbhub_s *hub = route->hub;
+        if (route->scanned || (hub && hub->resetdone >= hub->portcount))
+            break;
+        yield();
+    }
+    if (!route->routed)
+        return 1;
+    int port;
+    for (port = 0; port < 16; port++)
+        if (route->released & (1 << port)
+            && ehci_is_companion_port(route, pci, port))
+            return 1;
+    return 0;
+}
+
 
 /****************************************************************
  * End point communication
@@ -394,9 +490,9 @@ ehci_alloc_intr_pipe(struct usbdevice_s *usbdev
     if (frameexp > 10)
         frameexp = 10;
     int maxpacket = epdesc->wMaxPacketSize;
-    // Determine number of entries needed for 2 timer ticks.
+    // Determine number of entries needed for USB_INTR_QUEUE_TICKS.
     int ms = 1<<frameexp;
-    int count = DIV_ROUND_UP(ticks_to_ms(2), ms);
+    int count = DIV_ROUND_UP(ticks_to_ms(USB_INTR_QUEUE_TICKS), ms);
     struct ehci_pipe *pipe = memalign_low(EHCI_QH_ALIGN, sizeof(*pipe));
     struct ehci_qtd *tds = memalign_low(EHCI_QTD_ALIGN, sizeof(*tds) * count);
     void *data = malloc_low(maxpacket * count);
@@ -446,6 +542,18 @@ fail:
     return NULL;
 }
 
+// Transfer descriptors allocated with each control and bulk pipe.
+// Bulk pipes get enough of them (each covering at least 16KiB) to
+// queue a whole mass storage data phase at once.
+#define EHCI_CONTROL_QTDS 6
+#define EHCI_BULK_QTDS 16
+
+static int
+ehci_pipe_tdcount(u8 eptype)
+{
+    return eptype == USB_ENDPOINT_XFER_BULK ? EHCI_BULK_QTDS : EHCI_CONTROL_QTDS;
+}
+
 struct usb_pipe *
 ehci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
                   , struct usb_endpoint_descriptor *epdesc)
@@ -471,17 +579,26 @@ ehci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
         return usbpipe;
     }
 
-    // Allocate a new queue head.
+    // Allocate a new queue head and its transfer descriptors.
     struct ehci_pipe *pipe;
-    if (eptype == USB_ENDPOINT_XFER_CONTROL)
+    struct ehci_qtd *tds;
+    int tdcount = ehci_pipe_tdcount(eptype);
+    if (eptype == USB_ENDPOINT_XFER_CONTROL) {
         pipe = memalign_tmphigh(EHCI_QH_ALIGN, sizeof(*pipe));
-    else
+        tds = memalign_tmphigh(EHCI_QTD_ALIGN, sizeof(*tds) * tdcount);
+    } else {
         pipe = memalign_low(EHCI_QH_ALIGN, sizeof(*pipe));
-    if (!pipe) {
+        tds = memalign_low(EHCI_QTD_ALIGN, sizeof(*tds) * tdcount);
+    }
+    if (!pipe || !tds) {
         warn_noalloc();
+        free(pipe);
+        free(tds);
         return NULL;
     }
     memset(pipe, 0, sizeof(*pipe));
+    memset(tds, 0, sizeof(*tds) * tdcount);
+    pipe->tds = tds;
     ehci_desc2pipe(pipe, usbdev, epdesc);
     pipe->qh.qtd_next = pipe->qh.alt_next = EHCI_PTR_TERM;
 
@@ -507,7 +624,7 @@ ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
 {
     u32 status;
     for (;;) {
-        status = td->token;
+        status = GET_LOWFLAT(td->token);
         if (!(status & QTD_STS_ACTIVE))
             break;
         if (timer_check(end)) {
@@ -533,16 +650,21 @@ ehci_wait_td(struct ehci_pipe *pipe, struct ehci_qtd *td, u32 end)
     return 0;
 }
 
+// Fill in a transfer descriptor of a control or bulk pipe.  These
+// live with the pipe (in low memory for bulk pipes) so all accesses
+// go through the LOWFLAT macros.
 static void
-ehci_fill_tdbuf(struct ehci_qtd *td, u32 dest, int transfer)
+ehci_fill_td(struct ehci_qtd *td, u32 token, u32 dest, int transfer)
 {
-    u32 *pos = td->buf, end = dest + transfer;
-    for (; dest < end; dest = ALIGN_DOWN(dest + PAGE_SIZE, PAGE_SIZE))
-        *pos++ = dest;
+    SET_LOWFLAT(td->qtd_next, (u32)&td[1]);
+    SET_LOWFLAT(td->alt_next, EHCI_PTR_TERM);
+    u32 end = dest + transfer;
+    int i;
+    for (i=0; dest < end; i++, dest = ALIGN_DOWN(dest + PAGE_SIZE, PAGE_SIZE))
+        SET_LOWFLAT(td->buf[i], dest);
+    SET_LOWFLAT(td->token, token);
 }
 
-#define STACKQTDS 6
-
 int
 ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                , void *data, int datasize)
@@ -553,28 +675,26 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     dprintf(7, "ehci_send_pipe qh=%p dir=%d data=%p size=%d\n"
             , &pipe->qh, dir, data, datasize);
 
-    // Allocate tds on stack (with required alignment)
-    u8 tdsbuf[sizeof(struct ehci_qtd) * STACKQTDS + EHCI_QTD_ALIGN - 1];
-    struct ehci_qtd *tds = (void*)ALIGN((u32)tdsbuf, EHCI_QTD_ALIGN), *td = tds;
-    memset(tds, 0, sizeof(*tds) * STACKQTDS);
+    // Queue the whole transfer on the pipe's transfer descriptors
+    struct ehci_qtd *tds = GET_LOWFLAT(pipe->tds), *td = tds;
+    struct ehci_qtd *tdsend = &tds[ehci_pipe_tdcount(
+                                       GET_LOWFLAT(pipe->pipe.eptype))];
 
     // Setup transfer descriptors
     u16 maxpacket = GET_LOWFLAT(pipe->pipe.maxpacket);
     u32 toggle = 0;
     if (cmd) {
         // Send setup pid on control transfers
-        td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (ehci_explen(USB_CONTROL_SETUP_SIZE) | QTD_STS_ACTIVE
-                     | QTD_PID_SETUP | ehci_maxerr(3));
-        ehci_fill_tdbuf(td, (u32)cmd, USB_CONTROL_SETUP_SIZE);
+        ehci_fill_td(td, (ehci_explen(USB_CONTROL_SETUP_SIZE) | QTD_STS_ACTIVE
+                          | QTD_PID_SETUP | ehci_maxerr(3))
+                     , (u32)cmd, USB_CONTROL_SETUP_SIZE);
         td++;
         toggle = QTD_TOGGLE;
     }
     u32 dest = (u32)data, dataend = dest + datasize;
     while (dest < dataend) {
         // Send data pids
-        if (td >= &tds[STACKQTDS]) {
+        if (td >= tdsend) {
             warn_noalloc();
             return -1;
         }
@@ -582,34 +702,31 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
         int transfer = dataend - dest;
         if (transfer > maxtransfer)
             transfer = ALIGN_DOWN(maxtransfer, maxpacket);
-        td->qtd_next = (u32)MAKE_FLATPTR(GET_SEG(SS), td+1);
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
-                     | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3));
-        ehci_fill_tdbuf(td, dest, transfer);
+        ehci_fill_td(td, (ehci_explen(transfer) | toggle | QTD_STS_ACTIVE
+                          | (dir ? QTD_PID_IN : QTD_PID_OUT) | ehci_maxerr(3))
+                     , dest, transfer);
         td++;
         dest += transfer;
     }
     if (cmd) {
         // Send status pid on control transfers
-        if (td >= &tds[STACKQTDS]) {
+        if (td >= tdsend) {
             warn_noalloc();
             return -1;
         }
-        td->qtd_next = EHCI_PTR_TERM;
-        td->alt_next = EHCI_PTR_TERM;
-        td->token = (QTD_TOGGLE | QTD_STS_ACTIVE
-                     | (dir ? QTD_PID_OUT : QTD_PID_IN) | ehci_maxerr(3));
+        ehci_fill_td(td, (QTD_TOGGLE | QTD_STS_ACTIVE
+                          | (dir ? QTD_PID_OUT : QTD_PID_IN) | ehci_maxerr(3))
+                     , 0, 0);
         td++;
     }
 
     // Transfer data
-    (td-1)->qtd_next = EHCI_PTR_TERM;
+    SET_LOWFLAT(td[-1].qtd_next, EHCI_PTR_TERM);
     barrier();
-    SET_LOWFLAT(pipe->qh.qtd_next, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
+    SET_LOWFLAT(pipe->qh.qtd_next, (u32)tds);
     u32 end = timer_calc(usb_xfer_time(p, datasize));
-    int i;
-    for (i=0, td=tds; i<STACKQTDS; i++, td++) {
+    struct ehci_qtd *last = td;
+    for (td=tds; td<last; td++) {
         int ret = ehci_wait_td(pipe, td, end);
         if (ret)
             return -1;
@@ -3,7 +3,8 @@
 
 // usb-ehci.c
 void ehci_setup(void);
-void ehci_wait_controllers(void);
+struct pci_device;
+int ehci_companion_needed(struct pci_device *pci);
 struct usbdevice_s;
 struct usb_endpoint_descriptor;
 struct usb_pipe;
@@ -31,6 +32,8 @@ struct ehci_caps {
 #define HCC_64BIT_ADDR 1
 
 #define HCS_N_PORTS_MASK 0xf
+#define HCS_PORTROUTED   (1<<7)
+#define HCS_N_PCC(p)     (((p) >> 8) & 0xf)
 
 struct ehci_regs {
     u32 usbcmd;
@@ -8,15 +8,20 @@
 #include "biosvar.h" // GET_GLOBAL
 #include "config.h" // CONFIG_*
 #include "output.h" // dprintf, warn_noalloc
-#include "malloc.h" // malloc_fseg
+#include "malloc.h" // malloc_low
 #include "ps2port.h" // ATKBD_CMD_GETID
+#include "string.h" // memset
 #include "usb.h" // usb_ctrlrequest
 #include "usb-hid.h" // usb_keyboard_setup
 #include "util.h" // process_key
 
+// The list nodes are in low memory as the poll state is updated at
+// runtime.
 struct pipe_node {
     struct usb_pipe *pipe;
     struct pipe_node *next;
+    u8 idle;    // Polls since the device last reported activity
+    u8 wait;    // Timer ticks to skip before the next poll
 };
 
 struct pipe_node *keyboards VARFSEG = NULL;
@@ -31,11 +36,12 @@ add_pipe_node(struct pipe_node **list
     if (!pipe)
         return -1;
 
-    struct pipe_node *new_node = malloc_fseg(sizeof(struct pipe_node));
+    struct pipe_node *new_node = malloc_low(sizeof(struct pipe_node));
     if (!new_node) {
         warn_noalloc();
         return -1;
     }
+    memset(new_node, 0, sizeof(*new_node));
 
     new_node->pipe = pipe;
 
@@ -45,6 +51,44 @@ add_pipe_node(struct pipe_node **list
     return 0;
 }
 
+// Devices that have been idle for about a second are only polled on
+// every other timer tick, and those idle for about five seconds (for
+// example while a boot prompt waits for input) on every
+// USB_INTR_QUEUE_TICKS tick.  The uhci/ehci/ohci interrupt pipes
+// queue that many ticks worth of reports and xhci pipes keep a
+// transfer pending on the device, so no reports are lost - the first
+// one after an idle period is just seen a little later.
+#define HID_IDLE_POLLS 18
+#define HID_SLEEP_POLLS (HID_IDLE_POLLS + 40)
+
+// Check if a device should be polled on this tick.
+static int
+hid_poll_due(struct pipe_node *node)
+{
+    u8 wait = GET_LOWFLAT(node->wait);
+    if (!wait)
+        return 1;
+    SET_LOWFLAT(node->wait, wait - 1);
+    return 0;
+}
+
+// Note whether a polled device was active.
+static void
+hid_poll_done(struct pipe_node *node, int active)
+{
+    u8 idle = GET_LOWFLAT(node->idle), wait = 0;
+    if (active)
+        idle = 0;
+    else if (idle < HID_SLEEP_POLLS)
+        idle++;
+    if (idle >= HID_SLEEP_POLLS)
+        wait = USB_INTR_QUEUE_TICKS - 1;
+    else if (idle >= HID_IDLE_POLLS)
+        wait = 1;
+    SET_LOWFLAT(node->idle, idle);
+    SET_LOWFLAT(node->wait, wait);
+}
+
 /****************************************************************
  * Setup
  ****************************************************************/
@@ -346,16 +390,24 @@ usb_check_key(void)
 
     for (struct pipe_node *node = GET_GLOBAL(keyboards);
          node;
-         node = GET_GLOBALFLAT(node->next)) {
-        struct usb_pipe *pipe = GET_GLOBALFLAT(node->pipe);
+         node = GET_LOWFLAT(node->next)) {
+        if (!hid_poll_due(node))
+            continue;
+        struct usb_pipe *pipe = GET_LOWFLAT(node->pipe);
 
+        int active = 0;
         for (;;) {
             u8 data[MAX_KBD_EVENT];
             int ret = usb_poll_intr(pipe, data);
             if (ret)
                 break;
-            handle_key((void*)data);
+            // The key repeat reports arrive even with no key pressed
+            struct keyevent *ev = (void*)data;
+            if (ev->modifiers || ev->keys[0])
+                active = 1;
+            handle_key(ev);
         }
+        hid_poll_done(node, active);
     }
 }
 
@@ -415,16 +467,21 @@ usb_check_mouse(void)
 
     for (struct pipe_node *node = GET_GLOBAL(mice);
          node;
-         node = GET_GLOBALFLAT(node->next)) {
-        struct usb_pipe *pipe = GET_GLOBALFLAT(node->pipe);
+         node = GET_LOWFLAT(node->next)) {
+        if (!hid_poll_due(node))
+            continue;
+        struct usb_pipe *pipe = GET_LOWFLAT(node->pipe);
 
+        int active = 0;
         for (;;) {
             u8 data[MAX_MOUSE_EVENT];
             int ret = usb_poll_intr(pipe, data);
             if (ret)
                 break;
+            active = 1;
             handle_mouse((void*)data);
         }
+        hid_poll_done(node, active);
     }
 }
 
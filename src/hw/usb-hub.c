@@ -113,9 +113,11 @@ usb_hub_reset(struct usbhub_s *hub, u32 port)
     if (ret)
         goto fail;
 
-    // Wait for reset to complete.
+    // Wait for reset to complete.  It lasts at least USB_TIME_DRST, so
+    // don't spend control transfers on the port status before then.
     struct usb_port_status sts;
     u32 end = timer_calc(USB_TIME_DRST * 2);
+    msleep(USB_TIME_DRST);
     for (;;) {
         ret = get_port_status(hub, port, &sts);
         if (ret)
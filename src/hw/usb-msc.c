@@ -10,6 +10,7 @@
 #include "config.h" // CONFIG_USB_MSC
 #include "malloc.h" // free
 #include "output.h" // dprintf
+#include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
 #include "usb.h" // struct usb_s
@@ -20,6 +21,8 @@ struct usbdrive_s {
     struct drive_s drive;
     struct usb_pipe *bulkin, *bulkout;
     int lun;
+    // Serializes commands of luns probed at once (only during setup)
+    struct mutex_s *lock;
 };
 
 
@@ -61,6 +64,18 @@ usb_msc_send(struct usbdrive_s *udrive_gf, int dir, void *buf, u32 bytes)
     return usb_send_bulk(pipe, dir, buf, bytes);
 }
 
+static int
+usb_msc_send2(struct usbdrive_s *udrive_gf, int dir, void *buf1, u32 bytes1
+              , void *buf2, u32 bytes2)
+{
+    struct usb_pipe *pipe;
+    if (dir == USB_DIR_OUT)
+        pipe = GET_GLOBALFLAT(udrive_gf->bulkout);
+    else
+        pipe = GET_GLOBALFLAT(udrive_gf->bulkin);
+    return usb_send_bulk2(pipe, dir, buf1, bytes1, buf2, bytes2);
+}
+
 // Low-level usb command transmit function.
 int
 usb_process_op(struct disk_op_s *op)
@@ -87,23 +102,37 @@ usb_process_op(struct disk_op_s *op)
     cbw.bCBWLUN = GET_GLOBALFLAT(udrive_gf->lun);
     cbw.bCBWCBLength = USB_CDB_SIZE;
 
-    // Transfer cbw to device.
-    int ret = usb_msc_send(udrive_gf, USB_DIR_OUT
-                           , MAKE_FLATPTR(GET_SEG(SS), &cbw), sizeof(cbw));
-    if (ret)
-        goto fail;
-
-    // Transfer data to/from device.
-    if (bytes) {
-        ret = usb_msc_send(udrive_gf, cbw.bmCBWFlags, op->buf_fl, bytes);
-        if (ret)
-            goto fail;
+    // The pipes carry one command at a time for all luns
+    struct mutex_s *lock = NULL;
+    if (!MODESEGMENT) {
+        lock = udrive_gf->lock;
+        if (lock)
+            mutex_lock(lock);
     }
 
-    // Transfer csw info.
+    // Transfer cbw, data and csw.  Phases that use the same endpoint
+    // are queued together so the controller can run them back-to-back.
     struct csw_s csw;
-    ret = usb_msc_send(udrive_gf, USB_DIR_IN
-                       , MAKE_FLATPTR(GET_SEG(SS), &csw), sizeof(csw));
+    void *cbw_fl = MAKE_FLATPTR(GET_SEG(SS), &cbw);
+    void *csw_fl = MAKE_FLATPTR(GET_SEG(SS), &csw);
+    int ret;
+    if (!bytes) {
+        ret = usb_msc_send(udrive_gf, USB_DIR_OUT, cbw_fl, sizeof(cbw));
+        if (!ret)
+            ret = usb_msc_send(udrive_gf, USB_DIR_IN, csw_fl, sizeof(csw));
+    } else if (cbw.bmCBWFlags == USB_DIR_IN) {
+        ret = usb_msc_send(udrive_gf, USB_DIR_OUT, cbw_fl, sizeof(cbw));
+        if (!ret)
+            ret = usb_msc_send2(udrive_gf, USB_DIR_IN, op->buf_fl, bytes
+                                , csw_fl, sizeof(csw));
+    } else {
+        ret = usb_msc_send2(udrive_gf, USB_DIR_OUT, cbw_fl, sizeof(cbw)
+                            , op->buf_fl, bytes);
+        if (!ret)
+            ret = usb_msc_send(udrive_gf, USB_DIR_IN, csw_fl, sizeof(csw));
+    }
+    if (!MODESEGMENT && lock)
+        mutex_unlock(lock);
     if (ret)
         goto fail;
 
@@ -138,9 +167,15 @@ usb_msc_maxlun(struct usb_pipe *pipe)
     return maxlun;
 }
 
+struct usb_msc_scan_s {
+    struct usb_pipe *inpipe, *outpipe;
+    struct usbdevice_s *usbdev;
+    struct mutex_s lock;
+    int maxlun, next_lun, workers, tot;
+};
+
 static int
-usb_msc_lun_setup(struct usb_pipe *inpipe, struct usb_pipe *outpipe,
-                  struct usbdevice_s *usbdev, int lun)
+usb_msc_lun_setup(struct usb_msc_scan_s *scan, int lun)
 {
     // Allocate drive structure.
     struct usbdrive_s *drive = malloc_fseg(sizeof(*drive));
@@ -149,16 +184,18 @@ usb_msc_lun_setup(struct usb_pipe *inpipe, struct usb_pipe *outpipe,
         return -1;
     }
     memset(drive, 0, sizeof(*drive));
-    if (usb_32bit_pipe(inpipe))
+    if (usb_32bit_pipe(scan->inpipe))
         drive->drive.type = DTYPE_USB_32;
     else
         drive->drive.type = DTYPE_USB;
-    drive->bulkin = inpipe;
-    drive->bulkout = outpipe;
+    drive->bulkin = scan->inpipe;
+    drive->bulkout = scan->outpipe;
     drive->lun = lun;
+    drive->lock = &scan->lock;
 
-    int prio = bootprio_find_usb(usbdev, lun);
+    int prio = bootprio_find_usb(scan->usbdev, lun);
     int ret = scsi_drive_setup(&drive->drive, "USB MSC", prio);
+    drive->lock = NULL;
     if (ret) {
         dprintf(1, "Unable to configure USB MSC drive.\n");
         free(drive);
@@ -167,10 +204,23 @@ usb_msc_lun_setup(struct usb_pipe *inpipe, struct usb_pipe *outpipe,
     return 0;
 }
 
+static void
+usb_msc_scan_worker(void *data)
+{
+    struct usb_msc_scan_s *scan = data;
+    while (scan->next_lun <= scan->maxlun) {
+        int lun = scan->next_lun++;
+        scan->tot += !usb_msc_lun_setup(scan, lun);
+    }
+    scan->workers--;
+}
+
 /****************************************************************
  * Setup
  ****************************************************************/
 
+#define USB_MSC_SCAN_THREADS 4
+
 // Configure a usb msc device.
 int
 usb_msc_setup(struct usbdevice_s *usbdev)
@@ -202,15 +252,21 @@ usb_msc_setup(struct usbdevice_s *usbdev)
     if (!inpipe || !outpipe)
         goto fail;
 
-    int maxlun = usb_msc_maxlun(usbdev->defpipe);
-    int lun, pipesused = 0;
-    for (lun = 0; lun < maxlun + 1; lun++) {
-        int ret = usb_msc_lun_setup(inpipe, outpipe, usbdev, lun);
-        if (!ret)
-            pipesused = 1;
+    // Probe the luns of multi-slot readers at once, so that one lun's
+    // readiness wait doesn't hold up the others.
+    struct usb_msc_scan_s scan = {
+        .inpipe = inpipe, .outpipe = outpipe, .usbdev = usbdev,
+        .maxlun = usb_msc_maxlun(usbdev->defpipe),
+    };
+    int i;
+    for (i = 0; i <= scan.maxlun && i < USB_MSC_SCAN_THREADS; i++) {
+        scan.workers++;
+        run_thread(usb_msc_scan_worker, &scan);
     }
+    while (scan.workers)
+        yield();
 
-    if (!pipesused)
+    if (!scan.tot)
         goto fail;
 
     return 0;
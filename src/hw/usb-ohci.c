@@ -14,7 +14,7 @@
 #include "pci_regs.h" // PCI_BASE_ADDRESS_0
 #include "string.h" // memset
 #include "usb.h" // struct usb_s
-#include "usb-ehci.h" // ehci_wait_controllers
+#include "usb-ehci.h" // ehci_companion_needed
 #include "usb-ohci.h" // struct ohci_hcca
 #include "util.h" // msleep
 #include "x86.h" // readl
@@ -24,12 +24,15 @@
 struct usb_ohci_s {
     struct usb_s usb;
     struct ohci_regs *regs;
+    struct ohci_hcca *hcca;
+    u32 donegen;
 };
 
 struct ohci_pipe {
     struct ohci_ed ed;
     struct usb_pipe pipe;
     struct ohci_regs *regs;
+    struct usb_ohci_s *cntl;
     void *data;
     int count;
     struct ohci_td *tds;
@@ -97,8 +100,6 @@ static int
 check_ohci_ports(struct usb_ohci_s *cntl)
 {
     ASSERT32FLAT();
-    // Wait for ehci init - in case this is a "companion controller"
-    ehci_wait_controllers();
     // Turn on power for all devices on roothub.
     u32 rha = readl(&cntl->regs->roothub_a);
     rha &= ~(RH_A_PSM | RH_A_OCPM);
@@ -234,6 +235,13 @@ configure_ohci(void *data)
 {
     struct usb_ohci_s *cntl = data;
 
+    // Wait for ehci init - in case this is a "companion controller"
+    if (!ehci_companion_needed(cntl->usb.pci)) {
+        dprintf(1, "OHCI %pP: no ports from EHCI\n", cntl->usb.pci);
+        free(cntl);
+        return;
+    }
+
     // Allocate memory
     struct ohci_hcca *hcca = memalign_high(256, sizeof(*hcca));
     struct ohci_ed *intr_ed = malloc_high(sizeof(*intr_ed));
@@ -243,6 +251,7 @@ configure_ohci(void *data)
     }
     memset(hcca, 0, sizeof(*hcca));
     memset(intr_ed, 0, sizeof(*intr_ed));
+    cntl->hcca = hcca;
     intr_ed->hwINFO = ED_SKIP;
     int i;
     for (i=0; i<ARRAY_SIZE(hcca->int_table); i++)
@@ -324,6 +333,7 @@ ohci_desc2pipe(struct ohci_pipe *pipe, struct usbdevice_s *usbdev
     struct usb_ohci_s *cntl = container_of(
         usbdev->hub->cntl, struct usb_ohci_s, usb);
     pipe->regs = cntl->regs;
+    pipe->cntl = cntl;
 }
 
 static struct usb_pipe *
@@ -338,9 +348,9 @@ ohci_alloc_intr_pipe(struct usbdevice_s *usbdev
     if (frameexp > 5)
         frameexp = 5;
     int maxpacket = epdesc->wMaxPacketSize;
-    // Determine number of entries needed for 2 timer ticks.
+    // Determine number of entries needed for USB_INTR_QUEUE_TICKS.
     int ms = 1<<frameexp;
-    int count = DIV_ROUND_UP(ticks_to_ms(2), ms) + 1;
+    int count = DIV_ROUND_UP(ticks_to_ms(USB_INTR_QUEUE_TICKS), ms) + 1;
     struct ohci_pipe *pipe = malloc_low(sizeof(*pipe));
     struct ohci_td *tds = malloc_low(sizeof(*tds) * count);
     void *data = malloc_low(maxpacket * count);
@@ -437,14 +447,45 @@ ohci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     return &pipe->pipe;
 }
 
+// Collect the done queue.  The controller writes the list of retired
+// tds to the hcca (at the end of a frame, and only while WDH is clear),
+// so one memory read tells if any transfer has finished.  The list
+// itself isn't walked - the tds may be on the stack of a thread that
+// has already returned - a generation count is advanced instead.
+static u32
+ohci_check_done(struct usb_ohci_s *cntl)
+{
+    if (cntl->hcca->done_head) {
+        cntl->hcca->done_head = 0;
+        barrier();
+        writel(&cntl->regs->intrstatus, OHCI_INTR_WDH);
+        cntl->donegen++;
+    }
+    return cntl->donegen;
+}
+
+// Wait for the tds of an ed to retire.  The ed is only examined when
+// the done queue shows activity (or at the timeout).
 static int
-wait_ed(struct ohci_ed *ed, int timeout)
+wait_ed(struct ohci_pipe *pipe, int timeout)
 {
-    u32 end = timer_calc(timeout);
+    struct ohci_ed *ed = &pipe->ed;
+    u32 end = timer_calc(timeout), gen = pipe->cntl->donegen - 1;
     for (;;) {
-        if ((ed->hwHeadP & ~(ED_C|ED_H)) == ed->hwTailP)
-            return 0;
-        if (timer_check(end)) {
+        u32 curgen = ohci_check_done(pipe->cntl);
+        int expired = timer_check(end);
+        if (curgen != gen || expired) {
+            gen = curgen;
+            if ((ed->hwHeadP & ~(ED_C|ED_H)) == ed->hwTailP)
+                return 0;
+            if (ed->hwHeadP & ED_H) {
+                // A td failed (eg, stall) - no need to wait any longer
+                dprintf(1, "ohci ed halted info=%x head=%x\n"
+                        , ed->hwINFO, ed->hwHeadP);
+                return -1;
+            }
+        }
+        if (expired) {
             warn_timeout();
             dprintf(1, "ohci ed info=%x tail=%x head=%x next=%x\n"
                     , ed->hwINFO, ed->hwTailP, ed->hwHeadP, ed->hwNextED);
@@ -523,7 +564,7 @@ ohci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     pipe->ed.hwINFO &= ~ED_SKIP;
     writel(&pipe->regs->cmdstatus, statuscmd);
 
-    int ret = wait_ed(&pipe->ed, usb_xfer_time(p, datasize));
+    int ret = wait_ed(pipe, usb_xfer_time(p, datasize));
     pipe->ed.hwINFO |= ED_SKIP;
     if (ret)
         ohci_waittick(pipe->regs);
@@ -108,6 +108,7 @@ struct ohci_regs {
 #define OHCI_CLF        (1 << 1)
 #define OHCI_BLF        (1 << 2)
 
+#define OHCI_INTR_WDH   (1 << 1)
 #define OHCI_INTR_MIE   (1 << 31)
 
 #define RH_PS_CCS            0x00000001
@@ -1,10 +1,8 @@
 // Code for handling usb attached scsi devices.
 //
-// only usb 2.0 for now.
-//
-// once we have xhci driver with usb 3.0 support this must
-// be updated to use usb3 streams so booting from usb3
-// devices actually works.
+// usb 2.0 devices use the ready IUs to sequence data transfers,
+// usb 3.0 devices use bulk streams (xhci only), which also allows
+// several commands to be outstanding at once.
 //
 // Authors:
 //  Gerd Hoffmann <kraxel@redhat.com>
@@ -16,6 +14,7 @@
 
 #include "biosvar.h" // GET_GLOBALFLAT
 #include "block.h" // DTYPE_USB
+#include "byteorder.h" // cpu_to_be16
 #include "blockcmd.h" // cdb_read
 #include "config.h" // CONFIG_USB_UAS
 #include "malloc.h" // free
@@ -89,8 +88,96 @@ struct uasdrive_s {
     struct usbdevice_s *usbdev;
     struct usb_pipe *command, *status, *data_in, *data_out;
     u32 lun;
+    int tags;           // Number of stream ids usable as tags (usb 3.0 only)
 };
 
+// Maximum number of concurrent commands, and the smallest number of
+// blocks worth issuing as a separate command.
+#define UAS_MAX_TAGS    4
+#define UAS_SPLIT_BLOCKS 16
+
+// Process a request on a device using bulk streams.  Large reads and
+// writes are split into several commands (one per stream) which are
+// all submitted before waiting for any of them.
+static int
+uas_process_op_streams(struct disk_op_s *op, struct uasdrive_s *drive_gf)
+{
+    struct usb_pipe *command = drive_gf->command, *status = drive_gf->status;
+    struct usb_pipe *data = scsi_is_read(op) ? drive_gf->data_in
+                                             : drive_gf->data_out;
+    int ntags = 1;
+    u32 chunk = op->count;
+    if (op->command == CMD_READ || op->command == CMD_WRITE) {
+        ntags = op->count / UAS_SPLIT_BLOCKS;
+        if (ntags > drive_gf->tags)
+            ntags = drive_gf->tags;
+        if (ntags > 1) {
+            chunk = DIV_ROUND_UP(op->count, ntags);
+            ntags = DIV_ROUND_UP(op->count, chunk);
+        } else {
+            ntags = 1;
+        }
+    }
+
+    uas_ui sense[UAS_MAX_TAGS];
+    u32 bytes[UAS_MAX_TAGS];
+    int i, sent = 0, ret = 0;
+    for (i = 0; i < ntags; i++) {
+        struct disk_op_s sub = *op;
+        if (ntags > 1) {
+            sub.lba = op->lba + i * chunk;
+            sub.count = op->count - i * chunk;
+            if (sub.count > chunk)
+                sub.count = chunk;
+            sub.buf_fl = op->buf_fl + i * chunk * op->drive_fl->blksize;
+        }
+
+        uas_ui ui;
+        memset(&ui, 0, sizeof(ui));
+        ui.hdr.id = UAS_UI_COMMAND;
+        ui.hdr.tag = cpu_to_be16(i + 1);
+        ui.command.lun[1] = drive_gf->lun;
+        int blocksize = scsi_fill_cmd(&sub, ui.command.cdb
+                                  , sizeof(ui.command.cdb));
+        if (blocksize < 0)
+            return default_process_op(op);
+        bytes[i] = blocksize * sub.count;
+
+        // Post the status and data buffers before sending the command
+        memset(&sense[i], 0xff, sizeof(sense[i]));
+        ret = usb_stream_submit(status, i + 1, &sense[i], sizeof(sense[i]));
+        if (!ret && bytes[i])
+            ret = usb_stream_submit(data, i + 1, sub.buf_fl, bytes[i]);
+        if (!ret)
+            ret = usb_send_bulk(command, USB_DIR_OUT, &ui
+                                , sizeof(ui.hdr) + sizeof(ui.command));
+        if (ret) {
+            dprintf(1, "uas: command send fail\n");
+            break;
+        }
+        sent++;
+    }
+
+    for (i = 0; i < sent; i++) {
+        if (bytes[i] && usb_stream_wait(data, i + 1)) {
+            dprintf(1, "uas: data transfer fail\n");
+            ret = -1;
+        }
+        if (usb_stream_wait(status, i + 1)) {
+            dprintf(1, "uas: status recv fail\n");
+            ret = -1;
+            continue;
+        }
+        if (sense[i].hdr.id != UAS_UI_SENSE || sense[i].sense.status) {
+            dprintf(1, "uas: command fail (ui id %d)\n", sense[i].hdr.id);
+            ret = -1;
+        }
+    }
+    if (ret)
+        return DISK_RET_EBADTRACK;
+    return DISK_RET_SUCCESS;
+}
+
 int
 uas_process_op(struct disk_op_s *op)
 {
@@ -99,6 +186,8 @@ uas_process_op(struct disk_op_s *op)
 
     struct uasdrive_s *drive_gf = container_of(
         op->drive_fl, struct uasdrive_s, drive);
+    if (!MODESEGMENT && drive_gf->tags)
+        return uas_process_op_streams(op, drive_gf);
 
     uas_ui ui;
     memset(&ui, 0, sizeof(ui));
@@ -186,6 +275,16 @@ uas_init_lun(struct uasdrive_s *drive, struct usbdevice_s *usbdev,
     drive->data_in = data_in;
     drive->data_out = data_out;
     drive->lun = lun;
+
+    int tags = UAS_MAX_TAGS;
+    struct usb_pipe *pipes[] = { status, data_in, data_out };
+    int i;
+    for (i = 0; i < ARRAY_SIZE(pipes); i++) {
+        int count = usb_stream_count(pipes[i]);
+        if (tags > count)
+            tags = count;
+    }
+    drive->tags = tags;
 }
 
 static int
@@ -241,9 +340,8 @@ usb_uas_setup(struct usbdevice_s *usbdev)
             ep = (void*)desc;
             break;
         case USB_DT_ENDPOINT_COMPANION:
-            /* No support (yet) for usb3 streams */
-            dprintf(1, "Superspeed UAS devices not supported (yet)\n");
-            goto fail;
+            /* handled by the controller driver in usb_alloc_pipe */
+            break;
         case 0x24:
             switch (desc[2]) {
             case UAS_PIPE_ID_COMMAND:
@@ -272,6 +370,10 @@ usb_uas_setup(struct usbdevice_s *usbdev)
 
     struct uasdrive_s lun0;
     uas_init_lun(&lun0, usbdev, command, status, data_in, data_out, 0);
+    if (usbdev->speed == USB_SUPERSPEED && !lun0.tags) {
+        dprintf(1, "Superspeed UAS device without bulk streams\n");
+        goto fail;
+    }
     int ret = scsi_rep_luns_scan(&lun0.drive, uas_add_lun);
     if (ret <= 0) {
         dprintf(1, "Unable to configure UAS drive.\n");
@@ -14,7 +14,7 @@
 #include "pci_regs.h" // PCI_BASE_ADDRESS_4
 #include "string.h" // memset
 #include "usb.h" // struct usb_s
-#include "usb-ehci.h" // ehci_wait_controllers
+#include "usb-ehci.h" // ehci_companion_needed
 #include "usb-uhci.h" // USBLEGSUP
 #include "util.h" // msleep
 #include "x86.h" // outw
@@ -28,7 +28,7 @@ struct usb_uhci_s {
 
 struct uhci_pipe {
     struct uhci_qh qh;
-    struct uhci_td *next_td;
+    struct uhci_td *next_td, *tds;
     struct usb_pipe pipe;
     u16 iobase;
     u8 toggle;
@@ -96,9 +96,6 @@ static int
 check_uhci_ports(struct usb_uhci_s *cntl)
 {
     ASSERT32FLAT();
-    // Wait for ehci init - in case this is a "companion controller"
-    ehci_wait_controllers();
-
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &cntl->usb;
@@ -155,6 +152,7 @@ uhci_free_pipes(struct usb_uhci_s *cntl)
             break;
         cntl->usb.freelist = usbpipe->freenext;
         struct uhci_pipe *pipe = container_of(usbpipe, struct uhci_pipe, pipe);
+        free(pipe->tds);
         free(pipe);
     }
 }
@@ -181,6 +179,13 @@ configure_uhci(void *data)
 {
     struct usb_uhci_s *cntl = data;
 
+    // Wait for ehci init - in case this is a "companion controller"
+    if (!ehci_companion_needed(cntl->usb.pci)) {
+        dprintf(1, "UHCI %pP: no ports from EHCI\n", cntl->usb.pci);
+        free(cntl);
+        return;
+    }
+
     // Allocate ram for schedule storage
     struct uhci_td *term_td = malloc_high(sizeof(*term_td));
     struct uhci_framelist *fl = memalign_high(sizeof(*fl), sizeof(*fl));
@@ -297,9 +302,9 @@ uhci_alloc_intr_pipe(struct usbdevice_s *usbdev
     if (frameexp > 10)
         frameexp = 10;
     int maxpacket = epdesc->wMaxPacketSize;
-    // Determine number of entries needed for 2 timer ticks.
+    // Determine number of entries needed for USB_INTR_QUEUE_TICKS.
     int ms = 1<<frameexp;
-    int count = DIV_ROUND_UP(ticks_to_ms(2), ms);
+    int count = DIV_ROUND_UP(ticks_to_ms(USB_INTR_QUEUE_TICKS), ms);
     count = ALIGN(count, 2);
     struct uhci_pipe *pipe = malloc_low(sizeof(*pipe));
     struct uhci_td *tds = malloc_low(sizeof(*tds) * count);
@@ -313,7 +318,7 @@ uhci_alloc_intr_pipe(struct usbdevice_s *usbdev
     int lowspeed = pipe->pipe.speed;
     int devaddr = pipe->pipe.devaddr | (pipe->pipe.ep << 7);
     pipe->qh.element = (u32)tds;
-    pipe->next_td = &tds[0];
+    pipe->next_td = pipe->tds = &tds[0];
     pipe->iobase = cntl->iobase;
 
     int toggle = 0;
@@ -355,6 +360,19 @@ fail:
     return NULL;
 }
 
+// Size of the ring of transfer descriptors used by control and bulk
+// pipes.  Each descriptor carries a single packet, so bulk pipes get
+// a deeper ring to keep several frames of packets queued while the
+// completed descriptors are refilled.
+#define UHCI_CONTROL_TDS 16
+#define UHCI_BULK_TDS 64
+
+static int
+uhci_pipe_tdcount(u8 eptype)
+{
+    return eptype == USB_ENDPOINT_XFER_BULK ? UHCI_BULK_TDS : UHCI_CONTROL_TDS;
+}
+
 struct usb_pipe *
 uhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
                   , struct usb_endpoint_descriptor *epdesc)
@@ -378,17 +396,26 @@ uhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
         return usbpipe;
     }
 
-    // Allocate a new queue head.
+    // Allocate a new queue head and its ring of transfer descriptors.
     struct uhci_pipe *pipe;
-    if (eptype == USB_ENDPOINT_XFER_CONTROL)
+    struct uhci_td *tds;
+    int tdcount = uhci_pipe_tdcount(eptype);
+    if (eptype == USB_ENDPOINT_XFER_CONTROL) {
         pipe = malloc_tmphigh(sizeof(*pipe));
-    else
+        tds = malloc_tmphigh(sizeof(*tds) * tdcount);
+    } else {
         pipe = malloc_low(sizeof(*pipe));
-    if (!pipe) {
+        tds = malloc_low(sizeof(*tds) * tdcount);
+    }
+    if (!pipe || !tds) {
         warn_noalloc();
+        free(pipe);
+        free(tds);
         return NULL;
     }
     memset(pipe, 0, sizeof(*pipe));
+    memset(tds, 0, sizeof(*tds) * tdcount);
+    pipe->tds = tds;
     usb_desc2pipe(&pipe->pipe, usbdev, epdesc);
     pipe->qh.element = UHCI_PTR_TERM;
     pipe->iobase = cntl->iobase;
@@ -431,7 +458,7 @@ wait_td(struct uhci_td *td, u32 end)
 {
     u32 status;
     for (;;) {
-        status = td->status;
+        status = GET_LOWFLAT(td->status);
         if (!(status & TD_CTRL_ACTIVE))
             break;
         if (timer_check(end)) {
@@ -447,8 +474,27 @@ wait_td(struct uhci_td *td, u32 end)
     return 0;
 }
 
-#define STACKTDS 16
-#define TDALIGN 16
+// Fill in a transfer descriptor and then activate it.  These live
+// with the pipe (in low memory for bulk pipes) so all accesses go
+// through the LOWFLAT macros.
+static void
+uhci_fill_td(struct uhci_td *td, u32 link, u32 token, void *buffer, u32 status)
+{
+    SET_LOWFLAT(td->link, link);
+    SET_LOWFLAT(td->token, token);
+    SET_LOWFLAT(td->buffer, buffer);
+    barrier();
+    SET_LOWFLAT(td->status, status);
+}
+
+// Deactivate all descriptors of a pipe after a failed transfer.
+static void
+uhci_reset_tds(struct uhci_td *tds, int count)
+{
+    int i;
+    for (i=0; i<count; i++)
+        SET_LOWFLAT(tds[i].status, 0);
+}
 
 int
 uhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
@@ -465,34 +511,32 @@ uhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    | (GET_LOWFLAT(pipe->pipe.ep) << 7));
     int toggle = GET_LOWFLAT(pipe->toggle) ? TD_TOKEN_TOGGLE : 0;
 
-    // Allocate 16 tds on stack (16byte aligned)
-    u8 tdsbuf[sizeof(struct uhci_td) * STACKTDS + TDALIGN - 1];
-    struct uhci_td *tds = (void*)ALIGN((u32)tdsbuf, TDALIGN);
-    memset(tds, 0, sizeof(*tds) * STACKTDS);
+    // Use the pipe's ring of tds
+    struct uhci_td *tds = GET_LOWFLAT(pipe->tds);
+    int tdcount = uhci_pipe_tdcount(GET_LOWFLAT(pipe->pipe.eptype));
     int tdpos = 0;
 
     // Enable tds
     u32 end = timer_calc(usb_xfer_time(p, datasize));
     barrier();
-    SET_LOWFLAT(pipe->qh.element, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
+    SET_LOWFLAT(pipe->qh.element, (u32)tds);
 
     // Setup transfer descriptors
     if (cmd) {
         // Send setup pid on control transfers
-        struct uhci_td *td = &tds[tdpos++ % STACKTDS];
-        u32 nexttd = (u32)MAKE_FLATPTR(GET_SEG(SS), &tds[tdpos % STACKTDS]);
-        td->link = nexttd | UHCI_PTR_DEPTH;
-        td->token = (uhci_explen(USB_CONTROL_SETUP_SIZE)
-                     | (devaddr << TD_TOKEN_DEVADDR_SHIFT) | USB_PID_SETUP);
-        td->buffer = (void*)cmd;
-        barrier();
-        td->status = (uhci_maxerr(3) | (lowspeed ? TD_CTRL_LS : 0)
-                      | TD_CTRL_ACTIVE);
+        struct uhci_td *td = &tds[tdpos++ % tdcount];
+        u32 nexttd = (u32)&tds[tdpos % tdcount];
+        uhci_fill_td(td, nexttd | UHCI_PTR_DEPTH
+                     , (uhci_explen(USB_CONTROL_SETUP_SIZE)
+                        | (devaddr << TD_TOKEN_DEVADDR_SHIFT) | USB_PID_SETUP)
+                     , (void*)cmd
+                     , (uhci_maxerr(3) | (lowspeed ? TD_CTRL_LS : 0)
+                        | TD_CTRL_ACTIVE));
         toggle = TD_TOKEN_TOGGLE;
     }
     while (datasize) {
         // Send data pids
-        struct uhci_td *td = &tds[tdpos++ % STACKTDS];
+        struct uhci_td *td = &tds[tdpos++ % tdcount];
         int ret = wait_td(td, end);
         if (ret)
             goto fail;
@@ -500,16 +544,15 @@ uhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
         int transfer = datasize;
         if (transfer > maxpacket)
             transfer = maxpacket;
-        u32 nexttd = (u32)MAKE_FLATPTR(GET_SEG(SS), &tds[tdpos % STACKTDS]);
-        td->link = ((transfer==datasize && !cmd)
-                    ? UHCI_PTR_TERM : (nexttd | UHCI_PTR_DEPTH));
-        td->token = (uhci_explen(transfer) | toggle
-                     | (devaddr << TD_TOKEN_DEVADDR_SHIFT)
-                     | (dir ? USB_PID_IN : USB_PID_OUT));
-        td->buffer = data;
-        barrier();
-        td->status = (uhci_maxerr(3) | (lowspeed ? TD_CTRL_LS : 0)
-                      | TD_CTRL_ACTIVE);
+        u32 nexttd = (u32)&tds[tdpos % tdcount];
+        uhci_fill_td(td, ((transfer==datasize && !cmd)
+                          ? UHCI_PTR_TERM : (nexttd | UHCI_PTR_DEPTH))
+                     , (uhci_explen(transfer) | toggle
+                        | (devaddr << TD_TOKEN_DEVADDR_SHIFT)
+                        | (dir ? USB_PID_IN : USB_PID_OUT))
+                     , data
+                     , (uhci_maxerr(3) | (lowspeed ? TD_CTRL_LS : 0)
+                        | TD_CTRL_ACTIVE));
         toggle ^= TD_TOKEN_TOGGLE;
 
         data += transfer;
@@ -517,25 +560,28 @@ uhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     }
     if (cmd) {
         // Send status pid on control transfers
-        struct uhci_td *td = &tds[tdpos++ % STACKTDS];
+        struct uhci_td *td = &tds[tdpos++ % tdcount];
         int ret = wait_td(td, end);
         if (ret)
             goto fail;
-        td->link = UHCI_PTR_TERM;
-        td->token = (uhci_explen(0) | TD_TOKEN_TOGGLE
-                     | (devaddr << TD_TOKEN_DEVADDR_SHIFT)
-                     | (dir ? USB_PID_OUT : USB_PID_IN));
-        td->buffer = 0;
-        barrier();
-        td->status = (uhci_maxerr(0) | (lowspeed ? TD_CTRL_LS : 0)
-                      | TD_CTRL_ACTIVE);
+        uhci_fill_td(td, UHCI_PTR_TERM
+                     , (uhci_explen(0) | TD_TOKEN_TOGGLE
+                        | (devaddr << TD_TOKEN_DEVADDR_SHIFT)
+                        | (dir ? USB_PID_OUT : USB_PID_IN))
+                     , 0
+                     , (uhci_maxerr(0) | (lowspeed ? TD_CTRL_LS : 0)
+                        | TD_CTRL_ACTIVE));
     }
     SET_LOWFLAT(pipe->toggle, !!toggle);
-    return wait_pipe(pipe, end);
+    int ret = wait_pipe(pipe, end);
+    if (ret)
+        uhci_reset_tds(tds, tdcount);
+    return ret;
 fail:
     dprintf(1, "uhci_send_bulk failed\n");
     SET_LOWFLAT(pipe->qh.element, UHCI_PTR_TERM);
     uhci_waittick(GET_LOWFLAT(pipe->iobase));
+    uhci_reset_tds(tds, tdcount);
     return -1;
 }
 
@@ -5,6 +5,7 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
+#include "biosvar.h" // GET_LOWFLAT
 #include "config.h" // CONFIG_*
 #include "malloc.h" // memalign_low
 #include "memmap.h" // PAGE_SIZE
@@ -22,6 +23,7 @@
 // configuration
 
 #define XHCI_RING_ITEMS          16
+#define XHCI_STREAM_ARRAY        8    // stream ids 1..7 (0 is reserved)
 #define XHCI_RING_SIZE           (XHCI_RING_ITEMS*sizeof(struct xhci_trb))
 
 /*
@@ -239,6 +241,8 @@ struct usb_xhci_s {
     u32                  ports;
     u32                  slots;
     u8                   context64;
+    u8                   maxpsasize;
+    u32                  powerend;  // root port power settled after this
     struct xhci_portmap  usb2;
     struct xhci_portmap  usb3;
 
@@ -254,16 +258,34 @@ struct usb_xhci_s {
     struct xhci_ring     *cmds;
     struct xhci_ring     *evts;
     struct xhci_er_seg   *eseg;
+
+    /* pool of pages that control rings and contexts are carved from */
+    struct xhci_poolpage *poolpages;
+    u32                  poolpos;
+    void                 *freeinctx;
+    void                 *freedevctx;
+    u8                   *slotpipes;    // pipes in use on each slot
+};
+
+struct xhci_poolpage {
+    struct xhci_poolpage *next;
+    void                 *page;
 };
 
 struct xhci_pipe {
     struct xhci_ring     reqs;
 
     struct usb_pipe      pipe;
+    struct xhci_ring     *evts;     // Controller event ring
     u32                  slotid;
     u32                  epid;
     void                 *buf;
     int                  bufused;
+
+    /* bulk streams (superspeed only) */
+    u32                  streams;
+    struct xhci_streamctx *sctx;
+    struct xhci_ring     *srings[XHCI_STREAM_ARRAY];
 };
 
 // --------------------------------------------------------------
@@ -328,12 +350,19 @@ xhci_print_port_state(int loglevel, const char *prefix, u32 port, u32 portsc)
             pls, speed, speed_name[speed]);
 }
 
+// Once port power has settled, a port without a connection that isn't
+// training a link is empty - don't wait the full attach time for it.
 static int
 xhci_hub_detect(struct usbhub_s *hub, u32 port)
 {
     struct usb_xhci_s *xhci = container_of(hub->cntl, struct usb_xhci_s, usb);
     u32 portsc = readl(&xhci->pr[port].portsc);
-    return (portsc & XHCI_PORTSC_CCS) ? 1 : 0;
+    if (portsc & XHCI_PORTSC_CCS)
+        return 1;
+    if (!timer_check(xhci->powerend)
+        || xhci_get_field(portsc, XHCI_PORTSC_PLS) == PLS_POLLING)
+        return 0;
+    return -1;
 }
 
 // Reset device on port
@@ -415,9 +444,6 @@ static struct usbhub_op_s xhci_hub_ops = {
 static int
 xhci_check_ports(struct usb_xhci_s *xhci)
 {
-    // Wait for port power to stabilize.
-    msleep(XHCI_TIME_POSTPOWER);
-
     struct usbhub_s hub;
     memset(&hub, 0, sizeof(hub));
     hub.cntl = &xhci->usb;
@@ -428,6 +454,68 @@ xhci_check_ports(struct usb_xhci_s *xhci)
 }
 
 
+/****************************************************************
+ * Ring and context pool
+ ****************************************************************/
+
+// Carve a zeroed object out of the controller's pool pages.  Objects are
+// never returned to the malloc zones - they go on a list for reuse - so
+// enumerating many devices doesn't fragment ZoneHigh with aligned blocks.
+static void *
+xhci_pool_alloc(struct usb_xhci_s *xhci, u32 size, u32 align)
+{
+    u32 pos = ALIGN(xhci->poolpos, align);
+    if (!xhci->poolpages || pos + size > PAGE_SIZE) {
+        struct xhci_poolpage *pp = malloc_high(sizeof(*pp));
+        void *page = memalign_high(PAGE_SIZE, PAGE_SIZE);
+        if (!pp || !page) {
+            free(pp);
+            free(page);
+            return NULL;
+        }
+        pp->page = page;
+        pp->next = xhci->poolpages;
+        xhci->poolpages = pp;
+        pos = 0;
+    }
+    xhci->poolpos = pos + size;
+    void *obj = xhci->poolpages->page + pos;
+    memset(obj, 0, size);
+    return obj;
+}
+
+// Reuse an object from a pool list, or carve a new one.
+static void *
+xhci_pool_get(struct usb_xhci_s *xhci, void **list, u32 size, u32 align)
+{
+    void *obj = *list;
+    if (!obj)
+        return xhci_pool_alloc(xhci, size, align);
+    *list = *(void**)obj;
+    memset(obj, 0, size);
+    return obj;
+}
+
+static void
+xhci_pool_put(void **list, void *obj)
+{
+    if (!obj)
+        return;
+    *(void**)obj = *list;
+    *list = obj;
+}
+
+static void
+xhci_pool_free(struct usb_xhci_s *xhci)
+{
+    while (xhci->poolpages) {
+        struct xhci_poolpage *pp = xhci->poolpages;
+        xhci->poolpages = pp->next;
+        free(pp->page);
+        free(pp);
+    }
+}
+
 /****************************************************************
  * Setup
  ****************************************************************/
@@ -447,11 +535,16 @@ configure_xhci(void *data)
     xhci->devs = memalign_high(64, sizeof(*xhci->devs) * (xhci->slots + 1));
     xhci->eseg = memalign_high(64, sizeof(*xhci->eseg));
     xhci->cmds = memalign_high(XHCI_RING_SIZE, sizeof(*xhci->cmds));
-    xhci->evts = memalign_high(XHCI_RING_SIZE, sizeof(*xhci->evts));
-    if (!xhci->devs || !xhci->cmds || !xhci->evts || !xhci->eseg) {
+    // The event ring is in low memory so that xhci_poll_intr_pending()
+    // can check it from 16bit mode.
+    xhci->evts = memalign_low(XHCI_RING_SIZE, sizeof(*xhci->evts));
+    xhci->slotpipes = malloc_high(xhci->slots + 1);
+    if (!xhci->devs || !xhci->cmds || !xhci->evts || !xhci->eseg
+        || !xhci->slotpipes) {
         warn_noalloc();
         goto fail;
     }
+    memset(xhci->slotpipes, 0, xhci->slots + 1);
     memset(xhci->devs, 0, sizeof(*xhci->devs) * (xhci->slots + 1));
     memset(xhci->cmds, 0, sizeof(*xhci->cmds));
     memset(xhci->evts, 0, sizeof(*xhci->evts));
@@ -471,6 +564,9 @@ configure_xhci(void *data)
         goto fail;
     if (wait_bit(&xhci->op->usbsts, XHCI_STS_CNR, 0, 1000) != 0)
         goto fail;
+    // Ports are powered once the reset is done - the rest of the setup
+    // overlaps with the wait for port power to stabilize.
+    xhci->powerend = timer_calc(XHCI_TIME_POSTPOWER);
 
     writel(&xhci->op->config, xhci->slots);
     writel(&xhci->op->dcbaap_low, (u32)xhci->devs);
@@ -527,6 +623,8 @@ configure_xhci(void *data)
     wait_bit(&xhci->op->usbsts, XHCI_STS_HCH, XHCI_STS_HCH, 32);
 
 fail:
+    xhci_pool_free(xhci);
+    free(xhci->slotpipes);
     free(xhci->eseg);
     free(xhci->evts);
     free(xhci->cmds);
@@ -555,6 +653,7 @@ xhci_controller_setup(void *baseaddr)
     xhci->slots = hcs1         & 0xff;
     xhci->xcap  = ((hcc >> 16) & 0xffff) << 2;
     xhci->context64 = (hcc & 0x04) ? 1 : 0;
+    xhci->maxpsasize = (hcc >> 12) & 0x0f;
     xhci->usb.type = USB_TYPE_XHCI;
 
     dprintf(1, "XHCI init: regs @ %p, %d ports, %d slots"
@@ -699,15 +798,16 @@ static void xhci_doorbell(struct usb_xhci_s *xhci, u32 slotid, u32 value)
 static void xhci_process_events(struct usb_xhci_s *xhci)
 {
     struct xhci_ring *evts = xhci->evts;
+    u32 nidx = evts->nidx;
+    u32 cs = evts->cs;
+    int count = 0;
 
-    for (;;) {
+    for (;; count++) {
         /* check for event */
-        u32 nidx = evts->nidx;
-        u32 cs = evts->cs;
         struct xhci_trb *etrb = evts->ring + nidx;
         u32 control = etrb->control;
         if ((control & TRB_C) != (cs ? 1 : 0))
-            return;
+            break;
 
         /* process event */
         u32 evt_type = TRB_TYPE(control);
@@ -745,19 +845,23 @@ static void xhci_process_events(struct usb_xhci_s *xhci)
             break;
         }
 
-        /* move ring index, notify xhci */
+        /* move ring index */
         nidx++;
         if (nidx == XHCI_RING_ITEMS) {
             nidx = 0;
             cs = cs ? 0 : 1;
-            evts->cs = cs;
         }
-        evts->nidx = nidx;
-        struct xhci_ir *ir = xhci->ir;
-        u32 erdp = (u32)(evts->ring + nidx);
-        writel(&ir->erdp_low, erdp);
-        writel(&ir->erdp_high, 0);
     }
+    if (!count)
+        return;
+
+    /* notify xhci once for the whole batch of events */
+    evts->nidx = nidx;
+    evts->cs = cs;
+    struct xhci_ir *ir = xhci->ir;
+    u32 erdp = (u32)(evts->ring + nidx);
+    writel(&ir->erdp_low, erdp);
+    writel(&ir->erdp_high, 0);
 }
 
 // Check if a ring has any pending TRBs
@@ -809,7 +913,10 @@ static void xhci_trb_queue(struct xhci_ring *ring,
                            void *data, u32 xferlen, u32 flags)
 {
     if (ring->nidx >= ARRAY_SIZE(ring->ring) - 1) {
-        xhci_trb_fill(ring, ring->ring, 0, (TR_LINK << 10) | TRB_LK_TC);
+        // The link TRB must be part of the chain if a TD spans it
+        u32 chain = ring->ring[ring->nidx - 1].control & TRB_TR_CH;
+        xhci_trb_fill(ring, ring->ring, 0
+                      , (TR_LINK << 10) | TRB_LK_TC | chain);
         ring->nidx = 0;
         ring->cs ^= 1;
         dprintf(5, "%s: ring %p [linked]\n", __func__, ring);
@@ -821,9 +928,11 @@ static void xhci_trb_queue(struct xhci_ring *ring,
             __func__, ring, ring->nidx, xferlen);
 }
 
-// Submit a command to the xhci controller ring
-static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
-                           , u32 flags)
+// Submit a command to the xhci controller ring.  If 'evt' is set the
+// command completion event is copied to it (while the ring lock is
+// still held - other threads may queue commands once it is released).
+static int __xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
+                             , u32 flags, struct xhci_trb *evt)
 {
     if (inctx) {
         struct xhci_slotctx *slot = (void*)&inctx[1 << xhci->context64];
@@ -840,17 +949,26 @@ static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
     xhci_trb_queue(xhci->cmds, inctx, 0, flags);
     xhci_doorbell(xhci, 0, 0);
     int rc = xhci_event_wait(xhci, xhci->cmds, 1000);
+    if (evt)
+        memcpy(evt, &xhci->cmds->evt, sizeof(*evt));
     mutex_unlock(&xhci->cmds->lock);
     return rc;
 }
 
+static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
+                           , u32 flags)
+{
+    return __xhci_cmd_submit(xhci, inctx, flags, NULL);
+}
+
 static int xhci_cmd_enable_slot(struct usb_xhci_s *xhci)
 {
     dprintf(3, "%s:\n", __func__);
-    int cc = xhci_cmd_submit(xhci, NULL, CR_ENABLE_SLOT << 10);
+    struct xhci_trb evt;
+    int cc = __xhci_cmd_submit(xhci, NULL, CR_ENABLE_SLOT << 10, &evt);
     if (cc != CC_SUCCESS)
         return -1;
-    return (xhci->cmds->evt.control >> 24) & 0xff;
+    return (evt.control >> 24) & 0xff;
 }
 
 static int xhci_cmd_disable_slot(struct usb_xhci_s *xhci, u32 slotid)
@@ -891,12 +1009,12 @@ xhci_alloc_inctx(struct usbdevice_s *usbdev, int maxepid)
     struct usb_xhci_s *xhci = container_of(
         usbdev->hub->cntl, struct usb_xhci_s, usb);
     int size = (sizeof(struct xhci_inctx) * 33) << xhci->context64;
-    struct xhci_inctx *in = memalign_tmphigh(2048 << xhci->context64, size);
+    struct xhci_inctx *in = xhci_pool_get(xhci, &xhci->freeinctx, size
+                                          , 2048 << xhci->context64);
     if (!in) {
         warn_noalloc();
         return NULL;
     }
-    memset(in, 0, size);
 
     struct xhci_slotctx *slot = (void*)&in[1 << xhci->context64];
     slot->ctx[0]    |= maxepid << 27; // context entries
@@ -949,7 +1067,7 @@ static int xhci_config_hub(struct usbhub_s *hub)
     slot->ctx[1] |= hub->portcount << 24;
 
     int cc = xhci_cmd_configure_endpoint(xhci, pipe->slotid, in);
-    free(in);
+    xhci_pool_put(&xhci->freeinctx, in);
     if (cc != CC_SUCCESS) {
         dprintf(1, "%s: configure hub: failed (cc %d)\n", __func__, cc);
         return -1;
@@ -957,6 +1075,104 @@ static int xhci_config_hub(struct usbhub_s *hub)
     return 0;
 }
 
+static void
+xhci_free_streams(struct xhci_pipe *pipe)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(pipe->srings); i++)
+        free(pipe->srings[i]);
+    free(pipe->sctx);
+    pipe->streams = 0;
+}
+
+// Allocate a linear stream context array and one transfer ring per
+// stream for a superspeed bulk endpoint.
+static int
+xhci_alloc_streams(struct usb_xhci_s *xhci, struct xhci_pipe *pipe
+                   , int maxstreams)
+{
+    if (!xhci->maxpsasize || !maxstreams)
+        return 0;
+    // Use a stream array of 2, 4 or 8 entries (MaxPStreams 0, 1 or 2)
+    int pstreams = 2;
+    if (pstreams > xhci->maxpsasize - 1)
+        pstreams = xhci->maxpsasize - 1;
+    if (pstreams > maxstreams - 1)
+        pstreams = maxstreams - 1;
+    u32 count = 2 << pstreams;
+    pipe->sctx = memalign_high(16, count * sizeof(*pipe->sctx));
+    if (!pipe->sctx) {
+        warn_noalloc();
+        return 0;
+    }
+    memset(pipe->sctx, 0, count * sizeof(*pipe->sctx));
+    u32 i;
+    for (i = 1; i < count; i++) {
+        struct xhci_ring *ring = memalign_high(XHCI_RING_SIZE, sizeof(*ring));
+        if (!ring) {
+            warn_noalloc();
+            xhci_free_streams(pipe);
+            return 0;
+        }
+        memset(ring, 0, sizeof(*ring));
+        ring->cs = 1;
+        pipe->srings[i] = ring;
+        pipe->sctx[i].deq_low = (u32)ring | (1 << 1) | 1; // sct=1, dcs
+    }
+    pipe->streams = count;
+    dprintf(3, "%s: epid %d, %d streams\n", __func__, pipe->epid, count - 1);
+    return count;
+}
+
+// Find a pipe on the freelist that no slot uses anymore.  Control pipes
+// are in high memory, the others in low memory.
+static struct xhci_pipe *
+xhci_get_freepipe(struct usb_xhci_s *xhci, u8 eptype)
+{
+    int control = eptype == USB_ENDPOINT_XFER_CONTROL;
+    struct usb_pipe **pfree = &xhci->usb.freelist;
+    for (;;) {
+        struct usb_pipe *upipe = *pfree;
+        if (!upipe)
+            return NULL;
+        struct xhci_pipe *pipe = container_of(upipe, struct xhci_pipe, pipe);
+        if (!pipe->slotid
+            && (upipe->eptype == USB_ENDPOINT_XFER_CONTROL) == control) {
+            *pfree = upipe->freenext;
+            xhci_free_streams(pipe);
+            free(pipe->buf);
+            return pipe;
+        }
+        pfree = &upipe->freenext;
+    }
+}
+
+// Put a pipe on the freelist.  Once the last pipe of a device is freed its
+// slot is disabled, and the slot's pipes and device context can be reused.
+static void
+xhci_free_pipe(struct xhci_pipe *pipe)
+{
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    u32 slotid = pipe->slotid;
+    usb_add_freelist(&pipe->pipe);
+    if (!slotid || --xhci->slotpipes[slotid])
+        return;
+    int cc = xhci_cmd_disable_slot(xhci, slotid);
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "%s: disable slot: failed (cc %d)\n", __func__, cc);
+        return;
+    }
+    xhci_pool_put(&xhci->freedevctx, (void*)xhci->devs[slotid].ptr_low);
+    xhci->devs[slotid].ptr_low = 0;
+    struct usb_pipe *upipe;
+    for (upipe = xhci->usb.freelist; upipe; upipe = upipe->freenext) {
+        struct xhci_pipe *p = container_of(upipe, struct xhci_pipe, pipe);
+        if (p->slotid == slotid)
+            p->slotid = 0;
+    }
+}
+
 static struct usb_pipe *
 xhci_alloc_pipe(struct usbdevice_s *usbdev
                 , struct usb_endpoint_descriptor *epdesc)
@@ -974,9 +1190,10 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
         epid += (epdesc->bEndpointAddress & USB_DIR_IN) ? 1 : 0;
     }
 
-    if (eptype == USB_ENDPOINT_XFER_CONTROL)
-        pipe = memalign_high(XHCI_RING_SIZE, sizeof(*pipe));
-    else
+    pipe = xhci_get_freepipe(xhci, eptype);
+    if (!pipe && eptype == USB_ENDPOINT_XFER_CONTROL)
+        pipe = xhci_pool_alloc(xhci, sizeof(*pipe), XHCI_RING_SIZE);
+    else if (!pipe)
         pipe = memalign_low(XHCI_RING_SIZE, sizeof(*pipe));
     if (!pipe) {
         warn_noalloc();
@@ -985,13 +1202,14 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     memset(pipe, 0, sizeof(*pipe));
 
     usb_desc2pipe(&pipe->pipe, usbdev, epdesc);
+    pipe->evts = xhci->evts;
     pipe->epid = epid;
     pipe->reqs.cs = 1;
     if (eptype == USB_ENDPOINT_XFER_INT) {
         pipe->buf = malloc_high(pipe->pipe.maxpacket);
         if (!pipe->buf) {
             warn_noalloc();
-            free(pipe);
+            usb_add_freelist(&pipe->pipe);
             return NULL;
         }
     }
@@ -1012,6 +1230,17 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     ep->deq_low  = (u32)&pipe->reqs.ring[0];
     ep->deq_low  |= 1;         // dcs
     ep->length   = pipe->pipe.maxpacket;
+    struct usb_ss_ep_comp_descriptor *comp = NULL;
+    if (eptype != USB_ENDPOINT_XFER_CONTROL)
+        comp = usb_find_ep_comp(usbdev, epdesc);
+    if (comp) {
+        ep->ctx[1] |= comp->bMaxBurst << 8;
+        if (eptype == USB_ENDPOINT_XFER_BULK && xhci_alloc_streams(
+                xhci, pipe, comp->bmAttributes & 0x1f)) {
+            ep->ctx[0] |= ((pipe->streams >> 2) << 10) | (1 << 15); // lsa
+            ep->deq_low = (u32)pipe->sctx;
+        }
+    }
 
     dprintf(3, "%s: usbdev %p, ring %p, slotid %d, epid %d\n", __func__,
             usbdev, &pipe->reqs, pipe->slotid, pipe->epid);
@@ -1024,7 +1253,8 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
         }
         // Enable slot.
         u32 size = (sizeof(struct xhci_slotctx) * 32) << xhci->context64;
-        struct xhci_slotctx *dev = memalign_high(1024 << xhci->context64, size);
+        struct xhci_slotctx *dev = xhci_pool_get(
+            xhci, &xhci->freedevctx, size, 1024 << xhci->context64);
         if (!dev) {
             warn_noalloc();
             goto fail;
@@ -1032,11 +1262,10 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
         int slotid = xhci_cmd_enable_slot(xhci);
         if (slotid < 0) {
             dprintf(1, "%s: enable slot: failed\n", __func__);
-            free(dev);
+            xhci_pool_put(&xhci->freedevctx, dev);
             goto fail;
         }
         dprintf(3, "%s: enable slot: got slotid %d\n", __func__, slotid);
-        memset(dev, 0, size);
         xhci->devs[slotid].ptr_low = (u32)dev;
         xhci->devs[slotid].ptr_high = 0;
 
@@ -1050,7 +1279,7 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
                 goto fail;
             }
             xhci->devs[slotid].ptr_low = 0;
-            free(dev);
+            xhci_pool_put(&xhci->freedevctx, dev);
             goto fail;
         }
         pipe->slotid = slotid;
@@ -1065,13 +1294,15 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
             goto fail;
         }
     }
-    free(in);
+    xhci_pool_put(&xhci->freeinctx, in);
+    xhci->slotpipes[pipe->slotid]++;
     return &pipe->pipe;
 
 fail:
-    free(pipe->buf);
-    free(pipe);
-    free(in);
+    // The slot doesn't use the pipe - it can be reused right away
+    pipe->slotid = 0;
+    usb_add_freelist(&pipe->pipe);
+    xhci_pool_put(&xhci->freeinctx, in);
     return NULL;
 }
 
@@ -1082,7 +1313,8 @@ xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     if (!CONFIG_USB_XHCI)
         return NULL;
     if (!epdesc) {
-        usb_add_freelist(upipe);
+        if (upipe)
+            xhci_free_pipe(container_of(upipe, struct xhci_pipe, pipe));
         return NULL;
     }
     if (!upipe)
@@ -1112,7 +1344,7 @@ xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
         dprintf(1, "%s: reconf ctl endpoint: failed (cc %d)\n",
                 __func__, cc);
     }
-    free(in);
+    xhci_pool_put(&xhci->freeinctx, in);
 
     return upipe;
 }
@@ -1134,13 +1366,37 @@ static void xhci_xfer_setup(struct xhci_pipe *pipe, int dir, void *cmd
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
+// Queue a USB transfer request (TD) on the pipe's ring.  A TRB may
+// not cross a 64KiB boundary, so the TD is built from a chain of TRBs.
+static void xhci_xfer_queue(struct xhci_pipe *pipe, struct xhci_ring *ring
+                            , void *data, int datalen)
+{
+    u32 maxpacket = pipe->pipe.maxpacket;
+    for (;;) {
+        u32 len = 0x10000 - ((u32)data & 0xffff);
+        if (len >= datalen) {
+            xhci_trb_queue(ring, data, datalen
+                           , (TR_NORMAL << 10) | TRB_TR_IOC);
+            return;
+        }
+        // TD size - the number of packets remaining after this TRB
+        u32 tdsize = DIV_ROUND_UP(datalen - len, maxpacket);
+        if (tdsize > 31)
+            tdsize = 31;
+        xhci_trb_queue(ring, data, len | (tdsize << 17)
+                       , (TR_NORMAL << 10) | TRB_TR_CH);
+        data += len;
+        datalen -= len;
+    }
+}
+
 // Submit a USB transfer request to the pipe's ring
 static void xhci_xfer_normal(struct xhci_pipe *pipe,
                              void *data, int datalen)
 {
     struct usb_xhci_s *xhci = container_of(
         pipe->pipe.cntl, struct usb_xhci_s, usb);
-    xhci_trb_queue(&pipe->reqs, data, datalen, (TR_NORMAL << 10) | TRB_TR_IOC);
+    xhci_xfer_queue(pipe, &pipe->reqs, data, datalen);
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
@@ -1173,6 +1429,101 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     return 0;
 }
 
+// Queue two back-to-back bulk transfers and wait for both to complete.
+int
+xhci_send_bulk2(struct usb_pipe *p, int dir, void *data1, int datalen1
+                , void *data2, int datalen2)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+
+    xhci_xfer_queue(pipe, &pipe->reqs, data1, datalen1);
+    xhci_xfer_queue(pipe, &pipe->reqs, data2, datalen2);
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid);
+
+    int cc = xhci_event_wait(xhci, &pipe->reqs
+                             , usb_xfer_time(p, datalen1 + datalen2));
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Number of usable bulk stream ids (1..n) on the pipe.
+int
+xhci_stream_count(struct usb_pipe *p)
+{
+    if (!CONFIG_USB_XHCI)
+        return 0;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    return pipe->streams ? pipe->streams - 1 : 0;
+}
+
+// Queue a transfer on a bulk stream without waiting for it.
+int
+xhci_stream_submit(struct usb_pipe *p, int streamid, void *data, int datalen)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (streamid <= 0 || streamid >= pipe->streams)
+        return -1;
+    struct xhci_ring *ring = pipe->srings[streamid];
+    if (xhci_ring_busy(ring))
+        return -1;
+    xhci_xfer_queue(pipe, ring, data, datalen);
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid | (streamid << 16));
+    return 0;
+}
+
+// Wait for the transfer queued on a bulk stream to complete.  Short
+// transfers are not an error.
+int
+xhci_stream_wait(struct usb_pipe *p, int streamid)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (streamid <= 0 || streamid >= pipe->streams)
+        return -1;
+    int cc = xhci_event_wait(xhci, pipe->srings[streamid]
+                             , usb_xfer_time(p, 0));
+    if (cc != CC_SUCCESS && cc != CC_SHORT_PACKET) {
+        dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+    return 0;
+}
+
+// Check (from 16bit mode) if xhci_poll_intr() could find anything -
+// either the controller posted an event or a completion was already
+// dequeued while handling another pipe.  This avoids entering 32bit
+// mode on every timer tick for every idle keyboard and mouse.
+int
+xhci_poll_intr_pending(struct usb_pipe *p)
+{
+    if (!CONFIG_USB_XHCI)
+        return 0;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    if (!GET_LOWFLAT(pipe->bufused)
+        || GET_LOWFLAT(pipe->reqs.eidx) == GET_LOWFLAT(pipe->reqs.nidx))
+        return 1;
+    struct xhci_ring *evts = GET_LOWFLAT(pipe->evts);
+    u32 nidx = GET_LOWFLAT(evts->nidx);
+    u32 cs = GET_LOWFLAT(evts->cs);
+    u32 control = GET_LOWFLAT(evts->ring[nidx].control);
+    return (control & TRB_C) == (cs ? 1 : 0);
+}
+
 int VISIBLE32FLAT
 xhci_poll_intr(struct usb_pipe *p, void *data)
 {
@@ -14,6 +14,13 @@ struct usb_pipe *xhci_realloc_pipe(struct usbdevice_s *usbdev
                                    , struct usb_endpoint_descriptor *epdesc);
 int xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
+int xhci_send_bulk2(struct usb_pipe *p, int dir, void *data1, int datalen1
+                    , void *data2, int datalen2);
+int xhci_stream_count(struct usb_pipe *p);
+int xhci_stream_submit(struct usb_pipe *p, int streamid, void *data
+                       , int datalen);
+int xhci_stream_wait(struct usb_pipe *p, int streamid);
+int xhci_poll_intr_pending(struct usb_pipe *p);
 int xhci_poll_intr(struct usb_pipe *p, void *data);
 
 // --------------------------------------------------------------
@@ -122,6 +129,14 @@ struct xhci_trb {
     u32 control;
 } PACKED;
 
+// stream context
+struct xhci_streamctx {
+    u32 deq_low;
+    u32 deq_high;
+    u32 stopped_edtla;
+    u32 reserved_01;
+} PACKED;
+
 // event ring segment
 struct xhci_er_seg {
     u32 ptr_low;
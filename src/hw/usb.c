@@ -6,8 +6,10 @@
 
 #include "biosvar.h" // GET_GLOBAL
 #include "config.h" // CONFIG_*
+#include "fw/paravirt.h" // qemu_cfg_write_file
 #include "malloc.h" // free
 #include "output.h" // dprintf
+#include "pcidevice.h" // struct pci_device
 #include "romfile.h" // romfile_loadint
 #include "string.h" // memset
 #include "usb.h" // struct usb_s
@@ -19,7 +21,7 @@
 #include "usb-ohci.h" // ohci_setup
 #include "usb-uas.h" // usb_uas_setup
 #include "usb-uhci.h" // uhci_setup
-#include "util.h" // msleep
+#include "util.h" // msleep, boot_stop_probing
 #include "x86.h" // __fls
 
 
@@ -80,6 +82,8 @@ usb_poll_intr(struct usb_pipe *pipe_fl, void *data)
     case USB_TYPE_EHCI:
         return ehci_poll_intr(pipe_fl, data);
     case USB_TYPE_XHCI: ;
+        if (!xhci_poll_intr_pending(pipe_fl))
+            return -1;
         return call32_params(xhci_poll_intr, pipe_fl
                              , MAKE_FLATPTR(GET_SEG(SS), data), 0, -1);
     }
@@ -129,6 +133,49 @@ usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
     return usb_send_pipe(pipe_fl, dir, NULL, data, datasize);
 }
 
+// Send two back-to-back messages to a bulk endpoint.  Controllers
+// that can queue several transfers only wait once for both.
+int
+usb_send_bulk2(struct usb_pipe *pipe_fl, int dir, void *data1, int size1
+               , void *data2, int size2)
+{
+    if (!MODESEGMENT && GET_LOWFLAT(pipe_fl->type) == USB_TYPE_XHCI)
+        return xhci_send_bulk2(pipe_fl, dir, data1, size1, data2, size2);
+    int ret = usb_send_bulk(pipe_fl, dir, data1, size1);
+    if (ret)
+        return ret;
+    return usb_send_bulk(pipe_fl, dir, data2, size2);
+}
+
+// Number of bulk streams available on a pipe (zero if the pipe does
+// not use streams).  Stream ids 1..n may be used.
+int
+usb_stream_count(struct usb_pipe *pipe_fl)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return 0;
+    return xhci_stream_count(pipe_fl);
+}
+
+// Queue a message on a bulk stream without waiting for completion.
+int
+usb_stream_submit(struct usb_pipe *pipe_fl, int streamid
+                  , void *data, int datasize)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_stream_submit(pipe_fl, streamid, data, datasize);
+}
+
+// Wait for the message queued on a bulk stream to complete.
+int
+usb_stream_wait(struct usb_pipe *pipe_fl, int streamid)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_stream_wait(pipe_fl, streamid);
+}
+
 // Check if a pipe for a given controller is on the freelist
 int
 usb_is_freelist(struct usb_s *cntl, struct usb_pipe *pipe)
@@ -202,6 +249,19 @@ usb_xfer_time(struct usb_pipe *pipe, int datalen)
     return USB_TIME_COMMAND + 100;
 }
 
+// Find the superspeed companion descriptor that follows an endpoint.
+struct usb_ss_ep_comp_descriptor *
+usb_find_ep_comp(struct usbdevice_s *usbdev
+                 , struct usb_endpoint_descriptor *epdesc)
+{
+    struct usb_ss_ep_comp_descriptor *comp = (void*)epdesc + epdesc->bLength;
+    if (usbdev->speed != USB_SUPERSPEED
+        || (void*)&comp[1] > (void*)usbdev->iface + usbdev->imax
+        || comp->bDescriptorType != USB_DT_ENDPOINT_COMPANION)
+        return NULL;
+    return comp;
+}
+
 // Find the first endpoint of a given type in an interface description.
 struct usb_endpoint_descriptor *
 usb_find_desc(struct usbdevice_s *usbdev, int type, int dir)
@@ -233,8 +293,11 @@ get_device_info8(struct usb_pipe *pipe, struct usb_device_descriptor *dinfo)
     return usb_send_default_control(pipe, &req, dinfo);
 }
 
+// Read the first configuration descriptor.  If 'len' is non-zero it
+// is the expected total length and the initial read of the
+// descriptor header is skipped.
 static struct usb_config_descriptor *
-get_device_config(struct usb_pipe *pipe)
+get_device_config(struct usb_pipe *pipe, u16 len)
 {
     struct usb_config_descriptor cfg;
 
@@ -243,19 +306,25 @@ get_device_config(struct usb_pipe *pipe)
     req.bRequest = USB_REQ_GET_DESCRIPTOR;
     req.wValue = USB_DT_CONFIG<<8;
     req.wIndex = 0;
-    req.wLength = sizeof(cfg);
-    int ret = usb_send_default_control(pipe, &req, &cfg);
-    if (ret)
+    if (!len) {
+        req.wLength = sizeof(cfg);
+        int ret = usb_send_default_control(pipe, &req, &cfg);
+        if (ret)
+            return NULL;
+        len = cfg.wTotalLength;
+    }
+    if (len < sizeof(cfg))
         return NULL;
 
-    struct usb_config_descriptor *config = malloc_tmphigh(cfg.wTotalLength);
+    struct usb_config_descriptor *config = malloc_tmphigh(len);
     if (!config) {
         warn_noalloc();
         return NULL;
     }
-    req.wLength = cfg.wTotalLength;
-    ret = usb_send_default_control(pipe, &req, config);
-    if (ret || config->wTotalLength != cfg.wTotalLength) {
+    req.wLength = len;
+    int ret = usb_send_default_control(pipe, &req, config);
+    if (ret || config->bDescriptorType != USB_DT_CONFIG
+        || config->wTotalLength != len) {
         free(config);
         return NULL;
     }
@@ -297,6 +366,9 @@ usb_set_address(struct usbdevice_s *usbdev)
     dprintf(3, "set_address %p\n", cntl);
     if (cntl->maxaddr >= USB_MAXADDR)
         return -1;
+    // Reserve the address now - on xhci other ports may be setting
+    // their address at the same time (see usb_hub_port_setup()).
+    u8 devaddr = ++cntl->maxaddr;
 
     msleep(USB_TIME_RSTRCY);
 
@@ -307,31 +379,189 @@ usb_set_address(struct usbdevice_s *usbdev)
     };
     usbdev->defpipe = usb_alloc_pipe(usbdev, &epdesc);
     if (!usbdev->defpipe)
-        return -1;
+        goto fail;
 
     // Send set_address command.
     struct usb_ctrlrequest req;
     req.bRequestType = USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
     req.bRequest = USB_REQ_SET_ADDRESS;
-    req.wValue = cntl->maxaddr + 1;
+    req.wValue = devaddr;
     req.wIndex = 0;
     req.wLength = 0;
     int ret = usb_send_default_control(usbdev->defpipe, &req, NULL);
     if (ret) {
         usb_free_pipe(usbdev, usbdev->defpipe);
-        return -1;
+        goto fail;
     }
 
     msleep(USB_TIME_SETADDR_RECOVERY);
 
-    cntl->maxaddr++;
-    usbdev->devaddr = cntl->maxaddr;
+    usbdev->devaddr = devaddr;
     usbdev->defpipe = usb_realloc_pipe(usbdev, usbdev->defpipe, &epdesc);
     if (!usbdev->defpipe)
         return -1;
     return 0;
+
+fail:
+    if (cntl->maxaddr == devaddr)
+        // Address not used - give it back if no other port took a later one
+        cntl->maxaddr--;
+    return -1;
 }
 
+// Determine if resetting a port on the given hub must be serialized
+// with the other ports of the controller.  Until its address is set
+// a device answers on the shared default address 0.  The xhci Address
+// Device command targets a single root port or, on superspeed hubs,
+// a route string, so those ports can be reset and addressed in
+// parallel.  Everything else (including usb2 hubs behind an xhci
+// controller) takes resetlock.
+static int
+usb_hub_needs_resetlock(struct usbhub_s *hub)
+{
+    if (hub->cntl->type != USB_TYPE_XHCI)
+        return 1;
+    return hub->usbdev && hub->usbdev->speed != USB_SUPERSPEED;
+}
+
+
+/****************************************************************
+ * Device cache
+ ****************************************************************/
+
+// If the host provides a writable "etc/usb-cache" fw_cfg file, the
+// devices found on each port are recorded there before boot.  On the
+// next boot a port that held a device without a supported interface
+// is skipped without resetting it, and for other devices the cached
+// endpoint 0 packet size and configuration length save the initial
+// descriptor reads.  If the cached values turn out to be wrong the
+// device is enumerated normally.
+
+#define USBCACHE_MAGIC 0x43425355 // "USBC"
+#define USBCACHE_VERSION 1
+#define USBCACHE_ENTRIES 32
+#define USBCACHE_F_NODRIVER 0x01
+
+struct usbcache_entry_s {
+    u32 cntl;       // PCI bdf or mmio address of the controller
+    u32 path;       // Port path - see usbcache_path()
+    u8 speed;       // Zero if the port was skipped
+    u8 flags;
+    u16 maxpacket;  // Endpoint 0 max packet size
+    u16 cfglen;     // Total length of the first configuration
+    u16 reserved;
+} PACKED;
+
+struct usbcache_s {
+    u32 magic;
+    u16 version;
+    u16 count;
+    struct usbcache_entry_s entries[USBCACHE_ENTRIES];
+} PACKED;
+
+static struct usbcache_s UsbCacheOld VARVERIFY32INIT;
+static struct usbcache_s UsbCacheNew VARVERIFY32INIT;
+static struct romfile_s *UsbCacheFile VARVERIFY32INIT;
+
+// Read the devices recorded during the previous boot.
+static void
+usbcache_load(void)
+{
+    struct romfile_s *file = romfile_find("etc/usb-cache");
+    if (!file)
+        return;
+    if (file->size < sizeof(UsbCacheNew)) {
+        dprintf(1, "etc/usb-cache too small (%d)\n", file->size);
+        return;
+    }
+    int size;
+    struct usbcache_s *old = romfile_loadfile("etc/usb-cache", &size);
+    if (!old)
+        return;
+    if (old->magic == USBCACHE_MAGIC && old->version == USBCACHE_VERSION
+        && old->count <= USBCACHE_ENTRIES) {
+        memcpy(&UsbCacheOld, old, sizeof(UsbCacheOld));
+        dprintf(3, "USB device cache: %d devices\n", UsbCacheOld.count);
+    }
+    free(old);
+    UsbCacheFile = file;
+}
+
+// Encode the ports leading to a device - the root port is marked with
+// a 0x100 bit and each hub below it adds a nibble.  Returns zero if
+// the path does not fit.
+static u32
+usbcache_path(struct usbhub_s *hub, u32 port)
+{
+    if (!hub->usbdev)
+        return port <= 0xff ? 0x100 | port : 0;
+    u32 parent = usbcache_path(hub->usbdev->hub, hub->usbdev->port);
+    if (!parent || parent >= (1 << 28) || port > 0xf)
+        return 0;
+    return (parent << 4) | port;
+}
+
+static u32
+usbcache_cntl(struct usb_s *cntl)
+{
+    return cntl->pci ? cntl->pci->bdf : (u32)cntl->mmio;
+}
+
+// Find the entry of the previous boot for a device.
+static struct usbcache_entry_s *
+usbcache_find(struct usbdevice_s *usbdev)
+{
+    if (!UsbCacheFile)
+        return NULL;
+    u32 path = usbcache_path(usbdev->hub, usbdev->port);
+    if (!path)
+        return NULL;
+    u32 cntl = usbcache_cntl(usbdev->hub->cntl);
+    int i;
+    for (i = 0; i < UsbCacheOld.count; i++) {
+        struct usbcache_entry_s *e = &UsbCacheOld.entries[i];
+        if (e->cntl == cntl && e->path == path)
+            return e;
+    }
+    return NULL;
+}
+
+// Note a device in the cache written before boot.
+static void
+usbcache_record(struct usbdevice_s *usbdev, u8 speed, u8 flags
+                , u16 maxpacket, u16 cfglen)
+{
+    if (!UsbCacheFile || UsbCacheNew.count >= USBCACHE_ENTRIES)
+        return;
+    u32 path = usbcache_path(usbdev->hub, usbdev->port);
+    if (!path)
+        return;
+    struct usbcache_entry_s *e = &UsbCacheNew.entries[UsbCacheNew.count++];
+    memset(e, 0, sizeof(*e));
+    e->cntl = usbcache_cntl(usbdev->hub->cntl);
+    e->path = path;
+    e->speed = speed;
+    e->flags = flags;
+    e->maxpacket = maxpacket;
+    e->cfglen = cfglen;
+}
+
+// Hand the devices found during this boot to the host.
+void
+usb_cache_prepboot(void)
+{
+    if (!CONFIG_USB || !UsbCacheFile)
+        return;
+    UsbCacheNew.magic = USBCACHE_MAGIC;
+    UsbCacheNew.version = USBCACHE_VERSION;
+    qemu_cfg_write_file(&UsbCacheNew, UsbCacheFile, 0, sizeof(UsbCacheNew));
+}
+
+
+/****************************************************************
+ * Device configuration
+ ****************************************************************/
+
 // Called for every found device - see if a driver is available for
 // this device and do setup if so.
 static int
@@ -340,19 +570,30 @@ configure_usb_device(struct usbdevice_s *usbdev)
     ASSERT32FLAT();
     dprintf(3, "config_usb: %p\n", usbdev->defpipe);
 
+    struct usbcache_entry_s *cached = usbcache_find(usbdev);
+    if (cached && (cached->speed != usbdev->speed || cached->maxpacket < 8))
+        cached = NULL;
+    struct usb_config_descriptor *config;
+retry:;
     // Set the max packet size for endpoint 0 of this device.
-    struct usb_device_descriptor dinfo;
-    int ret = get_device_info8(usbdev->defpipe, &dinfo);
-    if (ret)
-        return 0;
-    u16 maxpacket = dinfo.bMaxPacketSize0;
-    if (dinfo.bcdUSB >= 0x0300)
-        maxpacket = 1 << dinfo.bMaxPacketSize0;
-    dprintf(3, "device rev=%04x cls=%02x sub=%02x proto=%02x size=%d\n"
-            , dinfo.bcdUSB, dinfo.bDeviceClass, dinfo.bDeviceSubClass
-            , dinfo.bDeviceProtocol, maxpacket);
-    if (maxpacket < 8)
-        return 0;
+    u16 maxpacket;
+    if (cached) {
+        maxpacket = cached->maxpacket;
+        dprintf(3, "device size=%d (cached)\n", maxpacket);
+    } else {
+        struct usb_device_descriptor dinfo;
+        int ret = get_device_info8(usbdev->defpipe, &dinfo);
+        if (ret)
+            return 0;
+        maxpacket = dinfo.bMaxPacketSize0;
+        if (dinfo.bcdUSB >= 0x0300)
+            maxpacket = 1 << dinfo.bMaxPacketSize0;
+        dprintf(3, "device rev=%04x cls=%02x sub=%02x proto=%02x size=%d\n"
+                , dinfo.bcdUSB, dinfo.bDeviceClass, dinfo.bDeviceSubClass
+                , dinfo.bDeviceProtocol, maxpacket);
+        if (maxpacket < 8)
+            return 0;
+    }
     struct usb_endpoint_descriptor epdesc = {
         .wMaxPacketSize = maxpacket,
         .bmAttributes = USB_ENDPOINT_XFER_CONTROL,
@@ -362,28 +603,42 @@ configure_usb_device(struct usbdevice_s *usbdev)
         return -1;
 
     // Get configuration
-    struct usb_config_descriptor *config = get_device_config(usbdev->defpipe);
-    if (!config)
+    config = get_device_config(usbdev->defpipe, cached ? cached->cfglen : 0);
+    if (!config) {
+        if (cached) {
+            dprintf(1, "USB device cache mismatch - enumerating device\n");
+            cached = NULL;
+            goto retry;
+        }
         return 0;
+    }
 
     // Determine if a driver exists for this device - only look at the
     // interfaces of the first configuration.
-    int num_iface = config->bNumInterfaces;
+    int num_iface = config->bNumInterfaces, skipped = 0, ret;
     void *config_end = (void*)config + config->wTotalLength;
     struct usb_interface_descriptor *iface = (void*)(&config[1]);
     for (;;) {
-        if (!num_iface || (void*)iface + iface->bLength > config_end)
+        if (!num_iface || (void*)iface + iface->bLength > config_end) {
             // Not a supported device.
+            if (!skipped)
+                usbcache_record(usbdev, usbdev->speed, USBCACHE_F_NODRIVER
+                                , maxpacket, config->wTotalLength);
             goto fail;
+        }
         if (iface->bDescriptorType == USB_DT_INTERFACE) {
             num_iface--;
             if (iface->bInterfaceClass == USB_CLASS_HUB
                 || (iface->bInterfaceClass == USB_CLASS_MASS_STORAGE
                     && (iface->bInterfaceProtocol == US_PR_BULK
-                        || iface->bInterfaceProtocol == US_PR_UAS))
-                || (iface->bInterfaceClass == USB_CLASS_HID
-                    && iface->bInterfaceSubClass == USB_INTERFACE_SUBCLASS_BOOT))
+                        || iface->bInterfaceProtocol == US_PR_UAS)))
                 break;
+            if (iface->bInterfaceClass == USB_CLASS_HID
+                && iface->bInterfaceSubClass == USB_INTERFACE_SUBCLASS_BOOT) {
+                if (!is_fast_boot())
+                    break;
+                skipped = 1;
+            }
         }
         iface = (void*)iface + iface->bLength;
     }
@@ -409,6 +664,7 @@ configure_usb_device(struct usbdevice_s *usbdev)
     if (ret)
         goto fail;
 
+    usbcache_record(usbdev, usbdev->speed, 0, maxpacket, config->wTotalLength);
     free(config);
     return 1;
 fail:
@@ -423,23 +679,42 @@ usb_hub_port_setup(void *data)
     struct usbhub_s *hub = usbdev->hub;
     u32 port = usbdev->port;
 
+    // Devices present at power on are seen by the first check, so an
+    // empty port is checked less and less often (each check of an
+    // external hub port is a control transfer).
+    u32 delay = 5;
     for (;;) {
         // Detect if device present (and possibly start reset)
         int ret = hub->op->detect(hub, port);
         if (ret > 0)
             // Device connected.
             break;
-        if (ret < 0 || timer_check(hub->detectend))
-            // No device found.
-            goto done;
-        msleep(5);
+        if (ret < 0 || timer_check(hub->detectend) || boot_stop_probing())
+            // No device found (or no longer needed).
+            goto nodevice;
+        msleep(delay);
+        if (delay < USB_DETECT_POLL_MAX)
+            delay *= 2;
+    }
+
+    struct usbcache_entry_s *cached = usbcache_find(usbdev);
+    if (cached && cached->flags & USBCACHE_F_NODRIVER) {
+        // No driver for the device here last boot - don't reset it.
+        dprintf(3, "usb port %d: skipping unsupported device (cached)\n"
+                , port);
+        usbcache_record(usbdev, cached->speed, cached->flags
+                        , cached->maxpacket, cached->cfglen);
+        goto nodevice;
     }
 
     // XXX - wait USB_TIME_ATTDB time?
 
     // Reset port and determine device speed
-    mutex_lock(&hub->cntl->resetlock);
+    int locked = usb_hub_needs_resetlock(hub);
+    if (locked)
+        mutex_lock(&hub->cntl->resetlock);
     int ret = hub->op->reset(hub, port);
+    hub->resetdone++;
     if (ret < 0)
         // Reset failed
         goto resetfail;
@@ -451,7 +726,8 @@ usb_hub_port_setup(void *data)
         hub->op->disconnect(hub, port);
         goto resetfail;
     }
-    mutex_unlock(&hub->cntl->resetlock);
+    if (locked)
+        mutex_unlock(&hub->cntl->resetlock);
 
     // Configure the device
     int count = configure_usb_device(usbdev);
@@ -464,8 +740,13 @@ done:
     free(usbdev);
     return;
 
+nodevice:
+    hub->resetdone++;
+    goto done;
+
 resetfail:
-    mutex_unlock(&hub->cntl->resetlock);
+    if (locked)
+        mutex_unlock(&hub->cntl->resetlock);
     goto done;
 }
 
@@ -505,6 +786,7 @@ usb_setup(void)
         return;
     dprintf(3, "init usb\n");
     usb_time_sigatt = romfile_loadint("etc/usb-time-sigatt", USB_TIME_SIGATT);
+    usbcache_load();
     xhci_setup();
     ehci_setup();
     uhci_setup();
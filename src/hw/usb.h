@@ -51,6 +51,7 @@ struct usbhub_s {
     u32 threads;
     u32 portcount;
     u32 devcount;
+    u32 resetdone;  // Ports that are past device detection and reset
 };
 
 // Hub callback (32bit) info
@@ -91,6 +92,12 @@ struct usbhub_op_s {
 
 #define USB_TIME_SETADDR_RECOVERY 2
 
+// Longest wait between checks of an empty port for a device (in ms)
+#define USB_DETECT_POLL_MAX 20
+
+// Interrupt pipes queue this many timer ticks worth of reports
+#define USB_INTR_QUEUE_TICKS 4
+
 #define USB_PID_OUT                     0xe1
 #define USB_PID_IN                      0x69
 #define USB_PID_SETUP                   0x2d
@@ -202,6 +209,15 @@ struct usb_endpoint_descriptor {
     u8  bInterval;
 } PACKED;
 
+struct usb_ss_ep_comp_descriptor {
+    u8  bLength;
+    u8  bDescriptorType;
+
+    u8  bMaxBurst;
+    u8  bmAttributes;
+    u16 wBytesPerInterval;
+} PACKED;
+
 #define USB_ENDPOINT_NUMBER_MASK        0x0f    /* in bEndpointAddress */
 #define USB_ENDPOINT_DIR_MASK           0x80
 
@@ -232,6 +248,12 @@ struct usb_endpoint_descriptor {
 
 // usb.c
 int usb_send_bulk(struct usb_pipe *pipe, int dir, void *data, int datasize);
+int usb_send_bulk2(struct usb_pipe *pipe_fl, int dir, void *data1, int size1
+                   , void *data2, int size2);
+int usb_stream_count(struct usb_pipe *pipe_fl);
+int usb_stream_submit(struct usb_pipe *pipe_fl, int streamid
+                      , void *data, int datasize);
+int usb_stream_wait(struct usb_pipe *pipe_fl, int streamid);
 int usb_poll_intr(struct usb_pipe *pipe, void *data);
 int usb_32bit_pipe(struct usb_pipe *pipe_fl);
 struct usb_pipe *usb_alloc_pipe(struct usbdevice_s *usbdev
@@ -247,9 +269,12 @@ void usb_desc2pipe(struct usb_pipe *pipe, struct usbdevice_s *usbdev
 int usb_get_period(struct usbdevice_s *usbdev
                    , struct usb_endpoint_descriptor *epdesc);
 int usb_xfer_time(struct usb_pipe *pipe, int datalen);
+struct usb_ss_ep_comp_descriptor *usb_find_ep_comp(
+    struct usbdevice_s *usbdev, struct usb_endpoint_descriptor *epdesc);
 struct usb_endpoint_descriptor *usb_find_desc(struct usbdevice_s *usbdev
                                               , int type, int dir);
 void usb_enumerate(struct usbhub_s *hub);
 void usb_setup(void);
+void usb_cache_prepboot(void);
 
 #endif // usb.h
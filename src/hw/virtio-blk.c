@@ -15,10 +15,11 @@
 #include "pcidevice.h" // foreachpci
 #include "pci_ids.h" // PCI_DEVICE_ID_VIRTIO_BLK
 #include "pci_regs.h" // PCI_VENDOR_ID
+#include "romfile.h" // romfile_loadint
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep, bootprio_find_pci_device, is_bootprio_strict
+#include "util.h" // bootprio_find_pci_device, is_bootprio_strict
 #include "virtio-pci.h"
 #include "virtio-mmio.h"
 #include "virtio-ring.h"
@@ -29,95 +30,305 @@
 		typeof(b) _b = b;\
 		_a < _b ? _a : _b; })
 
+// Maximum number of requests kept in flight on the virtqueue at once.
+#define VIRTIO_BLK_MAX_INFLIGHT 16
+// Maximum number of data segments in one request
+#define VIRTIO_BLK_MAX_SEGS (VRING_INDIRECT_MAX - 2)
+
 struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
     struct vp_device vp;
+    // Per-request header and status for pipelined submission
+    struct virtio_blk_outhdr hdr[VIRTIO_BLK_MAX_INFLIGHT];
+    u8 status[VIRTIO_BLK_MAX_INFLIGHT];
+    // Requests started with disk_submit() (indexed by request id)
+    struct disk_req_s *reqs[VIRTIO_BLK_MAX_INFLIGHT];
+    u32 async_busy;
+    int async_count;
+    // Write coalescing (see virtio_blk_wb_write())
+    u8 *wb_buf;
+    u16 wb_max;         // Buffer size in blocks (0 if not enabled)
+    u16 wb_count;       // Number of buffered blocks
+    u64 wb_lba;         // First block of the buffered writes
+    u8 wb_flush;        // VIRTIO_BLK_F_FLUSH was negotiated
+    u8 wb_dirty;        // Writes since the last cache flush
 };
 
-void
-virtio_blk_op_one_segment(struct virtiodrive_s *vdrive,
-    int write, struct vring_list sg[])
+// Determine the request size and queue depth limits of a drive.
+static int
+virtio_blk_limits(struct virtiodrive_s *vdrive, u32 *pseg_blocks
+                  , int *pmax_segs, u16 *pblk_num_max)
 {
-    struct vring_virtqueue *vq = vdrive->vq;
+    u32 blksize = vdrive->drive.blksize;
+
+    /* Each data segment is limited to size_max (if offered), and a
+     * request carries up to seg_max data segments (one if not offered) */
+    u32 seg_blocks = 0xffff;
+    if (vdrive->drive.max_segment_size)
+        seg_blocks = min(vdrive->drive.max_segment_size / blksize, seg_blocks);
+    if (!seg_blocks)
+        return 0;
+    int max_segs = min(vdrive->drive.max_segments ?: 1, VIRTIO_BLK_MAX_SEGS);
+    *pseg_blocks = seg_blocks;
+    *pmax_segs = max_segs;
+    *pblk_num_max = min(seg_blocks * max_segs, 0xffff);
+
+    /* Limit depth to the number of requests the ring can hold */
+    return min(VIRTIO_BLK_MAX_INFLIGHT,
+               vring_max_requests(vdrive->vq, max_segs + 2));
+}
 
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(&vdrive->vp, vq, 1);
+// Place one request on the virtqueue (without notifying the device)
+static void
+virtio_blk_add_request(struct virtiodrive_s *vdrive, int id, u64 lba
+                       , void *p, u16 blk_num, u32 seg_blocks, u32 type)
+{
+    struct vring_list sg[VIRTIO_BLK_MAX_SEGS + 2];
+    struct virtio_blk_outhdr *hdr = &vdrive->hdr[id];
+    hdr->type = type;
+    hdr->ioprio = 0;
+    // The request sector is always in 512 byte units
+    hdr->sector = lba * (vdrive->drive.blksize / DISK_SECTOR_SIZE);
+    vdrive->status[id] = VIRTIO_BLK_S_UNSUPP;
+    sg[0].addr = (void*)hdr;
+    sg[0].length = sizeof(*hdr);
+    int segs = 0;
+    while (blk_num) {
+        u16 n = min(blk_num, seg_blocks);
+        segs++;
+        sg[segs].addr = p;
+        sg[segs].length = vdrive->drive.blksize * n;
+        p += sg[segs].length;
+        blk_num -= n;
+    }
+    sg[segs + 1].addr = (void*)&vdrive->status[id];
+    sg[segs + 1].length = sizeof(vdrive->status[id]);
 
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+    if (type != VIRTIO_BLK_T_IN)
+        vring_add_buf(vdrive->vq, sg, segs + 1, 1, id, id);
+    else
+        vring_add_buf(vdrive->vq, sg, 1, segs + 1, id, id);
+}
 
-    /* Reclaim virtqueue element */
-        vring_get_buf(vq, NULL);
+// Reap the completions of a batch of requests placed on the virtqueue.
+static int
+virtio_blk_reap(struct virtiodrive_s *vdrive, int num)
+{
+    struct vring_virtqueue *vq = vdrive->vq;
+    int i, ret = DISK_RET_SUCCESS;
+    for (i = 0; i < num; i++) {
+        if (vring_wait_used(vq, DISK_REQUEST_TIMEOUT))
+            return DISK_RET_ETIMEOUT;
+        int id = vring_get_buf(vq, NULL);
+        if (vdrive->status[id] != VIRTIO_BLK_S_OK)
+            ret = DISK_RET_EBADTRACK;
+    }
 
     /**
     ** Clear interrupt status register. Avoid leaving interrupts stuck
     ** if VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
     **/
     vp_get_isr(&vdrive->vp);
+    return ret;
 }
 
+// Read or write (VIRTIO_BLK_T_IN/OUT) 'count' blocks at 'lba'
 static int
-virtio_blk_op(struct disk_op_s *op, int write)
+virtio_blk_xfer(struct virtiodrive_s *vdrive, u64 lba, void *p, u16 count
+                , u32 type)
 {
-    struct virtiodrive_s *vdrive =
-        container_of(op->drive_fl, struct virtiodrive_s, drive);
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
-    u32 max_io_size =
-        vdrive->drive.max_segment_size * vdrive->drive.max_segments;
+    u32 seg_blocks;
+    int max_segs;
     u16 blk_num_max;
+    int depth = virtio_blk_limits(vdrive, &seg_blocks, &max_segs, &blk_num_max);
+    if (!depth)
+        return DISK_RET_EPARAM;
 
-    if (vdrive->drive.blksize != 0 && max_io_size != 0)
-        blk_num_max = (u16) min(max_io_size / vdrive->drive.blksize, 0xffff);
-    else
-        /* default blk_num_max if hardware doesnot advise a proper value */
-        blk_num_max = 64;
+    while (count > 0) {
+        int num;
+        for (num = 0; num < depth && count > 0; num++) {
+            u16 blk_num = min(count, blk_num_max);
+            virtio_blk_add_request(vdrive, num, lba, p, blk_num
+                                   , seg_blocks, type);
+            p += blk_num * vdrive->drive.blksize;
+            lba += blk_num;
+            count -= blk_num;
+        }
+        vring_kick(&vdrive->vp, vdrive->vq, num);
+        int ret = virtio_blk_reap(vdrive, num);
+        if (ret)
+            return ret;
+    }
+    return DISK_RET_SUCCESS;
+}
 
-    if (op->count <= blk_num_max) {
-        virtio_blk_op_one_segment(vdrive, write, sg);
-    } else {
-        void *p  = op->buf_fl;
-        u16 count = op->count;
 
-        while (count > 0) {
-            u16 blk_num = min(count, blk_num_max);
-            sg[1].length = vdrive->drive.blksize * blk_num;
-            sg[1].addr = p;
-            virtio_blk_op_one_segment(vdrive, write, sg);
-            if (status == VIRTIO_BLK_S_OK) {
-                hdr.sector += blk_num;
-                p += sg[1].length;
-                count -= blk_num;
-            } else {
-                break;
-            }
+/****************************************************************
+ * Write coalescing
+ ****************************************************************/
+
+// When enabled (etc/virtio-blk-write-coalesce), writes are copied to a
+// per drive buffer and adjacent writes are issued together as one
+// larger request.  The buffer is written out (and the device's write
+// cache flushed if it supports that) on a read of the buffered blocks,
+// a non-adjacent write, a disk reset, a request to another drive, and
+// when the operating system is about to take over (see
+// disk_writeback_flush()).
+
+// Issue a cache flush request
+static int
+virtio_blk_cache_flush(struct virtiodrive_s *vdrive)
+{
+    virtio_blk_add_request(vdrive, 0, 0, NULL, 0, 1, VIRTIO_BLK_T_FLUSH);
+    vring_kick(&vdrive->vp, vdrive->vq, 1);
+    return virtio_blk_reap(vdrive, 1);
+}
+
+// Write out the buffered blocks of a drive, and with 'cache' set also
+// flush the device's write cache.
+static int
+virtio_blk_wb_flush(struct virtiodrive_s *vdrive, int cache)
+{
+    int ret = DISK_RET_SUCCESS;
+    if (vdrive->wb_count) {
+        ret = virtio_blk_xfer(vdrive, vdrive->wb_lba, vdrive->wb_buf
+                              , vdrive->wb_count, VIRTIO_BLK_T_OUT);
+        vdrive->wb_count = 0;
+    }
+    if (cache && vdrive->wb_dirty) {
+        if (vdrive->wb_flush) {
+            int flushret = virtio_blk_cache_flush(vdrive);
+            if (!ret)
+                ret = flushret;
         }
+        vdrive->wb_dirty = 0;
+        disk_writeback_note(NULL);
+    }
+    return ret;
+}
+
+// Check if a request touches the buffered blocks
+static int
+virtio_blk_wb_overlap(struct virtiodrive_s *vdrive, struct disk_op_s *op)
+{
+    return (vdrive->wb_count && op->lba < vdrive->wb_lba + vdrive->wb_count
+            && op->lba + op->count > vdrive->wb_lba);
+}
+
+// Handle a write with write coalescing enabled
+static int
+virtio_blk_wb_write(struct virtiodrive_s *vdrive, struct disk_op_s *op)
+{
+    if (vdrive->wb_count
+        && (op->lba != vdrive->wb_lba + vdrive->wb_count
+            || vdrive->wb_count + op->count > vdrive->wb_max)) {
+        int ret = virtio_blk_wb_flush(vdrive, 0);
+        if (ret)
+            return ret;
     }
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    vdrive->wb_dirty = 1;
+    disk_writeback_note(&vdrive->drive);
+    if (op->count > vdrive->wb_max)
+        return virtio_blk_xfer(vdrive, op->lba, op->buf_fl, op->count
+                               , VIRTIO_BLK_T_OUT);
+    if (!vdrive->wb_count)
+        vdrive->wb_lba = op->lba;
+    u32 blksize = vdrive->drive.blksize;
+    memcpy(vdrive->wb_buf + vdrive->wb_count * blksize, op->buf_fl
+           , op->count * blksize);
+    vdrive->wb_count += op->count;
+    return DISK_RET_SUCCESS;
+}
+
+// Enable write coalescing on a drive if requested
+static void
+virtio_blk_wb_setup(struct virtiodrive_s *vdrive, u32 kib, u64 features)
+{
+    u32 blocks = min(kib, 1024) * 1024 / vdrive->drive.blksize;
+    if (!blocks)
+        return;
+    u8 *buf = memalign_high(PAGE_SIZE, blocks * vdrive->drive.blksize);
+    if (!buf) {
+        warn_noalloc();
+        return;
+    }
+    vdrive->wb_buf = buf;
+    vdrive->wb_max = blocks;
+    vdrive->wb_flush = !!(features & (1ull << VIRTIO_BLK_F_FLUSH));
+    dprintf(1, "virtio-blk %p: coalescing writes of up to %d blocks"
+            " (cache flush %d)\n", vdrive, blocks, vdrive->wb_flush);
+}
+
+// Start a request submitted with disk_submit()
+static int
+virtio_blk_submit(struct disk_req_s *req)
+{
+    struct disk_op_s *op = &req->op;
+    struct virtiodrive_s *vdrive =
+        container_of(op->drive_fl, struct virtiodrive_s, drive);
+    u32 seg_blocks;
+    int max_segs;
+    u16 blk_num_max;
+    int depth = virtio_blk_limits(vdrive, &seg_blocks, &max_segs, &blk_num_max);
+    if (!depth || op->count > blk_num_max || vdrive->wb_count
+        || (vdrive->wb_max && op->command == CMD_WRITE))
+        // Write coalescing is only done on the synchronous path
+        return DISK_QUEUE_SYNC;
+    u32 idle = ~vdrive->async_busy & ((1 << depth) - 1);
+    if (!idle)
+        return DISK_QUEUE_FULL;
+    int id = __ffs(idle);
+    vdrive->reqs[id] = req;
+    vdrive->async_busy |= 1 << id;
+    vdrive->async_count++;
+    virtio_blk_add_request(vdrive, id, op->lba, op->buf_fl, op->count
+                           , seg_blocks, (op->command == CMD_WRITE
+                                          ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN));
+    vring_kick(&vdrive->vp, vdrive->vq, 1);
+    return DISK_QUEUE_STARTED;
+}
+
+// Complete finished requests that were started by virtio_blk_submit()
+static int
+virtio_blk_poll(struct drive_s *drive_fl)
+{
+    struct virtiodrive_s *vdrive =
+        container_of(drive_fl, struct virtiodrive_s, drive);
+    struct vring_virtqueue *vq = vdrive->vq;
+    int reaped = 0;
+    while (vdrive->async_busy && vring_more_used(vq)) {
+        int id = vring_get_buf(vq, NULL);
+        struct disk_req_s *req = vdrive->reqs[id];
+        int status = (vdrive->status[id] == VIRTIO_BLK_S_OK
+                      ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK);
+        vdrive->async_busy &= ~(1 << id);
+        vdrive->async_count--;
+        reaped = 1;
+        disk_req_done(req, status);
+    }
+    if (reaped)
+        vp_get_isr(&vdrive->vp);
+    return vdrive->async_count;
+}
+
+static const struct disk_async_s virtio_blk_async = {
+    .submit = virtio_blk_submit,
+    .poll = virtio_blk_poll,
+};
+
+// Enable disk_submit() support on a drive
+static void
+virtio_blk_async_setup(struct virtiodrive_s *vdrive)
+{
+    u32 seg_blocks;
+    int max_segs;
+    u16 blk_num_max;
+    int depth = virtio_blk_limits(vdrive, &seg_blocks, &max_segs, &blk_num_max);
+    if (!depth)
+        return;
+    vdrive->drive.async = &virtio_blk_async;
+    vdrive->drive.queue_depth = depth;
 }
 
 int
@@ -125,16 +336,62 @@ virtio_blk_process_op(struct disk_op_s *op)
 {
     if (! CONFIG_VIRTIO_BLK)
         return 0;
+    struct virtiodrive_s *vdrive =
+        container_of(op->drive_fl, struct virtiodrive_s, drive);
+    // The synchronous path reuses the request ids of disk_submit()
+    disk_drain(op->drive_fl);
     switch (op->command) {
     case CMD_READ:
-        return virtio_blk_op(op, 0);
+        if (virtio_blk_wb_overlap(vdrive, op)) {
+            int ret = virtio_blk_wb_flush(vdrive, 0);
+            if (ret)
+                return ret;
+        }
+        return virtio_blk_xfer(vdrive, op->lba, op->buf_fl, op->count
+                               , VIRTIO_BLK_T_IN);
     case CMD_WRITE:
-        return virtio_blk_op(op, 1);
+        if (vdrive->wb_max)
+            return virtio_blk_wb_write(vdrive, op);
+        return virtio_blk_xfer(vdrive, op->lba, op->buf_fl, op->count
+                               , VIRTIO_BLK_T_OUT);
+    case CMD_RESET:
+    case CMD_FLUSH:
+        return virtio_blk_wb_flush(vdrive, 1);
     default:
         return default_process_op(op);
     }
 }
 
+// Read the parts of the config space used for the drive geometry in
+// one batch, instead of one trapping access per field.
+static void
+virtio_blk_read_config(struct virtiodrive_s *vdrive, u64 features)
+{
+    struct virtio_blk_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    vp_read_device_config(&vdrive->vp, 0, &cfg,
+                          offsetof(struct virtio_blk_config, blk_size)
+                          + sizeof(cfg.blk_size));
+
+    vdrive->drive.sectors = cfg.capacity;
+    if (features & (1ull << VIRTIO_BLK_F_SIZE_MAX))
+        vdrive->drive.max_segment_size = cfg.size_max;
+    if (features & (1ull << VIRTIO_BLK_F_SEG_MAX))
+        vdrive->drive.max_segments = cfg.seg_max;
+    if (features & (1ull << VIRTIO_BLK_F_BLK_SIZE))
+        vdrive->drive.blksize = cfg.blk_size;
+    else
+        vdrive->drive.blksize = DISK_SECTOR_SIZE;
+    // The capacity is always in 512 byte units
+    if (vdrive->drive.blksize > DISK_SECTOR_SIZE
+        && disk_blksize_supported(vdrive->drive.blksize))
+        vdrive->drive.sectors >>= (__ffs(vdrive->drive.blksize)
+                                   - __ffs(DISK_SECTOR_SIZE));
+    vdrive->drive.pchs.cylinder = cfg.cylinders;
+    vdrive->drive.pchs.head = cfg.heads;
+    vdrive->drive.pchs.sector = cfg.sectors;
+}
+
 static void
 init_virtio_blk(void *data)
 {
@@ -149,6 +406,8 @@ init_virtio_blk(void *data)
     memset(vdrive, 0, sizeof(*vdrive));
     vdrive->drive.type = DTYPE_VIRTIO_BLK;
     vdrive->drive.cntl_id = pci->bdf;
+    u32 wb_kib = romfile_loadint("etc/virtio-blk-write-coalesce", 0);
+    u64 flush = wb_kib ? 1ull << VIRTIO_BLK_F_FLUSH : 0, wb_features;
 
     vp_init_simple(&vdrive->vp, pci);
 
@@ -160,6 +419,9 @@ init_virtio_blk(void *data)
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
         u64 max_segments = 1ull << VIRTIO_BLK_F_SEG_MAX;
         u64 max_segment_size = 1ull << VIRTIO_BLK_F_SIZE_MAX;
+        u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
 
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
@@ -167,7 +429,8 @@ init_virtio_blk(void *data)
         }
 
         features = features & (version1 | iommu_platform | blk_size
-                        | max_segments | max_segment_size);
+                        | max_segments | max_segment_size | indirect
+                        | packed | notify_data | flush);
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -176,38 +439,14 @@ init_virtio_blk(void *data)
             goto fail;
         }
 
-        if (features & max_segment_size)
-            vdrive->drive.max_segment_size =
-                vp_read(&vp->device, struct virtio_blk_config, size_max);
-
-        if (features & max_segments)
-            vdrive->drive.max_segments =
-                vp_read(&vp->device, struct virtio_blk_config, seg_max);
-
-        vdrive->drive.sectors =
-            vp_read(&vp->device, struct virtio_blk_config, capacity);
-        if (features & blk_size) {
-            vdrive->drive.blksize =
-                vp_read(&vp->device, struct virtio_blk_config, blk_size);
-        } else {
-            vdrive->drive.blksize = DISK_SECTOR_SIZE;
-        }
-        if (vdrive->drive.blksize != DISK_SECTOR_SIZE) {
-            dprintf(1, "virtio-blk %pP block size %d is unsupported\n",
-                    pci, vdrive->drive.blksize);
-            goto fail;
-        }
-        dprintf(3, "virtio-blk %pP blksize=%d sectors=%u size_max=%u "
-                "seg_max=%u.\n", pci, vdrive->drive.blksize,
-                (u32)vdrive->drive.sectors, vdrive->drive.max_segment_size,
-                vdrive->drive.max_segments);
-
-        vdrive->drive.pchs.cylinder =
-            vp_read(&vp->device, struct virtio_blk_config, cylinders);
-        vdrive->drive.pchs.head =
-            vp_read(&vp->device, struct virtio_blk_config, heads);
-        vdrive->drive.pchs.sector =
-            vp_read(&vp->device, struct virtio_blk_config, sectors);
+        virtio_blk_read_config(vdrive, features);
+        wb_features = features;
+    } else {
+        u64 features = vp_get_features(&vdrive->vp);
+        vp_set_features(&vdrive->vp, features
+                        & ((1ull << VIRTIO_RING_F_INDIRECT_DESC) | flush));
+        virtio_blk_read_config(vdrive, features);
+        wb_features = features & flush;
     }
 
     if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
@@ -215,36 +454,18 @@ init_virtio_blk(void *data)
         goto fail;
     }
 
-    if (!vdrive->vp.use_modern) {
-        struct virtio_blk_config cfg;
-        vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
-
-        u64 f = vp_get_features(&vdrive->vp);
-        vdrive->drive.blksize = (f & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
-            cfg.blk_size : DISK_SECTOR_SIZE;
-
-        if (f & (1 << VIRTIO_BLK_F_SIZE_MAX))
-            vdrive->drive.max_segment_size = cfg.size_max;
-
-        if (f & (1 << VIRTIO_BLK_F_SEG_MAX))
-            vdrive->drive.max_segments = cfg.seg_max;
-
-        vdrive->drive.sectors = cfg.capacity;
-        dprintf(3, "virtio-blk %pP blksize=%d sectors=%u size_max=%u "
-                "seg_max=%u.\n", pci, vdrive->drive.blksize,
-                (u32)vdrive->drive.sectors, vdrive->drive.max_segment_size,
-                vdrive->drive.max_segments);
-
-        if (vdrive->drive.blksize != DISK_SECTOR_SIZE) {
-            dprintf(1, "virtio-blk %pP block size %d is unsupported\n",
-                    pci, vdrive->drive.blksize);
-            goto fail;
-        }
-        vdrive->drive.pchs.cylinder = cfg.cylinders;
-        vdrive->drive.pchs.head = cfg.heads;
-        vdrive->drive.pchs.sector = cfg.sectors;
+    dprintf(3, "virtio-blk %pP blksize=%d sectors=%u size_max=%u "
+            "seg_max=%u.\n", pci, vdrive->drive.blksize,
+            (u32)vdrive->drive.sectors, vdrive->drive.max_segment_size,
+            vdrive->drive.max_segments);
+    if (!disk_blksize_supported(vdrive->drive.blksize)) {
+        dprintf(1, "virtio-blk %pP block size %d is unsupported\n",
+                pci, vdrive->drive.blksize);
+        goto fail;
     }
 
+    virtio_blk_wb_setup(vdrive, wb_kib, wb_features);
+    virtio_blk_async_setup(vdrive);
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk PCI:%pP", pci);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_pci_device(pci));
 
@@ -256,7 +477,7 @@ init_virtio_blk(void *data)
 
 fail:
     vp_reset(&vdrive->vp);
-    free(vdrive->vq);
+    vring_free(vdrive->vq);
     free(vdrive);
 }
 
@@ -273,6 +494,7 @@ init_virtio_blk_mmio(void *mmio)
     memset(vdrive, 0, sizeof(*vdrive));
     vdrive->drive.type = DTYPE_VIRTIO_BLK;
     vdrive->drive.cntl_id = (u32)mmio;
+    u32 wb_kib = romfile_loadint("etc/virtio-blk-write-coalesce", 0);
 
     vp_init_mmio(&vdrive->vp, mmio);
 
@@ -282,9 +504,14 @@ init_virtio_blk_mmio(void *mmio)
     u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
     u64 max_segments = 1ull << VIRTIO_BLK_F_SEG_MAX;
     u64 max_segment_size = 1ull << VIRTIO_BLK_F_SIZE_MAX;
+    u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
+    u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+    u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
+    u64 flush = wb_kib ? 1ull << VIRTIO_BLK_F_FLUSH : 0;
 
     features = features & (version1 | blk_size
-            | max_segments | max_segment_size);
+            | max_segments | max_segment_size | indirect | packed
+            | notify_data | flush);
     vp_set_features(vp, features);
     status |= VIRTIO_CONFIG_S_FEATURES_OK;
     vp_set_status(vp, status);
@@ -298,23 +525,8 @@ init_virtio_blk_mmio(void *mmio)
         goto fail;
     }
 
-    if (features & max_segment_size)
-        vdrive->drive.max_segment_size =
-            vp_read(&vp->device, struct virtio_blk_config, size_max);
-
-    if (features & max_segments)
-        vdrive->drive.max_segments =
-            vp_read(&vp->device, struct virtio_blk_config, seg_max);
-
-    vdrive->drive.sectors =
-        vp_read(&vp->device, struct virtio_blk_config, capacity);
-    if (features & blk_size) {
-        vdrive->drive.blksize =
-            vp_read(&vp->device, struct virtio_blk_config, blk_size);
-    } else {
-        vdrive->drive.blksize = DISK_SECTOR_SIZE;
-    }
-    if (vdrive->drive.blksize != DISK_SECTOR_SIZE) {
+    virtio_blk_read_config(vdrive, features);
+    if (!disk_blksize_supported(vdrive->drive.blksize)) {
         dprintf(1, "virtio-blk-mmio %p block size %d is unsupported\n",
                 mmio, vdrive->drive.blksize);
         goto fail;
@@ -324,13 +536,8 @@ init_virtio_blk_mmio(void *mmio)
             (u32)vdrive->drive.sectors, vdrive->drive.max_segment_size,
             vdrive->drive.max_segments);
 
-    vdrive->drive.pchs.cylinder =
-        vp_read(&vp->device, struct virtio_blk_config, cylinders);
-    vdrive->drive.pchs.head =
-        vp_read(&vp->device, struct virtio_blk_config, heads);
-    vdrive->drive.pchs.sector =
-        vp_read(&vp->device, struct virtio_blk_config, sectors);
-
+    virtio_blk_wb_setup(vdrive, wb_kib, features);
+    virtio_blk_async_setup(vdrive);
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk mmio:%p", mmio);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_mmio_device(mmio));
 
@@ -340,7 +547,7 @@ init_virtio_blk_mmio(void *mmio)
 
 fail:
     vp_reset(&vdrive->vp);
-    free(vdrive->vq);
+    vring_free(vdrive->vq);
     free(vdrive);
 }
 
@@ -367,7 +574,9 @@ virtio_blk_setup(void)
                     pci);
             continue;
         }
+        if (boot_defer_pci(init_virtio_blk, pci))
+            continue;
 
-        run_thread(init_virtio_blk, pci);
+        run_thread_prio(init_virtio_blk, pci, boot_thread_prio(pci));
     }
 }
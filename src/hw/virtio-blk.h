@@ -20,10 +20,13 @@ struct virtio_blk_config
 #define VIRTIO_BLK_F_SIZE_MAX 1  /* Maximum size of any single segment */
 #define VIRTIO_BLK_F_SEG_MAX 2   /* Maximum number of segments in a request */
 #define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9     /* Cache flush command support */
 
 /* These two define direction. */
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
+/* Cache flush command. */
+#define VIRTIO_BLK_T_FLUSH      4
 
 /* This is the first element of the read scatter-gather list. */
 struct virtio_blk_outhdr {
@@ -1,6 +1,8 @@
+#include "byteorder.h" // le64_to_cpu
 #include "config.h" // CONFIG_DEBUG_LEVEL
 #include "malloc.h" // free
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_loadfile
 #include "stacks.h" // run_thread
 #include "string.h" // memset
 #include "util.h" // acpi_dsdt_*
@@ -29,6 +31,24 @@ void virtio_mmio_setup_acpi(void)
     }
 }
 
+// Set up the devices listed in the "opt/org.seabios/virtio-mmio"
+// file - an array of little endian 64bit device base addresses.  Used
+// on machines without acpi tables to describe the devices.
+void virtio_mmio_setup_romfile(void)
+{
+    int size;
+    u64 *addrs = romfile_loadfile("opt/org.seabios/virtio-mmio", &size);
+    if (!addrs)
+        return;
+    int i;
+    for (i = 0; i < size / sizeof(addrs[0]); i++) {
+        dprintf(1, "fw_cfg: virtio-mmio device at 0x%llx\n"
+                , le64_to_cpu(addrs[i]));
+        virtio_mmio_setup_one(le64_to_cpu(addrs[i]));
+    }
+    free(addrs);
+}
+
 void virtio_mmio_setup_one(u64 addr)
 {
     static const char *names[] = {
@@ -71,6 +71,7 @@ typedef struct virtio_mmio_cfg {
 } virtio_mmio_cfg;
 
 void virtio_mmio_setup_acpi(void);
+void virtio_mmio_setup_romfile(void);
 void virtio_mmio_setup_one(u64 mmio);
 void vp_init_mmio(struct vp_device *vp, void *mmio);
 
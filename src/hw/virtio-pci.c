@@ -186,6 +186,38 @@ void _vp_write(struct vp_cap *cap, u32 offset, u8 size, u64 var)
     }
 }
 
+static u8 vp_config_generation(struct vp_device *vp)
+{
+    if (vp->use_mmio)
+        return vp_read(&vp->common, virtio_mmio_cfg, config_generation);
+    if (vp->use_modern)
+        return vp_read(&vp->common, virtio_pci_common_cfg, config_generation);
+    return 0;
+}
+
+// Read a block of the device specific config space a dword at a time.
+void vp_read_device_config(struct vp_device *vp, u32 offset,
+                           void *buf, u32 len)
+{
+    struct vp_cap *cap = &vp->device;
+    if (!vp->use_mmio && !vp->use_modern) {
+        cap = &vp->legacy;
+        offset += offsetof(struct virtio_pci_legacy, device);
+    }
+    u8 gen;
+    do {
+        gen = vp_config_generation(vp);
+        u8 *ptr = buf;
+        u32 pos = 0;
+        while (pos < len) {
+            u32 size = (len - pos >= 4 && !((offset + pos) & 3)) ? 4 : 1;
+            u32 val = _vp_read(cap, offset + pos, size);
+            memcpy(&ptr[pos], &val, size);
+            pos += size;
+        }
+    } while (gen != vp_config_generation(vp));
+}
+
 u64 vp_get_features(struct vp_device *vp)
 {
     u32 f0, f1;
@@ -211,6 +243,7 @@ void vp_set_features(struct vp_device *vp, u64 features)
 {
     u32 f0, f1;
 
+    vp->features = features;
     f0 = features;
     f1 = features >> 32;
 
@@ -278,53 +311,76 @@ void vp_reset(struct vp_device *vp)
     }
 }
 
-void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq)
+// Set up the doorbell of a queue, so vp_notify() doesn't have to work
+// out the access method and address on every kick.
+static void vp_notify_setup(struct vp_device *vp, struct vring_virtqueue *vq)
 {
+    struct vp_cap *cap;
+    u32 offset;
+    u8 size;
+
     if (vp->use_mmio) {
-        vp_write(&vp->common, virtio_mmio_cfg, queue_notify, vq->queue_index);
+        cap = &vp->common;
+        offset = offsetof(struct virtio_mmio_cfg, queue_notify);
+        size = 4;
     } else if (vp->use_modern) {
-        u32 offset = vq->queue_notify_off * vp->notify_off_multiplier;
-        switch (vp->notify.mode) {
-        case VP_ACCESS_IO:
-            outw(vq->queue_index, vp->notify.ioaddr + offset);
-            break;
-        case VP_ACCESS_MMIO:
-            writew(vp->notify.memaddr + offset, vq->queue_index);
-            break;
-        case VP_ACCESS_PCICFG:
-            pci_config_writeb(vp->notify.bdf, vp->notify.cfg +
-                              offsetof(struct virtio_pci_cfg_cap, cap.bar),
-                              vp->notify.bar);
-            pci_config_writel(vp->notify.bdf, vp->notify.cfg +
-                              offsetof(struct virtio_pci_cfg_cap, cap.offset),
-                              vp->notify.baroff + offset);
-            pci_config_writel(vp->notify.bdf, vp->notify.cfg +
-                              offsetof(struct virtio_pci_cfg_cap, cap.length),
-                              2);
-            pci_config_writew(vp->notify.bdf, vp->notify.cfg +
-                              offsetof(struct virtio_pci_cfg_cap, pci_cfg_data),
-                              vq->queue_index);
-        }
-        dprintf(9, "vp notify %x (%d) -- 0x%x\n",
-                vp->notify.ioaddr, 2, vq->queue_index);
+        u16 notify_off = vp_read(&vp->common, virtio_pci_common_cfg,
+                                 queue_notify_off);
+        cap = &vp->notify;
+        offset = notify_off * vp->notify_off_multiplier;
+        size = (vp->features & (1ull << VIRTIO_F_NOTIFICATION_DATA)) ? 4 : 2;
     } else {
-        vp_write(&vp->legacy, virtio_pci_legacy, queue_notify, vq->queue_index);
+        cap = &vp->legacy;
+        offset = offsetof(struct virtio_pci_legacy, queue_notify);
+        size = 2;
+    }
+    vq->notify_mode = cap->mode;
+    vq->notify_size = size;
+    vq->notify_addr = cap->ioaddr + offset;
+    dprintf(3, "vp queue %d notify %x (%d)\n", vq->queue_index
+            , vq->notify_addr, size);
+}
+
+void vp_notify(struct vp_device *vp, struct vring_virtqueue *vq)
+{
+    u32 data = vq->queue_index;
+    if (vp->features & (1ull << VIRTIO_F_NOTIFICATION_DATA)) {
+        // Tell the device where the new requests end
+        if (vq->packed)
+            data |= ((u32)vq->avail_idx << 16) | ((u32)vq->avail_wrap << 31);
+        else
+            data |= (u32)vq->vring.avail->idx << 16;
     }
+
+    switch (vq->notify_mode) {
+    case VP_ACCESS_IO:
+        if (vq->notify_size == 4)
+            outl(data, vq->notify_addr);
+        else
+            outw(data, vq->notify_addr);
+        break;
+    case VP_ACCESS_MMIO:
+        if (vq->notify_size == 4)
+            writel((void*)vq->notify_addr, data);
+        else
+            writew((void*)vq->notify_addr, data);
+        break;
+    case VP_ACCESS_PCICFG:
+        _vp_write(&vp->notify, vq->notify_addr - vp->notify.baroff
+                  , vq->notify_size, data);
+        break;
+    }
+    dprintf(9, "vp notify %x (%d) -- 0x%x\n",
+            vq->notify_addr, vq->notify_size, data);
 }
 
 int vp_find_vq(struct vp_device *vp, int queue_index,
                struct vring_virtqueue **p_vq)
 {
+   struct vring_virtqueue *vq = NULL;
    u16 num;
 
    ASSERT32FLAT();
-   struct vring_virtqueue *vq = *p_vq = memalign_high(PAGE_SIZE, sizeof(*vq));
-   if (!vq) {
-       warn_noalloc();
-       goto fail;
-   }
-   memset(vq, 0, sizeof(*vq));
-
 
    /* select the queue */
    if (vp->use_mmio) {
@@ -374,11 +430,13 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
            goto fail;
        }
    }
-   vq->queue_index = queue_index;
 
-   /* initialize the queue */
+   /* allocate and initialize the queue */
+   vq = vring_alloc(num, vp->features);
+   if (!vq)
+       goto fail;
+   vq->queue_index = queue_index;
    struct vring * vr = &vq->vring;
-   vring_init(vr, num, (unsigned char*)&vq->queue);
 
    /* activate the queue
     *
@@ -414,23 +472,23 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
                 (unsigned long)virt_to_phys(vr->used));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_enable, 1);
-       vq->queue_notify_off = vp_read(&vp->common, virtio_pci_common_cfg,
-                                      queue_notify_off);
    } else {
        vp_write(&vp->legacy, virtio_pci_legacy, queue_pfn,
                 (unsigned long)virt_to_phys(vr->desc) >> PAGE_SHIFT);
    }
+   vp_notify_setup(vp, vq);
+   *p_vq = vq;
    return num;
 
 fail:
-   free(vq);
+   vring_free(vq);
    *p_vq = NULL;
    return -1;
 }
 
 void vp_init_simple(struct vp_device *vp, struct pci_device *pci)
 {
-    u8 cap = pci_find_capability(pci->bdf, PCI_CAP_ID_VNDR, 0);
+    u8 cap = pci_device_find_capability(pci, PCI_CAP_ID_VNDR, 0);
     struct vp_cap *vp_cap;
     const char *mode;
     u32 offset, base, mul;
@@ -526,7 +584,7 @@ void vp_init_simple(struct vp_device *vp, struct pci_device *pci)
                     pci, vp_cap->cap, type, vp_cap->bar, addr, offset, mode);
         }
 
-        cap = pci_find_capability(pci->bdf, PCI_CAP_ID_VNDR, cap);
+        cap = pci_device_find_capability(pci, PCI_CAP_ID_VNDR, cap);
     }
 
     if (vp->common.cap && vp->notify.cap && vp->isr.cap && vp->device.cap) {
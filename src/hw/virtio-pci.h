@@ -110,6 +110,7 @@ struct vp_cap {
 struct vp_device {
     struct vp_cap common, notify, isr, device, legacy;
     u32 notify_off_multiplier;
+    u64 features; /* negotiated with vp_set_features() */
     u8 use_modern;
     u8 use_mmio;
 };
@@ -125,6 +126,8 @@ void _vp_write(struct vp_cap *cap, u32 offset, u8 size, u64 var);
     _vp_write(_cap, offsetof(_struct, _field),          \
              sizeof(((_struct *)0)->_field), _var)
 
+void vp_read_device_config(struct vp_device *vp, u32 offset,
+                           void *buf, u32 len);
 u64 vp_get_features(struct vp_device *vp);
 void vp_set_features(struct vp_device *vp, u64 features);
 
@@ -16,7 +16,11 @@
  *
  */
 
+#include "malloc.h" // memalign_high
 #include "output.h" // panic
+#include "stacks.h" // wait_completion
+#include "string.h" // memset
+#include "x86.h" // __ffs
 #include "virtio-ring.h"
 #include "virtio-pci.h"
 
@@ -25,6 +29,111 @@
         } while (0)
 #define BUG_ON(condition) do { if (condition) BUG(); } while (0)
 
+/*
+ * vring_alloc
+ *
+ * allocate a virtqueue with a ring of num entries
+ *
+ */
+
+static void vring_init_packed(struct vring_virtqueue *vq, unsigned int num)
+{
+    struct vring *vr = &vq->vring;
+    vr->num = num;
+    vr->desc = (void*)vq->queue;
+    vr->avail = (void*)vq->queue + sizeof(struct vring_packed_desc) * num;
+    vr->used = (void*)vr->avail + sizeof(struct vring_packed_desc_event);
+
+    /* disable interrupts */
+    struct vring_packed_desc_event *driver = (void*)vr->avail;
+    driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+    vq->packed = 1;
+    vq->avail_wrap = 1;
+    vq->used_wrap = 1;
+    vq->num_free = num;
+
+    /* Buffer ids are allocated separately from the ring positions as
+     * the device may complete buffers out of order */
+    unsigned int i;
+    for (i = 0; i < num; i++)
+        vq->pstate[i].next = i + 1;
+    vq->free_head = 0;
+}
+
+struct vring_virtqueue *vring_alloc(unsigned int num, u64 features)
+{
+    ASSERT32FLAT();
+    struct vring_virtqueue *vq = malloc_high(sizeof(*vq));
+    if (!vq) {
+        warn_noalloc();
+        return NULL;
+    }
+    memset(vq, 0, sizeof(*vq));
+    int packed = !!(features & (1ull << VIRTIO_F_RING_PACKED));
+    u32 size = packed ? vring_packed_size(num) : vring_size(num);
+    vq->queue = memalign_high(PAGE_SIZE, size);
+    if (packed)
+        vq->pstate = malloc_high(sizeof(*vq->pstate) * num);
+    else
+        vq->vdata = malloc_high(sizeof(*vq->vdata) * num);
+    if (!vq->queue || (!vq->vdata && !vq->pstate))
+        goto fail;
+    memset(vq->queue, 0, size);
+    if (features & (1ull << VIRTIO_RING_F_INDIRECT_DESC)) {
+        size = (sizeof(*vq->indirect) * VRING_INDIRECT_MAX
+                * VRING_INDIRECT_TABLES);
+        vq->indirect = memalign_high(sizeof(*vq->indirect), size);
+        if (!vq->indirect)
+            goto fail;
+        memset(vq->indirect, 0, size);
+        vq->indirect_free = (1ULL << VRING_INDIRECT_TABLES) - 1;
+    }
+    if (packed)
+        vring_init_packed(vq, num);
+    else
+        vring_init(&vq->vring, num, vq->queue);
+    return vq;
+
+fail:
+    warn_noalloc();
+    vring_free(vq);
+    return NULL;
+}
+
+/*
+ * vring_free
+ *
+ * release a virtqueue and its ring
+ *
+ */
+
+void vring_free(struct vring_virtqueue *vq)
+{
+    if (!vq)
+        return;
+    free(vq->queue);
+    free(vq->vdata);
+    free(vq->pstate);
+    free(vq->indirect);
+    free(vq);
+}
+
+/*
+ * vring_max_requests
+ *
+ * how many requests of segs descriptors can be in flight at once ?
+ *
+ */
+
+int vring_max_requests(struct vring_virtqueue *vq, int segs)
+{
+    int num = vq->packed ? vq->num_free : vq->vring.num;
+    if (vq->indirect && segs > 1 && segs <= VRING_INDIRECT_MAX)
+        return num < VRING_INDIRECT_TABLES ? num : VRING_INDIRECT_TABLES;
+    return num / segs;
+}
+
 /*
  * vring_more_used
  *
@@ -32,8 +141,21 @@
  *
  */
 
+static int vring_more_used_packed(struct vring_virtqueue *vq)
+{
+    struct vring_packed_desc *desc = (void*)vq->vring.desc;
+    u16 flags = desc[vq->last_used_idx].flags;
+    int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+    int used = !!(flags & VRING_PACKED_DESC_F_USED);
+    /* Make sure descriptor reads are done after flags read above. */
+    smp_rmb();
+    return avail == used && used == vq->used_wrap;
+}
+
 int vring_more_used(struct vring_virtqueue *vq)
 {
+    if (vq->packed)
+        return vring_more_used_packed(vq);
     struct vring_used *used = vq->vring.used;
     int more = vq->last_used_idx != used->idx;
     /* Make sure ring reads are done after idx read above. */
@@ -41,6 +163,98 @@ int vring_more_used(struct vring_virtqueue *vq)
     return more;
 }
 
+static int vring_more_used_cb(void *vq)
+{
+    return vring_more_used(vq);
+}
+
+/*
+ * vring_wait_used
+ *
+ * wait (up to timeout ms) for the host to return a used buffer
+ *
+ */
+
+int vring_wait_used(struct vring_virtqueue *vq, u32 timeout)
+{
+    return wait_completion(vring_more_used_cb, vq, timeout);
+}
+
+/*
+ * vring_reserve
+ *
+ * wait (up to timeout ms) for a free request index, so that several
+ * threads may each keep a request of up to segs descriptors in flight
+ *
+ */
+
+struct vring_reserve_s {
+    struct vring_virtqueue *vq;
+    u32 limit;
+    int index;
+};
+
+static int vring_reserve_cb(void *data)
+{
+    struct vring_reserve_s *r = data;
+    struct vring_virtqueue *vq = r->vq;
+    if ((vq->reserved & r->limit) == r->limit)
+        return 0;
+    r->index = __ffs(~vq->reserved);
+    vq->reserved |= 1 << r->index;
+    return 1;
+}
+
+int vring_reserve(struct vring_virtqueue *vq, int segs, u32 timeout)
+{
+    int num = vq->vring.num / segs;
+    if (vq->indirect && segs > 1 && segs <= VRING_INDIRECT_MAX)
+        num = vq->vring.num < VRING_INDIRECT_TABLES ?
+            vq->vring.num : VRING_INDIRECT_TABLES;
+    if (num > VRING_MAX_RESERVED)
+        num = VRING_MAX_RESERVED;
+    if (num < 1)
+        num = 1;
+    struct vring_reserve_s r = { vq, (1ULL << num) - 1, -1 };
+    if (wait_completion(vring_reserve_cb, &r, timeout))
+        return -1;
+    return r.index;
+}
+
+/*
+ * vring_wait_index
+ *
+ * wait (up to timeout ms) for the host to return the request added
+ * with a reserved index, collecting other completions on the way
+ *
+ */
+
+struct vring_wait_s {
+    struct vring_virtqueue *vq;
+    u32 mask;
+};
+
+static int vring_wait_index_cb(void *data)
+{
+    struct vring_wait_s *w = data;
+    struct vring_virtqueue *vq = w->vq;
+    while (!(vq->completed & w->mask) && vring_more_used(vq))
+        vq->completed |= 1 << vring_get_buf(vq, NULL);
+    return !!(vq->completed & w->mask);
+}
+
+int vring_wait_index(struct vring_virtqueue *vq, int index, u32 timeout)
+{
+    struct vring_wait_s w = { vq, 1 << index };
+    int ret = wait_completion(vring_wait_index_cb, &w, timeout);
+    if (ret)
+        // The host still owns the request - leave the index reserved
+        return ret;
+    vq->completed &= ~w.mask;
+    vq->reserved &= ~w.mask;
+    return 0;
+}
+
 /*
  * vring_free
  *
@@ -55,6 +269,12 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
 
     /* find end of given descriptor */
 
+    if (desc[head].flags & VRING_DESC_F_INDIRECT) {
+        u32 table = ((u32)desc[head].addr - virt_to_phys(vq->indirect))
+                     / (sizeof(*desc) * VRING_INDIRECT_MAX);
+        vq->indirect_free |= 1 << table;
+    }
+
     i = head;
     while (desc[i].flags & VRING_DESC_F_NEXT)
         i = desc[i].next;
@@ -72,8 +292,37 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
  *
  */
 
+static int vring_get_buf_packed(struct vring_virtqueue *vq, unsigned int *len)
+{
+    struct vring_packed_desc *desc = (void*)vq->vring.desc;
+    struct vring_packed_desc *elem = &desc[vq->last_used_idx];
+    u16 id = elem->id;
+    if (len != NULL)
+        *len = elem->len;
+
+    BUG_ON(id >= vq->vring.num);
+    struct vring_packed_state *st = &vq->pstate[id];
+    if (st->table >= 0)
+        vq->indirect_free |= 1 << st->table;
+    vq->num_free += st->chain;
+    st->next = vq->free_head;
+    vq->free_head = id;
+
+    u32 next = vq->last_used_idx + st->chain;
+    if (next >= vq->vring.num) {
+        next -= vq->vring.num;
+        vq->used_wrap ^= 1;
+    }
+    vq->last_used_idx = next;
+
+    return st->data;
+}
+
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 {
+    if (vq->packed)
+        return vring_get_buf_packed(vq, len);
+
     struct vring *vr = &vq->vring;
     struct vring_used_elem *elem;
     struct vring_used *used = vq->vring.used;
@@ -96,11 +345,85 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
     return ret;
 }
 
+static void vring_add_buf_packed(struct vring_virtqueue *vq,
+                                 struct vring_list list[],
+                                 unsigned int out, unsigned int in, int index)
+{
+    struct vring_packed_desc *desc = (void*)vq->vring.desc;
+    unsigned int num = vq->vring.num, n = out + in, chain = n, i;
+    u16 pos = vq->avail_idx, head = pos, head_flags = 0;
+    u16 id = vq->free_head;
+    u8 wrap = vq->avail_wrap;
+    s16 table = -1;
+
+    if (vq->indirect && n > 1 && n <= VRING_INDIRECT_MAX
+        && vq->indirect_free) {
+        /* Place the whole request in an indirect table */
+        table = __ffs(vq->indirect_free);
+        struct vring_packed_desc *idesc =
+            (void*)&vq->indirect[table * VRING_INDIRECT_MAX];
+        vq->indirect_free &= ~(1 << table);
+        for (i = 0; i < n; i++) {
+            idesc[i].addr = (u64)virt_to_phys(list[i].addr);
+            idesc[i].len = list[i].length;
+            idesc[i].id = 0;
+            idesc[i].flags = i >= out ? VRING_DESC_F_WRITE : 0;
+        }
+        chain = 1;
+    }
+    BUG_ON(chain > vq->num_free || id >= num);
+
+    for (i = 0; i < chain; i++) {
+        u16 flags = (wrap ? VRING_PACKED_DESC_F_AVAIL
+                     : VRING_PACKED_DESC_F_USED);
+        if (table >= 0) {
+            flags |= VRING_DESC_F_INDIRECT;
+            desc[pos].addr = (u64)virt_to_phys(
+                &vq->indirect[table * VRING_INDIRECT_MAX]);
+            desc[pos].len = n * sizeof(struct vring_packed_desc);
+        } else {
+            if (i >= out)
+                flags |= VRING_DESC_F_WRITE;
+            if (i + 1 < chain)
+                flags |= VRING_DESC_F_NEXT;
+            desc[pos].addr = (u64)virt_to_phys(list[i].addr);
+            desc[pos].len = list[i].length;
+        }
+        desc[pos].id = id;
+        if (i)
+            desc[pos].flags = flags;
+        else
+            head_flags = flags;
+        if (++pos >= num) {
+            pos = 0;
+            wrap ^= 1;
+        }
+    }
+    vq->avail_idx = pos;
+    vq->avail_wrap = wrap;
+    vq->num_free -= chain;
+
+    struct vring_packed_state *st = &vq->pstate[id];
+    vq->free_head = st->next;
+    st->data = index;
+    st->chain = chain;
+    st->table = table;
+
+    /* Make the chain visible to the device by writing the head flags last */
+    smp_wmb();
+    desc[head].flags = head_flags;
+}
+
 void vring_add_buf(struct vring_virtqueue *vq,
                    struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added)
 {
+    if (vq->packed) {
+        vring_add_buf_packed(vq, list, out, in, index);
+        return;
+    }
+
     struct vring *vr = &vq->vring;
     int i, av, head, prev;
     struct vring_desc *desc = vr->desc;
@@ -108,25 +431,48 @@ void vring_add_buf(struct vring_virtqueue *vq,
 
     BUG_ON(out + in == 0);
 
-    prev = 0;
     head = vq->free_head;
-    for (i = head; out; i = desc[i].next, out--) {
-        desc[i].flags = VRING_DESC_F_NEXT;
-        desc[i].addr = (u64)virt_to_phys(list->addr);
-        desc[i].len = list->length;
-        prev = i;
-        list++;
-    }
-    for ( ; in; i = desc[i].next, in--) {
-        desc[i].flags = VRING_DESC_F_NEXT|VRING_DESC_F_WRITE;
-        desc[i].addr = (u64)virt_to_phys(list->addr);
-        desc[i].len = list->length;
-        prev = i;
-        list++;
-    }
-    desc[prev].flags = desc[prev].flags & ~VRING_DESC_F_NEXT;
+    if (vq->indirect && out + in > 1 && out + in <= VRING_INDIRECT_MAX
+        && vq->indirect_free) {
+        /* Place the whole request in an indirect table */
+        int table = __ffs(vq->indirect_free);
+        struct vring_desc *idesc = &vq->indirect[table * VRING_INDIRECT_MAX];
+        unsigned int n = out + in;
+        vq->indirect_free &= ~(1 << table);
+        for (i = 0; i < n; i++) {
+            idesc[i].flags = VRING_DESC_F_NEXT;
+            if (i >= out)
+                idesc[i].flags |= VRING_DESC_F_WRITE;
+            idesc[i].addr = (u64)virt_to_phys(list[i].addr);
+            idesc[i].len = list[i].length;
+            idesc[i].next = i + 1;
+        }
+        idesc[n - 1].flags &= ~VRING_DESC_F_NEXT;
 
-    vq->free_head = i;
+        desc[head].flags = VRING_DESC_F_INDIRECT;
+        desc[head].addr = (u64)virt_to_phys(idesc);
+        desc[head].len = n * sizeof(*idesc);
+        vq->free_head = desc[head].next;
+    } else {
+        prev = 0;
+        for (i = head; out; i = desc[i].next, out--) {
+            desc[i].flags = VRING_DESC_F_NEXT;
+            desc[i].addr = (u64)virt_to_phys(list->addr);
+            desc[i].len = list->length;
+            prev = i;
+            list++;
+        }
+        for ( ; in; i = desc[i].next, in--) {
+            desc[i].flags = VRING_DESC_F_NEXT|VRING_DESC_F_WRITE;
+            desc[i].addr = (u64)virt_to_phys(list->addr);
+            desc[i].len = list->length;
+            prev = i;
+            list++;
+        }
+        desc[prev].flags = desc[prev].flags & ~VRING_DESC_F_NEXT;
+
+        vq->free_head = i;
+    }
 
     vq->vdata[head] = index;
 
@@ -137,11 +483,24 @@ void vring_add_buf(struct vring_virtqueue *vq,
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 {
     struct vring *vr = &vq->vring;
-    struct vring_avail *avail = vr->avail;
+    if (vq->packed) {
+        /* Make sure descriptor writes are done before notifying. */
+        smp_wmb();
+    } else {
+        /* Make sure idx update is done after ring write. */
+        smp_wmb();
+        vr->avail->idx = vr->avail->idx + num_added;
+    }
 
-    /* Make sure idx update is done after ring write. */
-    smp_wmb();
-    avail->idx = avail->idx + num_added;
+    /* Skip the doorbell while the device is polling the ring anyway. */
+    smp_mb();
+    if (vq->packed) {
+        struct vring_packed_desc_event *device = (void*)vr->used;
+        if (device->flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+            return;
+    } else if (vr->used->flags & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
 
     vp_notify(vp, vq);
 }
@@ -19,16 +19,36 @@
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1              32
 #define VIRTIO_F_IOMMU_PLATFORM         33
+/* Packed virtqueue layout. */
+#define VIRTIO_F_RING_PACKED            34
+/* Notifications carry the next available ring position. */
+#define VIRTIO_F_NOTIFICATION_DATA      38
 
-#define MAX_QUEUE_NUM      (256)
+/* Indirect descriptor tables supported. */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+
+#define MAX_QUEUE_NUM      (1024)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+
+/* Indirect tables per queue, and descriptors per table */
+#define VRING_INDIRECT_TABLES 16
+#define VRING_INDIRECT_MAX    8
+
+/* Request indexes tracked by vring_reserve (bits of a u32) */
+#define VRING_MAX_RESERVED 32
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
 #define VRING_USED_F_NO_NOTIFY     1
 
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+
 struct vring_desc
 {
    u64 addr;
@@ -57,6 +77,31 @@ struct vring_used
    struct vring_used_elem ring[];
 };
 
+struct vring_packed_desc
+{
+   u64 addr;
+   u32 len;
+   u16 id;
+   u16 flags;
+};
+
+struct vring_packed_desc_event
+{
+   u16 off_wrap;
+   u16 flags;
+};
+
+/* Per buffer id state of a packed ring */
+struct vring_packed_state
+{
+   u16 data;
+   u16 chain;
+   s16 table;
+   u16 next;    /* Next free buffer id (in free_head list) */
+};
+
+/* For a packed ring desc/avail/used point to the descriptor ring and
+ * the driver and device event suppression areas. */
 struct vring {
    unsigned int num;
    struct vring_desc *desc;
@@ -69,17 +114,37 @@ struct vring {
            + sizeof(u16) * num, PAGE_SIZE)                              \
      + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num)
 
-typedef unsigned char virtio_queue_t[vring_size(MAX_QUEUE_NUM)];
+#define vring_packed_size(num)                                  \
+    (sizeof(struct vring_packed_desc) * num                     \
+     + 2 * sizeof(struct vring_packed_desc_event))
 
 struct vring_virtqueue {
-   virtio_queue_t queue;
+   unsigned char *queue;
    struct vring vring;
-   u16 free_head;
+   u16 free_head;   /* Free descriptor (split) or buffer id (packed) */
    u16 last_used_idx;
-   u16 vdata[MAX_QUEUE_NUM];
+   u16 *vdata;
+   /* Indirect descriptor tables, NULL if not negotiated */
+   struct vring_desc *indirect;
+   u32 indirect_free;
+   /* Packed ring state */
+   u8 packed;
+   u8 avail_wrap;
+   u8 used_wrap;
+   u16 avail_idx;
+   u16 num_free;
+   struct vring_packed_state *pstate;
+   /* Request indexes handed out by vring_reserve, and those of them
+    * the host has returned but their waiter has not yet collected */
+   u32 reserved;
+   u32 completed;
    /* PCI */
    int queue_index;
-   int queue_notify_off;
+   /* Doorbell precomputed by vp_find_vq(): VP_ACCESS_* mode, access
+    * size and the port, address or bar offset to write */
+   u8 notify_mode;
+   u8 notify_size;
+   u32 notify_addr;
 };
 
 struct vring_list {
@@ -110,7 +175,13 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
 }
 
 struct vp_device;
+struct vring_virtqueue *vring_alloc(unsigned int num, u64 features);
+void vring_free(struct vring_virtqueue *vq);
+int vring_max_requests(struct vring_virtqueue *vq, int segs);
 int vring_more_used(struct vring_virtqueue *vq);
+int vring_wait_used(struct vring_virtqueue *vq, u32 timeout);
+int vring_reserve(struct vring_virtqueue *vq, int segs, u32 timeout);
+int vring_wait_index(struct vring_virtqueue *vq, int index, u32 timeout);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len);
 void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
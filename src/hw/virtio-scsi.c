@@ -18,19 +18,28 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep, bootprio_find_pci_device, is_bootprio_strict
+#include "util.h" // bootprio_find_pci_device, is_bootprio_strict
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-scsi.h"
 #include "virtio-mmio.h"
 
+#define VIRTIO_SCSI_MAX_QUEUES 4
+
+// A controller and its request queues
+struct virtio_scsi_s {
+    struct vp_device vp;
+    int num_queues;
+    struct vring_virtqueue *vqs[VIRTIO_SCSI_MAX_QUEUES];
+};
+
 struct virtio_lun_s {
     struct drive_s drive;
     struct pci_device *pci;
     void *mmio;
     char name[16];
     struct vring_virtqueue *vq;
-    struct vp_device *vp;
+    struct virtio_scsi_s *vs;
     u16 target;
     u16 lun;
 };
@@ -42,7 +51,7 @@ virtio_scsi_process_op(struct disk_op_s *op)
         return 0;
     struct virtio_lun_s *vlun =
         container_of(op->drive_fl, struct virtio_lun_s, drive);
-    struct vp_device *vp = vlun->vp;
+    struct vp_device *vp = &vlun->vs->vp;
     struct vring_virtqueue *vq = vlun->vq;
     struct virtio_scsi_req_cmd req;
     struct virtio_scsi_resp_cmd resp;
@@ -74,16 +83,20 @@ virtio_scsi_process_op(struct disk_op_s *op)
         sg[data_idx].length = len;
     }
 
+    /* Several target scans may share the queue - take a request slot,
+     * which also serves as the command's tag */
+    int index = vring_reserve(vq, 3, DISK_REQUEST_TIMEOUT);
+    if (index < 0)
+        return DISK_RET_ETIMEOUT;
+    req.id = index;
+
     /* Add to virtqueue and kick host */
-    vring_add_buf(vq, sg, out_num, in_num, 0, 0);
+    vring_add_buf(vq, sg, out_num, in_num, index, 0);
     vring_kick(vp, vq, 1);
 
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
-
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
+    /* Wait for reply (this also reclaims the virtqueue element) */
+    if (vring_wait_index(vq, index, DISK_REQUEST_TIMEOUT))
+        return DISK_RET_ETIMEOUT;
 
     /* Clear interrupt status register.  Avoid leaving interrupts stuck if
      * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
@@ -99,18 +112,21 @@ virtio_scsi_process_op(struct disk_op_s *op)
 static void
 virtio_scsi_init_lun(struct virtio_lun_s *vlun,
                      struct pci_device *pci, void *mmio,
-                     struct vp_device *vp, struct vring_virtqueue *vq,
-                     u16 target, u16 lun)
+                     struct virtio_scsi_s *vs, u16 target, u16 lun)
 {
     memset(vlun, 0, sizeof(*vlun));
     vlun->drive.type = DTYPE_VIRTIO_SCSI;
     vlun->drive.cntl_id = pci->bdf;
     vlun->pci = pci;
     vlun->mmio = mmio;
-    vlun->vp = vp;
-    vlun->vq = vq;
+    vlun->vs = vs;
+    // Spread the luns over the request queues - all the commands of a
+    // lun stay on one queue, so they complete in order.
+    vlun->vq = vs->vqs[(target + lun) % vs->num_queues];
     vlun->target = target;
     vlun->lun = lun;
+    // The data of a request is a single (up to 4GiB) descriptor
+    vlun->drive.max_blocks = 0xffff;
     if (vlun->pci)
         snprintf(vlun->name, sizeof(vlun->name), "pci:%pP", vlun->pci);
     if (vlun->mmio)
@@ -142,8 +158,8 @@ virtio_scsi_add_lun(u32 lun, struct drive_s *tmpl_drv)
         warn_noalloc();
         return -1;
     }
-    virtio_scsi_init_lun(vlun, tmpl_vlun->pci, tmpl_vlun->mmio,tmpl_vlun->vp,
-                         tmpl_vlun->vq, tmpl_vlun->target, lun);
+    virtio_scsi_init_lun(vlun, tmpl_vlun->pci, tmpl_vlun->mmio, tmpl_vlun->vs,
+                         tmpl_vlun->target, lun);
 
     if (vlun->pci)
         boot_lchs_find_scsi_device(vlun->pci, vlun->target, vlun->lun,
@@ -159,31 +175,115 @@ fail:
 }
 
 static int
-virtio_scsi_scan_target(struct pci_device *pci, void *mmio, struct vp_device *vp,
-                        struct vring_virtqueue *vq, u16 target)
+virtio_scsi_scan_target(struct pci_device *pci, void *mmio,
+                        struct virtio_scsi_s *vs, u16 target)
 {
+    if (is_bootprio_strict()) {
+        // Don't probe a target that has no bootable lun at all
+        int prio = -1;
+        if (pci)
+            prio = bootprio_find_scsi_target(pci, target);
+        if (mmio)
+            prio = bootprio_find_scsi_mmio_target(mmio, target);
+        if (prio < 0)
+            return 0;
+    }
 
     struct virtio_lun_s vlun0;
 
-    virtio_scsi_init_lun(&vlun0, pci, mmio, vp, vq, target, 0);
+    virtio_scsi_init_lun(&vlun0, pci, mmio, vs, target, 0);
 
-    int ret = scsi_rep_luns_scan(&vlun0.drive, virtio_scsi_add_lun);
+    int ret = scsi_rep_luns_scan_parallel(&vlun0.drive, virtio_scsi_add_lun);
     return ret < 0 ? 0 : ret;
 }
 
+#define VIRTIO_SCSI_MAX_TARGETS 256
+#define VIRTIO_SCSI_SCAN_THREADS 8
+
+struct virtio_scsi_scan_s {
+    struct pci_device *pci;
+    void *mmio;
+    struct virtio_scsi_s *vs;
+    int next_target, workers, tot;
+};
+
+static void
+virtio_scsi_scan_worker(void *data)
+{
+    struct virtio_scsi_scan_s *scan = data;
+    while (scan->next_target < VIRTIO_SCSI_MAX_TARGETS
+           && !boot_stop_probing()) {
+        u16 target = scan->next_target++;
+        scan->tot += virtio_scsi_scan_target(scan->pci, scan->mmio, scan->vs
+                                             , target);
+    }
+    scan->workers--;
+}
+
+// Scan all targets, overlapping the probes of several targets.
+static int
+virtio_scsi_scan_targets(struct pci_device *pci, void *mmio
+                         , struct virtio_scsi_s *vs)
+{
+    struct virtio_scsi_scan_s scan = {
+        .pci = pci, .mmio = mmio, .vs = vs,
+    };
+    int i;
+    for (i = 0; i < VIRTIO_SCSI_SCAN_THREADS; i++) {
+        scan.workers++;
+        run_thread(virtio_scsi_scan_worker, &scan);
+    }
+    while (scan.workers)
+        yield();
+    return scan.tot;
+}
+
+// Set up as many request queues (the ones after the control and event
+// queues) as the device has, up to VIRTIO_SCSI_MAX_QUEUES.
+static int
+virtio_scsi_find_vqs(struct virtio_scsi_s *vs)
+{
+    u32 num_queues;
+    vp_read_device_config(&vs->vp, offsetof(struct virtio_scsi_config
+                                            , num_queues)
+                          , &num_queues, sizeof(num_queues));
+    if (num_queues > VIRTIO_SCSI_MAX_QUEUES)
+        num_queues = VIRTIO_SCSI_MAX_QUEUES;
+    do {
+        if (vp_find_vq(&vs->vp, 2 + vs->num_queues
+                       , &vs->vqs[vs->num_queues]) < 0)
+            break;
+        vs->num_queues++;
+    } while (vs->num_queues < num_queues);
+    dprintf(3, "virtio-scsi using %d request queues\n", vs->num_queues);
+    return vs->num_queues ? 0 : -1;
+}
+
+static void
+virtio_scsi_free(struct virtio_scsi_s *vs)
+{
+    vp_reset(&vs->vp);
+    int i;
+    for (i = 0; i < vs->num_queues; i++)
+        vring_free(vs->vqs[i]);
+    free(vs);
+}
+
 static void
 init_virtio_scsi(void *data)
 {
     struct pci_device *pci = data;
     dprintf(1, "found virtio-scsi at %pP\n", pci);
-    struct vring_virtqueue *vq = NULL;
-    struct vp_device *vp = malloc_high(sizeof(*vp));
-    if (!vp) {
+    struct virtio_scsi_s *vs = malloc_high(sizeof(*vs));
+    if (!vs) {
         warn_noalloc();
         return;
     }
+    memset(vs, 0, sizeof(*vs));
+    struct vp_device *vp = &vs->vp;
     vp_init_simple(vp, pci);
     u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
 
     if (vp->use_modern) {
         u64 features = vp_get_features(vp);
@@ -194,16 +294,21 @@ init_virtio_scsi(void *data)
             goto fail;
         }
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
+        vp_set_features(vp, features & (version1 | iommu_platform | indirect
+                                        | packed | notify_data));
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
             dprintf(1, "device didn't accept features: %pP\n", pci);
             goto fail;
         }
+    } else {
+        vp_set_features(vp, vp_get_features(vp) & indirect);
     }
 
-    if (vp_find_vq(vp, 2, &vq) < 0 ) {
+    if (virtio_scsi_find_vqs(vs) < 0) {
         dprintf(1, "fail to find vq for virtio-scsi %pP\n", pci);
         goto fail;
     }
@@ -211,40 +316,39 @@ init_virtio_scsi(void *data)
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
-    int i, tot;
-    for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(pci, NULL, vp, vq, i);
-
-    if (!tot)
+    if (!virtio_scsi_scan_targets(pci, NULL, vs))
         goto fail;
 
     return;
 
 fail:
-    vp_reset(vp);
-    free(vp);
-    free(vq);
+    virtio_scsi_free(vs);
 }
 
 void
 init_virtio_scsi_mmio(void *mmio)
 {
     dprintf(1, "found virtio-scsi-mmio at %p\n", mmio);
-    struct vring_virtqueue *vq = NULL;
-    struct vp_device *vp = malloc_high(sizeof(*vp));
-    if (!vp) {
+    struct virtio_scsi_s *vs = malloc_high(sizeof(*vs));
+    if (!vs) {
         warn_noalloc();
         return;
     }
+    memset(vs, 0, sizeof(*vs));
+    struct vp_device *vp = &vs->vp;
     vp_init_mmio(vp, mmio);
     u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
 
     u64 features = vp_get_features(vp);
     u64 version1 = 1ull << VIRTIO_F_VERSION_1;
+    u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
     if (features & version1) {
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 notify_data = 1ull << VIRTIO_F_NOTIFICATION_DATA;
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        vp_set_features(vp, features & (version1 | iommu_platform | indirect
+                                        | packed | notify_data));
         vp_set_status(vp, VIRTIO_CONFIG_S_FEATURES_OK);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
             dprintf(1, "device didn't accept features: %pP\n", mmio);
@@ -252,7 +356,7 @@ init_virtio_scsi_mmio(void *mmio)
         }
     }
 
-    if (vp_find_vq(vp, 2, &vq) < 0 ) {
+    if (virtio_scsi_find_vqs(vs) < 0) {
         dprintf(1, "fail to find vq for virtio-scsi-mmio %p\n", mmio);
         goto fail;
     }
@@ -260,19 +364,13 @@ init_virtio_scsi_mmio(void *mmio)
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
-    int i, tot;
-    for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(NULL, mmio, vp, vq, i);
-
-    if (!tot)
+    if (!virtio_scsi_scan_targets(NULL, mmio, vs))
         goto fail;
 
     return;
 
 fail:
-    vp_reset(vp);
-    free(vp);
-    free(vq);
+    virtio_scsi_free(vs);
 }
 
 void
@@ -298,7 +396,9 @@ virtio_scsi_setup(void)
                     pci);
             continue;
         }
+        if (boot_defer_pci(init_virtio_scsi, pci))
+            continue;
 
-        run_thread(init_virtio_scsi, pci);
+        run_thread_prio(init_virtio_scsi, pci, boot_thread_prio(pci));
     }
 }
@@ -43,6 +43,7 @@
 #include "malloc.h"
 #include "string.h"
 #include "util.h"
+#include "x86.h"
 #define ISHIFT 11
 
 #define IFIX(a) ((int)((a) * (1 << ISHIFT) + .5))
@@ -121,6 +122,9 @@ static void col221111 __P((int *, unsigned char *, int));
 static void col221111_16 __P((int *, unsigned char *, int));
 static void col221111_32 __P((int *, unsigned char *, int));
 
+static void idct_sse2 __P((int *, int *, PREC *, PREC, int));
+static void col221111_32_sse2 __P((int *, unsigned char *, int));
+
 /*********************************/
 
 #define ERR_NO_SOI 1
@@ -395,17 +399,44 @@ void jpeg_get_size(struct jpeg_decdata *jpeg, int *width, int *height)
     *height = jpeg->height;
 }
 
-int jpeg_show(struct jpeg_decdata *jpeg, unsigned char *pic, int width
-              , int height, int depth, int bytes_per_line_dest)
+// The SSE registers are only used during POST - at runtime they may
+// hold state belonging to the caller.
+static int jpeg_sse2_available(void)
+{
+    u32 eax, ebx, ecx, edx;
+
+    if (HaveRunPost != 1)
+        return 0;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1)
+        return 0;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return !!(edx & CPUID_SSE2);
+}
+
+static void idct_mcu(struct jpeg_decdata *jpeg, int *max, int sse)
+{
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        PREC *quant = jpeg->dquant[i < 4 ? 0 : i - 3];
+        PREC off = i < 4 ? IFIX(128.5) : IFIX(0.5);
+        if (sse && max[i] != 1)
+            idct_sse2(jpeg->dcts + i * 64, jpeg->out + i * 64, quant, off
+                      , max[i]);
+        else
+            idct(jpeg->dcts + i * 64, jpeg->out + i * 64, quant, off
+                 , max[i]);
+    }
+}
+
+static int show_mcus(struct jpeg_decdata *jpeg, unsigned char *pic
+                     , int width, int depth, int bytes_per_line_dest
+                     , unsigned char *rowbuf, int sse)
 {
     int m, mcusx, mcusy, mx, my, mloffset, jpgbpl;
     int max[6];
 
-    if (jpeg->height != height)
-        return ERR_HEIGHT_MISMATCH;
-    if (jpeg->width != width)
-        return ERR_WIDTH_MISMATCH;
-
     jpgbpl = width * depth / 8;
     mloffset = bytes_per_line_dest > jpgbpl ? bytes_per_line_dest : jpgbpl;
 
@@ -416,46 +447,37 @@ int jpeg_show(struct jpeg_decdata *jpeg, unsigned char *pic, int width
     jpeg->dscans[1].next = 6 - 4 - 1;
     jpeg->dscans[2].next = 6 - 4 - 1 - 1;        /* 411 encoding */
     for (my = 0; my < mcusy; my++) {
+        unsigned char *row = pic + my * 16 * mloffset;
+        if (rowbuf)
+            row = rowbuf;
         for (mx = 0; mx < mcusx; mx++) {
             if (jpeg->info.dri && !--jpeg->info.nm)
                 if (dec_checkmarker(jpeg))
                     return ERR_WRONG_MARKER;
 
             decode_mcus(&jpeg->in, jpeg->dcts, 6, jpeg->dscans, max);
-            idct(jpeg->dcts, jpeg->out, jpeg->dquant[0],
-                 IFIX(128.5), max[0]);
-            idct(jpeg->dcts + 64, jpeg->out + 64, jpeg->dquant[0],
-                 IFIX(128.5), max[1]);
-            idct(jpeg->dcts + 128, jpeg->out + 128, jpeg->dquant[0],
-                 IFIX(128.5), max[2]);
-            idct(jpeg->dcts + 192, jpeg->out + 192, jpeg->dquant[0],
-                 IFIX(128.5), max[3]);
-            idct(jpeg->dcts + 256, jpeg->out + 256, jpeg->dquant[1],
-                 IFIX(0.5), max[4]);
-            idct(jpeg->dcts + 320, jpeg->out + 320, jpeg->dquant[2],
-                 IFIX(0.5), max[5]);
+            idct_mcu(jpeg, max, sse);
 
             switch (depth) {
             case 32:
-                col221111_32(jpeg->out,
-                             pic + (my * 16 * mloffset + mx * 16 * 4),
-                             mloffset);
+                if (sse)
+                    col221111_32_sse2(jpeg->out, row + mx * 16 * 4, mloffset);
+                else
+                    col221111_32(jpeg->out, row + mx * 16 * 4, mloffset);
                 break;
             case 24:
-                col221111(jpeg->out,
-                          pic + (my * 16 * mloffset + mx * 16 * 3),
-                          mloffset);
+                col221111(jpeg->out, row + mx * 16 * 3, mloffset);
                 break;
             case 16:
-                col221111_16(jpeg->out,
-                             pic + (my * 16 * mloffset + mx * 16 * 2),
-                             mloffset);
+                col221111_16(jpeg->out, row + mx * 16 * 2, mloffset);
                 break;
             default:
                 return ERR_DEPTH_MISMATCH;
                 break;
             }
         }
+        if (rowbuf)
+            iomemcpy(pic + my * 16 * mloffset, rowbuf, 16 * mloffset);
     }
 
     m = dec_readmarker(&jpeg->in);
@@ -465,12 +487,38 @@ int jpeg_show(struct jpeg_decdata *jpeg, unsigned char *pic, int width
     return 0;
 }
 
+// Decode the image into 'pic'.  If 'rowbuf' is given (room for 16
+// lines of 'bytes_per_line_dest') each row of MCUs is decoded there
+// and then copied to 'pic' - this avoids many small writes to io
+// memory when 'pic' is a framebuffer.
+int jpeg_show(struct jpeg_decdata *jpeg, unsigned char *pic, int width
+              , int height, int depth, int bytes_per_line_dest
+              , unsigned char *rowbuf)
+{
+    u32 cr0, cr4;
+    int ret;
+
+    if (jpeg->height != height)
+        return ERR_HEIGHT_MISMATCH;
+    if (jpeg->width != width)
+        return ERR_WIDTH_MISMATCH;
+
+    if (!jpeg_sse2_available())
+        return show_mcus(jpeg, pic, width, depth, bytes_per_line_dest
+                         , rowbuf, 0);
+    sse_enable(&cr0, &cr4);
+    ret = show_mcus(jpeg, pic, width, depth, bytes_per_line_dest
+                    , rowbuf, 1);
+    sse_restore(cr0, cr4);
+    return ret;
+}
+
 /****************************************************************/
 /**************       huffman decoder             ***************/
 /****************************************************************/
 
 static int fillbits __P((struct in *, int, unsigned int));
-static int dec_rec2 __P((struct in *, struct dec_hufftbl *, int *, int, int));
+static int dec_rec2 __P((struct in *, struct dec_hufftbl *, int *));
 
 static void setinput(struct in *in, unsigned char *p)
 {
@@ -535,40 +583,45 @@ static int dec_readmarker(struct in *in)
 )
 
 
-static int dec_rec2(struct in *in, struct dec_hufftbl *hu, int *runp,
-                    int c, int i)
+/* sign extend the s bit value c received after a huffman code */
+#define EXTEND(c, s) ((c) < (1 << ((s) - 1)) ? (c) + (-1 << (s)) + 1 : (c))
+
+/* slow path for codes longer than DECBITS bits */
+static int dec_rec2(struct in *in, struct dec_hufftbl *hu, int *runp)
 {
+    int i, c, p;
     LEBI_DCL;
 
     LEBI_GET(in);
-    if (i) {
-        UNGETBITS(in, i & 127);
-        *runp = i >> 8 & 15;
-        i >>= 16;
-    } else {
-        for (i = DECBITS;
-             (c = ((c << 1) | GETBITS(in, 1))) >= (hu->maxcode[i]); i++);
-        if (i >= 16) {
-            in->marker = M_BADHUFF;
-            return 0;
-        }
-        i = hu->vals[hu->valptr[i] + c - hu->maxcode[i - 1] * 2];
-        *runp = i >> 4;
-        i &= 15;
+    /* look at the next 16 bits at once instead of adding one at a time */
+    UNGETBITS(in, DECBITS);
+    p = GETBITS(in, 16);
+    for (i = DECBITS; i < 16 && (c = p >> (15 - i)) >= hu->maxcode[i]; i++)
+        ;
+    if (i >= 16) {
+        in->marker = M_BADHUFF;
+        return 0;
     }
+    UNGETBITS(in, 15 - i);
+    i = hu->vals[hu->valptr[i] + c - hu->maxcode[i - 1] * 2];
+    *runp = i >> 4;
+    i &= 15;
     if (i == 0) {                /* sigh, 0xf0 is 11 bit */
         LEBI_PUT(in);
         return 0;
     }
     /* receive part */
     c = GETBITS(in, i);
-    if (c < (1 << (i - 1)))
-        c += (-1 << i) + 1;
     LEBI_PUT(in);
-    return c;
+    return EXTEND(c, i);
 }
 
-#define DEC_REC(in, hu, r, i)         (  \
+/*
+ * The lookahead table decodes the code and, if it fits, the value.
+ * Codes of up to DECBITS bits whose value doesn't fit are decoded from
+ * the table too and only the value bits are read separately.
+ */
+#define DEC_REC(in, hu, r, i, c)      (  \
   r = GETBITS(in, DECBITS),              \
   i = hu->llvals[r],                     \
   i & 128 ?                              \
@@ -577,10 +630,18 @@ static int dec_rec2(struct in *in, struct dec_hufftbl *hu, int *runp,
       r = i >> 8 & 15,                   \
       i >> 16                            \
     )                                    \
+  : i ?                                  \
+    (                                    \
+      UNGETBITS(in, i & 127),            \
+      r = i >> 8 & 15,                   \
+      i >>= 16,                          \
+      c = GETBITS(in, i),                \
+      EXTEND(c, i)                       \
+    )                                    \
   :                                      \
     (                                    \
       LEBI_PUT(in),                      \
-      i = dec_rec2(in, hu, &r, r, i),    \
+      i = dec_rec2(in, hu, &r),          \
       LEBI_GET(in),                      \
       i                                  \
     )                                    \
@@ -590,19 +651,19 @@ static void decode_mcus(struct in *in, int *dct, int n, struct scan *sc,
                         int *maxp)
 {
     struct dec_hufftbl *hu;
-    int i, r, t;
+    int i, r, t, c;
     LEBI_DCL;
 
     memset(dct, 0, n * 64 * sizeof(*dct));
     LEBI_GET(in);
     while (n-- > 0) {
         hu = sc->hudc.dhuff;
-        *dct++ = (sc->dc += DEC_REC(in, hu, r, t));
+        *dct++ = (sc->dc += DEC_REC(in, hu, r, t, c));
 
         hu = sc->huac.dhuff;
         i = 63;
         while (i > 0) {
-            t = DEC_REC(in, hu, r, t);
+            t = DEC_REC(in, hu, r, t, c);
             if (t == 0 && r == 0) {
                 dct += i;
                 break;
@@ -1053,3 +1114,177 @@ static void col221111_32(int *out, unsigned char *pic, int width)
         outy += 64 * 2 - 16 * 4;
     }
 }
+
+/****************************************************************/
+/**************      sse2 idct and color          ***************/
+/****************************************************************/
+
+/*
+ * These produce exactly the same output as idct() and col221111_32()
+ * but work on four lanes at once.  The idct passes process four
+ * columns (or rows) in parallel using the IDCT macro above, with
+ * transposes between them, and the color conversion clamps using the
+ * saturating pack instructions.  scripts/bench-decode.c checks them
+ * against the scalar code.
+ */
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+
+#define JPEG_SSE2_TARGET __attribute__((target("sse2"))) noinline
+
+#define loadu(p) ({ v4si __v; __builtin_memcpy(&__v, (p), 16); __v; })
+#define storeu(p, v) ({ v4si __v = (v); __builtin_memcpy((p), &__v, 16); })
+#define psrldq(v, n)                                                    \
+    ((v4si)__builtin_ia32_psrldqi128((v2di)(v), (n) * 8))
+#define packssdw(a, b) __builtin_ia32_packssdw128((a), (b))
+#define packuswb(a, b) ((v4si)__builtin_ia32_packuswb128((a), (b)))
+#define punpcklbw(a, b)                                                 \
+    ((v4si)__builtin_ia32_punpcklbw128((v16qi)(a), (v16qi)(b)))
+#define punpcklwd(a, b)                                                 \
+    ((v4si)__builtin_ia32_punpcklwd128((v8hi)(a), (v8hi)(b)))
+
+#define TRANSPOSE4(a, b, c, d)                                          \
+    do {                                                                \
+        v4si __t0 = __builtin_shuffle((a), (b), (v4si){ 0, 4, 1, 5 });  \
+        v4si __t1 = __builtin_shuffle((a), (b), (v4si){ 2, 6, 3, 7 });  \
+        v4si __t2 = __builtin_shuffle((c), (d), (v4si){ 0, 4, 1, 5 });  \
+        v4si __t3 = __builtin_shuffle((c), (d), (v4si){ 2, 6, 3, 7 });  \
+        (a) = __builtin_shuffle(__t0, __t2, (v4si){ 0, 1, 4, 5 });      \
+        (b) = __builtin_shuffle(__t0, __t2, (v4si){ 2, 3, 6, 7 });      \
+        (c) = __builtin_shuffle(__t1, __t3, (v4si){ 0, 1, 4, 5 });      \
+        (d) = __builtin_shuffle(__t1, __t3, (v4si){ 2, 3, 6, 7 });      \
+    } while (0)
+
+/* position of each coefficient in the column pass input of idct_sse2 */
+static unsigned char zig2t[64] = {
+     0,  5,  8, 16, 13,  2,  7, 10,
+    21, 24, 32, 29, 18, 15,  1,  4,
+     9, 23, 26, 37, 40, 48, 45, 34,
+    31, 17, 12,  3,  6, 11, 20, 25,
+    39, 42, 53, 56, 61, 50, 47, 33,
+    28, 19, 14, 22, 27, 36, 41, 55,
+    58, 63, 49, 44, 35, 30, 38, 43,
+    52, 57, 60, 51, 46, 54, 59, 62
+};
+
+static JPEG_SSE2_TARGET void
+idct_sse2(int *in, int *out, PREC * quant, PREC off, int max)
+{
+    v4si t0, t1, t2, t3, t4, t5, t6, t7, t;
+    PREC deq[64], tmp[64];
+    int i, j;
+
+    /* dequantize with the column pass inputs for cols i..i+3 adjacent;
+     * coefficients past 'max' are zero */
+    memset(deq, 0, sizeof(deq));
+    if (max > 64)
+        max = 64;
+    for (j = 0; j < max; j++)
+        deq[zig2t[j]] = in[j] * quant[j];
+    deq[0] += off;
+    for (i = 0; i < 8; i += 4) {
+        t0 = loadu(&deq[0 * 8 + i]);
+        t5 = loadu(&deq[1 * 8 + i]);
+        t2 = loadu(&deq[2 * 8 + i]);
+        t7 = loadu(&deq[3 * 8 + i]);
+        t1 = loadu(&deq[4 * 8 + i]);
+        t4 = loadu(&deq[5 * 8 + i]);
+        t3 = loadu(&deq[6 * 8 + i]);
+        t6 = loadu(&deq[7 * 8 + i]);
+        IDCT;
+        storeu(&tmp[0 * 8 + i], t0);
+        storeu(&tmp[1 * 8 + i], t1);
+        storeu(&tmp[2 * 8 + i], t2);
+        storeu(&tmp[3 * 8 + i], t3);
+        storeu(&tmp[4 * 8 + i], t4);
+        storeu(&tmp[5 * 8 + i], t5);
+        storeu(&tmp[6 * 8 + i], t6);
+        storeu(&tmp[7 * 8 + i], t7);
+    }
+    /* row pass on rows i..i+3 */
+    for (i = 0; i < 64; i += 32) {
+        t0 = loadu(&tmp[i + 0 * 8]);
+        t1 = loadu(&tmp[i + 1 * 8]);
+        t2 = loadu(&tmp[i + 2 * 8]);
+        t3 = loadu(&tmp[i + 3 * 8]);
+        t4 = loadu(&tmp[i + 0 * 8 + 4]);
+        t5 = loadu(&tmp[i + 1 * 8 + 4]);
+        t6 = loadu(&tmp[i + 2 * 8 + 4]);
+        t7 = loadu(&tmp[i + 3 * 8 + 4]);
+        TRANSPOSE4(t0, t1, t2, t3);
+        TRANSPOSE4(t4, t5, t6, t7);
+        IDCT;
+        TRANSPOSE4(t0, t1, t2, t3);
+        TRANSPOSE4(t4, t5, t6, t7);
+        storeu(&out[i + 0 * 8], ITOINT(t0));
+        storeu(&out[i + 1 * 8], ITOINT(t1));
+        storeu(&out[i + 2 * 8], ITOINT(t2));
+        storeu(&out[i + 3 * 8], ITOINT(t3));
+        storeu(&out[i + 0 * 8 + 4], ITOINT(t4));
+        storeu(&out[i + 1 * 8 + 4], ITOINT(t5));
+        storeu(&out[i + 2 * 8 + 4], ITOINT(t6));
+        storeu(&out[i + 3 * 8 + 4], ITOINT(t7));
+    }
+}
+
+#ifdef ROUND
+#define CG4(cb, cr) ((50 * (cb) + 130 * (cr) + 128) >> 8)
+#else
+#define CG4(cb, cr) ((3 * (cb) + 8 * (cr)) >> 4)
+#endif
+
+/* four pixels of y with cb/cr/cg, as PIC_32 stores them */
+#define PIX4_32(p, y, cb, cr, cg)                               \
+    ({                                                          \
+        v8hi __rg = packssdw((y) + (cr), (y) - (cg));           \
+        v8hi __b = packssdw((y) + (cb), (v4si){});              \
+        v4si __v = packuswb(__rg, __b);                         \
+        v4si __rgi = punpcklbw(__v, psrldq(__v, 4));            \
+        v4si __bi = punpcklbw(psrldq(__v, 8), (v4si){});        \
+        storeu((p), punpcklwd(__rgi, __bi));                    \
+    })
+
+static JPEG_SSE2_TARGET void
+col221111_32_sse2(int *out, unsigned char *pic, int width)
+{
+    int i, j, k;
+    unsigned char *pic0, *pic1;
+    int *outy, *outc;
+    v4si cb, cr, cg, cbl, crl, cgl, cbh, crh, cgh;
+
+    pic0 = pic;
+    pic1 = pic + width;
+    outy = out;
+    outc = out + 64 * 4;
+    for (i = 2; i > 0; i--) {
+        for (j = 4; j > 0; j--) {
+            for (k = 0; k < 2; k++) {
+                cb = loadu(&outc[k * 4]);
+                cr = loadu(&outc[64 + k * 4]);
+                cg = CG4(cb, cr);
+                cbl = __builtin_shuffle(cb, (v4si){ 0, 0, 1, 1 });
+                crl = __builtin_shuffle(cr, (v4si){ 0, 0, 1, 1 });
+                cgl = __builtin_shuffle(cg, (v4si){ 0, 0, 1, 1 });
+                cbh = __builtin_shuffle(cb, (v4si){ 2, 2, 3, 3 });
+                crh = __builtin_shuffle(cr, (v4si){ 2, 2, 3, 3 });
+                cgh = __builtin_shuffle(cg, (v4si){ 2, 2, 3, 3 });
+                PIX4_32(pic0 + k * 32, loadu(&outy[k * 64])
+                        , cbl, crl, cgl);
+                PIX4_32(pic0 + k * 32 + 16, loadu(&outy[k * 64 + 4])
+                        , cbh, crh, cgh);
+                PIX4_32(pic1 + k * 32, loadu(&outy[k * 64 + 8])
+                        , cbl, crl, cgl);
+                PIX4_32(pic1 + k * 32 + 16, loadu(&outy[k * 64 + 12])
+                        , cbh, crh, cgh);
+            }
+            outc += 8;
+            outy += 16;
+            pic0 += 2 * width;
+            pic1 += 2 * width;
+        }
+        outy += 64 * 2 - 16 * 4;
+    }
+}
@@ -15,6 +15,13 @@
 #include "string.h" // memset
 #include "util.h" // kbd_init
 
+// Keys that did not fit in the 15 entry bda buffer.  The bda buffer
+// offsets are relative to segment 0x40 so the buffer itself can't be
+// moved to the ebda - instead keys wait here until there is room.
+#define KBD_EXTRA_SIZE (CONFIG_KBD_EXTRA_BUFFER ?: 1)
+u16 KbdExtraBuf[KBD_EXTRA_SIZE] VARLOW;
+u16 KbdExtraHead VARLOW, KbdExtraCount VARLOW;
+
 void
 kbd_init(void)
 {
@@ -27,10 +34,12 @@ kbd_init(void)
 
     SET_BDA(kbd_buf_end_offset
             , x + FIELD_SIZEOF(struct bios_data_area_s, kbd_buf));
+    SET_LOW(KbdExtraCount, 0);
 }
 
-u8
-enqueue_key(u16 keycode)
+// Add a key to the bda keyboard buffer.  Returns 0 if it is full.
+static u8
+bda_enqueue_key(u16 keycode)
 {
     u16 buffer_start = GET_BDA(kbd_buf_start_offset);
     u16 buffer_end   = GET_BDA(kbd_buf_end_offset);
@@ -51,6 +60,76 @@ enqueue_key(u16 keycode)
     return 1;
 }
 
+// Move keys from the extra buffer to the bda buffer while it has room.
+static void
+kbd_extra_refill(void)
+{
+    if (!CONFIG_KBD_EXTRA_BUFFER)
+        return;
+    u16 count = GET_LOW(KbdExtraCount);
+    if (!count)
+        return;
+    u16 head = GET_LOW(KbdExtraHead);
+    while (count && bda_enqueue_key(GET_LOW(KbdExtraBuf[head]))) {
+        if (++head >= KBD_EXTRA_SIZE)
+            head = 0;
+        count--;
+    }
+    SET_LOW(KbdExtraHead, head);
+    SET_LOW(KbdExtraCount, count);
+}
+
+u8
+enqueue_key(u16 keycode)
+{
+    if (!CONFIG_KBD_EXTRA_BUFFER)
+        return bda_enqueue_key(keycode);
+    // Keys only go to the bda buffer once the extra buffer is drained
+    // so that they stay in order.
+    kbd_extra_refill();
+    u16 count = GET_LOW(KbdExtraCount);
+    if (!count && bda_enqueue_key(keycode))
+        return 1;
+    if (count >= KBD_EXTRA_SIZE)
+        return 0;
+    u16 pos = GET_LOW(KbdExtraHead) + count;
+    if (pos >= KBD_EXTRA_SIZE)
+        pos -= KBD_EXTRA_SIZE;
+    SET_LOW(KbdExtraBuf[pos], keycode);
+    SET_LOW(KbdExtraCount, count + 1);
+    return 1;
+}
+
+// Number of keystroke checks without a keystroke in one timer tick
+// after which a caller is considered to be waiting for input.
+#define KBD_IDLE_POLLS 16
+
+u32 KbdPollTick VARLOW;
+u8 KbdPollCount VARLOW;
+
+// Note a keystroke check that found no keystroke.  Returns 1 if it
+// waited for an irq (and the keyboard buffer should be checked again).
+static int
+kbd_idle_poll(void)
+{
+    if (!CONFIG_KBD_IDLE_HALT || in_post())
+        return 0;
+    u32 tick = GET_BDA(timer_counter);
+    if (tick != GET_LOW(KbdPollTick)) {
+        SET_LOW(KbdPollTick, tick);
+        SET_LOW(KbdPollCount, 0);
+        return 0;
+    }
+    u8 count = GET_LOW(KbdPollCount);
+    if (count < KBD_IDLE_POLLS) {
+        SET_LOW(KbdPollCount, count + 1);
+        return 0;
+    }
+    // The caller is spinning - wait for the next timer or keyboard irq
+    yield_toirq();
+    return 1;
+}
+
 static void
 dequeue_key(struct bregs *regs, int incr, int extended)
 {
@@ -58,12 +137,15 @@ dequeue_key(struct bregs *regs, int incr, int extended)
     u16 buffer_head;
     u16 buffer_tail;
     for (;;) {
+        kbd_extra_refill();
         buffer_head = GET_BDA(kbd_buf_head);
         buffer_tail = GET_BDA(kbd_buf_tail);
 
         if (buffer_head != buffer_tail)
             break;
         if (!incr) {
+            if (kbd_idle_poll())
+                continue;
             regs->flags |= F_ZF;
             return;
         }
@@ -102,6 +184,7 @@ dequeue_key(struct bregs *regs, int incr, int extended)
     if (buffer_head >= buffer_end)
         buffer_head = buffer_start;
     SET_BDA(kbd_buf_head, buffer_head);
+    kbd_extra_refill();
 }
 
 static int
@@ -7,10 +7,12 @@
 #include "biosvar.h" // GET_BDA
 #include "config.h" // BUILD_BIOS_ADDR
 #include "e820map.h" // struct e820entry
+#include "fw/paravirt.h" // qemu_cfg_write_file
 #include "list.h" // hlist_node
 #include "malloc.h" // _malloc
 #include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_find
 #include "stacks.h" // wait_preempt
 #include "std/optionrom.h" // OPTION_ROM_ALIGN
 #include "string.h" // memset
@@ -26,6 +28,10 @@ struct allocdetail_s {
     struct allocinfo_s detailinfo;
     struct allocinfo_s datainfo;
     u32 handle;
+    u8 zone;                        // Index in Zones[] (for MALLOC_STATS)
+    u8 slab;                        // Block holds a slab_s cache
+    struct hlist_node datanode;     // In AllocHash (if alloc_size != 0)
+    struct hlist_node handlenode;   // In HandleHash (if handle is set)
 };
 
 // The various memory zones.
@@ -41,6 +47,18 @@ static struct zone_s *Zones[] VARVERIFY32INIT = {
     &ZoneTmpLow, &ZoneLow, &ZoneFSeg, &ZoneTmpHigh, &ZoneHigh
 };
 
+// Tracked allocations hashed by address and by PMM handle, so that
+// frees and handle lookups don't have to walk every zone.
+#define ALLOC_HASH_BITS 6
+static struct hlist_head AllocHash[1 << ALLOC_HASH_BITS] VARVERIFY32INIT;
+static struct hlist_head HandleHash[1 << ALLOC_HASH_BITS] VARVERIFY32INIT;
+
+static struct hlist_head *
+alloc_hash(struct hlist_head *table, u32 key)
+{
+    return &table[(key * 0x9e3779b1) >> (32 - ALLOC_HASH_BITS)];
+}
+
 
 /****************************************************************
  * low-level memory reservations
@@ -129,17 +147,14 @@ alloc_free(struct allocinfo_s *info)
     hlist_del(&info->node);
 }
 
-// Search all zones for an allocation obtained from alloc_new()
-static struct allocinfo_s *
-alloc_find(u32 data)
+// Find the tracking information of an allocation from malloc_palloc()
+static struct allocdetail_s *
+alloc_find_detail(u32 data)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->range_start == data)
-                return info;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, alloc_hash(AllocHash, data), datanode) {
+        if (detail->datainfo.range_start == data)
+            return detail;
     }
     return NULL;
 }
@@ -227,6 +242,286 @@ zonelow_expand(u32 size, u32 align, struct allocinfo_s *fill)
 }
 
 
+/****************************************************************
+ * allocation statistics
+ ****************************************************************/
+
+#define MSTATS_MAGIC 0x5453414d // "MAST"
+#define MSTATS_VERSION 1
+#define MSTATS_CALLERS 64
+#define MSTATS_BUCKETS 8        // Free ranges <64, <256, ... <256K, larger
+
+// Binary layout of the statistics - the host reads this from the
+// "etc/malloc-stats" fw_cfg file.  Zones are in the order of Zones[].
+struct mstats_zone_s {
+    u32 allocs, frees, failures;
+    u32 inuse, peak;            // Bytes reserved by allocations
+    u32 free_total, free_largest;
+    u32 free_ranges[MSTATS_BUCKETS];
+} PACKED;
+
+struct mstats_caller_s {
+    u32 caller;                 // Zero for callers that didn't fit
+    u8 zone;
+    u8 reserved[3];
+    u32 count, bytes, failures;
+} PACKED;
+
+struct mstats_s {
+    u32 magic;
+    u16 version;
+    u8 zone_count, caller_count;
+    struct mstats_zone_s zones[ARRAY_SIZE(Zones)];
+    struct mstats_caller_s callers[MSTATS_CALLERS];
+} PACKED;
+
+static struct mstats_s MallocStats VARVERIFY32INIT;
+
+static const char *ZoneNames[] VARVERIFY32INIT = {
+    "TmpLow", "Low", "FSeg", "TmpHigh", "High"
+};
+
+static int
+zone_index(struct zone_s *zone)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++)
+        if (Zones[i] == zone)
+            return i;
+    return 0;
+}
+
+// Note a block reservation (or failure if 'size' is zero)
+static void
+mstats_alloc(struct zone_s *zone, u32 size)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    struct mstats_zone_s *zs = &MallocStats.zones[zone_index(zone)];
+    if (!size) {
+        zs->failures++;
+        return;
+    }
+    zs->allocs++;
+    zs->inuse += size;
+    if (zs->inuse > zs->peak)
+        zs->peak = zs->inuse;
+}
+
+// Note the release of a block reservation
+static void
+mstats_free(struct allocdetail_s *detail)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    struct mstats_zone_s *zs = &MallocStats.zones[detail->zone];
+    zs->frees++;
+    zs->inuse -= detail->datainfo.alloc_size;
+}
+
+// Note a malloc_*() request on behalf of 'caller'
+static void
+mstats_caller(struct zone_s *zone, u32 size, void *caller, int failed)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    int zi = zone_index(zone), i;
+    struct mstats_caller_s *cs = NULL;
+    for (i=0; i<MSTATS_CALLERS-1; i++) {
+        cs = &MallocStats.callers[i];
+        if (!cs->caller || (cs->caller == (u32)caller && cs->zone == zi))
+            break;
+    }
+    if (i == MSTATS_CALLERS-1)
+        // Table full - account in the last (catch-all) slot
+        cs = &MallocStats.callers[i];
+    else
+        cs->caller = (u32)caller;
+    cs->zone = zi;
+    cs->count++;
+    cs->bytes += size;
+    cs->failures += failed;
+}
+
+// Report allocator statistics on the debug console and hand them to the host.
+static void
+mstats_export(void)
+{
+    if (!CONFIG_MALLOC_STATS)
+        return;
+    MallocStats.magic = MSTATS_MAGIC;
+    MallocStats.version = MSTATS_VERSION;
+    MallocStats.zone_count = ARRAY_SIZE(Zones);
+    MallocStats.caller_count = MSTATS_CALLERS;
+
+    dprintf(1, "Allocator statistics:\n");
+    int i, j;
+    for (i=0; i<ARRAY_SIZE(Zones); i++) {
+        struct mstats_zone_s *zs = &MallocStats.zones[i];
+        struct allocinfo_s *info;
+        hlist_for_each_entry(info, &Zones[i]->head, node) {
+            u32 space = info->range_end - info->range_start - info->alloc_size;
+            if (!space)
+                continue;
+            zs->free_total += space;
+            if (space > zs->free_largest)
+                zs->free_largest = space;
+            for (j=0; j<MSTATS_BUCKETS-1; j++)
+                if (space < (64 << (2*j)))
+                    break;
+            zs->free_ranges[j]++;
+        }
+        dprintf(1, "  %s: allocs=%d frees=%d failures=%d inuse=%d peak=%d"
+                " free=%d largest=%d\n", ZoneNames[i], zs->allocs, zs->frees
+                , zs->failures, zs->inuse, zs->peak, zs->free_total
+                , zs->free_largest);
+        dprintf(1, "    free ranges: <64:%d <256:%d <1K:%d <4K:%d <16K:%d"
+                " <64K:%d <256K:%d more:%d\n"
+                , zs->free_ranges[0], zs->free_ranges[1], zs->free_ranges[2]
+                , zs->free_ranges[3], zs->free_ranges[4], zs->free_ranges[5]
+                , zs->free_ranges[6], zs->free_ranges[7]);
+    }
+    for (i=0; i<MSTATS_CALLERS; i++) {
+        struct mstats_caller_s *cs = &MallocStats.callers[i];
+        if (!cs->count)
+            continue;
+        dprintf(1, "  caller %08x %s: count=%d bytes=%d failures=%d\n"
+                , cs->caller, ZoneNames[cs->zone], cs->count, cs->bytes
+                , cs->failures);
+    }
+
+    struct romfile_s *file = romfile_find("etc/malloc-stats");
+    if (!file)
+        return;
+    u32 size = sizeof(MallocStats);
+    if (size > file->size)
+        size = file->size;
+    qemu_cfg_write_file(&MallocStats, file, 0, size);
+}
+
+
+/****************************************************************
+ * small object caches
+ ****************************************************************/
+
+// Small allocations from ZoneHigh and ZoneTmpHigh are carved out of
+// SLAB_SIZE blocks that each hold objects of a single power-of-two
+// size.  This avoids a walk of the zone list and an allocdetail_s
+// record for every object.
+#define SLAB_SIZE 2048
+#define SLAB_MIN_OBJ 16
+#define SLAB_CLASSES 5          // 16, 32, 64, 128, and 256 byte objects
+#define SLAB_MAX_OBJ (SLAB_MIN_OBJ << (SLAB_CLASSES-1))
+
+// Header at the start of each slab block.
+struct slab_s {
+    struct hlist_node node;
+    void *freelist;
+    u16 inuse;
+    u16 unused;                 // Offset of first never allocated object
+    u8 cls, tmp;
+};
+
+// Slabs with free objects, for each size class.
+static struct hlist_head SlabHigh[SLAB_CLASSES] VARVERIFY32INIT;
+static struct hlist_head SlabTmpHigh[SLAB_CLASSES] VARVERIFY32INIT;
+
+static struct hlist_head *
+slab_caches(struct zone_s *zone)
+{
+    if (zone == &ZoneHigh)
+        return SlabHigh;
+    if (zone == &ZoneTmpHigh)
+        return SlabTmpHigh;
+    return NULL;
+}
+
+static int
+slab_full(struct slab_s *slab, u32 objsize)
+{
+    return !slab->freelist && slab->unused + objsize > SLAB_SIZE;
+}
+
+// Allocate an object from a slab cache (or return NULL)
+static void *
+slab_alloc(struct zone_s *zone, u32 size, u32 align)
+{
+    struct hlist_head *caches = slab_caches(zone);
+    if (!caches || size > SLAB_MAX_OBJ || align > SLAB_MAX_OBJ)
+        return NULL;
+    int cls = 0;
+    while ((SLAB_MIN_OBJ << cls) < size || (SLAB_MIN_OBJ << cls) < align)
+        cls++;
+    u32 objsize = SLAB_MIN_OBJ << cls;
+    struct hlist_head *cache = &caches[cls];
+
+    struct slab_s *slab = container_of_or_null(
+        cache->first, struct slab_s, node);
+    if (!slab) {
+        // Start a new slab
+        u32 base = malloc_palloc(zone, SLAB_SIZE, SLAB_SIZE);
+        if (!base)
+            return NULL;
+        alloc_find_detail(base)->slab = 1;
+        slab = memremap(base, SLAB_SIZE);
+        slab->freelist = NULL;
+        slab->inuse = 0;
+        slab->unused = ALIGN(sizeof(*slab), objsize);
+        slab->cls = cls;
+        slab->tmp = zone == &ZoneTmpHigh;
+        hlist_add_head(&slab->node, cache);
+    }
+
+    void *data = slab->freelist;
+    if (data) {
+        slab->freelist = *(void**)data;
+    } else {
+        data = (void*)slab + slab->unused;
+        slab->unused += objsize;
+    }
+    slab->inuse++;
+    if (slab_full(slab, objsize))
+        hlist_del(&slab->node);
+    dprintf(9, "slab_alloc zone=%p size=%d ret=%p\n", zone, size, data);
+    return data;
+}
+
+// Release an object obtained from slab_alloc()
+static int
+slab_free(void *data)
+{
+    u32 offset = (u32)data & (SLAB_SIZE-1);
+    if (!offset)
+        // Slab objects are never at the start of a slab block
+        return -1;
+    // Only look at the header of a block known to be a slab
+    struct slab_s *slab = data - offset;
+    struct allocdetail_s *detail = alloc_find_detail(virt_to_phys(slab));
+    if (!detail || !detail->slab)
+        return -1;
+    u32 objsize = SLAB_MIN_OBJ << slab->cls;
+    if (offset & (objsize-1) || offset >= slab->unused
+        || offset < ALIGN(sizeof(*slab), objsize))
+        return -1;
+    dprintf(9, "slab_free %p\n", data);
+
+    struct hlist_head *cache = &(slab->tmp ? SlabTmpHigh : SlabHigh)[slab->cls];
+    if (slab_full(slab, objsize))
+        hlist_add_head(&slab->node, cache);
+    *(void**)data = slab->freelist;
+    slab->freelist = data;
+    if (--slab->inuse)
+        return 0;
+
+    // Keep one empty temporary slab per class to avoid thrashing; all
+    // empty ZoneHigh slabs are released so that ZoneHigh can be returned.
+    if (slab->tmp && cache->first == &slab->node && !slab->node.next)
+        return 0;
+    hlist_del(&slab->node);
+    return malloc_pfree(virt_to_phys(slab));
+}
+
+
 /****************************************************************
  * tracked memory allocations
  ****************************************************************/
@@ -242,18 +537,25 @@ malloc_palloc(struct zone_s *zone, u32 size, u32 align)
     // Find and reserve space for main allocation
     struct allocdetail_s tempdetail;
     tempdetail.handle = MALLOC_DEFAULT_HANDLE;
+    tempdetail.zone = CONFIG_MALLOC_STATS ? zone_index(zone) : 0;
+    tempdetail.slab = 0;
     u32 data = alloc_new(zone, size, align, &tempdetail.datainfo);
     if (!CONFIG_MALLOC_UPPERMEMORY && !data && zone == &ZoneLow)
         data = zonelow_expand(size, align, &tempdetail.datainfo);
-    if (!data)
+    if (!data) {
+        mstats_alloc(zone, 0);
         return 0;
+    }
 
     // Find and reserve space for bookkeeping.
     struct allocdetail_s *detail = alloc_new_detail(&tempdetail);
     if (!detail) {
         alloc_free(&tempdetail.datainfo);
+        mstats_alloc(zone, 0);
         return 0;
     }
+    mstats_alloc(zone, size);
+    hlist_add_head(&detail->datanode, alloc_hash(AllocHash, data));
 
     dprintf(8, "phys_alloc zone=%p size=%d align=%x ret=%x (detail=%p)\n"
             , zone, size, align, data, detail);
@@ -265,7 +567,13 @@ malloc_palloc(struct zone_s *zone, u32 size, u32 align)
 void * __malloc
 _malloc(struct zone_s *zone, u32 size, u32 align)
 {
-    return memremap(malloc_palloc(zone, size, align), size);
+    void *data = NULL;
+    if (size && size <= SLAB_MAX_OBJ)
+        data = slab_alloc(zone, size, align);
+    if (!data)
+        data = memremap(malloc_palloc(zone, size, align), size);
+    mstats_caller(zone, size, __builtin_return_address(0), !data);
+    return data;
 }
 
 // Free a data block allocated with phys_alloc
@@ -273,13 +581,15 @@ int
 malloc_pfree(u32 data)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = alloc_find(data);
-    if (!info || data == virt_to_phys(info) || !info->alloc_size)
+    struct allocdetail_s *detail = alloc_find_detail(data);
+    if (!detail)
         return -1;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
     dprintf(8, "phys_free %x (detail=%p)\n", data, detail);
-    alloc_free(info);
+    hlist_del(&detail->datanode);
+    if (detail->handle != MALLOC_DEFAULT_HANDLE)
+        hlist_del(&detail->handlenode);
+    mstats_free(detail);
+    alloc_free(&detail->datainfo);
     alloc_free(&detail->detailinfo);
     return 0;
 }
@@ -289,6 +599,8 @@ free(void *data)
 {
     if (!data)
         return;
+    if (!slab_free(data))
+        return;
     int ret = malloc_pfree(virt_to_phys(data));
     if (ret)
         warn_internalerror();
@@ -317,34 +629,59 @@ malloc_getspace(struct zone_s *zone)
     return maxspace - reserve;
 }
 
+// Allocate a large block of memory that is to be kept for the
+// operating system.  Once the block holds its data, pass it to
+// malloc_persist() (or free() it on failure).
+void *
+memalign_persistent(u32 align, u32 size)
+{
+    ASSERT32FLAT();
+    if (CONFIG_MALLOC_HUGEPAGE_LAYOUT) {
+        void *data = _malloc(&ZoneHigh, size, align);
+        if (data)
+            return data;
+        dprintf(1, "ZoneHigh full - reserving %d bytes separately\n", size);
+    }
+    return _malloc(&ZoneTmpHigh, size, align);
+}
+
+// Keep a block from memalign_persistent() for the operating system.
+void
+malloc_persist(void *data, u32 size)
+{
+    ASSERT32FLAT();
+    // ZoneHigh is reserved as a whole by malloc_prepboot()
+    struct allocinfo_s *info;
+    hlist_for_each_entry(info, &ZoneHigh.head, node) {
+        if (info->range_start == (u32)data)
+            return;
+    }
+    e820_add((u32)data, size, E820_RESERVED);
+}
+
 // Set a handle associated with an allocation.
 void
 malloc_sethandle(u32 data, u32 handle)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = alloc_find(data);
-    if (!info || data == virt_to_phys(info) || !info->alloc_size)
+    struct allocdetail_s *detail = alloc_find_detail(data);
+    if (!detail)
         return;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
+    if (detail->handle != MALLOC_DEFAULT_HANDLE)
+        hlist_del(&detail->handlenode);
     detail->handle = handle;
+    if (handle != MALLOC_DEFAULT_HANDLE)
+        hlist_add_head(&detail->handlenode, alloc_hash(HandleHash, handle));
 }
 
 // Find the data block allocated with phys_alloc with a given handle.
 u32
 malloc_findhandle(u32 handle)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->range_start != virt_to_phys(info))
-                continue;
-            struct allocdetail_s *detail = container_of(
-                info, struct allocdetail_s, detailinfo);
-            if (detail->handle == handle)
-                return detail->datainfo.range_start;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, alloc_hash(HandleHash, handle), handlenode) {
+        if (detail->handle == handle)
+            return detail->datainfo.range_start;
     }
     return 0;
 }
@@ -425,8 +762,8 @@ malloc_preinit(void)
     u32 highram_start = 0;
     u32 highram_size = 0;
     int i;
-    for (i=e820_count-1; i>=0; i--) {
-        struct e820entry *en = &e820_list[i];
+    for (i=e820_map_count-1; i>=0; i--) {
+        struct e820entry *en = &e820_map[i];
         u64 end = en->start + en->size;
         if (end < 1024*1024)
             break;
@@ -478,8 +815,8 @@ calcRamSize(void)
 {
     u32 rs = 0;
     int i;
-    for (i=e820_count-1; i>=0; i--) {
-        struct e820entry *en = &e820_list[i];
+    for (i=e820_map_count-1; i>=0; i--) {
+        struct e820entry *en = &e820_map[i];
         u64 end = en->start + en->size;
         u32 type = en->type;
         if (end <= 0xffffffff && (type == E820_ACPI || type == E820_RAM)) {
@@ -505,6 +842,18 @@ malloc_init(void)
             if (zone->head.first)
                 zone->head.first->pprev = &zone->head.first;
         }
+        for (i=0; i<ARRAY_SIZE(AllocHash); i++) {
+            if (AllocHash[i].first)
+                AllocHash[i].first->pprev = &AllocHash[i].first;
+            if (HandleHash[i].first)
+                HandleHash[i].first->pprev = &HandleHash[i].first;
+        }
+        for (i=0; i<SLAB_CLASSES; i++) {
+            if (SlabHigh[i].first)
+                SlabHigh[i].first->pprev = &SlabHigh[i].first;
+            if (SlabTmpHigh[i].first)
+                SlabTmpHigh[i].first->pprev = &SlabTmpHigh[i].first;
+        }
     }
 
     // Initialize low-memory region
@@ -533,6 +882,8 @@ malloc_prepboot(void)
     ASSERT32FLAT();
     dprintf(3, "malloc finalize\n");
 
+    mstats_export();
+
     u32 base = rom_get_max();
     memset((void*)RomEnd, 0, base-RomEnd);
     if (CONFIG_MALLOC_UPPERMEMORY) {
@@ -558,7 +909,13 @@ malloc_prepboot(void)
     info = alloc_find_lowest(&ZoneHigh);
     if (info) {
         u32 giveback = ALIGN_DOWN(info->range_end-info->range_start, PAGE_SIZE);
-        e820_add(info->range_start, giveback, E820_RAM);
+        if (CONFIG_MALLOC_HUGEPAGE_LAYOUT) {
+            // Start the reserved range on a huge page boundary
+            u32 end = ALIGN_DOWN(info->range_end, HUGEPAGE_SIZE);
+            giveback = end > info->range_start ? end - info->range_start : 0;
+        }
+        if (giveback)
+            e820_add(info->range_start, giveback, E820_RAM);
         dprintf(1, "Returned %d bytes of ZoneHigh\n", giveback);
     }
 
@@ -17,6 +17,8 @@ void malloc_init(void);
 void malloc_prepboot(void);
 u32 malloc_palloc(struct zone_s *zone, u32 size, u32 align);
 void *_malloc(struct zone_s *zone, u32 size, u32 align);
+void *memalign_persistent(u32 align, u32 size);
+void malloc_persist(void *data, u32 size);
 int malloc_pfree(u32 data);
 void free(void *data);
 u32 malloc_getspace(struct zone_s *zone);
@@ -5,6 +5,7 @@
 
 // A typical OS page size
 #define PAGE_SIZE 4096
+#define HUGEPAGE_SIZE (2*1024*1024)
 #define PAGE_SHIFT 12
 
 static inline u32 virt_to_phys(void *v) {
@@ -7,7 +7,9 @@
 
 #include "bregs.h" // struct bregs
 #include "config.h" // CONFIG_*
+#include "e820map.h" // e820_update
 #include "farptr.h" // FLATPTR_TO_SEG
+#include "fw/paravirt.h" // qemu_cfg_write_file
 #include "biosvar.h" // GET_IVT
 #include "hw/pci.h" // pci_config_readl
 #include "hw/pcidevice.h" // foreachpci
@@ -16,11 +18,13 @@
 #include "malloc.h" // rom_confirm
 #include "output.h" // dprintf
 #include "romfile.h" // romfile_loadint
+#include "sha.h" // sha1_update_copy
 #include "stacks.h" // farcall16big
 #include "std/optionrom.h" // struct rom_header
 #include "std/pnpbios.h" // PNP_SIGNATURE
 #include "string.h" // memset
 #include "util.h" // get_pnp_offset
+#include "std/tcg.h" // SHA1_BUFSIZE
 #include "tcgbios.h" // tpm_*
 
 static int EnforceChecksum, S3ResumeVga, RunPCIroms;
@@ -46,6 +50,8 @@ __callrom(struct rom_header *rom, u16 offset, u16 bdf)
     br.es = SEG_BIOS;
     br.di = get_pnp_offset();
     br.code = SEGOFF(seg, offset);
+    // Let the rom see the current memory map via int 15 e820
+    e820_update();
     start_preempt();
     farcall16big(&br);
     finish_preempt();
@@ -121,9 +127,10 @@ get_pci_rom(struct rom_header *rom)
     return pd;
 }
 
-// Run rom init code and note rom size.
+// Run rom init code and note rom size.  The tpm measurement uses
+// 'digest' if the caller already hashed the rom.
 static int
-init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
+init_optionrom(struct rom_header *rom, u16 bdf, int isvga, const u8 *digest)
 {
     if (! is_valid_rom(rom))
         return -1;
@@ -135,7 +142,10 @@ init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
     if (newrom != rom)
         memmove(newrom, rom, rom->size * 512);
 
-    tpm_option_rom(newrom, rom->size * 512);
+    if (digest)
+        tpm_option_rom_digest(digest);
+    else
+        tpm_option_rom(newrom, rom->size * 512);
 
     if (isvga || get_pnp_rom(newrom))
         // Only init vga and PnP roms here.
@@ -154,9 +164,8 @@ setRomSource(u64 *sources, struct rom_header *rom, u64 source)
 }
 
 static int
-getRomPriority(u64 *sources, struct rom_header *rom, int instance)
+getSourcePriority(u64 source, int instance)
 {
-    u64 source = sources[((u32)rom - BUILD_ROM_START) / OPTION_ROM_ALIGN];
     if (!source)
         return -1;
     if (source & RS_PCIROM)
@@ -165,6 +174,40 @@ getRomPriority(u64 *sources, struct rom_header *rom, int instance)
     return bootprio_find_named_rom(file->name, instance);
 }
 
+static u64
+getRomSource(u64 *sources, struct rom_header *rom)
+{
+    return sources[((u32)rom - BUILD_ROM_START) / OPTION_ROM_ALIGN];
+}
+
+// Add the BEV/BCV vectors of a deployed rom to the boot list.  Returns
+// the number of PnP vectors found.
+static int
+add_rom_vectors(struct rom_header *rom, u64 source)
+{
+    struct pnp_data *pnp = get_pnp_rom(rom);
+    if (! pnp) {
+        // Legacy rom.
+        boot_add_bcv(FLATPTR_TO_SEG(rom), OPTION_ROM_INITVECTOR, 0
+                     , getSourcePriority(source, 0));
+        return 0;
+    }
+    // PnP rom - check for BEV and BCV boot capabilities.
+    int instance = 0;
+    while (pnp) {
+        if (pnp->bev)
+            boot_add_bev(FLATPTR_TO_SEG(rom), pnp->bev, pnp->productname
+                         , getSourcePriority(source, instance++));
+        else if (pnp->bcv)
+            boot_add_bcv(FLATPTR_TO_SEG(rom), pnp->bcv, pnp->productname
+                         , getSourcePriority(source, instance++));
+        else
+            break;
+        pnp = get_pnp_next(rom, pnp);
+    }
+    return instance;
+}
+
 
 /****************************************************************
  * Roms in CBFS
@@ -197,7 +240,7 @@ run_file_roms(const char *prefix, int isvga, u64 *sources)
         struct rom_header *rom = deploy_romfile(file);
         if (rom) {
             setRomSource(sources, rom, (u32)file);
-            init_optionrom(rom, 0, isvga);
+            init_optionrom(rom, 0, isvga, NULL);
         }
     }
 }
@@ -225,9 +268,11 @@ is_pci_vga(struct pci_device *pci)
     return 1;
 }
 
-// Copy a rom to its permanent location below 1MiB
+// Copy a rom to its permanent location below 1MiB.  If 'digest' is
+// given, the rom is hashed for the tpm in the same pass and 'hashed'
+// notes if that was needed.
 static struct rom_header *
-copy_rom(struct rom_header *rom)
+copy_rom(struct rom_header *rom, u8 *digest, int *hashed)
 {
     u32 romsize = rom->size * 512;
     struct rom_header *newrom = rom_reserve(romsize);
@@ -237,13 +282,18 @@ copy_rom(struct rom_header *rom)
     }
     dprintf(4, "Copying option rom (size %d) from %p to %p\n"
             , romsize, rom, newrom);
-    iomemcpy(newrom, rom, romsize);
+    if (digest)
+        *hashed = tpm_option_rom_copy(newrom, rom, romsize, digest);
+    else
+        iomemcpy(newrom, rom, romsize);
     return newrom;
 }
 
-// Map the option rom of a given PCI device.
+// Enable the rom bar of a given PCI device and find its x86 image.
+// On success the bar is left enabled and its original value is
+// stored in 'porig'.
 static struct rom_header *
-map_pcirom(struct pci_device *pci)
+find_pcirom(struct pci_device *pci, u32 *porig)
 {
     dprintf(6, "Attempting to map option rom on dev %pP\n", pci);
 
@@ -300,8 +350,7 @@ map_pcirom(struct pci_device *pci)
         rom = (void*)((u32)rom + pd->ilen * 512);
     }
 
-    rom = copy_rom(rom);
-    pci_config_writel(bdf, PCI_ROM_ADDRESS, orig);
+    *porig = orig;
     return rom;
 fail:
     // Not valid - restore original and exit.
@@ -309,6 +358,19 @@ fail:
     return NULL;
 }
 
+// Map the option rom of a given PCI device.
+static struct rom_header *
+map_pcirom(struct pci_device *pci, u8 *digest, int *hashed)
+{
+    u32 orig;
+    struct rom_header *rom = find_pcirom(pci, &orig);
+    if (!rom)
+        return NULL;
+    rom = copy_rom(rom, digest, hashed);
+    pci_config_writel(pci->bdf, PCI_ROM_ADDRESS, orig);
+    return rom;
+}
+
 static int boot_irq_captured(void)
 {
     return GET_IVT(0x19).segoff != FUNC16(entry_19_official).segoff;
@@ -322,6 +384,38 @@ static void boot_irq_restore(void)
     SET_IVT(0x19, seabios);
 }
 
+// Find the rom file overriding the option rom of a given PCI device.
+static struct romfile_s *
+find_pcirom_file(struct pci_device *pci)
+{
+    char fname[17];
+    snprintf(fname, sizeof(fname), "pci%04x,%04x.rom"
+             , pci->vendor, pci->device);
+    return romfile_find(fname);
+}
+
+// Initialize a deployed option rom of a given PCI device.  Returns
+// non-zero if the rom had to be stopped from capturing the boot irqs.
+static int
+run_pcirom(struct pci_device *pci, struct rom_header *rom, int isfile
+           , int isvga, u64 *sources, const u8 *digest)
+{
+    int irq_was_captured = boot_irq_captured();
+    struct pnp_data *pnp = get_pnp_rom(rom);
+    setRomSource(sources, rom, RS_PCIROM | (u32)pci);
+    init_optionrom(rom, pci->bdf, isvga, digest);
+    if (boot_irq_captured() && !irq_was_captured &&
+        !isfile && !isvga && pnp) {
+        // This PCI rom is misbehaving - recapture the boot irqs
+        char *desc = MAKE_FLATPTR(FLATPTR_TO_SEG(rom), pnp->productname);
+        dprintf(1, "PnP optionrom \"%s\" (bdf %pP) captured int19, restoring\n",
+                desc, pci);
+        boot_irq_restore();
+        return 1;
+    }
+    return 0;
+}
+
 // Attempt to map and initialize the option rom on a given PCI device.
 static void
 init_pcirom(struct pci_device *pci, int isvga, u64 *sources)
@@ -329,30 +423,249 @@ init_pcirom(struct pci_device *pci, int isvga, u64 *sources)
     dprintf(4, "Attempting to init PCI bdf %pP (vd %04x:%04x)\n"
             , pci, pci->vendor, pci->device);
 
-    char fname[17];
-    snprintf(fname, sizeof(fname), "pci%04x,%04x.rom"
-             , pci->vendor, pci->device);
-    struct romfile_s *file = romfile_find(fname);
+    struct romfile_s *file = find_pcirom_file(pci);
     struct rom_header *rom = NULL;
+    u8 digest[SHA1_BUFSIZE];
+    int hashed = 0;
     if (file)
         rom = deploy_romfile(file);
     else if (RunPCIroms > 1 || (RunPCIroms == 1 && isvga))
-        rom = map_pcirom(pci);
+        rom = map_pcirom(pci, digest, &hashed);
     if (! rom)
         // No ROM present.
         return;
-    int irq_was_captured = boot_irq_captured();
-    struct pnp_data *pnp = get_pnp_rom(rom);
-    setRomSource(sources, rom, RS_PCIROM | (u32)pci);
-    init_optionrom(rom, pci->bdf, isvga);
-    if (boot_irq_captured() && !irq_was_captured &&
-        !file && !isvga && pnp) {
-        // This PCI rom is misbehaving - recapture the boot irqs
-        char *desc = MAKE_FLATPTR(FLATPTR_TO_SEG(rom), pnp->productname);
-        dprintf(1, "PnP optionrom \"%s\" (bdf %pP) captured int19, restoring\n",
-                desc, pci);
-        boot_irq_restore();
+    run_pcirom(pci, rom, !!file, isvga, sources, hashed ? digest : NULL);
+}
+
+
+/****************************************************************
+ * PCI rom fetch-ahead
+ ****************************************************************/
+
+// While one option rom runs, the image of the next one is copied out
+// of its (slow) rom bar into a staging buffer, and hashed for the tpm,
+// by a thread.  The staged image is deployed in device order, so rom
+// addresses don't depend on thread timing.  Config space is only
+// touched from the main thread, as a preempted thread could otherwise
+// interleave its accesses with those of a running option rom.
+
+#define ROM_FETCH_CHUNK 4096
+
+struct rom_fetch_s {
+    struct pci_device *pci;
+    struct romfile_s *file;
+    struct rom_header *rom;     // Image in the enabled rom bar
+    u32 orig;                   // Original rom bar value
+    void *buf;                  // Staging copy in ZoneTmpHigh
+    u32 size;
+    int done, hashed;
+    u8 digest[SHA1_BUFSIZE];
+    struct hlist_node node;     // Skipped roms (see romcache_lazy)
+};
+
+static struct romfile_s *RomCacheFile VARVERIFY32INIT;
+
+static void
+fetch_pcirom_thread(void *data)
+{
+    struct rom_fetch_s *f = data;
+    // Hash each chunk as it is copied instead of rereading the image
+    struct sha_ctx ctx;
+    f->hashed = tpm_option_rom_needed();
+    int hash = CONFIG_TCGBIOS && (f->hashed || RomCacheFile);
+    if (hash)
+        sha1_init(&ctx);
+    u32 pos;
+    for (pos = 0; pos < f->size; pos += ROM_FETCH_CHUNK) {
+        u32 len = f->size - pos;
+        if (len > ROM_FETCH_CHUNK)
+            len = ROM_FETCH_CHUNK;
+        if (hash)
+            sha1_update_copy(&ctx, f->buf + pos, (void*)f->rom + pos, len);
+        else
+            iomemcpy(f->buf + pos, (void*)f->rom + pos, len);
+        yield();
+    }
+    if (hash)
+        sha1_final(&ctx, f->digest);
+    f->done = 1;
+}
+
+// Locate the option rom of a PCI device and start fetching it.
+static struct rom_fetch_s *
+fetch_pcirom(struct pci_device *pci)
+{
+    dprintf(4, "Attempting to init PCI bdf %pP (vd %04x:%04x)\n"
+            , pci, pci->vendor, pci->device);
+    struct rom_fetch_s *f = malloc_tmp(sizeof(*f));
+    if (!f) {
+        warn_noalloc();
+        return NULL;
+    }
+    memset(f, 0, sizeof(*f));
+    f->pci = pci;
+    f->file = find_pcirom_file(pci);
+    if (f->file || RunPCIroms <= 1)
+        return f;
+    f->rom = find_pcirom(pci, &f->orig);
+    if (!f->rom)
+        return f;
+    f->size = f->rom->size * 512;
+    f->buf = malloc_tmphigh(f->size);
+    if (!f->buf) {
+        // Copy straight out of the rom bar later on
+        f->done = 1;
+        return f;
+    }
+    run_thread(fetch_pcirom_thread, f);
+    return f;
+}
+
+/****************************************************************
+ * Option rom result cache
+ ****************************************************************/
+
+// If the host provides a writable "etc/optionrom-cache" fw_cfg file,
+// the hash of each PCI rom and the number of boot vectors it registered
+// are recorded there before boot, along with the bootorder priority of
+// the device that was booted.  On the next boot, a rom with unchanged
+// contents whose boot vectors all rank below that device is not run.
+// Such roms are run if the boot menu is opened or if the expected boot
+// device does not show up (see optionrom_cache_prepboot).
+
+#define ROMCACHE_MAGIC 0x43524f42 // "BORC"
+#define ROMCACHE_VERSION 1
+#define ROMCACHE_ENTRIES 16
+
+struct romcache_entry_s {
+    u16 bdf;
+    u16 vendor;
+    u16 device;
+    u8 vectors;     // Number of BEV/BCV vectors the rom registered
+    u8 reserved;
+    u32 size;
+    u8 digest[SHA1_BUFSIZE];
+} PACKED;
+
+struct romcache_s {
+    u32 magic;
+    u16 version;
+    u16 count;
+    s32 selprio;    // Bootorder priority of the booted entry or -1
+    struct romcache_entry_s entries[ROMCACHE_ENTRIES];
+} PACKED;
+
+static struct romcache_s RomCacheOld VARVERIFY32INIT;
+static struct romcache_s RomCacheNew VARVERIFY32INIT;
+static struct hlist_head LazyRoms VARVERIFY32INIT;
+
+// Read the results recorded during the previous boot.
+static void
+romcache_load(void)
+{
+    struct romfile_s *file = romfile_find("etc/optionrom-cache");
+    if (!file)
+        return;
+    if (file->size < sizeof(RomCacheNew)) {
+        dprintf(1, "etc/optionrom-cache too small (%d)\n", file->size);
+        return;
+    }
+    int size;
+    struct romcache_s *old = romfile_loadfile("etc/optionrom-cache", &size);
+    if (!old)
+        return;
+    if (old->magic == ROMCACHE_MAGIC && old->version == ROMCACHE_VERSION
+        && old->count <= ROMCACHE_ENTRIES) {
+        memcpy(&RomCacheOld, old, sizeof(RomCacheOld));
+        dprintf(3, "Option rom cache: %d roms, boot prio %d\n"
+                , RomCacheOld.count, RomCacheOld.selprio);
+    } else {
+        RomCacheOld.selprio = -1;
+    }
+    free(old);
+    RomCacheFile = file;
+}
+
+static struct romcache_entry_s *
+romcache_find(struct romcache_s *cache, struct pci_device *pci)
+{
+    int i;
+    for (i = 0; i < cache->count; i++) {
+        struct romcache_entry_s *e = &cache->entries[i];
+        if (e->bdf == pci->bdf && e->vendor == pci->vendor
+            && e->device == pci->device)
+            return e;
+    }
+    return NULL;
+}
+
+// Note a staged rom in the cache written before boot.
+static void
+romcache_record(struct rom_fetch_s *f, int vectors)
+{
+    if (!RomCacheFile || !f->buf || RomCacheNew.count >= ROMCACHE_ENTRIES)
+        return;
+    struct romcache_entry_s *e = &RomCacheNew.entries[RomCacheNew.count++];
+    e->bdf = f->pci->bdf;
+    e->vendor = f->pci->vendor;
+    e->device = f->pci->device;
+    e->vectors = vectors;
+    e->size = f->size;
+    memcpy(e->digest, f->digest, sizeof(e->digest));
+}
+
+// Note the number of boot vectors a rom registered.
+static void
+romcache_set_vectors(struct pci_device *pci, int vectors)
+{
+    if (!RomCacheFile)
+        return;
+    struct romcache_entry_s *e = romcache_find(&RomCacheNew, pci);
+    if (e)
+        e->vectors = vectors;
+}
+
+// Check if a staged rom can be skipped.  If so, it is queued on
+// LazyRoms and its previous results are carried over.
+static int
+romcache_lazy(struct rom_fetch_s *f)
+{
+    // Roms run late would be measured after the tpm boot separator
+    if (!RomCacheFile || RomCacheOld.selprio < 0 || f->hashed)
+        return 0;
+    struct romcache_entry_s *e = romcache_find(&RomCacheOld, f->pci);
+    if (!e || !e->vectors || e->size != f->size
+        || memcmp(e->digest, f->digest, sizeof(e->digest)))
+        return 0;
+    int i;
+    for (i = 0; i < e->vectors; i++) {
+        int prio = bootprio_find_pci_rom(f->pci, i);
+        if (prio >= 0 && prio <= RomCacheOld.selprio)
+            return 0;
     }
+    dprintf(1, "Skipping option rom of %pP (cached)\n", f->pci);
+    romcache_record(f, e->vectors);
+    hlist_add_head(&f->node, &LazyRoms);
+    return 1;
+}
+
+// Run skipped roms if the expected device isn't booted and record the
+// results of this boot.
+void
+optionrom_cache_prepboot(void)
+{
+    if (!RomCacheFile)
+        return;
+    int selprio = boot_selected_prio();
+    if (!hlist_empty(&LazyRoms)
+        && (selprio < 0 || selprio > RomCacheOld.selprio)) {
+        optionrom_run_lazy();
+        selprio = boot_selected_prio();
+    }
+    RomCacheNew.magic = ROMCACHE_MAGIC;
+    RomCacheNew.version = ROMCACHE_VERSION;
+    RomCacheNew.selprio = selprio;
+    qemu_cfg_write_file(&RomCacheNew, RomCacheFile, 0, sizeof(RomCacheNew));
 }
 
 
@@ -360,6 +673,61 @@ init_pcirom(struct pci_device *pci, int isvga, u64 *sources)
  * Non-VGA option rom init
  ****************************************************************/
 
+// Wait for a fetch to complete and initialize the rom.
+static void
+finish_pcirom(struct rom_fetch_s *f, u64 *sources)
+{
+    struct rom_header *rom = NULL;
+    if (f->file) {
+        rom = deploy_romfile(f->file);
+    } else if (f->rom) {
+        while (!f->done)
+            yield();
+        if (f->buf) {
+            pci_config_writel(f->pci->bdf, PCI_ROM_ADDRESS, f->orig);
+            if (romcache_lazy(f))
+                return;
+            rom = copy_rom(f->buf, NULL, NULL);
+            free(f->buf);
+        } else {
+            rom = copy_rom(f->rom, f->digest, &f->hashed);
+            pci_config_writel(f->pci->bdf, PCI_ROM_ADDRESS, f->orig);
+        }
+    }
+    if (rom && !run_pcirom(f->pci, rom, !!f->file, 0, sources
+                           , f->hashed ? f->digest : NULL))
+        romcache_record(f, 0);
+    free(f);
+}
+
+// Run the option roms that were skipped because of the rom cache.
+void
+optionrom_run_lazy(void)
+{
+    if (hlist_empty(&LazyRoms))
+        return;
+    dprintf(1, "Running skipped option roms\n");
+    struct rom_fetch_s *f;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(f, n, &LazyRoms, node) {
+        hlist_del(&f->node);
+        struct rom_header *rom = copy_rom(f->buf, NULL, NULL);
+        free(f->buf);
+        if (rom) {
+            int captured = run_pcirom(f->pci, rom, 0, 0, NULL, NULL);
+            int vectors = 0;
+            if (is_valid_rom(rom))
+                vectors = add_rom_vectors(rom, RS_PCIROM | (u32)f->pci);
+            romcache_set_vectors(f->pci, captured ? 0 : vectors);
+        }
+        free(f);
+    }
+    rom_reserve(0);
+}
+
+
+
+
 void
 optionrom_setup(void)
 {
@@ -370,16 +738,24 @@ optionrom_setup(void)
     u64 sources[(BUILD_BIOS_ADDR - BUILD_ROM_START) / OPTION_ROM_ALIGN];
     memset(sources, 0, sizeof(sources));
     u32 post_vga = rom_get_last();
+    romcache_load();
 
-    // Find and deploy PCI roms.
+    // Find and deploy PCI roms - fetch each rom while the previous one
+    // runs.
+    struct rom_fetch_s *prev = NULL;
     struct pci_device *pci;
     foreachpci(pci) {
         if (pci->class == PCI_CLASS_DISPLAY_VGA ||
             pci->class == PCI_CLASS_DISPLAY_OTHER ||
             pci->have_driver)
             continue;
-        init_pcirom(pci, 0, sources);
+        struct rom_fetch_s *f = fetch_pcirom(pci);
+        if (prev)
+            finish_pcirom(prev, sources);
+        prev = f;
     }
+    if (prev)
+        finish_pcirom(prev, sources);
 
     // Find and deploy CBFS roms not associated with a device.
     run_file_roms("genroms/", 0, sources);
@@ -395,27 +771,126 @@ optionrom_setup(void)
             continue;
         }
         pos += ALIGN(rom->size * 512, OPTION_ROM_ALIGN);
-        struct pnp_data *pnp = get_pnp_rom(rom);
-        if (! pnp) {
-            // Legacy rom.
-            boot_add_bcv(FLATPTR_TO_SEG(rom), OPTION_ROM_INITVECTOR, 0
-                         , getRomPriority(sources, rom, 0));
+        u64 source = getRomSource(sources, rom);
+        int vectors = add_rom_vectors(rom, source);
+        if (source & RS_PCIROM)
+            romcache_set_vectors((void*)(u32)source, vectors);
+    }
+}
+
+
+/****************************************************************
+ * S3 resume vga state
+ ****************************************************************/
+
+#define VGA_ACTL_ADDRESS    0x3c0
+#define VGA_ACTL_READ_DATA  0x3c1
+#define VGA_WRITE_MISC      0x3c2
+#define VGA_SEQU_ADDRESS    0x3c4
+#define VGA_DAC_READ_ADDR   0x3c7
+#define VGA_DAC_WRITE_ADDR  0x3c8
+#define VGA_DAC_DATA        0x3c9
+#define VGA_READ_MISC       0x3cc
+#define VGA_GRDC_ADDRESS    0x3ce
+#define VGA_CRTC_MONO       0x3b4
+#define VGA_CRTC_COLOR      0x3d4
+#define VGA_ACTL_RESET(crtc) ((crtc) + 6)
+
+// Register state of a standard vga adapter saved after its rom ran
+struct s3_vga_state_s {
+    u8 misc;
+    u8 seq[5];
+    u8 crtc[25];
+    u8 grdc[9];
+    u8 actl[21];
+    u8 dac[256*3];
+};
+static struct s3_vga_state_s *S3VgaState;
+
+static u16
+s3_vga_crtc(u8 misc)
+{
+    return misc & 0x01 ? VGA_CRTC_COLOR : VGA_CRTC_MONO;
+}
+
+// Snapshot the vga registers so that an S3 resume can write them
+// back instead of running the vga rom again.
+static void
+s3_vga_save(void)
+{
+    struct s3_vga_state_s *s = malloc_high(sizeof(*s));
+    if (!s) {
+        warn_noalloc();
+        return;
+    }
+    s->misc = inb(VGA_READ_MISC);
+    u16 crtc = s3_vga_crtc(s->misc);
+    int i;
+    for (i = 0; i < ARRAY_SIZE(s->seq); i++) {
+        outb(i, VGA_SEQU_ADDRESS);
+        s->seq[i] = inb(VGA_SEQU_ADDRESS + 1);
+    }
+    for (i = 0; i < ARRAY_SIZE(s->crtc); i++) {
+        outb(i, crtc);
+        s->crtc[i] = inb(crtc + 1);
+    }
+    for (i = 0; i < ARRAY_SIZE(s->grdc); i++) {
+        outb(i, VGA_GRDC_ADDRESS);
+        s->grdc[i] = inb(VGA_GRDC_ADDRESS + 1);
+    }
+    for (i = 0; i < ARRAY_SIZE(s->actl); i++) {
+        inb(VGA_ACTL_RESET(crtc));
+        outb(i, VGA_ACTL_ADDRESS);
+        s->actl[i] = inb(VGA_ACTL_READ_DATA);
+    }
+    inb(VGA_ACTL_RESET(crtc));
+    outb(0x20, VGA_ACTL_ADDRESS);
+    outb(0, VGA_DAC_READ_ADDR);
+    for (i = 0; i < ARRAY_SIZE(s->dac); i++)
+        s->dac[i] = inb(VGA_DAC_DATA);
+    S3VgaState = s;
+    dprintf(1, "Saved vga state for S3 resume\n");
+}
+
+static void
+s3_vga_restore(struct s3_vga_state_s *s)
+{
+    outb(s->misc, VGA_WRITE_MISC);
+    u16 crtc = s3_vga_crtc(s->misc);
+    int i;
+    // Hold the sequencer in reset while it is programmed
+    outb(0, VGA_SEQU_ADDRESS);
+    outb(0x01, VGA_SEQU_ADDRESS + 1);
+    for (i = 1; i < ARRAY_SIZE(s->seq); i++) {
+        outb(i, VGA_SEQU_ADDRESS);
+        outb(s->seq[i], VGA_SEQU_ADDRESS + 1);
+    }
+    outb(0, VGA_SEQU_ADDRESS);
+    outb(s->seq[0], VGA_SEQU_ADDRESS + 1);
+    // Unlock crtc registers 0-7 until the final write of register 0x11
+    outb(0x11, crtc);
+    outb(s->crtc[0x11] & 0x7f, crtc + 1);
+    for (i = 0; i < ARRAY_SIZE(s->crtc); i++) {
+        if (i == 0x11)
             continue;
-        }
-        // PnP rom - check for BEV and BCV boot capabilities.
-        int instance = 0;
-        while (pnp) {
-            if (pnp->bev)
-                boot_add_bev(FLATPTR_TO_SEG(rom), pnp->bev, pnp->productname
-                             , getRomPriority(sources, rom, instance++));
-            else if (pnp->bcv)
-                boot_add_bcv(FLATPTR_TO_SEG(rom), pnp->bcv, pnp->productname
-                             , getRomPriority(sources, rom, instance++));
-            else
-                break;
-            pnp = get_pnp_next(rom, pnp);
-        }
+        outb(i, crtc);
+        outb(s->crtc[i], crtc + 1);
     }
+    outb(0x11, crtc);
+    outb(s->crtc[0x11], crtc + 1);
+    for (i = 0; i < ARRAY_SIZE(s->grdc); i++) {
+        outb(i, VGA_GRDC_ADDRESS);
+        outb(s->grdc[i], VGA_GRDC_ADDRESS + 1);
+    }
+    inb(VGA_ACTL_RESET(crtc));
+    for (i = 0; i < ARRAY_SIZE(s->actl); i++) {
+        outb(i, VGA_ACTL_ADDRESS);
+        outb(s->actl[i], VGA_ACTL_ADDRESS);
+    }
+    outb(0x20, VGA_ACTL_ADDRESS);
+    outb(0, VGA_DAC_WRITE_ADDR);
+    for (i = 0; i < ARRAY_SIZE(s->dac); i++)
+        outb(s->dac[i], VGA_DAC_DATA);
 }
 
 
@@ -435,13 +910,15 @@ static void try_setup_display_other(void)
     foreachpci(pci) {
         if (pci->class != PCI_CLASS_DISPLAY_OTHER)
             continue;
-        struct rom_header *rom = map_pcirom(pci);
+        u8 digest[SHA1_BUFSIZE];
+        int hashed = 0;
+        struct rom_header *rom = map_pcirom(pci, digest, &hashed);
         if (!rom)
             continue;
         dprintf(1, "Other display found at %pP\n", pci);
         pci_config_maskw(pci->bdf, PCI_COMMAND, 0,
                          PCI_COMMAND_IO | PCI_COMMAND_MEMORY);
-        init_optionrom(rom, pci->bdf, 1);
+        init_optionrom(rom, pci->bdf, 1, hashed ? digest : NULL);
         return;
     }
 }
@@ -486,6 +963,10 @@ vgarom_setup(void)
     if (rom_get_last() != BUILD_ROM_START)
         // VGA rom found
         VgaROM = (void*)BUILD_ROM_START;
+
+    if (CONFIG_S3_RESUME && have_vga && VgaROM && S3ResumeVga
+        && romfile_loadint("etc/s3-resume-vga-restore", 0))
+        s3_vga_save();
 }
 
 void
@@ -493,6 +974,11 @@ s3_resume_vga(void)
 {
     if (!S3ResumeVga)
         return;
+    if (S3VgaState) {
+        // Fast path - the adapter's memory survived the suspend
+        s3_vga_restore(S3VgaState);
+        return;
+    }
     if (!VgaROM || ! is_valid_rom(VgaROM))
         return;
     callrom(VgaROM, 0);
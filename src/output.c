@@ -10,11 +10,14 @@
 #include "bregs.h" // struct bregs
 #include "config.h" // CONFIG_*
 #include "biosvar.h" // GET_GLOBAL
+#include "byteorder.h" // cpu_to_be64
+#include "fw/paravirt.h" // qemu_cfg_write_file
 #include "hw/pci.h" // pci_bdf_to_bus
 #include "hw/pcidevice.h" // pci_device
 #include "hw/serialio.h" // serial_debug_putc
 #include "malloc.h" // malloc_tmp
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_find
 #include "stacks.h" // call16_int
 #include "string.h" // memset
 #include "util.h" // ScreenAndDebug
@@ -51,6 +54,9 @@ debug_putc(struct putcinfo *action, char c)
 static void
 debug_flush(void)
 {
+    qemu_debug_flush();
+    if (!MODESEGMENT)
+        coreboot_debug_flush();
     serial_debug_flush();
 }
 
@@ -327,6 +333,205 @@ bvprintf(struct putcinfo *action, const char *fmt, va_list args)
     }
 }
 
+
+/****************************************************************
+ * Binary debug log
+ ****************************************************************/
+
+// With CONFIG_DEBUG_BINLOG, 32bit dprintf() calls don't format their
+// message.  Instead the address of the format string and the raw
+// arguments are appended to a ring in reserved memory, which
+// scripts/readbinlog.py decodes using the matching bios.bin.
+//
+// Each record is a 'struct binlog_rec_s' followed by the arguments as
+// the format string consumes them: one dword for each integer (two
+// for "ll" integers), the bdf for "%pP", and for "%s" and "%.s" a
+// length byte plus the string itself padded to a dword boundary.  A
+// record with a zero 'fmt' only pads to the end of the ring.  'head'
+// and 'tail' count bytes ever written, so their position in data[]
+// is the count modulo 'size'.
+struct binlog_s {
+    u32 signature;
+    u16 version;
+    u16 header_size;
+    u32 size;           // Size of data[] - a power of two
+    u32 head;           // Where the next record goes
+    u32 tail;           // The oldest record still present
+    u32 init_src;       // Link address of the relocated init code,
+    u32 init_dest;      //  its runtime address
+    u32 init_size;      //  and size - format strings may be in it
+    u8 data[];
+} PACKED;
+
+struct binlog_rec_s {
+    u32 fmt;
+    u16 len;            // Bytes in the record (a multiple of 4)
+    u16 flags;
+} PACKED;
+
+#define BINLOG_SIGNATURE 0x474c4253 // "SBLG"
+#define BINLOG_VERSION 1
+#define BINLOG_MAX_REC 256
+#define BINLOG_FLAG_THREAD 0x01
+
+struct binlog_s *BinLog VARFSEG;
+u32 BinLogInitSrc VARFSEG, BinLogInitDest VARFSEG, BinLogInitSize VARFSEG;
+
+// Note where the init code was relocated to.
+void
+binlog_note_reloc(void *src, void *dest, u32 size)
+{
+    if (!CONFIG_DEBUG_BINLOG)
+        return;
+    BinLogInitSrc = (u32)src;
+    BinLogInitDest = (u32)dest;
+    BinLogInitSize = size;
+}
+
+// Allocate the log and switch 32bit debug messages to it.
+void
+binlog_setup(void)
+{
+    if (!CONFIG_DEBUG_BINLOG)
+        return;
+    u32 size = CONFIG_DEBUG_BINLOG_SIZE;
+    while (size & (size - 1))
+        size &= size - 1;
+    struct binlog_s *log = malloc_high(sizeof(*log) + size);
+    if (!log) {
+        warn_noalloc();
+        return;
+    }
+    memset(log, 0, sizeof(*log));
+    log->signature = BINLOG_SIGNATURE;
+    log->version = BINLOG_VERSION;
+    log->header_size = sizeof(*log);
+    log->size = size;
+    log->init_src = BinLogInitSrc;
+    log->init_dest = BinLogInitDest;
+    log->init_size = BinLogInitSize;
+    dprintf(1, "Debug messages now go to the binary log at %p (size %d)\n"
+            , log, size);
+    debug_flush();
+    BinLog = log;
+
+    struct romfile_s *file = romfile_find("etc/debug-binlog");
+    if (file && file->size >= sizeof(u64)) {
+        u64 addr = cpu_to_be64((u32)log);
+        qemu_cfg_write_file(&addr, file, 0, sizeof(addr));
+    }
+}
+
+// Copy a string argument into the record at 'pos'.
+static int
+binlog_putstr(u8 *rec, int pos, const char *s)
+{
+    if (!s)
+        s = "(NULL)";
+    int len = 0, max = BINLOG_MAX_REC - pos - 1;
+    while (len < max && len < 255 && s[len]) {
+        rec[pos + 1 + len] = s[len];
+        len++;
+    }
+    rec[pos] = len;
+    return ALIGN(pos + 1 + len, 4);
+}
+
+static void
+binlog_write(struct binlog_s *log, u8 *rec, u32 len)
+{
+    u32 mask = log->size - 1, head = log->head;
+    u32 pad = 0;
+    if ((head & mask) + len > log->size)
+        // Records are not split - pad to the start of the ring
+        pad = log->size - (head & mask);
+    // Drop the oldest records to make room
+    while (head + pad + len - log->tail > log->size) {
+        struct binlog_rec_s *old = (void*)&log->data[log->tail & mask];
+        log->tail += old->len;
+    }
+    if (pad) {
+        struct binlog_rec_s *p = (void*)&log->data[head & mask];
+        p->fmt = 0;
+        p->len = pad;
+        p->flags = 0;
+        head += pad;
+    }
+    memcpy(&log->data[head & mask], rec, len);
+    log->head = head + len;
+}
+
+static void
+binlog_vprintf(struct binlog_s *log, u16 flags, const char *fmt, va_list args)
+{
+    u8 buf[BINLOG_MAX_REC] __aligned(4);
+    struct binlog_rec_s *rec = (void*)buf;
+    rec->fmt = (u32)fmt;
+    rec->flags = flags;
+    int pos = sizeof(*rec);
+
+    const char *s;
+    for (s = fmt; *s; s++) {
+        if (*s != '%')
+            continue;
+        const char *n = s+1;
+        while (isdigit(*n))
+            n++;
+        u8 is64 = 0;
+        if (*n == 'l')
+            n++;
+        if (*n == 'l') {
+            is64 = 1;
+            n++;
+        }
+        if (pos > BINLOG_MAX_REC - 8)
+            break;
+        u32 *arg = (void*)&buf[pos];
+        switch (*n) {
+        case 'd':
+        case 'u':
+        case 'x':
+        case 'X':
+            *arg = va_arg(args, u32);
+            pos += 4;
+            if (is64) {
+                arg[1] = va_arg(args, u32);
+                pos += 4;
+            }
+            break;
+        case 'c':
+            *arg = va_arg(args, int);
+            pos += 4;
+            break;
+        case 'p':
+            *arg = va_arg(args, u32);
+            if (n[1] == 'P') {
+                // %pP is 'struct pci_device' printer
+                *arg = ((struct pci_device*)*arg)->bdf;
+                n++;
+            }
+            pos += 4;
+            break;
+        case '.':
+            // Hack to support "%.s" - meaning string on stack.
+            if (n[1] != 's')
+                break;
+            n++;
+            // FALLTHROUGH
+        case 's':
+            pos = binlog_putstr(buf, pos, va_arg(args, const char *));
+            break;
+        case '%':
+            break;
+        default:
+            n = s;
+        }
+        s = n;
+    }
+    rec->len = pos;
+    binlog_write(log, buf, pos);
+}
+
 void
 panic(const char *fmt, ...)
 {
@@ -347,6 +552,17 @@ panic(const char *fmt, ...)
 void
 __dprintf(const char *fmt, ...)
 {
+    if (CONFIG_DEBUG_BINLOG && !MODESEGMENT && BinLog) {
+        u16 flags = 0;
+        if (CONFIG_THREADS && getCurThread() != &MainThread)
+            flags |= BINLOG_FLAG_THREAD;
+        va_list args;
+        va_start(args, fmt);
+        binlog_vprintf(BinLog, flags, fmt, args);
+        va_end(args);
+        return;
+    }
+
     if (!MODESEGMENT && CONFIG_THREADS && CONFIG_DEBUG_LEVEL >= DEBUG_thread
         && *fmt != '\\' && *fmt != '/') {
         struct thread_info *cur = getCurThread();
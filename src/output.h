@@ -31,6 +31,8 @@ void __set_code_invalid(struct bregs *regs, u32 linecode, const char *fname);
 void __set_code_unimplemented(struct bregs *regs, u32 linecode
                               , const char *fname);
 void hexdump(const void *d, int len);
+void binlog_note_reloc(void *src, void *dest, u32 size);
+void binlog_setup(void);
 
 #define dprintf(lvl, fmt, args...) do {                         \
         if (CONFIG_DEBUG_LEVEL && (lvl) <= CONFIG_DEBUG_LEVEL)  \
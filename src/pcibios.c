@@ -10,6 +10,7 @@
 #include "hw/pci.h" // pci_config_readl
 #include "hw/pcidevice.h" // MaxPCIBus
 #include "hw/pci_regs.h" // PCI_VENDOR_ID
+#include "malloc.h" // malloc_fseg
 #include "output.h" // dprintf
 #include "std/pirtable.h" // struct pir_header
 #include "string.h" // checksum
@@ -36,12 +37,59 @@ handle_1ab101(struct bregs *regs)
     set_code_success(regs);
 }
 
+// Snapshot of the devices found during POST, sorted by bdf, so that the
+// find device and find class calls don't have to scan every bdf.
+struct pcibios_dev_s {
+    u16 bdf;
+    u32 id;             // device id << 16 | vendor id
+    u32 classprog;      // class << 8 | programming interface
+};
+struct pcibios_dev_s *PciBiosDevs VARFSEG;
+int PciBiosDevCount VARFSEG;
+
+// Search the device snapshot for the 'count'th device whose id (or
+// class if 'byclass' is set) matches 'val'.  Returns the bdf, -1 if
+// there is no such device, or -2 if the hardware no longer matches the
+// snapshot.
+static int
+pcibios_find(int byclass, u32 val, int count)
+{
+    struct pcibios_dev_s *devs_gf = GET_GLOBAL(PciBiosDevs);
+    struct pcibios_dev_s *devs_g = GLOBALFLAT2GLOBAL(devs_gf);
+    int i, devcount = GET_GLOBAL(PciBiosDevCount);
+    for (i=0; i<devcount; i++) {
+        if (val != (byclass ? GET_GLOBAL(devs_g[i].classprog)
+                            : GET_GLOBAL(devs_g[i].id)))
+            continue;
+        if (count--)
+            continue;
+        // Make sure the device is still there (buses may be renumbered)
+        u16 bdf = GET_GLOBAL(devs_g[i].bdf);
+        u32 v = (byclass ? pci_config_readl(bdf, PCI_CLASS_REVISION) >> 8
+                 : pci_config_readl(bdf, PCI_VENDOR_ID));
+        return v == val ? bdf : -2;
+    }
+    return -1;
+}
+
 // find pci device
 static void
 handle_1ab102(struct bregs *regs)
 {
     u32 id = (regs->cx << 16) | regs->dx;
     int count = regs->si;
+    if (GET_GLOBAL(PciBiosDevs)) {
+        int bdf = pcibios_find(0, id, count);
+        if (bdf >= 0) {
+            regs->bx = bdf;
+            set_code_success(regs);
+            return;
+        }
+        if (bdf == -1) {
+            set_code_invalid(regs, RET_DEVICE_NOT_FOUND);
+            return;
+        }
+    }
     int bus = -1;
     while (bus < GET_GLOBAL(MaxPCIBus)) {
         bus++;
@@ -66,6 +114,18 @@ handle_1ab103(struct bregs *regs)
 {
     int count = regs->si;
     u32 classprog = regs->ecx;
+    if (GET_GLOBAL(PciBiosDevs)) {
+        int bdf = pcibios_find(1, classprog, count);
+        if (bdf >= 0) {
+            regs->bx = bdf;
+            set_code_success(regs);
+            return;
+        }
+        if (bdf == -1) {
+            set_code_invalid(regs, RET_DEVICE_NOT_FOUND);
+            return;
+        }
+    }
     int bus = -1;
     while (bus < GET_GLOBAL(MaxPCIBus)) {
         bus++;
@@ -231,6 +291,41 @@ struct bios32_s BIOS32HEADER __aligned(16) VARFSEG = {
     .length = sizeof(BIOS32HEADER) / 16,
 };
 
+// Take a snapshot of the PCI devices for the find device calls.
+void
+pcibios_prepboot(void)
+{
+    if (!CONFIG_PCIBIOS)
+        return;
+    int count = 0;
+    struct pci_device *pci;
+    foreachpci(pci) {
+        count++;
+    }
+    if (!count)
+        return;
+    struct pcibios_dev_s *devs = malloc_fseg(count * sizeof(*devs));
+    if (!devs) {
+        warn_noalloc();
+        return;
+    }
+    int i = 0;
+    foreachpci(pci) {
+        // Insert sorted by bdf - the order a hardware scan finds them in.
+        int pos = i++;
+        while (pos && devs[pos-1].bdf > pci->bdf) {
+            devs[pos] = devs[pos-1];
+            pos--;
+        }
+        devs[pos].bdf = pci->bdf;
+        devs[pos].id = (pci->device << 16) | pci->vendor;
+        devs[pos].classprog = (pci->class << 8) | pci->prog_if;
+    }
+    PciBiosDevs = devs;
+    PciBiosDevCount = count;
+    dprintf(3, "pcibios: %d devices\n", count);
+}
+
 void
 bios32_init(void)
 {
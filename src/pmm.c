@@ -24,6 +24,9 @@ struct pmmheader PMMHEADER __aligned(16) VARFSEG = {
 };
 #endif
 
+// Number of calls to each PMM function (the last entry counts others)
+static u32 PmmCalls[4] VARVERIFY32INIT;
+
 // PMM - allocate
 static u32
 handle_pmm00(u16 *args)
@@ -140,6 +143,7 @@ handle_pmm(u16 *args)
     u16 arg1 = args[0];
     dprintf(DEBUG_HDL_pmm, "pmm call arg1=%x\n", arg1);
 
+    PmmCalls[arg1 < ARRAY_SIZE(PmmCalls) ? arg1 : ARRAY_SIZE(PmmCalls)-1]++;
     u32 ret;
     switch (arg1) {
     case 0x00: ret = handle_pmm00(args); break;
@@ -170,6 +174,9 @@ pmm_prepboot(void)
         return;
 
     dprintf(3, "finalize PMM\n");
+    if (PmmCalls[0] || PmmCalls[1] || PmmCalls[2] || PmmCalls[3])
+        dprintf(1, "PMM calls: %d allocate, %d find, %d deallocate, %d other\n"
+                , PmmCalls[0], PmmCalls[1], PmmCalls[2], PmmCalls[3]);
 
     PMMHEADER.signature = 0;
     PMMHEADER.entry.segoff = 0;
@@ -20,6 +20,8 @@
 #include "malloc.h" // malloc_init
 #include "memmap.h" // SYMBOL
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_index_build
+#include "stacks.h" // stack_profile_setup
 #include "string.h" // memset
 #include "util.h" // kbd_init
 #include "tcgbios.h" // tpm_*
@@ -70,12 +72,16 @@ ivt_init(void)
     SET_IVT(0x79, SEGOFF(0, 0));
 }
 
+// Set if this boot was started by a ctrl+alt+del reboot
+int WarmBoot;
+
 static void
 bda_init(void)
 {
     dprintf(3, "init bda\n");
 
     struct bios_data_area_s *bda = MAKE_FLATPTR(SEG_BDA, 0);
+    WarmBoot = bda->soft_reset_flag == 0x1234;
     memset(bda, 0, sizeof(*bda));
 
     int esize = EBDA_SIZE_START;
@@ -96,6 +102,7 @@ bda_init(void)
 
     // Init extra stack
     StackPos = &ExtraStack[BUILD_EXTRA_STACK_SIZE] - SYMBOL(zonelow_base);
+    stack_profile_setup();
 }
 
 void
@@ -103,11 +110,13 @@ interface_init(void)
 {
     // Running at new code address - do code relocation fixups
     malloc_init();
+    binlog_setup();
 
     // Setup romfile items.
     qemu_cfg_init();
     coreboot_cbfs_init();
     multiboot_init();
+    romfile_index_build();
 
     // Setup ivt/bda/ebda
     ivt_init();
@@ -126,9 +135,9 @@ interface_init(void)
 void
 device_hardware_setup(void)
 {
-    usb_setup();
-    ps2port_setup();
-    block_setup();
+    TIMELINE_CALL(usb_setup);
+    TIMELINE_CALL(ps2port_setup);
+    TIMELINE_CALL(block_setup);
     lpt_setup();
     serial_setup();
     cbfs_payload_setup();
@@ -146,15 +155,16 @@ platform_hardware_setup(void)
     mathcp_setup();
 
     // Platform specific setup
-    qemu_platform_setup();
-    coreboot_platform_setup();
+    TIMELINE_CALL(qemu_platform_setup);
+    TIMELINE_CALL(coreboot_platform_setup);
 
     // Setup timers and periodic clock interrupt
     timer_setup();
     clock_setup();
+    call32_setup();
 
     // Initialize TPM
-    tpm_setup();
+    TIMELINE_CALL(tpm_setup);
 }
 
 void
@@ -166,9 +176,20 @@ prepareboot(void)
     // Run BCVs
     bcv_prepboot();
 
+    // Stop any application processors running threads
+    smp_prepboot();
+    stack_profile_report();
+    entry_stats_prepboot();
+    thread_prepboot();
+    mutex_prepboot();
+
     // Finalize data structures before boot
+    usb_cache_prepboot();
+    pcibios_prepboot();
     cdrom_prepboot();
+    disk_stats_prepboot();
     pmm_prepboot();
+    multiboot_prepboot();
     malloc_prepboot();
     e820_prepboot();
 
@@ -197,32 +218,33 @@ static void
 maininit(void)
 {
     // Initialize internal interfaces.
-    interface_init();
+    TIMELINE_CALL(interface_init);
 
     // Setup platform devices.
-    platform_hardware_setup();
+    TIMELINE_CALL(platform_hardware_setup);
 
     // Start hardware initialization (if threads allowed during optionroms)
     if (threads_during_optionroms())
-        device_hardware_setup();
+        TIMELINE_CALL(device_hardware_setup);
 
     // Run vga option rom
-    vgarom_setup();
+    TIMELINE_CALL(vgarom_setup);
     sercon_setup();
     enable_vga_console();
 
     // Do hardware initialization (if running synchronously)
     if (!threads_during_optionroms()) {
-        device_hardware_setup();
-        wait_threads();
+        TIMELINE_CALL(device_hardware_setup);
+        TIMELINE_CALL(wait_threads);
     }
 
     // Run option roms
-    optionrom_setup();
+    TIMELINE_CALL(optionrom_setup);
 
     // Allow user to modify overall boot order.
-    interactive_bootmenu();
-    wait_threads();
+    TIMELINE_CALL(interactive_bootmenu);
+    TIMELINE_CALL(wait_threads);
+    timeline_export();
 
     // Prepare for boot.
     prepareboot();
@@ -248,6 +270,28 @@ updateRelocs(void *dest, u32 *rstart, u32 *rend, u32 delta)
         *((u32*)(dest + *reloc)) += delta;
 }
 
+// Copy the init code to its new location.  With CONFIG_COMPRESS_INIT
+// the code that may run before relocation is stored as is at the end
+// of the init area and the rest is an lzma stream ending just before
+// its (four byte) length at the start of that code.
+static void
+copy_init(void *codedest, void *codesrc, u32 initsize)
+{
+    if (!CONFIG_COMPRESS_INIT) {
+        memcpy(codedest, codesrc, initsize);
+        return;
+    }
+    u32 mainsize = SYMBOL(code32init_main_end) - SYMBOL(code32init_start);
+    memcpy(codedest + mainsize, codesrc + mainsize, initsize - mainsize);
+    u32 *trailer = codesrc + mainsize - sizeof(u32);
+    u32 complen = *trailer;
+    if (ulzma(codedest, mainsize, (void*)trailer - complen, complen)
+        != mainsize)
+        panic("Unable to uncompress init code.\n");
+    dprintf(3, "Uncompressed %d bytes of init code from %d\n"
+            , mainsize, complen);
+}
+
 // Relocate init code and then call a function at its new address.
 // The passed function should be in the "init" section and must not
 // return.
@@ -270,7 +314,8 @@ reloc_preinit(void *f, void *arg)
     dprintf(1, "Relocating init from %p to %p (size %d)\n"
             , codesrc, codedest, initsize);
     s32 delta = codedest - codesrc;
-    memcpy(codedest, codesrc, initsize);
+    copy_init(codedest, codesrc, initsize);
+    binlog_note_reloc(codesrc, codedest, initsize);
     updateRelocs(codedest, VSYMBOL(_reloc_abs_start), VSYMBOL(_reloc_abs_end)
                  , delta);
     updateRelocs(codedest, VSYMBOL(_reloc_rel_start), VSYMBOL(_reloc_rel_end)
@@ -304,10 +349,12 @@ void VISIBLE32INIT
 dopost(void)
 {
     code_mutable_preinit();
+    string_preinit();
 
     // Detect ram and setup internal malloc.
     qemu_preinit();
     coreboot_preinit();
+    multiboot_preinit();
     malloc_preinit();
 
     // Relocate initialization code and call maininit().
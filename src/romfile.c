@@ -12,6 +12,11 @@
 
 static struct romfile_s *RomfileRoot VARVERIFY32INIT;
 
+// Name sorted index of the romfiles (see romfile_index_build())
+static struct romfile_s **RomfileIndex VARVERIFY32INIT;
+static int RomfileIndexCount VARVERIFY32INIT;
+static struct romfile_s *RomfileSorted VARVERIFY32INIT;
+
 void
 romfile_add(struct romfile_s *file)
 {
@@ -20,19 +25,144 @@ romfile_add(struct romfile_s *file)
     RomfileRoot = file;
 }
 
+// Merge two name sorted lists (entries of 'a' go first on a tie).
+static struct romfile_s *
+romfile_merge(struct romfile_s *a, struct romfile_s *b)
+{
+    struct romfile_s *head = NULL, **pprev = &head;
+    while (a && b) {
+        if (strcmp(b->name, a->name) < 0) {
+            *pprev = b;
+            b = b->next;
+        } else {
+            *pprev = a;
+            a = a->next;
+        }
+        pprev = &(*pprev)->next;
+    }
+    *pprev = a ? a : b;
+    return head;
+}
+
+// Detach the leading run of name sorted entries from *plist.
+static struct romfile_s *
+romfile_take_run(struct romfile_s **plist)
+{
+    struct romfile_s *head = *plist, *file = head;
+    while (file->next && strcmp(file->next->name, file->name) >= 0)
+        file = file->next;
+    *plist = file->next;
+    file->next = NULL;
+    return head;
+}
+
+// Stable sort a list by merging its already sorted runs - a list
+// added in sorted order (such as the fw_cfg directory) is a single
+// run and costs one pass.
+static struct romfile_s *
+romfile_sort(struct romfile_s *list)
+{
+    // pending[i] holds the merge of 2^i runs (earlier runs first)
+    struct romfile_s *pending[32];
+    memset(pending, 0, sizeof(pending));
+    while (list) {
+        struct romfile_s *run = romfile_take_run(&list);
+        int i;
+        for (i = 0; i < ARRAY_SIZE(pending) - 1 && pending[i]; i++) {
+            run = romfile_merge(pending[i], run);
+            pending[i] = NULL;
+        }
+        pending[i] = romfile_merge(pending[i], run);
+    }
+    struct romfile_s *sorted = NULL;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(pending); i++)
+        sorted = romfile_merge(pending[i], sorted);
+    return sorted;
+}
+
+// Sort the list of romfiles by name and build an index for binary
+// searching it.  The sort is stable, so when several files share a
+// name the most recently added one is still found first.  Files added
+// after the index is built are searched linearly until the next call.
+void
+romfile_index_build(void)
+{
+    int count = 0;
+    struct romfile_s *file;
+    for (file = RomfileRoot; file; file = file->next)
+        count++;
+    if (!count)
+        return;
+    struct romfile_s **index = malloc_tmp(count * sizeof(index[0]));
+    if (!index) {
+        warn_noalloc();
+        return;
+    }
+    RomfileRoot = RomfileSorted = romfile_sort(RomfileRoot);
+    int i = 0;
+    for (file = RomfileRoot; file; file = file->next)
+        index[i++] = file;
+    free(RomfileIndex);
+    RomfileIndex = index;
+    RomfileIndexCount = count;
+    dprintf(3, "Indexed %d romfiles\n", count);
+}
+
+// Find the first indexed file whose name starts with the given prefix.
+static struct romfile_s *
+romfile_index_find(const char *prefix, int prefixlen)
+{
+    int lo = 0, hi = RomfileIndexCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(RomfileIndex[mid]->name, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < RomfileIndexCount
+        && memcmp(prefix, RomfileIndex[lo]->name, prefixlen) == 0)
+        return RomfileIndex[lo];
+    return NULL;
+}
+
+// Determine if a file is part of the sorted index.
+static int
+romfile_is_indexed(struct romfile_s *file)
+{
+    if (!RomfileSorted)
+        return 0;
+    struct romfile_s *cur;
+    for (cur = RomfileRoot; cur != RomfileSorted; cur = cur->next)
+        if (cur == file)
+            return 0;
+    return 1;
+}
+
 // Search for the specified file.
 static struct romfile_s *
 __romfile_findprefix(const char *prefix, int prefixlen, struct romfile_s *prev)
 {
     struct romfile_s *cur = RomfileRoot;
-    if (prev)
+    if (prev) {
         cur = prev->next;
-    while (cur) {
+        if (romfile_is_indexed(prev)) {
+            // Matching entries in the sorted list are contiguous
+            if (cur && memcmp(prefix, cur->name, prefixlen) == 0)
+                return cur;
+            return NULL;
+        }
+    }
+    // Check files that are not (yet) in the index
+    while (cur && cur != RomfileSorted) {
         if (memcmp(prefix, cur->name, prefixlen) == 0)
             return cur;
         cur = cur->next;
     }
-    return NULL;
+    if (!cur)
+        return NULL;
+    return romfile_index_find(prefix, prefixlen);
 }
 
 struct romfile_s *
@@ -78,6 +208,31 @@ romfile_loadfile(const char *name, int *psize)
     return data;
 }
 
+// Helper function to find a romfile and return a pointer to its
+// contents (which must not be modified).  The contents are used in
+// place when the file provider can map them, otherwise they are loaded
+// with romfile_loadfile().  The caller must free() the pointer returned
+// in 'pfree' (which is NULL if no copy was made).
+void *
+romfile_mapfile(const char *name, int *psize, void **pfree)
+{
+    *pfree = NULL;
+    struct romfile_s *file = romfile_find(name);
+    if (!file || !file->size)
+        return NULL;
+    void *data = file->map ? file->map(file) : NULL;
+    if (data) {
+        dprintf(5, "Mapped romfile '%s' (len %d) at %p\n"
+                , name, file->size, data);
+        if (psize)
+            *psize = file->size;
+        return data;
+    }
+    data = romfile_loadfile(name, psize);
+    *pfree = data;
+    return data;
+}
+
 // Attempt to load an integer from the given file - return 'defval'
 // if unsuccessful.
 u64
@@ -140,6 +295,12 @@ const_read_file(struct romfile_s *file, void *dst, u32 maxlen)
     return file->size;
 }
 
+static void *
+const_map_file(struct romfile_s *file)
+{
+    return container_of(file, struct const_romfile_s, file)->data;
+}
+
 static void
 const_romfile_add(char *name, void *data, int size)
 {
@@ -152,6 +313,7 @@ const_romfile_add(char *name, void *data, int size)
     strtcpy(cfile->file.name, name, sizeof(cfile->file.name));
     cfile->file.size = size;
     cfile->file.copy = const_read_file;
+    cfile->file.map = const_map_file;
     cfile->data = data;
     romfile_add(&cfile->file);
 }
@@ -9,11 +9,16 @@ struct romfile_s {
     char name[128];
     u32 size;
     int (*copy)(struct romfile_s *file, void *dest, u32 maxlen);
+    // Optional - return a pointer to the (uncompressed) file contents
+    // if they are already directly accessible in memory.
+    void *(*map)(struct romfile_s *file);
 };
 void romfile_add(struct romfile_s *file);
+void romfile_index_build(void);
 struct romfile_s *romfile_findprefix(const char *prefix, struct romfile_s *prev);
 struct romfile_s *romfile_find(const char *name);
 void *romfile_loadfile(const char *name, int *psize);
+void *romfile_mapfile(const char *name, int *psize, void **pfree);
 u64 romfile_loadint(const char *name, u64 defval);
 u32 romfile_loadbool(const char *name, u32 defval);
 
@@ -6,6 +6,7 @@
 
 #include "biosvar.h" // SET_BDA
 #include "bregs.h" // struct bregs
+#include "malloc.h" // malloc_low
 #include "stacks.h" // yield
 #include "output.h" // dprintf
 #include "util.h" // irqtimer_calc_ticks
@@ -58,51 +59,165 @@ VARFSEG struct segoff_s sercon_real_vga_handler;
  *
  * sercon_char/attr  is the actual output buffer.
  * sercon_attr_last  is the most recent attribute sent to the terminal.
- * sercon_col_last   is the most recent column sent to the terminal.
- * sercon_row_last   is the most recent row sent to the terminal.
+ * sercon_col_last   is the column the buffered char belongs to.
+ * sercon_row_last   is the row the buffered char belongs to.
+ * sercon_col_term   is the column of the terminal cursor (0xff: unknown).
+ * sercon_row_term   is the row of the terminal cursor (0xff: unknown).
+ *
+ * With SERCON_SHADOW, sercon_shadow points to what the terminal
+ * currently shows (see sercon_cell()), so that redrawing a screen only
+ * sends the cells that changed and the cursor only moves to reach
+ * them.  It is allocated by sercon_setup() (NULL if not in use).
  */
 VARLOW u8 sercon_attr_last;
 VARLOW u8 sercon_col_last;
 VARLOW u8 sercon_row_last;
+VARLOW u8 sercon_col_term;
+VARLOW u8 sercon_row_term;
 VARLOW u8 sercon_char;
 VARLOW u8 sercon_attr = 0x07;
 
+#define SERCON_SHADOW_COLS 80
+#define SERCON_SHADOW_ROWS 25
+
+VARLOW u16 *sercon_shadow;
+
 static VAR16 u8 sercon_cmap[8] = { '0', '4', '2', '6', '1', '5', '3', '7' };
 
+/*
+ * Characters for the terminal are queued in a ring and sent a fifo
+ * load at a time, so the LSR is checked once per 16 bytes on a 16550
+ * instead of once per byte.  The ring is drained on each int10 call
+ * and from the timer irq, so a call doesn't wait for the line unless
+ * the ring is full.
+ *
+ * sercon_fifo    is the number of bytes the uart accepts once THRE is set.
+ * sercon_txlock  is set while the ring is being drained or waited on.
+ */
+#define SERCON_TXBUF_SIZE 128   // Must be a power of two
+
+VARLOW u8 sercon_fifo;
+VARLOW u8 sercon_txbuf[SERCON_TXBUF_SIZE];
+VARLOW u8 sercon_txhead;
+VARLOW u8 sercon_txtail;
+VARLOW u8 sercon_txlock;
+
 static int sercon_splitmode(void)
 {
     return GET_LOW(sercon_split);
 }
 
-static void sercon_putchar(u8 chr)
+static int sercon_tx_pending(void)
+{
+    return (u8)(GET_LOW(sercon_txtail) - GET_LOW(sercon_txhead));
+}
+
+// Send queued characters if the uart can take them - never waits.
+static void sercon_tx_kick(void)
 {
     u16 addr = GET_LOW(sercon_port);
-    u32 end = irqtimer_calc_ticks(0x0a);
+    int count = sercon_tx_pending();
+    if (!count || !(inb(addr+SEROFF_LSR) & 0x20))
+        return;
+    u8 fifo = GET_LOW(sercon_fifo);
+    if (count > fifo)
+        count = fifo;
+    u8 head = GET_LOW(sercon_txhead);
+    while (count--) {
+        outb(GET_LOW(sercon_txbuf[head % SERCON_TXBUF_SIZE]), addr+SEROFF_DATA);
+        head++;
+    }
+    SET_LOW(sercon_txhead, head);
+}
 
+static void sercon_putchar(u8 chr)
+{
 #if 0
     /* for visual control sequence debugging */
     if (chr == '\x1b')
         chr = '*';
 #endif
 
-    for (;;) {
-        u8 lsr = inb(addr+SEROFF_LSR);
-        if ((lsr & 0x60) == 0x60) {
-            // Success - can write data
-            outb(chr, addr+SEROFF_DATA);
-            break;
-        }
-        if (irqtimer_check(end)) {
-            break;
+    if (sercon_tx_pending() >= SERCON_TXBUF_SIZE) {
+        // Ring full - wait for the uart to drain it
+        u32 end = irqtimer_calc_ticks(0x0a);
+        SET_LOW(sercon_txlock, 1);
+        for (;;) {
+            sercon_tx_kick();
+            if (sercon_tx_pending() < SERCON_TXBUF_SIZE)
+                break;
+            if (irqtimer_check(end)) {
+                // The uart isn't sending - drop the queued output
+                SET_LOW(sercon_txhead, GET_LOW(sercon_txtail));
+                break;
+            }
+            yield();
         }
-        yield();
+        SET_LOW(sercon_txlock, 0);
     }
+    u8 tail = GET_LOW(sercon_txtail);
+    SET_LOW(sercon_txbuf[tail % SERCON_TXBUF_SIZE], chr);
+    SET_LOW(sercon_txtail, tail + 1);
+}
+
+/****************************************************************
+ * terminal shadow
+ ****************************************************************/
+
+/* A cell as it looks on the terminal; zero means unknown. */
+static u16 sercon_cell(u8 chr, u8 attr)
+{
+    attr &= 0x7f; /* blink isn't sent to the terminal */
+    if (chr == ' ')
+        attr &= 0x70; /* only the background of a blank is visible */
+    return (attr << 8) | chr;
+}
+
+static int sercon_shadow_index(u8 row, u8 col)
+{
+    if (!CONFIG_SERCON_SHADOW || !GET_LOW(sercon_shadow)
+        || video_rows() > SERCON_SHADOW_ROWS
+        || video_cols() > SERCON_SHADOW_COLS
+        || row >= SERCON_SHADOW_ROWS || col >= SERCON_SHADOW_COLS)
+        return -1;
+    return row * SERCON_SHADOW_COLS + col;
+}
+
+static void sercon_shadow_fill(u16 cell)
+{
+    u16 *shadow = GET_LOW(sercon_shadow);
+    int i;
+    if (!CONFIG_SERCON_SHADOW || !shadow)
+        return;
+    for (i = 0; i < SERCON_SHADOW_ROWS * SERCON_SHADOW_COLS; i++)
+        SET_LOWFLAT(shadow[i], cell);
+}
+
+/* the terminal scrolled up one line at the bottom of 'rows' lines */
+static void sercon_shadow_scroll(u8 rows)
+{
+    u16 *shadow = GET_LOW(sercon_shadow);
+    int i;
+    if (!CONFIG_SERCON_SHADOW || !shadow || rows > SERCON_SHADOW_ROWS)
+        return;
+    for (i = 0; i < (rows - 1) * SERCON_SHADOW_COLS; i++)
+        SET_LOWFLAT(shadow[i], GET_LOWFLAT(shadow[i + SERCON_SHADOW_COLS]));
+    for (; i < rows * SERCON_SHADOW_COLS; i++)
+        SET_LOWFLAT(shadow[i], 0);
+}
+
+static void sercon_term_pos(u8 row, u8 col)
+{
+    SET_LOW(sercon_row_term, row);
+    SET_LOW(sercon_col_term, col);
 }
 
 static void sercon_term_reset(void)
 {
     sercon_putchar('\x1b');
     sercon_putchar('c');
+    sercon_term_pos(0, 0);
+    sercon_shadow_fill(sercon_cell(' ', 0x07));
 }
 
 static void sercon_term_clear_screen(void)
@@ -111,6 +226,8 @@ static void sercon_term_clear_screen(void)
     sercon_putchar('[');
     sercon_putchar('2');
     sercon_putchar('J');
+    /* terminals erase with the current background color */
+    sercon_shadow_fill(sercon_cell(' ', GET_LOW(sercon_attr_last)));
 }
 
 static void sercon_term_no_linewrap(void)
@@ -122,17 +239,68 @@ static void sercon_term_no_linewrap(void)
     sercon_putchar('l');
 }
 
+static void sercon_term_number(u8 n)
+{
+    if (n >= 100)
+        sercon_putchar('0' + n / 100);
+    if (n >= 10)
+        sercon_putchar('0' + (n / 10) % 10);
+    sercon_putchar('0' + n % 10);
+}
+
 static void sercon_term_cursor_goto(u8 row, u8 col)
 {
-    row++; col++;
     sercon_putchar('\x1b');
     sercon_putchar('[');
-    sercon_putchar('0' + row / 10);
-    sercon_putchar('0' + row % 10);
+    sercon_term_number(row + 1);
     sercon_putchar(';');
-    sercon_putchar('0' + col / 10);
-    sercon_putchar('0' + col % 10);
+    sercon_term_number(col + 1);
     sercon_putchar('H');
+    sercon_term_pos(row, col);
+}
+
+/* Move the terminal cursor, using the shortest sequence we know of. */
+static void sercon_term_move(u8 row, u8 col)
+{
+    u8 trow = GET_LOW(sercon_row_term);
+    u8 tcol = GET_LOW(sercon_col_term);
+
+    if (trow == row && tcol == col)
+        return;
+    if (trow == 0xff || tcol == 0xff || row < trow || row - trow > 4) {
+        sercon_term_cursor_goto(row, col);
+        return;
+    }
+    if (col == 0) {
+        if (tcol != 0)
+            sercon_putchar('\r');
+        for (; trow < row; trow++)
+            sercon_putchar('\n');
+    } else if (row != trow) {
+        sercon_term_cursor_goto(row, col);
+        return;
+    } else if (col < tcol && tcol - col <= 4) {
+        for (; tcol > col; tcol--)
+            sercon_putchar(8);
+    } else {
+        /* cursor forward / backward on the same line */
+        sercon_putchar('\x1b');
+        sercon_putchar('[');
+        sercon_term_number(col > tcol ? col - tcol : tcol - col);
+        sercon_putchar(col > tcol ? 'C' : 'D');
+    }
+    sercon_term_pos(row, col);
+}
+
+/* Scroll the terminal up by a line (from its bottom line). */
+static void sercon_term_scroll(void)
+{
+    u8 rows = video_rows();
+    u8 col = GET_LOW(sercon_col_term);
+
+    sercon_term_move(rows - 1, col == 0xff ? 0 : col);
+    sercon_putchar('\n');
+    sercon_shadow_scroll(rows);
 }
 
 static void sercon_term_set_color(u8 fg, u8 bg, u8 bold)
@@ -184,6 +352,27 @@ static void sercon_print_utf8(u8 chr)
     }
 }
 
+/* Show chr/attr at row/col unless the terminal already has it there. */
+static void sercon_write_cell(u8 row, u8 col, u8 chr, u8 attr)
+{
+    u16 *shadow = GET_LOW(sercon_shadow);
+    int idx = sercon_shadow_index(row, col);
+    u16 cell = sercon_cell(chr, attr);
+
+    if (idx >= 0 && GET_LOWFLAT(shadow[idx]) == cell)
+        return;
+    sercon_term_move(row, col);
+    sercon_set_attr(attr);
+    sercon_print_utf8(chr);
+    if (idx >= 0)
+        SET_LOWFLAT(shadow[idx], cell);
+    if (col + 1 < video_cols())
+        sercon_term_pos(row, col + 1);
+    else
+        /* no line wrap - where the cursor ends up depends on the terminal */
+        sercon_term_pos(0xff, 0xff);
+}
+
 static void sercon_cursor_pos_set(u8 row, u8 col)
 {
     if (!sercon_splitmode()) {
@@ -193,32 +382,12 @@ static void sercon_cursor_pos_set(u8 row, u8 col)
     }
 }
 
+/* The terminal cursor only follows once something is drawn there
+ * (or from sercon_check_event()) */
 static void sercon_lazy_cursor_sync(void)
 {
-    u8 row = cursor_pos_row();
-    u8 col = cursor_pos_col();
-
-    if (GET_LOW(sercon_row_last) == row &&
-        GET_LOW(sercon_col_last) == col)
-        return;
-
-    if (col == 0 && GET_LOW(sercon_row_last) <= row) {
-        if (GET_LOW(sercon_col_last) != 0) {
-            sercon_putchar('\r');
-            SET_LOW(sercon_col_last, 0);
-        }
-        while (GET_LOW(sercon_row_last) < row) {
-            sercon_putchar('\n');
-            SET_LOW(sercon_row_last, GET_LOW(sercon_row_last)+1);
-        }
-        if (GET_LOW(sercon_row_last) == row &&
-            GET_LOW(sercon_col_last) == col)
-            return;
-    }
-
-    sercon_term_cursor_goto(row, col);
-    SET_LOW(sercon_row_last, row);
-    SET_LOW(sercon_col_last, col);
+    SET_LOW(sercon_row_last, cursor_pos_row());
+    SET_LOW(sercon_col_last, cursor_pos_col());
 }
 
 static void sercon_lazy_flush(void)
@@ -227,11 +396,9 @@ static void sercon_lazy_flush(void)
 
     chr = GET_LOW(sercon_char);
     attr = GET_LOW(sercon_attr);
-    if (chr) {
-        sercon_set_attr(attr);
-        sercon_print_utf8(chr);
-        SET_LOW(sercon_col_last, GET_LOW(sercon_col_last) + 1);
-    }
+    if (chr)
+        sercon_write_cell(GET_LOW(sercon_row_last), GET_LOW(sercon_col_last)
+                          , chr, attr);
 
     sercon_lazy_cursor_sync();
 
@@ -252,10 +419,8 @@ static void sercon_lazy_backspace(void)
 
     sercon_lazy_flush();
     col = cursor_pos_col();
-    if (col > 0) {
-        sercon_putchar(8);
+    if (col > 0)
         sercon_lazy_cursor_update(cursor_pos_row(), col-1);
-    }
 }
 
 static void sercon_lazy_cr(void)
@@ -271,9 +436,8 @@ static void sercon_lazy_lf(void)
     if (row >= video_rows()) {
         /* scrolling up */
         row = video_rows()-1;
-        if (GET_LOW(sercon_row_last) > 0) {
-            SET_LOW(sercon_row_last, GET_LOW(sercon_row_last) - 1);
-        }
+        sercon_lazy_flush();
+        sercon_term_scroll();
     }
     sercon_cursor_pos_set(row, cursor_pos_col());
 }
@@ -378,17 +542,31 @@ static void sercon_1006(struct bregs *regs)
 {
     sercon_lazy_flush();
     if (regs->al == 0) {
-        /* clear rect, do only in case this looks like a fullscreen clear */
         if (regs->ch == 0 &&
             regs->cl == 0 &&
             regs->dh == video_rows()-1 &&
             regs->dl == video_cols()-1) {
+            /* fullscreen clear */
             sercon_set_attr(regs->bh);
             sercon_term_clear_screen();
+        } else if (CONFIG_SERCON_SHADOW) {
+            /* clear rect - only the cells not blank already are sent */
+            u8 row, col;
+            for (row = regs->ch; row <= regs->dh && row < video_rows(); row++)
+                for (col = regs->cl; col <= regs->dl && col < video_cols()
+                         ; col++)
+                    sercon_write_cell(row, col, ' ', regs->bh);
         }
     } else {
+        sercon_term_move(GET_LOW(sercon_row_last), GET_LOW(sercon_col_last));
         sercon_putchar('\r');
         sercon_putchar('\n');
+        u8 row = GET_LOW(sercon_row_term);
+        if (row + 1 >= video_rows())
+            sercon_shadow_scroll(video_rows());
+        else
+            row++;
+        sercon_term_pos(row, 0);
     }
 }
 
@@ -417,14 +595,16 @@ static void sercon_1009(struct bregs *regs)
         sercon_term_clear_screen();
 
     } else {
+        u8 row = cursor_pos_row(), col = cursor_pos_col();
         sercon_lazy_flush();
-        sercon_set_attr(regs->bl);
-        while (count) {
-            sercon_print_utf8(regs->al);
+        while (count && row < video_rows()) {
+            sercon_write_cell(row, col, regs->al, regs->bl);
+            if (++col >= video_cols()) {
+                col = 0;
+                row++;
+            }
             count--;
         }
-        sercon_term_cursor_goto(cursor_pos_row(),
-                                cursor_pos_col());
     }
 }
 
@@ -450,6 +630,52 @@ static void sercon_100e(struct bregs *regs)
     }
 }
 
+/* Write string */
+static void sercon_1013(struct bregs *regs)
+{
+    u8 flag = regs->al, attr = regs->bl, row = regs->dh, col = regs->dl;
+    u16 count = regs->cx, seg = regs->es, offset = regs->bp;
+
+    sercon_lazy_flush();
+    while (count--) {
+        u8 chr = GET_FARVAR(seg, *(u8*)(offset+0));
+        offset++;
+        if (flag & 2) {
+            attr = GET_FARVAR(seg, *(u8*)(offset+0));
+            offset++;
+        }
+        switch (chr) {
+        case 7:
+            sercon_putchar(0x07);
+            break;
+        case 8:
+            if (col > 0)
+                col--;
+            break;
+        case '\r':
+            col = 0;
+            break;
+        case '\n':
+            row++;
+            break;
+        default:
+            sercon_write_cell(row, col, chr, attr);
+            col++;
+            break;
+        }
+        if (col >= video_cols()) {
+            col = 0;
+            row++;
+        }
+        if (row >= video_rows()) {
+            row = video_rows() - 1;
+            sercon_term_scroll();
+        }
+    }
+    if (flag & 1)
+        sercon_lazy_cursor_update(row, col);
+}
+
 /* Get current video mode */
 static void sercon_100f(struct bregs *regs)
 {
@@ -503,9 +729,12 @@ handle_sercon(struct bregs *regs)
     case 0x09: sercon_1009(regs); break;
     case 0x0e: sercon_100e(regs); break;
     case 0x0f: sercon_100f(regs); break;
+    case 0x13: sercon_1013(regs); break;
     case 0x4f: sercon_104f(regs); break;
     default:   sercon_10XX(regs); break;
     }
+
+    sercon_tx_kick();
 }
 
 void sercon_setup(void)
@@ -538,10 +767,26 @@ void sercon_setup(void)
         sercon_real_vga_handler = seabios;
     }
 
+    if (CONFIG_SERCON_SHADOW) {
+        u32 size = SERCON_SHADOW_ROWS * SERCON_SHADOW_COLS * sizeof(u16);
+        u16 *shadow = malloc_low(size);
+        if (shadow) {
+            memset(shadow, 0, size);
+            SET_LOW(sercon_shadow, shadow);
+        } else {
+            warn_noalloc();
+        }
+    }
+
     SET_IVT(0x10, FUNC16(entry_sercon));
     SET_LOW(sercon_port, addr);
+    sercon_term_pos(0xff, 0xff);
     outb(0x03, addr + SEROFF_LCR); // 8N1
-    outb(0x01, addr + 0x02);       // enable fifo
+    outb(0x07, addr + SEROFF_FCR); // enable and reset fifos
+    // A 16550A reports a working fifo in the top bits of the IIR
+    u8 fifo = (inb(addr + SEROFF_IIR) & 0xc0) == 0xc0 ? 16 : 1;
+    SET_LOW(sercon_fifo, fifo);
+    dprintf(3, "sercon: uart fifo size %d\n", fifo);
 }
 
 /****************************************************************
@@ -631,26 +876,31 @@ sercon_check_event(void)
     // check to see if there is a active serial port
     if (!addr)
         return;
-    if (inb(addr + SEROFF_LSR) == 0xFF)
+    u8 lsr = inb(addr + SEROFF_LSR);
+    if (lsr == 0xFF)
         return;
 
-    // flush pending output
-    sercon_lazy_flush();
+    // flush pending output (unless interrupting a wait for the uart)
+    if (!GET_LOW(sercon_txlock)) {
+        sercon_lazy_flush();
+        sercon_term_move(GET_LOW(sercon_row_last), GET_LOW(sercon_col_last));
+        sercon_tx_kick();
+    }
 
-    // read all available data
-    while (inb(addr + SEROFF_LSR) & 0x01) {
+    // read all available data - anything that doesn't fit stays in
+    // the uart fifo until the next tick
+    u8 rb = GET_LOW(rx_bytes);
+    while (lsr & 0x01 && rb < sizeof(rx_buf)) {
         byte = inb(addr + SEROFF_DATA);
-        u8 rb = GET_LOW(rx_bytes);
-        if (rb < sizeof(rx_buf)) {
-            SET_LOW(rx_buf[rb], byte);
-            SET_LOW(rx_bytes, rb + 1);
-            count++;
-        }
+        SET_LOW(rx_buf[rb++], byte);
+        count++;
+        lsr = inb(addr + SEROFF_LSR);
     }
+    SET_LOW(rx_bytes, rb);
 
     for (;;) {
         // no (more) input data
-        u8 rb = GET_LOW(rx_bytes);
+        rb = GET_LOW(rx_bytes);
         if (!rb)
             return;
 
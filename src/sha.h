@@ -3,9 +3,46 @@
 
 #include "types.h" // u32
 
+// Streaming hash state - shared by all of the algorithms below.
+struct sha_ctx {
+    union {
+        u32 h32[8];
+        u64 h64[8];
+    };
+    u32 length;     // Number of bytes hashed so far
+    u8 buf[128];    // Partial block
+};
+
+// Chunk size used by sha1_update_copy()
+#define SHA_COPY_CHUNK 1024
+
+void sha1_init(struct sha_ctx *ctx);
+void sha1_update(struct sha_ctx *ctx, const u8 *data, u32 length);
+void sha1_update_copy(struct sha_ctx *ctx, u8 *dest, const u8 *src, u32 length);
+void sha1_final(struct sha_ctx *ctx, u8 *hash);
 void sha1(const u8 *data, u32 length, u8 *hash);
+void sha256_init(struct sha_ctx *ctx);
+void sha256_update(struct sha_ctx *ctx, const u8 *data, u32 length);
+void sha256_final(struct sha_ctx *ctx, u8 *hash);
 void sha256(const u8 *data, u32 length, u8 *hash);
+void sha384_init(struct sha_ctx *ctx);
+void sha384_final(struct sha_ctx *ctx, u8 *hash);
 void sha384(const u8 *data, u32 length, u8 *hash);
+void sha512_init(struct sha_ctx *ctx);
+void sha512_update(struct sha_ctx *ctx, const u8 *data, u32 length);
+void sha512_final(struct sha_ctx *ctx, u8 *hash);
 void sha512(const u8 *data, u32 length, u8 *hash);
+#define sha384_update sha512_update
+
+// sha_ni.c
+void sha_ni_setup(void);
+int sha_ni_available(void);
+void sha1_ni_blocks(u32 *h, const u8 *data, u32 count);
+void sha256_ni_blocks(u32 *h, const u8 *data, u32 count);
+int sha512_sse2_available(void);
+void sha512_sse2_blocks(u64 *h, const u8 *data, u32 count);
+
+// sha512.c
+extern const u64 sha512_k[80];
 
 #endif // sha.h
@@ -17,13 +17,8 @@
 #include "string.h" // memcpy
 #include "x86.h" // rol
 
-typedef struct _sha1_ctx {
-    u32 h[5];
-} sha1_ctx;
-
-
 static void
-sha1_block(u32 *w, sha1_ctx *ctx)
+sha1_block(u32 *w, struct sha_ctx *ctx)
 {
     u32 i;
     u32 a,b,c,d,e,f;
@@ -42,11 +37,11 @@ sha1_block(u32 *w, sha1_ctx *ctx)
         w[i] = rol(tmp,1);
     }
 
-    a = ctx->h[0];
-    b = ctx->h[1];
-    c = ctx->h[2];
-    d = ctx->h[3];
-    e = ctx->h[4];
+    a = ctx->h32[0];
+    b = ctx->h32[1];
+    c = ctx->h32[2];
+    d = ctx->h32[3];
+    e = ctx->h32[4];
 
     for (i = 0; i <= 79; i++) {
         if (i <= 19) {
@@ -75,73 +70,114 @@ sha1_block(u32 *w, sha1_ctx *ctx)
         a = tmp;
     }
 
-    ctx->h[0] += a;
-    ctx->h[1] += b;
-    ctx->h[2] += c;
-    ctx->h[3] += d;
-    ctx->h[4] += e;
+    ctx->h32[0] += a;
+    ctx->h32[1] += b;
+    ctx->h32[2] += c;
+    ctx->h32[3] += d;
+    ctx->h32[4] += e;
 }
 
 
 static void
-sha1_do(sha1_ctx *ctx, const u8 *data32, u32 length)
+sha1_blocks(struct sha_ctx *ctx, const u8 *data, u32 count)
 {
-    u32 offset;
-    u16 num;
-    u32 bits = 0;
     u32 w[80];
-    u64 tmp;
 
-    /* treat data in 64-byte chunks */
-    for (offset = 0; length - offset >= 64; offset += 64) {
-        memcpy(w, data32 + offset, 64);
-        sha1_block((u32 *)w, ctx);
-        bits += (64 * 8);
+    if (sha_ni_available()) {
+        sha1_ni_blocks(ctx->h32, data, count);
+        return;
+    }
+    for (; count; count--, data += 64) {
+        memcpy(w, data, 64);
+        sha1_block(w, ctx);
     }
+}
 
-    /* last block with less than 64 bytes */
-    num = length - offset;
-    bits += (num << 3);
+void
+sha1_init(struct sha_ctx *ctx)
+{
+    ctx->h32[0] = 0x67452301;
+    ctx->h32[1] = 0xefcdab89;
+    ctx->h32[2] = 0x98badcfe;
+    ctx->h32[3] = 0x10325476;
+    ctx->h32[4] = 0xc3d2e1f0;
+    ctx->length = 0;
+}
 
-    memcpy(w, data32 + offset, num);
-    ((u8 *)w)[num] = 0x80;
-    if (64 - (num + 1) > 0)
-        memset( &((u8 *)w)[num + 1], 0x0, 64 - (num + 1));
+void
+sha1_update(struct sha_ctx *ctx, const u8 *data, u32 length)
+{
+    u32 used = ctx->length & 63;
+    ctx->length += length;
+    if (used) {
+        /* complete a previously buffered partial block */
+        u32 num = 64 - used;
+        if (num > length)
+            num = length;
+        memcpy(&ctx->buf[used], data, num);
+        data += num;
+        length -= num;
+        if (used + num < 64)
+            return;
+        sha1_blocks(ctx, ctx->buf, 1);
+    }
 
-    if (num >= 56) {
+    /* treat data in 64-byte chunks */
+    sha1_blocks(ctx, data, length / 64);
+    memcpy(ctx->buf, data + (length & ~63), length & 63);
+}
+
+// Copy data (possibly from a rom bar) and add it to the hash.  Each
+// chunk is hashed from the copy while it is still in the cache, so the
+// (slow) source is only read once.
+void
+sha1_update_copy(struct sha_ctx *ctx, u8 *dest, const u8 *src, u32 length)
+{
+    while (length) {
+        u32 len = length < SHA_COPY_CHUNK ? length : SHA_COPY_CHUNK;
+        iomemcpy(dest, src, len);
+        sha1_update(ctx, dest, len);
+        dest += len;
+        src += len;
+        length -= len;
+    }
+}
+
+void
+sha1_final(struct sha_ctx *ctx, u8 *hash)
+{
+    u32 used = ctx->length & 63;
+    u64 tmp;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
         /* cannot append number of bits here */
-        sha1_block((u32 *)w, ctx);
-        memset(w, 0x0, 60);
+        memset(&ctx->buf[used], 0x0, 64 - used);
+        sha1_blocks(ctx, ctx->buf, 1);
+        used = 0;
     }
+    memset(&ctx->buf[used], 0x0, 56 - used);
 
     /* write number of bits to end of block */
-    tmp = __swab64(bits);
-    memcpy(&w[14], &tmp, 8);
-
-    sha1_block(w, ctx);
+    tmp = __swab64((u64)ctx->length << 3);
+    memcpy(&ctx->buf[56], &tmp, 8);
+    sha1_blocks(ctx, ctx->buf, 1);
 
     /* need to switch result's endianness */
-    for (num = 0; num < 5; num++)
-        ctx->h[num] = cpu_to_be32(ctx->h[num]);
+    int i;
+    for (i = 0; i < 5; i++)
+        ctx->h32[i] = cpu_to_be32(ctx->h32[i]);
+    memcpy(hash, ctx->h32, 20);
 }
 
-
 void
 sha1(const u8 *data, u32 length, u8 *hash)
 {
     if (!CONFIG_TCGBIOS)
         return;
 
-    sha1_ctx ctx = {
-        .h[0] = 0x67452301,
-        .h[1] = 0xefcdab89,
-        .h[2] = 0x98badcfe,
-        .h[3] = 0x10325476,
-        .h[4] = 0xc3d2e1f0,
-    };
-
-    sha1_do(&ctx, data, length);
-    memcpy(hash, &ctx.h[0], 20);
-
-    return;
+    struct sha_ctx ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, data, length);
+    sha1_final(&ctx, hash);
 }
@@ -20,10 +20,6 @@
 #include "string.h"
 #include "x86.h"
 
-typedef struct _sha256_ctx {
-    u32 h[8];
-} sha256_ctx;
-
 static inline u32 Ch(u32 x, u32 y, u32 z)
 {
     return (x & y) | ((x ^ 0xffffffff) & z);
@@ -54,7 +50,7 @@ static inline u32 sigma1(u32 x)
     return ror(x, 17) ^ ror(x, 19) ^ (x >> 10);
 }
 
-static void sha256_block(u32 *w, sha256_ctx *ctx)
+static void sha256_block(u32 *w, struct sha_ctx *ctx)
 {
     u32 t;
     u32 a, b, c, d, e, f, g, h;
@@ -101,14 +97,14 @@ static void sha256_block(u32 *w, sha256_ctx *ctx)
     /*
      * step 2: a = H0, b = H1, c = H2, d = H3, e = H4, f = H5, g = H6, h = H7
      */
-    a = ctx->h[0];
-    b = ctx->h[1];
-    c = ctx->h[2];
-    d = ctx->h[3];
-    e = ctx->h[4];
-    f = ctx->h[5];
-    g = ctx->h[6];
-    h = ctx->h[7];
+    a = ctx->h32[0];
+    b = ctx->h32[1];
+    c = ctx->h32[2];
+    d = ctx->h32[3];
+    e = ctx->h32[4];
+    f = ctx->h32[5];
+    g = ctx->h32[6];
+    h = ctx->h32[7];
 
     /*
      * step 3: For i = 0 to 63:
@@ -133,79 +129,107 @@ static void sha256_block(u32 *w, sha256_ctx *ctx)
      * step 4:
      *    H0 = a + H0, H1 = b + H1, H2 = c + H2, H3 = d + H3, H4 = e + H4
      */
-    ctx->h[0] += a;
-    ctx->h[1] += b;
-    ctx->h[2] += c;
-    ctx->h[3] += d;
-    ctx->h[4] += e;
-    ctx->h[5] += f;
-    ctx->h[6] += g;
-    ctx->h[7] += h;
+    ctx->h32[0] += a;
+    ctx->h32[1] += b;
+    ctx->h32[2] += c;
+    ctx->h32[3] += d;
+    ctx->h32[4] += e;
+    ctx->h32[5] += f;
+    ctx->h32[6] += g;
+    ctx->h32[7] += h;
 }
 
-static void sha256_do(sha256_ctx *ctx, const u8 *data32, u32 length)
+static void sha256_blocks(struct sha_ctx *ctx, const u8 *data, u32 count)
 {
-    u32 offset;
-    u16 num;
-    u32 bits = 0;
     u32 w[64];
-    u64 tmp;
 
-    /* treat data in 64-byte chunks */
-    for (offset = 0; length - offset >= 64; offset += 64) {
-        memcpy(w, data32 + offset, 64);
-        sha256_block((u32 *)w, ctx);
-        bits += (64 * 8);
+    if (sha_ni_available()) {
+        sha256_ni_blocks(ctx->h32, data, count);
+        return;
     }
+    for (; count; count--, data += 64) {
+        memcpy(w, data, 64);
+        sha256_block(w, ctx);
+    }
+}
+
+void sha256_init(struct sha_ctx *ctx)
+{
+    /*
+     * FIPS 180-4: 6.2.1
+     *   -> 5.3.3: initial hash value
+     */
+    static const u32 sha256_h0[8] = {
+        0x6a09e667,
+        0xbb67ae85,
+        0x3c6ef372,
+        0xa54ff53a,
+        0x510e527f,
+        0x9b05688c,
+        0x1f83d9ab,
+        0x5be0cd19
+    };
 
-    /* last block with less than 64 bytes */
-    num = length - offset;
-    bits += (num << 3);
+    memcpy(ctx->h32, sha256_h0, sizeof(sha256_h0));
+    ctx->length = 0;
+}
+
+void sha256_update(struct sha_ctx *ctx, const u8 *data, u32 length)
+{
+    u32 used = ctx->length & 63;
+    ctx->length += length;
+    if (used) {
+        /* complete a previously buffered partial block */
+        u32 num = 64 - used;
+        if (num > length)
+            num = length;
+        memcpy(&ctx->buf[used], data, num);
+        data += num;
+        length -= num;
+        if (used + num < 64)
+            return;
+        sha256_blocks(ctx, ctx->buf, 1);
+    }
+
+    /* treat data in 64-byte chunks */
+    sha256_blocks(ctx, data, length / 64);
+    memcpy(ctx->buf, data + (length & ~63), length & 63);
+}
+
+void sha256_final(struct sha_ctx *ctx, u8 *hash)
+{
+    u32 used = ctx->length & 63;
+    u64 tmp;
 
-    memcpy(w, data32 + offset, num);
     /*
      * FIPS 180-4 5.1: Padding the Message
      */
-    ((u8 *)w)[num] = 0x80;
-    if (64 - (num + 1) > 0)
-        memset( &((u8 *)w)[num + 1], 0, 64 - (num + 1));
-
-    if (num >= 56) {
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
         /* cannot append number of bits here */
-        sha256_block((u32 *)w, ctx);
-        memset(w, 0, 60);
+        memset(&ctx->buf[used], 0, 64 - used);
+        sha256_blocks(ctx, ctx->buf, 1);
+        used = 0;
     }
+    memset(&ctx->buf[used], 0, 56 - used);
 
     /* write number of bits to end of block */
-    tmp = cpu_to_be64(bits);
-    memcpy(&w[14], &tmp, 8);
-
-    sha256_block(w, ctx);
+    tmp = cpu_to_be64((u64)ctx->length << 3);
+    memcpy(&ctx->buf[56], &tmp, 8);
+    sha256_blocks(ctx, ctx->buf, 1);
 
     /* need to switch result's endianness */
-    for (num = 0; num < 8; num++)
-        ctx->h[num] = cpu_to_be32(ctx->h[num]);
+    int i;
+    for (i = 0; i < 8; i++)
+        ctx->h32[i] = cpu_to_be32(ctx->h32[i]);
+    memcpy(hash, ctx->h32, 32);
 }
 
 void sha256(const u8 *data, u32 length, u8 *hash)
 {
-    sha256_ctx ctx = {
-        .h = {
-            /*
-             * FIPS 180-4: 6.2.1
-             *   -> 5.3.3: initial hash value
-             */
-            0x6a09e667,
-            0xbb67ae85,
-            0x3c6ef372,
-            0xa54ff53a,
-            0x510e527f,
-            0x9b05688c,
-            0x1f83d9ab,
-            0x5be0cd19
-        }
-    };
+    struct sha_ctx ctx;
 
-    sha256_do(&ctx, data, length);
-    memcpy(hash, ctx.h, sizeof(ctx.h));
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, length);
+    sha256_final(&ctx, hash);
 }
@@ -0,0 +1,376 @@
+// SHA block functions using the x86 SHA extensions and SSE2.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "byteorder.h" // be64_to_cpu
+#include "config.h" // CONFIG_TCGBIOS
+#include "output.h" // dprintf
+#include "sha.h" // sha_ni_setup
+#include "string.h" // memcmp
+#include "util.h" // HaveRunPost
+#include "x86.h" // cpuid
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+typedef unsigned long long v2du __attribute__((vector_size(16)));
+
+#define SHA_NI_TARGET __attribute__((target("sse2,ssse3,sse4.1,sha"))) noinline
+
+#define loadu(p) ({ v4si __v; __builtin_memcpy(&__v, (p), 16); __v; })
+#define storeu(p, v) ({ v4si __v = (v); __builtin_memcpy((p), &__v, 16); })
+#define pshufd(v, imm) __builtin_ia32_pshufd((v), (imm))
+#define pshufb(v, m) ((v4si)__builtin_ia32_pshufb128((v16qi)(v), (v16qi)(m)))
+#define palignr(a, b, n)                                                \
+    ((v4si)__builtin_ia32_palignr128((v2di)(a), (v2di)(b), (n) * 8))
+#define pblendw(a, b, imm)                                              \
+    ((v4si)__builtin_ia32_pblendw128((v8hi)(a), (v8hi)(b), (imm)))
+
+#define SHA_SSE2_TARGET __attribute__((target("sse2"))) noinline
+
+static int ShaNiEnabled, Sha512Sse2Enabled;
+
+// The SSE registers are only used during POST - at runtime they may
+// hold state belonging to the caller.
+int
+sha_ni_available(void)
+{
+    return ShaNiEnabled && HaveRunPost == 1;
+}
+
+int
+sha512_sse2_available(void)
+{
+    return Sha512Sse2Enabled && HaveRunPost == 1;
+}
+
+
+/****************************************************************
+ * SHA-256
+ ****************************************************************/
+
+static const u32 sha256_k[64] __aligned(16) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static SHA_NI_TARGET void
+__sha256_ni_blocks(u32 *h, const u8 *data, u32 count)
+{
+    const v4si bswap = (v4si)(v2di){ 0x0405060700010203ULL
+                                     , 0x0c0d0e0f08090a0bULL };
+    // Convert the state to the ABEF/CDGH layout used by sha256rnds2
+    v4si tmp = pshufd(loadu(&h[0]), 0xb1);
+    v4si state1 = pshufd(loadu(&h[4]), 0x1b);
+    v4si state0 = palignr(tmp, state1, 8);
+    state1 = pblendw(state1, tmp, 0xf0);
+
+    while (count--) {
+        v4si abef = state0, cdgh = state1, msg[4];
+        int i;
+        for (i = 0; i < 16; i++) {
+            if (i < 4)
+                msg[i] = pshufb(loadu(data + i * 16), bswap);
+            v4si m = msg[i & 3] + loadu(&sha256_k[i * 4]);
+            state1 = __builtin_ia32_sha256rnds2(state1, state0, m);
+            if (i >= 3 && i <= 14) {
+                v4si t = palignr(msg[i & 3], msg[(i - 1) & 3], 4);
+                msg[(i + 1) & 3] += t;
+                msg[(i + 1) & 3] = __builtin_ia32_sha256msg2(
+                    msg[(i + 1) & 3], msg[i & 3]);
+            }
+            state0 = __builtin_ia32_sha256rnds2(state0, state1
+                                                , pshufd(m, 0x0e));
+            if (i >= 1 && i <= 12)
+                msg[(i - 1) & 3] = __builtin_ia32_sha256msg1(
+                    msg[(i - 1) & 3], msg[i & 3]);
+        }
+        state0 += abef;
+        state1 += cdgh;
+        data += 64;
+    }
+
+    tmp = pshufd(state0, 0x1b);
+    state1 = pshufd(state1, 0xb1);
+    storeu(&h[0], pblendw(tmp, state1, 0xf0));
+    storeu(&h[4], palignr(state1, tmp, 8));
+}
+
+// Run the sha256 compression function over 'count' 64 byte blocks.
+void
+sha256_ni_blocks(u32 *h, const u8 *data, u32 count)
+{
+    u32 cr0, cr4;
+    sse_enable(&cr0, &cr4);
+    __sha256_ni_blocks(h, data, count);
+    sse_restore(cr0, cr4);
+}
+
+
+/****************************************************************
+ * SHA-1
+ ****************************************************************/
+
+// Four rounds of sha1 - 'g' is the group of four rounds (0-19).
+#define SHA1_ROUNDS(g) do {                                             \
+        v4si *ein = (g) & 1 ? &e1 : &e0, *eout = (g) & 1 ? &e0 : &e1;   \
+        if ((g) == 0)                                                   \
+            *ein += msg[0];                                             \
+        else                                                            \
+            *ein = __builtin_ia32_sha1nexte(*ein, msg[(g) & 3]);        \
+        *eout = abcd;                                                   \
+        if ((g) >= 3 && (g) <= 18)                                      \
+            msg[((g) + 1) & 3] = __builtin_ia32_sha1msg2(               \
+                msg[((g) + 1) & 3], msg[(g) & 3]);                      \
+        abcd = __builtin_ia32_sha1rnds4(abcd, *ein, (g) / 5);           \
+        if ((g) >= 1 && (g) <= 16)                                      \
+            msg[((g) - 1) & 3] = __builtin_ia32_sha1msg1(               \
+                msg[((g) - 1) & 3], msg[(g) & 3]);                      \
+        if ((g) >= 2 && (g) <= 17)                                      \
+            msg[((g) - 2) & 3] ^= msg[(g) & 3];                         \
+    } while (0)
+
+static SHA_NI_TARGET void
+__sha1_ni_blocks(u32 *h, const u8 *data, u32 count)
+{
+    const v4si bswap = (v4si)(v2di){ 0x08090a0b0c0d0e0fULL
+                                     , 0x0001020304050607ULL };
+    v4si abcd = pshufd(loadu(&h[0]), 0x1b);
+    v4si e0 = (v4si){ 0, 0, 0, h[4] }, e1;
+
+    while (count--) {
+        v4si abcd_save = abcd, e0_save = e0, msg[4];
+        int i;
+        for (i = 0; i < 4; i++)
+            msg[i] = pshufb(loadu(data + i * 16), bswap);
+        SHA1_ROUNDS(0);  SHA1_ROUNDS(1);  SHA1_ROUNDS(2);  SHA1_ROUNDS(3);
+        SHA1_ROUNDS(4);  SHA1_ROUNDS(5);  SHA1_ROUNDS(6);  SHA1_ROUNDS(7);
+        SHA1_ROUNDS(8);  SHA1_ROUNDS(9);  SHA1_ROUNDS(10); SHA1_ROUNDS(11);
+        SHA1_ROUNDS(12); SHA1_ROUNDS(13); SHA1_ROUNDS(14); SHA1_ROUNDS(15);
+        SHA1_ROUNDS(16); SHA1_ROUNDS(17); SHA1_ROUNDS(18); SHA1_ROUNDS(19);
+        e0 = __builtin_ia32_sha1nexte(e0, e0_save);
+        abcd += abcd_save;
+        data += 64;
+    }
+
+    storeu(&h[0], pshufd(abcd, 0x1b));
+    h[4] = e0[3];
+}
+
+// Run the sha1 compression function over 'count' 64 byte blocks.
+void
+sha1_ni_blocks(u32 *h, const u8 *data, u32 count)
+{
+    u32 cr0, cr4;
+    sse_enable(&cr0, &cr4);
+    __sha1_ni_blocks(h, data, count);
+    sse_restore(cr0, cr4);
+}
+
+
+/****************************************************************
+ * SHA-512 (SSE2)
+ ****************************************************************/
+
+// In 32bit mode every 64bit rotate and add of sha512 takes several
+// instructions on register pairs.  SSE2 has 64bit shifts and adds, so
+// the rounds are run on the low quadword of xmm registers and the
+// message schedule is computed two words at a time.
+
+#define ror64x(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define sum0x(x) (ror64x((x), 28) ^ ror64x((x), 34) ^ ror64x((x), 39))
+#define sum1x(x) (ror64x((x), 14) ^ ror64x((x), 18) ^ ror64x((x), 41))
+#define sigma0x(x) (ror64x((x), 1) ^ ror64x((x), 8) ^ ((x) >> 7))
+#define sigma1x(x) (ror64x((x), 19) ^ ror64x((x), 61) ^ ((x) >> 6))
+// The high word of 'a' and the low word of 'b'
+#define midq(a, b) __builtin_shuffle((a), (b), (v2du){ 1, 2 })
+
+static SHA_SSE2_TARGET void
+__sha512_sse2_blocks(u64 *h, const u8 *data, u32 count)
+{
+    u64 wk[80] __aligned(16);
+    while (count--) {
+        // Message schedule (plus the round constants) - w[] holds the
+        // last 16 words as pairs.
+        v2du w[8];
+        int i;
+        for (i = 0; i < 40; i++) {
+            v2du cur;
+            if (i < 8) {
+                u64 m[2];
+                memcpy(m, data + i * 16, sizeof(m));
+                cur = (v2du){ be64_to_cpu(m[0]), be64_to_cpu(m[1]) };
+            } else {
+                v2du w2 = w[(i - 1) & 7];
+                v2du w7 = midq(w[(i - 4) & 7], w[(i - 3) & 7]);
+                v2du w15 = midq(w[i & 7], w[(i + 1) & 7]);
+                cur = sigma1x(w2) + w7 + sigma0x(w15) + w[i & 7];
+            }
+            w[i & 7] = cur;
+            *(v2du*)&wk[i * 2] = cur + *(v2du*)&sha512_k[i * 2];
+        }
+
+        v2du a = { h[0] }, b = { h[1] }, c = { h[2] }, d = { h[3] };
+        v2du e = { h[4] }, f = { h[5] }, g = { h[6] }, hh = { h[7] };
+        for (i = 0; i < 80; i++) {
+            v2du t1 = hh + sum1x(e) + ((e & f) ^ (~e & g)) + (v2du){ wk[i] };
+            v2du t2 = sum0x(a) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a[0];
+        h[1] += b[0];
+        h[2] += c[0];
+        h[3] += d[0];
+        h[4] += e[0];
+        h[5] += f[0];
+        h[6] += g[0];
+        h[7] += hh[0];
+        data += 128;
+    }
+}
+
+// Run the sha512 compression function over 'count' 128 byte blocks.
+void
+sha512_sse2_blocks(u64 *h, const u8 *data, u32 count)
+{
+    u32 cr0, cr4;
+    sse_enable(&cr0, &cr4);
+    __sha512_sse2_blocks(h, data, count);
+    sse_restore(cr0, cr4);
+}
+
+
+/****************************************************************
+ * Setup
+ ****************************************************************/
+
+// FIPS 180-4 example vectors - "abc" and the two block message
+static const char sha_test_abc[] = "abc";
+static const char sha_test_long[] =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+static const u8 sha1_test_digest[2][20] = {
+    { 0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+      0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d },
+    { 0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae,
+      0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1 },
+};
+// "abc" and the two block (for sha512) message
+static const char sha512_test_long[] =
+    "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+    "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+static const u8 sha512_test_digest[2][64] = {
+    { 0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba,
+      0xcc, 0x41, 0x73, 0x49, 0xae, 0x20, 0x41, 0x31,
+      0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2,
+      0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a,
+      0x21, 0x92, 0x99, 0x2a, 0x27, 0x4f, 0xc1, 0xa8,
+      0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd,
+      0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e,
+      0x2a, 0x9a, 0xc9, 0x4f, 0xa5, 0x4c, 0xa4, 0x9f },
+    { 0x8e, 0x95, 0x9b, 0x75, 0xda, 0xe3, 0x13, 0xda,
+      0x8c, 0xf4, 0xf7, 0x28, 0x14, 0xfc, 0x14, 0x3f,
+      0x8f, 0x77, 0x79, 0xc6, 0xeb, 0x9f, 0x7f, 0xa1,
+      0x72, 0x99, 0xae, 0xad, 0xb6, 0x88, 0x90, 0x18,
+      0x50, 0x1d, 0x28, 0x9e, 0x49, 0x00, 0xf7, 0xe4,
+      0x33, 0x1b, 0x99, 0xde, 0xc4, 0xb5, 0x43, 0x3a,
+      0xc7, 0xd3, 0x29, 0xee, 0xb6, 0xdd, 0x26, 0x54,
+      0x5e, 0x96, 0xe5, 0x5b, 0x87, 0x4b, 0xe9, 0x09 },
+};
+static const u8 sha256_test_digest[2][32] = {
+    { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+      0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+      0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+      0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad },
+    { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+      0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+      0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+      0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 },
+};
+
+// Check the currently selected implementation against the test vectors
+static int
+sha_selftest(void)
+{
+    const char *msgs[2] = { sha_test_abc, sha_test_long };
+    const char *msgs512[2] = { sha_test_abc, sha512_test_long };
+    int i;
+    for (i = 0; i < 2; i++) {
+        u8 hash[64];
+        sha1((u8*)msgs[i], strlen(msgs[i]), hash);
+        if (memcmp(hash, sha1_test_digest[i], sizeof(sha1_test_digest[i])))
+            return -1;
+        sha256((u8*)msgs[i], strlen(msgs[i]), hash);
+        if (memcmp(hash, sha256_test_digest[i]
+                   , sizeof(sha256_test_digest[i])))
+            return -1;
+        sha512((u8*)msgs512[i], strlen(msgs512[i]), hash);
+        if (memcmp(hash, sha512_test_digest[i]
+                   , sizeof(sha512_test_digest[i])))
+            return -1;
+    }
+    return 0;
+}
+
+void
+sha_ni_setup(void)
+{
+    if (!CONFIG_TCGBIOS)
+        return;
+    ShaNiEnabled = Sha512Sse2Enabled = 0;
+    if (sha_selftest())
+        dprintf(1, "WARNING: sha self test failed\n");
+
+    u32 eax, ebx, ecx, edx, cpuid_max;
+    cpuid(0, &cpuid_max, &ebx, &ecx, &edx);
+    if (cpuid_max < 1)
+        return;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_SSE2))
+        return;
+    Sha512Sse2Enabled = 1;
+    if (sha_selftest()) {
+        dprintf(1, "WARNING: sse2 sha512 failed self test - not using\n");
+        Sha512Sse2Enabled = 0;
+        return;
+    }
+    dprintf(1, "Using sse2 for sha384/sha512\n");
+
+    if (cpuid_max < 7 || !(ecx & CPUID_ECX_SSSE3)
+        || !(ecx & CPUID_ECX_SSE41))
+        return;
+    __cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ebx & CPUID7_EBX_SHA))
+        return;
+
+    ShaNiEnabled = 1;
+    if (sha_selftest()) {
+        dprintf(1, "WARNING: sha extensions failed self test - not using\n");
+        ShaNiEnabled = 0;
+        return;
+    }
+    dprintf(1, "Using x86 sha extensions for sha1/sha256\n");
+}
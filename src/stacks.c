@@ -36,6 +36,9 @@ struct {
 #define C16_SMM 2
 
 int HaveSmmCall32 VARFSEG;
+// Use the (measured to be cheaper) direct transition instead of smm
+// unless the cpu is in vm86 mode.
+u8 Call32Direct VARFSEG;
 
 // Backup state in preparation for call32
 static int
@@ -234,13 +237,11 @@ call16_smm(u32 eax, u32 edx, void *func)
     return eax;
 }
 
-// Call a 32bit SeaBIOS function from a 16bit SeaBIOS function.
-u32 VISIBLE16
-__call32(void *func, u32 eax, u32 errret)
+// Call a 32bit SeaBIOS function by switching to protected mode
+static u32
+call32_direct(void *func, u32 eax, u32 errret)
 {
     ASSERT16();
-    if (CONFIG_CALL32_SMM && GET_GLOBAL(HaveSmmCall32))
-        return call32_smm(func, eax);
     // Jump direclty to 32bit mode - this clobbers the 16bit segment
     // selector registers.
     int ret = call32_prep(C16_BIG);
@@ -275,6 +276,66 @@ __call32(void *func, u32 eax, u32 errret)
     return eax;
 }
 
+// Call a 32bit SeaBIOS function from a 16bit SeaBIOS function.
+u32 VISIBLE16
+__call32(void *func, u32 eax, u32 errret)
+{
+    ASSERT16();
+    if (CONFIG_CALL32_SMM && GET_GLOBAL(HaveSmmCall32)
+        && (!GET_GLOBAL(Call32Direct) || cr0_vm86_read() & CR0_PE))
+        return call32_smm(func, eax);
+    return call32_direct(func, eax, errret);
+}
+
+#define CALL32_BENCH_COUNT 16
+
+u32 VISIBLE32INIT
+call32_bench_nop(u32 eax)
+{
+    return eax;
+}
+
+// Return the tsc cycles taken by CALL32_BENCH_COUNT round trips
+u32 VISIBLE16
+call32_bench16(u32 method)
+{
+    extern void _cfunc32flat_call32_bench_nop(void);
+    void *func = _cfunc32flat_call32_bench_nop;
+    u64 start = rdtscll();
+    int i;
+    for (i = 0; i < CALL32_BENCH_COUNT; i++) {
+        if (CONFIG_CALL32_SMM && method == C16_SMM)
+            call32_smm(func, 0);
+        else
+            call32_direct(func, 0, 0);
+    }
+    return rdtscll() - start;
+}
+
+// Measure the cost of each 16bit to 32bit transition method and
+// select the cheaper one for runtime calls.
+void
+call32_setup(void)
+{
+    u32 eax, ebx, ecx, edx, features = 0;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax > 0)
+        cpuid(1, &eax, &ebx, &ecx, &features);
+    if (!(features & CPUID_TSC))
+        return;
+    u32 direct = stack_hop_back(call32_bench16, C16_BIG, 0);
+    direct /= CALL32_BENCH_COUNT;
+    if (!CONFIG_CALL32_SMM || !HaveSmmCall32) {
+        dprintf(1, "call32: direct %u cycles\n", direct);
+        return;
+    }
+    u32 smm = stack_hop_back(call32_bench16, C16_SMM, 0);
+    smm /= CALL32_BENCH_COUNT;
+    Call32Direct = direct < smm && romfile_loadint("etc/call32-direct", 1);
+    dprintf(1, "call32: direct %u cycles, smm %u cycles - using %s\n"
+            , direct, smm, Call32Direct ? "direct" : "smm");
+}
+
 // Call a 16bit SeaBIOS function, restoring the mode from last call32().
 static u32
 call16(u32 eax, u32 edx, void *func)
@@ -318,6 +379,124 @@ call16(u32 eax, u32 edx, void *func)
 }
 
 
+/****************************************************************
+ * Stack usage profiling
+ ****************************************************************/
+
+// With CONFIG_STACK_PROFILE the unused part of the extra stack and of
+// each thread stack is filled with a pattern.  The lowest word that
+// no longer holds the pattern marks the deepest point reached.
+#define STACK_PAINT 0xa55aa55a
+#define STACK_PROF_ENTRIES 16
+
+struct stack_prof_s {
+    u32 func;
+    u16 max;
+    u16 count;
+};
+
+// Extra stack use by 16bit entry point (interrupt handler or
+// stack_hop() target) and the entry point that last ran on it.
+struct stack_prof_s StackProfEntry[STACK_PROF_ENTRIES] VARLOW;
+struct stack_prof_s StackProfOther VARLOW;
+u32 StackProfLast VARLOW;
+u16 StackProfPeak VARLOW;
+// Thread stack use by thread function
+struct stack_prof_s StackProfThread[STACK_PROF_ENTRIES] VARLOW;
+
+// Fill the words from 'start' up to 'end'.  In 16bit mode only the
+// extra stack may be passed.
+static void
+stack_paint(u32 *start, u32 *end)
+{
+    for (; start < end; start++)
+        SET_LOW(*start, STACK_PAINT);
+}
+
+// Find the lowest word between 'start' and 'end' that was overwritten.
+static u32 *
+stack_scan(u32 *start, u32 *end)
+{
+    while (start < end && GET_LOW(*start) == STACK_PAINT)
+        start++;
+    return start;
+}
+
+static void
+stack_prof_update(struct stack_prof_s *e, u32 used)
+{
+    SET_LOW(e->count, GET_LOW(e->count) + 1);
+    if (used > GET_LOW(e->max))
+        SET_LOW(e->max, used);
+}
+
+// Note 'used' bytes of stack for 'func' - the last entry of the table
+// accounts for everything once the others are taken.
+static void
+stack_prof_note(struct stack_prof_s *table, u32 func, u32 used)
+{
+    struct stack_prof_s *e = table;
+    for (; e < &table[STACK_PROF_ENTRIES-1]; e++) {
+        u32 efunc = GET_LOW(e->func);
+        if (efunc == func)
+            break;
+        if (!efunc) {
+            SET_LOW(e->func, func);
+            break;
+        }
+    }
+    stack_prof_update(e, used);
+}
+
+// Account the extra stack use since the last check to 'func' (or as
+// unknown if 'func' is zero) and repaint it.  Use by an entry point
+// reached after a stack_hop_back() is left to the outer entry point.
+static void
+stack_prof_extra(u32 func)
+{
+    if (!CONFIG_STACK_PROFILE)
+        return;
+    u32 *top = (void*)&ExtraStack[BUILD_EXTRA_STACK_SIZE];
+    if (MODESEGMENT && GET_LOW(StackPos) != (void*)top)
+        return;
+    // Only the part below the current frame may be repainted
+    u32 *end = top;
+    if (on_extra_stack())
+        end = (void*)ALIGN_DOWN(getesp(), 4);
+    u32 *pos = stack_scan((void*)ExtraStack, end);
+    if (pos >= end)
+        return;
+    u32 used = (void*)top - (void*)pos;
+    if (used > GET_LOW(StackProfPeak))
+        SET_LOW(StackProfPeak, used);
+    if (func)
+        stack_prof_note(StackProfEntry, func, used);
+    else
+        stack_prof_update(&StackProfOther, used);
+    // Repaint without calling other code (which would use the stack)
+    for (; pos < end; pos++)
+        SET_LOW(*pos, STACK_PAINT);
+}
+
+// Called from the romlayout.S interrupt entry points after switching
+// to the extra stack (with CONFIG_STACK_PROFILE).
+void VISIBLE16
+stack_prof_entry(u32 func)
+{
+    stack_prof_extra(GET_LOW(StackProfLast));
+    SET_LOW(StackProfLast, func);
+}
+
+// Paint the extra stack - called before its first use.
+void
+stack_profile_setup(void)
+{
+    if (CONFIG_STACK_PROFILE)
+        stack_paint((void*)ExtraStack
+                    , (void*)&ExtraStack[BUILD_EXTRA_STACK_SIZE]);
+}
+
+
 /****************************************************************
  * Extra 16bit stack
  ****************************************************************/
@@ -340,6 +519,8 @@ __stack_hop(u32 eax, u32 edx, void *func)
     if (on_extra_stack())
         return ((u32 (*)(u32, u32))func)(eax, edx);
     ASSERT16();
+    stack_prof_extra(GET_LOW(StackProfLast));
+    u32 hopfunc = (u32)func;
     u16 stack_seg = SEG_LOW;
     u32 bkup_ss, bkup_esp;
     asm volatile(
@@ -363,6 +544,10 @@ __stack_hop(u32 eax, u32 edx, void *func)
         : "+a" (eax), "+d" (edx), "+c" (func), "=&r" (bkup_ss), "=&r" (bkup_esp)
         : "m" (StackPos), "r" (stack_seg)
         : "cc", "memory");
+    if (CONFIG_STACK_PROFILE) {
+        stack_prof_extra(hopfunc);
+        SET_LOW(StackProfLast, 0);
+    }
     return eax;
 }
 
@@ -463,6 +648,87 @@ reset(void)
 }
 
 
+/****************************************************************
+ * Interrupt entry statistics
+ ****************************************************************/
+
+#define ESTATS_MAGIC 0x54534e45 // "ENST"
+#define ESTATS_VERSION 1
+#define ESTATS_ENTRIES 24
+
+// Binary layout of the statistics - the host reads a copy taken before
+// boot from the "etc/entry-stats" fw_cfg file.  'live' is the address
+// of the counters, which keep running after boot.  The last entry
+// accounts for all handlers once the others are taken.  Time spent in
+// a handler includes any handlers that interrupted it.
+struct estats_entry_s {
+    u32 func;
+    u32 count;
+    u64 cycles;
+} PACKED;
+
+struct estats_s {
+    u32 magic;
+    u16 version;
+    u16 entry_count;
+    u32 live;
+    struct estats_entry_s entries[ESTATS_ENTRIES];
+} PACKED;
+
+struct estats_s EntryStats VARLOW;
+
+// Called from the romlayout.S interrupt entry points (with
+// CONFIG_ENTRY_STATS) to run the handler 'func' and account for it.
+void VISIBLE16
+entry_stats_call(u32 arg, u32 func)
+{
+    u64 start = rdtscll();
+    ((void (*)(u32))func)(arg);
+    u64 cycles = rdtscll() - start;
+
+    struct estats_entry_s *e = EntryStats.entries;
+    for (; e < &EntryStats.entries[ESTATS_ENTRIES-1]; e++) {
+        u32 efunc = GET_LOW(e->func);
+        if (efunc == func)
+            break;
+        if (!efunc) {
+            SET_LOW(e->func, func);
+            break;
+        }
+    }
+    SET_LOW(e->count, GET_LOW(e->count) + 1);
+    SET_LOW(e->cycles, GET_LOW(e->cycles) + cycles);
+}
+
+// Report handler statistics on the debug console and hand them to the
+// host.
+void
+entry_stats_prepboot(void)
+{
+    if (!CONFIG_ENTRY_STATS)
+        return;
+    EntryStats.magic = ESTATS_MAGIC;
+    EntryStats.version = ESTATS_VERSION;
+    EntryStats.entry_count = ESTATS_ENTRIES;
+    EntryStats.live = (u32)&EntryStats;
+
+    dprintf(1, "Interrupt entry statistics:\n");
+    struct estats_entry_s *e;
+    for (e = EntryStats.entries; e < &EntryStats.entries[ESTATS_ENTRIES]; e++)
+        if (e->count)
+            dprintf(1, "  handler %x: count=%d cycles=%lld\n"
+                    , e->func, e->count, e->cycles);
+
+    struct romfile_s *file = romfile_find("etc/entry-stats");
+    if (!file)
+        return;
+    u32 size = sizeof(EntryStats);
+    if (size > file->size)
+        size = file->size;
+    qemu_cfg_write_file(&EntryStats, file, 0, size);
+}
+
+
 /****************************************************************
  * Threads
  ****************************************************************/
@@ -472,12 +738,97 @@ reset(void)
 struct thread_info {
     void *stackpos;
     struct hlist_node node;
+    u32 wake;           // Timer deadline while 'sleeping' is set
+    u8 priority;        // THREAD_PRIO_xxx
+    u8 sleeping;
+    u8 skipped;         // Times passed over since last run
+    u8 ap;              // Stack of an application processor worker
+    struct hlist_node sleepnode; // Entry in Sleepers while 'sleeping' is set
+    void *func;         // Thread function (for CONFIG_STACK_PROFILE)
 };
 struct thread_info MainThread VARFSEG = {
-    NULL, { &MainThread.node, &MainThread.node.next }
+    NULL, { &MainThread.node, &MainThread.node.next }, 0, THREAD_PRIO_NORMAL
 };
 #define THREADSTACKSIZE 4096
 
+// A runnable thread passed over this many times runs next regardless
+// of priority - this bounds starvation (and priority inversion on a
+// mutex held by a lower priority thread).
+#define THREAD_MAX_SKIP 4
+
+// The main thread only halts the cpu when no thread is due to wake
+// before the next timer irq (18.2Hz) could arrive.
+#define THREAD_IDLE_MSECS 55
+
+// Sleeping threads ordered by wake deadline - only the head needs to
+// be compared against the timer to find the threads that are due.
+static struct hlist_head Sleepers;
+static int ThreadCount, ThreadsAsleep; // Excluding the main thread
+
+// Stacks of ended threads are kept for the next threads instead of going
+// back to the allocator (linked through their 'stackpos').
+static struct thread_info *FreeStacks;
+static int ThreadPeak, ThreadStarts, ThreadStacks;
+
+// Paint the unused part of a thread stack (see stack_prof_extra).
+static void
+thread_stack_paint(struct thread_info *thread)
+{
+    if (CONFIG_STACK_PROFILE)
+        stack_paint((void*)&thread[1], (void*)thread + THREADSTACKSIZE);
+}
+
+// Note the stack use of a thread that ran 'func'.
+static void
+thread_stack_note(struct thread_info *thread, void *func)
+{
+    if (!CONFIG_STACK_PROFILE)
+        return;
+    u32 *top = (void*)thread + THREADSTACKSIZE;
+    u32 *pos = stack_scan((void*)&thread[1], top);
+    stack_prof_note(StackProfThread, (u32)func, (void*)top - (void*)pos);
+    if (thread != getCurThread())
+        return;
+    // An ap worker stack is reused for the next job - repaint the
+    // part below the current frame (without calling other code).
+    u32 *end = (void*)ALIGN_DOWN(getesp(), 4);
+    while (pos < end)
+        *pos++ = STACK_PAINT;
+}
+
+static void
+stack_prof_report(const char *type, struct stack_prof_s *table, u32 size)
+{
+    struct stack_prof_s *e;
+    for (e = table; e < &table[STACK_PROF_ENTRIES]; e++) {
+        if (!e->count)
+            continue;
+        if (e == &table[STACK_PROF_ENTRIES-1])
+            dprintf(1, "  %s others: max=%d of %d count=%d\n"
+                    , type, e->max, size, e->count);
+        else
+            dprintf(1, "  %s %x: max=%d of %d count=%d\n"
+                    , type, e->func, e->max, size, e->count);
+    }
+}
+
+// Report the measured stack use on the debug console.
+void
+stack_profile_report(void)
+{
+    if (!CONFIG_STACK_PROFILE)
+        return;
+    stack_prof_extra(StackProfLast);
+    dprintf(1, "Stack profile (extra stack peak %d of %d bytes):\n"
+            , StackProfPeak, BUILD_EXTRA_STACK_SIZE);
+    if (StackProfOther.count)
+        dprintf(1, "  other: max=%d of %d count=%d\n", StackProfOther.max
+                , BUILD_EXTRA_STACK_SIZE, StackProfOther.count);
+    stack_prof_report("entry", StackProfEntry, BUILD_EXTRA_STACK_SIZE);
+    stack_prof_report("thread", StackProfThread
+                      , THREADSTACKSIZE - sizeof(struct thread_info));
+}
+
 // Check if any threads are running.
 static int
 have_threads(void)
@@ -516,12 +867,227 @@ threads_during_optionroms(void)
     return CONFIG_THREADS && CONFIG_RTC_TIMER && ThreadControl == 2 && in_post();
 }
 
+
+/****************************************************************
+ * Application processor threads
+ ****************************************************************/
+
+// When enabled (see smp_setup), idle application processors run
+// threads from a work queue.  Thread code is not written to be SMP
+// safe, so each cpu holds ThreadLock while running it and only
+// drops it in yield().  Code between two yields thus stays atomic
+// (including mutex_s), while the waits run in parallel.
+
+struct ap_job_s {
+    void (*func)(void*);
+    void *data;
+    int priority;
+    struct hlist_node node;
+};
+
+static struct hlist_head APJobs;
+static int APEnabled, APStop, APIdle, APPending, APBusy;
+static u32 ThreadLockNext, ThreadLockOwner;
+
+// Acquire the big thread lock (a fifo ticket lock).
+static void
+thread_lock(void)
+{
+    u32 ticket = 1;
+    asm volatile("lock xaddl %0, %1"
+                 : "+r"(ticket), "+m"(ThreadLockNext) : : "memory");
+    while (*(volatile u32*)&ThreadLockOwner != ticket)
+        cpu_relax();
+}
+
+static void
+thread_unlock(void)
+{
+    barrier();
+    writel(&ThreadLockOwner, ThreadLockOwner + 1);
+}
+
+// Briefly hand the thread lock to other cpus.
+static void
+thread_lock_pause(void)
+{
+    if (!APEnabled && !getCurThread()->ap)
+        return;
+    thread_unlock();
+    cpu_relax();
+    thread_lock();
+}
+
+// Enable dispatch of threads to application processors.  The calling
+// (main) cpu holds the thread lock from here on.
+int
+ap_threads_start(void)
+{
+    if (!CONFIG_THREADS || ThreadControl != 1)
+        return 0;
+    thread_lock();
+    APEnabled = 1;
+    return 1;
+}
+
+// Stop dispatching threads and release the application processors.
+void
+ap_threads_stop(void)
+{
+    if (!APEnabled)
+        return;
+    wait_threads();
+    APStop = 1;
+    APEnabled = 0;
+    thread_unlock();
+}
+
+// Allocate a stack for an application processor worker.  Returns the
+// initial stack pointer.
+void *
+ap_thread_stack(void)
+{
+    struct thread_info *thread;
+    thread = memalign_tmphigh(THREADSTACKSIZE, THREADSTACKSIZE);
+    if (!thread) {
+        warn_noalloc();
+        return NULL;
+    }
+    memset(thread, 0, sizeof(*thread));
+    thread->ap = 1;
+    thread_stack_paint(thread);
+    return (void*)thread + THREADSTACKSIZE;
+}
+
+// Main loop of an application processor worker (run on a stack from
+// ap_thread_stack).  Returns after ap_threads_stop().
+void
+ap_thread_worker(void)
+{
+    thread_lock();
+    APIdle++;
+    for (;;) {
+        struct ap_job_s *job = container_of_or_null(
+            APJobs.first, struct ap_job_s, node);
+        if (job) {
+            hlist_del(&job->node);
+            APPending--;
+            APIdle--;
+            APBusy++;
+            struct thread_info *cur = getCurThread();
+            void (*func)(void*) = job->func;
+            void *data = job->data;
+            cur->priority = job->priority;
+            free(job);
+            dprintf(DEBUG_thread, "/%08x\\ Start ap thread\n", (u32)cur);
+            func(data);
+            thread_stack_note(cur, func);
+            APBusy--;
+            APIdle++;
+            continue;
+        }
+        if (APStop)
+            break;
+        thread_unlock();
+        while (!*(volatile int*)&APPending && !*(volatile int*)&APStop)
+            cpu_relax();
+        thread_lock();
+    }
+    APIdle--;
+    thread_unlock();
+}
+
+// Queue 'func(data)' for an idle application processor.  Returns 0 if
+// no processor is available to run it.
+static int
+ap_thread_queue(void (*func)(void*), void *data, int priority)
+{
+    if (!APEnabled || APPending >= APIdle)
+        return 0;
+    struct ap_job_s *job = malloc_tmp(sizeof(*job));
+    if (!job)
+        return 0;
+    job->func = func;
+    job->data = data;
+    job->priority = priority;
+    struct hlist_node **pprev;
+    struct ap_job_s *pos;
+    hlist_for_each_entry_pprev(pos, pprev, &APJobs, node)
+        ;
+    hlist_add(&job->node, pprev);
+    APPending++;
+    return 1;
+}
+
+// Park the current thread on the sleep queue until 'end'.
+static void
+thread_sleep(struct thread_info *cur, u32 end)
+{
+    cur->wake = end;
+    cur->sleeping = 1;
+    if (cur != &MainThread)
+        ThreadsAsleep++;
+    struct hlist_node **pprev;
+    struct thread_info *pos;
+    hlist_for_each_entry_pprev(pos, pprev, &Sleepers, sleepnode) {
+        if ((s32)(pos->wake - end) > 0)
+            break;
+    }
+    hlist_add(&cur->sleepnode, pprev);
+}
+
+// Make runnable all sleeping threads whose deadline has passed.
+static void
+thread_wake_due(void)
+{
+    struct thread_info *t;
+    while ((t = container_of_or_null(Sleepers.first, struct thread_info
+                                     , sleepnode))) {
+        if (!timer_check(t->wake))
+            return;
+        hlist_del(&t->sleepnode);
+        t->sleeping = 0;
+        if (t != &MainThread)
+            ThreadsAsleep--;
+    }
+}
+
+// Select the thread to run after 'cur'.  The highest priority
+// runnable thread wins, with ties going round-robin from 'cur'.  A
+// sleeping thread is not considered until its deadline passes - except
+// the main thread, which keeps an occasional turn to service irqs.
+static struct thread_info *
+pick_next(struct thread_info *cur)
+{
+    struct thread_info *best = NULL, *t = cur;
+    int bestprio = -2;
+    thread_wake_due();
+    do {
+        t = container_of(t->node.next, struct thread_info, node);
+        if (t->skipped < THREAD_MAX_SKIP)
+            t->skipped++;
+        int prio = t->priority;
+        if (t->sleeping) {
+            if (t != &MainThread)
+                continue;
+            prio = -1;
+        }
+        if (t->skipped >= THREAD_MAX_SKIP)
+            prio = THREAD_PRIO_HIGH + 1;
+        if (prio > bestprio) {
+            best = t;
+            bestprio = prio;
+        }
+    } while (t != cur);
+    best->skipped = 0;
+    return best;
+}
+
 // Switch to next thread stack.
 static void
 switch_next(struct thread_info *cur)
 {
-    struct thread_info *next = container_of(
-        cur->node.next, struct thread_info, node);
+    struct thread_info *next = pick_next(cur);
     if (cur == next)
         // Nothing to do.
         return;
@@ -543,31 +1109,54 @@ static void
 __end_thread(struct thread_info *old)
 {
     hlist_del(&old->node);
+    ThreadCount--;
+    thread_stack_note(old, old->func);
     dprintf(DEBUG_thread, "\\%08x/ End thread\n", (u32)old);
-    free(old);
+    old->stackpos = FreeStacks;
+    FreeStacks = old;
     if (!have_threads())
         dprintf(1, "All threads complete.\n");
 }
 
 void VISIBLE16 check_irqs(void);
 
-// Create a new thread and start executing 'func' in it.
+// Create a new thread with the given scheduling priority and start
+// executing 'func' in it.
 void
-run_thread(void (*func)(void*), void *data)
+run_thread_prio(void (*func)(void*), void *data, int priority)
 {
     ASSERT32FLAT();
     if (! CONFIG_THREADS || ! ThreadControl)
         goto fail;
-    struct thread_info *thread;
-    thread = memalign_tmphigh(THREADSTACKSIZE, THREADSTACKSIZE);
-    if (!thread)
+    // Keyboard and other low priority work stays on the main cpu
+    if (priority > THREAD_PRIO_LOW && ap_thread_queue(func, data, priority))
+        return;
+    if (getCurThread()->ap)
+        // Only the main cpu has a thread list
         goto fail;
+    struct thread_info *thread = FreeStacks;
+    if (thread) {
+        FreeStacks = thread->stackpos;
+    } else {
+        thread = memalign_tmphigh(THREADSTACKSIZE, THREADSTACKSIZE);
+        if (!thread)
+            goto fail;
+        ThreadStacks++;
+    }
 
     dprintf(DEBUG_thread, "/%08x\\ Start thread\n", (u32)thread);
     thread->stackpos = (void*)thread + THREADSTACKSIZE;
+    thread->priority = priority;
+    thread->sleeping = thread->skipped = thread->ap = 0;
+    thread->func = func;
+    thread_stack_paint(thread);
     struct thread_info *cur = getCurThread();
     struct thread_info *edx = cur;
     hlist_add_after(&thread->node, &cur->node);
+    ThreadCount++;
+    ThreadStarts++;
+    if (ThreadCount > ThreadPeak)
+        ThreadPeak = ThreadCount;
     asm volatile(
         // Start thread
         "  pushl $1f\n"                 // store return pc
@@ -597,6 +1186,35 @@ fail:
     func(data);
 }
 
+// Release the pool of thread stacks - no threads are started after POST.
+void
+thread_prepboot(void)
+{
+    if (!CONFIG_THREADS)
+        return;
+    dprintf(1, "Threads: %d run, peak %d at once, %d stacks allocated\n"
+            , ThreadStarts, ThreadPeak, ThreadStacks);
+    while (FreeStacks) {
+        struct thread_info *thread = FreeStacks;
+        FreeStacks = thread->stackpos;
+        free(thread);
+    }
+}
+
+// Create a new thread and start executing 'func' in it.  The thread
+// inherits the priority of its creator.
+void
+run_thread(void (*func)(void*), void *data)
+{
+    int priority = THREAD_PRIO_NORMAL;
+    if (CONFIG_THREADS) {
+        struct thread_info *cur = getCurThread();
+        if (cur != &MainThread)
+            priority = cur->priority;
+    }
+    run_thread_prio(func, data, priority);
+}
+
 
 /****************************************************************
  * Thread helpers
@@ -629,6 +1247,9 @@ yield(void)
         return;
     }
     struct thread_info *cur = getCurThread();
+    thread_lock_pause();
+    if (cur->ap)
+        return;
     // Switch to the next thread
     switch_next(cur);
     if (cur == &MainThread)
@@ -646,12 +1267,58 @@ wait_irq(void)
     asm volatile("sti ; hlt ; cli ; cld": : :"memory");
 }
 
+// Called on the main thread when it has nothing to do but service
+// irqs.  If every other thread is asleep and the next deadline is
+// beyond the next timer tick then halt the cpu until an irq arrives.
+static void
+main_idle(void)
+{
+    struct thread_info *first = container_of_or_null(
+        Sleepers.first, struct thread_info, sleepnode);
+    if (!CONFIG_HARDWARE_IRQ || !CanInterrupt || APEnabled
+        || ThreadsAsleep != ThreadCount || !first
+        || (s32)(first->wake - timer_calc(THREAD_IDLE_MSECS)) <= 0) {
+        check_irqs();
+        return;
+    }
+    wait_irq();
+}
+
+// Yield until the timer reaches 'end'.  Other threads are run in the
+// meantime and the caller is not rescheduled until the deadline passes.
+void
+yield_until(u32 end)
+{
+    if (MODESEGMENT || !CONFIG_THREADS || !have_threads()
+        || getCurThread()->ap) {
+        while (!timer_check(end))
+            yield();
+        return;
+    }
+    struct thread_info *cur = getCurThread();
+    thread_sleep(cur, end);
+    while (cur->sleeping) {
+        thread_lock_pause();
+        switch_next(cur);
+        if (cur == &MainThread)
+            main_idle();
+    }
+}
+
 // Wait for next irq to occur.
 void
 yield_toirq(void)
 {
+    if (!MODESEGMENT && CONFIG_THREADS && have_threads()
+        && getCurThread() == &MainThread) {
+        // Run the other threads - and halt if they are all asleep
+        yield();
+        main_idle();
+        return;
+    }
     if (!CONFIG_HARDWARE_IRQ
-        || (!MODESEGMENT && (have_threads() || !CanInterrupt))) {
+        || (!MODESEGMENT && (have_threads() || !CanInterrupt
+                             || APEnabled))) {
         // Threads still active or irqs not available - do a yield instead.
         yield();
         return;
@@ -659,13 +1326,121 @@ yield_toirq(void)
     wait_irq();
 }
 
+// Wait for a device to signal completion of a request.  The 'done'
+// callback is polled until it returns non-zero (a negative value
+// reports a device error) or until 'timeout' milliseconds pass.  The
+// cpu is handed to other threads between polls, so that a driver
+// waiting on one controller does not hold up the probing of others.
+// Returns 0 on completion, and a negative value on error or timeout.
+int
+wait_completion(int (*done)(void *data), void *data, u32 timeout)
+{
+    u32 end = timer_calc(timeout);
+    for (;;) {
+        int ret = done(data);
+        if (ret)
+            return ret < 0 ? ret : 0;
+        if (timer_check(end)) {
+            warn_timeout();
+            return -1;
+        }
+        yield();
+    }
+}
+
 // Wait for all threads (other than the main thread) to complete.
 void
 wait_threads(void)
 {
     ASSERT32FLAT();
-    while (have_threads())
-        yield();
+    if (!have_threads() && !APPending && !APBusy)
+        return;
+    // The main thread has nothing to do but service irqs - let the
+    // threads being waited on have the cpu.
+    MainThread.priority = THREAD_PRIO_LOW;
+    while (have_threads() || APPending || APBusy) {
+        thread_lock_pause();
+        switch_next(&MainThread);
+        main_idle();
+    }
+    MainThread.priority = THREAD_PRIO_NORMAL;
+}
+
+
+/****************************************************************
+ * Mutexes
+ ****************************************************************/
+
+#define LSTATS_SITES 16
+
+// Lock statistics (with CONFIG_MUTEX_STATS) - one entry per mutex_lock()
+// call site.  The last entry accounts for all sites once the others
+// are taken.  Times are in timer ticks.
+struct lstats_site_s {
+    u32 site;
+    u32 acquires, contended;
+    u32 wait, maxhold;
+};
+static struct lstats_site_s LockStats[LSTATS_SITES];
+
+// Account for a mutex acquired by 'site' - the entry index is kept in
+// 'isLocked' so that mutex_unlock() can find it.
+static void
+lstats_lock(struct mutex_s *mutex, void *site, int contended, u32 start)
+{
+    struct lstats_site_s *ls = LockStats;
+    for (; ls < &LockStats[LSTATS_SITES-1]; ls++) {
+        if (ls->site == (u32)site)
+            break;
+        if (!ls->site) {
+            ls->site = (u32)site;
+            break;
+        }
+    }
+    u32 now = timer_read();
+    ls->acquires++;
+    if (contended) {
+        ls->contended++;
+        ls->wait += now - start;
+    }
+    mutex->isLocked = 1 + ls - LockStats;
+    mutex->locktime = now;
+}
+
+static void
+lstats_unlock(struct mutex_s *mutex)
+{
+    if (!mutex->isLocked)
+        return;
+    struct lstats_site_s *ls = &LockStats[mutex->isLocked - 1];
+    u32 hold = timer_read() - mutex->locktime;
+    if (hold > ls->maxhold)
+        ls->maxhold = hold;
+}
+
+static u32
+lstats_usecs(u32 ticks, u32 khz)
+{
+    if (ticks < 0xffffffff / 1000)
+        return ticks * 1000 / khz;
+    return ticks / khz * 1000;
+}
+
+// Report the lock statistics on the debug console.
+void
+mutex_prepboot(void)
+{
+    if (!CONFIG_MUTEX_STATS)
+        return;
+    u32 khz = timer_khz();
+    dprintf(1, "Mutex statistics:\n");
+    struct lstats_site_s *ls;
+    for (ls = LockStats; ls < &LockStats[LSTATS_SITES]; ls++)
+        if (ls->acquires)
+            dprintf(1, "  site %x: acquires=%d contended=%d wait=%dus"
+                    " maxhold=%dus\n", ls->site, ls->acquires
+                    , ls->contended, lstats_usecs(ls->wait, khz)
+                    , lstats_usecs(ls->maxhold, khz));
 }
 
 void
@@ -674,9 +1449,13 @@ mutex_lock(struct mutex_s *mutex)
     ASSERT32FLAT();
     if (! CONFIG_THREADS)
         return;
+    u32 start = CONFIG_MUTEX_STATS ? timer_read() : 0;
+    int contended = mutex->isLocked;
     while (mutex->isLocked)
         yield();
     mutex->isLocked = 1;
+    if (CONFIG_MUTEX_STATS)
+        lstats_lock(mutex, __builtin_return_address(0), contended, start);
 }
 
 void
@@ -685,6 +1464,8 @@ mutex_unlock(struct mutex_s *mutex)
     ASSERT32FLAT();
     if (! CONFIG_THREADS)
         return;
+    if (CONFIG_MUTEX_STATS)
+        lstats_unlock(mutex);
     mutex->isLocked = 0;
 }
 
@@ -694,7 +1475,9 @@ mutex_unlock(struct mutex_s *mutex)
  ****************************************************************/
 
 int CanPreempt VARFSEG;
-static u32 PreemptCount;
+// Timer value before which the 16bit code doesn't need to run threads
+u32 PreemptWake VARFSEG;
+static u32 PreemptCount, PreemptTicks, PreemptMsecs;
 
 // Turn on RTC irqs and arrange for them to check the 32bit threads.
 void
@@ -703,7 +1486,8 @@ start_preempt(void)
     if (! threads_during_optionroms())
         return;
     CanPreempt = 1;
-    PreemptCount = 0;
+    PreemptWake = timer_calc(0);
+    PreemptCount = PreemptTicks = PreemptMsecs = 0;
     rtc_use();
 }
 
@@ -717,7 +1501,8 @@ finish_preempt(void)
     }
     CanPreempt = 0;
     rtc_release();
-    dprintf(9, "Done preempt - %d checks\n", PreemptCount);
+    dprintf(3, "Done preempt - %d switches, %dms in threads\n"
+            , PreemptCount, PreemptMsecs);
     yield();
 }
 
@@ -733,19 +1518,35 @@ wait_preempt(void)
     return 1;
 }
 
-// Try to execute 32bit threads.
+// Try to execute 32bit threads.  The option rom then gets at least as
+// much time as the threads just used, and if every thread is asleep
+// it isn't interrupted again until the first one is due.
 void VISIBLE32INIT
 yield_preempt(void)
 {
-    PreemptCount++;
+    u32 start = timer_read();
     switch_next(&MainThread);
+    u32 end = timer_read(), ran = end - start, next = end + ran;
+    struct thread_info *first = container_of_or_null(
+        Sleepers.first, struct thread_info, sleepnode);
+    if (ThreadsAsleep == ThreadCount && first
+        && (s32)(first->wake - next) > 0)
+        next = first->wake;
+    PreemptWake = next;
+
+    PreemptCount++;
+    PreemptTicks += ran;
+    u32 khz = timer_khz();
+    PreemptMsecs += PreemptTicks / khz;
+    PreemptTicks %= khz;
 }
 
-// 16bit code that checks if threads are pending and executes them if so.
+// 16bit code that checks if threads are due and executes them if so.
 void
 check_preempt(void)
 {
-    if (CONFIG_THREADS && GET_GLOBAL(CanPreempt) && have_threads())
+    if (CONFIG_THREADS && GET_GLOBAL(CanPreempt) && have_threads()
+        && timer_check(GET_GLOBAL(PreemptWake)))
         call32(yield_preempt, 0, 0);
 }
 
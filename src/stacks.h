@@ -25,6 +25,9 @@ u32 __stack_hop_back(u32 eax, u32 edx, void *func);
         __stack_hop_back((u32)(eax), (u32)(edx), _cfunc16_ ##func );    \
     })
 int on_extra_stack(void);
+void stack_profile_setup(void);
+void stack_profile_report(void);
+void entry_stats_prepboot(void);
 struct bregs;
 void farcall16(struct bregs *callregs);
 void farcall16big(struct bregs *callregs);
@@ -37,14 +40,27 @@ void reset(void);
 extern struct thread_info MainThread;
 struct thread_info *getCurThread(void);
 void yield(void);
+void yield_until(u32 end);
 void yield_toirq(void);
+int wait_completion(int (*done)(void *data), void *data, u32 timeout);
 void thread_setup(void);
+void call32_setup(void);
 int threads_during_optionroms(void);
+#define THREAD_PRIO_LOW    0
+#define THREAD_PRIO_NORMAL 1
+#define THREAD_PRIO_HIGH   2
+void thread_prepboot(void);
+void run_thread_prio(void (*func)(void*), void *data, int priority);
 void run_thread(void (*func)(void*), void *data);
 void wait_threads(void);
-struct mutex_s { u32 isLocked; };
+int ap_threads_start(void);
+void ap_threads_stop(void);
+void *ap_thread_stack(void);
+void ap_thread_worker(void);
+struct mutex_s { u32 isLocked; u32 locktime; };
 void mutex_lock(struct mutex_s *mutex);
 void mutex_unlock(struct mutex_s *mutex);
+void mutex_prepboot(void);
 void start_preempt(void);
 void finish_preempt(void);
 int wait_preempt(void);
@@ -32,6 +32,7 @@ struct int13ext_s {
     u16 count;
     struct segoff_s data;
     u64 lba;
+    u64 data64;     // EDD 3.0 flat buffer when data is ffff:ffff
 } PACKED;
 
 // DPTE definition
@@ -361,6 +361,7 @@ struct tpm_res_sha1complete {
 #define TPM2_CC_ClearControl        0x127
 #define TPM2_CC_HierarchyChangeAuth 0x129
 #define TPM2_CC_PCR_Allocate        0x12b
+#define TPM2_CC_IncrementalSelfTest 0x142
 #define TPM2_CC_SelfTest            0x143
 #define TPM2_CC_Startup             0x144
 #define TPM2_CC_Shutdown            0x145
@@ -383,6 +384,14 @@ struct tpm2_req_stirrandom {
     u64 stir;
 } PACKED;
 
+#define TPM2_MAX_SELFTEST_ALGS      8
+
+struct tpm2_req_incrementalselftest {
+    struct tpm_req_header hdr;
+    u32 count;
+    u16 algs[TPM2_MAX_SELFTEST_ALGS];
+} PACKED;
+
 struct tpm2_req_getrandom {
     struct tpm_req_header hdr;
     u16 bytesRequested;
@@ -4,9 +4,45 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
+#include "biosvar.h" // GET_GLOBAL
 #include "stacks.h" // yield
 #include "string.h" // memcpy
 #include "farptr.h" // SET_SEG
+#include "x86.h" // cpuid
+
+
+/****************************************************************
+ * Cpu feature detection
+ ****************************************************************/
+
+#define STRING_ERMS 0x01 // "rep movsb/stosb" is fast for all sizes
+#define STRING_NT   0x02 // "movnti" non-temporal stores are available
+
+// Non-temporal fills are only used on regions larger than a typical
+// cache, where caching the written data would just evict useful lines.
+#define STRING_NT_THRESHOLD (256*1024)
+
+u8 StringFeatures VARFSEG;
+
+// Detect cpu features that speed up large memory copies and fills.
+void
+string_preinit(void)
+{
+    u32 eax, ebx, ecx, edx, max;
+    cpuid(0, &max, &ebx, &ecx, &edx);
+    if (max < 1)
+        return;
+    u8 features = 0;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_SSE2)
+        features |= STRING_NT;
+    if (max >= 7) {
+        __cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+        if (ebx & CPUID7_EBX_ERMS)
+            features |= STRING_ERMS;
+    }
+    StringFeatures = features;
+}
 
 
 /****************************************************************
@@ -106,11 +142,70 @@ memset16_far(u16 d_seg, void *d_far, u16 c, size_t len)
         : "cc", "memory");
 }
 
+inline void
+memset32_far(u16 d_seg, void *d_far, u32 c, size_t len)
+{
+    len /= 4;
+    SET_SEG(ES, d_seg);
+    asm volatile(
+        "rep stosl %%es:(%%di)"
+        : "+c"(len), "+D"(d_far)
+        : "a"(c), "m" (__segment_ES)
+        : "cc", "memory");
+}
+
+// Fill a large area using non-temporal stores.  The area must be
+// 4 byte aligned and a multiple of 16 bytes in length.
+static void
+memset_nt(void *s, u32 v, size_t n)
+{
+    u32 *p = s, *end = s + n;
+    for (; p < end; p += 4)
+        asm volatile("movnti %1, (%0)\n"
+                     "movnti %1, 4(%0)\n"
+                     "movnti %1, 8(%0)\n"
+                     "movnti %1, 12(%0)"
+                     : : "r"(p), "r"(v) : "memory");
+    asm volatile("sfence" : : : "memory");
+}
+
 void *
 memset(void *s, int c, size_t n)
 {
-    while (n)
-        ((char *)s)[--n] = c;
+    SET_SEG(ES, GET_SEG(SS));
+    void *d = s;
+    u32 v = (u8)c * 0x01010101;
+    if (!MODESEGMENT && n >= 64) {
+        u8 features = GET_GLOBAL(StringFeatures);
+        if (features & STRING_NT && n >= STRING_NT_THRESHOLD
+            && !((u32)d & 3)) {
+            u32 bulk = n & ~15;
+            memset_nt(d, v, bulk);
+            d += bulk;
+            n -= bulk;
+        } else if (features & STRING_ERMS) {
+            asm volatile(
+                "rep stosb %%es:(%%edi)"
+                : "+c"(n), "+D"(d)
+                : "a"(v), "m" (__segment_ES) : "cc", "memory");
+            return s;
+        }
+    }
+    if (n >= 16) {
+        // Align the destination and then fill 4 bytes at a time
+        u32 head = -(u32)d & 3, count = (n - head) / 4;
+        n -= head + count * 4;
+        asm volatile(
+            "rep stosb %%es:(%%edi)\n"
+            "movl %3, %%ecx\n"
+            "rep stosl %%es:(%%edi)"
+            : "+c"(head), "+D"(d)
+            : "a"(v), "g"(count), "m" (__segment_ES) : "cc", "memory");
+    }
+    asm volatile(
+        "rep stosb %%es:(%%edi)"
+        : "+c"(n), "+D"(d)
+        : "a"(v), "m" (__segment_ES) : "cc", "memory");
     return s;
 }
 
@@ -158,18 +253,31 @@ memcpy(void *d1, const void *s1, size_t len)
 {
     SET_SEG(ES, GET_SEG(SS));
     void *d = d1;
-    if (((u32)d1 | (u32)s1 | len) & 3) {
-        // non-aligned memcpy
+    if (!(((u32)d1 | (u32)s1 | len) & 3)) {
+        // Common case - use 4-byte copy
+        len /= 4;
         asm volatile(
-            "rep movsb (%%esi),%%es:(%%edi)"
+            "rep movsl (%%esi),%%es:(%%edi)"
             : "+c"(len), "+S"(s1), "+D"(d)
             : "m" (__segment_ES) : "cc", "memory");
         return d1;
     }
-    // Common case - use 4-byte copy
-    len /= 4;
+    if (len >= 16 && (MODESEGMENT
+                      || !(GET_GLOBAL(StringFeatures) & STRING_ERMS))) {
+        // non-aligned memcpy - align the destination and then use a
+        // 4-byte copy for the bulk of the data
+        u32 head = -(u32)d & 3, count = (len - head) / 4;
+        len -= head + count * 4;
+        asm volatile(
+            "rep movsb (%%esi),%%es:(%%edi)\n"
+            "movl %4, %%ecx\n"
+            "rep movsl (%%esi),%%es:(%%edi)"
+            : "+c"(head), "+S"(s1), "+D"(d)
+            : "m" (__segment_ES), "g"(count) : "cc", "memory");
+    }
+    // Copy remaining bytes (or everything if the cpu has fast "rep movsb")
     asm volatile(
-        "rep movsl (%%esi),%%es:(%%edi)"
+        "rep movsb (%%esi),%%es:(%%edi)"
         : "+c"(len), "+S"(s1), "+D"(d)
         : "m" (__segment_ES) : "cc", "memory");
     return d1;
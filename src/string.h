@@ -5,6 +5,7 @@
 #include "types.h" // u32
 
 // string.c
+void string_preinit(void);
 u8 checksum_far(u16 buf_seg, void *buf_far, u32 len);
 u8 checksum(void *buf, u32 len);
 size_t strlen(const char *s);
@@ -13,6 +14,7 @@ int memcmp(const void *s1, const void *s2, size_t n);
 int strcmp(const char *s1, const char *s2);
 void memset_far(u16 d_seg, void *d_far, u8 c, size_t len);
 void memset16_far(u16 d_seg, void *d_far, u16 c, size_t len);
+void memset32_far(u16 d_seg, void *d_far, u32 c, size_t len);
 void *memset(void *s, int c, size_t n);
 void memset_fl(void *ptr, u8 val, size_t size);
 void memcpy_far(u16 d_seg, void *d_far
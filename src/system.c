@@ -6,6 +6,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "biosvar.h" // GET_GLOBAL
+#include "block.h" // disk_writeback_flush
 #include "bregs.h" // struct bregs
 #include "e820map.h" // E820_RAM
 #include "hw/pic.h" // pic_reset
@@ -74,6 +75,12 @@ handle_1587(struct bregs *regs)
     // +++ should probably have descriptor checks
     // +++ should have exception handlers
 
+    if (!regs->cx) {
+        // Nothing to copy - skip the mode switches
+        set_code_success(regs);
+        return;
+    }
+
     u8 prev_a20_enable = set_a20(1); // enable A20 line
 
     // 128K max of transfer on 386+ ???
@@ -127,11 +134,11 @@ handle_1587(struct bregs *regs)
         "  movw $(3<<3), %%ax\n" // 3rd descriptor in table, TI=GDT, RPL=00
         "  movw %%ax, %%es\n"
 
-        // memcpy CX words using 32bit memcpy if applicable
-        "  testw $1, %%cx\n"
-        "  jnz 3f\n"
+        // memcpy CX words using 32bit memcpy (and a trailing 16bit
+        // copy if CX is odd)
         "  shrw $1, %%cx\n"
         "  rep movsl %%ds:(%%si), %%es:(%%di)\n"
+        "  jc 3f\n"
 
         // Restore DS and ES segment limits to 0xffff
         "2:movw $(5<<3), %%ax\n" // 5th descriptor in table (SS)
@@ -146,8 +153,8 @@ handle_1587(struct bregs *regs)
         // far jump to flush CPU queue after transition to real mode
         "  ljmpw $" __stringify(SEG_BIOS) ", $4f\n"
 
-        // Slower 16bit copy method
-        "3:rep movsw %%ds:(%%si), %%es:(%%di)\n"
+        // Copy the last word of an odd count
+        "3:movsw %%ds:(%%si), %%es:(%%di)\n"
         "  jmp 2b\n"
 
         // restore IDT to normal real-mode defaults
@@ -157,10 +164,12 @@ handle_1587(struct bregs *regs)
         "  movw %%ss, %%ax\n"
         "  movw %%ax, %%ds\n"
         : "+a" (gdt_far), "+c"(count), "+m" (__segment_ES)
-        : "S" (si), "D" (di)
-        : "cc");
+          , "+S" (si), "+D" (di)
+        : : "cc");
 
-    set_a20(prev_a20_enable);
+    if (!prev_a20_enable)
+        // Only touch the A20 port again if it was changed above
+        set_a20(0);
 
     set_code_success(regs);
 }
@@ -185,6 +194,7 @@ void VISIBLE16
 handle_1589(struct bregs *regs)
 {
     debug_enter(regs, DEBUG_HDL_15);
+    disk_writeback_flush();
     set_a20(1);
 
     pic_reset(regs->bl, regs->bh);
@@ -295,6 +305,10 @@ handle_15e820(struct bregs *regs)
         set_code_invalid(regs, RET_EUNSUPPORTED);
         return;
     }
+    if (!regs->bx)
+        // Operating system loaders read the memory map just before
+        // they take over - complete any buffered disk writes.
+        disk_writeback_flush();
 
     memcpy_far(regs->es, (void*)(regs->di+0)
                , get_global_seg(), &e820_list[regs->bx]
@@ -16,6 +16,7 @@
 #include "fw/paravirt.h" // runningOnXen
 #include "hw/tpm_drivers.h" // tpm_drivers[]
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_loadint
 #include "sha.h" // sha1, sha256, ...
 #include "std/acpi.h"  // RSDP_SIGNATURE, rsdt_descriptor
 #include "std/smbios.h" // struct smbios_21_entry_point
@@ -167,32 +168,42 @@ static const struct hash_parameters {
     u8  hashalg_flag;
     u8  hash_buffersize;
     const char *name;
-    void (*hashfunc)(const u8 *data, u32 length, u8 *hash);
+    void (*init)(struct sha_ctx *ctx);
+    void (*update)(struct sha_ctx *ctx, const u8 *data, u32 length);
+    void (*final)(struct sha_ctx *ctx, u8 *hash);
 } hash_parameters[] = {
     {
         .hashalg = TPM2_ALG_SHA1,
         .hashalg_flag = TPM2_ALG_SHA1_FLAG,
         .hash_buffersize = SHA1_BUFSIZE,
         .name = "SHA1",
-        .hashfunc = sha1,
+        .init = sha1_init,
+        .update = sha1_update,
+        .final = sha1_final,
     }, {
         .hashalg = TPM2_ALG_SHA256,
         .hashalg_flag = TPM2_ALG_SHA256_FLAG,
         .hash_buffersize = SHA256_BUFSIZE,
         .name = "SHA256",
-        .hashfunc = sha256,
+        .init = sha256_init,
+        .update = sha256_update,
+        .final = sha256_final,
     }, {
         .hashalg = TPM2_ALG_SHA384,
         .hashalg_flag = TPM2_ALG_SHA384_FLAG,
         .hash_buffersize = SHA384_BUFSIZE,
         .name = "SHA384",
-        .hashfunc = sha384,
+        .init = sha384_init,
+        .update = sha512_update,
+        .final = sha384_final,
     }, {
         .hashalg = TPM2_ALG_SHA512,
         .hashalg_flag = TPM2_ALG_SHA512_FLAG,
         .hash_buffersize = SHA512_BUFSIZE,
         .name = "SHA512",
-        .hashfunc = sha512,
+        .init = sha512_init,
+        .update = sha512_update,
+        .final = sha512_final,
     }, {
         .hashalg = TPM2_ALG_SM3_256,
         .hashalg_flag = TPM2_ALG_SM3_256_FLAG,
@@ -264,19 +275,21 @@ tpm20_hashalg_flag_to_name(u8 hashalg_flag)
     return NULL;
 }
 
-static void tpm2_hash_data(u16 hashAlg, const u8 *data, u32 data_len, u8 *hash)
+// Maximum number of PCR banks hashed in software and the amount of
+// data fed to each bank before moving on to the next.
+#define TPM20_HASH_BANKS 4
+#define TPM20_HASH_CHUNK 4096
+
+static const struct hash_parameters *
+tpm20_find_hash_parameters(u16 hashAlg)
 {
     unsigned i;
 
     for (i = 0; i < ARRAY_SIZE(hash_parameters); i++) {
-        if (hash_parameters[i].hashalg == hashAlg) {
-            if (hash_parameters[i].hashfunc) {
-                hash_parameters[i].hashfunc(data, data_len, hash);
-            } else {
-                memset(hash, 0xff, hash_parameters[i].hash_buffersize);
-            }
-        }
+        if (hash_parameters[i].hashalg == hashAlg)
+            return &hash_parameters[i];
     }
+    return NULL;
 }
 
 // Add an entry at the start of the log describing digest formats
@@ -361,6 +374,9 @@ tpm20_write_EfiSpecIdEventStruct(void)
  * hash and fill the remaining bytes with zeros. Or truncate the sha256
  * hash when writing it in the area of the sha1 hash.
  *
+ * All active banks are hashed in a single pass over the data so that
+ * each chunk of the input only has to be brought into the cache once.
+ *
  * le: the log entry to build the digest in
  * hashdata: the data to hash
  * hashdata_len: the length of the hashdata
@@ -379,6 +395,10 @@ tpm20_build_digest(struct tpm_log_entry *le,
     struct tpms_pcr_selection *sel = tpm20_pcr_selection->selections;
     void *nsel, *end = (void*)tpm20_pcr_selection + tpm20_pcr_selection_size;
     void *dest = le->hdr.digest + sizeof(struct tpm2_digest_values);
+    const struct hash_parameters *hp[TPM20_HASH_BANKS];
+    struct sha_ctx ctx[TPM20_HASH_BANKS];
+    u8 *hash[TPM20_HASH_BANKS];
+    int i, numCtx = 0;
 
     u32 count, numAlgs = 0;
     for (count = 0; count < be32_to_cpu(tpm20_pcr_selection->count); count++) {
@@ -413,8 +433,19 @@ tpm20_build_digest(struct tpm_log_entry *le,
         else
             v->hashAlg = be16_to_cpu(sel->hashAlg);
 
-        tpm2_hash_data(be16_to_cpu(sel->hashAlg), hashdata, hashdata_len,
-                       v->hash);
+        const struct hash_parameters *p = tpm20_find_hash_parameters(
+            be16_to_cpu(sel->hashAlg));
+        if (!p->init) {
+            memset(v->hash, 0xff, hsize);
+        } else if (numCtx >= ARRAY_SIZE(ctx)) {
+            dprintf(DEBUG_tcg, "TPM has too many active PCR banks\n");
+            return -1;
+        } else {
+            hp[numCtx] = p;
+            hash[numCtx] = v->hash;
+            p->init(&ctx[numCtx]);
+            numCtx++;
+        }
 
         dest += sizeof(*v) + hsize;
         sel = nsel;
@@ -427,6 +458,18 @@ tpm20_build_digest(struct tpm_log_entry *le,
         return -1;
     }
 
+    while (hashdata_len) {
+        u32 len = hashdata_len;
+        if (len > TPM20_HASH_CHUNK)
+            len = TPM20_HASH_CHUNK;
+        for (i = 0; i < numCtx; i++)
+            hp[i]->update(&ctx[i], hashdata, len);
+        hashdata += len;
+        hashdata_len -= len;
+    }
+    for (i = 0; i < numCtx; i++)
+        hp[i]->final(&ctx[i], hash[i]);
+
     struct tpm2_digest_values *v = (void*)le->hdr.digest;
     if (bigEndian)
         v->count = cpu_to_be32(numAlgs);
@@ -436,6 +479,27 @@ tpm20_build_digest(struct tpm_log_entry *le,
     return dest - (void*)le->hdr.digest;
 }
 
+/*
+ * Convert a digest built by tpm20_build_digest() in big endian format
+ * for the TPM to the little endian format of the log - avoids hashing
+ * the data a second time.
+ */
+static void
+tpm20_digest_to_log(struct tpm_log_entry *le)
+{
+    struct tpm2_digest_values *dv = (void*)le->hdr.digest;
+    void *dest = le->hdr.digest + sizeof(*dv);
+    u32 count = be32_to_cpu(dv->count), i;
+
+    dv->count = count;
+    for (i = 0; i < count; i++) {
+        struct tpm2_digest_value *v = dest;
+        u16 hashAlg = be16_to_cpu(v->hashAlg);
+        v->hashAlg = hashAlg;
+        dest += sizeof(*v) + tpm20_get_hash_buffersize(hashAlg);
+    }
+}
+
 static int
 tpm12_build_digest(struct tpm_log_entry *le,
                    const u8 *hashdata, u32 hashdata_len)
@@ -465,6 +529,13 @@ tpm_build_digest(struct tpm_log_entry *le, const u8 *hashdata, u32 hashdata_len
     return -1;
 }
 
+static void
+tpm_digest_to_log(struct tpm_log_entry *le)
+{
+    if (TPM_version == TPM_VERSION_2)
+        tpm20_digest_to_log(le);
+}
+
 
 /****************************************************************
  * TPM hardware command wrappers
@@ -565,6 +636,77 @@ tpm20_get_pcrbanks(void)
     return ret;
 }
 
+// Test only the hash algorithms of the active PCR banks (the ones the
+// bios uses) instead of running the full self test.
+static int
+tpm20_incremental_selftest(void)
+{
+    struct tpm2_req_incrementalselftest tis = {
+        .hdr.tag = cpu_to_be16(TPM2_ST_NO_SESSIONS),
+        .hdr.ordinal = cpu_to_be32(TPM2_CC_IncrementalSelfTest),
+    };
+    u32 count = 0;
+
+    if (!tpm20_pcr_selection)
+        return -1;
+
+    struct tpms_pcr_selection *sel = tpm20_pcr_selection->selections;
+    void *end = (void*)tpm20_pcr_selection + tpm20_pcr_selection_size;
+
+    while (count < ARRAY_SIZE(tis.algs)) {
+        u8 sizeOfSelect = sel->sizeOfSelect;
+        void *nsel = (void*)sel + sizeof(*sel) + sizeOfSelect;
+        if (nsel > end)
+            break;
+
+        unsigned i;
+        for (i = 0; i < sizeOfSelect; i++) {
+            if (sel->pcrSelect[i]) {
+                tis.algs[count++] = sel->hashAlg;
+                break;
+            }
+        }
+
+        sel = nsel;
+    }
+    if (!count)
+        return -1;
+
+    u32 size = offsetof(struct tpm2_req_incrementalselftest, algs)
+               + count * sizeof(tis.algs[0]);
+    tis.hdr.totlen = cpu_to_be32(size);
+    tis.count = cpu_to_be32(count);
+
+    u8 obuffer[64];
+    struct tpm_rsp_header *trsh = (void*)obuffer;
+    u32 obuffer_len = sizeof(obuffer);
+    int ret = tpmhw_transmit(0, &tis.hdr, obuffer, &obuffer_len,
+                             TPM_DURATION_TYPE_LONG);
+    ret = ret ? -1 : be32_to_cpu(trsh->errcode);
+
+    dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_IncrementalSelfTest = 0x%08x\n",
+            ret);
+
+    return ret;
+}
+
+// Run the self test of the algorithms in use, falling back to the
+// full self test if the TPM doesn't support incremental testing.
+static int
+tpm20_selftest(void)
+{
+    if (!tpm20_incremental_selftest())
+        return 0;
+
+    int ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
+                             1, TPM2_YES, TPM_DURATION_TYPE_LONG);
+
+    dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_SelfTest = 0x%08x\n",
+            ret);
+
+    return ret;
+}
+
 static int
 tpm20_get_suppt_pcrbanks(u8 *suppt_pcrbanks, u8 *active_pcrbanks)
 {
@@ -1022,7 +1164,7 @@ tpm_add_measurement_to_log(u32 pcrindex, u32 event_type,
         tpm_set_failure();
         return;
     }
-    tpm_build_digest(&le, hashdata, hashdata_length, 0);
+    tpm_digest_to_log(&le);
     tpm_log_event(&le.hdr, digest_len, event, event_length);
 }
 
@@ -1165,16 +1307,15 @@ tpm20_startup(void)
     if (ret)
         goto err_exit;
 
-    ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
-                         1, TPM2_YES, TPM_DURATION_TYPE_LONG);
-
-    dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_SelfTest = 0x%08x\n",
-            ret);
-
+    /* The PCR banks are queried once here; the self test and all
+     * later users work from this copy.  GetCapability doesn't need
+     * the self test to have run.
+     */
+    ret = tpm20_get_pcrbanks();
     if (ret)
         goto err_exit;
 
-    ret = tpm20_get_pcrbanks();
+    ret = tpm20_selftest();
     if (ret)
         goto err_exit;
 
@@ -1225,6 +1366,7 @@ tpm_setup(void)
              (TPM_version == TPM_VERSION_1_2) ? "1.2" : "2");
 
     TPM_working = 1;
+    sha_ni_setup();
 
     if (runningOnXen())
         return;
@@ -1240,9 +1382,13 @@ tpm_setup(void)
 static void
 tpm20_prepboot(void)
 {
-    int ret = tpm20_stirrandom();
-    if (ret)
-         goto err_exit;
+    int ret;
+    /* Mixing extra entropy into the TPM's generator is optional */
+    if (romfile_loadint("etc/tpm-stir-random", 1)) {
+        ret = tpm20_stirrandom();
+        if (ret)
+            goto err_exit;
+    }
 
     u8 auth[20];
     ret = tpm20_getrandom(&auth[0], sizeof(auth));
@@ -1285,8 +1431,32 @@ tpm_prepboot(void)
 /*
  * Add measurement to the log about an option rom
  */
+// Returns 0 if option roms don't need to be measured.
+int
+tpm_option_rom_needed(void)
+{
+    return tpm_is_working();
+}
+
+// Copy an option rom and calculate its digest in the same pass.
+// Returns 0 (after just copying) if the rom doesn't need to be measured.
+int
+tpm_option_rom_copy(void *dest, const void *src, u32 len, u8 *digest)
+{
+    if (!tpm_is_working()) {
+        iomemcpy(dest, src, len);
+        return 0;
+    }
+    struct sha_ctx ctx;
+    sha1_init(&ctx);
+    sha1_update_copy(&ctx, dest, src, len);
+    sha1_final(&ctx, digest);
+    return 1;
+}
+
+// Measure an option rom given its precalculated sha1 digest.
 void
-tpm_option_rom(const void *addr, u32 len)
+tpm_option_rom_digest(const u8 *digest)
 {
     if (!tpm_is_working())
         return;
@@ -1295,13 +1465,23 @@ tpm_option_rom(const void *addr, u32 len)
         .eventid = 7,
         .eventdatasize = sizeof(u16) + sizeof(u16) + SHA1_BUFSIZE,
     };
-    sha1((const u8 *)addr, len, pcctes.digest);
+    memcpy(pcctes.digest, digest, SHA1_BUFSIZE);
     tpm_add_measurement_to_log(2,
                                EV_EVENT_TAG,
                                (const char *)&pcctes, sizeof(pcctes),
                                (u8 *)&pcctes, sizeof(pcctes));
 }
 
+void
+tpm_option_rom(const void *addr, u32 len)
+{
+    if (!tpm_is_working())
+        return;
+    u8 digest[SHA1_BUFSIZE];
+    sha1((const u8 *)addr, len, digest);
+    tpm_option_rom_digest(digest);
+}
+
 void
 tpm_add_bcv(u32 bootdrv, const u8 *addr, u32 length)
 {
@@ -1385,13 +1565,7 @@ tpm_s3_resume(void)
         if (ret)
             goto err_exit;
 
-
-        ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
-                             1, TPM2_YES, TPM_DURATION_TYPE_LONG);
-
-        dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_SelfTest() = 0x%08x\n",
-                ret);
-
+        ret = tpm20_selftest();
         break;
     }
 
@@ -1444,7 +1618,6 @@ hash_log_extend(struct pcpes *pcpes, const void *hashdata, u32 hashdata_length
         if (ret)
             return TCG_TCG_COMMAND_ERROR;
     }
-    tpm12_build_digest_direct(&le, pcpes->digest);
     int ret = tpm_log_event(&le.hdr, digest_len
                             , pcpes->event, pcpes->eventdatasize);
     if (ret)
@@ -12,6 +12,9 @@ void tpm_s3_resume(void);
 void tpm_add_bcv(u32 bootdrv, const u8 *addr, u32 length);
 void tpm_add_cdrom(u32 bootdrv, const u8 *addr, u32 length);
 void tpm_add_cdrom_catalog(const u8 *addr, u32 length);
+int tpm_option_rom_needed(void);
+int tpm_option_rom_copy(void *dest, const void *src, u32 len, u8 *digest);
+void tpm_option_rom_digest(const u8 *digest);
 void tpm_option_rom(const void *addr, u32 len);
 int tpm_can_show_menu(void);
 void tpm_menu(void);
@@ -0,0 +1,137 @@
+// Record a timeline of the boot process using the cpu timestamp counter.
+//
+// Copyright (C) 2026  SeaBIOS developers
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "config.h" // CONFIG_BOOT_TIMELINE
+#include "fw/paravirt.h" // qemu_cfg_write_file
+#include "output.h" // dprintf
+#include "romfile.h" // romfile_find
+#include "string.h" // strtcpy
+#include "util.h" // timeline_begin
+#include "x86.h" // rdtscll
+
+#define TIMELINE_MAGIC 0x4e4c5442 // "BTLN"
+#define TIMELINE_VERSION 1
+#define TIMELINE_ENTRIES 64       // Must be a power of two
+#define TIMELINE_MAX_DEPTH 8
+
+// Binary layout of the timeline - the host reads this from the
+// "etc/boot-timeline" fw_cfg file.  Entries form a ring indexed by
+// 'seq % TIMELINE_ENTRIES'; 'count' is the total number of entries
+// ever recorded so the reader can tell if older entries were lost.
+struct timeline_entry_s {
+    u64 start;
+    u64 end;        // Zero if the phase never completed
+    u32 seq;
+    u8 depth;
+    u8 reserved[3];
+    char name[24];
+} PACKED;
+
+struct timeline_s {
+    u32 magic;
+    u16 version;
+    u16 entry_size;
+    u32 count;
+    u32 tsc_khz;    // Zero if the tsc frequency is not known
+    struct timeline_entry_s entries[TIMELINE_ENTRIES];
+} PACKED;
+
+static struct timeline_s Timeline VARVERIFY32INIT;
+static u32 TimelineStack[TIMELINE_MAX_DEPTH] VARVERIFY32INIT;
+static int TimelineDepth VARVERIFY32INIT;
+
+// Mark the start of a boot phase.  Phases may be nested.
+void
+timeline_begin(const char *name)
+{
+    if (!CONFIG_BOOT_TIMELINE)
+        return;
+    u32 seq = Timeline.count++;
+    struct timeline_entry_s *e = &Timeline.entries[seq % TIMELINE_ENTRIES];
+    memset(e, 0, sizeof(*e));
+    e->seq = seq;
+    e->depth = TimelineDepth;
+    strtcpy(e->name, name, sizeof(e->name));
+    if (TimelineDepth < TIMELINE_MAX_DEPTH)
+        TimelineStack[TimelineDepth] = seq;
+    TimelineDepth++;
+    e->start = rdtscll();
+}
+
+// Mark the end of the most recently started boot phase.
+void
+timeline_end(void)
+{
+    if (!CONFIG_BOOT_TIMELINE)
+        return;
+    u64 now = rdtscll();
+    if (!TimelineDepth)
+        return;
+    TimelineDepth--;
+    if (TimelineDepth >= TIMELINE_MAX_DEPTH)
+        return;
+    u32 seq = TimelineStack[TimelineDepth];
+    struct timeline_entry_s *e = &Timeline.entries[seq % TIMELINE_ENTRIES];
+    if (e->seq == seq)
+        e->end = now;
+}
+
+// Convert a tsc delta to microseconds
+static u32
+timeline_usecs(u64 delta, u32 khz)
+{
+    u32 ms = 0;
+    while (delta >= (u64)khz * 1000) {
+        // Avoid 64bit division - step in whole seconds
+        delta -= (u64)khz * 1000;
+        ms += 1000;
+    }
+    u32 d = delta;
+    return (ms + d / khz) * 1000 + (d % khz) * 1000 / khz;
+}
+
+static const char TimelineIndent[] = "                "; // 2*MAX_DEPTH
+
+// Report the timeline on the debug console and hand it to the host.
+void
+timeline_export(void)
+{
+    if (!CONFIG_BOOT_TIMELINE)
+        return;
+    Timeline.magic = TIMELINE_MAGIC;
+    Timeline.version = TIMELINE_VERSION;
+    Timeline.entry_size = sizeof(struct timeline_entry_s);
+    Timeline.tsc_khz = timer_tsc_khz();
+
+    u32 count = Timeline.count, first = 0, khz = Timeline.tsc_khz;
+    if (count > TIMELINE_ENTRIES)
+        first = count - TIMELINE_ENTRIES;
+    dprintf(1, "Boot timeline (%d entries, tsc %d khz):\n", count, khz);
+    u64 base = Timeline.entries[first % TIMELINE_ENTRIES].start;
+    u32 seq;
+    for (seq = first; seq < count; seq++) {
+        struct timeline_entry_s *e = &Timeline.entries[seq % TIMELINE_ENTRIES];
+        int depth = e->depth;
+        if (depth > TIMELINE_MAX_DEPTH)
+            depth = TIMELINE_MAX_DEPTH;
+        const char *indent = &TimelineIndent[(TIMELINE_MAX_DEPTH-depth) * 2];
+        u64 start = e->start - base, len = e->end ? e->end - e->start : 0;
+        if (khz)
+            dprintf(1, "  %s%s: start=%uus len=%uus\n", indent, e->name
+                    , timeline_usecs(start, khz), timeline_usecs(len, khz));
+        else
+            dprintf(1, "  %s%s: start=%u len=%u tsc\n", indent, e->name
+                    , (u32)start, (u32)len);
+    }
+
+    struct romfile_s *file = romfile_find("etc/boot-timeline");
+    if (!file)
+        return;
+    u32 size = sizeof(Timeline);
+    if (size > file->size)
+        size = file->size;
+    qemu_cfg_write_file(&Timeline, file, 0, size);
+}
@@ -28,12 +28,20 @@ void boot_add_cbfs(void *data, const char *desc, int prio);
 void interactive_bootmenu(void);
 void bcv_prepboot(void);
 u8 is_bootprio_strict(void);
+u8 is_fast_boot(void);
 struct pci_device;
 int bootprio_find_pci_device(struct pci_device *pci);
+int boot_defer_pci(void (*func)(void *), struct pci_device *pci);
+int boot_thread_prio(struct pci_device *pci);
+int boot_selected_prio(void);
+int boot_stop_probing(void);
 int bootprio_find_mmio_device(void *mmio);
 int bootprio_find_scsi_device(struct pci_device *pci, int target, int lun);
 int bootprio_find_scsi_mmio_device(void *mmio, int target, int lun);
+int bootprio_find_scsi_target(struct pci_device *pci, int target);
+int bootprio_find_scsi_mmio_target(void *mmio, int target);
 int bootprio_find_ata_device(struct pci_device *pci, int chanid, int slave);
+int bootprio_find_nvme_ns(struct pci_device *pci, u32 nsid);
 int bootprio_find_fdc_device(struct pci_device *pci, int port, int fdid);
 int bootprio_find_pci_rom(struct pci_device *pci, int instance);
 int bootprio_find_named_rom(const char *name, int instance);
@@ -91,6 +99,7 @@ void *smbios_get_tables(u32 *length);
 void copy_smbios_21(void *pos);
 void display_uuid(void);
 void copy_table(void *pos);
+void link_table(void *pos);
 void smbios_setup(void);
 
 // fw/dsdt_parser.c
@@ -108,11 +117,17 @@ int acpi_dsdt_find_irq(struct acpi_device *dev, u64 *irq);
 extern const char *CBvendor, *CBpart;
 struct cbfs_file;
 void coreboot_debug_putc(char c);
+void coreboot_debug_flush(void);
 void cbfs_run_payload(struct cbfs_file *file);
 void coreboot_platform_setup(void);
 void cbfs_payload_setup(void);
 void coreboot_preinit(void);
 void coreboot_cbfs_init(void);
+struct ulzma_work_s;
+struct ulzma_work_s *ulzma_work_alloc(void);
+int ulzma_with(u8 *dst, u32 maxlen, const u8 *src, u32 srclen
+               , struct ulzma_work_s *work);
+int ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen);
 struct cb_header;
 void *find_cb_subtable(struct cb_header *cbh, u32 tag);
 struct cb_header *find_cb_table(void);
@@ -121,6 +136,7 @@ struct cb_header *find_cb_table(void);
 int csm_bootprio_fdc(struct pci_device *pci, int port, int fdid);
 int csm_bootprio_ata(struct pci_device *pci, int chanid, int slave);
 int csm_bootprio_pci(struct pci_device *pci);
+int csm_ata_drives(u16 iobase1);
 
 // fw/mptable.c
 void mptable_setup(void);
@@ -129,11 +145,14 @@ void mptable_setup(void);
 void mtrr_setup(void);
 
 // fw/multiboot.c
+void multiboot_preinit(void);
 void multiboot_init(void);
+void multiboot_prepboot(void);
 
 // fw/pciinit.c
 extern u64 pcimem_start, pcimem_end;
 extern u64 pcimem64_start, pcimem64_end;
+extern u64 pcifb_start, pcifb_end;
 extern const u8 pci_irqs[4];
 void pci_setup(void);
 void pci_resume(void);
@@ -158,6 +177,7 @@ extern u32 MaxCountCPUs;
 void wrmsr_smp(u32 index, u64 val);
 void smp_setup(void);
 void smp_resume(void);
+void smp_prepboot(void);
 int apic_id_is_present(u8 apic_id);
 
 // hw/dma.c
@@ -183,7 +203,13 @@ void sdcard_setup(void);
 // hw/timer.c
 void timer_setup(void);
 void pmtimer_setup(u16 ioport);
+void hpet_setup(u64 addr);
 void tsctimer_setfreq(u32 khz, const char *src);
+u32 timer_tsc_khz(void);
+u32 timer_khz(void);
+u64 timer_tsc_read(void);
+u32 timer_tsc_msecs(u64 delta);
+u32 timer_read(void);
 u32 timer_calc(u32 msecs);
 u32 timer_calc_usec(u32 usecs);
 int timer_check(u32 end);
@@ -202,7 +228,8 @@ struct jpeg_decdata *jpeg_alloc(void);
 int jpeg_decode(struct jpeg_decdata *jpeg, unsigned char *buf);
 void jpeg_get_size(struct jpeg_decdata *jpeg, int *width, int *height);
 int jpeg_show(struct jpeg_decdata *jpeg, unsigned char *pic, int width
-              , int height, int depth, int bytes_per_line_dest);
+              , int height, int depth, int bytes_per_line_dest
+              , unsigned char *rowbuf);
 
 // kbd.c
 void kbd_init(void);
@@ -229,12 +256,15 @@ void callrom(struct rom_header *rom, u16 bdf);
 void call_bcv(u16 seg, u16 ip);
 int is_pci_vga(struct pci_device *pci);
 void optionrom_setup(void);
+void optionrom_run_lazy(void);
+void optionrom_cache_prepboot(void);
 void vgarom_setup(void);
 void s3_resume_vga(void);
 extern int ScreenAndDebug;
 
 // pcibios.c
 void handle_1ab1(struct bregs *regs);
+void pcibios_prepboot(void);
 void bios32_init(void);
 
 // pmm.c
@@ -246,6 +276,7 @@ u16 get_pnp_offset(void);
 void pnp_init(void);
 
 // post.c
+extern int WarmBoot;
 void interface_init(void);
 void device_hardware_setup(void);
 void prepareboot(void);
@@ -261,6 +292,16 @@ void sercon_check_event(void);
 void serial_setup(void);
 void lpt_setup(void);
 
+// timeline.c
+void timeline_begin(const char *name);
+void timeline_end(void);
+void timeline_export(void);
+#define TIMELINE_CALL(func) do {                \
+        timeline_begin(#func);                  \
+        func();                                 \
+        timeline_end();                         \
+    } while (0)
+
 // version.c
 extern const char VERSION[], BUILDINFO[];
 
@@ -12,8 +12,13 @@
 #define CR0_PG (1<<31) // Paging
 #define CR0_CD (1<<30) // Cache disable
 #define CR0_NW (1<<29) // Not Write-through
+#define CR0_TS (1<<3)  // Task switched
+#define CR0_EM (1<<2)  // Emulation
 #define CR0_PE (1<<0)  // Protection enable
 
+// CR4 flags
+#define CR4_OSFXSR (1<<9) // OS support for fxsave/fxrstor (enables SSE)
+
 // PORT_A20 bitdefs
 #define PORT_A20 0x0092
 #define A20_ENABLE_BIT 0x02
@@ -69,12 +74,25 @@ static inline void wbinvd(void)
 #define CPUID_APIC (1 << 9)
 #define CPUID_MTRR (1 << 12)
 #define CPUID_X2APIC (1 << 21)
+#define CPUID_SSE2 (1 << 26)
+#define CPUID_ECX_SSSE3 (1 << 9)
+#define CPUID_ECX_SSE41 (1 << 19)
+#define CPUID7_EBX_ERMS (1 << 9)
+#define CPUID7_EBX_SHA (1 << 29)
+#define CPUID_EXT7_EDX_INVTSC (1 << 8)
 static inline void __cpuid(u32 index, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
 {
     asm("cpuid"
         : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
         : "0" (index));
 }
+static inline void __cpuid_count(u32 index, u32 subleaf
+                                 , u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    asm("cpuid"
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+        : "0" (index), "2" (subleaf));
+}
 
 static inline u32 cr0_read(void) {
     u32 cr0;
@@ -87,6 +105,25 @@ static inline void cr0_write(u32 cr0) {
 static inline void cr0_mask(u32 off, u32 on) {
     cr0_write((cr0_read() & ~off) | on);
 }
+static inline u32 cr4_read(void) {
+    u32 cr4;
+    asm("movl %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+static inline void cr4_write(u32 cr4) {
+    asm("movl %0, %%cr4" : : "r"(cr4));
+}
+// Enable SSE instructions; returns the state for sse_restore().
+static inline void sse_enable(u32 *cr0, u32 *cr4) {
+    *cr0 = cr0_read();
+    *cr4 = cr4_read();
+    cr0_write(*cr0 & ~(CR0_EM | CR0_TS));
+    cr4_write(*cr4 | CR4_OSFXSR);
+}
+static inline void sse_restore(u32 cr0, u32 cr4) {
+    cr4_write(cr4);
+    cr0_write(cr0);
+}
 static inline u16 cr0_vm86_read(void) {
     u16 cr0;
     asm("smsww %0" : "=r"(cr0));
@@ -205,6 +242,10 @@ static inline void smp_rmb(void) {
 static inline void smp_wmb(void) {
     barrier();
 }
+/* Writes may pass later reads though - a locked instruction orders them */
+static inline void smp_mb(void) {
+    asm volatile("lock; addl $0, (%%esp)" : : : "memory");
+}
 
 static inline void writel(void *addr, u32 val) {
     barrier();
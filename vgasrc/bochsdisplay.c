@@ -11,12 +11,70 @@
 #include "hw/pci.h" // pci_config_readl
 #include "hw/pci_regs.h" // PCI_BASE_ADDRESS_0
 #include "vgabios.h" // SET_VGA
+#include "vgafb.h" // memcpy_high
 #include "vgautil.h" // VBE_total_memory
 
 #define FRAMEBUFFER_WIDTH      1024
 #define FRAMEBUFFER_HEIGHT     768
 #define FRAMEBUFFER_BPP        4
 
+static u32 BochsDisplayDispi VAR16;
+static u16 BochsDisplayVirtHeight VAR16;
+
+// The dispi registers are memory mapped - use int 1587 to reach them
+// from real mode.
+static void
+bochs_display_write(u16 index, u16 val)
+{
+    u16 *reg = (u16*)GET_GLOBAL(BochsDisplayDispi) + index;
+    memcpy_high(reg, MAKE_FLATPTR(GET_SEG(SS), &val), sizeof(val));
+}
+
+int
+bochs_display_get_displaystart(struct vgamode_s *curmode_g)
+{
+    return GET_BDA_EXT(displaystart_y) * cbvga_get_linelength(curmode_g);
+}
+
+int
+bochs_display_set_displaystart(struct vgamode_s *curmode_g, int val)
+{
+    u32 linelength = cbvga_get_linelength(curmode_g);
+    u32 y = val / linelength;
+    if (!GET_GLOBAL(BochsDisplayDispi) || val < 0 || val % linelength
+        || y + GET_GLOBAL(curmode_g->height) > GET_GLOBAL(BochsDisplayVirtHeight))
+        return -1;
+    bochs_display_write(VBE_DISPI_INDEX_Y_OFFSET, y);
+    SET_BDA_EXT(displaystart_y, y);
+    return 0;
+}
+
+// Scroll the whole screen up by 'lines' pixel rows by moving the
+// visible window down through video memory.  The screen contents are
+// only copied when the window reaches the end of video memory.
+int
+bochs_display_scroll(struct vgamode_s *curmode_g, int lines)
+{
+    u32 height = GET_GLOBAL(curmode_g->height);
+    if (lines <= 0 || lines >= height
+        || GET_GLOBAL(BochsDisplayVirtHeight) <= height)
+        return -1;
+    struct gfx_op op;
+    init_gfx_op(&op, curmode_g);
+    u32 y = GET_BDA_EXT(displaystart_y) + lines;
+    if (y + height > GET_GLOBAL(BochsDisplayVirtHeight)) {
+        // Wrap around - move the rows that stay visible to the start
+        op.displaystart = 0;
+        op.xlen = GET_GLOBAL(curmode_g->width);
+        op.srcy = y;
+        op.ylen = height - lines;
+        op.op = GO_MEMMOVE;
+        handle_gfx_op(&op);
+        y = 0;
+    }
+    return bochs_display_set_displaystart(curmode_g, y * op.linelength);
+}
+
 int
 bochs_display_setup(void)
 {
@@ -73,6 +131,23 @@ bochs_display_setup(void)
     writew(dispi + VBE_DISPI_INDEX_BPP,    FRAMEBUFFER_BPP * 8);
     writew(dispi + VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED);
 
+    // Use all of video memory as the virtual screen so that text can
+    // scroll by moving the display start.
+    u32 vram = readw(dispi + VBE_DISPI_INDEX_VIDEO_MEMORY_64K) * 64 * 1024;
+    u32 virt_height = vram / fb_stride;
+    if (virt_height > 0xffff)
+        virt_height = 0xffff;
+    if (virt_height < fb_height)
+        virt_height = fb_height;
+    writew(dispi + VBE_DISPI_INDEX_VIRT_WIDTH,  fb_width);
+    writew(dispi + VBE_DISPI_INDEX_VIRT_HEIGHT, virt_height);
+    writew(dispi + VBE_DISPI_INDEX_X_OFFSET,    0);
+    writew(dispi + VBE_DISPI_INDEX_Y_OFFSET,    0);
+    SET_VGA(BochsDisplayDispi, (u32)dispi);
+    SET_VGA(BochsDisplayVirtHeight, virt_height);
+    dprintf(1, "bochs-display: %d lines of video memory for scrolling\n"
+            , virt_height);
+
     writeb(vga, 0x20); /* unblank (for qemu -device VGA) */
 
     return 0;
@@ -72,11 +72,19 @@ bochsvga_list_modes(u16 seg, u16 *dest, u16 *last)
 
 static inline u16 dispi_read(u16 reg)
 {
+    u32 mmio = GET_GLOBAL(VgaMmio);
+    if (mmio)
+        return readw((void*)(mmio + VBE_DISPI_MMIO_OFFSET + reg * 2));
     outw(reg, VBE_DISPI_IOPORT_INDEX);
     return inw(VBE_DISPI_IOPORT_DATA);
 }
 static inline void dispi_write(u16 reg, u16 val)
 {
+    u32 mmio = GET_GLOBAL(VgaMmio);
+    if (mmio) {
+        writew((void*)(mmio + VBE_DISPI_MMIO_OFFSET + reg * 2), val);
+        return;
+    }
     outw(reg, VBE_DISPI_IOPORT_INDEX);
     outw(val, VBE_DISPI_IOPORT_DATA);
 }
@@ -186,6 +194,18 @@ bochsvga_set_dacformat(struct vgamode_s *curmode_g, int val)
     return 0;
 }
 
+// Return the size of the VBE protected mode interface table (see
+// vgaentry.S) and its location, or 0 if it can't be used.
+int
+bochsvga_pm_interface(void **table)
+{
+    if (!CONFIG_VGA_VBE || !GET_GLOBAL(dispi_found))
+        return 0;
+    extern u8 vbe_pm_table[], vbe_pm_table_end[];
+    *table = vbe_pm_table;
+    return vbe_pm_table_end - vbe_pm_table;
+}
+
 static int
 bochsvga_save_state(u16 seg, u16 *info)
 {
@@ -256,7 +276,8 @@ bochsvga_set_mode(struct vgamode_s *vmode_g, int flags)
 
     u8 memmodel = GET_GLOBAL(vmode_g->memmodel);
     if (memmodel == MM_PLANAR)
-        stdvga_set_mode(stdvga_find_mode(0x6a), 0);
+        // Enabling dispi below clears video memory (if requested)
+        stdvga_set_mode(stdvga_find_mode(0x6a), MF_NOCLEARMEM);
     if (memmodel == MM_PACKED && !(flags & MF_NOPALETTE))
         stdvga_set_packed_palette();
 
@@ -332,6 +353,14 @@ bochsvga_setup(void)
             bar = pci_config_readl(bdf, PCI_BASE_ADDRESS_2);
             io_addr = bar & PCI_BASE_ADDRESS_IO_MASK;
             barid = 0;
+            // Newer qemu also maps the vga and dispi registers in bar 2;
+            // use it (instead of trapping port accesses) while in init.
+            if (io_addr && !(bar & PCI_BASE_ADDRESS_SPACE_IO)
+                && readw((void*)(io_addr + VBE_DISPI_MMIO_OFFSET
+                                 + VBE_DISPI_INDEX_ID * 2)) == VBE_DISPI_ID5) {
+                dprintf(1, "VBE DISPI: mmio at %x\n", io_addr);
+                SET_VGA(VgaMmio, io_addr);
+            }
             break;
         default: /* qxl, virtio */
             barid = 0;
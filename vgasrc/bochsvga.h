@@ -11,6 +11,7 @@
 
 #define VBE_DISPI_IOPORT_INDEX           0x01CE
 #define VBE_DISPI_IOPORT_DATA            0x01CF
+#define VBE_DISPI_MMIO_OFFSET            0x500
 
 #define VBE_DISPI_INDEX_ID               0x0
 #define VBE_DISPI_INDEX_XRES             0x1
@@ -50,6 +51,7 @@ int bochsvga_get_displaystart(struct vgamode_s *curmode_g);
 int bochsvga_set_displaystart(struct vgamode_s *curmode_g, int val);
 int bochsvga_get_dacformat(struct vgamode_s *curmode_g);
 int bochsvga_set_dacformat(struct vgamode_s *curmode_g, int val);
+int bochsvga_pm_interface(void **table);
 int bochsvga_save_restore(int cmd, u16 seg, void *data);
 int bochsvga_set_mode(struct vgamode_s *vmode_g, int flags);
 int bochsvga_setup(void);
@@ -103,12 +103,16 @@ cbvga_set_linelength(struct vgamode_s *curmode_g, int val)
 int
 cbvga_get_displaystart(struct vgamode_s *curmode_g)
 {
+    if (CONFIG_DISPLAY_BOCHS)
+        return bochs_display_get_displaystart(curmode_g);
     return 0;
 }
 
 int
 cbvga_set_displaystart(struct vgamode_s *curmode_g, int val)
 {
+    if (CONFIG_DISPLAY_BOCHS)
+        return bochs_display_set_displaystart(curmode_g, val);
     return -1;
 }
 
@@ -145,6 +149,7 @@ cbvga_set_mode(struct vgamode_s *vmode_g, int flags)
      */
     u8 extra_stack = GET_BDA_EXT(flags) & BF_EXTRA_STACK;
     MASK_BDA_EXT(flags, BF_EMULATE_TEXT, emul ? BF_EMULATE_TEXT : 0);
+    cbvga_set_displaystart(vmode_g, 0);
     if (!(flags & MF_NOCLEARMEM)) {
         if (GET_GLOBAL(CBmodeinfo.memmodel) == MM_TEXT) {
             memset16_far(SEG_CTEXT, (void*)0, 0x0720, 80*25*2);
@@ -158,6 +163,7 @@ cbvga_set_mode(struct vgamode_s *vmode_g, int flags)
             op.ylen = GET_GLOBAL(CBmodeinfo.height);
             op.op = GO_MEMSET;
             handle_gfx_op(&op);
+            vgafb_text_shadow_cleared();
         }
     }
     return 0;
@@ -11,8 +11,9 @@
 #include "hw/pci_regs.h" // PCI_BASE_ADDRESS_0
 #include "output.h" // dprintf
 #include "stdvga.h" // VGAREG_SEQU_ADDRESS
-#include "string.h" // memset16_far
+#include "string.h" // memset32_far
 #include "vgabios.h" // SET_VGA
+#include "vgafb.h" // struct gfx_op
 #include "vgautil.h" // VBE_total_memory
 
 
@@ -308,6 +309,76 @@ clext_list_modes(u16 seg, u16 *dest, u16 *last)
  * helper functions
  ****************************************************************/
 
+// Perform a GO_MEMSET or GO_MEMMOVE with the bitblt engine ('color' is
+// the framebuffer value for a fill).  Returns 0 if it was done - the
+// caller falls back to a software copy otherwise.
+int
+clext_gfx_accel(struct gfx_op *op, u32 color)
+{
+    struct vgamode_s *curmode_g = op->curmode_g;
+    if (!is_cirrus_mode(curmode_g))
+        return -1;
+    if (stdvga_grdc_read(0x31) & 0x01)
+        // Blitter busy
+        return -1;
+    int bypp = DIV_ROUND_UP(GET_GLOBAL(curmode_g->depth), 8);
+    u32 width = op->xlen * bypp, height = op->ylen, pitch = op->linelength;
+    if (!width || !height || width > 0x2000 || height > 0x800
+        || pitch >= 0x2000)
+        return -1;
+    // Packed modes are drawn at the start of video memory (see
+    // gfx_packed()), direct modes relative to the display start.
+    u32 base = GET_GLOBAL(curmode_g->memmodel) == MM_DIRECT
+               ? op->displaystart : 0;
+    u32 dest = base + op->y * pitch + op->x * bypp, src = 0;
+    u8 mode = (bypp - 1) << 4, modeext = 0;
+    u8 gr0 = stdvga_grdc_read(0x00), gr1 = stdvga_grdc_read(0x01);
+    if (op->op == GO_MEMSET) {
+        // Solid fill with the foreground color
+        mode |= 0xc0;
+        modeext = 0x04;
+        stdvga_grdc_write(0x01, color);
+        stdvga_grdc_write(0x11, color >> 8);
+        stdvga_grdc_write(0x13, color >> 16);
+        stdvga_grdc_write(0x15, color >> 24);
+    } else {
+        src = base + op->srcy * pitch + op->x * bypp;
+        if (src < dest) {
+            // Copy backwards from the last byte
+            mode |= 0x01;
+            dest += (height - 1) * pitch + width - 1;
+            src += (height - 1) * pitch + width - 1;
+        }
+    }
+    stdvga_grdc_write(0x20, width - 1);
+    stdvga_grdc_write(0x21, (width - 1) >> 8);
+    stdvga_grdc_write(0x22, height - 1);
+    stdvga_grdc_write(0x23, (height - 1) >> 8);
+    stdvga_grdc_write(0x24, pitch);
+    stdvga_grdc_write(0x25, pitch >> 8);
+    stdvga_grdc_write(0x26, pitch);
+    stdvga_grdc_write(0x27, pitch >> 8);
+    stdvga_grdc_write(0x28, dest);
+    stdvga_grdc_write(0x29, dest >> 8);
+    stdvga_grdc_write(0x2a, dest >> 16);
+    stdvga_grdc_write(0x2c, src);
+    stdvga_grdc_write(0x2d, src >> 8);
+    stdvga_grdc_write(0x2e, src >> 16);
+    stdvga_grdc_write(0x30, mode);
+    stdvga_grdc_write(0x32, 0x0d); // rop: source copy
+    stdvga_grdc_write(0x33, modeext);
+    stdvga_grdc_write(0x31, 0x02); // start
+
+    int i;
+    for (i = 0; i < 0x100000 && stdvga_grdc_read(0x31) & 0x01; i++)
+        ;
+    // Restore the standard vga set/reset registers (they share the
+    // foreground/background color registers).
+    stdvga_grdc_write(0x00, gr0);
+    stdvga_grdc_write(0x01, gr1);
+    return 0;
+}
+
 int
 clext_get_window(struct vgamode_s *curmode_g, int window)
 {
@@ -427,14 +498,14 @@ cirrus_enable_16k_granularity(void)
 }
 
 static void
-cirrus_clear_vram(u16 fill)
+cirrus_clear_vram(u32 fill)
 {
     cirrus_enable_16k_granularity();
     int count = GET_GLOBAL(VBE_total_memory) / (16 * 1024);
     int i;
     for (i=0; i<count; i++) {
         stdvga_grdc_write(0x09, i);
-        memset16_far(SEG_GRAPH, 0, fill, 16 * 1024);
+        memset32_far(SEG_GRAPH, 0, fill, 16 * 1024);
     }
     stdvga_grdc_write(0x09, 0x00);
 }
@@ -456,7 +527,7 @@ clext_set_mode(struct vgamode_s *vmode_g, int flags)
         cirrus_enable_16k_granularity();
     if (!(flags & MF_NOCLEARMEM))
         // fill with 0xff to keep win 2K happy
-        cirrus_clear_vram(flags & MF_LEGACY ? 0xffff : 0x0000);
+        cirrus_clear_vram(flags & MF_LEGACY ? 0xffffffff : 0x00000000);
     return 0;
 }
 
@@ -7,6 +7,7 @@
 #include "biosvar.h" // GET_BDA
 #include "output.h" // dprintf
 #include "string.h" // memset16_far
+#include "vgafb.h" // vgafb_damage_setup
 #include "vgautil.h" // VBE_total_memory
 #include "std/pmm.h" // struct pmmheader
 #include "byteorder.h"
@@ -68,7 +69,7 @@ qemu_cfg_write_entry(void *buf, int e, int len)
 }
 
 static int
-qemu_cfg_find_file(const char *filename)
+qemu_cfg_find_file(const char *filename, int len)
 {
     u32 count, e, select;
 
@@ -78,7 +79,7 @@ qemu_cfg_find_file(const char *filename)
         struct QemuCfgFile qfile;
         qemu_cfg_read(&qfile, sizeof(qfile));
         if (memcmp_far(GET_SEG(SS), qfile.name,
-                       GET_SEG(CS), filename, 10) == 0)
+                       GET_SEG(CS), filename, len) == 0)
             select = be16_to_cpu(qfile.select);
     }
     return select;
@@ -108,6 +109,23 @@ struct QemuRAMFBCfg {
 #define DRM_FORMAT_RGB888       fourcc_code('R', 'G', '2', '4') /* [23:0] R:G:B little endian */
 #define DRM_FORMAT_XRGB8888     fourcc_code('X', 'R', '2', '4') /* [31:0] x:R:G:B 8:8:8:8 little endian */
 
+// Tell the host where the framebuffer damage table is
+static void
+ramfb_publish_damage(void)
+{
+    if (!CONFIG_VGA_DAMAGE_TRACKING)
+        return;
+    u32 select = qemu_cfg_find_file("etc/vga-damage"
+                                    , sizeof("etc/vga-damage"));
+    if (!select)
+        return;
+    u32 table = vgafb_damage_setup();
+    if (!table)
+        return;
+    u64 addr = cpu_to_be64((u64)table);
+    qemu_cfg_write_entry(&addr, select, sizeof(addr));
+}
+
 static u32
 allocate_framebuffer(void)
 {
@@ -126,7 +144,7 @@ ramfb_setup(void)
     if (GET_GLOBAL(HaveRunInit))
         return 0;
 
-    u32 select = qemu_cfg_find_file("etc/ramfb");
+    u32 select = qemu_cfg_find_file("etc/ramfb", sizeof("etc/ramfb"));
     if (select == 0) {
         dprintf(1, "ramfb: fw_cfg (etc/ramfb) file not found\n");
         return -1;
@@ -165,5 +183,7 @@ ramfb_setup(void)
     };
     qemu_cfg_write_entry(&cfg, select, sizeof(cfg));
 
+    ramfb_publish_damage();
+
     return 0;
 }
@@ -127,41 +127,6 @@ stdvga_get_palette_page(u8 *pal_pagesize, u8 *pal_page)
  * DAC control
  ****************************************************************/
 
-// Store dac colors into memory in 3-byte rgb format
-void
-stdvga_dac_read_many(u16 seg, u8 *data_far, u8 start, int count)
-{
-    while (count) {
-        struct vbe_palette_entry rgb = stdvga_dac_read(start);
-        SET_FARVAR(seg, *data_far, rgb.red);
-        data_far++;
-        SET_FARVAR(seg, *data_far, rgb.green);
-        data_far++;
-        SET_FARVAR(seg, *data_far, rgb.blue);
-        data_far++;
-        start++;
-        count--;
-    }
-}
-
-// Load dac colors from memory in 3-byte rgb format
-void
-stdvga_dac_write_many(u16 seg, u8 *data_far, u8 start, int count)
-{
-    while (count) {
-        u8 r = GET_FARVAR(seg, *data_far);
-        data_far++;
-        u8 g = GET_FARVAR(seg, *data_far);
-        data_far++;
-        u8 b = GET_FARVAR(seg, *data_far);
-        data_far++;
-        struct vbe_palette_entry rgb = { .red=r, .green=g, .blue=b };
-        stdvga_dac_write(start, rgb);
-        start++;
-        count--;
-    }
-}
-
 // Convert all loaded colors to shades of gray
 void
 stdvga_perform_gray_scale_summing(u16 start, u16 count)
@@ -202,6 +167,36 @@ stdvga_planar4_plane(int plane)
     }
 }
 
+// Enable writes to all planes using the given write mode (0-3) when in
+// planar4 mode.  Write mode 1 stores the latches loaded by the last
+// read and write mode 2 stores the color in the written data.
+void
+stdvga_planar4_write_mode(u8 mode)
+{
+    stdvga_sequ_write(0x02, 0x0f);
+    stdvga_grdc_mask(0x05, 0x03, mode);
+}
+
+// Write the given color to all planes on any write mode 0 access, or
+// disable set/reset when 'color' is negative.
+void
+stdvga_planar4_setreset(int color)
+{
+    if (color < 0) {
+        stdvga_grdc_write(0x01, 0x00);
+    } else {
+        stdvga_grdc_write(0x00, color);
+        stdvga_grdc_write(0x01, 0x0f);
+    }
+}
+
+// Select the pixels updated by a write (the rest come from the latches).
+void
+stdvga_planar4_bitmask(u8 mask)
+{
+    stdvga_grdc_write(0x08, mask);
+}
+
 
 /****************************************************************
  * Font loading
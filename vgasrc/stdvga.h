@@ -40,6 +40,9 @@
 #define VGAREG_CGA_MODECTL             0x3d8
 #define VGAREG_CGA_PALETTE             0x3d9
 
+// Offset of ports 0x3c0-0x3df in the qemu stdvga mmio bar
+#define VGA_MMIO_STDVGA                0x400
+
 /* Video memory */
 #define SEG_GRAPH 0xA000
 #define SEG_CTEXT 0xB800
@@ -56,10 +59,11 @@ void stdvga_set_palette_blinking(u8 enable_blink);
 void stdvga_set_palette_pagesize(u8 pal_pagesize);
 void stdvga_set_palette_page(u8 pal_page);
 void stdvga_get_palette_page(u8 *pal_pagesize, u8 *pal_page);
-void stdvga_dac_read_many(u16 seg, u8 *data_far, u8 start, int count);
-void stdvga_dac_write_many(u16 seg, u8 *data_far, u8 start, int count);
 void stdvga_perform_gray_scale_summing(u16 start, u16 count);
 void stdvga_planar4_plane(int plane);
+void stdvga_planar4_write_mode(u8 mode);
+void stdvga_planar4_setreset(int color);
+void stdvga_planar4_bitmask(u8 mask);
 void stdvga_set_font_location(u8 spec);
 void stdvga_load_font(u16 seg, void *src_far, u16 count
                       , u16 start, u8 destflags, u8 fontsize);
@@ -85,6 +89,7 @@ void stdvga_enable_video_addressing(u8 disable);
 int stdvga_setup(void);
 
 // stdvgaio.c
+extern u32 VgaMmio;
 u8 stdvga_pelmask_read(void);
 void stdvga_pelmask_write(u8 val);
 u8 stdvga_misc_read(void);
@@ -106,5 +111,8 @@ u8 stdvga_attrindex_read(void);
 void stdvga_attrindex_write(u8 value);
 struct vbe_palette_entry stdvga_dac_read(u8 color);
 void stdvga_dac_write(u8 color, struct vbe_palette_entry rgb);
+void stdvga_dac_read_many(u16 seg, u8 *data_far, u8 start, int count);
+void stdvga_dac_write_many(u16 seg, u8 *data_far, u8 start, int count);
+void stdvga_dac_clear(u8 start, int count);
 
 #endif // stdvga.h
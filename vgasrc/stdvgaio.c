@@ -4,33 +4,80 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
+#include "biosvar.h" // GET_GLOBAL
 #include "farptr.h" // GET_FARVAR
 #include "stdvga.h" // VGAREG_PEL_MASK
 #include "x86.h" // inb
 
+// Address of the mmio bar mirroring the vga ports (see bochsvga_setup).
+// Only set during option rom init - later callers may be in real mode
+// and unable to reach the bar.
+u32 VgaMmio VAR16;
+
+static inline void *
+vgaio_mmio(u16 port)
+{
+    u32 mmio = GET_GLOBAL(VgaMmio);
+    if (!mmio || port < VGAREG_ACTL_ADDRESS
+        || port >= VGAREG_ACTL_ADDRESS + 0x20)
+        return NULL;
+    return (void*)(mmio + VGA_MMIO_STDVGA + port - VGAREG_ACTL_ADDRESS);
+}
+
+static u8
+vgaio_inb(u16 port)
+{
+    void *addr = vgaio_mmio(port);
+    if (addr)
+        return readb(addr);
+    return inb(port);
+}
+
+static void
+vgaio_outb(u8 value, u16 port)
+{
+    void *addr = vgaio_mmio(port);
+    if (addr)
+        writeb(addr, value);
+    else
+        outb(value, port);
+}
+
+static void
+vgaio_outw(u16 value, u16 port)
+{
+    void *addr = vgaio_mmio(port);
+    if (addr) {
+        writeb(addr, value);
+        writeb(addr + 1, value >> 8);
+    } else {
+        outw(value, port);
+    }
+}
+
 u8
 stdvga_pelmask_read(void)
 {
-    return inb(VGAREG_PEL_MASK);
+    return vgaio_inb(VGAREG_PEL_MASK);
 }
 
 void
 stdvga_pelmask_write(u8 value)
 {
-    outb(value, VGAREG_PEL_MASK);
+    vgaio_outb(value, VGAREG_PEL_MASK);
 }
 
 
 u8
 stdvga_misc_read(void)
 {
-    return inb(VGAREG_READ_MISC_OUTPUT);
+    return vgaio_inb(VGAREG_READ_MISC_OUTPUT);
 }
 
 void
 stdvga_misc_write(u8 value)
 {
-    outb(value, VGAREG_WRITE_MISC_OUTPUT);
+    vgaio_outb(value, VGAREG_WRITE_MISC_OUTPUT);
 }
 
 void
@@ -43,132 +90,180 @@ stdvga_misc_mask(u8 off, u8 on)
 u8
 stdvga_sequ_read(u8 index)
 {
-    outb(index, VGAREG_SEQU_ADDRESS);
-    return inb(VGAREG_SEQU_DATA);
+    vgaio_outb(index, VGAREG_SEQU_ADDRESS);
+    return vgaio_inb(VGAREG_SEQU_DATA);
 }
 
 void
 stdvga_sequ_write(u8 index, u8 value)
 {
-    outw((value<<8) | index, VGAREG_SEQU_ADDRESS);
+    vgaio_outw((value<<8) | index, VGAREG_SEQU_ADDRESS);
 }
 
 void
 stdvga_sequ_mask(u8 index, u8 off, u8 on)
 {
-    outb(index, VGAREG_SEQU_ADDRESS);
-    u8 v = inb(VGAREG_SEQU_DATA);
-    outb((v & ~off) | on, VGAREG_SEQU_DATA);
+    vgaio_outb(index, VGAREG_SEQU_ADDRESS);
+    u8 v = vgaio_inb(VGAREG_SEQU_DATA);
+    vgaio_outb((v & ~off) | on, VGAREG_SEQU_DATA);
 }
 
 
 u8
 stdvga_grdc_read(u8 index)
 {
-    outb(index, VGAREG_GRDC_ADDRESS);
-    return inb(VGAREG_GRDC_DATA);
+    vgaio_outb(index, VGAREG_GRDC_ADDRESS);
+    return vgaio_inb(VGAREG_GRDC_DATA);
 }
 
 void
 stdvga_grdc_write(u8 index, u8 value)
 {
-    outw((value<<8) | index, VGAREG_GRDC_ADDRESS);
+    vgaio_outw((value<<8) | index, VGAREG_GRDC_ADDRESS);
 }
 
 void
 stdvga_grdc_mask(u8 index, u8 off, u8 on)
 {
-    outb(index, VGAREG_GRDC_ADDRESS);
-    u8 v = inb(VGAREG_GRDC_DATA);
-    outb((v & ~off) | on, VGAREG_GRDC_DATA);
+    vgaio_outb(index, VGAREG_GRDC_ADDRESS);
+    u8 v = vgaio_inb(VGAREG_GRDC_DATA);
+    vgaio_outb((v & ~off) | on, VGAREG_GRDC_DATA);
 }
 
 
 u8
 stdvga_crtc_read(u16 crtc_addr, u8 index)
 {
-    outb(index, crtc_addr);
-    return inb(crtc_addr + 1);
+    vgaio_outb(index, crtc_addr);
+    return vgaio_inb(crtc_addr + 1);
 }
 
 void
 stdvga_crtc_write(u16 crtc_addr, u8 index, u8 value)
 {
-    outw((value<<8) | index, crtc_addr);
+    vgaio_outw((value<<8) | index, crtc_addr);
 }
 
 void
 stdvga_crtc_mask(u16 crtc_addr, u8 index, u8 off, u8 on)
 {
-    outb(index, crtc_addr);
-    u8 v = inb(crtc_addr + 1);
-    outb((v & ~off) | on, crtc_addr + 1);
+    vgaio_outb(index, crtc_addr);
+    u8 v = vgaio_inb(crtc_addr + 1);
+    vgaio_outb((v & ~off) | on, crtc_addr + 1);
 }
 
 
 u8
 stdvga_attr_read(u8 index)
 {
-    inb(VGAREG_ACTL_RESET);
-    u8 orig = inb(VGAREG_ACTL_ADDRESS);
-    outb(index, VGAREG_ACTL_ADDRESS);
-    u8 v = inb(VGAREG_ACTL_READ_DATA);
-    inb(VGAREG_ACTL_RESET);
-    outb(orig, VGAREG_ACTL_ADDRESS);
+    vgaio_inb(VGAREG_ACTL_RESET);
+    u8 orig = vgaio_inb(VGAREG_ACTL_ADDRESS);
+    vgaio_outb(index, VGAREG_ACTL_ADDRESS);
+    u8 v = vgaio_inb(VGAREG_ACTL_READ_DATA);
+    vgaio_inb(VGAREG_ACTL_RESET);
+    vgaio_outb(orig, VGAREG_ACTL_ADDRESS);
     return v;
 }
 
 void
 stdvga_attr_write(u8 index, u8 value)
 {
-    inb(VGAREG_ACTL_RESET);
-    u8 orig = inb(VGAREG_ACTL_ADDRESS);
-    outb(index, VGAREG_ACTL_ADDRESS);
-    outb(value, VGAREG_ACTL_WRITE_DATA);
-    outb(orig, VGAREG_ACTL_ADDRESS);
+    vgaio_inb(VGAREG_ACTL_RESET);
+    u8 orig = vgaio_inb(VGAREG_ACTL_ADDRESS);
+    vgaio_outb(index, VGAREG_ACTL_ADDRESS);
+    vgaio_outb(value, VGAREG_ACTL_WRITE_DATA);
+    vgaio_outb(orig, VGAREG_ACTL_ADDRESS);
 }
 
 void
 stdvga_attr_mask(u8 index, u8 off, u8 on)
 {
-    inb(VGAREG_ACTL_RESET);
-    u8 orig = inb(VGAREG_ACTL_ADDRESS);
-    outb(index, VGAREG_ACTL_ADDRESS);
-    u8 v = inb(VGAREG_ACTL_READ_DATA);
-    outb((v & ~off) | on, VGAREG_ACTL_WRITE_DATA);
-    outb(orig, VGAREG_ACTL_ADDRESS);
+    vgaio_inb(VGAREG_ACTL_RESET);
+    u8 orig = vgaio_inb(VGAREG_ACTL_ADDRESS);
+    vgaio_outb(index, VGAREG_ACTL_ADDRESS);
+    u8 v = vgaio_inb(VGAREG_ACTL_READ_DATA);
+    vgaio_outb((v & ~off) | on, VGAREG_ACTL_WRITE_DATA);
+    vgaio_outb(orig, VGAREG_ACTL_ADDRESS);
 }
 
 u8
 stdvga_attrindex_read(void)
 {
-    inb(VGAREG_ACTL_RESET);
-    return inb(VGAREG_ACTL_ADDRESS);
+    vgaio_inb(VGAREG_ACTL_RESET);
+    return vgaio_inb(VGAREG_ACTL_ADDRESS);
 }
 
 void
 stdvga_attrindex_write(u8 value)
 {
-    inb(VGAREG_ACTL_RESET);
-    outb(value, VGAREG_ACTL_ADDRESS);
+    vgaio_inb(VGAREG_ACTL_RESET);
+    vgaio_outb(value, VGAREG_ACTL_ADDRESS);
 }
 
 
 struct vbe_palette_entry
 stdvga_dac_read(u8 color)
 {
-    outb(color, VGAREG_DAC_READ_ADDRESS);
-    u8 r = inb(VGAREG_DAC_DATA);
-    u8 g = inb(VGAREG_DAC_DATA);
-    u8 b = inb(VGAREG_DAC_DATA);
+    vgaio_outb(color, VGAREG_DAC_READ_ADDRESS);
+    u8 r = vgaio_inb(VGAREG_DAC_DATA);
+    u8 g = vgaio_inb(VGAREG_DAC_DATA);
+    u8 b = vgaio_inb(VGAREG_DAC_DATA);
     return (struct vbe_palette_entry){ .red=r, .green=g, .blue=b };
 }
 
 void
 stdvga_dac_write(u8 color, struct vbe_palette_entry rgb)
 {
-    outb(color, VGAREG_DAC_WRITE_ADDRESS);
-    outb(rgb.red, VGAREG_DAC_DATA);
-    outb(rgb.green, VGAREG_DAC_DATA);
-    outb(rgb.blue, VGAREG_DAC_DATA);
+    vgaio_outb(color, VGAREG_DAC_WRITE_ADDRESS);
+    vgaio_outb(rgb.red, VGAREG_DAC_DATA);
+    vgaio_outb(rgb.green, VGAREG_DAC_DATA);
+    vgaio_outb(rgb.blue, VGAREG_DAC_DATA);
+}
+
+// The dac advances its index after each color, so blocks of colors
+// (3-byte rgb format) are transferred with a single index write and a
+// string I/O instruction.
+
+// Store dac colors into memory in 3-byte rgb format
+void
+stdvga_dac_read_many(u16 seg, u8 *data_far, u8 start, int count)
+{
+    vgaio_outb(start, VGAREG_DAC_READ_ADDRESS);
+    if (vgaio_mmio(VGAREG_DAC_DATA)) {
+        int i;
+        for (i = 0; i < count * 3; i++)
+            SET_FARVAR(seg, data_far[i], vgaio_inb(VGAREG_DAC_DATA));
+        return;
+    }
+    SET_SEG(ES, seg);
+    insb(VGAREG_DAC_DATA, data_far, count * 3);
+}
+
+// Load dac colors from memory in 3-byte rgb format
+void
+stdvga_dac_write_many(u16 seg, u8 *data_far, u8 start, int count)
+{
+    vgaio_outb(start, VGAREG_DAC_WRITE_ADDRESS);
+    if (vgaio_mmio(VGAREG_DAC_DATA)) {
+        int i;
+        for (i = 0; i < count * 3; i++)
+            vgaio_outb(GET_FARVAR(seg, data_far[i]), VGAREG_DAC_DATA);
+        return;
+    }
+    SET_SEG(ES, seg);
+    outsb(VGAREG_DAC_DATA, data_far, count * 3);
+}
+
+static u8 DacBlack[16 * 3] VAR16;
+
+// Set dac colors to black
+void
+stdvga_dac_clear(u8 start, int count)
+{
+    while (count > 0) {
+        int n = count > 16 ? 16 : count;
+        stdvga_dac_write_many(get_global_seg(), DacBlack, start, n);
+        start += n;
+        count -= n;
+    }
 }
@@ -442,13 +442,13 @@ clear_screen(struct vgamode_s *curmode_g)
 {
     switch (GET_GLOBAL(curmode_g->memmodel)) {
     case MM_TEXT:
-        memset16_far(GET_GLOBAL(curmode_g->sstart), 0, 0x0720, 32*1024);
+        memset32_far(GET_GLOBAL(curmode_g->sstart), 0, 0x07200720, 32*1024);
         break;
     case MM_CGA:
-        memset16_far(GET_GLOBAL(curmode_g->sstart), 0, 0x0000, 32*1024);
+        memset32_far(GET_GLOBAL(curmode_g->sstart), 0, 0x00000000, 32*1024);
         break;
     default:
-        memset16_far(GET_GLOBAL(curmode_g->sstart), 0, 0x0000, 64*1024);
+        memset32_far(GET_GLOBAL(curmode_g->sstart), 0, 0x00000000, 64*1024);
     }
 }
 
@@ -472,11 +472,7 @@ stdvga_set_mode(struct vgamode_s *vmode_g, int flags)
 
         // Always 256*3 values
         stdvga_dac_write_many(get_global_seg(), palette_g, 0, palsize);
-        int i;
-        for (i = palsize; i < 0x0100; i++) {
-            struct vbe_palette_entry rgb = { };
-            stdvga_dac_write(i, rgb);
-        }
+        stdvga_dac_clear(palsize, 0x0100 - palsize);
 
         if (flags & MF_GRAYSUM)
             stdvga_perform_gray_scale_summing(0x00, 0x100);
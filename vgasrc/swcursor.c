@@ -6,10 +6,57 @@
 
 #include "biosvar.h" // GET_BDA
 #include "bregs.h" // struct bregs
+#include "output.h" // dprintf
+#include "string.h" // memset_far
 #include "vgabios.h" // get_cursor_pos
 #include "vgafb.h" // handle_gfx_op
 #include "vgautil.h" // swcursor_check_event
 
+// Pixels of the cell under the cursor, saved so that the cursor can be
+// drawn and removed without reading back the framebuffer.  The copy
+// stays valid until a vgabios call that may change the screen.
+struct swcursor_save_s {
+    u8 valid;
+    u32 last_output;        // Timer tick of the last text output call
+    u8 pixels[16][8];
+} PACKED;
+
+u16 SwCursorSeg VAR16;
+
+#define GET_SC(var)     GET_FARVAR(GET_GLOBAL(SwCursorSeg), ((struct swcursor_save_s *)0)->var)
+#define SET_SC(var, val)     SET_FARVAR(GET_GLOBAL(SwCursorSeg), ((struct swcursor_save_s *)0)->var                , (val))
+
+// Don't blink the cursor back on until text output has paused
+#define SWCURSOR_HOLD_TICKS 2
+
+// Fill the saved copy of the cell - from the text shadow when it is in
+// sync, otherwise by reading the framebuffer once.
+static void
+gfx_save_swcursor(struct gfx_op *op, struct cursorpos cp, int start, int end)
+{
+    int cheight = GET_BDA(char_height);
+    u16 cell = 0;
+    int shadow = !vgafb_text_shadow_cell(cp, &cell);
+    struct segoff_s font = get_font_data(cell);
+    u8 fgattr = (cell >> 8) & 0x0f, bgattr = cell >> 12;
+    int i;
+    for (i = start; i < cheight && i <= end; i++, op->y++) {
+        if (shadow) {
+            u8 fontline = GET_FARVAR(font.seg, *(u8*)(font.offset+i));
+            int j;
+            for (j = 0; j < 8; j++)
+                op->pixels[j] = (fontline & (0x80>>j)) ? fgattr : bgattr;
+        } else {
+            op->op = GO_READ8;
+            handle_gfx_op(op);
+        }
+        memcpy_far(GET_GLOBAL(SwCursorSeg)
+                   , ((struct swcursor_save_s *)0)->pixels[i]
+                   , GET_SEG(SS), op->pixels, sizeof(op->pixels));
+    }
+    SET_SC(valid, 1);
+}
+
 // Draw/undraw a cursor on the framebuffer by xor'ing the cursor cell
 static void
 gfx_set_swcursor(struct vgamode_s *curmode_g, int enable, struct cursorpos cp)
@@ -22,13 +69,31 @@ gfx_set_swcursor(struct vgamode_s *curmode_g, int enable, struct cursorpos cp)
     int cheight = GET_BDA(char_height);
     op.y = cp.y * cheight + start;
 
+    int saved = GET_GLOBAL(SwCursorSeg) && cheight <= 16;
+    if (saved && !GET_SC(valid)) {
+        if (enable) {
+            gfx_save_swcursor(&op, cp, start, end);
+            op.y = cp.y * cheight + start;
+        } else {
+            saved = 0;
+        }
+    }
+
     int i;
     for (i = start; i < cheight && i <= end; i++, op.y++) {
-        op.op = GO_READ8;
-        handle_gfx_op(&op);
-        int j;
-        for (j = 0; j < 8; j++)
-            op.pixels[j] ^= 0x07;
+        if (saved) {
+            memcpy_far(GET_SEG(SS), op.pixels, GET_GLOBAL(SwCursorSeg)
+                       , ((struct swcursor_save_s *)0)->pixels[i]
+                       , sizeof(op.pixels));
+        } else {
+            op.op = GO_READ8;
+            handle_gfx_op(&op);
+        }
+        if (enable || !saved) {
+            int j;
+            for (j = 0; j < 8; j++)
+                op.pixels[j] ^= 0x07;
+        }
         op.op = GO_WRITE8;
         handle_gfx_op(&op);
     }
@@ -80,6 +145,12 @@ swcursor_pre_handle10(struct bregs *regs)
     case 0x05 ... 0x0e:
     case 0x13:
         set_swcursor(0);
+        if (GET_GLOBAL(SwCursorSeg)) {
+            SET_SC(valid, 0);
+            if (regs->ah == 0x09 || regs->ah == 0x0a || regs->ah == 0x0e
+                || regs->ah == 0x13)
+                SET_SC(last_output, GET_BDA(timer_counter));
+        }
         break;
     default:
         break;
@@ -92,5 +163,25 @@ swcursor_check_event(void)
 {
     if (!vga_emulate_text())
         return;
-    set_swcursor(GET_BDA(timer_counter) % 18 < 9);
+    u32 ticks = GET_BDA(timer_counter);
+    int enable = ticks % 18 < 9;
+    if (enable && GET_GLOBAL(SwCursorSeg)
+        && ticks - GET_SC(last_output) < SWCURSOR_HOLD_TICKS)
+        // Text output in progress - leave the cursor off
+        return;
+    set_swcursor(enable);
+}
+
+// Allocate the saved copy of the cell under the cursor
+void
+swcursor_setup(void)
+{
+    if (!CONFIG_VGA_EMULATE_TEXT)
+        return;
+    u32 res = allocate_pmm(ALIGN(sizeof(struct swcursor_save_s), 16), 0, 0);
+    if (!res)
+        return;
+    dprintf(1, "VGA cursor save area allocated at %x\n", res);
+    memset_far(res >> 4, 0, 0, sizeof(struct swcursor_save_s));
+    SET_VGA(SwCursorSeg, res >> 4);
 }
@@ -27,6 +27,38 @@ u32 VBE_framebuffer VAR16;
 u16 VBE_win_granularity VAR16;
 u8 VBE_edid[256] VAR16;
 
+// The mode list and the mode independent part of the mode info block
+// are built once at init (by vbe_setup()) and copied out on request.
+static u16 VBE_modes[ARRAY_SIZE(((struct vbe_info *)0)->reserved) / 2] VAR16;
+static u8 VBE_mode_count VAR16;
+static struct vbe_mode_info VBE_mode_template VAR16;
+
+void
+vbe_setup(void)
+{
+    if (!CONFIG_VGA_VBE)
+        return;
+    vgahw_list_modes(get_global_seg(), VBE_modes
+                     , &VBE_modes[ARRAY_SIZE(VBE_modes) - 1]);
+    int count = 0;
+    while (GET_GLOBAL(VBE_modes[count]) != 0xffff)
+        count++;
+    SET_VGA(VBE_mode_count, count);
+
+    u32 win_granularity = GET_GLOBAL(VBE_win_granularity);
+    SET_VGA(VBE_mode_template.winA_attributes,
+            (win_granularity ? VBE_WINDOW_ATTRIBUTE_RELOCATABLE : 0) |
+            VBE_WINDOW_ATTRIBUTE_READABLE |
+            VBE_WINDOW_ATTRIBUTE_WRITEABLE);
+    SET_VGA(VBE_mode_template.win_granularity, win_granularity);
+    SET_VGA(VBE_mode_template.win_size, 64); /* Bank size 64K */
+    extern void entry_104f05(void);
+    SET_VGA(VBE_mode_template.win_func_ptr
+            , SEGOFF(get_global_seg(), (u32)entry_104f05));
+    SET_VGA(VBE_mode_template.reserved0, 1);
+    dprintf(1, "VBE: %d modes\n", count);
+}
+
 static void
 vbe_104f00(struct bregs *regs)
 {
@@ -69,8 +101,8 @@ vbe_104f00(struct bregs *regs)
             SEGOFF(get_global_seg(), (u32)VBE_REVISION_STRING));
 
     /* Fill list of modes */
-    u16 *last = (void*)&info->reserved[sizeof(info->reserved)];
-    vgahw_list_modes(seg, destmode, last - 1);
+    memcpy_far(seg, destmode, get_global_seg(), VBE_modes
+               , (GET_GLOBAL(VBE_mode_count) + 1) * sizeof(VBE_modes[0]));
 
     regs->ax = 0x004f;
 }
@@ -91,22 +123,10 @@ vbe_104f01(struct bregs *regs)
         return;
     }
 
-    memset_far(seg, info, 0, sizeof(*info));
-
     // Basic information about video controller.
-    u32 win_granularity = GET_GLOBAL(VBE_win_granularity);
-    SET_FARVAR(seg, info->winA_attributes,
-               (win_granularity ? VBE_WINDOW_ATTRIBUTE_RELOCATABLE : 0) |
-               VBE_WINDOW_ATTRIBUTE_READABLE |
-               VBE_WINDOW_ATTRIBUTE_WRITEABLE);
-    SET_FARVAR(seg, info->winB_attributes, 0);
-    SET_FARVAR(seg, info->win_granularity, win_granularity);
-    SET_FARVAR(seg, info->win_size, 64); /* Bank size 64K */
+    memcpy_far(seg, info, get_global_seg(), &VBE_mode_template
+               , sizeof(*info));
     SET_FARVAR(seg, info->winA_seg, GET_GLOBAL(vmode_g->sstart));
-    SET_FARVAR(seg, info->winB_seg, 0x0);
-    extern void entry_104f05(void);
-    SET_FARVAR(seg, info->win_func_ptr
-               , SEGOFF(get_global_seg(), (u32)entry_104f05));
     // Basic information about mode.
     int width = GET_GLOBAL(vmode_g->width);
     int height = GET_GLOBAL(vmode_g->height);
@@ -120,7 +140,6 @@ vbe_104f01(struct bregs *regs)
     SET_FARVAR(seg, info->bits_per_pixel, depth);
     u8 memmodel = GET_GLOBAL(vmode_g->memmodel);
     SET_FARVAR(seg, info->mem_model, memmodel);
-    SET_FARVAR(seg, info->reserved0, 1);
 
     // Mode specific info.
     u16 mode_attr = VBE_MODE_ATTRIBUTE_SUPPORTED |
@@ -193,10 +212,7 @@ vbe_104f01(struct bregs *regs)
     if (framebuffer) {
         SET_FARVAR(seg, info->phys_base, framebuffer);
 
-        SET_FARVAR(seg, info->reserved1, 0);
-        SET_FARVAR(seg, info->reserved2, 0);
         SET_FARVAR(seg, info->linear_bytes_per_scanline, linesize);
-        SET_FARVAR(seg, info->linear_pages, 0);
         SET_FARVAR(seg, info->linear_red_size, r_size);
         SET_FARVAR(seg, info->linear_red_pos, r_pos);
         SET_FARVAR(seg, info->linear_green_size, g_size);
@@ -404,19 +420,33 @@ vbe_104f09(struct bregs *regs)
         goto fail;
     u16 seg = regs->es;
     struct vbe_palette_entry *data_far = (void*)(regs->di+0);
-    int i;
+    // Convert between the 4-byte vbe format and the dac's rgb format in
+    // chunks, so each chunk is a single block transfer.
+    u8 rgb[16 * 3];
+    int i, j;
     switch (regs->bl) {
     case 0x80:
     case 0x00:
-        for (i = 0; i < count; i++) {
-            struct vbe_palette_entry rgb = GET_FARVAR(seg, data_far[i]);
-            stdvga_dac_write(start + i, rgb);
+        for (i = 0; i < count; i += 16) {
+            int n = count - i > 16 ? 16 : count - i;
+            for (j = 0; j < n; j++) {
+                struct vbe_palette_entry e = GET_FARVAR(seg, data_far[i + j]);
+                rgb[j*3] = e.red;
+                rgb[j*3 + 1] = e.green;
+                rgb[j*3 + 2] = e.blue;
+            }
+            stdvga_dac_write_many(GET_SEG(SS), rgb, start + i, n);
         }
         break;
     case 0x01:
-        for (i = 0; i < count; i++) {
-            struct vbe_palette_entry rgb = stdvga_dac_read(start + i);
-            SET_FARVAR(seg, data_far[i], rgb);
+        for (i = 0; i < count; i += 16) {
+            int n = count - i > 16 ? 16 : count - i;
+            stdvga_dac_read_many(GET_SEG(SS), rgb, start + i, n);
+            for (j = 0; j < n; j++) {
+                struct vbe_palette_entry e = {
+                    .red=rgb[j*3], .green=rgb[j*3 + 1], .blue=rgb[j*3 + 2] };
+                SET_FARVAR(seg, data_far[i + j], e);
+            }
         }
         break;
     default:
@@ -431,8 +461,21 @@ fail:
 static void
 vbe_104f0a(struct bregs *regs)
 {
-    debug_stub(regs);
-    regs->ax = 0x0100;
+    void *table;
+    int size = vgahw_pm_interface(&table);
+    if (!size) {
+        debug_stub(regs);
+        regs->ax = 0x0100;
+        return;
+    }
+    if (regs->bl) {
+        regs->ax = 0x014f;
+        return;
+    }
+    regs->es = get_global_seg();
+    regs->di = (u32)table;
+    regs->cx = size;
+    regs->ax = 0x004f;
 }
 
 static void
@@ -167,39 +167,69 @@ write_char(struct cursorpos *pcp, struct carattr ca)
     }
 }
 
-// Write a character to the screen at a given position.  Implement
-// special characters and scroll the screen if necessary.
+// Determine if write_teletype() draws the given character (instead of
+// only moving the cursor).
+static int
+teletype_draws(u8 car)
+{
+    return car != 7 && car != 8 && car != '\r' && car != '\n';
+}
+
+// Move the cursor past a character written by write_teletype().
 static void
-write_teletype(struct cursorpos *pcp, struct carattr ca)
+teletype_advance(int *px, int *py, u8 car)
 {
-    switch (ca.car) {
+    switch (car) {
     case 7:
         //FIXME should beep
         break;
     case 8:
-        if (pcp->x > 0)
-            pcp->x--;
+        if (*px > 0)
+            (*px)--;
         break;
     case '\r':
-        pcp->x = 0;
+        *px = 0;
         break;
     case '\n':
-        pcp->y++;
+        (*py)++;
         break;
     default:
-        write_char(pcp, ca);
+        // Do we need to wrap ?
+        if (++*px == GET_BDA(video_cols)) {
+            *px = 0;
+            (*py)++;
+        }
         break;
     }
+}
 
-    // Do we need to scroll ?
+// Scroll the whole page up by 'lines' for teletype output.
+static void
+teletype_scroll(u8 page, int lines)
+{
     u16 nbrows = GET_BDA(video_rows);
-    if (pcp->y > nbrows) {
-        pcp->y--;
+    struct cursorpos win = {0, 0, page};
+    struct cursorpos winsize = {GET_BDA(video_cols), nbrows+1};
+    struct carattr attr = {' ', 0, 0};
+    vgafb_scroll(win, winsize, lines > nbrows ? 0 : lines, attr);
+}
 
-        struct cursorpos win = {0, 0, pcp->page};
-        struct cursorpos winsize = {GET_BDA(video_cols), nbrows+1};
-        struct carattr attr = {' ', 0, 0};
-        vgafb_scroll(win, winsize, 1, attr);
+// Write a character to the screen at a given position.  Implement
+// special characters and scroll the screen if necessary.
+static void
+write_teletype(struct cursorpos *pcp, struct carattr ca)
+{
+    if (teletype_draws(ca.car))
+        vgafb_write_char(*pcp, ca);
+    int x = pcp->x, y = pcp->y;
+    teletype_advance(&x, &y, ca.car);
+    pcp->x = x;
+    pcp->y = y;
+
+    // Do we need to scroll ?
+    if (pcp->y > GET_BDA(video_rows)) {
+        pcp->y--;
+        teletype_scroll(pcp->page, 1);
     }
 }
 
@@ -324,6 +354,8 @@ vga_set_mode(int mode, int flags)
         break;
     }
 
+    vgafb_text_shadow_reset();
+
     return 0;
 }
 
@@ -989,17 +1021,55 @@ handle_1013(struct bregs *regs)
     u16 count = regs->cx;
     u8 *offset_far = (void*)(regs->bp + 0);
     u8 attr = regs->bl;
-    while (count--) {
-        u8 car = GET_FARVAR(regs->es, *offset_far);
-        offset_far++;
-        if (regs->al & 2) {
-            attr = GET_FARVAR(regs->es, *offset_far);
-            offset_far++;
+    int step = regs->al & 2 ? 2 : 1;
+
+    // Find how many times the string scrolls the screen
+    u16 nbrows = GET_BDA(video_rows);
+    int x = cp.x, y = cp.y, scrolls = 0, i;
+    for (i = 0; i < count; i++) {
+        teletype_advance(&x, &y, GET_FARVAR(regs->es, offset_far[i * step]));
+        if (y > nbrows) {
+            y--;
+            scrolls++;
         }
+    }
+    if (scrolls)
+        // Scroll once up front and then write the string with the
+        // cursor offset by the scroll - characters that would end up
+        // scrolled off the screen are not drawn at all.
+        teletype_scroll(cp.page, scrolls);
 
-        struct carattr ca = {car, attr, 1};
-        write_teletype(&cp, ca);
+    // Draw runs of printable characters on the same row at once
+    u16 cols = GET_BDA(video_cols);
+    x = cp.x;
+    y = cp.y - scrolls;
+    i = 0;
+    while (i < count) {
+        u8 car = GET_FARVAR(regs->es, offset_far[i * step]);
+        if (!teletype_draws(car)) {
+            teletype_advance(&x, &y, car);
+            i++;
+            continue;
+        }
+        int n = 1;
+        while (i + n < count && x + n < cols
+               && teletype_draws(GET_FARVAR(regs->es
+                                            , offset_far[(i + n) * step])))
+            n++;
+        if (y >= 0) {
+            struct cursorpos pos = {x, y, cp.page};
+            vgafb_write_chars(pos, regs->es, &offset_far[i * step], step
+                              , attr, n);
+        }
+        i += n;
+        x += n;
+        if (x == cols) {
+            x = 0;
+            y++;
+        }
     }
+    cp.x = x;
+    cp.y = y;
 
     if (regs->al & 1)
         set_cursor_pos(cp);
@@ -50,6 +50,7 @@ struct vga_bda_s {
     u8 flags;
     u16 vbe_mode;
     u16 vgamode_offset;
+    u16 displaystart_y;     // Scroll position on bochs-display
 } PACKED;
 
 #define BF_PM_MASK      0x0f
@@ -15,8 +15,49 @@
 #include "vgahw.h" // vgahw_get_linelength
 #include "vgautil.h" // VBE_framebuffer
 
+// Move an area within a segment, using 4 byte moves when the area is
+// suitably aligned.  The source and destination may overlap.
+static void
+memmove_far(u16 seg, void *dst, void *src, u32 len)
+{
+    if (!(((u32)dst | (u32)src | len) & 3)) {
+        len /= 4;
+        if (src < dst) {
+            // Copy backwards
+            dst += (len - 1) * 4;
+            src += (len - 1) * 4;
+        }
+        SET_SEG(ES, seg);
+        u16 bkup_ds;
+        asm volatile(
+            "movw %%ds, %w0\n"
+            "movw %w4, %%ds\n"
+            "cmpw %%si, %%di\n"
+            "jbe 1f\n"
+            "std\n"
+            "1:rep movsl (%%si),%%es:(%%di)\n"
+            "cld\n"
+            "movw %w0, %%ds"
+            : "=&r"(bkup_ds), "+c"(len), "+S"(src), "+D"(dst)
+            : "r"(seg), "m" (__segment_ES)
+            : "cc", "memory");
+        return;
+    }
+    if (src >= dst) {
+        memcpy_far(seg, dst, seg, src, len);
+        return;
+    }
+    while (len) {
+        // Overlapping backwards move - copy in chunks that don't overlap
+        u32 n = dst - src < len ? dst - src : len;
+        len -= n;
+        memcpy_far(seg, dst + len, seg, src + len, n);
+    }
+}
+
+// Move lines one at a time using byte moves.
 static inline void
-memmove_stride(u16 seg, void *dst, void *src, int copylen, int stride, int lines)
+memmove_lines(u16 seg, void *dst, void *src, int copylen, int stride, int lines)
 {
     if (src < dst) {
         dst += stride * (lines - 1);
@@ -27,9 +68,24 @@ memmove_stride(u16 seg, void *dst, void *src, int copylen, int stride, int lines
         memcpy_far(seg, dst, seg, src, copylen);
 }
 
+static inline void
+memmove_stride(u16 seg, void *dst, void *src, int copylen, int stride, int lines)
+{
+    if (copylen == stride) {
+        // Full lines - move them as one contiguous area
+        memmove_far(seg, dst, src, copylen * lines);
+        return;
+    }
+    memmove_lines(seg, dst, src, copylen, stride, lines);
+}
+
 static inline void
 memset_stride(u16 seg, void *dst, u8 val, int setlen, int stride, int lines)
 {
+    if (setlen == stride) {
+        memset_far(seg, dst, val, setlen * lines);
+        return;
+    }
     for (; lines; lines--, dst+=stride)
         memset_far(seg, dst, val, setlen);
 }
@@ -37,6 +93,10 @@ memset_stride(u16 seg, void *dst, u8 val, int setlen, int stride, int lines)
 static inline void
 memset16_stride(u16 seg, void *dst, u16 val, int setlen, int stride, int lines)
 {
+    if (setlen == stride) {
+        memset16_far(seg, dst, val, setlen * lines);
+        return;
+    }
     for (; lines; lines--, dst+=stride)
         memset16_far(seg, dst, val, setlen);
 }
@@ -65,32 +125,52 @@ gfx_planar(struct gfx_op *op)
                 op->pixels[pixel] |= ((data>>(7-pixel)) & 1) << plane;
         }
         break;
-    case GO_WRITE8:
-        for (plane = 0; plane<4; plane++) {
-            stdvga_planar4_plane(plane);
-            u8 data = 0;
-            int pixel;
-            for (pixel=0; pixel<8; pixel++)
-                data |= ((op->pixels[pixel]>>plane) & 1) << (7-pixel);
-            SET_FARVAR(SEG_GRAPH, *(u8*)dest_far, data);
+    case GO_WRITE8: ;
+        // Write mode 2 - the first write sets all pixels to the color
+        // of the first pixel, then each further color is written with
+        // a bit mask of its pixels.  The latches are reloaded before a
+        // masked write so the other pixels keep their new contents.
+        stdvga_planar4_write_mode(2);
+        u8 done = 0;
+        int pixel = 0, i;
+        for (;;) {
+            u8 color = op->pixels[pixel], mask = 0;
+            for (i=pixel; i<8; i++)
+                if (op->pixels[i] == color)
+                    mask |= 0x80 >> i;
+            if (done) {
+                GET_FARVAR(SEG_GRAPH, *(volatile u8*)dest_far);
+                stdvga_planar4_bitmask(mask);
+            }
+            SET_FARVAR(SEG_GRAPH, *(u8*)dest_far, color);
+            done |= mask;
+            if (done == 0xff)
+                break;
+            while (done & (0x80 >> pixel))
+                pixel++;
         }
-        break;
+        if (pixel)
+            stdvga_planar4_bitmask(0xff);
+        stdvga_planar4_write_mode(0);
+        return;
     case GO_MEMSET:
-        for (plane = 0; plane < 4; plane++) {
-            stdvga_planar4_plane(plane);
-            u8 data = (op->pixels[0] & (1<<plane)) ? 0xff : 0x00;
-            memset_stride(SEG_GRAPH, dest_far, data
-                          , op->xlen / 8, op->linelength, op->ylen);
-        }
-        break;
+        // Set/reset supplies the color for all planes in one pass
+        stdvga_planar4_write_mode(0);
+        stdvga_planar4_setreset(op->pixels[0] & 0x0f);
+        memset_stride(SEG_GRAPH, dest_far, 0xff
+                      , op->xlen / 8, op->linelength, op->ylen);
+        stdvga_planar4_setreset(-1);
+        return;
     case GO_MEMMOVE: ;
+        // Write mode 1 - each byte read loads all four planes into the
+        // latches and the following write stores them.  This requires
+        // byte sized accesses.
         void *src_far = (void*)(op->srcy * op->linelength + op->x / 8);
-        for (plane = 0; plane < 4; plane++) {
-            stdvga_planar4_plane(plane);
-            memmove_stride(SEG_GRAPH, dest_far, src_far
-                           , op->xlen / 8, op->linelength, op->ylen);
-        }
-        break;
+        stdvga_planar4_write_mode(1);
+        memmove_lines(SEG_GRAPH, dest_far, src_far
+                      , op->xlen / 8, op->linelength, op->ylen);
+        stdvga_planar4_write_mode(0);
+        return;
     }
     stdvga_planar4_plane(-1);
 }
@@ -182,6 +262,99 @@ gfx_packed(struct gfx_op *op)
 }
 
 
+/****************************************************************
+ * Damage tracking
+ ****************************************************************/
+
+// Table of framebuffer areas changed by the vgabios.  The host may
+// consume the rectangles and reset 'count' to zero; 'seq' is
+// incremented after every update.
+#define VGA_DAMAGE_SIGNATURE 0x44414756 // "VGAD"
+#define VGA_DAMAGE_RECTS 8
+
+struct vga_damage_rect_s {
+    u16 x, y, width, height;
+};
+
+struct vga_damage_s {
+    u32 signature;
+    u8 version;
+    u8 count;
+    u8 max;
+    u8 reserved;
+    u32 seq;
+    struct vga_damage_rect_s rects[VGA_DAMAGE_RECTS];
+};
+
+u16 DamageSeg VAR16;
+
+#define GET_DMG(var)                                                    \
+    GET_FARVAR(GET_GLOBAL(DamageSeg), ((struct vga_damage_s *)0)->var)
+#define SET_DMG(var, val)                                               \
+    SET_FARVAR(GET_GLOBAL(DamageSeg), ((struct vga_damage_s *)0)->var, (val))
+
+// Allocate the damage table (during post).  Returns its address.
+u32
+vgafb_damage_setup(void)
+{
+    if (!CONFIG_VGA_DAMAGE_TRACKING)
+        return 0;
+    if (GET_GLOBAL(DamageSeg))
+        return GET_GLOBAL(DamageSeg) << 4;
+    u32 res = allocate_pmm(ALIGN(sizeof(struct vga_damage_s), 16), 0, 0);
+    if (!res)
+        return 0;
+    dprintf(1, "VGA damage table allocated at %x\n", res);
+    memset_far(res >> 4, 0, 0, sizeof(struct vga_damage_s));
+    SET_FARVAR(res >> 4, ((struct vga_damage_s *)0)->signature
+               , VGA_DAMAGE_SIGNATURE);
+    SET_FARVAR(res >> 4, ((struct vga_damage_s *)0)->version, 1);
+    SET_FARVAR(res >> 4, ((struct vga_damage_s *)0)->max, VGA_DAMAGE_RECTS);
+    SET_VGA(DamageSeg, res >> 4);
+    return res;
+}
+
+// Record a changed area.  It is merged into the existing rectangle
+// that grows the least, or added as a new rectangle if every merge
+// would cover extra area and there is room.
+static void
+vgafb_damage(u16 x, u16 y, u16 width, u16 height)
+{
+    if (!CONFIG_VGA_DAMAGE_TRACKING || !GET_GLOBAL(DamageSeg)
+        || !width || !height)
+        return;
+    struct vga_damage_rect_s new = {x, y, width, height}, best;
+    u32 area = (u32)width * height, bestcost = ~0;
+    int count = GET_DMG(count), bestidx = -1, i;
+    if (count > VGA_DAMAGE_RECTS)
+        count = 0;
+    for (i = 0; i < count && bestcost; i++) {
+        struct vga_damage_rect_s r = GET_DMG(rects[i]);
+        u16 ux = x < r.x ? x : r.x, uy = y < r.y ? y : r.y;
+        u16 ux2 = x + width, uy2 = y + height;
+        if (ux2 < r.x + r.width)
+            ux2 = r.x + r.width;
+        if (uy2 < r.y + r.height)
+            uy2 = r.y + r.height;
+        u32 uarea = (u32)(ux2 - ux) * (uy2 - uy);
+        u32 rarea = (u32)r.width * r.height;
+        u32 cost = uarea > rarea + area ? uarea - rarea - area : 0;
+        if (cost < bestcost) {
+            bestcost = cost;
+            bestidx = i;
+            best = (struct vga_damage_rect_s){ux, uy, ux2 - ux, uy2 - uy};
+        }
+    }
+    if (bestidx < 0 || (bestcost && count < VGA_DAMAGE_RECTS)) {
+        bestidx = count;
+        best = new;
+        SET_DMG(count, count + 1);
+    }
+    SET_DMG(rects[bestidx], best);
+    SET_DMG(seq, GET_DMG(seq) + 1);
+}
+
+
 /****************************************************************
  * Direct framebuffers in high mem
  ****************************************************************/
@@ -210,9 +383,46 @@ void memcpy_high(void *dest, void *src, u32 len)
         : : "cc", "memory");
 }
 
+// Largest copy a single int 1587 call can do
+#define MEMCPY_HIGH_MAX (64 * 1024)
+
+// Copy between possibly overlapping framebuffer areas using as few
+// int 1587 calls as possible - each piece is no larger than the
+// distance between the areas so no single call overlaps.
+static void
+memmove_high(void *dst, void *src, u32 len)
+{
+    u32 chunk = dst > src ? dst - src : src - dst;
+    if (chunk > MEMCPY_HIGH_MAX)
+        chunk = MEMCPY_HIGH_MAX;
+    chunk &= ~3;
+    if (!chunk)
+        return;
+    if (src < dst) {
+        while (len) {
+            u32 n = len < chunk ? len : chunk;
+            len -= n;
+            memcpy_high(dst + len, src + len, n);
+        }
+        return;
+    }
+    while (len) {
+        u32 n = len < chunk ? len : chunk;
+        memcpy_high(dst, src, n);
+        dst += n;
+        src += n;
+        len -= n;
+    }
+}
+
 static void
 memmove_stride_high(void *dst, void *src, int copylen, int stride, int lines)
 {
+    if (copylen == stride) {
+        // Full lines - move them as one contiguous area
+        memmove_high(dst, src, copylen * lines);
+        return;
+    }
     if (src < dst) {
         dst += stride * (lines - 1);
         src += stride * (lines - 1);
@@ -222,25 +432,57 @@ memmove_stride_high(void *dst, void *src, int copylen, int stride, int lines)
         memcpy_high(dst, src, copylen);
 }
 
+// Replicate the 'filled' byte pattern at 'dst' until 'len' bytes are
+// set, doubling the size of each copy.  Copies are kept a multiple of
+// the pattern size so the pattern stays in phase.
+static void
+memfill_high(void *dst, u32 filled, u32 len)
+{
+    u32 max = filled;
+    while (max <= MEMCPY_HIGH_MAX / 2)
+        max <<= 1;
+    while (filled < len) {
+        u32 n = len - filled;
+        if (n > filled)
+            n = filled;
+        if (n > max)
+            n = max;
+        memcpy_high(dst + filled, dst, n);
+        filled += n;
+    }
+}
+
+// "Direct" mode rgb values of the 16 CGA colors - these are built at
+// compile time so drawing text does not recompute them per pixel.
+#define CGA_LEVEL(bits, lvl) (((((1 << (bits)) - 1) * (lvl)) + 1) / 3)
+#define CGA_H(attr) (((attr) & 8) ? 1 : 0)
+#define CGA_R(attr) ((((attr) & 4) ? 2 : 0) + CGA_H(attr))
+#define CGA_G(attr) (((attr) == 6 ? 1 : ((attr) & 2) ? 2 : 0) + CGA_H(attr))
+#define CGA_B(attr) ((((attr) & 1) ? 2 : 0) + CGA_H(attr))
+#define CGA_COLOR(rbits, gbits, bbits, attr)                            \
+    ((CGA_LEVEL(rbits, CGA_R(attr)) << ((gbits) + (bbits)))             \
+     + (CGA_LEVEL(gbits, CGA_G(attr)) << (bbits))                       \
+     + CGA_LEVEL(bbits, CGA_B(attr)))
+#define CGA_COLORS(rbits, gbits, bbits) {                               \
+    CGA_COLOR(rbits, gbits, bbits, 0), CGA_COLOR(rbits, gbits, bbits, 1), \
+    CGA_COLOR(rbits, gbits, bbits, 2), CGA_COLOR(rbits, gbits, bbits, 3), \
+    CGA_COLOR(rbits, gbits, bbits, 4), CGA_COLOR(rbits, gbits, bbits, 5), \
+    CGA_COLOR(rbits, gbits, bbits, 6), CGA_COLOR(rbits, gbits, bbits, 7), \
+    CGA_COLOR(rbits, gbits, bbits, 8), CGA_COLOR(rbits, gbits, bbits, 9), \
+    CGA_COLOR(rbits, gbits, bbits, 10), CGA_COLOR(rbits, gbits, bbits, 11), \
+    CGA_COLOR(rbits, gbits, bbits, 12), CGA_COLOR(rbits, gbits, bbits, 13), \
+    CGA_COLOR(rbits, gbits, bbits, 14), CGA_COLOR(rbits, gbits, bbits, 15) }
+
+static u32 DirectColors[3][16] VAR16 = {
+    CGA_COLORS(5, 5, 5), CGA_COLORS(5, 6, 5), CGA_COLORS(8, 8, 8)
+};
+
 // Map a CGA color to a "direct" mode rgb value.
-static u32
+static inline u32
 get_color(int depth, u8 attr)
 {
-    int rbits, gbits, bbits;
-    switch (depth) {
-    case 15: rbits=5; gbits=5; bbits=5; break;
-    case 16: rbits=5; gbits=6; bbits=5; break;
-    default:
-    case 24: rbits=8; gbits=8; bbits=8; break;
-    }
-    int h = (attr&8) ? 1 : 0;
-    int r = (attr&4) ? 2 : 0, g = (attr&2) ? 2 : 0, b = (attr&1) ? 2 : 0;
-    if ((attr & 0xf) == 6)
-        g = 1;
-    int rv = DIV_ROUND_CLOSEST(((1<<rbits) - 1) * (r + h), 3);
-    int gv = DIV_ROUND_CLOSEST(((1<<gbits) - 1) * (g + h), 3);
-    int bv = DIV_ROUND_CLOSEST(((1<<bbits) - 1) * (b + h), 3);
-    return (rv << (gbits+bbits)) + (gv << bbits) + bv;
+    int idx = depth == 15 ? 0 : (depth == 16 ? 1 : 2);
+    return GET_GLOBAL(DirectColors[idx][attr & 0xf]);
 }
 
 // Find the closest attribute for a given framebuffer color
@@ -276,6 +518,10 @@ gfx_direct(struct gfx_op *op)
                       + op->x * bypp);
     u8 data[64];
     int i;
+    if (op->op == GO_WRITE8)
+        vgafb_damage(op->x, op->y, 8, 1);
+    else if (op->op == GO_MEMSET || op->op == GO_MEMMOVE)
+        vgafb_damage(op->x, op->y, op->xlen, op->ylen);
     switch (op->op) {
     default:
     case GO_READ8:
@@ -293,7 +539,12 @@ gfx_direct(struct gfx_op *op)
         for (i=0; i<8; i++)
             *(u32*)&data[i*bypp] = color;
         memcpy_high(dest_far, MAKE_FLATPTR(GET_SEG(SS), data), bypp * 8);
-        memcpy_high(dest_far + bypp * 8, dest_far, op->xlen * bypp - bypp * 8);
+        if (op->xlen * bypp == op->linelength) {
+            // Full lines - fill the whole area as one contiguous run
+            memfill_high(dest_far, bypp * 8, op->linelength * op->ylen);
+            break;
+        }
+        memfill_high(dest_far, bypp * 8, op->xlen * bypp);
         for (i=1; i < op->ylen; i++)
             memcpy_high(dest_far + op->linelength * i
                         , dest_far, op->xlen * bypp);
@@ -326,7 +577,20 @@ init_gfx_op(struct gfx_op *op, struct vgamode_s *curmode_g)
 void
 handle_gfx_op(struct gfx_op *op)
 {
-    switch (GET_GLOBAL(op->curmode_g->memmodel)) {
+    u8 memmodel = GET_GLOBAL(op->curmode_g->memmodel);
+    if (CONFIG_VGA_CIRRUS && (op->op == GO_MEMSET || op->op == GO_MEMMOVE)
+        && (memmodel == MM_PACKED || memmodel == MM_DIRECT)) {
+        // Try to offload fills and moves to the hardware
+        u32 color = op->pixels[0];
+        if (memmodel == MM_DIRECT)
+            color = get_color(GET_GLOBAL(op->curmode_g->depth), color);
+        if (!vgahw_gfx_accel(op, color)) {
+            if (memmodel == MM_DIRECT)
+                vgafb_damage(op->x, op->y, op->xlen, op->ylen);
+            return;
+        }
+    }
+    switch (memmodel) {
     case MM_PLANAR:
         gfx_planar(op);
         break;
@@ -344,16 +608,206 @@ handle_gfx_op(struct gfx_op *op)
     }
 }
 
+
+/****************************************************************
+ * Emulated text shadow
+ ****************************************************************/
+
+// Characters and attributes of an emulated text screen, so that text
+// can be read back and scrolled without reading the framebuffer.
+struct text_shadow_s {
+    u8 valid;
+    u8 cleared;     // Framebuffer was cleared by the last mode set
+    u16 cols, rows;
+    u16 cells[];
+};
+
+u16 TextShadowSeg VAR16;
+u16 TextShadowSize VAR16;   // Capacity in cells
+
+#define GET_TS(var)                                                     \
+    GET_FARVAR(GET_GLOBAL(TextShadowSeg), ((struct text_shadow_s *)0)->var)
+#define SET_TS(var, val)                                                \
+    SET_FARVAR(GET_GLOBAL(TextShadowSeg), ((struct text_shadow_s *)0)->var \
+               , (val))
+
+// A framebuffer scroll reads back every pixel it moves while a redraw
+// only writes - weigh the moves accordingly when choosing between them.
+#define TEXT_SHADOW_READBACK_COST 4
+
+static inline int
+text_shadow_present(void)
+{
+    return CONFIG_VGA_TEXT_SHADOW && GET_GLOBAL(TextShadowSeg)
+        && vga_emulate_text();
+}
+
+// Return true if the shadow tracks the current screen contents.
+static int
+text_shadow_active(void)
+{
+    return text_shadow_present() && GET_TS(valid);
+}
+
+static inline u16
+text_shadow_get(int x, int y)
+{
+    return GET_TS(cells[y * GET_TS(cols) + x]);
+}
+
+static inline void
+text_shadow_set(int x, int y, u16 cell)
+{
+    SET_TS(cells[y * GET_TS(cols) + x], cell);
+}
+
+// Shadow value of a cell cleared with the given attribute - matches
+// what decoding the blank cell from the framebuffer would report.
+static u16
+text_shadow_blank(u8 attr)
+{
+    u8 bgattr = attr >> 4;
+    return (((bgattr << 4) | (bgattr ^ 0x7)) << 8) | ' ';
+}
+
+// Note that the mode set in progress cleared the framebuffer.
+void
+vgafb_text_shadow_cleared(void)
+{
+    if (CONFIG_VGA_TEXT_SHADOW && GET_GLOBAL(TextShadowSeg))
+        SET_TS(cleared, 1);
+}
+
+// Resynchronize the shadow after a mode set.
+void
+vgafb_text_shadow_reset(void)
+{
+    if (!CONFIG_VGA_TEXT_SHADOW || !GET_GLOBAL(TextShadowSeg))
+        return;
+    u16 cols = GET_BDA(video_cols), rows = GET_BDA(video_rows) + 1;
+    int valid = (GET_TS(cleared) && vga_emulate_text()
+                 && cols * rows <= GET_GLOBAL(TextShadowSize));
+    SET_TS(cleared, 0);
+    SET_TS(valid, valid);
+    if (!valid)
+        return;
+    SET_TS(cols, cols);
+    SET_TS(rows, rows);
+    memset16_far(GET_GLOBAL(TextShadowSeg), ((struct text_shadow_s *)0)->cells
+                 , text_shadow_blank(0x00), cols * rows * 2);
+}
+
+// Report the shadow contents of a cell if the shadow is in sync.
+int
+vgafb_text_shadow_cell(struct cursorpos cp, u16 *cell)
+{
+    if (!text_shadow_active() || cp.x >= GET_TS(cols) || cp.y >= GET_TS(rows))
+        return -1;
+    *cell = text_shadow_get(cp.x, cp.y);
+    return 0;
+}
+
+// Clear an area of the shadow.  A full screen clear brings an out of
+// sync shadow back in sync.
+static void
+text_shadow_clear(struct cursorpos win, struct cursorpos winsize
+                  , struct carattr ca)
+{
+    if (!text_shadow_present())
+        return;
+    if (!GET_TS(valid)) {
+        u16 cols = GET_BDA(video_cols), rows = GET_BDA(video_rows) + 1;
+        if (win.x || win.y || winsize.x < cols || winsize.y < rows
+            || cols * rows > GET_GLOBAL(TextShadowSize))
+            return;
+        SET_TS(cols, cols);
+        SET_TS(rows, rows);
+        SET_TS(valid, 1);
+    }
+    u16 blank = text_shadow_blank(ca.attr);
+    int y;
+    for (y = win.y; y < win.y + winsize.y; y++)
+        memset16_far(GET_GLOBAL(TextShadowSeg)
+                     , &((struct text_shadow_s *)0)->cells[
+                         y * GET_TS(cols) + win.x]
+                     , blank, winsize.x * 2);
+}
+
+static void gfx_write_char(struct vgamode_s *curmode_g
+                           , struct cursorpos cp, struct carattr ca);
+
+// Move characters in the shadow.  If only a few cells change, redraw
+// just those and return 1; otherwise return 0 so the caller moves the
+// framebuffer contents.
+static int
+text_shadow_move(struct vgamode_s *curmode_g, struct cursorpos dest
+                 , struct cursorpos movesize, int lines)
+{
+    int x, y, changed = 0;
+    for (y = dest.y; y < dest.y + movesize.y; y++)
+        for (x = dest.x; x < dest.x + movesize.x; x++)
+            if (text_shadow_get(x, y) != text_shadow_get(x, y + lines))
+                changed++;
+
+    // Estimate the int 1587 calls of each approach
+    struct gfx_op op;
+    init_gfx_op(&op, curmode_g);
+    int cheight = GET_BDA(char_height);
+    int bypp = DIV_ROUND_UP(GET_GLOBAL(curmode_g->depth), 8);
+    u32 movecalls = movesize.y * cheight;
+    if (movesize.x * 8 * bypp == op.linelength) {
+        u32 dist = (lines < 0 ? -lines : lines) * cheight * op.linelength;
+        if (dist > MEMCPY_HIGH_MAX)
+            dist = MEMCPY_HIGH_MAX;
+        movecalls = DIV_ROUND_UP(movesize.y * cheight * op.linelength, dist);
+    }
+    int redraw = changed * cheight <= movecalls * TEXT_SHADOW_READBACK_COST;
+
+    int step = lines > 0 ? 1 : -1;
+    int first = lines > 0 ? dest.y : dest.y + movesize.y - 1;
+    for (y = first; y >= dest.y && y < dest.y + movesize.y; y += step) {
+        for (x = dest.x; x < dest.x + movesize.x; x++) {
+            u16 cell = text_shadow_get(x, y + lines);
+            if (cell == text_shadow_get(x, y))
+                continue;
+            text_shadow_set(x, y, cell);
+            if (redraw) {
+                struct cursorpos cp = {x, y, dest.page};
+                gfx_write_char(curmode_g, cp
+                               , (struct carattr){cell, cell >> 8, 1});
+            }
+        }
+    }
+    return redraw;
+}
+
 // Move characters when in graphics mode.
 static void
 gfx_move_chars(struct vgamode_s *curmode_g, struct cursorpos dest
                , struct cursorpos movesize, int lines)
 {
+    int cheight = GET_BDA(char_height);
+    if (vga_emulate_text() && !dest.x && !dest.y && lines > 0
+        && movesize.x == GET_BDA(video_cols)
+        && movesize.y + lines == GET_BDA(video_rows) + 1
+        && !vgahw_scroll(curmode_g, lines * cheight)) {
+        // The hardware scrolled the whole screen
+        if (text_shadow_active())
+            memmove_far(GET_GLOBAL(TextShadowSeg)
+                        , ((struct text_shadow_s *)0)->cells
+                        , &((struct text_shadow_s *)0)->cells[
+                            lines * GET_TS(cols)]
+                        , movesize.y * GET_TS(cols) * 2);
+        return;
+    }
+    if (text_shadow_active()
+        && text_shadow_move(curmode_g, dest, movesize, lines))
+        return;
+
     struct gfx_op op;
     init_gfx_op(&op, curmode_g);
     op.x = dest.x * 8;
     op.xlen = movesize.x * 8;
-    int cheight = GET_BDA(char_height);
     op.y = dest.y * cheight;
     op.ylen = movesize.y * cheight;
     op.srcy = op.y + lines * cheight;
@@ -376,6 +830,7 @@ gfx_clear_chars(struct vgamode_s *curmode_g, struct cursorpos win
     op.pixels[0] = ca.attr;
     if (vga_emulate_text())
         op.pixels[0] = ca.attr >> 4;
+    text_shadow_clear(win, winsize, ca);
     op.op = GO_MEMSET;
     handle_gfx_op(&op);
 }
@@ -416,6 +871,9 @@ gfx_write_char(struct vgamode_s *curmode_g
         if (ca.use_attr) {
             bgattr = fgattr >> 4;
             fgattr = fgattr & 0x0f;
+        } else if (text_shadow_active()) {
+            bgattr = text_shadow_get(cp.x, cp.y) >> 12;
+            fgattr = bgattr ^ 0x7;
         } else {
             // Read bottom right pixel of the cell to guess bg color
             op.op = GO_READ8;
@@ -425,6 +883,9 @@ gfx_write_char(struct vgamode_s *curmode_g
             bgattr = op.pixels[7];
             fgattr = bgattr ^ 0x7;
         }
+        if (text_shadow_active())
+            text_shadow_set(cp.x, cp.y
+                            , ((fgattr | (bgattr << 4)) << 8) | ca.car);
     } else if (fgattr & 0x80 && GET_GLOBAL(curmode_g->depth) < 8) {
         usexor = 1;
         fgattr &= 0x7f;
@@ -456,6 +917,10 @@ gfx_read_char(struct vgamode_s *curmode_g, struct cursorpos cp)
     int cheight = GET_BDA(char_height);
     if (cp.x >= GET_BDA(video_cols) || cheight > ARRAY_SIZE(lines))
         goto fail;
+    if (text_shadow_active()) {
+        u16 cell = text_shadow_get(cp.x, cp.y);
+        return (struct carattr){cell, cell >> 8, 0};
+    }
 
     // Read cell from screen
     struct gfx_op op;
@@ -506,6 +971,10 @@ vgafb_write_pixel(u8 color, u16 x, u16 y)
     if (!curmode_g)
         return;
 
+    // Pixels drawn over emulated text are not tracked by the shadow
+    if (text_shadow_present())
+        SET_TS(valid, 0);
+
     struct gfx_op op;
     init_gfx_op(&op, curmode_g);
     op.x = ALIGN_DOWN(x, 8);
@@ -643,6 +1112,33 @@ vgafb_write_char(struct cursorpos cp, struct carattr ca)
     }
 }
 
+// Write a run of characters (each followed by its attribute if 'step'
+// is 2) on one row of the screen.  The mode is only looked up once.
+void
+vgafb_write_chars(struct cursorpos cp, u16 seg, u8 *str_far, int step
+                  , u8 attr, int count)
+{
+    struct vgamode_s *curmode_g = get_current_mode();
+    if (!curmode_g)
+        return;
+
+    int text = GET_GLOBAL(curmode_g->memmodel) == MM_TEXT;
+    u16 sstart = GET_GLOBAL(curmode_g->sstart);
+    u16 *dest_far = text ? text_address(cp) : NULL;
+    for (; count > 0; count--, cp.x++, str_far += step) {
+        u8 car = GET_FARVAR(seg, str_far[0]);
+        if (step == 2)
+            attr = GET_FARVAR(seg, str_far[1]);
+        if (text) {
+            SET_FARVAR(sstart, *dest_far, (attr << 8) | car);
+            dest_far++;
+        } else {
+            struct carattr ca = {car, attr, 1};
+            gfx_write_char(curmode_g, cp, ca);
+        }
+    }
+}
+
 // Return the character at the given position on the screen.
 struct carattr
 vgafb_read_char(struct cursorpos cp)
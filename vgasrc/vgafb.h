@@ -36,8 +36,16 @@ void *text_address(struct cursorpos cp);
 void vgafb_scroll(struct cursorpos win, struct cursorpos winsize
                   , int lines, struct carattr ca);
 void vgafb_write_char(struct cursorpos cp, struct carattr ca);
+void vgafb_write_chars(struct cursorpos cp, u16 seg, u8 *str_far, int step
+                       , u8 attr, int count);
 struct carattr vgafb_read_char(struct cursorpos cp);
+struct segoff_s get_font_data(u8 c);
 void vgafb_write_pixel(u8 color, u16 x, u16 y);
+extern u16 TextShadowSeg, TextShadowSize;
+void vgafb_text_shadow_cleared(void);
+void vgafb_text_shadow_reset(void);
+int vgafb_text_shadow_cell(struct cursorpos cp, u16 *cell);
+u32 vgafb_damage_setup(void);
 u8 vgafb_read_pixel(u16 x, u16 y);
 
 #endif // vgafb.h
@@ -157,4 +157,22 @@ static inline int vgahw_save_restore(int cmd, u16 seg, void *data) {
     return stdvga_save_restore(cmd, seg, data);
 }
 
+static inline int vgahw_gfx_accel(struct gfx_op *op, u32 color) {
+    if (CONFIG_VGA_CIRRUS)
+        return clext_gfx_accel(op, color);
+    return -1;
+}
+
+static inline int vgahw_scroll(struct vgamode_s *curmode_g, int lines) {
+    if (CONFIG_DISPLAY_BOCHS)
+        return bochs_display_scroll(curmode_g, lines);
+    return -1;
+}
+
+static inline int vgahw_pm_interface(void **table) {
+    if (CONFIG_VGA_BOCHS)
+        return bochsvga_pm_interface(table);
+    return 0;
+}
+
 #endif // vgahw.h
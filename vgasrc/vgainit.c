@@ -15,6 +15,7 @@
 #include "std/pmm.h" // struct pmmheader
 #include "string.h" // checksum_far
 #include "vgabios.h" // SET_VGA
+#include "vgafb.h" // TextShadowSeg
 #include "vgahw.h" // vgahw_setup
 #include "vgautil.h" // swcursor_check_event
 
@@ -99,6 +100,28 @@ allocate_extra_stack(void)
 }
 
 
+// Allocate the emulated text shadow sized for the text mode grid.
+static void
+allocate_text_shadow(void)
+{
+    if (!CONFIG_VGA_TEXT_SHADOW)
+        return;
+    struct vgamode_s *vmode_g = vgahw_find_mode(0x03);
+    if (!vmode_g || GET_GLOBAL(vmode_g->memmodel) == MM_TEXT)
+        return;
+    u32 cells = ((GET_GLOBAL(vmode_g->width) / GET_GLOBAL(vmode_g->cwidth))
+                 * (GET_GLOBAL(vmode_g->height) / GET_GLOBAL(vmode_g->cheight)));
+    if (!cells || cells > 0xffff)
+        return;
+    u32 res = allocate_pmm(ALIGN(8 + cells * 2, 16), 0, 0);
+    if (!res)
+        return;
+    dprintf(1, "VGA text shadow (%u cells) allocated at %x\n", cells, res);
+    SET_VGA(TextShadowSeg, res >> 4);
+    SET_VGA(TextShadowSize, cells);
+}
+
+
 /****************************************************************
  * Timer hook
  ****************************************************************/
@@ -181,6 +204,8 @@ vga_post(struct bregs *regs)
 
     init_bios_area();
 
+    vbe_setup();
+
     if (CONFIG_VGA_STDVGA_PORTS)
         stdvga_build_video_param();
 
@@ -189,8 +214,16 @@ vga_post(struct bregs *regs)
 
     allocate_extra_stack();
 
+    allocate_text_shadow();
+
+    swcursor_setup();
+
+    vgafb_damage_setup();
+
     hook_timer_irq();
 
+    // Runtime callers may be in real mode - use the vga ports from now on
+    SET_VGA(VgaMmio, 0);
     SET_VGA(HaveRunInit, 1);
 
     // Fixup checksum
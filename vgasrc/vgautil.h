@@ -22,6 +22,9 @@ void cbvga_setup_modes(u64 addr, u8 bpp, u32 xlines, u32 ylines, u32 linelength)
 int cbvga_setup(void);
 
 // bochsdisplay.c
+int bochs_display_get_displaystart(struct vgamode_s *curmode_g);
+int bochs_display_set_displaystart(struct vgamode_s *curmode_g, int val);
+int bochs_display_scroll(struct vgamode_s *curmode_g, int lines);
 int bochs_display_setup(void);
 
 // ramfb.c
@@ -38,6 +41,8 @@ int clext_get_displaystart(struct vgamode_s *curmode_g);
 int clext_set_displaystart(struct vgamode_s *curmode_g, int val);
 int clext_save_restore(int cmd, u16 seg, void *data);
 int clext_set_mode(struct vgamode_s *vmode_g, int flags);
+struct gfx_op;
+int clext_gfx_accel(struct gfx_op *op, u32 color);
 struct bregs;
 void clext_1012(struct bregs *regs);
 int clext_setup(void);
@@ -59,6 +64,7 @@ void stdvga_set_packed_palette(void);
 // swcursor.c
 void swcursor_pre_handle10(struct bregs *regs);
 void swcursor_check_event(void);
+void swcursor_setup(void);
 
 // vbe.c
 extern u32 VBE_total_memory;
@@ -66,6 +72,7 @@ extern u32 VBE_capabilities;
 extern u32 VBE_framebuffer;
 extern u16 VBE_win_granularity;
 extern u8 VBE_edid[256];
+void vbe_setup(void);
 void handle_104f(struct bregs *regs);
 
 // vgafonts.c